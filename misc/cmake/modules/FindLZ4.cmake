@@ -0,0 +1,29 @@
+#
+# Find LZ4 library
+#
+
+find_library (
+  LZ4_LIBRARIES
+  NAMES lz4
+  HINTS "$ENV{LZ4_DIR}/lib"
+  PATHS ENV LD_LIBRARY_PATH
+  )
+
+find_path (
+  LZ4_INCLUDE_DIR
+  NAMES lz4.h lz4hc.h
+  HINTS "$ENV{LZ4_DIR}/include"
+  )
+
+include (FindPackageHandleStandardArgs)
+find_package_handle_standard_args (
+  lz4
+  DEFAULT_MSG
+  LZ4_INCLUDE_DIR
+  LZ4_LIBRARIES
+  )
+
+mark_as_advanced (
+  LZ4_INCLUDE_DIR
+  LZ4_LIBRARIES
+  )
@@ -0,0 +1,29 @@
+#
+# Find Zstandard library
+#
+
+find_library (
+  ZSTD_LIBRARIES
+  NAMES zstd
+  HINTS "$ENV{ZSTD_DIR}/lib"
+  PATHS ENV LD_LIBRARY_PATH
+  )
+
+find_path (
+  ZSTD_INCLUDE_DIR
+  NAMES zstd.h
+  HINTS "$ENV{ZSTD_DIR}/include"
+  )
+
+include (FindPackageHandleStandardArgs)
+find_package_handle_standard_args (
+  zstd
+  DEFAULT_MSG
+  ZSTD_INCLUDE_DIR
+  ZSTD_LIBRARIES
+  )
+
+mark_as_advanced (
+  ZSTD_INCLUDE_DIR
+  ZSTD_LIBRARIES
+  )
@@ -0,0 +1,162 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "bench_backend.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <boost/foreach.hpp>
+
+// ベンチマーク用ファイル操作バックエンド
+namespace cbb {
+
+#define BENCH_FILE_MODE  (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+#define BENCH_DIR_MODE   (S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH)
+
+/**
+ * @breaf システムコールの戻り値をError値に変換 (perrorを出さない)
+ * @param result システムコールの戻り値
+ * @return Error値
+ */
+static Error bench_error(int result) {
+  return result < 0 ? -errno: kCBBSuccess;
+}
+
+/**
+ * @breaf ディレクトリエントリ数 ("." と ".." を除く)
+ * @param file_stats エントリ一覧
+ * @return エントリ数
+ */
+static size_t count_entries(const FileStats &file_stats) {
+  size_t count = 0;
+  BOOST_FOREACH(const FileStats::value_type &entry, file_stats) {
+    if (entry.first != "." && entry.first != "..") {
+      count++;
+    }
+  }
+  return count;
+}
+
+
+Error ClientBenchBackend::MkDir(const std::string &path) {
+  return client_.MkDir(path.c_str(), BENCH_DIR_MODE);
+}
+
+Error ClientBenchBackend::RmDir(const std::string &path) {
+  return client_.RmDir(path.c_str());
+}
+
+Error ClientBenchBackend::Create(const std::string &path, BenchFile *file_ptr) {
+  return client_.Create(path.c_str(), O_CREAT | O_RDWR | O_TRUNC, BENCH_FILE_MODE, &file_ptr->file);
+}
+
+Error ClientBenchBackend::Open(const std::string &path, int flags, BenchFile *file_ptr) {
+  return client_.Open(path.c_str(), flags, &file_ptr->file);
+}
+
+Error ClientBenchBackend::Read(BenchFile &file, char *buf, size_t size, off_t offset, ssize_t *ssize_ptr) {
+  return client_.Read(file.file, buf, size, offset, ssize_ptr);
+}
+
+Error ClientBenchBackend::Write(BenchFile &file, const char *buf, size_t size, off_t offset, ssize_t *ssize_ptr) {
+  return client_.Write(file.file, buf, size, offset, ssize_ptr);
+}
+
+Error ClientBenchBackend::Close(BenchFile &file) {
+  return client_.Release(file.file);
+}
+
+Error ClientBenchBackend::Stat(const std::string &path) {
+  FileStat file_stat;
+  return client_.GetAttr(path.c_str(), &file_stat);
+}
+
+Error ClientBenchBackend::ReadDir(const std::string &path, size_t *count_ptr) {
+  FileStats file_stats;
+  Error error = client_.ReadDir(path.c_str(), 0, &file_stats, kDirAll);
+  *count_ptr = count_entries(file_stats);
+  return error;
+}
+
+Error ClientBenchBackend::Unlink(const std::string &path) {
+  return client_.Unlink(path.c_str());
+}
+
+
+Error PosixBenchBackend::MkDir(const std::string &path) {
+  return bench_error(mkdir((mount_path_ + path).c_str(), BENCH_DIR_MODE));
+}
+
+Error PosixBenchBackend::RmDir(const std::string &path) {
+  return bench_error(rmdir((mount_path_ + path).c_str()));
+}
+
+Error PosixBenchBackend::Create(const std::string &path, BenchFile *file_ptr) {
+  file_ptr->fd = open((mount_path_ + path).c_str(), O_CREAT | O_RDWR | O_TRUNC, BENCH_FILE_MODE);
+  return bench_error(file_ptr->fd);
+}
+
+Error PosixBenchBackend::Open(const std::string &path, int flags, BenchFile *file_ptr) {
+  file_ptr->fd = open((mount_path_ + path).c_str(), flags);
+  return bench_error(file_ptr->fd);
+}
+
+Error PosixBenchBackend::Read(BenchFile &file, char *buf, size_t size, off_t offset, ssize_t *ssize_ptr) {
+  *ssize_ptr = pread(file.fd, buf, size, offset);
+  return bench_error(*ssize_ptr);
+}
+
+Error PosixBenchBackend::Write(BenchFile &file, const char *buf, size_t size, off_t offset, ssize_t *ssize_ptr) {
+  *ssize_ptr = pwrite(file.fd, buf, size, offset);
+  return bench_error(*ssize_ptr);
+}
+
+Error PosixBenchBackend::Close(BenchFile &file) {
+  return bench_error(close(file.fd));
+}
+
+Error PosixBenchBackend::Stat(const std::string &path) {
+  struct stat st;
+  return bench_error(lstat((mount_path_ + path).c_str(), &st));
+}
+
+Error PosixBenchBackend::ReadDir(const std::string &path, size_t *count_ptr) {
+  *count_ptr = 0;
+
+  DIR *dir = opendir((mount_path_ + path).c_str());
+  if (dir == NULL) {
+    return -errno;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) {
+      (*count_ptr)++;
+    }
+  }
+  closedir(dir);
+
+  return kCBBSuccess;
+}
+
+Error PosixBenchBackend::Unlink(const std::string &path) {
+  return bench_error(unlink((mount_path_ + path).c_str()));
+}
+
+} // namespace cbb
@@ -0,0 +1,112 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef CBB_BENCH_BENCH_BACKEND_H_
+#define CBB_BENCH_BENCH_BACKEND_H_
+
+#include <sys/types.h>
+
+#include <string>
+
+#include "common/error.h"
+#include "cbb/burst_buffer_client.h"
+
+namespace cbb {
+
+/// ベンチマーク中のオープン済みファイル
+struct BenchFile {
+  File file;  // BurstBufferClient用
+  int fd;     // POSIX用
+};
+
+// ベンチマーク対象のファイル操作インターフェース
+class BenchBackend {
+
+ public:
+
+  virtual ~BenchBackend() {}
+
+  virtual const char *name() const = 0;
+
+  virtual Error MkDir(const std::string &path) = 0;
+  virtual Error RmDir(const std::string &path) = 0;
+  virtual Error Create(const std::string &path, BenchFile *file_ptr) = 0;
+  virtual Error Open(const std::string &path, int flags, BenchFile *file_ptr) = 0;
+  virtual Error Read(BenchFile &file, char *buf, size_t size, off_t offset, ssize_t *ssize_ptr) = 0;
+  virtual Error Write(BenchFile &file, const char *buf, size_t size, off_t offset, ssize_t *ssize_ptr) = 0;
+  virtual Error Close(BenchFile &file) = 0;
+  virtual Error Stat(const std::string &path) = 0;
+  virtual Error ReadDir(const std::string &path, size_t *count_ptr) = 0;
+  virtual Error Unlink(const std::string &path) = 0;
+};
+
+// BurstBufferClientを直接呼び出すバックエンド
+class ClientBenchBackend : public BenchBackend {
+
+ public:
+
+  ClientBenchBackend() {}
+  virtual ~ClientBenchBackend() { client_.Destroy(); }
+
+  Error Init(const char *config_path) { return client_.Init(config_path); }
+  Error Init(const Settings &settings) { return client_.Init(settings); }
+
+  virtual const char *name() const { return "client"; }
+
+  virtual Error MkDir(const std::string &path);
+  virtual Error RmDir(const std::string &path);
+  virtual Error Create(const std::string &path, BenchFile *file_ptr);
+  virtual Error Open(const std::string &path, int flags, BenchFile *file_ptr);
+  virtual Error Read(BenchFile &file, char *buf, size_t size, off_t offset, ssize_t *ssize_ptr);
+  virtual Error Write(BenchFile &file, const char *buf, size_t size, off_t offset, ssize_t *ssize_ptr);
+  virtual Error Close(BenchFile &file);
+  virtual Error Stat(const std::string &path);
+  virtual Error ReadDir(const std::string &path, size_t *count_ptr);
+  virtual Error Unlink(const std::string &path);
+
+ private:
+
+  BurstBufferClient client_;
+};
+
+// FUSEマウント先をPOSIX APIで操作するバックエンド
+class PosixBenchBackend : public BenchBackend {
+
+ public:
+
+  PosixBenchBackend(const std::string &mount_path) : mount_path_(mount_path) {}
+  virtual ~PosixBenchBackend() {}
+
+  virtual const char *name() const { return "posix"; }
+
+  virtual Error MkDir(const std::string &path);
+  virtual Error RmDir(const std::string &path);
+  virtual Error Create(const std::string &path, BenchFile *file_ptr);
+  virtual Error Open(const std::string &path, int flags, BenchFile *file_ptr);
+  virtual Error Read(BenchFile &file, char *buf, size_t size, off_t offset, ssize_t *ssize_ptr);
+  virtual Error Write(BenchFile &file, const char *buf, size_t size, off_t offset, ssize_t *ssize_ptr);
+  virtual Error Close(BenchFile &file);
+  virtual Error Stat(const std::string &path);
+  virtual Error ReadDir(const std::string &path, size_t *count_ptr);
+  virtual Error Unlink(const std::string &path);
+
+ private:
+
+  std::string mount_path_;
+};
+
+} // namespace cbb
+
+#endif // CBB_BENCH_BENCH_BACKEND_H_
@@ -0,0 +1,296 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <string>
+
+#include "common/error.h"
+#include "common/common.h"
+#include "cbb/burst_buffer_client.h"
+#include "cbb/local_cluster.h"
+#include "cbb/server_stats.h"
+
+// サーバーのリクエスト処理のヒープ確保回数ベンチマーク
+//   1プロセス内のループバックのサーバー (LocalCluster) にクライアントから GetAttr / Read を送り、
+//   サーバーの dispatch (Execute) で処理中のメソッドごとに malloc 系の関数の呼び出し回数を数える。
+//   operator new、msgpack の zone のチャンク、Arena の溢れたブロック、O_DIRECT の整列バッファも malloc 系を通るため数える。
+//   io_ring の登録バッファ (AllocIoBuffer) は起動時に mmap した領域から取り出すためヒープ確保にならない。
+//   受信 (msgpack-rpc の受信バッファの取り出し) は対象外、返答の作成は対象に含む。
+//   返答の作成だけの確保回数の目安として、処理のない kHello も同じように測り、
+//   kHello より1回あたりの確保回数が多いメソッドがあれば失敗とする。
+
+#define CBB_ALLOC_BENCH_DESC \
+  "Usage: %s [options]\n" \
+  "  --count=N              iterations per phase (default 100000)\n" \
+  "  --path=PATH            file path in the request (default /alloc_bench_file)\n" \
+  "  --transfer=N           bytes per Read (default 4096)\n"
+
+#define ALLOC_BENCH_WARMUP 100  // 計測前に送る要求の数 (スレッドのアリーナ、fdキャッシュ等の初回の確保を除く)
+
+// glibc の確保関数の本体 (置き換えた malloc 系から呼ぶ)
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t align, size_t size);
+void __libc_free(void *ptr);
+}
+
+static uint64_t g_alloc_counts[cbb::kMsgPackCodeMax];  // メソッドごとの確保回数
+static __thread int tls_counting = 0;  // 数えている途中か (StatsScope::current の TLS 確保での再入を数えない)
+
+/**
+ * @breaf 確保回数の加算
+ *   サーバーの処理スレッドで処理中のメソッドだけ数える (クライアント、通信スレッドは数えない)
+ */
+static void CountAlloc() {
+  if (tls_counting) {
+    return;
+  }
+  tls_counting = 1;
+  cbb::StatsScope *scope = cbb::StatsScope::current();
+  if (scope != NULL && scope->code() >= 0 && scope->code() < cbb::kMsgPackCodeMax) {
+    __sync_add_and_fetch(&g_alloc_counts[scope->code()], 1);
+  }
+  tls_counting = 0;
+}
+
+// malloc 系の置き換え (operator new も libstdc++ の中でここを通る)
+extern "C" {
+
+void *malloc(size_t size) {
+  CountAlloc();
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  CountAlloc();
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  CountAlloc();
+  return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t align, size_t size) {
+  CountAlloc();
+  return __libc_memalign(align, size);
+}
+
+int posix_memalign(void **ptr_ptr, size_t align, size_t size) {
+  if (align < sizeof(void *) || (align & (align - 1)) != 0) {
+    return EINVAL;
+  }
+  CountAlloc();
+  void *ptr = __libc_memalign(align, size);
+  if (ptr == NULL) {
+    return ENOMEM;
+  }
+  *ptr_ptr = ptr;
+  return 0;
+}
+
+void free(void *ptr) {
+  __libc_free(ptr);
+}
+
+}
+
+/// フェーズごとの結果
+struct AllocResult {
+  const char *name;
+  uint64_t count;
+  uint64_t errors;
+  uint64_t allocs;
+  uint64_t elapsed_usec;
+};
+
+/// 計測する要求
+struct AllocTarget {
+  cbb::BurstBufferClient *client;
+  msgpack::rpc::client *rpc;
+  std::string path;
+  cbb::File file;
+  char *buf;
+  size_t transfer;
+};
+
+/**
+ * @breaf 1回分の要求の送信
+ * @param target 計測する要求
+ * @param code メソッドコード
+ * @return 成功したかどうか
+ */
+static bool Send(AllocTarget &target, int code) {
+  switch (code) {
+    case cbb::kHello: {
+      int version = target.rpc->call(static_cast<int>(cbb::kHello), CBB_PROTOCOL_VERSION).get<int>();
+      return version > 0;
+    }
+    case cbb::kGetAttr: {
+      cbb::FileStat file_stat;
+      return target.client->GetAttr(target.path.c_str(), &file_stat) == cbb::kCBBSuccess;
+    }
+    case cbb::kRead: {
+      ssize_t ssize = 0;
+      cbb::Error error = target.client->Read(target.file, target.buf, target.transfer, 0, &ssize);
+      return error == cbb::kCBBSuccess && ssize == (ssize_t)target.transfer;
+    }
+  }
+  return false;
+}
+
+/**
+ * @breaf フェーズの計測
+ * @param target 計測する要求
+ * @param name フェーズ名
+ * @param code メソッドコード
+ * @param count 繰り返し回数
+ * @return 結果
+ */
+static AllocResult Run(AllocTarget &target, const char *name, int code, uint64_t count) {
+  AllocResult result = { name, count, 0, 0, 0 };
+
+  for (int index = 0; index < ALLOC_BENCH_WARMUP; index++) {
+    Send(target, code);
+  }
+
+  uint64_t allocs = __sync_add_and_fetch(&g_alloc_counts[code], 0);
+  uint64_t start = cbb::get_time_usec();
+  for (uint64_t index = 0; index < count; index++) {
+    if (!Send(target, code)) {
+      result.errors++;
+    }
+  }
+  result.elapsed_usec = cbb::get_time_usec() - start;
+  result.allocs = __sync_add_and_fetch(&g_alloc_counts[code], 0) - allocs;
+  return result;
+}
+
+/**
+ * @breaf 結果の表示
+ * @param result 結果
+ * @param baseline 返答の作成だけの結果 (kHello)
+ */
+static void PrintResult(const AllocResult &result, const AllocResult &baseline) {
+  double allocs = (double)result.allocs / result.count;
+  double reply_allocs = (double)baseline.allocs / baseline.count;
+  printf("%-8s count:%llu  errors:%llu  allocs/op:%.3f  (hello +%.3f)  usec/op:%.3f\n", result.name,
+         (unsigned long long)result.count, (unsigned long long)result.errors,
+         allocs, allocs - reply_allocs, (double)result.elapsed_usec / result.count);
+}
+
+/**
+ * @breaf cbb_alloc_bench メイン
+ * @param argc 引数個数
+ * @param argv 引数値
+ * @return 処理結果 (エラー、または kHello より確保回数の多いメソッドがあった場合は -1)
+ */
+int main(int argc, char *argv[]) {
+  uint64_t count = 100000;
+  std::string path = "/alloc_bench_file";
+  size_t transfer = 4096;
+
+  for (int index = 1; index < argc; index++) {
+    const char *arg = argv[index];
+    bool is_valid = true;
+    if (!strncmp(arg, "--count=", 8)) {
+      count = strtoull(&arg[8], NULL, 10);
+      is_valid = count > 0;
+    } else if (!strncmp(arg, "--path=", 7)) {
+      path = &arg[7];
+      is_valid = path.size() > 1 && path[0] == '/' && path.find('/', 1) == std::string::npos;
+    } else if (!strncmp(arg, "--transfer=", 11)) {
+      transfer = strtoul(&arg[11], NULL, 10);
+      is_valid = transfer > 0;
+    } else {
+      is_valid = false;
+    }
+
+    if (!is_valid) {
+      printf(CBB_ALLOC_BENCH_DESC, argv[0]);
+      return -1;
+    }
+  }
+
+  // 計測対象外の準備 (サーバーの起動、ファイルの作成)
+  cbb::LocalCluster cluster;
+  cbb::Error error = cluster.Start(1);
+  if (error != cbb::kCBBSuccess) {
+    printf("cluster start error : %d\n", error);
+    return -1;
+  }
+
+  // 共有メモリ通信路は Read の処理を通らないため、TCPで送る
+  cbb::Settings settings = cluster.client_settings();
+  settings.set_client_shared_memory(false);
+  cbb::BurstBufferClient client;
+  if (client.Init(settings) != cbb::kCBBSuccess) {
+    printf("client init error\n");
+    return -1;
+  }
+
+  AllocTarget target;
+  target.client = &client;
+  target.path = path;
+  target.transfer = transfer;
+  target.buf = (char *)malloc(transfer);
+  memset(target.buf, 'x', transfer);
+
+  ssize_t ssize = 0;
+  if (client.Create(path.c_str(), O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR, &target.file) != cbb::kCBBSuccess ||
+      client.Write(target.file, target.buf, transfer, 0, &ssize) != cbb::kCBBSuccess ||
+      client.Release(target.file) != cbb::kCBBSuccess ||
+      client.Open(path.c_str(), O_RDONLY, &target.file) != cbb::kCBBSuccess) {
+    printf("file create error : %s\n", path.c_str());
+    return -1;
+  }
+
+  cbb::ServerInfo info = client.server_list().front();
+  msgpack::rpc::client rpc(info.host, info.port);
+  target.rpc = &rpc;
+
+  AllocResult results[3];
+  results[0] = Run(target, "hello", cbb::kHello, count);
+  results[1] = Run(target, "getattr", cbb::kGetAttr, count);
+  results[2] = Run(target, "read", cbb::kRead, count);
+
+  int result = 0;
+  for (int index = 0; index < 3; index++) {
+    PrintResult(results[index], results[0]);
+    if (results[index].errors > 0) {
+      result = -1;
+    }
+    // 1回あたりの確保回数が kHello を超える (処理の中で確保している)
+    if (results[index].allocs * results[0].count > results[0].allocs * results[index].count) {
+      printf("%s allocates beyond the reply baseline\n", results[index].name);
+      result = -1;
+    }
+  }
+
+  client.Release(target.file);
+  client.Unlink(path.c_str());
+  client.Destroy();
+  free(target.buf);
+
+  return result;
+}
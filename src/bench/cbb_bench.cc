@@ -0,0 +1,590 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <boost/format.hpp>
+
+#include "common/error.h"
+#include "common/common.h"
+#include "util/histogram.h"
+#include "cbb/local_cluster.h"
+#include "bench_backend.h"
+
+// CBBベンチマークコマンド
+//   メタデータ性能 (mdtest相当): create / stat / readdir / unlink
+//   ストリーミングI/O性能 (IOR相当): write / read を N-N (スレッドごとのファイル)
+//   または N-1 (共有ファイル) で、シーケンシャルまたはランダムに実行する
+
+#define CBB_BENCH_DESC \
+  "Usage: %s [options]\n" \
+  "  --option=PATH          load client setting file path\n" \
+  "  --mount=DIR            run through a FUSE mount point instead of the client library\n" \
+  "  --cluster=N            start N servers in this process on loopback ports\n" \
+  "  --dir=PATH             benchmark directory in the file system (default /cbb_bench)\n" \
+  "  --threads=N            number of threads (default 1)\n" \
+  "  --files=M              files per thread for metadata phases (default 1000)\n" \
+  "  --phases=LIST          comma separated phases (default create,stat,readdir,unlink,write,read)\n" \
+  "  --layout=nn|n1         N-N (file per thread) or N-1 (shared file) I/O (default nn)\n" \
+  "  --random               random transfer order for I/O phases\n" \
+  "  --block=SIZE           bytes per thread for I/O phases (default 64m)\n" \
+  "  --transfer=SIZE        bytes per I/O call (default 1m)\n" \
+  "  --seed=N               random seed (default 1)\n" \
+  "  --output=PATH          JSON result file (default stdout)\n" \
+  "  --keep                 keep benchmark files\n"
+
+enum BenchPhase {
+  kBenchCreate,
+  kBenchStat,
+  kBenchReadDir,
+  kBenchUnlink,
+  kBenchWrite,
+  kBenchRead,
+  kBenchPhaseMax
+};
+
+static const char *g_phase_names[] = {
+  "create",
+  "stat",
+  "readdir",
+  "unlink",
+  "write",
+  "read",
+};
+
+/// ベンチマーク設定
+struct BenchConfig {
+  std::string config_path;
+  std::string mount_path;
+  int cluster;
+  std::string dir;
+  int threads;
+  int files;
+  std::vector<int> phases;
+  bool is_shared;
+  bool is_random;
+  size_t block;
+  size_t transfer;
+  unsigned int seed;
+  std::string output_path;
+  bool is_keep;
+};
+
+/// フェーズごとの結果
+struct PhaseResult {
+  int phase;
+  uint64_t ops;
+  uint64_t errors;
+  uint64_t bytes;
+  uint64_t elapsed_usec;
+  cbb::Histogram *histogram;
+};
+
+/// ワーカースレッドの引数
+struct BenchWorker {
+  const BenchConfig *config;
+  cbb::BenchBackend *backend;
+  pthread_barrier_t *barrier;
+  int phase;
+  int rank;
+  uint64_t ops;
+  uint64_t errors;
+  uint64_t bytes;
+  uint64_t start_usec;
+  uint64_t end_usec;
+  cbb::Histogram *histogram;
+};
+
+/**
+ * @breaf サイズ指定の解析 (k, m, g の接尾辞を受け付ける)
+ * @param value 文字列
+ * @return バイト数 (不正な場合は0)
+ */
+static size_t ParseSize(const char *value) {
+  char *end = NULL;
+  unsigned long long size = strtoull(value, &end, 10);
+  switch (*end) {
+    case 'g': case 'G': size <<= 10;
+    case 'm': case 'M': size <<= 10;
+    case 'k': case 'K': size <<= 10; end++;
+    default: break;
+  }
+  return *end == '\0' ? (size_t)size: 0;
+}
+
+/**
+ * @breaf フェーズ一覧の解析
+ * @param value カンマ区切りのフェーズ名
+ * @param phases フェーズ一覧の保存先
+ * @return bool 解析結果
+ */
+static bool ParsePhases(const std::string &value, std::vector<int> *phases) {
+  phases->clear();
+  size_t pos = 0;
+  while (pos <= value.size()) {
+    size_t next = value.find(',', pos);
+    if (next == std::string::npos) {
+      next = value.size();
+    }
+    std::string name = value.substr(pos, next - pos);
+    int phase = 0;
+    while (phase < kBenchPhaseMax && name != g_phase_names[phase]) {
+      phase++;
+    }
+    if (phase == kBenchPhaseMax) {
+      return false;
+    }
+    phases->push_back(phase);
+    pos = next + 1;
+  }
+  return !phases->empty();
+}
+
+/**
+ * @breaf スレッドごとのディレクトリパス
+ */
+static std::string RankDir(const BenchConfig &config, int rank) {
+  return (boost::format("%1%/rank.%2%") % config.dir % rank).str();
+}
+
+/**
+ * @breaf I/Oフェーズのファイルパス
+ */
+static std::string DataPath(const BenchConfig &config, int rank) {
+  if (config.is_shared) {
+    return config.dir + "/shared.dat";
+  }
+  return RankDir(config, rank) + "/data.dat";
+}
+
+/**
+ * @breaf 1操作の結果を記録
+ * @param worker ワーカー
+ * @param start 開始時刻 (usec)
+ * @param error Error値
+ * @param bytes 転送バイト数
+ */
+static void RecordOp(BenchWorker *worker, uint64_t start, cbb::Error error, uint64_t bytes) {
+  worker->histogram->Record(cbb::get_time_usec() - start);
+  worker->ops++;
+  worker->bytes += bytes;
+  if (error != cbb::kCBBSuccess) {
+    worker->errors++;
+  }
+}
+
+/**
+ * @breaf メタデータフェーズ (create / stat / readdir / unlink)
+ * @param worker ワーカー
+ */
+static void RunMetaData(BenchWorker *worker) {
+  const BenchConfig &config = *worker->config;
+  std::string rank_dir = RankDir(config, worker->rank);
+
+  if (worker->phase == kBenchReadDir) {
+    size_t count = 0;
+    uint64_t start = cbb::get_time_usec();
+    cbb::Error error = worker->backend->ReadDir(rank_dir, &count);
+    RecordOp(worker, start, error, 0);
+    return;
+  }
+
+  for (int index = 0; index < config.files; index++) {
+    std::string path = (boost::format("%1%/file.%2%") % rank_dir % index).str();
+    uint64_t start = cbb::get_time_usec();
+    cbb::Error error = cbb::kCBBSuccess;
+
+    switch (worker->phase) {
+      case kBenchCreate: {
+        cbb::BenchFile file;
+        error = worker->backend->Create(path, &file);
+        if (error == cbb::kCBBSuccess) {
+          error = worker->backend->Close(file);
+        }
+        break;
+      }
+      case kBenchStat:
+        error = worker->backend->Stat(path);
+        break;
+      case kBenchUnlink:
+        error = worker->backend->Unlink(path);
+        break;
+    }
+    RecordOp(worker, start, error, 0);
+  }
+}
+
+/**
+ * @breaf I/Oフェーズ (write / read)
+ * @param worker ワーカー
+ */
+static void RunIO(BenchWorker *worker) {
+  const BenchConfig &config = *worker->config;
+  bool is_write = worker->phase == kBenchWrite;
+
+  // 転送順序 (ランダムの場合もシード固定で再現可能)
+  size_t count = config.block / config.transfer;
+  std::vector<size_t> order(count);
+  for (size_t index = 0; index < count; index++) {
+    order[index] = index;
+  }
+  if (config.is_random) {
+    unsigned int seed = config.seed + worker->rank;
+    for (size_t index = count; index > 1; index--) {
+      std::swap(order[index - 1], order[rand_r(&seed) % index]);
+    }
+  }
+
+  // N-1の場合はスレッドごとに連続した領域を担当する
+  off_t base = config.is_shared ? (off_t)config.block * worker->rank: 0;
+
+  std::vector<char> buf(config.transfer, (char)('a' + worker->rank % 26));
+
+  cbb::BenchFile file;
+  cbb::Error error = worker->backend->Open(DataPath(config, worker->rank), is_write ? O_WRONLY: O_RDONLY, &file);
+  if (error != cbb::kCBBSuccess) {
+    worker->errors++;
+    return;
+  }
+
+  for (size_t index = 0; index < count; index++) {
+    off_t offset = base + (off_t)(order[index] * config.transfer);
+    ssize_t ssize = 0;
+    uint64_t start = cbb::get_time_usec();
+    if (is_write) {
+      error = worker->backend->Write(file, &buf[0], config.transfer, offset, &ssize);
+    } else {
+      error = worker->backend->Read(file, &buf[0], config.transfer, offset, &ssize);
+    }
+    if (error == cbb::kCBBSuccess && ssize != (ssize_t)config.transfer) {
+      error = -EIO;
+    }
+    RecordOp(worker, start, error, ssize > 0 ? ssize: 0);
+  }
+
+  if (worker->backend->Close(file) != cbb::kCBBSuccess) {
+    worker->errors++;
+  }
+}
+
+/**
+ * @breaf ワーカースレッド
+ * @param arg ワーカー
+ */
+static void *WorkerMain(void *arg) {
+  BenchWorker *worker = (BenchWorker *)arg;
+
+  pthread_barrier_wait(worker->barrier);
+  worker->start_usec = cbb::get_time_usec();
+
+  if (worker->phase == kBenchWrite || worker->phase == kBenchRead) {
+    RunIO(worker);
+  } else {
+    RunMetaData(worker);
+  }
+
+  worker->end_usec = cbb::get_time_usec();
+  return NULL;
+}
+
+/**
+ * @breaf I/Oフェーズ用ファイルの準備 (計測対象外)
+ * @param config 設定
+ * @param backend バックエンド
+ * @return Error値
+ */
+static cbb::Error PrepareDataFiles(const BenchConfig &config, cbb::BenchBackend *backend) {
+  int files = config.is_shared ? 1: config.threads;
+  for (int rank = 0; rank < files; rank++) {
+    cbb::BenchFile file;
+    cbb::Error error = backend->Create(DataPath(config, rank), &file);
+    if (error != cbb::kCBBSuccess) {
+      return error;
+    }
+    backend->Close(file);
+  }
+  return cbb::kCBBSuccess;
+}
+
+/**
+ * @breaf 1フェーズの実行
+ * @param config 設定
+ * @param backend バックエンド
+ * @param phase フェーズ
+ * @return フェーズ結果
+ */
+static PhaseResult RunPhase(const BenchConfig &config, cbb::BenchBackend *backend, int phase) {
+  PhaseResult result;
+  result.phase = phase;
+  result.ops = 0;
+  result.errors = 0;
+  result.bytes = 0;
+  result.histogram = new cbb::Histogram();
+
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, NULL, config.threads);
+
+  std::vector<BenchWorker> workers(config.threads);
+  std::vector<pthread_t> threads(config.threads);
+  for (int rank = 0; rank < config.threads; rank++) {
+    BenchWorker &worker = workers[rank];
+    worker.config = &config;
+    worker.backend = backend;
+    worker.barrier = &barrier;
+    worker.phase = phase;
+    worker.rank = rank;
+    worker.ops = 0;
+    worker.errors = 0;
+    worker.bytes = 0;
+    worker.histogram = result.histogram;
+    pthread_create(&threads[rank], NULL, WorkerMain, &worker);
+  }
+
+  // 最初のスレッドの開始から最後のスレッドの終了までを計測時間とする
+  uint64_t start = ~(uint64_t)0;
+  uint64_t end = 0;
+  for (int rank = 0; rank < config.threads; rank++) {
+    pthread_join(threads[rank], NULL);
+    result.ops += workers[rank].ops;
+    result.errors += workers[rank].errors;
+    result.bytes += workers[rank].bytes;
+    start = std::min(start, workers[rank].start_usec);
+    end = std::max(end, workers[rank].end_usec);
+  }
+
+  result.elapsed_usec = end - start;
+  pthread_barrier_destroy(&barrier);
+
+  return result;
+}
+
+/**
+ * @breaf 結果をJSONで出力
+ * @param fp 出力先
+ * @param config 設定
+ * @param backend バックエンド
+ * @param results フェーズ結果
+ */
+static void WriteJson(FILE *fp, const BenchConfig &config, cbb::BenchBackend *backend, const std::vector<PhaseResult> &results) {
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"config\": {\"backend\": \"%s\", \"cluster\": %d, \"threads\": %d, \"files\": %d, \"layout\": \"%s\", "
+          "\"access\": \"%s\", \"block\": %lu, \"transfer\": %lu, \"seed\": %u},\n",
+          backend->name(), config.cluster, config.threads, config.files,
+          config.is_shared ? "n1": "nn", config.is_random ? "random": "sequential",
+          (unsigned long)config.block, (unsigned long)config.transfer, config.seed);
+  fprintf(fp, "  \"phases\": [\n");
+
+  for (size_t index = 0; index < results.size(); index++) {
+    const PhaseResult &result = results[index];
+    const cbb::Histogram &histogram = *result.histogram;
+    double seconds = result.elapsed_usec / 1000000.0;
+
+    fprintf(fp, "    {\"name\": \"%s\", \"ops\": %lu, \"errors\": %lu, \"bytes\": %lu, \"elapsed_usec\": %lu, "
+            "\"ops_per_sec\": %.1f, \"mib_per_sec\": %.2f,\n",
+            g_phase_names[result.phase],
+            (unsigned long)result.ops, (unsigned long)result.errors,
+            (unsigned long)result.bytes, (unsigned long)result.elapsed_usec,
+            seconds > 0 ? result.ops / seconds: 0.0,
+            seconds > 0 ? result.bytes / seconds / (1024 * 1024): 0.0);
+    fprintf(fp, "     \"latency_usec\": {\"avg\": %lu, \"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}}%s\n",
+            (unsigned long)(histogram.count() ? histogram.sum() / histogram.count(): 0),
+            (unsigned long)histogram.Percentile(50.0),
+            (unsigned long)histogram.Percentile(90.0),
+            (unsigned long)histogram.Percentile(99.0),
+            (unsigned long)histogram.Percentile(99.9),
+            (unsigned long)histogram.max(),
+            index + 1 < results.size() ? ",": "");
+  }
+
+  fprintf(fp, "  ]\n");
+  fprintf(fp, "}\n");
+}
+
+/**
+ * @breaf cbb_bench メイン
+ * @param argc 引数個数
+ * @param argv 引数値
+ * @return 処理結果
+ */
+int main(int argc, char *argv[]) {
+  BenchConfig config;
+  config.config_path = CBB_CONFIG;
+  config.cluster = 0;
+  config.dir = "/cbb_bench";
+  config.threads = 1;
+  config.files = 1000;
+  ParsePhases("create,stat,readdir,unlink,write,read", &config.phases);
+  config.is_shared = false;
+  config.is_random = false;
+  config.block = 64 << 20;
+  config.transfer = 1 << 20;
+  config.seed = 1;
+  config.is_keep = false;
+
+  for (int index = 1; index < argc; index++) {
+    const char *arg = argv[index];
+    bool is_valid = true;
+    if (!strncmp(arg, "--option=", 9)) {
+      config.config_path = &arg[9];
+    } else if (!strncmp(arg, "--mount=", 8)) {
+      config.mount_path = &arg[8];
+    } else if (!strncmp(arg, "--cluster=", 10)) {
+      config.cluster = atoi(&arg[10]);
+      is_valid = config.cluster > 0;
+    } else if (!strncmp(arg, "--dir=", 6)) {
+      config.dir = &arg[6];
+    } else if (!strncmp(arg, "--threads=", 10)) {
+      config.threads = atoi(&arg[10]);
+      is_valid = config.threads > 0;
+    } else if (!strncmp(arg, "--files=", 8)) {
+      config.files = atoi(&arg[8]);
+      is_valid = config.files > 0;
+    } else if (!strncmp(arg, "--phases=", 9)) {
+      is_valid = ParsePhases(&arg[9], &config.phases);
+    } else if (!strncmp(arg, "--layout=", 9)) {
+      config.is_shared = !strcmp(&arg[9], "n1");
+      is_valid = config.is_shared || !strcmp(&arg[9], "nn");
+    } else if (!strcmp(arg, "--random")) {
+      config.is_random = true;
+    } else if (!strncmp(arg, "--block=", 8)) {
+      config.block = ParseSize(&arg[8]);
+      is_valid = config.block > 0;
+    } else if (!strncmp(arg, "--transfer=", 11)) {
+      config.transfer = ParseSize(&arg[11]);
+      is_valid = config.transfer > 0;
+    } else if (!strncmp(arg, "--seed=", 7)) {
+      config.seed = strtoul(&arg[7], NULL, 10);
+    } else if (!strncmp(arg, "--output=", 9)) {
+      config.output_path = &arg[9];
+    } else if (!strcmp(arg, "--keep")) {
+      config.is_keep = true;
+    } else {
+      is_valid = false;
+    }
+
+    if (!is_valid) {
+      printf(CBB_BENCH_DESC, argv[0]);
+      return -1;
+    }
+  }
+
+  if (config.transfer > config.block || config.block % config.transfer != 0) {
+    printf("block size must be a multiple of transfer size\n");
+    return -1;
+  }
+
+  // 設定ファイルなしで動かす場合は同一プロセス内にサーバーを起動する
+  cbb::LocalCluster cluster;
+  if (config.cluster > 0) {
+    cbb::Error error = cluster.Start(config.cluster);
+    if (error != cbb::kCBBSuccess) {
+      printf("local cluster start error : %d\n", error);
+      return -1;
+    }
+  }
+
+  cbb::BenchBackend *backend = NULL;
+  if (config.cluster > 0) {
+    cbb::ClientBenchBackend *client_backend = new cbb::ClientBenchBackend();
+    cbb::Error error = client_backend->Init(cluster.client_settings());
+    if (error != cbb::kCBBSuccess) {
+      printf("local cluster client init error : %d\n", error);
+      delete client_backend;
+      return -1;
+    }
+    backend = client_backend;
+  } else if (config.mount_path.empty()) {
+    cbb::ClientBenchBackend *client_backend = new cbb::ClientBenchBackend();
+    if (client_backend->Init(config.config_path.c_str()) != cbb::kCBBSuccess) {
+      printf("setting file load error : %s\n", config.config_path.c_str());
+      delete client_backend;
+      return -1;
+    }
+    backend = client_backend;
+  } else {
+    backend = new cbb::PosixBenchBackend(config.mount_path);
+  }
+
+  // 計測対象外の準備
+  backend->MkDir(config.dir);
+  for (int rank = 0; rank < config.threads; rank++) {
+    backend->MkDir(RankDir(config, rank));
+  }
+
+  std::vector<PhaseResult> results;
+  bool is_prepared = false;
+  for (size_t index = 0; index < config.phases.size(); index++) {
+    int phase = config.phases[index];
+    if ((phase == kBenchWrite || phase == kBenchRead) && !is_prepared) {
+      cbb::Error error = PrepareDataFiles(config, backend);
+      if (error != cbb::kCBBSuccess) {
+        printf("data file create error : %d\n", error);
+        break;
+      }
+      is_prepared = true;
+    }
+    results.push_back(RunPhase(config, backend, phase));
+  }
+
+  FILE *fp = stdout;
+  if (!config.output_path.empty()) {
+    fp = fopen(config.output_path.c_str(), "w");
+    if (fp == NULL) {
+      printf("output file open error : %s\n", config.output_path.c_str());
+      fp = stdout;
+    }
+  }
+  WriteJson(fp, config, backend, results);
+  if (fp != stdout) {
+    fclose(fp);
+  }
+
+  // 後始末 (unlinkフェーズを実行していない場合のメタデータファイルも削除する)
+  if (!config.is_keep) {
+    for (int rank = 0; rank < config.threads; rank++) {
+      std::string rank_dir = RankDir(config, rank);
+      for (int index = 0; index < config.files; index++) {
+        backend->Unlink((boost::format("%1%/file.%2%") % rank_dir % index).str());
+      }
+      if (is_prepared && !config.is_shared) {
+        backend->Unlink(DataPath(config, rank));
+      }
+      backend->RmDir(rank_dir);
+    }
+    if (is_prepared && config.is_shared) {
+      backend->Unlink(DataPath(config, 0));
+    }
+    backend->RmDir(config.dir);
+  }
+
+  int result = 0;
+  for (size_t index = 0; index < results.size(); index++) {
+    if (results[index].errors > 0) {
+      result = -1;
+    }
+    delete results[index].histogram;
+  }
+  delete backend;
+
+  return result;
+}
@@ -0,0 +1,247 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "common/common.h"
+#include "util/compressor.h"
+
+// 通信データの圧縮ベンチマーク
+//   圧縮が効くデータ (CSV、テキスト) と効かないデータ (乱数) を読み書き1回分の大きさに区切り、
+//   クライアントと同じ手順 (ShouldCompress → Compress → Decompress) で圧縮率と速度を測る。
+//   乱数のデータでは圧縮を見送った回数 (skipped) で圧縮の試行がどれだけ減るかを確認する。
+
+#define CBB_COMPRESS_BENCH_DESC \
+  "Usage: %s [options]\n" \
+  "  --type=TYPE            lz4 / zstd / all (default all)\n" \
+  "  --level=N              compression level (default 0)\n" \
+  "  --transfer=N           bytes per transfer (default 131072)\n" \
+  "  --total=N              bytes per data set (default 268435456)\n"
+
+/// データの種類ごとの結果
+struct CompressResult {
+  const char *data;
+  uint64_t count;
+  uint64_t compressed;   // 圧縮を送ったデータ数
+  uint64_t skipped;      // 圧縮を見送ったデータ数 (効かなかった後の見送りを含む)
+  uint64_t in_bytes;
+  uint64_t tried_bytes;  // 圧縮を試みたサイズ (圧縮速度の計算に使う)
+  uint64_t out_bytes;    // 送るサイズ (圧縮しなかったデータは元のサイズ)
+  uint64_t compress_usec;
+  uint64_t decompress_usec;
+  uint64_t errors;
+};
+
+/**
+ * @breaf CSV 形式のデータ生成 (数値の列が並ぶ計測ログを模す)
+ * @param buf 保存先
+ * @param size サイズ
+ */
+static void FillCsv(char *buf, size_t size) {
+  unsigned int seed = 1;
+  size_t pos = 0;
+  uint64_t row = 0;
+  while (pos < size) {
+    char line[128];
+    int length = snprintf(line, sizeof(line), "%llu,node%03d,%d.%03d,%d,OK\n", (unsigned long long)row++,
+                          rand_r(&seed) % 64, rand_r(&seed) % 100, rand_r(&seed) % 1000, rand_r(&seed) % 16);
+    size_t copy = std::min((size_t)length, size - pos);
+    memcpy(buf + pos, line, copy);
+    pos += copy;
+  }
+}
+
+/**
+ * @breaf テキストのデータ生成 (少ない語彙の単語を並べる)
+ * @param buf 保存先
+ * @param size サイズ
+ */
+static void FillText(char *buf, size_t size) {
+  static const char *words[] = {
+    "burst", "buffer", "local", "secondary", "storage", "file", "server", "client",
+    "read", "write", "the", "a", "of", "to", "and", "is", "data", "export",
+  };
+  unsigned int seed = 2;
+  size_t pos = 0;
+  while (pos < size) {
+    const char *word = words[rand_r(&seed) % (sizeof(words) / sizeof(words[0]))];
+    size_t length = strlen(word);
+    for (size_t index = 0; index <= length && pos < size; index++) {
+      buf[pos++] = index < length ? word[index]: (rand_r(&seed) % 12 == 0 ? '\n': ' ');
+    }
+  }
+}
+
+/**
+ * @breaf 乱数のデータ生成 (圧縮済みのファイル、暗号化されたファイルを模す)
+ * @param buf 保存先
+ * @param size サイズ
+ */
+static void FillRandom(char *buf, size_t size) {
+  unsigned int seed = 3;
+  for (size_t index = 0; index < size; index++) {
+    buf[index] = (char)(rand_r(&seed) >> 7);
+  }
+}
+
+/**
+ * @breaf 1種類のデータの計測
+ * @param type 圧縮方式
+ * @param level 圧縮レベル
+ * @param name データの種類名
+ * @param data データ
+ * @param total データサイズ
+ * @param transfer 1回の読み書きサイズ
+ * @return 結果
+ */
+static CompressResult Run(int type, int level, const char *name, const char *data, size_t total, size_t transfer) {
+  CompressResult result = { name, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+  cbb::Compressor compressor;
+  compressor.Init(type, level, COMPRESS_MIN_SIZE);
+
+  std::vector<char> cbuf(cbb::Compressor::Bound(type, transfer));
+  std::vector<char> dbuf(transfer);
+
+  for (size_t offset = 0; offset + transfer <= total; offset += transfer) {
+    const char *src = data + offset;
+    result.count++;
+    result.in_bytes += transfer;
+
+    if (!compressor.ShouldCompress(transfer)) {
+      result.skipped++;
+      result.out_bytes += transfer;
+      continue;
+    }
+
+    result.tried_bytes += transfer;
+    uint64_t start = cbb::get_time_usec();
+    ssize_t csize = compressor.Compress(src, transfer, &cbuf[0], cbuf.size());
+    result.compress_usec += cbb::get_time_usec() - start;
+    if (csize < 0) {
+      result.skipped++;
+      result.out_bytes += transfer;
+      continue;
+    }
+
+    start = cbb::get_time_usec();
+    ssize_t dsize = cbb::Compressor::Decompress(type, &cbuf[0], csize, &dbuf[0], dbuf.size());
+    result.decompress_usec += cbb::get_time_usec() - start;
+    if (dsize != (ssize_t)transfer || memcmp(&dbuf[0], src, transfer) != 0) {
+      result.errors++;
+    }
+    result.compressed++;
+    result.out_bytes += csize;
+  }
+  return result;
+}
+
+/**
+ * @breaf 結果の表示
+ * @param type 圧縮方式
+ * @param result 結果
+ */
+static void PrintResult(int type, const CompressResult &result) {
+  double tried_mb = (double)result.tried_bytes / (1 << 20);
+  double compressed_mb = result.count > 0 ? (double)result.in_bytes / result.count * result.compressed / (1 << 20): 0.0;
+  printf("%-5s %-7s count:%llu  compressed:%llu  skipped:%llu  ratio:%.3f  compress:%.1fMB/s  decompress:%.1fMB/s  errors:%llu\n",
+         cbb::Compressor::name(type), result.data, (unsigned long long)result.count,
+         (unsigned long long)result.compressed, (unsigned long long)result.skipped,
+         (double)result.out_bytes / result.in_bytes,
+         result.compress_usec > 0 ? tried_mb * 1000000 / result.compress_usec: 0.0,
+         result.decompress_usec > 0 ? compressed_mb * 1000000 / result.decompress_usec: 0.0,
+         (unsigned long long)result.errors);
+}
+
+/**
+ * @breaf cbb_compress_bench メイン
+ * @param argc 引数個数
+ * @param argv 引数値
+ * @return 処理結果 (展開結果が一致しなかった場合は -1)
+ */
+int main(int argc, char *argv[]) {
+  std::string type_name = "all";
+  int level = 0;
+  size_t transfer = 128 * 1024;
+  size_t total = 256 * 1024 * 1024;
+
+  for (int index = 1; index < argc; index++) {
+    const char *arg = argv[index];
+    bool is_valid = true;
+    if (!strncmp(arg, "--type=", 7)) {
+      type_name = &arg[7];
+      is_valid = type_name == "all" || cbb::Compressor::Parse(type_name) > cbb::kCompressNone;
+    } else if (!strncmp(arg, "--level=", 8)) {
+      level = atoi(&arg[8]);
+    } else if (!strncmp(arg, "--transfer=", 11)) {
+      transfer = strtoul(&arg[11], NULL, 10);
+      is_valid = transfer > 0;
+    } else if (!strncmp(arg, "--total=", 8)) {
+      total = strtoull(&arg[8], NULL, 10);
+      is_valid = total > 0;
+    } else {
+      is_valid = false;
+    }
+
+    if (!is_valid) {
+      printf(CBB_COMPRESS_BENCH_DESC, argv[0]);
+      return -1;
+    }
+  }
+  total = std::max(total, transfer);
+
+  std::vector<int> types;
+  for (int type = cbb::kCompressNone + 1; type < cbb::kCompressTypeMax; type++) {
+    if ((type_name == "all" || cbb::Compressor::Parse(type_name) == type) && cbb::Compressor::is_supported(type)) {
+      types.push_back(type);
+    }
+  }
+  if (types.empty()) {
+    printf("compression is not supported : %s (build with LZ4 / Zstd)\n", type_name.c_str());
+    return -1;
+  }
+
+  char *data = (char *)malloc(total);
+  if (data == NULL) {
+    printf("memory allocation error : %llu\n", (unsigned long long)total);
+    return -1;
+  }
+
+  static const char *names[] = { "csv", "text", "random" };
+  int result = 0;
+  for (int kind = 0; kind < 3; kind++) {
+    switch (kind) {
+    case 0: FillCsv(data, total); break;
+    case 1: FillText(data, total); break;
+    default: FillRandom(data, total); break;
+    }
+    for (size_t index = 0; index < types.size(); index++) {
+      CompressResult compress_result = Run(types[index], level, names[kind], data, total, transfer);
+      PrintResult(types[index], compress_result);
+      if (compress_result.errors > 0) {
+        result = -1;
+      }
+    }
+  }
+
+  free(data);
+  return result;
+}
@@ -19,13 +19,22 @@
 #include <sys/types.h>
 #include <sys/xattr.h>
 #include <sys/file.h>
+#include <sys/statvfs.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <cstdio>
 #include <iostream>
 #include <cerrno>
 #include <cassert>
+#include <cstring>
+
+#include <algorithm>
+#include <new>
 
 #include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/format.hpp>
 
 #include "common/error.h"
 #include "common/common.h"
@@ -33,10 +42,289 @@
 #include "burst_buffer.h"
 #include "util/options.h"
 #include "util/settings.h"
+#include "util/file_control.h"
+#include "util/arena.h"
+#include "util/io_priority.h"
+#include "util/secondary_throttle.h"
 
 // CBBモジュール（サーバー側）のメイン処理クラス
 namespace cbb {
 
+/**
+ * @breaf エラー結果を統計情報に記録する
+ * @param error Error値
+ * @return Error値 (そのまま返す)
+ */
+static inline Error count_error(Error error) {
+  if (error < 0) {
+    StatsScope *scope = StatsScope::current();
+    if (scope != NULL) {
+      scope->set_error();
+    }
+  }
+  return error;
+}
+
+/**
+ * @breaf 構成の変更後に担当サーバーに転送するメソッドかどうか
+ *   パスだけで処理でき、ファイルディスクリプタを使わないメソッドが対象。
+ * @param code メソッドコード
+ * @return bool 転送対象かどうか
+ */
+static bool is_routed_method(int code) {
+  switch (code) {
+    case kGetAttr: case kReadLink: case kRename: case kChmod: case kChown: case kTruncate:
+    case kSetXAttr: case kGetXAttr: case kListXAttr: case kRemoveXAttr: case kAccess: case kUtimens:
+    case kFilePrevRead: case kFileFlush: case kGetStripe: case kPlacement: case kPlacementLookup:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// v1 のメソッド名 (CODE(kXxx)) をコードに変換する名前表 (名前順)
+class MethodNames {
+ public:
+  MethodNames() {
+    for (int code = kNone + 1; code < kMsgPackCodeMax; code++) {
+      codes_.push_back(code);
+    }
+    std::sort(codes_.begin(), codes_.end(), Less());
+  }
+
+  int Find(const char *ptr, size_t size) const {
+    size_t low = 0;
+    size_t high = codes_.size();
+    while (low < high) {
+      size_t middle = (low + high) / 2;
+      int result = compare(ServerStats::method_name(codes_[middle]), ptr, size);
+      if (result == 0) {
+        return codes_[middle];
+      } else if (result < 0) {
+        low = middle + 1;
+      } else {
+        high = middle;
+      }
+    }
+    return kNone;
+  }
+
+ private:
+  struct Less {
+    bool operator()(int left, int right) const {
+      return strcmp(ServerStats::method_name(left), ServerStats::method_name(right)) < 0;
+    }
+  };
+
+  static int compare(const char *name, const char *ptr, size_t size) {
+    size_t length = strlen(name);
+    int result = memcmp(name, ptr, std::min(length, size));
+    if (result != 0 || length == size) {
+      return result;
+    }
+    return length < size ? -1: 1;
+  }
+
+  std::vector<int> codes_;
+};
+
+/**
+ * @breaf メソッドコードの取得
+ *   v2 は整数のコードをそのまま使い、v1 はコード名の文字列を名前表から二分探索する。
+ * @param method メソッド
+ * @return コード (不明な場合は kNone)
+ */
+static int method_code(const msgpack::object &method) {
+  if (method.type == msgpack::type::POSITIVE_INTEGER) {
+    // 上位ビットはQoS分類
+    uint64_t code = method.via.u64 & CBB_QOS_CODE_MASK;
+    return code < kMsgPackCodeMax ? (int)code: kNone;
+  }
+  if (method.type != msgpack::type::RAW) {
+    return kNone;
+  }
+
+  static const MethodNames names;
+  return names.Find(method.via.raw.ptr, method.via.raw.size);
+}
+
+/**
+ * @breaf アプリケーションの読み書き (バックグラウンドのコピーより優先する) かどうか
+ * @param code メソッドコード
+ * @return bool フォアグラウンドの読み書きかどうか
+ */
+static bool is_foreground_method(int code) {
+  switch (code) {
+    case kRead: case kWrite: case kFSync: case kFlush: case kOpen: case kCreate:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/**
+ * @breaf 分類ごとのキューに入れるデータ転送要求の判定
+ *   メタデータ操作は受信スレッドでそのまま処理し、データ転送の待ちに巻き込まない。
+ * @param req MsgPackリクエストオブジェクト
+ * @param class_ptr QoS分類保存ポインタ (v2のメソッドコードの上位ビット、v1は分類なし)
+ * @param cost_ptr コスト (転送バイト数) 保存ポインタ
+ * @return bool キューに入れるかどうか
+ */
+static bool is_scheduled_request(msgpack::rpc::request &req, int *class_ptr, size_t *cost_ptr) {
+  msgpack::object method = req.method();
+  msgpack::object params = req.params();
+  int code = method_code(method);
+  bool is_v2 = method.type == msgpack::type::POSITIVE_INTEGER;
+
+  *class_ptr = is_v2 ? (int)(method.via.u64 >> CBB_QOS_CLASS_SHIFT): 0;
+  *cost_ptr = REQUEST_SCHEDULER_DEFAULT_COST;
+
+  if (params.type != msgpack::type::ARRAY) {
+    return false;
+  }
+  uint32_t count = params.via.array.size;
+  const msgpack::object *args = params.via.array.ptr;
+
+  // サイズのパラメータ (読み込みは要求サイズ、書き込みはデータのサイズ) をコストにする
+  uint32_t size_index = count;
+  switch (code) {
+    case kRead:
+      size_index = is_v2 ? 1: 2;
+      break;
+    case kMigrateRead:
+      size_index = 1;
+      break;
+    case kWrite:
+      for (uint32_t index = 0; index < count; index++) {
+        if (args[index].type == msgpack::type::RAW) {
+          *cost_ptr = args[index].via.raw.size;
+        }
+      }
+      break;
+    case kFSync: case kFilePrevRead: case kFileFlush: case kReplicate:
+      break;
+    default:
+      return false;
+  }
+
+  if (size_index < count && args[size_index].type == msgpack::type::POSITIVE_INTEGER) {
+    *cost_ptr = args[size_index].via.u64;
+  }
+  return true;
+}
+
+/**
+ * @breaf 受信バッファ上の文字列をスレッドのアリーナに複製する (dispatch の終わりまで有効)
+ * @param raw 受信バッファ上の文字列
+ * @return 終端文字付きの文字列 (確保できない場合は空文字列)
+ */
+static const char *arena_string(const msgpack::type::raw_ref &raw) {
+  const char *str = Arena::current()->Strndup(raw.ptr, raw.size);
+  return str != NULL ? str: "";
+}
+
+/**
+ * @breaf 省略可能な構成の版のパラメータ取得
+ *   構成の版を送らないクライアントは、常に最新の構成を使っているものとして扱う。
+ * @param params パラメータ
+ * @param index 構成の版の位置
+ * @return uint64_t 構成の版
+ */
+static uint64_t optional_epoch(const msgpack::object &params, size_t index) {
+  if (params.type != msgpack::type::ARRAY || params.via.array.size <= index) {
+    return MIGRATION_EPOCH_ANY;
+  }
+  return params.via.array.ptr[index].as<uint64_t>();
+}
+
+/**
+ * @breaf 省略可能な整数のパラメータ取得 (旧クライアントは送らない)
+ * @param params パラメータ
+ * @param index パラメータの位置
+ * @return 値 (省略された場合は 0)
+ */
+static uint64_t optional_uint(const msgpack::object &params, size_t index) {
+  if (params.type != msgpack::type::ARRAY || params.via.array.size <= index) {
+    return 0;
+  }
+  return params.via.array.ptr[index].as<uint64_t>();
+}
+
+/**
+ * @breaf ディレクトリの同期
+ * @param dirname 実ディレクトリパス
+ * @param datasync データのみ同期するかどうか
+ * @param is_syncfs ディレクトリのあるファイルシステム全体を同期するかどうか
+ * @return Error値 (ディレクトリがない場合は成功)
+ */
+static Error sync_directory(const std::string &dirname, int datasync, bool is_syncfs) {
+  int fd = open(dirname.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    return errno == ENOENT ? kCBBSuccess : -errno;
+  }
+
+  int result;
+  if (is_syncfs) {
+    result = syncfs(fd);
+  } else {
+    result = datasync ? fdatasync(fd) : fsync(fd);
+  }
+  Error error = result == 0 ? kCBBSuccess : -errno;
+
+  close(fd);
+  return error;
+}
+
+/**
+ * @breaf 登録バッファの返却 (返答の送信後にゾーンから呼ばれる)
+ * @param buf バッファ
+ */
+static void free_io_buffer(void *buf) {
+  FileControl::FreeIoBuffer(buf);
+}
+
+/**
+ * @breaf 要求のゾーンの取得 (読み込みデータの返答に引き渡す)
+ * @param req MsgPackリクエストオブジェクト
+ * @return ゾーン
+ */
+static msgpack::rpc::auto_zone &request_zone(msgpack::rpc::request &req) {
+  msgpack::rpc::auto_zone &life = req.zone();
+  if (life.get() == NULL) {
+    life.reset(new msgpack::zone());
+  }
+  return life;
+}
+
+/**
+ * @breaf 要求のゾーンへの文字列の複製 (完了通知まで使うパス)
+ * @param life ゾーン
+ * @param str 文字列
+ * @return 複製した文字列
+ */
+static const char *zone_strdup(msgpack::rpc::auto_zone &life, const char *str) {
+  size_t size = strlen(str) + 1;
+  char *ptr = (char*)life->malloc(size);
+  memcpy(ptr, str, size);
+  return ptr;
+}
+
+// io_uring に投入した読み書きの要求 (完了通知で返答する)
+//   領域は AllocAsyncIo / FreeAsyncIo で再利用する。
+struct BurstBuffer::AsyncIo {
+  AsyncIo(BurstBuffer *bb, msgpack::rpc::request req, const char *path, int fd, char *ptr, size_t size, off_t offset)
+      : bb(bb), req(req), path(path), fd(fd), ptr(ptr), size(size), offset(offset) {}
+
+  BurstBuffer *bb;
+  msgpack::rpc::request req;   // 読み込み先、書き込みデータ、パスは要求のゾーンにあるため、返答まで保持する
+  const char *path;
+  int fd;
+  char *ptr;
+  size_t size;
+  off_t offset;
+  StatsDeferred stats;         // 完了時に記録するメソッドごとの統計情報
+};
+
 /**
  * @breaf Constractor
  * @param local_storage_root_path ローカルストレージルートパス
@@ -44,31 +332,251 @@ namespace cbb {
  * @param interval_time ファイル監視時間間隔 (min)
  */
 BurstBuffer::BurstBuffer(std::string local_storage_root_path, std::string secondary_storage_root_path, int interval_time)
-    : md_manager_(local_storage_root_path, secondary_storage_root_path) {
+    : md_manager_(local_storage_root_path, secondary_storage_root_path), shm_sequence_(0), is_fsyncdir_syncfs_(false),
+      compression_level_(0), max_transfer_size_(BB_MAX_TRANSFER_SIZE), is_io_ring_(false), is_direct_io_(false), is_chunk_store_(false), is_device_stripe_(false), async_io_free_(NULL) {
+  shm_mutex_.Init();
+  async_io_mutex_.Init();
+  session_id_ = (uint32_t)(get_time_usec() ^ ((uint64_t)getpid() << 20));
+  if (session_id_ == 0) {
+    session_id_ = 1;
+  }
   DuplicateDirSecondaryToLocal(secondary_storage_root_path);
   lf_exporter_.Create(&md_manager_, interval_time * 60 * 1000);
+  replica_manager_.Create(&md_manager_);
+  placement_directory_.Open(md_manager_.local_path(PLACEMENT_FILE_NAME));
+  migration_manager_.Create(&md_manager_, &lf_exporter_, &placement_directory_);
 }
 
 /**
  * @breaf destructor
+ *   同じプロセスの他のサーバーも使う機能 (FileControl) は、このサーバーが有効にした分だけ無効にする。
  */
 BurstBuffer::~BurstBuffer() {
   DMSG("destructor : BurstBuffer::~BurstBuffer \n");
+  scheduler_.Stop();
+  md_manager_.secondary_throttle().Disable();
+  if (is_io_ring_) {
+    FileControl::DisableIoRing();
+  }
+  if (is_direct_io_) {
+    FileControl::DisableDirectIo();
+  }
   lf_exporter_.Release();
+  replica_manager_.Release();
+  migration_manager_.Release();
+
+  BOOST_FOREACH(ShmServer *shm_server, shm_servers_) {
+    delete shm_server;
+  }
+  shm_servers_.clear();
+  if (is_chunk_store_) {
+    FileControl::DisableChunkStore();
+  }
+  if (is_device_stripe_) {
+    FileControl::DisableDeviceStripe();
+  }
+
+  while (async_io_free_ != NULL) {
+    void *mem = async_io_free_;
+    async_io_free_ = *(void **)mem;
+    ::operator delete(mem);
+  }
+}
+
+/**
+ * @breaf ディレクトリ同期の方式の設定
+ * @param is_syncfs Localストレージのファイルシステム全体を syncfs で同期するかどうか
+ *   (ディレクトリ内のファイルのデータも永続化される。Secondaryは常にディレクトリだけを同期する)
+ */
+void BurstBuffer::SetFSyncDirPolicy(bool is_syncfs) {
+  is_fsyncdir_syncfs_ = is_syncfs;
+}
+
+/**
+ * @breaf fdキャッシュの設定
+ * @param cache_size 閉じずに再利用のため開いておく未使用fdの最大数 (0の場合はキャッシュしない)
+ */
+void BurstBuffer::SetFdCachePolicy(int cache_size) {
+  md_manager_.SetFdCachePolicy(cache_size);
+}
+
+/**
+ * @breaf ファイル読み書きの方式の設定 (ファイルを開く前に呼ぶ)
+ *   io_uring はプロセス全体で共有し、同じプロセスの他のサーバーが有効にしている場合はそのリングを使う。
+ * @param entries io_uring の投入リングの大きさ (0の場合、または io_uring が使えない場合は pread/pwrite)
+ * @return bool io_uring を使うかどうか
+ */
+bool BurstBuffer::SetIoPolicy(int entries) {
+  if (entries <= 0) {
+    if (is_io_ring_) {
+      FileControl::DisableIoRing();
+      is_io_ring_ = false;
+    }
+    return false;
+  }
+  if (!is_io_ring_) {
+    is_io_ring_ = FileControl::EnableIoRing(entries);
+  }
+  return is_io_ring_;
+}
+
+/**
+ * @breaf 直接I/Oの方式の設定 (ファイルを開く前に呼ぶ)
+ *   直接I/Oはプロセス全体で共有し、同じプロセスの他のサーバーが先に有効にしている場合はその設定を使う。
+ * @param threshold 直接I/Oにする1回の読み書きサイズ (0の場合は直接I/Oを使わない)
+ * @param buffer_count 境界に揃っていないバッファの読み書きに使う境界合わせバッファの数
+ * @return bool 直接I/Oを使うかどうか
+ */
+bool BurstBuffer::SetDirectIoPolicy(size_t threshold, int buffer_count) {
+  if (threshold == 0) {
+    if (is_direct_io_) {
+      FileControl::DisableDirectIo();
+      is_direct_io_ = false;
+    }
+    return false;
+  }
+  if (!is_direct_io_) {
+    is_direct_io_ = FileControl::EnableDirectIo(threshold, buffer_count);
+  }
+  return is_direct_io_;
+}
+
+/**
+ * @breaf 通信データの圧縮の設定 (圧縮方式はクライアントごとに kCompression で決める)
+ * @param level 読み込みデータを圧縮する場合の圧縮レベル (0の場合は方式の既定値)
+ * @param max_transfer_size 圧縮された書き込みを展開した後のサイズの上限
+ */
+void BurstBuffer::SetCompressionPolicy(int level, size_t max_transfer_size) {
+  compression_level_ = level;
+  max_transfer_size_ = max_transfer_size;
+}
+
+/**
+ * @breaf Localストレージの圧縮の設定 (ファイルを開く前に呼ぶ)
+ *   圧縮する場合は Localストレージのルートに記録を残し、kCompressNone でも記録がある場合は
+ *   既に圧縮形式で保存されたファイルを展開して読み書きする。記録がない場合は圧縮形式を有効にせず、
+ *   ファイルを開く、切り詰めるたびの拡張属性の確認を省く。
+ *   圧縮の設定はプロセス全体で共有し、同じプロセスの他のサーバーが先に設定している場合はそれを使う。
+ * @param type 新しく書くファイルの圧縮方式
+ * @param level 圧縮レベル (0の場合は方式の既定値)
+ * @param chunk_size 圧縮の単位 (ランダムな読み込みはこの単位で展開する)
+ * @return bool 圧縮方式を使えるかどうか
+ */
+bool BurstBuffer::SetLocalCompressionPolicy(int type, int level, size_t chunk_size) {
+  if (is_chunk_store_) {
+    FileControl::DisableChunkStore();
+    is_chunk_store_ = false;
+  }
+  const char *root = md_manager_.devices().root(0).c_str();
+  if (type == kCompressNone && !ChunkStore::is_marked(root)) {
+    return true;
+  }
+  is_chunk_store_ = true;
+  bool is_supported = FileControl::EnableChunkStore(type, level, chunk_size);
+  if (is_supported && type != kCompressNone && !ChunkStore::MarkStorage(root)) {
+    WMSG("cannot mark %s as compressed storage : %s\n", root, strerror(errno));
+  }
+  return is_supported;
+}
+
+/**
+ * @breaf Localストレージの複数デバイスの設定 (ファイルを開く前に呼ぶ)
+ *   通常ファイルは空き容量と開いているファイル数で選んだ1つのデバイスに置き、
+ *   stripe_size が指定された場合は大きなファイルをすべてのデバイスにストライプする。
+ * @param roots デバイスのルートパス (先頭は名前空間を持つルート)
+ * @param stripe_size デバイス間のストライプサイズ (0の場合はストライプしない)
+ * @param stripe_patterns 作成時にストライプするパスのパターン (fnmatch形式、カンマ区切り)
+ * @param stripe_min_size Secondaryから取り込む時にストライプするファイルサイズ (0の場合は取り込み時はしない)
+ */
+void BurstBuffer::SetLocalDevices(const std::vector<std::string> &roots, size_t stripe_size,
+                                  const std::string &stripe_patterns, uint64_t stripe_min_size) {
+  md_manager_.SetLocalDevices(roots);
+  if (roots.size() > 1) {
+    if (!is_device_stripe_) {
+      is_device_stripe_ = FileControl::EnableDeviceStripe();
+    }
+    md_manager_.SetDeviceStripePolicy(stripe_size, stripe_patterns, stripe_min_size);
+  }
+  // 先頭以外のデバイスにあるファイルも書き出しの対象にする
+  lf_exporter_.ReSearchLocalFiles();
+}
+
+/**
+ * @breaf データ転送要求のQoSの設定
+ *   読み書き等はクライアントのジョブごとのキューに入れ、重みに応じた公平な順で処理する。
+ * @param thread_count 処理スレッド数 (0の場合はキューを使わず、受信スレッドで処理する)
+ * @param quantum 重み1あたりに1回で処理するバイト数
+ * @param bandwidth ジョブごとの帯域の既定の上限 (バイト/秒、0の場合は制限なし)
+ * @param classes ジョブごとの重み、帯域 ("ジョブID:重み[:帯域],..."、カンマ区切り)
+ * @return bool 成否 (設定が不正な場合は失敗)
+ */
+bool BurstBuffer::SetQosPolicy(int thread_count, size_t quantum, uint64_t bandwidth, const std::string &classes) {
+  if (thread_count <= 0) {
+    scheduler_.Stop();
+    return true;
+  }
+  return scheduler_.Start(thread_count, quantum, bandwidth, classes, ExecuteQueued, this);
+}
+
+/**
+ * @breaf バックグラウンドのコピー (先読み、書き出し、レプリカの作成) の優先度の設定
+ * @param busy_depth コピーを止めるアプリケーションの読み書きの処理数 (0の場合は止めない)
+ * @param idle_msec 処理数が下回ってからコピーを再開するまでの時間 (msec)
+ * @param max_pause_msec 1回にコピーを止める時間の上限 (msec、0の場合は上限なし)
+ * @param use_ioprio コピー中のスレッドのI/O優先度を idle クラスに下げるかどうか
+ */
+void BurstBuffer::SetBackgroundPolicy(int busy_depth, int idle_msec, int max_pause_msec, bool use_ioprio) {
+  md_manager_.io_priority().SetPolicy(busy_depth, idle_msec, max_pause_msec, use_ioprio);
+}
+
+/**
+ * @breaf Secondaryストレージへの書き出し (エクスポート、名前の変更に伴うコピー) の上限の設定
+ * @param bandwidth このサーバーの書き込み帯域の上限 (バイト/秒、0の場合は制限なし)
+ * @param ops このサーバーのメタデータ操作の上限 (回/秒、0の場合は制限なし)
+ * @param cluster_bandwidth クラスタ全体の書き込み帯域の上限 (0の場合は調整しない)
+ * @param cluster_ops クラスタ全体のメタデータ操作の上限 (0の場合は調整しない)
+ * @param lease_dir リースファイルを置くディレクトリ (空の場合はSecondaryストレージ内)
+ * @param lease_name このサーバーのリースファイル名
+ * @param interval_msec リースの更新間隔 (msec)
+ */
+void BurstBuffer::SetSecondaryPolicy(uint64_t bandwidth, uint64_t ops, uint64_t cluster_bandwidth, uint64_t cluster_ops,
+                                     const std::string &lease_dir, const std::string &lease_name, int interval_msec) {
+  SecondaryThrottle &throttle = md_manager_.secondary_throttle();
+  throttle.SetPolicy(bandwidth, ops);
+  throttle.SetCoordination(cluster_bandwidth, cluster_ops,
+                           lease_dir.empty() ? md_manager_.secondary_path(LEASE_DIR_NAME): lease_dir,
+                           lease_name, interval_msec);
+}
+
+/**
+ * @breaf 読み込みの多いファイルの複製方針の設定
+ * @param replica_count オーナー以外に複製するサーバー数 (0の場合は複製しない)
+ * @param threshold 複製を始める1秒あたりの読み込みオープン回数 (0の場合は回数で判定しない)
+ * @param patterns 常に複製するパスのパターン (fnmatch形式、カンマ区切り)
+ */
+void BurstBuffer::SetReplicaPolicy(int replica_count, int threshold, const std::string &patterns) {
+  replica_manager_.SetPolicy(replica_count, threshold, patterns);
 }
 
 /**
  * @breaf ファイル属性取得
  * @param req MsgPackリクエストオブジェクト
- * @param path ファイルパス
+ * @param path ファイルパス (受信バッファ上の文字列)
+ * @param is_compact CompactFileStat で返すかどうか (v2プロトコル)
  */
-void BurstBuffer::GetAttr(msgpack::rpc::request req, const std::string &path) {
-  DMSG("[GetAttr] : %s \n", path.c_str());
+void BurstBuffer::GetAttr(msgpack::rpc::request req, const msgpack::type::raw_ref &path, bool is_compact) {
+  DMSG("[GetAttr] : %.*s \n", (int)path.size, path.ptr);
 
+  // リンクパスはアリーナにあるため、文字列と同じ形式の raw_ref で返す
   FileStat file_stat;
-  std::string link_path;
-  Error error = md_manager_.GetFileStat(path, &file_stat, link_path);
-  req.result(msgpack::type::make_tuple<Error, FileStat, std::string>(error, file_stat, link_path));
+  const char *link_path = "";
+  Error error = count_error(md_manager_.GetFileStat(path.ptr, path.size, &file_stat, &link_path));
+  msgpack::type::raw_ref link(link_path, strlen(link_path));
+  if (is_compact) {
+    req.result(msgpack::type::make_tuple<Error, CompactFileStat, msgpack::type::raw_ref>(error, CompactFileStat(file_stat), link));
+  } else {
+    req.result(msgpack::type::make_tuple<Error, FileStat, msgpack::type::raw_ref>(error, file_stat, link));
+  }
 }
 
 /**
@@ -138,17 +646,21 @@ void BurstBuffer::Unlink(msgpack::rpc::request req, const std::string &path) {
   Error error = kCBBSuccess;
   boost::system::error_code ec;
 
+  replica_manager_.Invalidate(path);
+  migration_manager_.Forget(path);
+
   std::string target_path = md_manager_.local_path(path);
   if (boost::filesystem::exists(target_path, ec)) {
     lf_exporter_.Unregister(path);
     md_manager_.Unregister(path);
-    error = errno_to_cbb_error(unlink(target_path.c_str()));
+    error = FileControl::Remove(target_path.c_str());
   }
 
   target_path = md_manager_.secondary_path(path);
   if (boost::filesystem::exists(target_path, ec)) {
     errno_to_cbb_error(unlink(target_path.c_str()));
   }
+  md_manager_.BumpGeneration(path);
 
   req.result(error);
 }
@@ -161,8 +673,18 @@ void BurstBuffer::Unlink(msgpack::rpc::request req, const std::string &path) {
 void BurstBuffer::RmDir(msgpack::rpc::request req, const std::string &path) {
   DMSG("[RmDir] : %s \n", path.c_str());
 
+  // 先頭以外のデバイスのディレクトリはファイルを置くために作ったもので、空でなければ削除できない
+  Error error = kCBBSuccess;
+  for (int device = 1; device < md_manager_.devices().size() && error == kCBBSuccess; device++) {
+    if (rmdir(md_manager_.device_path(device, path).c_str()) != 0 && errno != ENOENT) {
+      error = -errno;
+    }
+  }
+
   std::string target_path = md_manager_.local_path(path);
-  Error error = errno_to_cbb_error(rmdir(target_path.c_str()));
+  if (error == kCBBSuccess) {
+    error = errno_to_cbb_error(rmdir(target_path.c_str()));
+  }
 
   target_path = md_manager_.secondary_path(path);
   if (boost::filesystem::exists(target_path)) {
@@ -218,6 +740,13 @@ void BurstBuffer::Rename(msgpack::rpc::request req, const std::string &old_path,
   boost::system::error_code ec;
   Error error = kCBBSuccess;
 
+  replica_manager_.Invalidate(old_path);
+  replica_manager_.Invalidate(new_path);
+
+  // 名前の変更はSecondaryへのコピーを伴うため、書き出しと同じ上限に含める
+  SecondaryThrottle::ExportScope export_scope(md_manager_.secondary_throttle());
+  md_manager_.secondary_throttle().Operation();
+
   // ディレクトリの場合
   std::string target = md_manager_.local_path(old_path);
   if (fs::exists(target) && fs::is_directory(target)) {
@@ -234,25 +763,36 @@ DMSG("dir secondary : %s \n", target.c_str());
       second = md_manager_.secondary_path(old_path);
     }
 
-    // すべてのLocalファイルをSecondaryへコピーする
+    // すべてのデバイスのLocalファイルをSecondaryへコピーする (ストライプの断片は元のファイルと一緒にコピーされる)
     fs::recursive_directory_iterator last;
-    std::string local = target + "/";
-    second = second + "/";
-    for (fs::recursive_directory_iterator it(target); it != last; ++it) {
-      if (fs::is_directory(it->path())) {
-        std::string filename = std::string(it->path().filename().c_str()) + "/";
-        local += filename;
-        second += filename;
-      } else {
-        std::string filename = it->path().filename().c_str();
-        if (fs::exists(local + filename)) {
-          fs::copy_file(local + filename, second + filename, boost::filesystem::copy_option::overwrite_if_exists);
+    std::string second_root = second + "/";
+    for (int device = 0; device < md_manager_.devices().size(); device++) {
+      std::string device_target = md_manager_.device_path(device, old_path);
+      if (!fs::is_directory(device_target, ec)) {
+        continue;
+      }
+      std::string local = device_target + "/";
+      second = second_root;
+      for (fs::recursive_directory_iterator it(device_target); it != last; ++it) {
+        if (fs::is_directory(it->path())) {
+          std::string filename = std::string(it->path().filename().c_str()) + "/";
+          local += filename;
+          second += filename;
+        } else {
+          std::string filename = it->path().filename().c_str();
+          if (!is_internal_name(filename.c_str()) && fs::exists(local + filename)) {
+            md_manager_.secondary_throttle().Operation();
+            MetaDataManager::CopyFile(local + filename, second + filename, false);
+          }
         }
       }
     }
 
     // Localのディレクトリを削除
-    fs::remove_all(target);
+    md_manager_.InvalidateFdCache(old_path);
+    for (int device = 0; device < md_manager_.devices().size(); device++) {
+      fs::remove_all(md_manager_.device_path(device, old_path), ec);
+    }
 
     if (is_rename) {
       // Secondaryの名前を変更
@@ -263,7 +803,7 @@ DMSG("dir secondary : %s \n", target.c_str());
     }
 
     // Secondaryのディレクトリ階層をLocalへコピー
-    local = new_path + "/";
+    std::string local = new_path + "/";
     fs::create_directories(md_manager_.local_path(local));
     for (fs::recursive_directory_iterator it(md_manager_.secondary_path(new_path)); it != last; ++it) {
       if (fs::is_directory(it->path())) {
@@ -279,16 +819,32 @@ DMSG("dir secondary : %s \n", target.c_str());
   else {
 DMSG("file : %s \n", target.c_str());
 
+    StripeLayout layout;
+    md_manager_.GetLocalStripe(old_path, &layout);
+
+    // ストライプされたファイルの場合 (他のサーバーも同じSecondaryファイルに書き込むため、Localのまま名前を変える)
+    if (fs::exists(target) && fs::is_regular_file(target) && layout.is_striped()) {
+DMSG("striped file : %s -> %s \n", target.c_str(), md_manager_.local_path(new_path).c_str());
+      lf_exporter_.Unregister(old_path);
+      error = md_manager_.Rename(old_path, new_path);
+      lf_exporter_.Register(new_path);
+    }
     // Localにファイルがある場合
-    if (fs::exists(target) && fs::is_regular_file(target)) {
+    else if (fs::exists(target) && fs::is_regular_file(target)) {
 DMSG("file : %s -> %s \n", target.c_str(), md_manager_.secondary_path(new_path).c_str());
       lf_exporter_.Unregister(old_path);
       fs::remove(md_manager_.secondary_path(old_path), ec);
 
 //      fs::rename(target, md_manager_.secondary_path(new_path), ec);
-      fs::copy_file(target, md_manager_.secondary_path(new_path), ec);
-      if (ec) { error = -1; }
-      fs::remove(target, ec);
+      if (!FileControl::is_plain(target.c_str()) || SecondaryThrottle::is_paced()) {
+        // 圧縮形式、ストライプしたファイルは展開してコピーする (帯域を制限する場合も区切りごとにコピーする)
+        if (FileControl::CopyFile(target.c_str(), md_manager_.secondary_path(new_path).c_str(), false) != kCBBSuccess) { error = -1; }
+      } else {
+        fs::copy_file(target, md_manager_.secondary_path(new_path), ec);
+        if (ec) { error = -1; }
+      }
+      md_manager_.InvalidateFdCache(old_path);
+      FileControl::Remove(target.c_str());
     } else {
       // Secondaryにファイルがある場合
       target = md_manager_.secondary_path(old_path);
@@ -298,6 +854,8 @@ DMSG("file : %s -> %s \n", target.c_str(), md_manager_.secondary_path(new_path).
         if (ec) { error = -1; }
       }
     }
+    md_manager_.BumpGeneration(old_path);
+    md_manager_.BumpGeneration(new_path);
   }
 
   req.result(error);
@@ -371,7 +929,8 @@ void BurstBuffer::Chown(msgpack::rpc::request req, const std::string &path, uid_
 void BurstBuffer::Truncate(msgpack::rpc::request req, const std::string &path, off_t size) {
   DMSG("[Truncate] : %s \n", path.c_str());
 
-  req.result(md_manager_.Truncate(path, size));
+  replica_manager_.Invalidate(path);
+  req.result(count_error(md_manager_.Truncate(path, size)));
 }
 
 
@@ -381,14 +940,29 @@ void BurstBuffer::Truncate(msgpack::rpc::request req, const std::string &path, o
  * @param req MsgPackリクエストオブジェクト
  * @param path ファイルパス
  * @param flags フラグ
+ * @param epoch クライアントの構成の版
  */
-void BurstBuffer::Open(msgpack::rpc::request req, const std::string &path, int flags) {
+void BurstBuffer::Open(msgpack::rpc::request req, const std::string &path, int flags, uint64_t epoch) {
+  // 構成の変更で担当でなくなったファイルは開かない
+  Error error = migration_manager_.CheckOpen(path, epoch);
+  if (error != kCBBSuccess) {
+    req.result(count_error(error));
+    return;
+  }
+
   // 書き込み属性がある場合
   if (flags & (O_WRONLY | O_RDWR) != 0) {
     lf_exporter_.Unregister(path);
   }
 
-  int fd = md_manager_.Open(path, flags);
+  int fd = count_error(md_manager_.Open(path, flags));
+
+  // 読み込みオープンはレプリカ作成にも使われるため、書き込みオープンだけ記録する
+  uint64_t replica_version;
+  int replica_count;
+  if (fd >= 0 && (flags & O_ACCMODE) != O_RDONLY) {
+    replica_manager_.RecordOpen(path, false, &replica_version, &replica_count);
+  }
 
   DMSG("[Open] : %s %08lx  fd:%d \n", path.c_str(), flags, fd);
 
@@ -398,22 +972,62 @@ void BurstBuffer::Open(msgpack::rpc::request req, const std::string &path, int f
 /**
  * @breaf ファイル読み込み
  * @param req MsgPackリクエストオブジェクト
- * @param path ファイルパス
+ * @param path ファイルパス (v2プロトコルでは空)
  * @param fd ファイルディスクリプタ
  * @param size サイズ
  * @param offset オフセット
+ * @param compress_type 読み込みデータの圧縮方式 (kCompressNone 以外の場合は圧縮方式を加えて返す)
  */
-void BurstBuffer::Read(msgpack::rpc::request req, const std::string &path, int fd, size_t size, off_t offset) {
-  msgpack::rpc::auto_zone life(new msgpack::zone());
-
-  char *ptr = (char*)life->malloc(size);
+void BurstBuffer::Read(msgpack::rpc::request req, const char *path, int fd, size_t size, off_t offset,
+                       int compress_type) {
+  // 読み込みデータは要求のゾーンに置き、ゾーンごと返答に引き渡す (要求ごとにゾーンを確保しない)
+  msgpack::rpc::auto_zone &life = request_zone(req);
+
+  // io_uring を使う場合は登録バッファに読み込み、返答の送信後に返却する
+  char *ptr = (char*)FileControl::AllocIoBuffer(size);
+  if (ptr != NULL) {
+    life->push_finalizer(free_io_buffer, ptr);
+  } else {
+    ptr = (char*)life->malloc(size);
+  }
   assert(ptr != NULL);
   
-  ssize_t ssize = md_manager_.Read(path, fd, ptr, size, offset);
+  if (FileControl::is_io_ring_enabled() && compress_type == kCompressNone) {
+    stats_.AddInflight(size);
+    AsyncIo *io = AllocAsyncIo(req, zone_strdup(life, path), fd, ptr, size, offset);
+    // 処理時間、読み込みサイズは完了時に記録する (投入直後に完了する場合があるため、先に引き継ぐ)
+    StatsScope::current()->Defer(&io->stats);
+    if (md_manager_.SubmitRead(path, fd, ptr, size, offset, ReadDone, io)) {
+      return;
+    }
+    StatsScope::current()->Resume(io->stats);
+    stats_.AddInflight(-(int64_t)size);
+    FreeAsyncIo(io);
+  }
 
-  DMSG("[Read] : %s  fd:%d  off:%d  size:%d -> size:%d\n", path.c_str(), fd, offset, size, ssize);
+  ssize_t ssize = ReadData(path, fd, ptr, size, offset);
+
+  DMSG("[Read] : %s  fd:%d  off:%d  size:%d -> size:%d\n", path, fd, offset, size, ssize);
+
+  if (compress_type != kCompressNone) {
+    // 圧縮が効かない場合は圧縮方式 kCompressNone として読み込んだデータをそのまま返す
+    msgpack::type::raw_ref buf(ptr, ssize > 0 ? ssize: 0);
+    int type = kCompressNone;
+    if (ssize >= COMPRESS_MIN_SIZE) {
+      size_t capacity = Compressor::Bound(compress_type, ssize);
+      char *cbuf = (char*)life->malloc(capacity);
+      ssize_t csize = Compressor::Compress(compress_type, compression_level_, ptr, ssize, cbuf, capacity);
+      if (csize > 0 && (size_t)csize * 100 <= (size_t)ssize * COMPRESS_RATIO_LIMIT) {
+        buf = msgpack::type::raw_ref(cbuf, csize);
+        type = compress_type;
+      }
+    }
+    req.result(msgpack::type::make_tuple<ssize_t, msgpack::type::raw_ref, int>(ssize, buf, type), life);
+    return;
+  }
 
-  msgpack::type::raw_ref buf(ptr, size);
+  // 読み込んだ分だけ返す (登録バッファには前の要求のデータが残っている)
+  msgpack::type::raw_ref buf(ptr, ssize > 0 ? ssize: 0);
   req.result(msgpack::type::make_tuple<ssize_t, msgpack::type::raw_ref>(ssize, buf), life);
 }
 
@@ -428,7 +1042,20 @@ void BurstBuffer::Read(msgpack::rpc::request req, const std::string &path, int f
 void BurstBuffer::Write(msgpack::rpc::request req, const std::string &path, int fd, off_t offset, const msgpack::type::raw_ref &raw) {
   //std::cout << "[WRITE] " << md_manager_.secondary_path(path) <<  " fd: " << fd << std::endl;
   
-  ssize_t ssize = md_manager_.Write(path, fd, raw.ptr, raw.size, offset);
+  if (FileControl::is_io_ring_enabled()) {
+    stats_.AddInflight(raw.size);
+    AsyncIo *io = AllocAsyncIo(req, zone_strdup(request_zone(req), path.c_str()), fd, const_cast<char *>(raw.ptr),
+                               raw.size, offset);
+    StatsScope::current()->Defer(&io->stats);
+    if (md_manager_.SubmitWrite(path, fd, raw.ptr, raw.size, offset, WriteDone, io)) {
+      return;
+    }
+    StatsScope::current()->Resume(io->stats);
+    stats_.AddInflight(-(int64_t)raw.size);
+    FreeAsyncIo(io);
+  }
+
+  ssize_t ssize = WriteData(path, fd, raw.ptr, raw.size, offset);
 
   DMSG("[Write] : %s  fd:%d  off:%d  size:%d -> size:%d\n", path.c_str(), fd, offset, raw.size, ssize);
 
@@ -436,62 +1063,232 @@ void BurstBuffer::Write(msgpack::rpc::request req, const std::string &path, int
 }
 
 /**
- *
+ * @breaf 圧縮されたデータのファイル書き込み (展開先はアリーナに取るため同期で書き込む)
+ * @param req MsgPackリクエストオブジェクト
+ * @param fd ファイルディスクリプタ
+ * @param offset オフセット
+ * @param raw 圧縮データ
+ * @param compress_type 圧縮方式
+ * @param size 展開後のサイズ
  */
-void BurstBuffer::StatFs(msgpack::rpc::request req, const std::string &path) {
-  DMSG("[StatFs] : %s \n", path.c_str());
+void BurstBuffer::WriteCompressed(msgpack::rpc::request req, int fd, off_t offset, const msgpack::type::raw_ref &raw,
+                                  int compress_type, size_t size) {
+  // 展開後のサイズはクライアントの申告のため、確保する前に上限と圧縮方式の最大の倍率で確かめる
+  if (size == 0 || size > max_transfer_size_ || size > Compressor::DecompressBound(compress_type, raw.size)) {
+    DMSG("[Write] : fd:%d  off:%d  size:%d (%s %d) -> invalid size\n", fd, offset, size,
+         Compressor::name(compress_type), raw.size);
+    req.result((ssize_t)count_error(-EINVAL));
+    return;
+  }
 
-  std::string target = md_manager_.target_path(path);
-  struct StatVfs stat_info;
+  char *ptr = (char*)Arena::current()->Alloc(size);
+  if (ptr == NULL) {
+    req.result((ssize_t)count_error(-ENOMEM));
+    return;
+  }
+  if (Compressor::Decompress(compress_type, raw.ptr, raw.size, ptr, size) != (ssize_t)size) {
+    DMSG("[Write] : fd:%d  off:%d  size:%d -> broken %s data\n", fd, offset, size, Compressor::name(compress_type));
+    req.result((ssize_t)count_error(-EIO));
+    return;
+  }
 
-  Error error = statvfs(target.c_str(), &stat_info);
+  ssize_t ssize = WriteData("", fd, ptr, size, offset);
 
-  req.result(msgpack::type::make_tuple<Error, StatVfs>(error, stat_info));
+  DMSG("[Write] : fd:%d  off:%d  size:%d (%s %d) -> size:%d\n", fd, offset, size,
+       Compressor::name(compress_type), raw.size, ssize);
+
+  req.result(ssize);
 }
 
 /**
- * @breaf ファイルフラッシュ
- * @param req MsgPackリクエストオブジェクト
- * @param path ファイルパス
+ * @breaf 同期の読み込み (RPC、共有メモリ経由の読み込みで共通)
+ * @param path ファイルパス (空の場合はfdから求める)
  * @param fd ファイルディスクリプタ
+ * @param buf バッファ
+ * @param size サイズ
+ * @param offset オフセット
+ * @return 読み込みサイズまたはError値
  */
-void BurstBuffer::Flush(msgpack::rpc::request req, const std::string &path, int fd) {
-  DMSG("[Flush] : %s  fd:%d \n", path.c_str(), fd);
-
-  req.result(md_manager_.Flush(path, fd));
+ssize_t BurstBuffer::ReadData(const char *path, int fd, void *buf, size_t size, off_t offset) {
+  stats_.AddInflight(size);
+  ssize_t ssize = md_manager_.Read(path, fd, buf, size, offset);
+  stats_.AddInflight(-(int64_t)size);
+  if (count_error(ssize) > 0) {
+    StatsScope::current()->AddBytesOut(ssize);
+  }
+  return ssize;
 }
 
 /**
- * @breaf ファイル開放（クローズ）
- * @param req MsgPackリクエストオブジェクト
- * @param path ファイルパス
+ * @breaf 同期の書き込み (RPC、共有メモリ経由の書き込みで共通)
+ * @param path ファイルパス (空の場合はfdから求める)
  * @param fd ファイルディスクリプタ
+ * @param buf データ
+ * @param size サイズ
+ * @param offset オフセット
+ * @return 書き込みサイズまたはError値
  */
-void BurstBuffer::Release(msgpack::rpc::request req, const std::string &path, int fd) {
-  DMSG("[Release] : %s  fd:%d \n", path.c_str(), fd);
+ssize_t BurstBuffer::WriteData(const std::string &path, int fd, const void *buf, size_t size, off_t offset) {
+  stats_.AddInflight(size);
+  ssize_t ssize = md_manager_.Write(path, fd, buf, size, offset);
+  stats_.AddInflight(-(int64_t)size);
+  if (count_error(ssize) > 0) {
+    StatsScope::current()->AddBytesIn(ssize);
+  }
+  return ssize;
+}
 
-  req.result(md_manager_.Close(path, fd));
-  lf_exporter_.Register(path);
+/**
+ * @breaf キューを通さない読み書き (共有メモリ経由) の帯域の制限 (待ち時間は統計情報のqueue区間に加算)
+ * @param class_id QoS分類
+ * @param cost 転送バイト数
+ */
+void BurstBuffer::Throttle(int class_id, size_t cost) {
+  StatsTimer timer(kPhaseQueue);
+  scheduler_.Throttle(class_id, cost);
 }
 
 /**
- * @breaf ファイル同期
- * @param req MsgPackリクエストオブジェクト
- * @param path ファイルパス
- * @param fd ファイルディスクリプタ
- * @param datasync データ同期
+ * @breaf io_uring での読み込み完了 (完了スレッドから返答する)
+ *   短い読み込み、エラーの場合は読み込んだ分だけ返す (登録バッファには前の要求のデータが残っている)。
+ * @param user_data 要求 (AsyncIo)
+ * @param result 読み込みサイズまたはError値
  */
-void BurstBuffer::FSync(msgpack::rpc::request req, const std::string &path, int fd, int datasync) {
-  DMSG("[FSync] : %s  fd:%d \n", path.c_str(), fd);
+void BurstBuffer::ReadDone(void *user_data, ssize_t result) {
+  AsyncIo *io = (AsyncIo *)user_data;
+  io->bb->stats_.AddInflight(-(int64_t)io->size);
+  io->stats.Finish(result < 0, 0, result > 0 ? result : 0);
+
+  DMSG("[Read] : %s  fd:%d  off:%d  size:%d -> size:%d (async)\n", io->path, io->fd, io->offset, io->size, result);
 
-  req.result(md_manager_.FSync(path, fd, datasync));
+  msgpack::type::raw_ref buf(io->ptr, result > 0 ? result : 0);
+  io->req.result(msgpack::type::make_tuple<ssize_t, msgpack::type::raw_ref>(result, buf), io->req.zone());
+  io->bb->FreeAsyncIo(io);
 }
 
+/**
+ * @breaf io_uring での書き込み完了 (変更範囲を記録し、完了スレッドから返答する)
+ * @param user_data 要求 (AsyncIo)
+ * @param result 書き込みサイズまたはError値
+ */
+void BurstBuffer::WriteDone(void *user_data, ssize_t result) {
+  AsyncIo *io = (AsyncIo *)user_data;
+  io->bb->md_manager_.FinishWrite(io->path, io->fd, io->offset, result);
+  io->bb->stats_.AddInflight(-(int64_t)io->size);
+  io->stats.Finish(result < 0, result > 0 ? result : 0, 0);
+
+  DMSG("[Write] : %s  fd:%d  off:%d  size:%d -> size:%d (async)\n", io->path, io->fd, io->offset, io->size, result);
 
+  io->req.result(result);
+  io->bb->FreeAsyncIo(io);
+}
 
 /**
- * @breaf ディレクトリリスト読み込み補助関数
- * @param path ファイルパス
+ * @breaf io_uring に投入する要求の作成 (返却された領域を再利用する)
+ * @param req MsgPackリクエストオブジェクト
+ * @param path ファイルパス (要求のゾーンに複製したもの)
+ * @param fd ファイルディスクリプタ
+ * @param ptr 読み込み先、書き込みデータ
+ * @param size サイズ
+ * @param offset オフセット
+ * @return 要求
+ */
+BurstBuffer::AsyncIo *BurstBuffer::AllocAsyncIo(msgpack::rpc::request req, const char *path, int fd, char *ptr,
+                                                size_t size, off_t offset) {
+  async_io_mutex_.Lock();
+  void *mem = async_io_free_;
+  if (mem != NULL) {
+    async_io_free_ = *(void **)mem;
+  }
+  async_io_mutex_.Unlock();
+
+  if (mem == NULL) {
+    mem = ::operator new(sizeof(AsyncIo));
+  }
+  return new (mem) AsyncIo(this, req, path, fd, ptr, size, offset);
+}
+
+/**
+ * @breaf io_uring に投入した要求の返却
+ * @param io 要求
+ */
+void BurstBuffer::FreeAsyncIo(AsyncIo *io) {
+  io->~AsyncIo();
+
+  async_io_mutex_.Lock();
+  *(void **)io = async_io_free_;
+  async_io_free_ = io;
+  async_io_mutex_.Unlock();
+}
+
+/**
+ *
+ */
+void BurstBuffer::StatFs(msgpack::rpc::request req, const std::string &path) {
+  DMSG("[StatFs] : %s \n", path.c_str());
+
+  std::string target = md_manager_.target_path(path);
+  struct StatVfs stat_info;
+
+  // Localは全デバイスの合計
+  Error error;
+  if (md_manager_.exists_on_local(path)) {
+    error = md_manager_.devices().StatVfs(&stat_info);
+  } else {
+    error = statvfs(target.c_str(), &stat_info);
+  }
+
+  req.result(msgpack::type::make_tuple<Error, StatVfs>(error, stat_info));
+}
+
+/**
+ * @breaf ファイルフラッシュ
+ * @param req MsgPackリクエストオブジェクト
+ * @param path ファイルパス
+ * @param fd ファイルディスクリプタ
+ */
+void BurstBuffer::Flush(msgpack::rpc::request req, const std::string &path, int fd) {
+  DMSG("[Flush] : %s  fd:%d \n", path.c_str(), fd);
+
+  req.result(md_manager_.Flush(path, fd));
+}
+
+/**
+ * @breaf ファイル開放（クローズ）
+ * @param req MsgPackリクエストオブジェクト
+ * @param path ファイルパス
+ * @param fd ファイルディスクリプタ
+ */
+void BurstBuffer::Release(msgpack::rpc::request req, const std::string &path, int fd) {
+  DMSG("[Release] : %s  fd:%d \n", path.c_str(), fd);
+
+  int access_mode = fcntl(fd, F_GETFL);
+  req.result(count_error(md_manager_.Close(path, fd)));
+  lf_exporter_.Register(path);
+
+  if (access_mode != -1 && (access_mode & O_ACCMODE) != O_RDONLY) {
+    replica_manager_.CloseWriter(path);
+  }
+}
+
+/**
+ * @breaf ファイル同期
+ * @param req MsgPackリクエストオブジェクト
+ * @param path ファイルパス
+ * @param fd ファイルディスクリプタ
+ * @param datasync データ同期
+ */
+void BurstBuffer::FSync(msgpack::rpc::request req, const std::string &path, int fd, int datasync) {
+  DMSG("[FSync] : %s  fd:%d \n", path.c_str(), fd);
+
+  req.result(count_error(md_manager_.FSync(path, fd, datasync)));
+}
+
+
+
+/**
+ * @breaf ディレクトリリスト読み込み補助関数
+ * @param path ファイルパス
  * @param offset オフセット
  * @param file_stats_ptr ファイル情報配列ポインタ
  * @return Error値
@@ -511,6 +1308,11 @@ Error BurstBuffer::ReadDirInternal(const std::string &path, off_t offset, FileSt
     FileStat file_stat;
     std::string d_name = std::string(de->d_name);
 
+    // レプリカ保存ディレクトリ、配置ディレクトリ等のサーバー内部ファイルは見せない
+    if (is_internal_name(de->d_name)) {
+      continue;
+    }
+
     // virtual symlink check
     if (is_virtual_symlink(d_name)) {
       d_name = remove_virtual_ext(d_name);
@@ -566,6 +1368,14 @@ void BurstBuffer::ReadDir(msgpack::rpc::request req, const std::string &path, of
     if (error != kCBBSuccess) {
       errno_to_cbb_error(error);
     }
+
+    // 先頭以外のデバイスに置いたファイル (オフセットは先頭のデバイスのものなので最初の読み込みだけ)
+    for (int device = 1; device < md_manager_.devices().size() && offset == 0; device++) {
+      std::string device_path = md_manager_.device_path(device, path);
+      if (boost::filesystem::is_directory(device_path)) {
+        ReadDirInternal(device_path, 0, file_stats);
+      }
+    }
   }
 
   if (type == kDirAll || type == kDirSecondary) {
@@ -589,10 +1399,18 @@ void BurstBuffer::ReadDir(msgpack::rpc::request req, const std::string &path, of
 void BurstBuffer::FSyncDir(msgpack::rpc::request req, const std::string &path, int datasync) {
   DMSG("[FSyncDir] : %s %d \n", path.c_str(), datasync);
 
-  sync();
-  sync();
+  // ノード全体の sync() ではなく、このディレクトリの inode だけを同期する
+  Error error;
+  {
+    StatsTimer timer(kPhaseSyscall);
+    error = sync_directory(md_manager_.local_path(path), datasync, is_fsyncdir_syncfs_);
+    Error secondary_error = sync_directory(md_manager_.secondary_path(path), datasync, false);
+    if (error == kCBBSuccess) {
+      error = secondary_error;
+    }
+  }
 
-  req.result(0);
+  req.result(count_error(error));
 }
 
 
@@ -700,11 +1518,23 @@ void BurstBuffer::Access(msgpack::rpc::request req, const std::string &path, int
  * @param path ファイルパス
  * @param flags フラグ
  * @param mode モード値
+ * @param epoch クライアントの構成の版
  */
-void BurstBuffer::Create(msgpack::rpc::request req, const std::string &path, int flags, mode_t mode) {
+void BurstBuffer::Create(msgpack::rpc::request req, const std::string &path, int flags, mode_t mode, uint64_t epoch) {
+  Error error = migration_manager_.CheckOpen(path, epoch);
+  if (error != kCBBSuccess) {
+    req.result(count_error(error));
+    return;
+  }
 
   lf_exporter_.Unregister(path);
-  int fd = md_manager_.Create(path, flags, mode);
+  int fd = count_error(md_manager_.Create(path, flags, mode));
+
+  uint64_t replica_version;
+  int replica_count;
+  if (fd >= 0) {
+    replica_manager_.RecordOpen(path, false, &replica_version, &replica_count);
+  }
 
   DMSG("[Create] : %s %08lx  fd:%d \n", path.c_str(), mode, fd);
 
@@ -721,21 +1551,27 @@ void BurstBuffer::Create(msgpack::rpc::request req, const std::string &path, int
 void BurstBuffer::FTruncate(msgpack::rpc::request req, const std::string &path, int fd, off_t size) {
   DMSG("[FTruncate] : %s  fd:%d \n", path.c_str(), fd);
 
-  req.result(md_manager_.FTruncate(path, fd, size));
+  replica_manager_.Invalidate(path);
+  req.result(count_error(md_manager_.FTruncate(path, fd, size)));
 }
 
 /**
  * @breaf ファイル属性取得 (ファイルディスクリプタ版)
  * @param req MsgPackリクエストオブジェクト
- * @param path ファイルパス
+ * @param path ファイルパス (受信バッファ上の文字列、v2プロトコルでは空)
  * @param fd ファイルディスクリプタ
+ * @param is_compact CompactFileStat で返すかどうか (v2プロトコル)
  */
-void BurstBuffer::FGetAttr(msgpack::rpc::request req, const std::string &path, int fd) {
-  DMSG("[FGetAttr] : %s %d \n", path.c_str(), fd);
+void BurstBuffer::FGetAttr(msgpack::rpc::request req, const msgpack::type::raw_ref &path, int fd, bool is_compact) {
+  DMSG("[FGetAttr] : %.*s %d \n", (int)path.size, path.ptr, fd);
 
   FileStat file_stat;
   Error error = md_manager_.GetFileStatFD(fd, &file_stat);
-  req.result(msgpack::type::make_tuple<Error, FileStat>(error, file_stat));
+  if (is_compact) {
+    req.result(msgpack::type::make_tuple<Error, CompactFileStat>(error, CompactFileStat(file_stat)));
+  } else {
+    req.result(msgpack::type::make_tuple<Error, FileStat>(error, file_stat));
+  }
 }
 
 /**
@@ -776,7 +1612,14 @@ void BurstBuffer::Utimens(msgpack::rpc::request req, const std::string &path, co
 void BurstBuffer::FilePrevRead(msgpack::rpc::request req, const std::string &path) {
   DMSG("[FilePrevRead] : %s \n", path.c_str());
 
-  Error error = md_manager_.CopySecondaryToLocal(path);
+  stats_.AddPrefetch(1);
+  Error error;
+  {
+    // 先読みはアプリケーションの読み書きを優先する
+    IoPriority::BackgroundScope background_scope(md_manager_.io_priority());
+    error = count_error(md_manager_.CopySecondaryToLocal(path));
+  }
+  stats_.AddPrefetch(-1);
 
   if (error != 0) {
     DMSG("[FilePrevRead] : error = %d \n", error);
@@ -810,228 +1653,1026 @@ void BurstBuffer::LocalFileExport(msgpack::rpc::request req) {
   req.result((Error)kCBBSuccess);
 }
 
+/**
+ * @breaf 統計情報取得
+ * @param req MsgPackリクエストオブジェクト
+ * @param reset 取得後に統計情報をクリアするかどうか
+ */
+void BurstBuffer::Stats(msgpack::rpc::request req, int reset) {
+  ServerStatsInfo info;
+
+  stats_.set_export_queue_depth(lf_exporter_.queue_depth());
+  stats_.Snapshot(&info);
+  md_manager_.devices().Snapshot(&info.devices);
+  if (scheduler_.is_enabled()) {
+    scheduler_.Snapshot(&info.qos_classes);
+  }
+  md_manager_.io_priority().Snapshot(&info.background);
+  md_manager_.secondary_throttle().Snapshot(&info.secondary);
+  if (reset) {
+    stats_.Reset();
+  }
+
+  req.result(msgpack::type::make_tuple<Error, ServerStatsInfo>(kCBBSuccess, info));
+}
+
+/**
+ * @breaf ログレベル変更
+ * @param req MsgPackリクエストオブジェクト
+ * @param level 新しいログレベル (負の値の場合は変更しない)
+ *   結果は変更前のログレベル (範囲外のレベルの場合は -EINVAL)
+ */
+void BurstBuffer::LogLevel(msgpack::rpc::request req, int level) {
+  int prev_level = Logger::level();
+
+  if (level > kLogNone) {
+    req.result(-EINVAL);
+    return;
+  }
+  if (level >= kLogDebug) {
+    Logger::set_level(level);
+  }
+
+  req.result(prev_level);
+}
+
+/**
+ * @breaf 共有メモリ通信路の作成
+ *   同一ホストのクライアントだけが共有メモリを開いて乱数を確認できる。
+ *   接続されなかった通信路は処理スレッドが一定時間後に閉じる。
+ * @param req MsgPackリクエストオブジェクト
+ * @param class_id クライアントのQoS分類 (kQosClass の結果、旧クライアントは0)
+ */
+void BurstBuffer::ShmAttach(msgpack::rpc::request req, int class_id) {
+  shm_mutex_.Lock();
+
+  // 閉じた通信路の回収
+  std::list<ShmServer *>::iterator it = shm_servers_.begin();
+  while (it != shm_servers_.end()) {
+    if ((*it)->is_closed()) {
+      delete *it;
+      it = shm_servers_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  uint64_t sequence = ++shm_sequence_;
+  std::string name = (boost::format("/cbb.%1%.%2%") % getpid() % sequence).str();
+  uint64_t nonce = get_time_usec() ^ ((uint64_t)getpid() << 40) ^ (sequence * 0x9E3779B97F4A7C15ULL);
+
+  ShmServer *shm_server = new ShmServer(this, &stats_, class_id);
+  Error error = count_error(shm_server->Open(name, nonce, SHM_ARENA_SIZE));
+  if (error == kCBBSuccess) {
+    shm_servers_.push_back(shm_server);
+  } else {
+    delete shm_server;
+    name.clear();
+    nonce = 0;
+  }
+
+  shm_mutex_.Unlock();
+
+  DMSG("[ShmAttach] : %s -> %d\n", name.c_str(), error);
+
+  req.result(msgpack::type::make_tuple<Error, std::string, uint64_t>(error, name, nonce));
+}
+
+/**
+ * @breaf ストライプ配置付きファイルオープン
+ *   stripe_size が 0 の場合は保存済みの配置を返す (オーナーサーバーでのオープン)。
+ *   0 より大きい場合は指定された配置をLocalファイルに保存する (作成時、メンバーサーバーでのオープン)。
+ *   ストライプされていないファイルはクライアントのページキャッシュ判定のためにファイルの版 (更新日時、変更世代) も返す。
+ *   最後に v2プロトコルのファイルハンドルを返す (旧クライアントは読み飛ばす)。
+ * @param req MsgPackリクエストオブジェクト
+ * @param path ファイルパス
+ * @param flags オープンフラグ
+ * @param mode ファイル作成時のモード
+ * @param create 0以外の場合はファイルを作成する
+ * @param stripe_size ストライプサイズ
+ * @param stripe_count ストライプ数
+ * @param stripe_index このサーバーのストライプ番号
+ * @param epoch クライアントの構成の版
+ */
+void BurstBuffer::StripeOpen(msgpack::rpc::request req, const std::string &path, int flags, mode_t mode, int create,
+                             uint64_t stripe_size, int stripe_count, int stripe_index, uint64_t epoch) {
+  Error error = migration_manager_.CheckOpen(path, epoch);
+  if (error != kCBBSuccess) {
+    req.result(msgpack::type::make_tuple<int, uint64_t, int, uint64_t, int, int, uint64_t, uint64_t, uint64_t>(
+        count_error(error), 0, 0, 0, 0, 0, 0, 0, 0));
+    return;
+  }
+
+  StripeLayout layout;
+  layout.size = stripe_size;
+  layout.count = stripe_count;
+  layout.index = stripe_index;
+
+  int fd;
+  if (create) {
+    lf_exporter_.Unregister(path);
+    fd = count_error(md_manager_.Create(path, flags, mode));
+  } else {
+    if ((flags & (O_WRONLY | O_RDWR)) != 0) {
+      lf_exporter_.Unregister(path);
+    }
+    fd = count_error(md_manager_.Open(path, flags));
+  }
+
+  uint64_t replica_version = 0;
+  int replica_count = 0;
+  bool is_replicate = false;
+  uint64_t mtime = 0;
+  uint64_t generation = 0;
+
+  if (fd >= 0) {
+    if (layout.is_striped()) {
+      md_manager_.SetLocalStripe(path, layout);
+    } else if (!create) {
+      StripeLayout local_layout;
+      md_manager_.GetStripe(path, &layout);
+      // Secondaryから復元した配置はLocalファイルにも保存する
+      md_manager_.GetLocalStripe(path, &local_layout);
+      if (layout.is_striped() && !local_layout.is_striped()) {
+        md_manager_.SetLocalStripe(path, layout);
+      }
+    }
+
+    // ストライプされていないファイルは読み込みの多さに応じて複製する
+    if (!layout.is_striped()) {
+      bool is_read_only = !create && (flags & O_ACCMODE) == O_RDONLY;
+      is_replicate = replica_manager_.RecordOpen(path, is_read_only, &replica_version, &replica_count);
+      md_manager_.GetVersion(path, fd, &mtime, &generation);
+    }
+  }
+
+  DMSG("[StripeOpen] : %s %08lx  fd:%d  stripe:%lu/%d/%d  replica:%lu/%d\n",
+       path.c_str(), flags, fd, layout.size, layout.index, layout.count, replica_version, replica_count);
+
+  // v2プロトコルのクライアントは以降の読み書き等にハンドルを使う
+  uint64_t handle = fd >= 0 ? make_file_handle(session_id_, fd): 0;
+
+  req.result(msgpack::type::make_tuple<int, uint64_t, int, uint64_t, int, int, uint64_t, uint64_t, uint64_t>(
+      fd, layout.size, layout.count, replica_version, replica_count, is_replicate ? 1 : 0, mtime, generation, handle));
+}
+
+/**
+ * @breaf ストライプ配置取得
+ * @param req MsgPackリクエストオブジェクト
+ * @param path ファイルパス
+ */
+void BurstBuffer::GetStripe(msgpack::rpc::request req, const std::string &path) {
+  StripeLayout layout;
+  Error error = md_manager_.GetStripe(path, &layout);
+
+  DMSG("[GetStripe] : %s -> %d  stripe:%lu/%d\n", path.c_str(), error, layout.size, layout.count);
+
+  req.result(msgpack::type::make_tuple<Error, uint64_t, int>(error, layout.size, layout.count));
+}
+
+/**
+ * @breaf レプリカのオープン (読み込み専用)
+ * @param req MsgPackリクエストオブジェクト
+ * @param path ファイルパス
+ * @param version レプリカの版 (一致しない場合は -ESTALE)
+ */
+void BurstBuffer::ReplicaOpen(msgpack::rpc::request req, const std::string &path, uint64_t version) {
+  int fd = replica_manager_.Open(path, version);
+
+  DMSG("[ReplicaOpen] : %s (%lu)  fd:%d\n", path.c_str(), version, fd);
+
+  req.result(fd);
+}
+
+/**
+ * @breaf レプリカ作成要求 (オーナーサーバーからの読み込みは別スレッドで行う)
+ * @param req MsgPackリクエストオブジェクト
+ * @param path ファイルパス
+ * @param version レプリカの版
+ * @param host オーナーサーバーのhost
+ * @param port オーナーサーバーのport
+ */
+void BurstBuffer::Replicate(msgpack::rpc::request req, const std::string &path, uint64_t version, const std::string &host, int port) {
+  DMSG("[Replicate] : %s (%lu) from %s:%d\n", path.c_str(), version, host.c_str(), port);
+
+  replica_manager_.Fetch(path, version, host, port);
+
+  req.result((Error)kCBBSuccess);
+}
+
+/**
+ * @breaf 負荷・容量の取得 (新規ファイルの配置先選択用)
+ * @param req MsgPackリクエストオブジェクト
+ */
+void BurstBuffer::Load(msgpack::rpc::request req) {
+  ServerLoad load;
+  struct statvfs st;
+
+  Error error = md_manager_.devices().StatVfs(&st);
+  if (error == kCBBSuccess) {
+    load.free_bytes = (uint64_t)st.f_bavail * st.f_frsize;
+    load.total_bytes = (uint64_t)st.f_blocks * st.f_frsize;
+  }
+  load.inflight_bytes = stats_.inflight_bytes();
+  load.export_backlog = lf_exporter_.queue_depth();
+  load.placed_count = placement_directory_.size();
+
+  req.result(msgpack::type::make_tuple<Error, ServerLoad>(error, load));
+}
+
+/**
+ * @breaf 配置ディレクトリの登録・削除
+ * @param req MsgPackリクエストオブジェクト
+ * @param path ファイルパス
+ * @param host 配置先サーバーのhost (空の場合は削除)
+ * @param port 配置先サーバーのport
+ * @param is_exclusive 未登録の場合だけ登録するかどうか (作成時、旧クライアントはfalse)
+ *   trueの場合の応答は Error値、登録済みの配置先のhost、port の組。
+ */
+void BurstBuffer::Placement(msgpack::rpc::request req, const std::string &path, const std::string &host, int port, bool is_exclusive) {
+  Error error;
+  ServerInfo existing;
+  if (host.empty()) {
+    error = placement_directory_.Remove(path);
+  } else {
+    ServerInfo info;
+    info.host = host;
+    info.port = port;
+    error = is_exclusive ? placement_directory_.Claim(path, info, &existing)
+                         : placement_directory_.Set(path, info);
+  }
+
+  DMSG("[Placement] : %s -> %s:%d (%d)\n", path.c_str(), host.c_str(), port, error);
+
+  if (is_exclusive) {
+    // 登録済みの配置先も返す (-EEXISTの場合)
+    req.result(msgpack::type::make_tuple<Error, std::string, int>(count_error(error), existing.host, existing.port));
+  } else {
+    req.result(count_error(error));
+  }
+}
+
+/**
+ * @breaf 配置ディレクトリの検索
+ * @param req MsgPackリクエストオブジェクト
+ * @param path ファイルパス
+ */
+void BurstBuffer::PlacementLookup(msgpack::rpc::request req, const std::string &path) {
+  ServerInfo info;
+  Error error = placement_directory_.Lookup(path, &info) ? kCBBSuccess : -ENOENT;
+
+  req.result(msgpack::type::make_tuple<Error, std::string, int>(error, info.host, info.port));
+}
+
+
+/**
+ * @breaf サーバー構成の取得
+ * @param req MsgPackリクエストオブジェクト
+ */
+void BurstBuffer::GetMembership(msgpack::rpc::request req) {
+  Membership membership;
+  bool is_migrating;
+  migration_manager_.GetMembership(&membership, &is_migrating);
+
+  req.result(msgpack::type::make_tuple<Error, Membership, int>(kCBBSuccess, membership, is_migrating ? 1 : 0));
+}
+
+/**
+ * @breaf サーバー構成の変更
+ *   全サーバーで commit = 0 (準備) を終えてから commit = 1 (確定) を呼ぶ。
+ * @param req MsgPackリクエストオブジェクト
+ * @param current 変更前の構成
+ * @param next 変更後の構成
+ * @param self このサーバー ("host:port")
+ * @param commit 0の場合は準備、0以外の場合は確定
+ */
+void BurstBuffer::SetMembership(msgpack::rpc::request req, const Membership &current, const Membership &next,
+                                const std::string &self, int commit) {
+  Error error;
+  if (commit) {
+    error = migration_manager_.Commit(next.epoch);
+  } else {
+    error = migration_manager_.Prepare(current, next, self);
+  }
+
+  DMSG("[SetMembership] : epoch %lu -> %lu  self:%s  commit:%d (%d)\n",
+       current.epoch, next.epoch, self.c_str(), commit, error);
+
+  req.result(count_error(error));
+}
+
+/**
+ * @breaf 引き渡すファイルの一覧 (移動元)
+ * @param req MsgPackリクエストオブジェクト
+ * @param epoch 移動先サーバーの構成の版
+ * @param host 移動先サーバーのhost
+ * @param port 移動先サーバーのport
+ * @param after このパスより後のファイルを返す
+ * @param max 最大件数
+ */
+void BurstBuffer::MigrateList(msgpack::rpc::request req, uint64_t epoch, const std::string &host, int port,
+                              const std::string &after, size_t max) {
+  std::vector<std::string> paths;
+  Error error = migration_manager_.List(epoch, ServerInfo(host.c_str(), port), after, max, &paths);
+
+  req.result(msgpack::type::make_tuple<Error, std::vector<std::string> >(count_error(error), paths));
+}
+
+/**
+ * @breaf 引き渡すファイルの読み込み (移動元)
+ * @param req MsgPackリクエストオブジェクト
+ * @param path ファイルパス
+ * @param size サイズ
+ * @param offset オフセット
+ */
+void BurstBuffer::MigrateRead(msgpack::rpc::request req, const std::string &path, size_t size, off_t offset) {
+  msgpack::rpc::auto_zone life(new msgpack::zone());
+
+  char *ptr = (char*)life->malloc(size);
+  assert(ptr != NULL);
+
+  FileStat stat;
+  stats_.AddInflight(size);
+  ssize_t ssize = migration_manager_.Read(path, size, offset, &stat, ptr);
+  stats_.AddInflight(-(int64_t)size);
+  if (count_error(ssize) > 0) {
+    StatsScope::current()->AddBytesOut(ssize);
+  }
+
+  DMSG("[MigrateRead] : %s  off:%d  size:%d -> size:%d\n", path.c_str(), offset, size, ssize);
+
+  msgpack::type::raw_ref buf(ptr, ssize > 0 ? ssize : 0);
+  req.result(msgpack::type::make_tuple<ssize_t, FileStat, msgpack::type::raw_ref>(ssize, stat, buf), life);
+}
+
+/**
+ * @breaf 引き渡したファイルの削除 (移動元)
+ * @param req MsgPackリクエストオブジェクト
+ * @param path ファイルパス
+ * @param stat 移動先サーバーが読み込んだ時点のファイル属性
+ */
+void BurstBuffer::MigrateRelease(msgpack::rpc::request req, const std::string &path, const FileStat &stat) {
+  Error error = migration_manager_.ReleaseFile(path, stat);
+
+  DMSG("[MigrateRelease] : %s (%d)\n", path.c_str(), error);
+
+  req.result(count_error(error));
+}
+
+/**
+ * @breaf プロトコルの版の決定 (クライアントの接続時)
+ * @param req MsgPackリクエストオブジェクト
+ * @param version クライアントが扱える最新の版
+ */
+void BurstBuffer::Hello(msgpack::rpc::request req, int version) {
+  int result = std::max(std::min(version, CBB_PROTOCOL_VERSION), CBB_PROTOCOL_V1);
+
+  DMSG("[Hello] : version %d -> %d\n", version, result);
+
+  req.result(result);
+}
+
+/**
+ * @breaf 通信データの圧縮方式の決定 (クライアントの接続時)
+ * @param req MsgPackリクエストオブジェクト
+ * @param type クライアントが使う圧縮方式
+ */
+void BurstBuffer::Compression(msgpack::rpc::request req, int type) {
+  int result = Compressor::is_supported(type) ? type: kCompressNone;
+
+  DMSG("[Compression] : %s -> %s\n", Compressor::name(type), Compressor::name(result));
+
+  req.result(result);
+}
+
+/**
+ * @breaf QoS分類の決定 (クライアントの接続時)
+ *   同じジョブのクライアントは同じ分類になり、分類ごとに帯域を公平に分ける。
+ * @param req MsgPackリクエストオブジェクト
+ * @param job クライアントのジョブID (空の場合は分類なし)
+ */
+void BurstBuffer::QosClass(msgpack::rpc::request req, const std::string &job) {
+  int result = scheduler_.is_enabled() ? scheduler_.Register(job): 0;
+
+  DMSG("[QosClass] : %s -> %d\n", job.c_str(), result);
+
+  req.result(result);
+}
+
+/**
+ * @breaf v2プロトコルのファイルハンドルからfdを求める
+ * @param handle ファイルハンドル
+ * @param path_ptr ファイルパス保存ポインタ (NULLの場合は求めない)
+ * @return fd (このサーバーが発行していない、閉じられたハンドルの場合は -EBADF)
+ */
+int BurstBuffer::ResolveHandle(uint64_t handle, std::string *path_ptr) {
+  int fd = file_handle_fd(handle);
+  if (file_handle_session(handle) != session_id_ || fd < 0) {
+    return -EBADF;
+  }
+
+  if (path_ptr == NULL) {
+    return md_manager_.is_open(fd) ? fd: -EBADF;
+  }
+  *path_ptr = md_manager_.fd_path(fd);
+  return path_ptr->empty() ? -EBADF: fd;
+}
 
 /**
  * @breaf MsgPack処理振り分け
+ *   QoSが有効な場合、データ転送要求は分類ごとのキューに入れて処理スレッドで処理する。
  * @param req MsgPackリクエストオブジェクト
  */
 void BurstBuffer::dispatch(msgpack::rpc::request req) {
+  int class_id;
+  size_t cost;
+  if (scheduler_.is_enabled() && is_scheduled_request(req, &class_id, &cost)) {
+    scheduler_.Submit(req, class_id, cost);
+    return;
+  }
+  Execute(req, 0);
+}
+
+/**
+ * @breaf キューで順番が来た要求の処理 (RequestSchedulerの処理スレッド)
+ * @param context BurstBuffer
+ * @param req MsgPackリクエストオブジェクト
+ * @param queued_time キューに入れた時刻 (usec)
+ */
+void BurstBuffer::ExecuteQueued(void *context, msgpack::rpc::request req, uint64_t queued_time) {
+  ((BurstBuffer *)context)->Execute(req, queued_time);
+}
+
+/**
+ * @breaf MsgPack処理の実行
+ * @param req MsgPackリクエストオブジェクト
+ * @param queued_time キューに入れた時刻 (usec、0の場合はキューを通していない)
+ */
+void BurstBuffer::Execute(msgpack::rpc::request req, uint64_t queued_time) {
+  StatsScope stats_scope(&stats_, queued_time);
+
+  // パスは受信バッファを参照して取り出し、派生するパスはアリーナに作る (返答後に破棄する)
+  ArenaScope arena_scope(Arena::current());
+
+#define METHOD(code) case code: stats_scope.Select(code);
 
   try {
 
-    std::string method;
-    req.method().convert(&method);
+    msgpack::object method_object = req.method();
+    msgpack::object params_object = req.params();
+    int code = method_code(method_object);
+    int hops = 0;
+
+    // 他のサーバーから転送されたリクエストは転送元のメソッドとして処理する
+    if (code == kForward) {
+      msgpack::type::tuple<msgpack::object, msgpack::object, int> forward;
+      params_object.convert(&forward);
+      method_object = forward.get<0>();
+      params_object = forward.get<1>();
+      hops = forward.get<2>();
+      code = method_code(method_object);
+    }
+
+    // 整数のメソッドコードは v2 プロトコル (ファイルハンドル、CompactFileStat を使う)
+    bool is_v2 = method_object.type == msgpack::type::POSITIVE_INTEGER;
 
-    DMSG("[dispatch] : %s \n", method.c_str());
+    DMSG("[dispatch] : %s (hops:%d%s)\n", ServerStats::method_name(code), hops, is_v2 ? " v2": "");
 
-    if (method == CODE(kGetAttr)) {
+    // 処理中はバックグラウンドのコピーを控えさせる (オープンはSecondaryからの取り込みを含む)
+    IoPriority::ForegroundScope foreground_scope(md_manager_.io_priority(), is_foreground_method(code));
 
-      msgpack::type::tuple<std::string> params;
-      req.params().convert(&params);
-      GetAttr(req, params.get<0>());
+    // 構成の変更後は担当サーバーに転送し、転送されたリクエストは移動中のファイルの読み込みを待つ
+    if (migration_manager_.is_routing() && is_routed_method(code)) {
+      msgpack::type::tuple<std::string> path_params;
+      params_object.convert(&path_params);
 
-    } else if (method == CODE(kReadLink)) {
+      ServerInfo info;
+      if (hops >= MIGRATION_FORWARD_MAX) {
+        migration_manager_.WaitPull(path_params.get<0>());
+      } else if (migration_manager_.Route(path_params.get<0>(), &info) == kRouteForward) {
+        stats_scope.Select(kForward);
+        if (migration_manager_.Forward(req, method_object, params_object, hops, info)) {
+          return;
+        }
+      }
+    }
+
+    switch (code) {
+
+    METHOD(kGetAttr) {
+
+      msgpack::type::tuple<msgpack::type::raw_ref> params;
+      params_object.convert(&params);
+      GetAttr(req, params.get<0>(), is_v2);
+
+    } break;
+
+    METHOD(kReadLink) {
 
       msgpack::type::tuple<std::string, size_t> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       ReadLink(req, params.get<0>(), params.get<1>());
 
-    } else if (method == CODE(kMkDir)) {
+    } break;
+
+    METHOD(kMkDir) {
 
       msgpack::type::tuple<std::string, mode_t> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       MkDir(req, params.get<0>(), params.get<1>());
 
-    } else if (method == CODE(kUnlink)) {
+    } break;
+
+    METHOD(kUnlink) {
 
       msgpack::type::tuple<std::string> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       Unlink(req, params.get<0>());
 
-    } else if (method == CODE(kRmDir)) {
+    } break;
+
+    METHOD(kRmDir) {
 
       msgpack::type::tuple<std::string> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       RmDir(req, params.get<0>());
 
-    } else if (method == CODE(kSymlink)) {
+    } break;
+
+    METHOD(kSymlink) {
 
       msgpack::type::tuple<std::string, std::string> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       Symlink(req, params.get<0>(), params.get<1>());
 
-    } else if (method == CODE(kRename)) {
+    } break;
+
+    METHOD(kRename) {
 
       msgpack::type::tuple<std::string, std::string> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       Rename(req, params.get<0>(), params.get<1>());
 
-    } else if (method == CODE(kLink)) {
+    } break;
+
+    METHOD(kLink) {
 
       msgpack::type::tuple<std::string, std::string> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       Link(req, params.get<0>(), params.get<1>());
 
-    } else if (method == CODE(kChmod)) {
+    } break;
+
+    METHOD(kChmod) {
 
       msgpack::type::tuple<std::string, mode_t> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       Chmod(req, params.get<0>(), params.get<1>());
 
-    } else if (method == CODE(kChown)) {
+    } break;
+
+    METHOD(kChown) {
 
       msgpack::type::tuple<std::string, uid_t, gid_t> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       Chown(req, params.get<0>(), params.get<1>(), params.get<2>());
 
-    } else if (method == CODE(kTruncate)) {
+    } break;
+
+    METHOD(kTruncate) {
 
       msgpack::type::tuple<std::string, off_t> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       Truncate(req, params.get<0>(), params.get<1>());
 
-    } else if (method == CODE(kOpen)) {
+    } break;
+
+    METHOD(kOpen) {
 
       msgpack::type::tuple<std::string, int> params;
-      req.params().convert(&params);
-      Open(req, params.get<0>(), params.get<1>());
+      params_object.convert(&params);
+      Open(req, params.get<0>(), params.get<1>(), optional_epoch(params_object, 2));
 
-    } else if (method == CODE(kRead)) {
+    } break;
 
-      msgpack::type::tuple<std::string, int, size_t, off_t> params;
-      req.params().convert(&params);
-      Read(req, params.get<0>(), params.get<1>(), params.get<2>(), params.get<3>());
+    METHOD(kRead) {
+
+      if (is_v2) {
+        // 読み書きはパスを使わないため、ハンドルの確認だけ行う
+        msgpack::type::tuple<uint64_t, size_t, off_t> params;
+        params_object.convert(&params);
+        int fd = ResolveHandle(params.get<0>(), NULL);
+        if (fd < 0) {
+          req.result(msgpack::type::make_tuple<ssize_t, msgpack::type::raw_ref>(count_error(fd), msgpack::type::raw_ref()));
+          break;
+        }
+        // 4番目のパラメータは kCompression で決めた圧縮方式 (圧縮を使うクライアントだけが送る)
+        int type = (int)optional_uint(params_object, 3);
+        Read(req, "", fd, params.get<1>(), params.get<2>(), Compressor::is_supported(type) ? type: kCompressNone);
+        break;
+      }
 
-    } else if (method == CODE(kWrite)) {
+      msgpack::type::tuple<msgpack::type::raw_ref, int, size_t, off_t> params;
+      params_object.convert(&params);
+      Read(req, arena_string(params.get<0>()), params.get<1>(), params.get<2>(), params.get<3>());
+
+    } break;
+
+    METHOD(kWrite) {
+
+      if (is_v2) {
+        msgpack::type::tuple<uint64_t, off_t, msgpack::type::raw_ref> params;
+        params_object.convert(&params);
+        int fd = ResolveHandle(params.get<0>(), NULL);
+        if (fd < 0) {
+          req.result((ssize_t)count_error(fd));
+          break;
+        }
+        // 圧縮されたデータは圧縮方式と展開後のサイズが続く
+        int type = (int)optional_uint(params_object, 3);
+        if (type != kCompressNone) {
+          WriteCompressed(req, fd, params.get<1>(), params.get<2>(), type, optional_uint(params_object, 4));
+          break;
+        }
+        Write(req, "", fd, params.get<1>(), params.get<2>());
+        break;
+      }
 
       msgpack::type::tuple<std::string, int, off_t, msgpack::type::raw_ref> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       Write(req, params.get<0>(), params.get<1>(), params.get<2>(), params.get<3>());
 
-    } else if (method == CODE(kStatFs)) {
+    } break;
+
+    METHOD(kStatFs) {
 
       msgpack::type::tuple<std::string> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       StatFs(req, params.get<0>());
 
-    } else if (method == CODE(kFlush)) {
+    } break;
+
+    METHOD(kFlush) {
+
+      if (is_v2) {
+        msgpack::type::tuple<uint64_t> params;
+        params_object.convert(&params);
+        std::string path;
+        int fd = ResolveHandle(params.get<0>(), &path);
+        if (fd < 0) {
+          req.result(count_error(fd));
+          break;
+        }
+        Flush(req, path, fd);
+        break;
+      }
 
       msgpack::type::tuple<std::string, int> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       Flush(req, params.get<0>(), params.get<1>());
 
-    } else if (method == CODE(kRelease)) {
+    } break;
+
+    METHOD(kRelease) {
+
+      if (is_v2) {
+        msgpack::type::tuple<uint64_t> params;
+        params_object.convert(&params);
+        std::string path;
+        int fd = ResolveHandle(params.get<0>(), &path);
+        if (fd < 0) {
+          req.result(count_error(fd));
+          break;
+        }
+        Release(req, path, fd);
+        break;
+      }
 
       msgpack::type::tuple<std::string, int> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       Release(req, params.get<0>(), params.get<1>());
 
-    } else if (method == CODE(kFSync)) {
-      
+    } break;
+
+    METHOD(kFSync) {
+
+      if (is_v2) {
+        msgpack::type::tuple<uint64_t, int> params;
+        params_object.convert(&params);
+        std::string path;
+        int fd = ResolveHandle(params.get<0>(), &path);
+        if (fd < 0) {
+          req.result(count_error(fd));
+          break;
+        }
+        FSync(req, path, fd, params.get<1>());
+        break;
+      }
+
       msgpack::type::tuple<std::string, int, int> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       FSync(req, params.get<0>(), params.get<1>(), params.get<2>());
 
-    } else if (method == CODE(kReadDir)) {
+    } break;
+
+    METHOD(kReadDir) {
 
       msgpack::type::tuple<std::string, off_t, int> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       ReadDir(req, params.get<0>(), params.get<1>(), params.get<2>());
 
-    } else if (method == CODE(kFSyncDir)) {
+    } break;
+
+    METHOD(kFSyncDir) {
 
       msgpack::type::tuple<std::string, int> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       FSyncDir(req, params.get<0>(), params.get<1>());
 
-    } else if (method == CODE(kSetXAttr)) {
+    } break;
+
+    METHOD(kSetXAttr) {
 
       msgpack::type::tuple<std::string, std::string, std::string, size_t, int> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       SetXAttr(req, params.get<0>(), params.get<1>(), params.get<2>(), params.get<3>(), params.get<4>());
 
-    } else if (method == CODE(kGetXAttr)) {
+    } break;
+
+    METHOD(kGetXAttr) {
 
       msgpack::type::tuple<std::string, std::string, std::string, size_t> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       GetXAttr(req, params.get<0>(), params.get<1>(), params.get<2>(), params.get<3>());
 
-    } else if (method == CODE(kListXAttr)) {
+    } break;
+
+    METHOD(kListXAttr) {
 
       msgpack::type::tuple<std::string, std::string, size_t> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       ListXAttr(req, params.get<0>(), params.get<1>(), params.get<2>());
 
-    } else if (method == CODE(kRemoveXAttr)) {
+    } break;
+
+    METHOD(kRemoveXAttr) {
 
       msgpack::type::tuple<std::string, std::string> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       RemoveXAttr(req, params.get<0>(), params.get<1>());
 
-    } else if (method == CODE(kAccess)) {
+    } break;
+
+    METHOD(kAccess) {
 
       msgpack::type::tuple<std::string, int> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       Access(req, params.get<0>(), params.get<1>());
 
-    } else if (method == CODE(kCreate)) {
+    } break;
+
+    METHOD(kCreate) {
 
       msgpack::type::tuple<std::string, int, mode_t> params;
-      req.params().convert(&params);
-      Create(req, params.get<0>(), params.get<1>(), params.get<2>());
+      params_object.convert(&params);
+      Create(req, params.get<0>(), params.get<1>(), params.get<2>(), optional_epoch(params_object, 3));
+
+    } break;
 
-    } else if (method == CODE(kFTruncate)) {
+    METHOD(kFTruncate) {
+
+      if (is_v2) {
+        msgpack::type::tuple<uint64_t, off_t> params;
+        params_object.convert(&params);
+        std::string path;
+        int fd = ResolveHandle(params.get<0>(), &path);
+        if (fd < 0) {
+          req.result(count_error(fd));
+          break;
+        }
+        FTruncate(req, path, fd, params.get<1>());
+        break;
+      }
 
       msgpack::type::tuple<std::string, int, off_t> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       FTruncate(req, params.get<0>(), params.get<1>(), params.get<2>());
 
-    } else if (method == CODE(kFGetAttr)) {
+    } break;
 
-      msgpack::type::tuple<std::string, int> params;
-      req.params().convert(&params);
-      FGetAttr(req, params.get<0>(), params.get<1>());
+    METHOD(kFGetAttr) {
+
+      if (is_v2) {
+        msgpack::type::tuple<uint64_t> params;
+        params_object.convert(&params);
+        int fd = ResolveHandle(params.get<0>(), NULL);
+        if (fd < 0) {
+          req.result(msgpack::type::make_tuple<Error, CompactFileStat>(count_error(fd), CompactFileStat()));
+          break;
+        }
+        FGetAttr(req, msgpack::type::raw_ref(), fd, true);
+        break;
+      }
+
+      msgpack::type::tuple<msgpack::type::raw_ref, int> params;
+      params_object.convert(&params);
+      FGetAttr(req, params.get<0>(), params.get<1>(), false);
+
+    } break;
 
-    } else if (method == CODE(kLock)) {
+    METHOD(kLock) {
 
       msgpack::type::tuple<std::string, int, int> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       Lock(req, params.get<0>(), params.get<1>(), params.get<2>());
 
-    } else if (method == CODE(kUtimens)) {
+    } break;
+
+    METHOD(kUtimens) {
 
       msgpack::type::tuple<std::string, TimeSpec, TimeSpec> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       Utimens(req, params.get<0>(), params.get<1>(), params.get<2>());
       
-    } else if (method == CODE(kFilePrevRead)) {
+    } break;
+
+    METHOD(kFilePrevRead) {
 
       msgpack::type::tuple<std::string> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       FilePrevRead(req, params.get<0>());
 
-    } else if (method == CODE(kFileFlush)) {
+    } break;
+
+    METHOD(kFileFlush) {
 
       msgpack::type::tuple<std::string> params;
-      req.params().convert(&params);
+      params_object.convert(&params);
       FileFlush(req, params.get<0>());
 
-    } else if (method == CODE(kLocalFileExport)) {
+    } break;
+
+    METHOD(kLocalFileExport) {
 
       LocalFileExport(req);
 
-    } else {
+    } break;
+
+    METHOD(kStats) {
+
+      msgpack::type::tuple<int> params;
+      params_object.convert(&params);
+      Stats(req, params.get<0>());
+
+    } break;
+
+    METHOD(kLogLevel) {
+
+      msgpack::type::tuple<int> params;
+      params_object.convert(&params);
+      LogLevel(req, params.get<0>());
+
+    } break;
+
+    METHOD(kShmAttach) {
+
+      ShmAttach(req, (int)optional_uint(params_object, 0));
+
+    } break;
+
+    METHOD(kStripeOpen) {
+
+      msgpack::type::tuple<std::string, int, mode_t, int, uint64_t, int, int> params;
+      params_object.convert(&params);
+      StripeOpen(req, params.get<0>(), params.get<1>(), params.get<2>(), params.get<3>(),
+                 params.get<4>(), params.get<5>(), params.get<6>(), optional_epoch(params_object, 7));
+
+    } break;
+
+    METHOD(kGetStripe) {
+
+      msgpack::type::tuple<std::string> params;
+      params_object.convert(&params);
+      GetStripe(req, params.get<0>());
+
+    } break;
+
+    METHOD(kReplicaOpen) {
+
+      msgpack::type::tuple<std::string, uint64_t> params;
+      params_object.convert(&params);
+      ReplicaOpen(req, params.get<0>(), params.get<1>());
+
+    } break;
+
+    METHOD(kReplicate) {
+
+      msgpack::type::tuple<std::string, uint64_t, std::string, int> params;
+      params_object.convert(&params);
+      Replicate(req, params.get<0>(), params.get<1>(), params.get<2>(), params.get<3>());
+
+    } break;
+
+    METHOD(kLoad) {
+
+      Load(req);
+
+    } break;
+
+    METHOD(kPlacement) {
+
+      msgpack::type::tuple<std::string, std::string, int> params;
+      params_object.convert(&params);
+      Placement(req, params.get<0>(), params.get<1>(), params.get<2>(), optional_uint(params_object, 3) != 0);
+
+    } break;
+
+    METHOD(kPlacementLookup) {
+
+      msgpack::type::tuple<std::string> params;
+      params_object.convert(&params);
+      PlacementLookup(req, params.get<0>());
+
+    } break;
+
+    METHOD(kMembership) {
+
+      GetMembership(req);
+
+    } break;
+
+    METHOD(kSetMembership) {
+
+      msgpack::type::tuple<Membership, Membership, std::string, int> params;
+      params_object.convert(&params);
+      SetMembership(req, params.get<0>(), params.get<1>(), params.get<2>(), params.get<3>());
+
+    } break;
+
+    METHOD(kMigrateList) {
+
+      msgpack::type::tuple<uint64_t, std::string, int, std::string, size_t> params;
+      params_object.convert(&params);
+      MigrateList(req, params.get<0>(), params.get<1>(), params.get<2>(), params.get<3>(), params.get<4>());
+
+    } break;
+
+    METHOD(kMigrateRead) {
+
+      msgpack::type::tuple<std::string, size_t, off_t> params;
+      params_object.convert(&params);
+      MigrateRead(req, params.get<0>(), params.get<1>(), params.get<2>());
+
+    } break;
+
+    METHOD(kMigrateRelease) {
+
+      msgpack::type::tuple<std::string, FileStat> params;
+      params_object.convert(&params);
+      MigrateRelease(req, params.get<0>(), params.get<1>());
+
+    } break;
+
+    METHOD(kHello) {
+
+      msgpack::type::tuple<int> params;
+      params_object.convert(&params);
+      Hello(req, params.get<0>());
+
+    } break;
+
+    METHOD(kCompression) {
+
+      msgpack::type::tuple<int> params;
+      params_object.convert(&params);
+      Compression(req, params.get<0>());
+
+    } break;
+
+    METHOD(kQosClass) {
+
+      msgpack::type::tuple<std::string> params;
+      params_object.convert(&params);
+      QosClass(req, params.get<0>());
+
+    } break;
+
+    default:
 
       req.error(msgpack::rpc::NO_METHOD_ERROR);
+      break;
 
     }
 
   } catch (msgpack::type_error& e) {
+    stats_scope.set_error();
     req.error(msgpack::rpc::ARGUMENT_ERROR);
   } catch (std::exception& e) {
+    stats_scope.set_error();
     req.error(std::string(e.what()));
   }
 
+#undef METHOD
 }
 
 /**
@@ -17,8 +17,21 @@
 #define CBB_BURST_BUFFER_H_
 
 #include <jubatus/msgpack/rpc/server.h>
+
+#include <list>
+
+#include "util/compressor.h"
+#include "util/mutex.h"
 #include "meta_data_manager.h"
 #include "local_file_exporter.h"
+#include "server_stats.h"
+#include "shm_server.h"
+#include "replica_manager.h"
+#include "placement_directory.h"
+#include "migration_manager.h"
+#include "request_scheduler.h"
+
+#define BB_MAX_TRANSFER_SIZE 67108864  // 既定の圧縮された書き込みを展開した後のサイズの上限 (64MiB)
 
 namespace cbb {
 
@@ -30,7 +43,21 @@ class BurstBuffer : public msgpack::rpc::server::base {
   BurstBuffer(std::string local_storage_root_path, std::string secondary_storage_root_path, int interval_time);
   virtual ~BurstBuffer();
 
-  void GetAttr(msgpack::rpc::request req, const std::string &path);
+  void SetReplicaPolicy(int replica_count, int threshold, const std::string &patterns);
+  void SetFSyncDirPolicy(bool is_syncfs);
+  void SetFdCachePolicy(int cache_size);
+  bool SetIoPolicy(int entries);
+  bool SetDirectIoPolicy(size_t threshold, int buffer_count);
+  void SetCompressionPolicy(int level, size_t max_transfer_size = BB_MAX_TRANSFER_SIZE);
+  bool SetLocalCompressionPolicy(int type, int level, size_t chunk_size);
+  void SetLocalDevices(const std::vector<std::string> &roots, size_t stripe_size,
+                       const std::string &stripe_patterns, uint64_t stripe_min_size);
+  bool SetQosPolicy(int thread_count, size_t quantum, uint64_t bandwidth, const std::string &classes);
+  void SetBackgroundPolicy(int busy_depth, int idle_msec, int max_pause_msec, bool use_ioprio);
+  void SetSecondaryPolicy(uint64_t bandwidth, uint64_t ops, uint64_t cluster_bandwidth, uint64_t cluster_ops,
+                          const std::string &lease_dir, const std::string &lease_name, int interval_msec);
+
+  void GetAttr(msgpack::rpc::request req, const msgpack::type::raw_ref &path, bool is_compact);
   void ReadLink(msgpack::rpc::request req, const std::string &path, size_t size);
   void MkDir(msgpack::rpc::request req, const std::string &path, mode_t mode);
   void Unlink(msgpack::rpc::request req, const std::string &path);
@@ -42,9 +69,16 @@ class BurstBuffer : public msgpack::rpc::server::base {
   void Chown(msgpack::rpc::request req, const std::string &path, uid_t uid, gid_t gid);
   void Truncate(msgpack::rpc::request req, const std::string &path, off_t size);
 
-  void Open(msgpack::rpc::request req, const std::string &path, int flags);
-  void Read(msgpack::rpc::request req, const std::string &path, int fd, size_t size, off_t offset);
+  void Open(msgpack::rpc::request req, const std::string &path, int flags, uint64_t epoch);
+  void Read(msgpack::rpc::request req, const char *path, int fd, size_t size, off_t offset,
+            int compress_type = kCompressNone);
   void Write(msgpack::rpc::request req, const std::string &path, int fd, off_t offset, const msgpack::type::raw_ref &raw);
+  void WriteCompressed(msgpack::rpc::request req, int fd, off_t offset, const msgpack::type::raw_ref &raw,
+                       int compress_type, size_t size);
+  ssize_t ReadData(const char *path, int fd, void *buf, size_t size, off_t offset);
+  ssize_t WriteData(const std::string &path, int fd, const void *buf, size_t size, off_t offset);
+  void Throttle(int class_id, size_t cost);
+  IoPriority &io_priority() { return md_manager_.io_priority(); }
   void StatFs(msgpack::rpc::request req, const std::string &path); //*
   void Flush(msgpack::rpc::request req, const std::string &path, int fd);
   void Release(msgpack::rpc::request req, const std::string &path, int fd);
@@ -59,26 +93,76 @@ class BurstBuffer : public msgpack::rpc::server::base {
   void RemoveXAttr(msgpack::rpc::request req, const std::string &path, const std::string &name); //*
 
   void Access(msgpack::rpc::request req, const std::string &path, int mode);
-  void Create(msgpack::rpc::request req, const std::string &path, int flags, mode_t mode);
+  void Create(msgpack::rpc::request req, const std::string &path, int flags, mode_t mode, uint64_t epoch);
   void FTruncate(msgpack::rpc::request req, const std::string &path, int fd, off_t size);
-  void FGetAttr(msgpack::rpc::request req, const std::string &path, int fd); //*
+  void FGetAttr(msgpack::rpc::request req, const msgpack::type::raw_ref &path, int fd, bool is_compact); //*
   void Lock(msgpack::rpc::request req, const std::string &path, int fd, int cmd); //*
   void Utimens(msgpack::rpc::request req, const std::string &path, const TimeSpec &time0, const TimeSpec &time1);
 
   void FilePrevRead(msgpack::rpc::request req, const std::string &path);
   void FileFlush(msgpack::rpc::request req, const std::string &path);
   void LocalFileExport(msgpack::rpc::request req);
+  void Stats(msgpack::rpc::request req, int reset);
+  void LogLevel(msgpack::rpc::request req, int level);
+  void ShmAttach(msgpack::rpc::request req, int class_id);
+  void StripeOpen(msgpack::rpc::request req, const std::string &path, int flags, mode_t mode, int create,
+                  uint64_t stripe_size, int stripe_count, int stripe_index, uint64_t epoch);
+  void GetStripe(msgpack::rpc::request req, const std::string &path);
+  void ReplicaOpen(msgpack::rpc::request req, const std::string &path, uint64_t version);
+  void Replicate(msgpack::rpc::request req, const std::string &path, uint64_t version, const std::string &host, int port);
+  void Load(msgpack::rpc::request req);
+  void Placement(msgpack::rpc::request req, const std::string &path, const std::string &host, int port, bool is_exclusive);
+  void PlacementLookup(msgpack::rpc::request req, const std::string &path);
+  void GetMembership(msgpack::rpc::request req);
+  void SetMembership(msgpack::rpc::request req, const Membership &current, const Membership &next,
+                     const std::string &self, int commit);
+  void MigrateList(msgpack::rpc::request req, uint64_t epoch, const std::string &host, int port,
+                   const std::string &after, size_t max);
+  void MigrateRead(msgpack::rpc::request req, const std::string &path, size_t size, off_t offset);
+  void MigrateRelease(msgpack::rpc::request req, const std::string &path, const FileStat &stat);
+  void Hello(msgpack::rpc::request req, int version);
+  void Compression(msgpack::rpc::request req, int type);
+  void QosClass(msgpack::rpc::request req, const std::string &job);
 
   void dispatch(msgpack::rpc::request req);
+  void Execute(msgpack::rpc::request req, uint64_t queued_time);
 
 private:
 
+  struct AsyncIo;
+
+  static void ReadDone(void *user_data, ssize_t result);
+  static void WriteDone(void *user_data, ssize_t result);
+  AsyncIo *AllocAsyncIo(msgpack::rpc::request req, const char *path, int fd, char *ptr, size_t size, off_t offset);
+  void FreeAsyncIo(AsyncIo *io);
+  static void ExecuteQueued(void *context, msgpack::rpc::request req, uint64_t queued_time);
+
+  int ResolveHandle(uint64_t handle, std::string *path_ptr);
   int ReadDirInternal(const std::string &path, off_t offset, FileStats &file_stats);
   void DuplicateDirSecondaryToLocal(std::string path);
 
 
   MetaDataManager md_manager_;
   LocalFileExporter lf_exporter_;
+  ServerStats stats_;
+  ReplicaManager replica_manager_;
+  PlacementDirectory placement_directory_;
+  MigrationManager migration_manager_;
+  RequestScheduler scheduler_;
+
+  std::list<ShmServer *> shm_servers_;
+  Mutex shm_mutex_;
+  uint64_t shm_sequence_;
+  bool is_fsyncdir_syncfs_;
+  uint32_t session_id_;  // v2プロトコルのファイルハンドルに入れるセッションID (起動ごとに変わる)
+  int compression_level_;  // 読み込みデータを圧縮して返す場合の圧縮レベル (0の場合は方式の既定値)
+  size_t max_transfer_size_;  // 圧縮された書き込みを展開した後のサイズの上限
+  bool is_io_ring_;        // io_uring を有効にしたかどうか (終了時に無効にする)
+  bool is_direct_io_;      // 直接I/Oを有効にしたかどうか (終了時に無効にする)
+  bool is_chunk_store_;    // 圧縮形式を有効にしたかどうか (終了時に無効にする)
+  bool is_device_stripe_;  // デバイス間ストライプを有効にしたかどうか (終了時に無効にする)
+  void *async_io_free_;    // 返却された AsyncIo の領域 (先頭に次の領域を入れた単方向リスト)
+  Mutex async_io_mutex_;
 };
 
 } // namesapce cbb
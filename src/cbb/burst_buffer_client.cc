@@ -15,6 +15,8 @@
 //
 
 #include <sys/stat.h>
+#include <signal.h>
+#include <climits>
 
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
@@ -26,6 +28,7 @@
 #include "common/common.h"
 #include "util/hash/hash_calc_md5.h"
 #include "util/mutex.h"
+#include "util/shm_channel.h"
 #include "burst_buffer_client.h"
 
 static cbb::Mutex g_fuse_mutex;
@@ -33,45 +36,68 @@ static cbb::Mutex g_fuse_mutex;
 
 #define USE_SESSION_POOL_FOR_IO
 
-#define RETRY_MAX 3       // 再実行の上限回数
-#define RETRY_INTERVAL 1  // 再実行の間隔(秒
-
-#define RPC_RETRY_EXCEPTION_COMMON_HANDLER()  \
-  /* 再実行回数の上限に達したら諦める */               \
-  if (--retry_count <= 0) throw;              \
-                                                     \
-  /* 再実行の準備: 一旦 接続を明示的に破棄 */          \
-  c.close();                                  \
-                                                     \
-  /* 間隔をおいて再実行 */                            \
-  std::cerr << e.what() << std::endl;         \
-  ::sleep(RETRY_INTERVAL);                    \
-  continue
-
-
-#define MSGPACK_CLIENT_CALL(operation)                      \
-  try {                                                     \
-    int retry_count = 0;                                    \
-    g_fuse_mutex.Lock();                                    \
-    while (true) {                                          \
+#define RETRY_MAX 3              // 再実行の上限回数
+#define RETRY_BACKOFF_MAX 2000   // 再実行までの待ち時間の上限 (msec)
+
+#define SHM_RESPONSE_WAIT 1000  // 共有メモリ応答待ちの確認間隔 (msec)
+#define SHM_ATTACH_RETRY 30000  // 共有メモリ通信路を開けなかった場合に再接続を試すまでの時間 (msec)
+#define HANDSHAKE_RETRY 10000   // 版、圧縮方式、QoS分類の確認で通信できなかったサーバーに再度問い合わせるまでの時間 (msec)
+
+#define FILE_VERSION_MAX 65536  // 記録するファイルの版の最大数 (超えた場合はすべて捨てる)
+
+#define PLACEMENT_INFLIGHT_SLACK (64ULL << 20)  // 配置先とみなす処理中バイト数の余裕 (平均の2倍に加える)
+#define PLACEMENT_BACKLOG_SLACK 64              // 配置先とみなすエクスポート待ち数の余裕 (平均の2倍に加える)
+#define PLACEMENT_BACKLOG_WEIGHT (1ULL << 20)   // エクスポート待ち1件を処理中バイト数に換算した重み
+
+// RPC呼び出し (通信エラーは期限までバックオフして再実行し、失敗した場合は result に負のerrnoを設定する)
+//   operation の c は RpcSession に置き換わり、g_fuse_mutex は要求の送信中だけ確保する。
+//   応答を待つ間、再実行を待つ間は確保しないため、応答しないサーバーが他の呼び出しを止めない。
+#define MSGPACK_CLIENT_CALL_N(host, port, result, retry_max, operation)   \
+  {                                                         \
+    RpcRetry retry(server_health_, settings_, host, port, retry_max);  \
+    msgpack::rpc::session &rpc_session = c;                 \
+    while (retry.Begin()) {                                 \
       try {                                                 \
+        RpcSession c(rpc_session, retry.timeout());         \
         operation ;                                         \
+        retry.Succeeded();                                  \
         break;                                              \
-      } catch (msgpack::rpc::connection_closed_error &e) {  \
-        RPC_RETRY_EXCEPTION_COMMON_HANDLER();               \
-      } catch (msgpack::rpc::system_error &e) {             \
-        RPC_RETRY_EXCEPTION_COMMON_HANDLER();               \
+      } catch (msgpack::rpc::remote_error &e) {             \
+        retry.Failed(e, -EIO, false);                       \
       } catch (msgpack::rpc::timeout_error &e) {            \
-        RPC_RETRY_EXCEPTION_COMMON_HANDLER();               \
-      }                                                              \
-    }                                                                \
-    g_fuse_mutex.Unlock();                                  \
-  } catch (msgpack::rpc::remote_error &e) {                 \
-    g_fuse_mutex.Unlock();                                  \
-    std::cerr << "Error " << e.what() << std::endl;         \
-    abort();                                                \
+        RpcSession::Close(rpc_session);                     \
+        retry.Failed(e, -ETIMEDOUT, true);                  \
+      } catch (msgpack::rpc::rpc_error &e) {                \
+        RpcSession::Close(rpc_session);                     \
+        retry.Failed(e, -EIO, true);                        \
+      } catch (std::exception &e) {                         \
+        retry.Failed(e, -EIO, false);                       \
+      }                                                     \
+    }                                                       \
+    if (retry.error() != kCBBSuccess)                       \
+      result = retry.error();                               \
   }
 
+#define MSGPACK_CLIENT_CALL(host, port, result, operation)   \
+  MSGPACK_CLIENT_CALL_N(host, port, result, RETRY_MAX, operation)
+
+// 再実行しないRPC呼び出し (旧サーバー、停止中のサーバーでは別の方法で処理を続ける呼び出し)
+#define MSGPACK_CLIENT_TRY(host, port, result, operation)    \
+  MSGPACK_CLIENT_CALL_N(host, port, result, 0, operation)
+
+
+/**
+ * @breaf 応答の配列の要素の取得 (旧サーバーが返さない後ろの要素は0とする)
+ * @param result 応答
+ * @param index 要素番号
+ * @return 要素の値
+ */
+static uint64_t optional_uint(const msgpack::object &result, size_t index) {
+  if (result.type != msgpack::type::ARRAY || result.via.array.size <= index) {
+    return 0;
+  }
+  return result.via.array.ptr[index].as<uint64_t>();
+}
 
 uint32_t addr_to_binary(const char *ipv4_addr) {
   struct in_addr addr;
@@ -86,11 +112,202 @@ uint32_t addr_to_binary(const char *ipv4_addr) {
 // CBFSモジュール（クライアント側）のメイン処理クラス
 namespace cbb {
 
+// MSGPACK_CLIENT_CALL の再実行制御
+//   通信エラーは Client.rpc_deadline の期限まで、乱数でばらつかせた指数バックオフで再実行する。
+//   1回の呼び出しは Client.rpc_timeout で打ち切る。
+//   サーバーからのエラー応答 (remote_error)、応答の解析エラーは再実行しない。
+//   サーキットが開いているサーバー (ServerHealth) には送らずに -EHOSTDOWN を返す。
+class RpcRetry {
+ public:
+  RpcRetry(ServerHealth &health, Settings &settings, const std::string &host, int port, int retry_max)
+      : health_(health), host_(host), port_(port), interval_(settings.client_retry_interval()),
+        attempt_timeout_(settings.client_rpc_timeout()), retry_max_(retry_max),
+        attempt_(0), error_(kCBBSuccess), is_retry_(true) {
+    deadline_ = get_time_msec() + settings.client_rpc_deadline();
+    seed_ = (unsigned int)(get_time_usec() ^ (uintptr_t)this);
+  }
+
+  /**
+   * @breaf 呼び出しの開始 (2回目以降は待ってから再実行する)
+   * @return bool 呼び出すかどうか
+   */
+  bool Begin() {
+    uint64_t now = get_time_msec();
+    if (attempt_ > 0) {
+      if (!is_retry_ || attempt_ > retry_max_ || now >= deadline_)
+        return false;
+
+      uint64_t wait = std::min(ServerHealth::Backoff(attempt_, interval_, RETRY_BACKOFF_MAX, &seed_), deadline_ - now);
+      usleep(wait * 1000);
+      now = get_time_msec();
+      if (now >= deadline_)
+        return false;
+    }
+
+    if (!health_.Allow(host_, port_, now)) {
+      if (attempt_ == 0)
+        error_ = -EHOSTDOWN;
+      return false;
+    }
+
+    attempt_++;
+    return true;
+  }
+
+  /**
+   * @breaf 1回の呼び出しのタイムアウト (Client.rpc_timeout と期限までの残り時間の短い方、秒)
+   */
+  unsigned int timeout() {
+    uint64_t now = get_time_msec();
+    uint64_t remain = now < deadline_ ? deadline_ - now : 0;
+    return std::max<unsigned int>((std::min<uint64_t>(remain, attempt_timeout_) + 999) / 1000, 1);
+  }
+
+  /**
+   * @breaf 再実行しない呼び出しのタイムアウト (Client.rpc_timeout、秒)
+   * @param settings 設定
+   */
+  static unsigned int attempt_timeout(Settings &settings) {
+    return std::max<unsigned int>((settings.client_rpc_timeout() + 999) / 1000, 1);
+  }
+
+  void Succeeded() {
+    health_.Success(host_, port_);
+    error_ = kCBBSuccess;
+  }
+
+  /**
+   * @breaf 呼び出しの失敗
+   * @param e 例外
+   * @param error 返すエラー値
+   * @param is_transport 通信エラーかどうか (サーバーの状態に記録し、再実行する)
+   */
+  void Failed(const std::exception &e, Error error, bool is_transport) {
+    WMSG("RPC %s:%d failed (attempt %d) : %s\n", host_.c_str(), port_, attempt_, e.what());
+    error_ = error;
+    is_retry_ = is_transport;
+    if (is_transport) {
+      health_.Failure(host_, port_, get_time_msec());
+    } else {
+      health_.Success(host_, port_);
+    }
+  }
+
+  Error error() { return error_; }
+
+ private:
+  ServerHealth &health_;
+  std::string host_;
+  int port_;
+  uint64_t interval_;
+  uint64_t attempt_timeout_;
+  uint64_t deadline_;
+  unsigned int seed_;
+  int retry_max_;
+  int attempt_;
+  Error error_;
+  bool is_retry_;
+};
+
+// g_fuse_mutex を確保した要求の送信
+//   応答 (future) は g_fuse_mutex を確保せずに待つ。
+class RpcSession {
+ public:
+  RpcSession(msgpack::rpc::session &session, unsigned int timeout) : session_(session), timeout_(timeout) {}
+
+  template <typename M>
+  msgpack::rpc::future call(M method) {
+    Lock lock(session_, timeout_);
+    return session_.call(method);
+  }
+  template <typename M, typename A1>
+  msgpack::rpc::future call(M method, const A1 &a1) {
+    Lock lock(session_, timeout_);
+    return session_.call(method, a1);
+  }
+  template <typename M, typename A1, typename A2>
+  msgpack::rpc::future call(M method, const A1 &a1, const A2 &a2) {
+    Lock lock(session_, timeout_);
+    return session_.call(method, a1, a2);
+  }
+  template <typename M, typename A1, typename A2, typename A3>
+  msgpack::rpc::future call(M method, const A1 &a1, const A2 &a2, const A3 &a3) {
+    Lock lock(session_, timeout_);
+    return session_.call(method, a1, a2, a3);
+  }
+  template <typename M, typename A1, typename A2, typename A3, typename A4>
+  msgpack::rpc::future call(M method, const A1 &a1, const A2 &a2, const A3 &a3, const A4 &a4) {
+    Lock lock(session_, timeout_);
+    return session_.call(method, a1, a2, a3, a4);
+  }
+  template <typename M, typename A1, typename A2, typename A3, typename A4, typename A5>
+  msgpack::rpc::future call(M method, const A1 &a1, const A2 &a2, const A3 &a3, const A4 &a4, const A5 &a5) {
+    Lock lock(session_, timeout_);
+    return session_.call(method, a1, a2, a3, a4, a5);
+  }
+  template <typename M, typename A1, typename A2, typename A3, typename A4, typename A5, typename A6>
+  msgpack::rpc::future call(M method, const A1 &a1, const A2 &a2, const A3 &a3, const A4 &a4, const A5 &a5,
+                            const A6 &a6) {
+    Lock lock(session_, timeout_);
+    return session_.call(method, a1, a2, a3, a4, a5, a6);
+  }
+  template <typename M, typename A1, typename A2, typename A3, typename A4, typename A5, typename A6, typename A7>
+  msgpack::rpc::future call(M method, const A1 &a1, const A2 &a2, const A3 &a3, const A4 &a4, const A5 &a5,
+                            const A6 &a6, const A7 &a7) {
+    Lock lock(session_, timeout_);
+    return session_.call(method, a1, a2, a3, a4, a5, a6, a7);
+  }
+  template <typename M, typename A1, typename A2, typename A3, typename A4, typename A5, typename A6, typename A7,
+            typename A8>
+  msgpack::rpc::future call(M method, const A1 &a1, const A2 &a2, const A3 &a3, const A4 &a4, const A5 &a5,
+                            const A6 &a6, const A7 &a7, const A8 &a8) {
+    Lock lock(session_, timeout_);
+    return session_.call(method, a1, a2, a3, a4, a5, a6, a7, a8);
+  }
+  template <typename M, typename A1, typename A2, typename A3, typename A4, typename A5, typename A6, typename A7,
+            typename A8, typename A9>
+  msgpack::rpc::future call(M method, const A1 &a1, const A2 &a2, const A3 &a3, const A4 &a4, const A5 &a5,
+                            const A6 &a6, const A7 &a7, const A8 &a8, const A9 &a9) {
+    Lock lock(session_, timeout_);
+    return session_.call(method, a1, a2, a3, a4, a5, a6, a7, a8, a9);
+  }
+
+  /**
+   * @breaf 通信エラー後の接続の切断
+   * @param session セッション
+   */
+  static void Close(msgpack::rpc::session &session) {
+    g_fuse_mutex.Lock();
+    session.close();
+    g_fuse_mutex.Unlock();
+  }
+
+ private:
+  // 送信中の g_fuse_mutex の確保 (タイムアウトは送信時に設定する)
+  class Lock {
+   public:
+    Lock(msgpack::rpc::session &session, unsigned int timeout) {
+      g_fuse_mutex.Lock();
+      session.set_timeout(timeout);
+    }
+    ~Lock() { g_fuse_mutex.Unlock(); }
+  };
+
+  msgpack::rpc::session &session_;
+  unsigned int timeout_;
+};
+
 /**
  * @breaf constractor
  */
-BurstBufferClient::BurstBufferClient() {
+BurstBufferClient::BurstBufferClient() : replica_seed_(0), loads_time_(0),
+                                         epoch_(0), membership_time_(0), is_membership_supported_(true) {
 	Thread::Init();
+	shm_mutex_.Init();
+	placement_mutex_.Init();
+	membership_mutex_.Init();
+	version_mutex_.Init();
+	protocol_mutex_.Init();
 }
 
 /**
@@ -98,6 +315,12 @@ BurstBufferClient::BurstBufferClient() {
  */
 BurstBufferClient::~BurstBufferClient() {
 	Thread::Release();
+
+	std::map<std::pair<std::string, uint16_t>, Compressor *>::iterator it;
+	for (it = compressors_.begin(); it != compressors_.end(); ++it) {
+		delete it->second;
+	}
+	compressors_.clear();
 }
 
 
@@ -137,8 +360,19 @@ DMSG("GetAttrExInternal [%s] \n", path);
   msgpack::rpc::client c(bb_host, bb_port);
 #endif
 
+  if (GetProtocol(bb_host, bb_port) >= CBB_PROTOCOL_V2) {
+    typedef msgpack::type::tuple<Error, CompactFileStat, std::string> CompactResult;
+    MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
+        CompactResult result = c.call(static_cast<int>(kGetAttr), std::string(path)).get<CompactResult>();
+        error = result.get<0>();
+        result.get<1>().ToFileStat(file_stat_ptr);
+        link_path = result.get<2>();
+    );
+    return error;
+  }
+
   typedef msgpack::type::tuple<Error, FileStat, std::string> Result;
-  MSGPACK_CLIENT_CALL(
+  MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
       Result result  = c.call(CODE(kGetAttr), std::string(path)).get<Result>();
       error = result.get<0>();
       *file_stat_ptr = result.get<1>();
@@ -220,7 +454,7 @@ Error BurstBufferClient::ReadLink(const char *path, char *buf, size_t size) {
       msgpack::rpc::auto_zone zone;
 
       typedef msgpack::type::tuple<Error, msgpack::type::raw_ref> Result;
-      MSGPACK_CLIENT_CALL(
+      MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
           Result result = c.call(CODE(kReadLink), std::string(path), size).get<Result>(&zone);
           error = result.get<0>();
           msgpack::type::raw_ref data = result.get<1>();
@@ -253,7 +487,7 @@ Error BurstBufferClient::MkDir(const char *path, mode_t mode) {
     msgpack::rpc::client c(info.host, info.port);
 #endif
 
-    MSGPACK_CLIENT_CALL(
+    MSGPACK_CLIENT_CALL(info.host, info.port, error,
         error = c.call(CODE(kMkDir), std::string(path), mode).get<Error>();
     );
   }
@@ -279,7 +513,7 @@ DMSG("UnlinkInternal [%s] \n", path);
       msgpack::rpc::client c(info.host, info.port);
 #endif
 
-      MSGPACK_CLIENT_CALL(
+      MSGPACK_CLIENT_CALL(info.host, info.port, error,
           error = c.call(CODE(kUnlink), std::string(path)).get<Error>();
       );
     }
@@ -292,15 +526,29 @@ DMSG("UnlinkInternal [%s] \n", path);
     if (error != kCBBSuccess)
       return error;
 
+    // ストライプのメンバーサーバーのファイルを先に削除する
+    std::vector<ServerInfo> members;
+    GetStripeMembers(path, &members);
+    BOOST_FOREACH(ServerInfo info, members) {
+      msgpack::rpc::session c = session_pool_.get_session(info.host, info.port);
+      MSGPACK_CLIENT_CALL(info.host, info.port, error,
+          c.call(CODE(kUnlink), std::string(path)).get<Error>();
+      );
+    }
+
 #ifdef USE_SESSION_POOL_FOR_IO
     msgpack::rpc::session c = session_pool_.get_session(bb_host, bb_port);
 #else
     msgpack::rpc::client c(bb_host, bb_port);
 #endif
 
-    MSGPACK_CLIENT_CALL(
+    MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
         error = c.call(CODE(kUnlink), std::string(path)).get<Error>();
     );
+
+    if (error == kCBBSuccess) {
+      ForgetPlacement(path, bb_host, bb_port);
+    }
   }
   
   return error;
@@ -352,7 +600,7 @@ Error BurstBufferClient::RmDir(const char *path) {
     msgpack::rpc::client c(info.host, info.port);
 #endif
 
-    MSGPACK_CLIENT_CALL(
+    MSGPACK_CLIENT_CALL(info.host, info.port, error,
         error = c.call(CODE(kRmDir), std::string(path)).get<Error>();
     );
   }
@@ -385,7 +633,7 @@ Error BurstBufferClient::Symlink(const char *path, const char *link) {
       msgpack::rpc::client c(info.host, info.port);
 #endif
 
-      MSGPACK_CLIENT_CALL(
+      MSGPACK_CLIENT_CALL(info.host, info.port, error,
           error = c.call(CODE(kSymlink), std::string(path), std::string(link)).get<Error>();
       );
     }
@@ -407,7 +655,7 @@ Error BurstBufferClient::Symlink(const char *path, const char *link) {
     msgpack::rpc::client c(bb_host, bb_port);
 #endif
 
-    MSGPACK_CLIENT_CALL(
+    MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
         error = c.call(CODE(kSymlink), std::string(path), link_path).get<Error>();
     );
   }
@@ -441,7 +689,7 @@ Error BurstBufferClient::Rename(const char *old_path, const char *new_path) {
       msgpack::rpc::client c(info.host, info.port);
 #endif
 
-      MSGPACK_CLIENT_CALL(
+      MSGPACK_CLIENT_CALL(info.host, info.port, error,
           error = c.call(CODE(kRename), std::string(old_path), std::string(new_path)).get<Error>();
       );
     }
@@ -454,15 +702,38 @@ Error BurstBufferClient::Rename(const char *old_path, const char *new_path) {
     if (error != kCBBSuccess)
       return error;
 
+    // 上書きされるファイルの配置先
+    std::string new_host;
+    uint16_t new_port = 0;
+    if (settings_.client_placement()) {
+      GetBurstBuffer(new_path, &new_host, &new_port);
+    }
+
+    // ストライプのメンバーサーバーのファイルも同じ名前に変更する
+    std::vector<ServerInfo> members;
+    GetStripeMembers(old_path, &members);
+    BOOST_FOREACH(ServerInfo info, members) {
+      msgpack::rpc::session c = session_pool_.get_session(info.host, info.port);
+      MSGPACK_CLIENT_CALL(info.host, info.port, error,
+          c.call(CODE(kRename), std::string(old_path), std::string(new_path)).get<Error>();
+      );
+    }
+
 #ifdef USE_SESSION_POOL_FOR_IO
     msgpack::rpc::session c = session_pool_.get_session(bb_host, bb_port);
 #else
     msgpack::rpc::client c(bb_host, bb_port);
 #endif
 
-    MSGPACK_CLIENT_CALL(
+    MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
         error = c.call(CODE(kRename), std::string(old_path), std::string(new_path)).get<Error>();
     );
+
+    // 名前を変えたファイルはSecondaryへ移るため、新しい名前はハッシュのサーバーで開く
+    if (error == kCBBSuccess) {
+      ForgetPlacement(old_path, bb_host, bb_port);
+      ForgetPlacement(new_path, new_host, new_port);
+    }
   }
 
   return error;
@@ -493,7 +764,7 @@ Error BurstBufferClient::Link(const char *path, const char *newpath) {
       msgpack::rpc::client c(info.host, info.port);
 #endif
 
-      MSGPACK_CLIENT_CALL(
+      MSGPACK_CLIENT_CALL(info.host, info.port, error,
           error = c.call(CODE(kLink), std::string(path), std::string(newpath)).get<Error>();
       );
     }
@@ -515,7 +786,7 @@ Error BurstBufferClient::Link(const char *path, const char *newpath) {
     msgpack::rpc::client c(bb_host, bb_port);
 #endif
 
-    MSGPACK_CLIENT_CALL(
+    MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
         error = c.call(CODE(kLink), std::string(path), link_path).get<Error>();
     );
   }
@@ -543,7 +814,7 @@ Error BurstBufferClient::Chmod(const char *path, mode_t mode) {
   msgpack::rpc::client c(bb_host, bb_port);
 #endif
 
-  MSGPACK_CLIENT_CALL(
+  MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
       error = c.call(CODE(kChmod), std::string(path), mode).get<Error>();
   );
 
@@ -571,7 +842,7 @@ Error BurstBufferClient::Chown(const char *path, uid_t uid, gid_t gid) {
   msgpack::rpc::client c(bb_host, bb_port);
 #endif
 
-  MSGPACK_CLIENT_CALL(
+  MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
       error = c.call(CODE(kChown), std::string(path), uid, gid).get<Error>();
   );
   
@@ -592,13 +863,22 @@ Error BurstBufferClient::Truncate(const char *path, off_t size) {
   if (error != kCBBSuccess)
     return error;
 
+  std::vector<ServerInfo> members;
+  GetStripeMembers(path, &members);
+  BOOST_FOREACH(ServerInfo info, members) {
+    msgpack::rpc::session c = session_pool_.get_session(info.host, info.port);
+    MSGPACK_CLIENT_CALL(info.host, info.port, error,
+        c.call(CODE(kTruncate), std::string(path), size).get<Error>();
+    );
+  }
+
 #ifdef USE_SESSION_POOL_FOR_IO
   msgpack::rpc::session c = session_pool_.get_session(bb_host, bb_port);
 #else
   msgpack::rpc::client c(bb_host, bb_port);
 #endif
 
-  MSGPACK_CLIENT_CALL(
+  MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
       error = c.call(CODE(kTruncate), std::string(path), size).get<Error>();
   );
  
@@ -615,33 +895,16 @@ Error BurstBufferClient::Truncate(const char *path, off_t size) {
  * @return Error値
  */
 Error BurstBufferClient::Open(const char* path, int flags, File *file_ptr) {
-  std::string bb_host;
-  uint16_t bb_port;
+  // ストライプ配置はオーナーサーバーが返す
+  Error error = OpenStripes(path, flags, 0, false, 0, 0, file_ptr);
 
-  Error error = GetBurstBuffer(path, &bb_host, &bb_port);
+  // サーバー構成が変わっていた場合は構成を取り直して開き直す
+  if (error == -ESTALE) {
+    RefreshMembership(true);
+    error = OpenStripes(path, flags, 0, false, 0, 0, file_ptr);
+  }
   if (error != kCBBSuccess)
     return error;
- 
-  file_ptr->path = path;
-  file_ptr->bb_host = bb_host;
-  file_ptr->bb_port = bb_port;
-
-#ifdef USE_SESSION_POOL_FOR_IO
-  msgpack::rpc::session c = session_pool_.get_session(bb_host, bb_port);
-#else
-  msgpack::rpc::client c(bb_host, bb_port);
-#endif
-
-  int fd = -1;
-  MSGPACK_CLIENT_CALL(
-      fd = c.call(CODE(kOpen), std::string(path), flags).get<int>();
-  );
-
-  if (fd < 0)
-    return static_cast<Error>(fd);
-
-  file_ptr->fd_org = fd;
-  file_ptr->fd = ((uint64_t)addr_to_binary(bb_host.c_str()) << 32) | fd;
 
   // 先読み開始
   StartPrevFileRead(path);
@@ -658,7 +921,19 @@ Error BurstBufferClient::Open(const char* path, int flags, File *file_ptr) {
  * @param ssize_ptr サイズ保存ポインタ
  * @return Error値
  */
-Error BurstBufferClient::Read(const File &file, char *buf, size_t size, off_t offset, ssize_t *ssize_ptr) {
+Error BurstBufferClient::Read(const File &owner_file, char *buf, size_t size, off_t offset, ssize_t *ssize_ptr) {
+  if (owner_file.is_striped()) {
+    return StripeTransfer(false, owner_file, buf, size, offset, ssize_ptr);
+  }
+
+  // レプリカがある場合はレプリカから読む
+  const File &file = owner_file.replica ? *owner_file.replica : owner_file;
+
+  Error error;
+  ShmClient *shm_client = GetShmClient(file.bb_host, file.bb_port);
+  if (shm_client != NULL && ShmTransfer(shm_client, kShmRead, file, buf, size, offset, ssize_ptr, &error)) {
+    return error;
+  }
 
 #ifdef USE_SESSION_POOL_FOR_IO
   msgpack::rpc::session c = session_pool_.get_session(file.bb_host, file.bb_port);
@@ -669,10 +944,43 @@ Error BurstBufferClient::Read(const File &file, char *buf, size_t size, off_t of
   ssize_t ssize = 0;
   msgpack::type::raw_ref raw;
   msgpack::rpc::auto_zone zone;
-  
+
+  // QoS分類は g_fuse_mutex の外で決める
+  int code = QosCode(file, kRead);
+
+  // 圧縮を決めたサーバーには圧縮方式を送り、サーバーが圧縮したかどうかを返す (v2のみ)
+  Compressor *compressor = file.handle != 0 ? GetCompressor(file.bb_host, file.bb_port) : NULL;
+  if (compressor != NULL && compressor->ShouldCompress(size)) {
+    int type = kCompressNone;
+
+    typedef msgpack::type::tuple<ssize_t, msgpack::type::raw_ref, int> CompressedResult;
+    MSGPACK_CLIENT_CALL(file.bb_host, file.bb_port, ssize,
+        CompressedResult result = c.call(code, file.handle, size, offset,
+                                         compressor->type()).get<CompressedResult>(&zone);
+        ssize = result.get<0>();
+        raw = result.get<1>();
+        type = result.get<2>();
+    );
+
+    if (ssize < 0)
+      return static_cast<Error>(ssize);
+
+    // 展開は g_fuse_mutex の外で行う
+    compressor->Record(type != kCompressNone);
+    if (type == kCompressNone) {
+      std::memcpy(buf, raw.ptr, std::min((size_t)raw.size, size));
+    } else if (Compressor::Decompress(type, raw.ptr, raw.size, buf, size) != ssize) {
+      return -EIO;
+    }
+
+    *ssize_ptr = ssize;
+    return kCBBSuccess;
+  }
+
   typedef msgpack::type::tuple<ssize_t, msgpack::type::raw_ref> Result;
-  MSGPACK_CLIENT_CALL(
-      Result result =  c.call(CODE(kRead), file.path, file.fd_org, size, offset).get<Result>(&zone);
+  MSGPACK_CLIENT_CALL(file.bb_host, file.bb_port, ssize,
+      Result result = (file.handle != 0 ? c.call(code, file.handle, size, offset)
+                                        : c.call(CODE(kRead), file.path, file.fd_org, size, offset)).get<Result>(&zone);
       ssize = result.get<0>();
       raw = result.get<1>();
   );
@@ -696,6 +1004,15 @@ Error BurstBufferClient::Read(const File &file, char *buf, size_t size, off_t of
  * @return Error値
  */
 Error BurstBufferClient::Write(const File &file, const char *buf, size_t size, off_t offset, ssize_t *ssize_ptr) {
+  if (file.is_striped()) {
+    return StripeTransfer(true, file, const_cast<char *>(buf), size, offset, ssize_ptr);
+  }
+
+  Error error;
+  ShmClient *shm_client = GetShmClient(file.bb_host, file.bb_port);
+  if (shm_client != NULL && ShmTransfer(shm_client, kShmWrite, file, const_cast<char *>(buf), size, offset, ssize_ptr, &error)) {
+    return error;
+  }
 
 #ifdef USE_SESSION_POOL_FOR_IO
   msgpack::rpc::session c = session_pool_.get_session(file.bb_host, file.bb_port);
@@ -706,8 +1023,30 @@ Error BurstBufferClient::Write(const File &file, const char *buf, size_t size, o
   msgpack::type::raw_ref raw(buf, size);
 
   ssize_t ssize = 0;
-  MSGPACK_CLIENT_CALL(
-      ssize = c.call(CODE(kWrite), file.path, file.fd_org, offset, raw).get<ssize_t>();
+  int code = QosCode(file, kWrite);
+
+  // 圧縮は g_fuse_mutex の外で行い、効かなかった場合はそのまま送る (v2のみ)
+  Compressor *compressor = file.handle != 0 ? GetCompressor(file.bb_host, file.bb_port) : NULL;
+  if (compressor != NULL && compressor->ShouldCompress(size)) {
+    std::vector<char> cbuf(Compressor::Bound(compressor->type(), size));
+    ssize_t csize = compressor->Compress(buf, size, &cbuf[0], cbuf.size());
+    if (csize > 0) {
+      msgpack::type::raw_ref craw(&cbuf[0], csize);
+      MSGPACK_CLIENT_CALL(file.bb_host, file.bb_port, ssize,
+          ssize = c.call(code, file.handle, offset, craw, compressor->type(), size).get<ssize_t>();
+      );
+
+      if (ssize < 0)
+        return static_cast<Error>(ssize);
+
+      *ssize_ptr = ssize;
+      return kCBBSuccess;
+    }
+  }
+
+  MSGPACK_CLIENT_CALL(file.bb_host, file.bb_port, ssize,
+      ssize = (file.handle != 0 ? c.call(code, file.handle, offset, raw)
+                                : c.call(CODE(kWrite), file.path, file.fd_org, offset, raw)).get<ssize_t>();
   );
 
   if (ssize < 0)
@@ -719,145 +1058,1079 @@ Error BurstBufferClient::Write(const File &file, const char *buf, size_t size, o
 }
 
 /**
- * @breaf StatFs
- * @param path ファイルパス
- * @param buf statvfs情報
- * @return Error値
+ * @breaf サーバーとのプロトコルの版を取得
+ *   初回に kHello (v1の文字列) で版を決めて記録する。kHello を持たない旧サーバーは v1 とする。
+ *   通信できなかった場合 (サーキットが開いている場合を含む) は HANDSHAKE_RETRY の間は v1 とし、
+ *   その後に決め直す。
+ * @param host サーバーのhost
+ * @param port サーバーのport
+ * @return 版 (CBB_PROTOCOL_V1 / CBB_PROTOCOL_V2)
  */
-Error BurstBufferClient::StatFs(const char *path, struct statvfs *buf) {
-  std::string bb_host;
-  uint16_t bb_port;
+int BurstBufferClient::GetProtocol(const std::string &host, uint16_t port) {
+  if (settings_.client_protocol() < CBB_PROTOCOL_V2) {
+    return CBB_PROTOCOL_V1;
+  }
 
-  Error error = GetBurstBuffer(path, &bb_host, &bb_port);
-  if (error != kCBBSuccess)
-    return error;
+  std::pair<std::string, uint16_t> key(host, port);
+  uint64_t now = get_time_msec();
 
-#ifdef USE_SESSION_POOL_FOR_IO
-  msgpack::rpc::session c = session_pool_.get_session(bb_host, bb_port);
-#else
-  msgpack::rpc::client c(bb_host, bb_port);
-#endif
+  protocol_mutex_.Lock();
+  std::map<std::pair<std::string, uint16_t>, int>::iterator it = protocols_.find(key);
+  if (it != protocols_.end()) {
+    int version = it->second;
+    protocol_mutex_.Unlock();
+    return version;
+  }
+  std::map<std::pair<std::string, uint16_t>, uint64_t>::iterator retry_it = protocol_retry_times_.find(key);
+  if (retry_it != protocol_retry_times_.end() && now < retry_it->second) {
+    protocol_mutex_.Unlock();
+    return CBB_PROTOCOL_V1;
+  }
+  protocol_mutex_.Unlock();
 
-  typedef msgpack::type::tuple<Error, StatVfs> Result;
-  MSGPACK_CLIENT_CALL(
-      Result result  = c.call(CODE(kStatFs), std::string(path)).get<Result>();
-      error = result.get<0>();
-      *buf = result.get<1>();
+  // 旧サーバーは kHello を持たないため、エラー応答 (remote_error) は v1 として記録する
+  int version = CBB_PROTOCOL_V1;
+  Error error = kCBBSuccess;
+  msgpack::rpc::session c = session_pool_.get_session(host, port);
+  MSGPACK_CLIENT_TRY(host, port, error,
+      try {
+        version = c.call(CODE(kHello), std::min(settings_.client_protocol(), CBB_PROTOCOL_VERSION)).get<int>();
+      } catch (msgpack::rpc::remote_error &e) {
+        version = CBB_PROTOCOL_V1;
+      }
   );
+  if (error != kCBBSuccess) {
+    version = CBB_PROTOCOL_V1;
+  }
 
-  return error;
+  DMSG("GetProtocol : %s:%d -> v%d%s\n", host.c_str(), port, version, error == kCBBSuccess ? "": " (retry)");
+
+  protocol_mutex_.Lock();
+  if (error == kCBBSuccess) {
+    protocols_[key] = version;
+    protocol_retry_times_.erase(key);
+  } else {
+    protocol_retry_times_[key] = now + HANDSHAKE_RETRY;
+  }
+  protocol_mutex_.Unlock();
+  return version;
 }
 
 /**
- * @breaf ファイルフラッシュ
- * @param file ファイル情報
- * @return Error値
+ * @breaf サーバーとの通信データの圧縮を取得
+ *   初回に kCompression で設定の圧縮方式を送り、サーバーが受け付けた方式を記録する。
+ *   kCompression を持たない旧サーバー、v1 のサーバーとは圧縮しない。
+ *   通信できなかった場合は HANDSHAKE_RETRY の間は圧縮せず、その後に問い合わせ直す。
+ * @param host サーバーのhost
+ * @param port サーバーのport
+ * @return 圧縮 (圧縮しない場合はNULL)
  */
-Error BurstBufferClient::Flush(const File &file) {
+Compressor *BurstBufferClient::GetCompressor(const std::string &host, uint16_t port) {
+  int type = Compressor::Parse(settings_.client_compression());
+  if (type <= kCompressNone || !Compressor::is_supported(type)) {
+    return NULL;
+  }
+  if (GetProtocol(host, port) < CBB_PROTOCOL_V2) {
+    return NULL;
+  }
 
-#ifdef USE_SESSION_POOL_FOR_IO
-  msgpack::rpc::session c = session_pool_.get_session(file.bb_host, file.bb_port);
-#else
-  msgpack::rpc::client c(file.bb_host, file.bb_port);
-#endif
+  std::pair<std::string, uint16_t> key(host, port);
+  uint64_t now = get_time_msec();
+
+  protocol_mutex_.Lock();
+  std::map<std::pair<std::string, uint16_t>, Compressor *>::iterator it = compressors_.find(key);
+  if (it != compressors_.end()) {
+    Compressor *compressor = it->second;
+    protocol_mutex_.Unlock();
+    return compressor;
+  }
+  std::map<std::pair<std::string, uint16_t>, uint64_t>::iterator retry_it = compressor_retry_times_.find(key);
+  if (retry_it != compressor_retry_times_.end() && now < retry_it->second) {
+    protocol_mutex_.Unlock();
+    return NULL;
+  }
+  protocol_mutex_.Unlock();
 
+  // kCompression を持たない旧サーバーのエラー応答 (remote_error) は圧縮しないとして記録する
+  int accepted = kCompressNone;
   Error error = kCBBSuccess;
-  MSGPACK_CLIENT_CALL(
-      error = c.call(CODE(kFlush), file.path, static_cast<int>(file.fd_org)).get<Error>();
+  msgpack::rpc::session c = session_pool_.get_session(host, port);
+  MSGPACK_CLIENT_TRY(host, port, error,
+      try {
+        accepted = c.call(static_cast<int>(kCompression), type).get<int>();
+      } catch (msgpack::rpc::remote_error &e) {
+        accepted = kCompressNone;
+      }
   );
 
-  return error;
+  DMSG("GetCompressor : %s:%d -> %s%s\n", host.c_str(), port, Compressor::name(accepted),
+       error == kCBBSuccess ? "": " (retry)");
+
+  if (error != kCBBSuccess) {
+    protocol_mutex_.Lock();
+    compressor_retry_times_[key] = now + HANDSHAKE_RETRY;
+    protocol_mutex_.Unlock();
+    return NULL;
+  }
+
+  Compressor *compressor = NULL;
+  if (accepted != kCompressNone && Compressor::is_supported(accepted)) {
+    compressor = new Compressor();
+    compressor->Init(accepted, settings_.client_compression_level(), settings_.client_compression_min_size());
+  }
+
+  protocol_mutex_.Lock();
+  compressor_retry_times_.erase(key);
+  it = compressors_.find(key);
+  if (it != compressors_.end()) {
+    // 他のスレッドが先に記録した場合はそちらを使う
+    delete compressor;
+    compressor = it->second;
+  } else {
+    compressors_[key] = compressor;
+  }
+  protocol_mutex_.Unlock();
+  return compressor;
 }
 
 /**
- * @breaf ファイル開放（クローズ）
- * @param file ファイル情報
- * @return Error値
+ * @breaf QoS分類に使うジョブIDの取得
+ *   設定ファイルにない場合はジョブスケジューラーの環境変数を使う。
+ * @param settings 設定
+ * @return ジョブID (空の場合は分類しない)
  */
-Error BurstBufferClient::Release(const File &file) {
-
-#ifdef USE_SESSION_POOL_FOR_IO
-  msgpack::rpc::session c = session_pool_.get_session(file.bb_host, file.bb_port);
-#else
-  msgpack::rpc::client c(file.bb_host, file.bb_port);
-#endif
-
-  Error error = kCBBSuccess;
-  MSGPACK_CLIENT_CALL(
-      error = c.call(CODE(kRelease), file.path, static_cast<int>(file.fd_org)).get<Error>();
-  );
+static std::string qos_job_id(Settings &settings) {
+  if (!settings.client_job_id().empty()) {
+    return settings.client_job_id();
+  }
 
-  return error;
+  const char *names[] = { "CBB_JOB_ID", "SLURM_JOB_ID", "PBS_JOBID", NULL };
+  for (int index = 0; names[index] != NULL; index++) {
+    const char *value = getenv(names[index]);
+    if (value != NULL && *value != '\0') {
+      return value;
+    }
+  }
+  return "";
 }
 
 /**
- * @breaf ファイル同期
- * @param file ファイル情報
- * @param datasync データ同期
- * @return Error値
+ * @breaf サーバーでのQoS分類を取得
+ *   初回に kQosClass でジョブIDを送り、サーバーが割り当てた分類を記録する。
+ *   kQosClass を持たない旧サーバー、QoSを使わないサーバーは分類なしの0を返す。
+ *   通信できなかった場合は HANDSHAKE_RETRY の間は分類なしとし、その後に問い合わせ直す。
+ * @param host サーバーのhost
+ * @param port サーバーのport
+ * @return 分類 (0の場合は分類なし)
  */
-Error BurstBufferClient::FSync(const File &file, int datasync) {
-
-#ifdef USE_SESSION_POOL_FOR_IO
-  msgpack::rpc::session c = session_pool_.get_session(file.bb_host, file.bb_port);
-#else
-  msgpack::rpc::client c(file.bb_host, file.bb_port);
-#endif
+int BurstBufferClient::GetQosClass(const std::string &host, uint16_t port) {
+  std::pair<std::string, uint16_t> key(host, port);
+  uint64_t now = get_time_msec();
+
+  protocol_mutex_.Lock();
+  std::map<std::pair<std::string, uint16_t>, int>::iterator it = qos_classes_.find(key);
+  if (it != qos_classes_.end()) {
+    int class_id = it->second;
+    protocol_mutex_.Unlock();
+    return class_id;
+  }
+  std::map<std::pair<std::string, uint16_t>, uint64_t>::iterator retry_it = qos_retry_times_.find(key);
+  if (retry_it != qos_retry_times_.end() && now < retry_it->second) {
+    protocol_mutex_.Unlock();
+    return 0;
+  }
+  protocol_mutex_.Unlock();
 
+  // kQosClass を持たない旧サーバーのエラー応答 (remote_error) は分類なしとして記録する
+  std::string job = qos_job_id(settings_);
+  int class_id = 0;
   Error error = kCBBSuccess;
-  MSGPACK_CLIENT_CALL(
-      error = c.call(CODE(kFSync), file.path, static_cast<int>(file.fd_org), datasync).get<Error>();
-  );
+  if (!job.empty()) {
+    msgpack::rpc::session c = session_pool_.get_session(host, port);
+    MSGPACK_CLIENT_TRY(host, port, error,
+        try {
+          class_id = c.call(static_cast<int>(kQosClass), job).get<int>();
+        } catch (msgpack::rpc::remote_error &e) {
+          class_id = 0;
+        }
+    );
+  }
 
-  return error;
+  // 上位ビットに収まらない分類は使わない
+  if (class_id < 0 || class_id > (INT_MAX >> CBB_QOS_CLASS_SHIFT)) {
+    class_id = 0;
+  }
+
+  DMSG("GetQosClass : %s:%d %s -> %d%s\n", host.c_str(), port, job.c_str(), class_id,
+       error == kCBBSuccess ? "": " (retry)");
+
+  protocol_mutex_.Lock();
+  if (error != kCBBSuccess) {
+    qos_retry_times_[key] = now + HANDSHAKE_RETRY;
+    class_id = 0;
+  } else {
+    qos_retry_times_.erase(key);
+    qos_classes_[key] = class_id;
+  }
+  protocol_mutex_.Unlock();
+  return class_id;
 }
 
+/**
+ * @breaf QoS分類を付けたv2のメソッドコード
+ * @param file ファイル情報
+ * @param code メソッドコード
+ * @return 分類を上位ビットに入れたコード (v1のファイルはそのまま)
+ */
+int BurstBufferClient::QosCode(const File &file, int code) {
+  if (file.handle == 0) {
+    return code;
+  }
+  return code | (GetQosClass(file.bb_host, file.bb_port) << CBB_QOS_CLASS_SHIFT);
+}
 
+/// 共有メモリ通信路 (サーバーごと)
+struct ShmClient {
+  ShmChannel channel;
+  Mutex mutex;
+};
 
 /**
- * @breaf ディレクトリリスト読み込み
- * @param path ファイルパス
- * @param offset オフセット
- * @param file_stats_ptr ファイル情報配列ポインタ
- * @return Error値
+ * @breaf 同一ホストのサーバーとの共有メモリ通信路を取得
+ *   初回に kShmAttach で通信路を作成し、開けなかった場合 (別ホスト、旧サーバー、通信エラー) は
+ *   SHM_ATTACH_RETRY の間はTCPを使い、その後に再接続を試す。
+ * @param host サーバーのhost
+ * @param port サーバーのport
+ * @return 通信路 (使えない場合はNULL)
  */
-Error BurstBufferClient::ReadDir(const char *path, off_t offset, FileStats *file_stats_ptr, int type) {
-  Error error;
+ShmClient *BurstBufferClient::GetShmClient(const std::string &host, uint16_t port) {
+  if (!settings_.client_shared_memory()) {
+    return NULL;
+  }
 
-  file_stats_ptr->clear();
+  std::string key = (boost::format("%1%:%2%") % host % port).str();
 
-  BOOST_FOREACH(ServerInfo info, select_server_.server_list()) {
-#ifdef USE_SESSION_POOL_FOR_IO
-    msgpack::rpc::session c = session_pool_.get_session(info.host, info.port);
-#else
-    msgpack::rpc::client c(info.host, info.port);
-#endif
+  shm_mutex_.Lock();
 
-    FileStats file_stats;
+  std::map<std::string, ShmClient *>::iterator it = shm_clients_.find(key);
+  if (it != shm_clients_.end()) {
+    ShmClient *shm_client = it->second;
+    shm_mutex_.Unlock();
+    return shm_client;
+  }
 
-    typedef msgpack::type::tuple<Error, FileStats> Result;
-    MSGPACK_CLIENT_CALL(
-      Result result = c.call(CODE(kReadDir), std::string(path), offset, type).get<Result>();
+  uint64_t now = get_time_msec();
+  std::map<std::string, uint64_t>::iterator retry_it = shm_retry_times_.find(key);
+  if (retry_it != shm_retry_times_.end() && now < retry_it->second) {
+    shm_mutex_.Unlock();
+    return NULL;
+  }
+
+  int class_id = GetQosClass(host, port);
+
+  Error error = kCBBSuccess;
+  std::string name;
+  uint64_t nonce = 0;
+
+  // 旧サーバー (kShmAttach がない)、停止中のサーバーはTCPを使うため再実行しない
+  msgpack::rpc::session c = session_pool_.get_session(host, port);
+  typedef msgpack::type::tuple<Error, std::string, uint64_t> Result;
+  MSGPACK_CLIENT_TRY(host, port, error,
+      Result result = c.call(CODE(kShmAttach), class_id).get<Result>();
       error = result.get<0>();
-      file_stats = result.get<1>();
-    );
+      name = result.get<1>();
+      nonce = result.get<2>();
+  );
 
-    file_stats_ptr->insert(file_stats.begin(), file_stats.end());
+  ShmClient *shm_client = NULL;
+  if (error == kCBBSuccess) {
+    shm_client = new ShmClient;
+    shm_client->mutex.Init();
+    if (shm_client->channel.Attach(name, nonce) != kCBBSuccess) {
+      delete shm_client;
+      shm_client = NULL;
+    }
   }
+  DMSG("GetShmClient : %s -> %s\n", key.c_str(), shm_client != NULL ? name.c_str(): "tcp");
 
-  return error;
+  if (shm_client != NULL) {
+    shm_clients_[key] = shm_client;
+    shm_retry_times_.erase(key);
+  } else {
+    shm_retry_times_[key] = now + SHM_ATTACH_RETRY;
+  }
+  shm_mutex_.Unlock();
+
+  return shm_client;
 }
 
 /**
- * @breaf ディレクトリ同期
- * @param path ディレクトリパス
- * @param datasync データ同期
- * @param file ファイル情報
- * @return Error値
+ * @breaf 使えなくなった共有メモリ通信路を外す (次回の入出力で再接続を試す)
+ *   他のスレッドが参照中の可能性があるため、破棄は Destroy で行う。
+ * @param host サーバーのhost
+ * @param port サーバーのport
+ * @param shm_client 通信路
  */
-Error BurstBufferClient::FSyncDir(const char *path, int datasync, const File &file) {
-  Error error;
+void BurstBufferClient::RetireShmClient(const std::string &host, uint16_t port, ShmClient *shm_client) {
+  std::string key = (boost::format("%1%:%2%") % host % port).str();
+
+  shm_mutex_.Lock();
+  std::map<std::string, ShmClient *>::iterator it = shm_clients_.find(key);
+  if (it != shm_clients_.end() && it->second == shm_client) {
+    shm_clients_.erase(it);
+    shm_retired_clients_.push_back(shm_client);
+  }
+  shm_mutex_.Unlock();
+}
 
+/**
+ * @breaf 共有メモリ経由の読み書き
+ *   データ領域をリングのスロット数に分割し、転送をチャンク単位の要求に分けて
+ *   まとめて投入してから応答を待つ。
+ * @param shm_client 通信路
+ * @param op kShmRead / kShmWrite
+ * @param file ファイル情報
+ * @param buf バッファポインタ
+ * @param size サイズ
+ * @param offset オフセット
+ * @param ssize_ptr サイズ保存ポインタ
+ * @param error_ptr Error値保存ポインタ
+ * @return bool 処理できたかどうか (falseの場合はTCPで再実行する)
+ *   Client.rpc_deadline までに応答がない場合は通信路を外し、-ETIMEDOUT を返す。
+ */
+bool BurstBufferClient::ShmTransfer(ShmClient *shm_client, int op, const File &file, char *buf, size_t size, off_t offset, ssize_t *ssize_ptr, Error *error_ptr) {
+  ShmChannel &channel = shm_client->channel;
+  uint64_t chunk_size = channel.chunk_size();
+  int64_t results[SHM_RING_SLOTS];
+  bool is_done = true;
+  bool is_end = false;
+  ssize_t total = 0;
+
+  bool is_timeout = false;
+
+  *error_ptr = kCBBSuccess;
+
+  shm_client->mutex.Lock();
+
+  uint64_t deadline = get_time_msec() + settings_.client_rpc_deadline();
+
+  size_t pos = 0;
+  while (pos < size && !is_end) {
+    int count = 0;
+    for (; count < SHM_RING_SLOTS && pos + count * chunk_size < size; count++) {
+      ShmRequest request;
+      request.tag = count;
+      request.op = op;
+      request.fd = file.fd_org;
+      request.offset = offset + pos + count * chunk_size;
+      request.size = std::min<uint64_t>(chunk_size, size - (pos + count * chunk_size));
+      request.data_offset = count * chunk_size;
+      if (op == kShmWrite) {
+        std::memcpy(channel.data(request.data_offset), buf + pos + count * chunk_size, request.size);
+      }
+      channel.PushRequest(request);
+    }
+
+    int received = 0;
+    while (received < count) {
+      ShmResponse response;
+      if (channel.PopResponse(&response)) {
+        results[response.tag] = response.result;
+        received++;
+      } else if (!channel.WaitResponse(SHM_RESPONSE_WAIT) || channel.header()->is_closed) {
+        // サーバーの停止を確認する
+        ShmChannelHeader *header = channel.header();
+        if (header->is_closed || (kill(header->server_pid, 0) != 0 && errno == ESRCH)) {
+          is_done = false;
+          break;
+        }
+        // 応答しないサーバー (処理スレッドの停止等) は待ち続けない
+        if (get_time_msec() >= deadline) {
+          is_timeout = true;
+          break;
+        }
+      }
+    }
+    if (!is_done || is_timeout) {
+      break;
+    }
+
+    // 短い転送 (EOF等) やエラー以降のチャンクは捨てる
+    for (int index = 0; index < count && !is_end; index++) {
+      uint64_t request_size = std::min<uint64_t>(chunk_size, size - (pos + index * chunk_size));
+      if (results[index] < 0) {
+        *error_ptr = static_cast<Error>(results[index]);
+        is_end = true;
+        break;
+      }
+      if (op == kShmRead) {
+        std::memcpy(buf + pos + index * chunk_size, channel.data(index * chunk_size), results[index]);
+      }
+      total += results[index];
+      if ((uint64_t)results[index] < request_size) {
+        is_end = true;
+      }
+    }
+    pos += count * chunk_size;
+  }
+
+  shm_client->mutex.Unlock();
+
+  if (!is_done) {
+    RetireShmClient(file.bb_host, file.bb_port, shm_client);
+    return false;
+  }
+  if (is_timeout) {
+    // 応答が後から届く可能性があるため、この通信路は再利用しない
+    RetireShmClient(file.bb_host, file.bb_port, shm_client);
+    *error_ptr = -ETIMEDOUT;
+    return true;
+  }
+
+  if (*error_ptr == kCBBSuccess) {
+    *ssize_ptr = total;
+  }
+  return true;
+}
+
+/**
+ * @breaf ストライプのメンバーサーバー (オーナー以外) を取得
+ *   ストライプを使わない設定 (Client.stripe_size = 0) の場合は問い合わせない。
+ * @param path ファイルパス
+ * @param members_ptr メンバーサーバー保存ポインタ
+ * @return Error値
+ */
+Error BurstBufferClient::GetStripeMembers(const char *path, std::vector<ServerInfo> *members_ptr) {
+  members_ptr->clear();
+  if (settings_.client_stripe_size() == 0) {
+    return kCBBSuccess;
+  }
+
+  std::string bb_host;
+  uint16_t bb_port;
+
+  Error error = GetBurstBuffer(path, &bb_host, &bb_port);
+  if (error != kCBBSuccess)
+    return error;
+
+  msgpack::rpc::session c = session_pool_.get_session(bb_host, bb_port);
+
+  int stripe_count = 0;
+  typedef msgpack::type::tuple<Error, uint64_t, int> Result;
+  MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
+      Result result = c.call(CODE(kGetStripe), std::string(path)).get<Result>();
+      error = result.get<0>();
+      stripe_count = result.get<1>() > 0 ? result.get<2>() : 0;
+  );
+
+  if (error == kCBBSuccess && stripe_count > 1) {
+    select_server_.GetStripeInfo(path, stripe_count, *members_ptr);
+    members_ptr->erase(members_ptr->begin());
+  }
+
+  return error;
+}
+
+/**
+ * @breaf ストライプ配置付きのファイルオープン
+ *   オーナーサーバー (ストライプ番号0) で開いた後、メンバーサーバーでそれぞれの番号を指定して開く。
+ *   既存ファイルを開く場合 (create = false) は、オーナーサーバーが返した配置を使う。
+ * @param path ファイルパス
+ * @param flags フラグ
+ * @param mode モード値
+ * @param create ファイルを作成するかどうか
+ * @param stripe_size ストライプサイズ
+ * @param stripe_count ストライプ数 (0の場合は全サーバー)
+ * @param file_ptr ファイル情報ポインタ
+ * @return Error値
+ */
+Error BurstBufferClient::OpenStripes(const char *path, int flags, mode_t mode, bool create, uint64_t stripe_size, int stripe_count, File *file_ptr) {
+  RefreshMembership(false);
+
+  std::vector<ServerInfo> servers;
+  select_server_.GetStripeInfo(path, create ? stripe_count : 1, servers);
+  if (servers.empty())
+    return kCBBUnknownError;
+
+  // 既存ファイルは配置ディレクトリの配置先で開く (ストライプされたファイルはハッシュのサーバーのまま)
+  if (!create && settings_.client_placement()) {
+    std::string bb_host;
+    uint16_t bb_port;
+    GetBurstBuffer(path, &bb_host, &bb_port);
+    servers[0] = ServerInfo(bb_host.c_str(), bb_port);
+  }
+
+  // ストライプ数は実際のサーバー数に合わせる
+  stripe_count = servers.size();
+  if (stripe_count < 2) {
+    stripe_size = 0;
+  }
+
+  file_ptr->path = path;
+  file_ptr->bb_host = servers[0].host;
+  file_ptr->bb_port = servers[0].port;
+  file_ptr->stripe_size = 0;
+  file_ptr->stripes.clear();
+  file_ptr->replica.reset();
+
+  file_ptr->version = FileVersion();
+  file_ptr->keep_cache = false;
+  file_ptr->handle = 0;
+
+  uint64_t replica_version = 0;
+  int replica_count = 0;
+  bool is_replicate = false;
+
+  Error error = kCBBSuccess;
+  for (int index = 0; index < stripe_count; index++) {
+    if (index == 1 && !create) {
+      // オーナーが返した配置でメンバーを決める
+      select_server_.GetStripeInfo(path, stripe_count, servers);
+    }
+    if (index >= (int)servers.size())
+      break;
+
+    msgpack::rpc::session c = session_pool_.get_session(servers[index].host, servers[index].port);
+
+    int fd = -1;
+    uint64_t handle = 0;
+    typedef msgpack::type::tuple<int, uint64_t, int> Result;
+    MSGPACK_CLIENT_CALL(servers[index].host, servers[index].port, fd,
+        msgpack::rpc::future future = c.call(CODE(kStripeOpen), std::string(path), flags, mode, static_cast<int>(create),
+                                             stripe_size, stripe_count, index, epoch_);
+        // 旧サーバーは後ろの要素 (レプリカ、ファイルの版、ハンドル) を返さないため、0 (なし) とする
+        msgpack::object object = future.get<msgpack::object>();
+        Result result;
+        object.convert(&result);
+        fd = result.get<0>();
+        handle = optional_uint(object, 8);
+        if (index == 0 && !create) {
+          stripe_size = result.get<1>();
+          stripe_count = stripe_size > 0 ? std::max(result.get<2>(), 1) : 1;
+          replica_version = optional_uint(object, 3);
+          replica_count = optional_uint(object, 4);
+          is_replicate = optional_uint(object, 5) != 0;
+          file_ptr->version.mtime = optional_uint(object, 6);
+          file_ptr->version.generation = optional_uint(object, 7);
+        }
+    );
+
+    if (fd < 0) {
+      error = static_cast<Error>(fd);
+      break;
+    }
+
+    StripeMember member;
+    member.bb_host = servers[index].host;
+    member.bb_port = servers[index].port;
+    member.fd_org = fd;
+    file_ptr->stripes.push_back(member);
+    if (index == 0) {
+      file_ptr->handle = handle;
+    }
+  }
+
+  // 配置に必要なサーバーがそろわない場合は読み書きできない
+  if (error == kCBBSuccess && (int)file_ptr->stripes.size() < stripe_count) {
+    error = -EIO;
+  }
+
+  if (error != kCBBSuccess || file_ptr->stripes.empty()) {
+    // 開いたファイルを閉じる
+    StripeCall(kRelease, *file_ptr, 0, 0);
+    if (!file_ptr->stripes.empty()) {
+      msgpack::rpc::session c = session_pool_.get_session(file_ptr->bb_host, file_ptr->bb_port);
+      Error release_error = kCBBSuccess;
+      MSGPACK_CLIENT_CALL(file_ptr->bb_host, file_ptr->bb_port, release_error,
+          c.call(CODE(kRelease), file_ptr->path, static_cast<int>(file_ptr->stripes[0].fd_org)).get<Error>();
+      );
+    }
+    file_ptr->stripes.clear();
+    return error != kCBBSuccess ? error : kCBBUnknownError;
+  }
+
+  file_ptr->fd_org = file_ptr->stripes[0].fd_org;
+  file_ptr->fd = ((uint64_t)addr_to_binary(file_ptr->bb_host.c_str()) << 32) | file_ptr->fd_org;
+  if (file_ptr->is_striped() || GetProtocol(file_ptr->bb_host, file_ptr->bb_port) < CBB_PROTOCOL_V2) {
+    file_ptr->handle = 0;
+  }
+  if (file_ptr->is_striped()) {
+    file_ptr->stripe_size = stripe_size;
+  } else {
+    file_ptr->stripes.clear();
+    if (replica_version > 0 && replica_count > 0 && (flags & O_ACCMODE) == O_RDONLY) {
+      OpenReplica(path, replica_version, replica_count, is_replicate, file_ptr);
+    }
+    if (!create && settings_.client_keep_cache()) {
+      file_ptr->keep_cache = CheckVersion(path, file_ptr->version);
+    }
+  }
+
+  return kCBBSuccess;
+}
+
+/**
+ * @breaf ファイルの版が前回のオープンから変わっていないかどうか (今回の版を記録する)
+ *   変わっていなければカーネルのページキャッシュをそのまま使える。
+ *   他のクライアントの変更は次のオープンで版が変わって検出する (close-to-open 一貫性)。
+ * @param path ファイルパス
+ * @param version 今回のオープンで返された版
+ * @return bool 変わっていないかどうか
+ */
+bool BurstBufferClient::CheckVersion(const std::string &path, const FileVersion &version) {
+  if (!version.is_valid()) {
+    return false;
+  }
+
+  version_mutex_.Lock();
+  std::map<std::string, FileVersion>::iterator it = versions_.find(path);
+  bool is_same = it != versions_.end() && it->second == version;
+  if (it != versions_.end()) {
+    it->second = version;
+  } else {
+    if (versions_.size() >= FILE_VERSION_MAX) {
+      versions_.clear();
+    }
+    versions_.insert(std::make_pair(path, version));
+  }
+  version_mutex_.Unlock();
+
+  return is_same;
+}
+
+/**
+ * @breaf 読み込みに使うレプリカの選択とオープン
+ *   オーナーと複製先サーバーの中から、ランク (なければプロセスID) とパスで決まるサーバーを選ぶ。
+ *   レプリカがまだない、版が違う場合はオーナーのファイルをそのまま使う。
+ * @param path ファイルパス
+ * @param version レプリカの版
+ * @param count 複製先サーバー数
+ * @param is_replicate 複製先サーバーに複製を依頼するかどうか
+ * @param file_ptr ファイル情報ポインタ (オーナーで開いたもの)
+ */
+void BurstBufferClient::OpenReplica(const char *path, uint64_t version, int count, bool is_replicate, File *file_ptr) {
+  std::vector<ServerInfo> servers;
+  select_server_.GetStripeInfo(path, count + 1, servers);
+  if (servers.size() < 2)
+    return;
+
+  // 複製の依頼 (応答は待たない)
+  if (is_replicate) {
+    for (size_t index = 1; index < servers.size(); index++) {
+      if (server_health_.is_open(servers[index].host, servers[index].port, get_time_msec()))
+        continue;
+      g_fuse_mutex.Lock();
+      try {
+        msgpack::rpc::session c = session_pool_.get_session(servers[index].host, servers[index].port);
+        c.notify(CODE(kReplicate), std::string(path), version, file_ptr->bb_host, static_cast<int>(file_ptr->bb_port));
+      } catch (msgpack::rpc::rpc_error &e) {
+        std::cerr << e.what() << std::endl;
+      }
+      g_fuse_mutex.Unlock();
+    }
+    return;
+  }
+
+  uint64_t slot = replica_seed_;
+  for (const char *ptr = path; *ptr != '\0'; ptr++) {
+    slot = slot * 31 + (unsigned char)*ptr;
+  }
+  slot %= servers.size();
+  if (slot == 0)
+    return;
+
+  // 旧サーバー、停止中のサーバーではオーナーを使い続けるため再実行しない
+  int fd = -1;
+  msgpack::rpc::session c = session_pool_.get_session(servers[slot].host, servers[slot].port);
+  MSGPACK_CLIENT_TRY(servers[slot].host, servers[slot].port, fd,
+      fd = c.call(CODE(kReplicaOpen), std::string(path), version).get<int>();
+  );
+
+  DMSG("OpenReplica : %s (%lu) -> %s:%d fd:%d\n", path, version, servers[slot].host.c_str(), servers[slot].port, fd);
+
+  if (fd < 0)
+    return;
+
+  File *replica = new File;
+  replica->path = path;
+  replica->bb_host = servers[slot].host;
+  replica->bb_port = servers[slot].port;
+  replica->fd_org = fd;
+  replica->fd = ((uint64_t)addr_to_binary(replica->bb_host.c_str()) << 32) | fd;
+  file_ptr->replica.reset(replica);
+}
+
+/**
+ * @breaf ストライプされたファイルの読み書き
+ *   要求をストライプ単位に分割し、担当サーバーへの呼び出しをすべて発行してから結果を待つ。
+ *   各サーバーのファイルは論理オフセットそのままの位置にデータを持つ (担当外の範囲は穴になる)。
+ * @param is_write 書き込みかどうか
+ * @param file ファイル情報
+ * @param buf バッファポインタ
+ * @param size サイズ
+ * @param offset オフセット
+ * @param ssize_ptr サイズ保存ポインタ
+ * @return Error値
+ */
+Error BurstBufferClient::StripeTransfer(bool is_write, const File &file, char *buf, size_t size, off_t offset, ssize_t *ssize_ptr) {
+  std::vector<size_t> positions;
+  std::vector<size_t> lengths;
+  std::vector<ssize_t> results;
+  std::vector<msgpack::rpc::future> futures;
+  uint64_t stripe_count = file.stripes.size();
+
+  for (size_t pos = 0; pos < size;) {
+    uint64_t current = offset + pos;
+    size_t length = std::min<uint64_t>(size - pos, file.stripe_size - current % file.stripe_size);
+    positions.push_back(pos);
+    lengths.push_back(length);
+    pos += length;
+  }
+  results.resize(positions.size(), 0);
+
+  Error error = kCBBSuccess;
+  msgpack::rpc::auto_zone zone;
+  std::vector<const StripeMember *> members;
+  unsigned int timeout = RpcRetry::attempt_timeout(settings_);
+  uint64_t now = get_time_msec();
+
+  // 停止中のサーバー (サーキットが開いている) があるストライプは読み書きできない
+  for (size_t index = 0; index < positions.size(); index++) {
+    uint64_t current = offset + positions[index];
+    const StripeMember &member = file.stripes[(current / file.stripe_size) % stripe_count];
+    if (server_health_.is_open(member.bb_host, member.bb_port, now))
+      return -EHOSTDOWN;
+    members.push_back(&member);
+  }
+
+  // 呼び出しはすべて発行してから、g_fuse_mutex を確保せずに応答を待つ
+  try {
+    for (size_t index = 0; index < positions.size(); index++) {
+      uint64_t current = offset + positions[index];
+      const StripeMember &member = *members[index];
+      msgpack::rpc::session session = session_pool_.get_session(member.bb_host, member.bb_port);
+      RpcSession c(session, timeout);
+      if (is_write) {
+        msgpack::type::raw_ref raw(buf + positions[index], lengths[index]);
+        futures.push_back(c.call(CODE(kWrite), file.path, member.fd_org, static_cast<off_t>(current), raw));
+      } else {
+        futures.push_back(c.call(CODE(kRead), file.path, member.fd_org, lengths[index], static_cast<off_t>(current)));
+      }
+    }
+  } catch (msgpack::rpc::rpc_error &e) {
+    std::cerr << e.what() << std::endl;
+    error = -EIO;
+  }
+
+  typedef msgpack::type::tuple<ssize_t, msgpack::type::raw_ref> Result;
+  for (size_t index = 0; index < futures.size(); index++) {
+    const StripeMember &member = *members[index];
+    try {
+      if (is_write) {
+        results[index] = futures[index].get<ssize_t>();
+      } else {
+        Result result = futures[index].get<Result>(&zone);
+        results[index] = result.get<0>();
+        if (results[index] > 0) {
+          std::memcpy(buf + positions[index], result.get<1>().ptr, results[index]);
+        }
+      }
+      server_health_.Success(member.bb_host, member.bb_port);
+    } catch (msgpack::rpc::remote_error &e) {
+      std::cerr << e.what() << std::endl;
+      error = -EIO;
+    } catch (msgpack::rpc::timeout_error &e) {
+      std::cerr << e.what() << std::endl;
+      server_health_.Failure(member.bb_host, member.bb_port, get_time_msec());
+      error = -ETIMEDOUT;
+    } catch (msgpack::rpc::rpc_error &e) {
+      std::cerr << e.what() << std::endl;
+      server_health_.Failure(member.bb_host, member.bb_port, get_time_msec());
+      error = -EIO;
+    }
+  }
+
+  if (error != kCBBSuccess)
+    return error;
+
+  size_t end = 0;
+  for (size_t index = 0; index < results.size(); index++) {
+    if (results[index] < 0)
+      return static_cast<Error>(results[index]);
+    if (results[index] > 0) {
+      end = positions[index] + results[index];
+    }
+  }
+
+  if (!is_write) {
+    // 後ろにデータがある短い読み込みは穴なので0で埋める
+    for (size_t index = 0; index < results.size() && positions[index] < end; index++) {
+      size_t hole_end = std::min(positions[index] + lengths[index], end);
+      size_t data_end = positions[index] + results[index];
+      if (data_end < hole_end) {
+        std::memset(buf + data_end, 0, hole_end - data_end);
+      }
+    }
+  }
+
+  *ssize_ptr = end;
+  return kCBBSuccess;
+}
+
+/**
+ * @breaf ストライプのメンバーサーバー (オーナー以外) に同じ操作を実行
+ * @param code kFlush / kRelease / kFSync / kFTruncate
+ * @param file ファイル情報
+ * @param datasync データ同期 (kFSync)
+ * @param size サイズ (kFTruncate)
+ * @return Error値 (最初に失敗したもの)
+ */
+Error BurstBufferClient::StripeCall(int code, const File &file, int datasync, off_t size) {
+  Error result = kCBBSuccess;
+
+  for (size_t index = 1; index < file.stripes.size(); index++) {
+    const StripeMember &member = file.stripes[index];
+    msgpack::rpc::session c = session_pool_.get_session(member.bb_host, member.bb_port);
+
+    Error error = kCBBSuccess;
+    switch (code) {
+      case kFlush:
+        MSGPACK_CLIENT_CALL(member.bb_host, member.bb_port, error,
+            error = c.call(CODE(kFlush), file.path, static_cast<int>(member.fd_org)).get<Error>();
+        );
+        break;
+      case kRelease:
+        MSGPACK_CLIENT_CALL(member.bb_host, member.bb_port, error,
+            error = c.call(CODE(kRelease), file.path, static_cast<int>(member.fd_org)).get<Error>();
+        );
+        break;
+      case kFSync:
+        MSGPACK_CLIENT_CALL(member.bb_host, member.bb_port, error,
+            error = c.call(CODE(kFSync), file.path, static_cast<int>(member.fd_org), datasync).get<Error>();
+        );
+        break;
+      case kFTruncate:
+        MSGPACK_CLIENT_CALL(member.bb_host, member.bb_port, error,
+            error = c.call(CODE(kFTruncate), file.path, member.fd_org, size).get<Error>();
+        );
+        break;
+      default:
+        error = kCBBUnknownError;
+        break;
+    }
+
+    if (error != kCBBSuccess && result == kCBBSuccess) {
+      result = error;
+    }
+  }
+
+  return result;
+}
+
+/**
+ * @breaf ストライプされたファイルの論理サイズ取得
+ * @param file ファイル情報
+ * @param size_ptr 論理サイズ (全サーバーの最大サイズ) 保存ポインタ
+ * @param owner_size_ptr オーナーサーバーのファイルサイズ保存ポインタ
+ * @return Error値
+ */
+Error BurstBufferClient::GetStripeFileSize(const File &file, off_t *size_ptr, off_t *owner_size_ptr) {
+  *size_ptr = 0;
+  *owner_size_ptr = 0;
+
+  for (size_t index = 0; index < file.stripes.size(); index++) {
+    const StripeMember &member = file.stripes[index];
+    msgpack::rpc::session c = session_pool_.get_session(member.bb_host, member.bb_port);
+
+    Error error = kCBBSuccess;
+    FileStat file_stat;
+    typedef msgpack::type::tuple<Error, FileStat> Result;
+    MSGPACK_CLIENT_CALL(member.bb_host, member.bb_port, error,
+        Result result = c.call(CODE(kFGetAttr), file.path, member.fd_org).get<Result>();
+        error = result.get<0>();
+        file_stat = result.get<1>();
+    );
+    if (error != kCBBSuccess)
+      return error;
+
+    *size_ptr = std::max(*size_ptr, file_stat.st_size);
+    if (index == 0) {
+      *owner_size_ptr = file_stat.st_size;
+    }
+  }
+
+  return kCBBSuccess;
+}
+
+/**
+ * @breaf StatFs
+ * @param path ファイルパス
+ * @param buf statvfs情報
+ * @return Error値
+ */
+Error BurstBufferClient::StatFs(const char *path, struct statvfs *buf) {
+  std::string bb_host;
+  uint16_t bb_port;
+
+  Error error = GetBurstBuffer(path, &bb_host, &bb_port);
+  if (error != kCBBSuccess)
+    return error;
+
+#ifdef USE_SESSION_POOL_FOR_IO
+  msgpack::rpc::session c = session_pool_.get_session(bb_host, bb_port);
+#else
+  msgpack::rpc::client c(bb_host, bb_port);
+#endif
+
+  typedef msgpack::type::tuple<Error, StatVfs> Result;
+  MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
+      Result result  = c.call(CODE(kStatFs), std::string(path)).get<Result>();
+      error = result.get<0>();
+      *buf = result.get<1>();
+  );
+
+  return error;
+}
+
+/**
+ * @breaf ファイルフラッシュ
+ * @param file ファイル情報
+ * @return Error値
+ */
+Error BurstBufferClient::Flush(const File &file) {
+
+#ifdef USE_SESSION_POOL_FOR_IO
+  msgpack::rpc::session c = session_pool_.get_session(file.bb_host, file.bb_port);
+#else
+  msgpack::rpc::client c(file.bb_host, file.bb_port);
+#endif
+
+  Error error = StripeCall(kFlush, file, 0, 0);
+  MSGPACK_CLIENT_CALL(file.bb_host, file.bb_port, error,
+      error = (file.handle != 0 ? c.call(static_cast<int>(kFlush), file.handle)
+                                : c.call(CODE(kFlush), file.path, static_cast<int>(file.fd_org))).get<Error>();
+  );
+
+  return error;
+}
+
+/**
+ * @breaf ファイル開放（クローズ）
+ * @param file ファイル情報
+ * @return Error値
+ */
+Error BurstBufferClient::Release(const File &file) {
+
+#ifdef USE_SESSION_POOL_FOR_IO
+  msgpack::rpc::session c = session_pool_.get_session(file.bb_host, file.bb_port);
+#else
+  msgpack::rpc::client c(file.bb_host, file.bb_port);
+#endif
+
+  Error error = kCBBSuccess;
+  if (file.replica) {
+    // レプリカを閉じられなくてもオーナーのファイルは閉じる
+    msgpack::rpc::session c = session_pool_.get_session(file.replica->bb_host, file.replica->bb_port);
+    Error replica_error = kCBBSuccess;
+    MSGPACK_CLIENT_TRY(file.replica->bb_host, file.replica->bb_port, replica_error,
+        replica_error = c.call(CODE(kRelease), file.path, static_cast<int>(file.replica->fd_org)).get<Error>();
+    );
+  }
+
+  if (file.is_striped()) {
+    // 論理サイズ (メンバーの最大サイズ) をオーナーのファイルに反映してから閉じる
+    off_t size = 0;
+    off_t owner_size = 0;
+    if (GetStripeFileSize(file, &size, &owner_size) == kCBBSuccess && owner_size < size) {
+      MSGPACK_CLIENT_CALL(file.bb_host, file.bb_port, error,
+          c.call(CODE(kFTruncate), file.path, file.fd_org, size).get<Error>();
+      );
+    }
+    StripeCall(kRelease, file, 0, 0);
+  }
+
+  MSGPACK_CLIENT_CALL(file.bb_host, file.bb_port, error,
+      error = (file.handle != 0 ? c.call(static_cast<int>(kRelease), file.handle)
+                                : c.call(CODE(kRelease), file.path, static_cast<int>(file.fd_org))).get<Error>();
+  );
+
+  return error;
+}
+
+/**
+ * @breaf ファイル同期
+ * @param file ファイル情報
+ * @param datasync データ同期
+ * @return Error値
+ */
+Error BurstBufferClient::FSync(const File &file, int datasync) {
+
+#ifdef USE_SESSION_POOL_FOR_IO
+  msgpack::rpc::session c = session_pool_.get_session(file.bb_host, file.bb_port);
+#else
+  msgpack::rpc::client c(file.bb_host, file.bb_port);
+#endif
+
+  Error error = StripeCall(kFSync, file, datasync, 0);
+  if (error != kCBBSuccess)
+    return error;
+
+  int code = QosCode(file, kFSync);
+  MSGPACK_CLIENT_CALL(file.bb_host, file.bb_port, error,
+      error = (file.handle != 0 ? c.call(code, file.handle, datasync)
+                                : c.call(CODE(kFSync), file.path, static_cast<int>(file.fd_org), datasync)).get<Error>();
+  );
+
+  return error;
+}
+
+
+
+/**
+ * @breaf ディレクトリリスト読み込み
+ * @param path ファイルパス
+ * @param offset オフセット
+ * @param file_stats_ptr ファイル情報配列ポインタ
+ * @return Error値
+ */
+Error BurstBufferClient::ReadDir(const char *path, off_t offset, FileStats *file_stats_ptr, int type) {
+  Error error;
+
+  file_stats_ptr->clear();
+
+  BOOST_FOREACH(ServerInfo info, select_server_.server_list()) {
+#ifdef USE_SESSION_POOL_FOR_IO
+    msgpack::rpc::session c = session_pool_.get_session(info.host, info.port);
+#else
+    msgpack::rpc::client c(info.host, info.port);
+#endif
+
+    FileStats file_stats;
+
+    typedef msgpack::type::tuple<Error, FileStats> Result;
+    MSGPACK_CLIENT_CALL(info.host, info.port, error,
+      Result result = c.call(CODE(kReadDir), std::string(path), offset, type).get<Result>();
+      error = result.get<0>();
+      file_stats = result.get<1>();
+    );
+
+    file_stats_ptr->insert(file_stats.begin(), file_stats.end());
+  }
+
+  return error;
+}
+
+/**
+ * @breaf ディレクトリ同期
+ * @param path ディレクトリパス
+ * @param datasync データ同期
+ * @param file ファイル情報
+ * @return Error値
+ */
+Error BurstBufferClient::FSyncDir(const char *path, int datasync, const File &file) {
+  Error error = kCBBSuccess;
+
+  // ディレクトリは全サーバーにあるため、すべてのサーバーで同期する (最初のエラーを返す)
   BOOST_FOREACH(ServerInfo info, select_server_.server_list()) {
 #ifdef USE_SESSION_POOL_FOR_IO
     msgpack::rpc::session c = session_pool_.get_session(info.host, info.port);
@@ -865,9 +2138,13 @@ Error BurstBufferClient::FSyncDir(const char *path, int datasync, const File &fi
     msgpack::rpc::client c(info.host, info.port);
 #endif
 
-    MSGPACK_CLIENT_CALL(
-        error = c.call(CODE(kFSync), std::string(path), datasync).get<Error>();
+    Error server_error = kCBBSuccess;
+    MSGPACK_CLIENT_CALL(info.host, info.port, server_error,
+        server_error = c.call(CODE(kFSyncDir), std::string(path), datasync).get<Error>();
     );
+    if (error == kCBBSuccess) {
+      error = server_error;
+    }
   }
 
   return error;
@@ -904,7 +2181,7 @@ Error BurstBufferClient::SetXAttr(const char *path, const char *name, const char
       msgpack::rpc::client c(info.host, info.port);
 #endif
 
-      MSGPACK_CLIENT_CALL(
+      MSGPACK_CLIENT_CALL(info.host, info.port, error,
           error = c.call(CODE(kSetXAttr), std::string(path), std::string(name), std::string(value), size, flags).get<Error>();
       );
     }
@@ -923,7 +2200,7 @@ Error BurstBufferClient::SetXAttr(const char *path, const char *name, const char
     msgpack::rpc::client c(bb_host, bb_port);
 #endif
 
-    MSGPACK_CLIENT_CALL(
+    MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
         error = c.call(CODE(kSetXAttr), std::string(path), std::string(name), std::string(value), size, flags).get<Error>();
     );
   }
@@ -954,7 +2231,7 @@ Error BurstBufferClient::GetXAttr(const char *path, const char *name, char *valu
 #endif
 
   typedef msgpack::type::tuple<size_t, std::string> Result;
-  MSGPACK_CLIENT_CALL(
+  MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
       Result result = c.call(CODE(kGetXAttr), std::string(path), std::string(name), std::string(value != NULL ? value : ""), size).get<Result>();
       error = result.get<0>();
       std::string value_result = result.get<1>();
@@ -989,7 +2266,7 @@ Error BurstBufferClient::ListXAttr(const char *path, char *list, size_t size) {
 #endif
 
   typedef msgpack::type::tuple<size_t, std::string> Result;
-  MSGPACK_CLIENT_CALL(
+  MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
       Result result = c.call(CODE(kListXAttr), std::string(path), std::string(list != NULL ? list: ""), size).get<Result>();
       error = result.get<0>();
       std::string list_result = result.get<1>();
@@ -1022,7 +2299,7 @@ Error BurstBufferClient::RemoveXAttr(const char *path, const char *name) {
   msgpack::rpc::client c(bb_host, bb_port);
 #endif
 
-  MSGPACK_CLIENT_CALL(
+  MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
       error = c.call(CODE(kRemoveXAttr), std::string(path), std::string(name)).get<Error>();
   );
 
@@ -1037,13 +2314,43 @@ Error BurstBufferClient::RemoveXAttr(const char *path, const char *name) {
  * @return Error値
  */
 Error BurstBufferClient::Init(const char *config_path) {
-  if (!settings_.Load(config_path, false)) {
+  Settings settings;
+  if (!settings.Load(config_path, false)) {
     return kCBBUnknownError;
   }
 
+  return Init(settings);
+}
+
+/**
+ * @breaf 初期化 (設定内容を直接指定)
+ * @param settings クライアント設定
+ * @return Error値
+ */
+Error BurstBufferClient::Init(const Settings &settings) {
+  settings_ = settings;
+
   select_server_.Init(settings_, new cbb::HashCalcMD5());
   g_fuse_mutex.Init();
 
+  // レプリカ選択用の値 (MPIのランク、なければホスト名とプロセスID)
+  const char *rank_names[] = { "PMI_RANK", "OMPI_COMM_WORLD_RANK", "SLURM_PROCID", NULL };
+  replica_seed_ = 0;
+  for (int index = 0; rank_names[index] != NULL && replica_seed_ == 0; index++) {
+    const char *rank = getenv(rank_names[index]);
+    if (rank != NULL) {
+      replica_seed_ = strtoull(rank, NULL, 10) + 1;
+    }
+  }
+  if (replica_seed_ == 0) {
+    char hostname[256] = "";
+    gethostname(hostname, sizeof(hostname) - 1);
+    for (const char *ptr = hostname; *ptr != '\0'; ptr++) {
+      replica_seed_ = replica_seed_ * 131 + (unsigned char)*ptr;
+    }
+    replica_seed_ = replica_seed_ * 1000003 + getpid();
+  }
+
   BOOST_FOREACH(std::string host, settings_.client_hosts()) {
     DMSG("host = %s\n", host.c_str());
   }
@@ -1060,6 +2367,18 @@ Error BurstBufferClient::Init(const char *config_path) {
  */
 Error BurstBufferClient::Destroy() {
   Thread::Release();
+
+  shm_mutex_.Lock();
+  for (std::map<std::string, ShmClient *>::iterator it = shm_clients_.begin(); it != shm_clients_.end(); ++it) {
+    delete it->second;
+  }
+  shm_clients_.clear();
+  BOOST_FOREACH(ShmClient *shm_client, shm_retired_clients_) {
+    delete shm_client;
+  }
+  shm_retired_clients_.clear();
+  shm_mutex_.Unlock();
+
   return kCBBSuccess;
 }
 
@@ -1085,7 +2404,7 @@ Error BurstBufferClient::Access(const char *path, int mode) {
   msgpack::rpc::client c(bb_host, bb_port);
 #endif
 
-  MSGPACK_CLIENT_CALL(
+  MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
       error = c.call(CODE(kAccess), std::string(path), mode).get<Error>();
   );
 
@@ -1101,6 +2420,32 @@ Error BurstBufferClient::Access(const char *path, int mode) {
  * @return Error値
  */
 Error BurstBufferClient::Create(const char *path, int flags,  mode_t mode, File *file_ptr) {
+  Error error = Create(path, flags, mode, file_ptr, settings_.client_stripe_size(), settings_.client_stripe_count());
+
+  // サーバー構成が変わっていた場合は構成を取り直して作成し直す
+  if (error == -ESTALE) {
+    RefreshMembership(true);
+    error = Create(path, flags, mode, file_ptr, settings_.client_stripe_size(), settings_.client_stripe_count());
+  }
+
+  return error;
+}
+
+/**
+ * @breaf ファイルクリエイト (ストライプ配置指定)
+ * @param path ファイルパス
+ * @param flags フラグ
+ * @param mode モード値
+ * @param file_ptr ファイル情報ポインタ
+ * @param stripe_size ストライプサイズ (0の場合はストライプなし)
+ * @param stripe_count ストライプ数 (0の場合は全サーバー)
+ * @return Error値
+ */
+Error BurstBufferClient::Create(const char *path, int flags,  mode_t mode, File *file_ptr, uint64_t stripe_size, int stripe_count) {
+  if (stripe_size > 0) {
+    return OpenStripes(path, flags, mode, true, stripe_size, stripe_count, file_ptr);
+  }
+
   std::string bb_host;
   uint16_t bb_port;
 
@@ -1108,9 +2453,35 @@ Error BurstBufferClient::Create(const char *path, int flags,  mode_t mode, File
   if (error != kCBBSuccess)
     return error;
 
+  // 負荷と容量に応じて配置先を選ぶ (既存のファイルは移動しない)
+  std::string owner_host;
+  int owner_port = 0;
+  bool is_placed = false;
+  if (settings_.client_placement()) {
+    select_server_.GetInfo(path, owner_host, owner_port);
+    if (owner_host == bb_host && owner_port == bb_port) {
+      ServerInfo info = SelectPlacement(owner_host, owner_port);
+      if (info.host != bb_host || info.port != bb_port) {
+        FileStat file_stat;
+        std::string link_path;
+        ServerInfo selected = info;
+        if (GetAttrExInternal(path, &file_stat, link_path) == -ENOENT &&
+            ClaimPlacement(owner_host, owner_port, path, &info) == kCBBSuccess) {
+          DMSG("Create placement : %s -> %s:%d\n", path, info.host.c_str(), info.port);
+          bb_host = info.host;
+          bb_port = info.port;
+          // 他のクライアントが登録した配置は作成に失敗しても消さない
+          is_placed = info.host == selected.host && info.port == selected.port;
+        }
+      }
+    }
+  }
+
   file_ptr->path = path;
   file_ptr->bb_host = bb_host;
   file_ptr->bb_port = bb_port;
+  file_ptr->stripe_size = 0;
+  file_ptr->stripes.clear();
 
 #ifdef USE_SESSION_POOL_FOR_IO
   msgpack::rpc::session c = session_pool_.get_session(bb_host, bb_port);
@@ -1119,12 +2490,16 @@ Error BurstBufferClient::Create(const char *path, int flags,  mode_t mode, File
 #endif
 
   int fd = -1;
-  MSGPACK_CLIENT_CALL(
-      fd = c.call(CODE(kCreate), std::string(path), flags, mode).get<int>();
+  MSGPACK_CLIENT_CALL(bb_host, bb_port, fd,
+      fd = c.call(CODE(kCreate), std::string(path), flags, mode, epoch_).get<int>();
   );
 
-  if (fd < 0)
+  if (fd < 0) {
+    if (is_placed) {
+      SetPlacement(owner_host, owner_port, path, "", 0);
+    }
     return static_cast<Error>(fd);
+  }
 
   file_ptr->fd_org = fd;
   file_ptr->fd = ((uint64_t)addr_to_binary(bb_host.c_str()) << 32) | fd;
@@ -1146,10 +2521,13 @@ Error BurstBufferClient::FTruncate(const File &file, off_t size) {
   msgpack::rpc::client c(file.bb_host, file.bb_port);
 #endif
 
-  Error error = kCBBSuccess;
+  Error error = StripeCall(kFTruncate, file, 0, size);
+  if (error != kCBBSuccess)
+    return error;
 
-  MSGPACK_CLIENT_CALL(
-      error = c.call(CODE(kFTruncate), std::string(file.path), file.fd_org, size).get<Error>();
+  MSGPACK_CLIENT_CALL(file.bb_host, file.bb_port, error,
+      error = (file.handle != 0 ? c.call(static_cast<int>(kFTruncate), file.handle, size)
+                                : c.call(CODE(kFTruncate), std::string(file.path), file.fd_org, size)).get<Error>();
   );
 
   return error;
@@ -1178,12 +2556,28 @@ Error BurstBufferClient::FGetAttr(const char *path, FileStat *file_stat_ptr, con
   msgpack::rpc::client c(bb_host, bb_port);
 #endif
 
-  typedef msgpack::type::tuple<Error, FileStat> Result;
-  MSGPACK_CLIENT_CALL(
-      Result result  = c.call(CODE(kFGetAttr), std::string(path), file.fd_org).get<Result>();
-      error = result.get<0>();
-      *file_stat_ptr = result.get<1>();
-  );
+  if (file.handle != 0 && bb_host == file.bb_host && bb_port == file.bb_port) {
+    typedef msgpack::type::tuple<Error, CompactFileStat> CompactResult;
+    MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
+        CompactResult result = c.call(static_cast<int>(kFGetAttr), file.handle).get<CompactResult>();
+        error = result.get<0>();
+        result.get<1>().ToFileStat(file_stat_ptr);
+    );
+  } else {
+    typedef msgpack::type::tuple<Error, FileStat> Result;
+    MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
+        Result result  = c.call(CODE(kFGetAttr), std::string(path), file.fd_org).get<Result>();
+        error = result.get<0>();
+        *file_stat_ptr = result.get<1>();
+    );
+  }
+
+  // ストライプ中のファイルはメンバーの最大サイズが論理サイズになる
+  off_t size = 0;
+  off_t owner_size = 0;
+  if (error == kCBBSuccess && file.is_striped() && GetStripeFileSize(file, &size, &owner_size) == kCBBSuccess) {
+    file_stat_ptr->st_size = std::max(file_stat_ptr->st_size, size);
+  }
 
   return error;
 }
@@ -1211,7 +2605,7 @@ Error BurstBufferClient::Lock(const char *path, const File &file, int cmd, struc
 #endif
 
   typedef msgpack::type::tuple<Error, FLock> Result;
-  MSGPACK_CLIENT_CALL(
+  MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
       Result result  = c.call(CODE(kLock), std::string(path), file.fd_org).get<Result>();
       error = result.get<0>();
       *lockbuf = result.get<1>();
@@ -1240,7 +2634,7 @@ Error BurstBufferClient::Utimens(const char *path, const TimeSpec times[2]) {
   msgpack::rpc::client c(bb_host, bb_port);
 #endif
 
-  MSGPACK_CLIENT_CALL(
+  MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
       error = c.call(CODE(kUtimens), std::string(path), times[0], times[1]).get<Error>();
   );
 
@@ -1268,7 +2662,7 @@ Error BurstBufferClient::FilePrevRead(const char *path) {
   msgpack::rpc::client c(bb_host, bb_port);
 #endif
 
-  MSGPACK_CLIENT_CALL(
+  MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
       error = c.call(CODE(kFilePrevRead), std::string(path)).get<Error>();
   );
 
@@ -1294,7 +2688,7 @@ Error BurstBufferClient::FileFlush(const char *path) {
   msgpack::rpc::client c(bb_host, bb_port);
 #endif
 
-  MSGPACK_CLIENT_CALL(
+  MSGPACK_CLIENT_CALL(bb_host, bb_port, error,
       error = c.call(CODE(kFileFlush), std::string(path)).get<Error>();
   );
 
@@ -1317,7 +2711,7 @@ Error BurstBufferClient::LocalFileExport() {
     msgpack::rpc::client c(info.host, info.port);
 #endif
 
-    MSGPACK_CLIENT_CALL(
+    MSGPACK_CLIENT_CALL(info.host, info.port, error,
         error = c.call(CODE(kLocalFileExport)).get<Error>();
     );
   }
@@ -1326,6 +2720,118 @@ Error BurstBufferClient::LocalFileExport() {
 }
 
 
+/**
+ * @breaf 統計情報取得
+ * @param info 対象サーバー情報
+ * @param stats_ptr 統計情報保存ポインタ
+ * @param reset 取得後にサーバーの統計情報をクリアするかどうか
+ * @return Error値
+ */
+Error BurstBufferClient::Stats(const ServerInfo &info, ServerStatsInfo *stats_ptr, int reset) {
+  Error error = kCBBSuccess;
+
+#ifdef USE_SESSION_POOL_FOR_IO
+  msgpack::rpc::session c = session_pool_.get_session(info.host, info.port);
+#else
+  msgpack::rpc::client c(info.host, info.port);
+#endif
+
+  typedef msgpack::type::tuple<Error, ServerStatsInfo> Result;
+  MSGPACK_CLIENT_CALL(info.host, info.port, error,
+      Result result = c.call(CODE(kStats), reset).get<Result>();
+      error = result.get<0>();
+      *stats_ptr = result.get<1>();
+  );
+
+  return error;
+}
+
+/**
+ * @breaf サーバーのログレベル変更
+ * @param info 対象サーバー情報
+ * @param level 新しいログレベル (負の値の場合は取得のみ)
+ * @param prev_level_ptr 変更前のログレベル保存ポインタ
+ * @return Error値 (サーバーが変更できなかった場合はサーバーのエラー)
+ */
+Error BurstBufferClient::LogLevel(const ServerInfo &info, int level, int *prev_level_ptr) {
+
+#ifdef USE_SESSION_POOL_FOR_IO
+  msgpack::rpc::session c = session_pool_.get_session(info.host, info.port);
+#else
+  msgpack::rpc::client c(info.host, info.port);
+#endif
+
+  Error error = kCBBSuccess;
+  int result = 0;
+  MSGPACK_CLIENT_CALL(info.host, info.port, error,
+      result = c.call(CODE(kLogLevel), level).get<int>();
+  );
+  if (error == kCBBSuccess) {
+    if (result < 0) {
+      error = result;
+    } else {
+      *prev_level_ptr = result;
+    }
+  }
+
+  return error;
+}
+
+
+/**
+ * @breaf サーバー構成の取得
+ * @param info 対象サーバー情報
+ * @param membership_ptr 構成保存ポインタ
+ * @param is_migrating_ptr ファイル移動中かどうかの保存ポインタ
+ * @return Error値
+ */
+Error BurstBufferClient::GetMembership(const ServerInfo &info, Membership *membership_ptr, bool *is_migrating_ptr) {
+  Error error = kCBBSuccess;
+
+#ifdef USE_SESSION_POOL_FOR_IO
+  msgpack::rpc::session c = session_pool_.get_session(info.host, info.port);
+#else
+  msgpack::rpc::client c(info.host, info.port);
+#endif
+
+  typedef msgpack::type::tuple<Error, Membership, int> Result;
+  MSGPACK_CLIENT_CALL(info.host, info.port, error,
+      Result result = c.call(CODE(kMembership)).get<Result>();
+      error = result.get<0>();
+      *membership_ptr = result.get<1>();
+      *is_migrating_ptr = result.get<2>() != 0;
+  );
+
+  return error;
+}
+
+/**
+ * @breaf サーバー構成の変更
+ *   全サーバーで準備 (is_commit = false) を終えてから確定 (is_commit = true) を呼ぶ。
+ * @param info 対象サーバー情報
+ * @param current 変更前の構成
+ * @param next 変更後の構成
+ * @param self 対象サーバーの構成内の名前 ("host:port")
+ * @param is_commit 確定するかどうか
+ * @return Error値
+ */
+Error BurstBufferClient::SetMembership(const ServerInfo &info, const Membership &current, const Membership &next,
+                                       const std::string &self, bool is_commit) {
+  Error error = kCBBSuccess;
+
+#ifdef USE_SESSION_POOL_FOR_IO
+  msgpack::rpc::session c = session_pool_.get_session(info.host, info.port);
+#else
+  msgpack::rpc::client c(info.host, info.port);
+#endif
+
+  MSGPACK_CLIENT_CALL(info.host, info.port, error,
+      error = c.call(CODE(kSetMembership), current, next, self, static_cast<int>(is_commit)).get<Error>();
+  );
+
+  return error;
+}
+
 /**
  * @see Thread::ThreadCall
  * @breaf 先読みファイルのコピー
@@ -1349,7 +2855,7 @@ bool BurstBufferClient::ThreadCall(void *user_data) {
     FileStats file_stats;
 
     typedef msgpack::type::tuple<Error, FileStats> Result;
-    MSGPACK_CLIENT_CALL(
+    MSGPACK_CLIENT_CALL(info.host, info.port, error,
         Result result = c.call(CODE(kReadDir), std::string(prev_read_dir_.c_str()), (off_t)0, (int)kDirSecondary).get<Result>();
         error = result.get<0>();
         file_stats = result.get<1>();
@@ -1385,15 +2891,367 @@ Error BurstBufferClient::GetBurstBuffer(const char *path, std::string *bb_host_p
   std::string host = "";
   int port = 0;
 
+  RefreshMembership(false);
   select_server_.GetInfo(path, host, port);
 
-  // Should introduce schedule feature here.
+  // 負荷に応じて別サーバーに配置したファイルは、ハッシュのサーバーが持つ配置ディレクトリで引く
+  ServerInfo info;
+  if (settings_.client_placement() && LookupPlacement(path, host, port, &info)) {
+    host = info.host;
+    port = info.port;
+  }
+
   *bb_host_ptr = host;
   *bb_port_ptr = port;
 
   return kCBBSuccess;
 }
 
+/**
+ * @breaf サーバー構成の確認
+ *   Client.membership_interval (msec) ごとにサーバーに構成の版を問い合わせ、
+ *   新しい版の場合はサーバー選択と配置ディレクトリの検索結果を差し替える。
+ * @param is_force 確認間隔に関係なく問い合わせ、配置ディレクトリの検索結果も捨てるかどうか
+ */
+void BurstBufferClient::RefreshMembership(bool is_force) {
+  int interval = settings_.client_membership_interval();
+  if (interval <= 0 || !is_membership_supported_)
+    return;
+
+  uint64_t now = get_time_msec();
+  if (!is_force && now < membership_time_ + interval)
+    return;
+
+  membership_mutex_.Lock();
+  if (!is_force && now < membership_time_ + interval) {
+    membership_mutex_.Unlock();
+    return;
+  }
+  membership_time_ = now;
+
+  // 旧サーバーは kMembership を持たない (no_method_error の場合は以降問い合わせない)
+  Membership membership;
+  bool is_found = false;
+  typedef msgpack::type::tuple<Error, Membership, int> Result;
+  BOOST_FOREACH(ServerInfo info, select_server_.server_list()) {
+    msgpack::rpc::session c = session_pool_.get_session(info.host, info.port);
+    Error error = kCBBSuccess;
+    MSGPACK_CLIENT_TRY(info.host, info.port, error,
+        try {
+          Result result = c.call(CODE(kMembership)).get<Result>();
+          if (result.get<0>() == kCBBSuccess) {
+            membership = result.get<1>();
+            is_found = true;
+          }
+        } catch (msgpack::rpc::no_method_error &e) {
+          is_membership_supported_ = false;
+        }
+    );
+
+    if (is_found || !is_membership_supported_)
+      break;
+  }
+
+  bool is_changed = is_found && membership.epoch > epoch_ && !membership.hosts.empty();
+  if (is_changed) {
+    DMSG("Membership : epoch %lu -> %lu (%lu servers)\n", epoch_, membership.epoch, membership.hosts.size());
+    select_server_.Update(membership.hosts, membership.virtual_nodes);
+    epoch_ = membership.epoch;
+  }
+  membership_mutex_.Unlock();
+
+  if (is_changed || is_force) {
+    placement_mutex_.Lock();
+    placements_.clear();
+    loads_time_ = 0;
+    placement_mutex_.Unlock();
+  }
+}
+
+/**
+ * @breaf 配置ディレクトリの検索
+ *   結果は負荷情報の更新間隔 (Client.placement_interval) の間だけ保持する。
+ *   他のクライアントが削除、名前変更した配置はその間だけ古いまま見えることがある。
+ * @param path ファイルパス
+ * @param owner_host ハッシュで決まるサーバーのhost
+ * @param owner_port ハッシュで決まるサーバーのport
+ * @param info_ptr 配置先サーバー情報ポインタ
+ * @return 別サーバーに配置されているかどうか
+ */
+bool BurstBufferClient::LookupPlacement(const char *path, const std::string &owner_host, int owner_port, ServerInfo *info_ptr) {
+  placement_mutex_.Lock();
+  RefreshLoads();
+
+  std::map<std::string, ServerInfo>::iterator it = placements_.find(path);
+  if (it != placements_.end()) {
+    *info_ptr = it->second;
+    placement_mutex_.Unlock();
+    return true;
+  }
+
+  // 配置ディレクトリが空のサーバーには問い合わせない
+  bool is_placed = false;
+  size_t index = 0;
+  BOOST_FOREACH(ServerInfo info, select_server_.server_list()) {
+    if (info.host == owner_host && info.port == owner_port) {
+      is_placed = index < loads_.size() && loads_[index].placed_count > 0;
+      break;
+    }
+    index++;
+  }
+
+  if (is_placed) {
+    is_placed = false;
+    msgpack::rpc::session c = session_pool_.get_session(owner_host, owner_port);
+    typedef msgpack::type::tuple<Error, std::string, int> Result;
+    Error error = kCBBSuccess;
+    MSGPACK_CLIENT_TRY(owner_host, owner_port, error,
+        Result result = c.call(CODE(kPlacementLookup), std::string(path)).get<Result>();
+        if (result.get<0>() == kCBBSuccess) {
+          info_ptr->host = result.get<1>();
+          info_ptr->port = result.get<2>();
+          is_placed = true;
+        }
+    );
+
+    if (is_placed) {
+      placements_[path] = *info_ptr;
+    }
+  }
+
+  placement_mutex_.Unlock();
+  return is_placed;
+}
+
+/**
+ * @breaf 全サーバーの負荷と容量の取得
+ *   前回の取得から Client.placement_interval 以上経過した場合だけ、全サーバーに並列に問い合わせる。
+ *   応答しないサーバー、旧版のサーバーは容量0 (配置先にしない) として扱う。
+ *   placement_mutex_ を確保して呼び出すこと。
+ */
+void BurstBufferClient::RefreshLoads() {
+  std::list<ServerInfo> servers = select_server_.server_list();
+  uint64_t now = get_time_msec();
+  if (loads_.size() == servers.size() && now < loads_time_ + settings_.client_placement_interval())
+    return;
+
+  std::vector<ServerLoad> loads(servers.size());
+  std::vector<ServerInfo> infos;
+  std::vector<size_t> indexes;
+  std::vector<msgpack::rpc::future> futures;
+  unsigned int timeout = RpcRetry::attempt_timeout(settings_);
+
+  size_t index = 0;
+  BOOST_FOREACH(ServerInfo info, servers) {
+    // 停止中のサーバー (サーキットが開いている) の応答は待たない
+    if (server_health_.is_open(info.host, info.port, now)) {
+      index++;
+      continue;
+    }
+    try {
+      msgpack::rpc::session c = session_pool_.get_session(info.host, info.port);
+      futures.push_back(RpcSession(c, timeout).call(CODE(kLoad)));
+      infos.push_back(info);
+      indexes.push_back(index);
+    } catch (msgpack::rpc::rpc_error &e) {
+      std::cerr << e.what() << std::endl;
+    }
+    index++;
+  }
+
+  // 応答は g_fuse_mutex を確保せずに待ち、応答しないサーバーはサーバーの状態に記録する
+  typedef msgpack::type::tuple<Error, ServerLoad> Result;
+  for (size_t pos = 0; pos < futures.size(); pos++) {
+    try {
+      Result result = futures[pos].get<Result>();
+      if (result.get<0>() == kCBBSuccess) {
+        loads[indexes[pos]] = result.get<1>();
+      }
+      server_health_.Success(infos[pos].host, infos[pos].port);
+    } catch (msgpack::rpc::remote_error &e) {
+      server_health_.Success(infos[pos].host, infos[pos].port);
+    } catch (msgpack::rpc::rpc_error &e) {
+      std::cerr << e.what() << std::endl;
+      server_health_.Failure(infos[pos].host, infos[pos].port, get_time_msec());
+    }
+  }
+
+  loads_.swap(loads);
+  loads_time_ = now;
+  placements_.clear();
+}
+
+/**
+ * @breaf 新規ファイルの配置先選択
+ *   ハッシュで決まるサーバーに十分な空き (Client.placement_min_free %) があり、
+ *   処理中のバイト数とエクスポート待ちが全体の平均から大きく外れていなければそのまま使う。
+ *   そうでなければ、空きのあるサーバーの中で処理中のバイト数とエクスポート待ちが最も少ないものを選ぶ。
+ * @param owner_host ハッシュで決まるサーバーのhost
+ * @param owner_port ハッシュで決まるサーバーのport
+ * @return 配置先サーバー情報
+ */
+ServerInfo BurstBufferClient::SelectPlacement(const std::string &owner_host, int owner_port) {
+  ServerInfo owner(owner_host.c_str(), owner_port);
+
+  placement_mutex_.Lock();
+  RefreshLoads();
+
+  std::vector<ServerInfo> servers;
+  BOOST_FOREACH(ServerInfo info, select_server_.server_list()) {
+    servers.push_back(info);
+  }
+  if (servers.empty() || loads_.size() != servers.size()) {
+    placement_mutex_.Unlock();
+    return owner;
+  }
+
+  uint64_t inflight_sum = 0;
+  uint64_t backlog_sum = 0;
+  for (size_t index = 0; index < loads_.size(); index++) {
+    inflight_sum += loads_[index].inflight_bytes;
+    backlog_sum += loads_[index].export_backlog;
+  }
+  uint64_t inflight_limit = inflight_sum / loads_.size() * 2 + PLACEMENT_INFLIGHT_SLACK;
+  uint64_t backlog_limit = backlog_sum / loads_.size() * 2 + PLACEMENT_BACKLOG_SLACK;
+  uint64_t min_free = settings_.client_placement_min_free();
+
+  int owner_index = -1;
+  int best_index = -1;
+  for (size_t index = 0; index < servers.size(); index++) {
+    const ServerLoad &load = loads_[index];
+    bool is_owner = servers[index].host == owner_host && servers[index].port == owner_port;
+    if (is_owner) {
+      owner_index = index;
+    }
+
+    bool is_healthy = load.total_bytes > 0 && load.free_bytes > 0 &&
+        load.free_bytes * 100 >= load.total_bytes * min_free &&
+        load.inflight_bytes <= inflight_limit && load.export_backlog <= backlog_limit;
+    if (!is_healthy)
+      continue;
+
+    if (is_owner) {
+      best_index = index;
+      break;
+    }
+
+    if (best_index < 0) {
+      best_index = index;
+      continue;
+    }
+    const ServerLoad &best = loads_[best_index];
+    uint64_t score = load.inflight_bytes + load.export_backlog * PLACEMENT_BACKLOG_WEIGHT;
+    uint64_t best_score = best.inflight_bytes + best.export_backlog * PLACEMENT_BACKLOG_WEIGHT;
+    if (score < best_score || (score == best_score && load.free_bytes > best.free_bytes)) {
+      best_index = index;
+    }
+  }
+
+  // 配置できるサーバーがない場合はハッシュのサーバーを使う
+  ServerInfo result = owner;
+  if (best_index >= 0 && best_index != owner_index) {
+    result = servers[best_index];
+    // 次の更新までに同じサーバーへ集中しないよう、エクスポート待ちを見込みで加えておく
+    loads_[best_index].export_backlog++;
+  }
+
+  placement_mutex_.Unlock();
+  return result;
+}
+
+/**
+ * @breaf 配置ディレクトリへの登録・削除
+ * @param owner_host ハッシュで決まるサーバーのhost
+ * @param owner_port ハッシュで決まるサーバーのport
+ * @param path ファイルパス
+ * @param host 配置先サーバーのhost (空の場合は削除)
+ * @param port 配置先サーバーのport
+ * @return Error値
+ */
+Error BurstBufferClient::SetPlacement(const std::string &owner_host, int owner_port, const char *path, const std::string &host, int port) {
+  Error error = kCBBSuccess;
+
+  msgpack::rpc::session c = session_pool_.get_session(owner_host, owner_port);
+  MSGPACK_CLIENT_CALL(owner_host, owner_port, error,
+      error = c.call(CODE(kPlacement), std::string(path), host, port).get<Error>();
+  );
+
+  placement_mutex_.Lock();
+  if (error == kCBBSuccess && !host.empty()) {
+    placements_[path] = ServerInfo(host.c_str(), port);
+  } else {
+    placements_.erase(path);
+  }
+  placement_mutex_.Unlock();
+
+  return error;
+}
+
+/**
+ * @breaf 作成時の配置先の登録
+ *   オーナーサーバーが未登録の場合だけ登録するため、同じパスを同時に作成した
+ *   クライアントは最初に登録された配置先に揃う。旧サーバーは常に上書きする。
+ * @param owner_host ハッシュで決まるサーバーのhost
+ * @param owner_port ハッシュで決まるサーバーのport
+ * @param path ファイルパス
+ * @param info_ptr 配置先サーバー情報ポインタ (登録済みの場合はその配置先に変更する)
+ * @return Error値
+ */
+Error BurstBufferClient::ClaimPlacement(const std::string &owner_host, int owner_port, const char *path, ServerInfo *info_ptr) {
+  Error error = kCBBSuccess;
+  ServerInfo existing;
+  typedef msgpack::type::tuple<Error, std::string, int> Result;
+
+  msgpack::rpc::session c = session_pool_.get_session(owner_host, owner_port);
+  MSGPACK_CLIENT_CALL(owner_host, owner_port, error,
+      msgpack::rpc::future future = c.call(CODE(kPlacement), std::string(path), info_ptr->host, info_ptr->port, 1);
+      // 旧サーバーは Error値だけを返す
+      msgpack::object object = future.get<msgpack::object>();
+      if (object.type == msgpack::type::ARRAY) {
+        Result result;
+        object.convert(&result);
+        error = result.get<0>();
+        existing.host = result.get<1>();
+        existing.port = result.get<2>();
+      } else {
+        error = object.as<Error>();
+      }
+  );
+
+  if (error == -EEXIST) {
+    *info_ptr = existing;
+    error = kCBBSuccess;
+  }
+
+  placement_mutex_.Lock();
+  if (error == kCBBSuccess) {
+    placements_[path] = *info_ptr;
+  } else {
+    placements_.erase(path);
+  }
+  placement_mutex_.Unlock();
+
+  return error;
+}
+
+/**
+ * @breaf 削除、名前変更したファイルの配置ディレクトリからの削除
+ * @param path ファイルパス
+ * @param bb_host ファイルがあったサーバーのhost
+ * @param bb_port ファイルがあったサーバーのport
+ */
+void BurstBufferClient::ForgetPlacement(const char *path, const std::string &bb_host, uint16_t bb_port) {
+  if (!settings_.client_placement())
+    return;
+
+  std::string owner_host;
+  int owner_port = 0;
+  select_server_.GetInfo(path, owner_host, owner_port);
+  if (owner_host != bb_host || owner_port != bb_port) {
+    SetPlacement(owner_host, owner_port, path, "", 0);
+  }
+}
+
 /**
  * @breaf ファイル先読み開始
  * @param path ファイルパス
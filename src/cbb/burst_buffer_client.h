@@ -21,6 +21,10 @@
 
 #include <string>
 #include <list>
+#include <map>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
 
 #include <jubatus/msgpack/rpc/client.h>
 #include <jubatus/msgpack/rpc/session_pool.h>
@@ -29,20 +33,50 @@
 #include "common/common.h"
 #include "util/settings.h"
 #include "util/select_server.h"
+#include "util/server_health.h"
 #include "util/thread.h"
+#include "util/compressor.h"
+#include "util/mutex.h"
 
 namespace cbb {
 
+// ストライプを担当するサーバーとそのファイルディスクリプタ
+struct StripeMember {
+  std::string bb_host;
+  uint16_t bb_port;
+  uint64_t fd_org;
+};
+
+// サーバーが返すファイルの版 (前回のオープンから内容が変わっていないかの判定に使う)
+struct FileVersion {
+  uint64_t mtime;       // 更新日時 (ナノ秒、0の場合は不明)
+  uint64_t generation;  // サーバー内の変更世代
+
+  FileVersion() : mtime(0), generation(0) {}
+  bool is_valid() const { return mtime != 0; }
+  bool operator==(const FileVersion &other) const { return mtime == other.mtime && generation == other.generation; }
+};
+
 struct File {
   std::string path;
   std::string bb_host;
   uint16_t bb_port;
   uint64_t fd_org;
   uint64_t fd;
+  uint64_t handle;                    // v2プロトコルのファイルハンドル (0の場合はv1でパスとfdを送る)
+  uint64_t stripe_size;               // ストライプサイズ (0の場合はストライプなし)
+  std::vector<StripeMember> stripes;  // ストライプ番号順の担当サーバー (先頭はbb_host/bb_port)
+  boost::shared_ptr<File> replica;    // 読み込みに使うレプリカ (ない場合はNULL)
+  FileVersion version;                // オープン時のファイルの版
+  bool keep_cache;                    // 前回のオープンと版が同じでページキャッシュを使い続けてよいかどうか
+
+  File() : bb_port(0), fd_org(0), fd(0), handle(0), stripe_size(0), keep_cache(false) {}
+  bool is_striped() const { return stripes.size() > 1; }
 };
 
 struct FileStat;
 struct TimeVal;
+struct ShmClient;
 
 // CBFSモジュール（クライアント側）のメイン処理クラス
 class BurstBufferClient : public Thread {
@@ -82,10 +116,12 @@ class BurstBufferClient : public Thread {
   Error RemoveXAttr(const char *path, const char *name); //*
 
   Error Init(const char *config_path);
+  Error Init(const Settings &settings);
   Error Destroy();
 
   Error Access(const char *path, int mode);
   Error Create(const char *path, int flags,  mode_t mode, File *file_ptr);
+  Error Create(const char *path, int flags,  mode_t mode, File *file_ptr, uint64_t stripe_size, int stripe_count);
   Error FTruncate(const File &file, off_t size);
   Error FGetAttr(const char *path, FileStat *file_stat_ptr, const File &file); //*
   Error Lock(const char *path, const File &file, int cmd, struct flock *lockbuf); //*
@@ -95,7 +131,13 @@ class BurstBufferClient : public Thread {
   Error FilePrevRead(const char *path);
   Error FileFlush(const char *path);
   Error LocalFileExport();
+  Error Stats(const ServerInfo &info, ServerStatsInfo *stats_ptr, int reset);
+  Error LogLevel(const ServerInfo &info, int level, int *prev_level_ptr);
+  Error GetMembership(const ServerInfo &info, Membership *membership_ptr, bool *is_migrating_ptr);
+  Error SetMembership(const ServerInfo &info, const Membership &current, const Membership &next,
+                      const std::string &self, bool is_commit);
 
+  std::list<ServerInfo> server_list() { return select_server_.server_list(); }
 
  protected:
   bool ThreadCall(void *user_data);
@@ -103,19 +145,72 @@ class BurstBufferClient : public Thread {
  private:
 
   Error GetBurstBuffer(const char *path, std::string *bb_host_ptr, uint16_t *bb_port_ptr);
+  void RefreshMembership(bool is_force);
+  bool LookupPlacement(const char *path, const std::string &owner_host, int owner_port, ServerInfo *info_ptr);
+  void RefreshLoads();
+  ServerInfo SelectPlacement(const std::string &owner_host, int owner_port);
+  Error SetPlacement(const std::string &owner_host, int owner_port, const char *path, const std::string &host, int port);
+  Error ClaimPlacement(const std::string &owner_host, int owner_port, const char *path, ServerInfo *info_ptr);
+  void ForgetPlacement(const char *path, const std::string &bb_host, uint16_t bb_port);
 
   Error GetAttrExInternal(const char *path, FileStat *file_stat_ptr, std::string &link_path);
   Error UnlinkInternal(const char *path, bool is_all_server);
 
+  Error GetStripeMembers(const char *path, std::vector<ServerInfo> *members_ptr);
+  Error OpenStripes(const char *path, int flags, mode_t mode, bool create, uint64_t stripe_size, int stripe_count, File *file_ptr);
+  void OpenReplica(const char *path, uint64_t version, int count, bool is_replicate, File *file_ptr);
+  bool CheckVersion(const std::string &path, const FileVersion &version);
+  Error StripeTransfer(bool is_write, const File &file, char *buf, size_t size, off_t offset, ssize_t *ssize_ptr);
+  Error StripeCall(int code, const File &file, int datasync, off_t size);
+  Error GetStripeFileSize(const File &file, off_t *size_ptr, off_t *owner_size_ptr);
+
   void StartPrevFileRead(const char* path);
 
+  int GetProtocol(const std::string &host, uint16_t port);
+  Compressor *GetCompressor(const std::string &host, uint16_t port);
+  int GetQosClass(const std::string &host, uint16_t port);
+  int QosCode(const File &file, int code);
+
+  ShmClient *GetShmClient(const std::string &host, uint16_t port);
+  void RetireShmClient(const std::string &host, uint16_t port, ShmClient *shm_client);
+  bool ShmTransfer(ShmClient *shm_client, int op, const File &file, char *buf, size_t size, off_t offset, ssize_t *ssize_ptr, Error *error_ptr);
+
   msgpack::rpc::session_pool session_pool_;
   msgpack::rpc::shared_zone life_;
 
   Settings settings_;
   SelectServer select_server_;
+  ServerHealth server_health_;  // サーバーごとの通信状態 (MSGPACK_CLIENT_CALL で更新)
   std::string prev_read_dir_;
   std::string target_filename_;
+
+  std::map<std::string, ShmClient *> shm_clients_;
+  std::list<ShmClient *> shm_retired_clients_;
+  std::map<std::string, uint64_t> shm_retry_times_;  // 通信路を開けなかったサーバーの再接続時刻 (msec)
+  Mutex shm_mutex_;
+
+  uint64_t replica_seed_;
+
+  std::vector<ServerLoad> loads_;                  // サーバー一覧順の負荷と容量
+  uint64_t loads_time_;                            // loads_ の取得時刻 (msec)
+  std::map<std::string, ServerInfo> placements_;   // 配置ディレクトリの検索結果
+  Mutex placement_mutex_;
+
+  uint64_t epoch_;                                 // サーバー構成の版 (0の場合は設定ファイルの構成)
+  uint64_t membership_time_;                       // サーバー構成の確認時刻 (msec)
+  bool is_membership_supported_;                   // サーバーが kMembership に対応しているかどうか
+  Mutex membership_mutex_;
+
+  std::map<std::string, FileVersion> versions_;    // 前回のオープン時のファイルの版
+  Mutex version_mutex_;
+
+  std::map<std::pair<std::string, uint16_t>, int> protocols_;  // サーバーごとに決めたプロトコルの版
+  std::map<std::pair<std::string, uint16_t>, uint64_t> protocol_retry_times_;  // 版を決められなかったサーバーの再問い合わせ時刻 (msec)
+  std::map<std::pair<std::string, uint16_t>, Compressor *> compressors_;  // サーバーごとの圧縮 (NULLの場合は圧縮しない)
+  std::map<std::pair<std::string, uint16_t>, uint64_t> compressor_retry_times_;  // 圧縮方式を決められなかったサーバーの再問い合わせ時刻 (msec)
+  std::map<std::pair<std::string, uint16_t>, int> qos_classes_;  // サーバーごとのQoS分類 (0の場合は分類なし)
+  std::map<std::pair<std::string, uint16_t>, uint64_t> qos_retry_times_;  // QoS分類を決められなかったサーバーの再問い合わせ時刻 (msec)
+  Mutex protocol_mutex_;
 };
 
 } // namespace cbb
@@ -13,6 +13,8 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 //
+#include <unistd.h>
+
 #include "common/error.h"
 #include "common/common.h"
 #include "burst_buffer.h"
@@ -61,6 +63,12 @@ int main(int argc, char *argv[]) {
     return -1;
   }
 
+  // ログ出力設定
+  if (!cbb::Logger::Open(settings.server_log_file(), cbb::Logger::ParseLevel(settings.server_log_level(), cbb::kLogInfo))) {
+    printf("log file open error : %s\n", settings.server_log_file().c_str());
+    return -1;
+  }
+
   DMSG("local strage = %s\n", settings.server_local_strage_path().c_str());
   DMSG("secondary strage = %s\n", settings.server_secondary_storage_path().c_str());
   DMSG("host = %s\n", settings.server_host().c_str());
@@ -77,7 +85,42 @@ int main(int argc, char *argv[]) {
 
   // BurstBuffer構築・MsgPack設定
   cbb::BurstBuffer bb(settings.server_local_strage_path(), settings.server_secondary_storage_path(), settings.server_interval_time());
+  bb.SetReplicaPolicy(settings.server_replica_count(), settings.server_replica_threshold(), settings.server_replica_pattern());
+  bb.SetFSyncDirPolicy(settings.server_fsyncdir_syncfs());
+  bb.SetFdCachePolicy(settings.server_fd_cache_size());
+  if (settings.server_io_uring_entries() > 0 && !bb.SetIoPolicy(settings.server_io_uring_entries())) {
+    IMSG("io_uring is not available, using pread/pwrite\n");
+  }
+  if (settings.server_direct_io_size() > 0 && !bb.SetDirectIoPolicy(settings.server_direct_io_size(), settings.server_direct_io_buffers())) {
+    IMSG("direct I/O buffers are not available, using buffered I/O\n");
+  }
+  bb.SetCompressionPolicy(settings.server_compression_level(), settings.server_max_transfer_size());
+  if (!bb.SetLocalCompressionPolicy(cbb::Compressor::Parse(settings.server_local_compression()),
+                                    settings.server_local_compression_level(),
+                                    settings.server_local_compression_chunk_size())) {
+    IMSG("local compression %s is not available, storing files uncompressed\n", settings.server_local_compression().c_str());
+  }
+  if (settings.server_local_devices().size() > 1) {
+    bb.SetLocalDevices(settings.server_local_devices(), settings.server_local_stripe_size(),
+                       settings.server_local_stripe_pattern(), settings.server_local_stripe_min_size());
+    IMSG("local storage spans %lu devices\n", settings.server_local_devices().size());
+  }
+  if (!bb.SetQosPolicy(settings.server_qos_threads(), settings.server_qos_quantum(),
+                       settings.server_qos_bandwidth(), settings.server_qos_classes())) {
+    IMSG("invalid qos_classes %s, data requests are not scheduled\n", settings.server_qos_classes().c_str());
+  }
+  bb.SetBackgroundPolicy(settings.server_background_busy_depth(), settings.server_background_idle_msec(),
+                         settings.server_background_max_pause_msec(), settings.server_background_ioprio());
+  char hostname[256] = {0};
+  gethostname(hostname, sizeof(hostname) - 1);
+  bb.SetSecondaryPolicy(settings.server_secondary_bandwidth(), settings.server_secondary_ops(),
+                        settings.server_secondary_cluster_bandwidth(), settings.server_secondary_cluster_ops(),
+                        settings.server_secondary_lease_dir(),
+                        std::string(cbb::S("%s_%d", hostname, settings.server_port())),
+                        settings.server_secondary_lease_interval());
   g_server = &bb.instance;
   bb.instance.listen(settings.server_host(), settings.server_port());
   bb.instance.run(settings.server_thread()); // run 1 threads
+
+  cbb::Logger::Close();
 }
@@ -0,0 +1,302 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <boost/foreach.hpp>
+
+#include "common/error.h"
+#include "common/common.h"
+#include "burst_buffer_client.h"
+
+// CBBサーバー統計情報表示コマンド
+
+#define CBB_STAT_DESC \
+  "Usage: %s [options]\n" \
+  "  --option=PATH          load setting file path\n" \
+  "  --reset                reset server statistics after dump\n" \
+  "  --log-level=LEVEL      change server log level (debug, info, warn, error, none)\n" \
+  "  --membership           show server membership and migration status\n" \
+  "  --membership=HOSTS     change server membership (host:port,host:port,...) and migrate files\n" \
+  "  --virtual-nodes=N      virtual nodes per server for the new membership (default 0: even split)\n"
+
+/**
+ * @breaf レイテンシ要約の表示
+ * @param label 区間名
+ * @param summary レイテンシ要約
+ */
+static void PrintLatency(const char *label, const cbb::LatencySummary &summary) {
+  if (summary.count == 0) {
+    return;
+  }
+  printf("    %-8s avg %8lu  p50 %8lu  p90 %8lu  p99 %8lu  p99.9 %8lu  max %8lu (usec)\n",
+         label,
+         (unsigned long)(summary.sum / summary.count),
+         (unsigned long)summary.p50,
+         (unsigned long)summary.p90,
+         (unsigned long)summary.p99,
+         (unsigned long)summary.p999,
+         (unsigned long)summary.max);
+}
+
+/**
+ * @breaf 統計情報の表示
+ * @param info サーバー情報
+ * @param stats 統計情報
+ */
+static void PrintStats(const cbb::ServerInfo &info, const cbb::ServerStatsInfo &stats) {
+  printf("server %s:%d  uptime %lu ms  export queue %lu  prefetch queue %lu\n",
+         info.host.c_str(), info.port,
+         (unsigned long)stats.uptime_msec,
+         (unsigned long)stats.export_queue_depth,
+         (unsigned long)stats.prefetch_queue_depth);
+
+  BOOST_FOREACH(const cbb::MethodStats &method, stats.methods) {
+    printf("  %-18s ops %10lu  errors %8lu  in %12lu B  out %12lu B\n",
+           method.name.c_str(),
+           (unsigned long)method.ops,
+           (unsigned long)method.errors,
+           (unsigned long)method.bytes_in,
+           (unsigned long)method.bytes_out);
+    PrintLatency("total", method.total);
+    PrintLatency("queue", method.queue);
+    PrintLatency("syscall", method.syscall);
+    PrintLatency("copy", method.copy);
+  }
+  BOOST_FOREACH(const cbb::DeviceStats &device, stats.devices) {
+    printf("  device %-30s free %14lu / %14lu B  open %6lu  placed %8lu  read %14lu B  written %14lu B\n",
+           device.root.c_str(),
+           (unsigned long)device.free_bytes,
+           (unsigned long)device.total_bytes,
+           (unsigned long)device.open_files,
+           (unsigned long)device.placed_files,
+           (unsigned long)device.bytes_read,
+           (unsigned long)device.bytes_written);
+  }
+  BOOST_FOREACH(const cbb::QosClassStats &qos, stats.qos_classes) {
+    printf("  qos %-20s weight %4u  limit %12lu B/s  queued %6lu  requests %10lu  bytes %14lu B  wait avg %8lu  throttled %8lu\n",
+           qos.name.empty() ? "(none)": qos.name.c_str(),
+           (unsigned)qos.weight,
+           (unsigned long)qos.bandwidth,
+           (unsigned long)qos.queued,
+           (unsigned long)qos.requests,
+           (unsigned long)qos.bytes,
+           (unsigned long)(qos.requests > 0 ? qos.wait_usec / qos.requests: 0),
+           (unsigned long)qos.throttled);
+  }
+  if (stats.background.bytes > 0 || stats.background.deferred > 0) {
+    printf("  background copy %14lu B  active %4lu  foreground %4lu  deferred %8lu (%lu ms)  forced %8lu\n",
+           (unsigned long)stats.background.bytes,
+           (unsigned long)stats.background.active,
+           (unsigned long)stats.background.foreground,
+           (unsigned long)stats.background.deferred,
+           (unsigned long)stats.background.deferred_msec,
+           (unsigned long)stats.background.forced);
+  }
+  if (stats.secondary.bytes > 0 || stats.secondary.operations > 0) {
+    printf("  secondary write %14lu B  ops %8lu  limit %12lu B/s %6lu ops/s  servers %3lu  throttled %8lu (%lu ms)\n",
+           (unsigned long)stats.secondary.bytes,
+           (unsigned long)stats.secondary.operations,
+           (unsigned long)stats.secondary.bandwidth,
+           (unsigned long)stats.secondary.ops,
+           (unsigned long)stats.secondary.servers,
+           (unsigned long)stats.secondary.throttled,
+           (unsigned long)stats.secondary.throttled_msec);
+  }
+  printf("\n");
+}
+
+/**
+ * @breaf サーバー構成の表示
+ * @param client クライアント
+ * @return 処理結果
+ */
+static int PrintMembership(cbb::BurstBufferClient &client) {
+  int result = 0;
+  BOOST_FOREACH(cbb::ServerInfo info, client.server_list()) {
+    cbb::Membership membership;
+    bool is_migrating = false;
+    cbb::Error error = client.GetMembership(info, &membership, &is_migrating);
+    if (error != cbb::kCBBSuccess) {
+      printf("server %s:%d  error %d\n", info.host.c_str(), info.port, error);
+      result = -1;
+      continue;
+    }
+    printf("server %s:%d  epoch %lu  virtual nodes %d  %s\n", info.host.c_str(), info.port,
+           (unsigned long)membership.epoch, membership.virtual_nodes, is_migrating ? "migrating" : "stable");
+    BOOST_FOREACH(const std::string &host, membership.hosts) {
+      printf("  %s\n", host.c_str());
+    }
+  }
+  return result;
+}
+
+/**
+ * @breaf サーバー構成の変更
+ *   変更前と変更後の全サーバーで準備してから確定する。ファイルの移動は確定後にサーバー間で行う。
+ * @param client クライアント
+ * @param hosts 変更後のサーバー一覧 (カンマ区切り)
+ * @param virtual_nodes 変更後のサーバーあたりの仮想ノード数
+ * @return 処理結果
+ */
+static int ChangeMembership(cbb::BurstBufferClient &client, const std::string &hosts, int virtual_nodes) {
+  std::list<cbb::ServerInfo> servers = client.server_list();
+  if (servers.empty()) {
+    return -1;
+  }
+  int default_port = servers.front().port;
+
+  // 現在の構成 (版が最も新しいもの、どのサーバーも持たない場合は設定ファイルの構成)
+  cbb::Membership current;
+  BOOST_FOREACH(const cbb::ServerInfo &info, servers) {
+    current.hosts.push_back(info.str());
+  }
+  BOOST_FOREACH(const cbb::ServerInfo &info, servers) {
+    cbb::Membership membership;
+    bool is_migrating = false;
+    if (client.GetMembership(info, &membership, &is_migrating) != cbb::kCBBSuccess) {
+      continue;
+    }
+    if (is_migrating) {
+      printf("server %s:%d  migration in progress\n", info.host.c_str(), info.port);
+      return -1;
+    }
+    if (membership.epoch > current.epoch) {
+      current = membership;
+    }
+  }
+
+  cbb::Membership next;
+  next.epoch = current.epoch + 1;
+  next.virtual_nodes = virtual_nodes;
+  std::string::size_type start = 0;
+  while (start <= hosts.size()) {
+    std::string::size_type end = hosts.find(',', start);
+    if (end == std::string::npos) {
+      end = hosts.size();
+    }
+    if (end > start) {
+      next.hosts.push_back(cbb::ServerInfo::Parse(hosts.substr(start, end - start), default_port).str());
+    }
+    start = end + 1;
+  }
+  if (next.hosts.empty()) {
+    return -1;
+  }
+
+  // 変更前と変更後のすべてのサーバー
+  std::vector<cbb::ServerInfo> targets;
+  std::vector<std::string> names(current.hosts);
+  names.insert(names.end(), next.hosts.begin(), next.hosts.end());
+  BOOST_FOREACH(const std::string &name, names) {
+    cbb::ServerInfo info = cbb::ServerInfo::Parse(name, default_port);
+    if (std::find(targets.begin(), targets.end(), info) == targets.end()) {
+      targets.push_back(info);
+    }
+  }
+
+  for (int commit = 0; commit <= 1; commit++) {
+    BOOST_FOREACH(const cbb::ServerInfo &info, targets) {
+      cbb::Error error = client.SetMembership(info, current, next, info.str(), commit != 0);
+      printf("server %s:%d  %s epoch %lu -> %lu : %d\n", info.host.c_str(), info.port,
+             commit ? "commit" : "prepare", (unsigned long)current.epoch, (unsigned long)next.epoch, error);
+      if (error != cbb::kCBBSuccess) {
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @breaf cbb_stat メイン
+ * @param argc 引数個数
+ * @param argv 引数値
+ * @return 処理結果
+ */
+int main(int argc, char *argv[]) {
+  std::string config_path = CBB_CONFIG;
+  int reset = 0;
+  int log_level = -1;
+  bool is_membership = false;
+  std::string membership_hosts;
+  int virtual_nodes = 0;
+
+  for (int index = 1; index < argc; index++) {
+    if (!strncmp(argv[index], "--option=", 9)) {
+      config_path = &argv[index][9];
+    } else if (!strcmp(argv[index], "--reset")) {
+      reset = 1;
+    } else if (!strncmp(argv[index], "--log-level=", 12)) {
+      log_level = cbb::Logger::ParseLevel(&argv[index][12], -1);
+      if (log_level < 0) {
+        printf(CBB_STAT_DESC, argv[0]);
+        return -1;
+      }
+    } else if (!strcmp(argv[index], "--membership")) {
+      is_membership = true;
+    } else if (!strncmp(argv[index], "--membership=", 13)) {
+      membership_hosts = &argv[index][13];
+    } else if (!strncmp(argv[index], "--virtual-nodes=", 16)) {
+      virtual_nodes = atoi(&argv[index][16]);
+    } else {
+      printf(CBB_STAT_DESC, argv[0]);
+      return 0;
+    }
+  }
+
+  cbb::BurstBufferClient client;
+  if (client.Init(config_path.c_str()) != cbb::kCBBSuccess) {
+    printf("setting file load error : %s\n", config_path.c_str());
+    return -1;
+  }
+
+  if (!membership_hosts.empty()) {
+    return ChangeMembership(client, membership_hosts, virtual_nodes);
+  }
+  if (is_membership) {
+    return PrintMembership(client);
+  }
+
+  int result = 0;
+  BOOST_FOREACH(cbb::ServerInfo info, client.server_list()) {
+    if (log_level >= 0) {
+      int prev_level = 0;
+      cbb::Error error = client.LogLevel(info, log_level, &prev_level);
+      if (error != cbb::kCBBSuccess) {
+        printf("server %s:%d  log level error %d\n", info.host.c_str(), info.port, error);
+        result = -1;
+        continue;
+      }
+      printf("server %s:%d  log level %d -> %d\n", info.host.c_str(), info.port, prev_level, log_level);
+      continue;
+    }
+
+    cbb::ServerStatsInfo stats;
+    cbb::Error error = client.Stats(info, &stats, reset);
+    if (error != cbb::kCBBSuccess) {
+      printf("server %s:%d  error %d\n\n", info.host.c_str(), info.port, error);
+      result = -1;
+      continue;
+    }
+    PrintStats(info, stats);
+  }
+
+  return result;
+}
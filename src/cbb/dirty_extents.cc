@@ -0,0 +1,206 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "dirty_extents.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include <boost/format.hpp>
+
+// ファイルの変更範囲クラス
+namespace cbb {
+
+/**
+ * @breaf 変更範囲の追加
+ * @param offset 変更したオフセット
+ * @param size 変更したサイズ
+ */
+void DirtyExtents::Add(off_t offset, size_t size) {
+  if (is_full_ || size == 0) {
+    return;
+  }
+
+  off_t start = offset / DIRTY_BLOCK_SIZE * DIRTY_BLOCK_SIZE;
+  off_t end = (offset + (off_t)size + DIRTY_BLOCK_SIZE - 1) / DIRTY_BLOCK_SIZE * DIRTY_BLOCK_SIZE;
+  Insert(start, end);
+  Coalesce();
+}
+
+/**
+ * @breaf ファイルサイズ変更の反映 (縮めた場合は新しいサイズより後ろの範囲を捨てる)
+ * @param size 新しいファイルサイズ
+ */
+void DirtyExtents::Truncate(off_t size) {
+  if (is_full_) {
+    return;
+  }
+  if (truncated_ < 0 || size < truncated_) {
+    truncated_ = size;
+  }
+
+  off_t limit = (size + DIRTY_BLOCK_SIZE - 1) / DIRTY_BLOCK_SIZE * DIRTY_BLOCK_SIZE;
+
+  Extents::iterator it = extents_.lower_bound(limit);
+  extents_.erase(it, extents_.end());
+  if (!extents_.empty() && extents_.rbegin()->second > limit) {
+    extents_.rbegin()->second = limit;
+  }
+}
+
+/**
+ * @breaf 他の変更範囲をまとめる
+ * @param other 変更範囲
+ */
+void DirtyExtents::Merge(const DirtyExtents &other) {
+  if (is_full_) {
+    return;
+  }
+  if (other.is_full_) {
+    SetFull();
+    return;
+  }
+
+  if (other.truncated_ >= 0 && (truncated_ < 0 || other.truncated_ < truncated_)) {
+    truncated_ = other.truncated_;
+  }
+  for (Extents::const_iterator it = other.extents_.begin(); it != other.extents_.end(); ++it) {
+    Insert(it->first, it->second);
+  }
+  Coalesce();
+}
+
+/**
+ * @breaf 変更範囲の合計バイト数
+ * @return バイト数 (ファイル全体の場合は0)
+ */
+uint64_t DirtyExtents::bytes() const {
+  uint64_t total = 0;
+  for (Extents::const_iterator it = extents_.begin(); it != extents_.end(); ++it) {
+    total += it->second - it->first;
+  }
+  return total;
+}
+
+/**
+ * @breaf 保存用の文字列 ("*" または "[t最小サイズ,]開始-終了,開始-終了,...")
+ * @return 文字列
+ */
+std::string DirtyExtents::str() const {
+  if (is_full_) {
+    return "*";
+  }
+
+  std::string value;
+  if (truncated_ >= 0) {
+    value = (boost::format("t%1%") % truncated_).str();
+  }
+  for (Extents::const_iterator it = extents_.begin(); it != extents_.end(); ++it) {
+    if (!value.empty()) {
+      value += ",";
+    }
+    value += (boost::format("%1%-%2%") % it->first % it->second).str();
+  }
+  return value;
+}
+
+/**
+ * @breaf 保存用の文字列の解析
+ * @param value 文字列
+ * @param extents_ptr 変更範囲保存ポインタ
+ * @return bool 解析できたかどうか
+ */
+bool DirtyExtents::Parse(const std::string &value, DirtyExtents *extents_ptr) {
+  extents_ptr->Clear();
+  if (value == "*") {
+    extents_ptr->SetFull();
+    return true;
+  }
+
+  const char *ptr = value.c_str();
+  while (*ptr != '\0') {
+    char *next;
+    if (*ptr == 't') {
+      off_t size = strtoll(ptr + 1, &next, 10);
+      if ((*next != ',' && *next != '\0') || size < 0) {
+        return false;
+      }
+      extents_ptr->truncated_ = size;
+      ptr = *next == ',' ? next + 1 : next;
+      continue;
+    }
+
+    off_t start = strtoll(ptr, &next, 10);
+    if (*next != '-') {
+      return false;
+    }
+    off_t end = strtoll(next + 1, &next, 10);
+    if ((*next != ',' && *next != '\0') || start < 0 || end <= start) {
+      return false;
+    }
+    extents_ptr->Insert(start, end);
+    ptr = *next == ',' ? next + 1 : next;
+  }
+  extents_ptr->Coalesce();
+  return true;
+}
+
+/**
+ * @breaf 範囲の挿入 (重なる範囲、隣接する範囲は1つにまとめる)
+ * @param start 開始オフセット
+ * @param end 終了オフセット
+ */
+void DirtyExtents::Insert(off_t start, off_t end) {
+  Extents::iterator it = extents_.upper_bound(start);
+  if (it != extents_.begin()) {
+    Extents::iterator prev = it;
+    --prev;
+    if (prev->second >= start) {
+      start = prev->first;
+      end = std::max(end, prev->second);
+      it = prev;
+    }
+  }
+  while (it != extents_.end() && it->first <= end) {
+    end = std::max(end, it->second);
+    extents_.erase(it++);
+  }
+  extents_[start] = end;
+}
+
+/**
+ * @breaf 範囲の数を DIRTY_EXTENT_MAX 以下にする (間隔の最も狭い範囲どうしをまとめる)
+ */
+void DirtyExtents::Coalesce() {
+  while (extents_.size() > DIRTY_EXTENT_MAX) {
+    Extents::iterator best = extents_.end();
+    off_t best_gap = 0;
+    for (Extents::iterator it = extents_.begin(), next = ++extents_.begin(); next != extents_.end(); ++it, ++next) {
+      off_t gap = next->first - it->second;
+      if (best == extents_.end() || gap < best_gap) {
+        best = it;
+        best_gap = gap;
+      }
+    }
+
+    Extents::iterator next = best;
+    ++next;
+    best->second = next->second;
+    extents_.erase(next);
+  }
+}
+
+} // namespace cbb
@@ -0,0 +1,68 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef CBB_DIRTY_EXTENTS_H_
+#define CBB_DIRTY_EXTENTS_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+#include <map>
+
+#define DIRTY_BLOCK_SIZE  (64 << 10)  // 変更範囲を記録する単位 (バイト)
+#define DIRTY_EXTENT_MAX  64          // 記録する範囲の最大数 (超えた場合は近い範囲をまとめる)
+
+namespace cbb {
+
+// ファイル内の変更された範囲 (DIRTY_BLOCK_SIZE 単位に揃えた [開始, 終了) の集合)
+//   範囲の数は DIRTY_EXTENT_MAX 以下に保ち、拡張属性に保存できる大きさにする。
+//   サイズ変更は最小のサイズだけを覚え、書き出し時にいったんそのサイズまで縮めてから範囲を書き込む。
+class DirtyExtents {
+
+ public:
+
+  typedef std::map<off_t, off_t> Extents;
+
+  DirtyExtents() : truncated_(-1), is_full_(false) {}
+
+  void Add(off_t offset, size_t size);
+  void Truncate(off_t size);
+  void Merge(const DirtyExtents &other);
+  void SetFull() { is_full_ = true; truncated_ = -1; extents_.clear(); }
+  void Clear() { is_full_ = false; truncated_ = -1; extents_.clear(); }
+
+  bool empty() const { return !is_full_ && truncated_ < 0 && extents_.empty(); }
+  bool is_full() const { return is_full_; }
+  off_t truncated() const { return truncated_; }
+  uint64_t bytes() const;
+  const Extents &extents() const { return extents_; }
+
+  std::string str() const;
+  static bool Parse(const std::string &value, DirtyExtents *extents_ptr);
+
+ private:
+
+  void Insert(off_t start, off_t end);
+  void Coalesce();
+
+  Extents extents_;  // 開始オフセット → 終了オフセット (重ならず、隣接しない)
+  off_t truncated_;  // 記録中に縮めた最小のファイルサイズ (なしの場合は-1)
+  bool is_full_;     // ファイル全体が変更されたものとして扱うかどうか
+};
+
+} // namespace cbb
+
+#endif // CBB_DIRTY_EXTENTS_H_
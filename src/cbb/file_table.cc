@@ -0,0 +1,134 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "file_table.h"
+
+// 空きスロットがないことを表すスロット番号
+#define NO_SLOT 0xffffffffU
+
+// ファイルハンドルテーブルクラス
+namespace cbb {
+
+/**
+ * @breaf constructor (全スロットを空きスタックに積む)
+ * @param size スロット数
+ */
+FileTable::FileTable(uint32_t size) : slots_(size), free_head_(0), used_(0) {
+  for (uint32_t index = 0; index < size; index++) {
+    slots_[index].next = index + 1 < size ? index + 1: NO_SLOT;
+  }
+  free_head_ = size > 0 ? 0: NO_SLOT;
+}
+
+/**
+ * @breaf ファイルの登録
+ * @param file ファイル情報 (スロットにコピーする)
+ * @return ハンドル (空きスロットがない場合は0)
+ */
+uint64_t FileTable::Insert(const File &file) {
+  uint32_t index = Pop();
+  if (index == NO_SLOT) {
+    return 0;
+  }
+
+  Slot &slot = slots_[index];
+  slot.file = file;
+  __sync_synchronize();
+  slot.tag = slot.generation;
+  __sync_add_and_fetch(&used_, 1);
+
+  return ((uint64_t)slot.generation << 32) | (index + 1);
+}
+
+/**
+ * @breaf ハンドルからファイルを求める
+ * @param handle ハンドル
+ * @return ファイル情報 (Remove まで有効、解放済み、範囲外の場合はNULL)
+ */
+const File *FileTable::Lookup(uint64_t handle) const {
+  uint32_t index = (uint32_t)handle - 1;
+  if (index >= slots_.size()) {
+    return NULL;
+  }
+
+  const Slot &slot = slots_[index];
+  uint32_t tag = slot.tag;
+  if (tag == 0 || tag != (uint32_t)(handle >> 32)) {
+    return NULL;
+  }
+  __sync_synchronize();
+  return &slot.file;
+}
+
+/**
+ * @breaf ファイルの登録解除 (スロットの世代を進め、古いハンドルを無効にする)
+ * @param handle ハンドル
+ * @return bool 解除したかどうか
+ */
+bool FileTable::Remove(uint64_t handle) {
+  uint32_t index = (uint32_t)handle - 1;
+  if (index >= slots_.size()) {
+    return false;
+  }
+
+  Slot &slot = slots_[index];
+  uint32_t generation = (uint32_t)(handle >> 32);
+  if (generation == 0 || !__sync_bool_compare_and_swap(&slot.tag, generation, 0)) {
+    return false;
+  }
+
+  // 世代0は使わない (ハンドル0を無効値にするため)
+  slot.generation = generation + 1 != 0 ? generation + 1: 1;
+  slot.file = File();
+  __sync_sub_and_fetch(&used_, 1);
+  Push(index);
+  return true;
+}
+
+/**
+ * @breaf 空きスロットを取り出す
+ * @return スロット番号 (空きがない場合は NO_SLOT)
+ */
+uint32_t FileTable::Pop() {
+  while (true) {
+    uint64_t head = free_head_;
+    uint32_t index = (uint32_t)head;
+    if (index == NO_SLOT) {
+      return NO_SLOT;
+    }
+    uint64_t next = ((head >> 32) + 1) << 32 | slots_[index].next;
+    if (__sync_bool_compare_and_swap(&free_head_, head, next)) {
+      return index;
+    }
+  }
+}
+
+/**
+ * @breaf 空きスロットを戻す
+ * @param index スロット番号
+ */
+void FileTable::Push(uint32_t index) {
+  while (true) {
+    uint64_t head = free_head_;
+    slots_[index].next = (uint32_t)head;
+    __sync_synchronize();
+    uint64_t next = ((head >> 32) + 1) << 32 | index;
+    if (__sync_bool_compare_and_swap(&free_head_, head, next)) {
+      return;
+    }
+  }
+}
+
+} // namespace cbb
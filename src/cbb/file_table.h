@@ -0,0 +1,72 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef CBB_FILE_TABLE_H_
+#define CBB_FILE_TABLE_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "burst_buffer_client.h"
+
+// ファイルテーブルの既定のスロット数 (同時に開けるファイル数)
+#define FILE_TABLE_SIZE 16384
+
+namespace cbb {
+
+// 開いているファイルのハンドルテーブルクラス
+//
+// スロットを起動時に確保しておき、ハンドル (FUSE の fh) は
+// 上位32bitにスロットの世代、下位32bitにスロット番号+1を持つ。
+// Lookup はロックもヒープ確保も行わずにスロットの File を参照する。
+// 空きスロットは世代付きの先頭を CAS で更新するロックフリーのスタックで管理する。
+// 同じハンドルの Lookup と Remove を同時に呼ばないこと (FUSE は release を最後に呼ぶ)。
+class FileTable {
+ public:
+  explicit FileTable(uint32_t size = FILE_TABLE_SIZE);
+  virtual ~FileTable() {}
+
+  uint64_t Insert(const File &file);
+  const File *Lookup(uint64_t handle) const;
+  bool Remove(uint64_t handle);
+
+  uint32_t size() const { return (uint32_t)slots_.size(); }
+  uint32_t used() const { return used_; }
+
+ private:
+  struct Slot {
+    File file;
+    volatile uint32_t tag;  // 使用中のハンドルの世代 (空きの場合は0、File を書き終えてから設定する)
+    uint32_t generation;    // 次に発行するハンドルの世代 (解放するたびに進める)
+    uint32_t next;          // 次の空きスロット番号 (NO_SLOT は終端)
+
+    Slot() : tag(0), generation(1), next(0) {}
+  };
+
+  std::vector<Slot> slots_;
+  volatile uint64_t free_head_;  // 上位32bitは更新回数 (ABA対策)、下位32bitは先頭の空きスロット番号
+  volatile uint32_t used_;
+
+  uint32_t Pop();
+  void Push(uint32_t index);
+
+  FileTable(const FileTable &);
+  FileTable &operator=(const FileTable &);
+};
+
+} // namespace cbb
+
+#endif // CBB_FILE_TABLE_H_
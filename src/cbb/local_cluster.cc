@@ -0,0 +1,193 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "local_cluster.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <boost/format.hpp>
+#include <boost/filesystem.hpp>
+
+#define LOCAL_CLUSTER_HOST        "127.0.0.1"
+#define LOCAL_CLUSTER_LISTEN_RETRY  10
+#define LOCAL_CLUSTER_INTERVAL      1 // min
+
+// テスト・ベンチマーク用ローカルクラスタ
+namespace cbb {
+
+/**
+ * @breaf 空いているループバックのポート番号を取得
+ * @return ポート番号 (失敗時は0)
+ */
+static int find_free_port() {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) {
+    return 0;
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+
+  int port = 0;
+  socklen_t length = sizeof(addr);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+      getsockname(sock, (struct sockaddr *)&addr, &length) == 0) {
+    port = ntohs(addr.sin_port);
+  }
+  close(sock);
+
+  return port;
+}
+
+/**
+ * @breaf クラスタ起動
+ * @param server_count サーバー数
+ * @param thread_count サーバーごとのスレッド数
+ * @return Error値
+ */
+Error LocalCluster::Start(int server_count, int thread_count) {
+  Stop();
+
+  const char *tmp_dir = getenv("TMPDIR");
+  std::string root_template = std::string(tmp_dir != NULL ? tmp_dir: "/tmp") + "/cbb_cluster_XXXXXX";
+  std::vector<char> root_path(root_template.begin(), root_template.end());
+  root_path.push_back('\0');
+  if (mkdtemp(&root_path[0]) == NULL) {
+    return -errno;
+  }
+  root_path_ = &root_path[0];
+
+  for (int index = 0; index < server_count; index++) {
+    Error error = StartNode(index, thread_count);
+    if (error != kCBBSuccess) {
+      Stop();
+      return error;
+    }
+  }
+
+  return kCBBSuccess;
+}
+
+/**
+ * @breaf サーバーの追加 (構成の変更は呼び出し元が行う)
+ * @param thread_count スレッド数
+ * @return Error値
+ */
+Error LocalCluster::AddServer(int thread_count) {
+  if (root_path_.empty()) {
+    return -EINVAL;
+  }
+  return StartNode(nodes_.size(), thread_count);
+}
+
+/**
+ * @breaf サーバー1台の起動
+ * @param index サーバー番号
+ * @param thread_count スレッド数
+ * @return Error値
+ */
+Error LocalCluster::StartNode(int index, int thread_count) {
+  Node node;
+  node.bb = NULL;
+  node.port = 0;
+  node.local_path = (boost::format("%1%/local.%2%") % root_path_ % index).str();
+  node.secondary_path = (boost::format("%1%/secondary.%2%") % root_path_ % index).str();
+
+  if (mkdir(node.local_path.c_str(), S_IRWXU) != 0 ||
+      mkdir(node.secondary_path.c_str(), S_IRWXU) != 0) {
+    return -errno;
+  }
+
+  node.bb = new BurstBuffer(node.local_path, node.secondary_path, LOCAL_CLUSTER_INTERVAL);
+
+  // 空きポートの取得から待ち受けまでの間に他に取られた場合は取り直す
+  for (int retry = 0; retry < LOCAL_CLUSTER_LISTEN_RETRY && node.port == 0; retry++) {
+    int port = find_free_port();
+    if (port == 0) {
+      continue;
+    }
+    try {
+      node.bb->instance.listen(LOCAL_CLUSTER_HOST, port);
+      node.port = port;
+    } catch (...) {
+      DMSG("LocalCluster : listen error port = %d\n", port);
+    }
+  }
+
+  if (node.port == 0) {
+    delete node.bb;
+    return -EADDRINUSE;
+  }
+
+  node.bb->instance.start(thread_count);
+  nodes_.push_back(node);
+
+  return kCBBSuccess;
+}
+
+/**
+ * @breaf クラスタ停止 (一時ディレクトリも削除する)
+ */
+void LocalCluster::Stop() {
+  for (size_t index = 0; index < nodes_.size(); index++) {
+    Node &node = nodes_[index];
+    node.bb->instance.end();
+    node.bb->instance.join();
+    node.bb->instance.close();
+    delete node.bb;
+  }
+  nodes_.clear();
+
+  if (!root_path_.empty()) {
+    boost::system::error_code error_code;
+    boost::filesystem::remove_all(root_path_, error_code);
+    root_path_.clear();
+  }
+}
+
+/**
+ * @breaf サーバーのアドレス
+ * @param index サーバー番号
+ * @return "host:port" 形式のアドレス
+ */
+std::string LocalCluster::address(int index) const {
+  return (boost::format("%1%:%2%") % LOCAL_CLUSTER_HOST % nodes_[index].port).str();
+}
+
+/**
+ * @breaf クラスタに接続するクライアント設定
+ * @return 設定内容
+ */
+Settings LocalCluster::client_settings() const {
+  std::vector<std::string> hosts;
+  for (size_t index = 0; index < nodes_.size(); index++) {
+    hosts.push_back(address(index));
+  }
+
+  Settings settings;
+  settings.SetClient(hosts, nodes_.empty() ? 0: nodes_[0].port);
+  return settings;
+}
+
+} // namespace cbb
@@ -0,0 +1,71 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef CBB_LOCAL_CLUSTER_H_
+#define CBB_LOCAL_CLUSTER_H_
+
+#include <string>
+#include <vector>
+
+#include "common/error.h"
+#include "common/common.h"
+#include "util/settings.h"
+#include "burst_buffer.h"
+
+namespace cbb {
+
+// 1プロセス内で複数のCBBサーバーをループバックで起動するテスト・ベンチマーク用クラスタ
+//   各サーバーは一時ディレクトリ以下に専用のローカル/セカンドストレージを持つ。
+//   root権限、FUSE、設定ファイルは不要。
+class LocalCluster {
+
+ public:
+
+  LocalCluster() {}
+  virtual ~LocalCluster() { Stop(); }
+
+  Error Start(int server_count, int thread_count = 2);
+  Error AddServer(int thread_count = 2);
+  void Stop();
+
+  Settings client_settings() const;
+
+  int server_count() const { return (int)nodes_.size(); }
+  int port(int index) const { return nodes_[index].port; }
+  std::string address(int index) const;
+  BurstBuffer *server(int index) const { return nodes_[index].bb; }
+  const std::string &local_path(int index) const { return nodes_[index].local_path; }
+  const std::string &secondary_path(int index) const { return nodes_[index].secondary_path; }
+  const std::string &root_path() const { return root_path_; }
+
+ private:
+
+  /// サーバー1台分の情報
+  struct Node {
+    BurstBuffer *bb;
+    int port;
+    std::string local_path;
+    std::string secondary_path;
+  };
+
+  Error StartNode(int index, int thread_count);
+
+  std::string root_path_;
+  std::vector<Node> nodes_;
+};
+
+} // namespace cbb
+
+#endif // CBB_LOCAL_CLUSTER_H_
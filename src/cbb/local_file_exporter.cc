@@ -16,6 +16,11 @@
 #include "local_file_exporter.h"
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <vector>
 
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
@@ -23,7 +28,14 @@
 
 #include "common/error.h"
 #include "common/common.h"
+#include "util/file_control.h"
+#include "util/io_priority.h"
+#include "util/secondary_throttle.h"
 #include "meta_data_manager.h"
+#include "server_stats.h"
+
+#define STRIPE_COPY_BUFFER_SIZE  (1 << 20)
+#define EXPORT_COPY_BUFFER_SIZE  (1 << 20)
 
 // ローカルストレージのファイルをセカンダリストレージにコピーするクラス
 namespace cbb {
@@ -43,7 +55,7 @@ void LocalFileExporter::Create(MetaDataManager *md_manager_ptr, int interval_tim
   mutex_.Init();
   md_manager_ptr_ = md_manager_ptr;
 
-  SearchLocalFiles(md_manager_ptr->local_path(""));
+  SearchAllDevices();
 
   Thread::Create(NULL, interval_time);
 }
@@ -75,12 +87,12 @@ bool LocalFileExporter::Register(const std::string &path) {
     return false;
   }
 
-  mutex_.Lock();
+  LockTable();
 
   local_files_[path] = time;
   DMSG("LocalFileExporter::Register : %s : %d\n", path.c_str(), time);
 
-  mutex_.Unlock();
+  UnlockTable();
 
   return true;
 }
@@ -90,23 +102,25 @@ bool LocalFileExporter::Register(const std::string &path) {
  * @param path ファイルパス
  */
 void LocalFileExporter::Unregister(const std::string &path) {
-  mutex_.Lock();
+  LockTable();
 
   local_files_.erase(path);
+  exported_stripes_.erase(path);
   DMSG("LocalFileExporter::Unregister : %s : %d\n", path.c_str());
 
-  mutex_.Unlock();
+  UnlockTable();
 }
 
 /**
  * @breaf すべての登録を解除する
  */
 void LocalFileExporter::UnregisterAll() {
-  mutex_.Lock();
+  LockTable();
 
   local_files_.clear();
+  exported_stripes_.clear();
 
-  mutex_.Unlock();
+  UnlockTable();
 }
 
 /**
@@ -114,7 +128,16 @@ void LocalFileExporter::UnregisterAll() {
  */
 void LocalFileExporter::ReSearchLocalFiles() {
   UnregisterAll();
-  SearchLocalFiles(md_manager_ptr_->local_path(""));
+  SearchAllDevices();
+}
+
+/**
+ * @breaf Localストレージのすべてのデバイスのファイルをサーチして登録する
+ */
+void LocalFileExporter::SearchAllDevices() {
+  for (int device = 0; device < md_manager_ptr_->devices().size(); device++) {
+    SearchLocalFiles(md_manager_ptr_->device_path(device, ""), md_manager_ptr_->device_path(device, ""));
+  }
 }
 
 /**
@@ -126,12 +149,11 @@ void LocalFileExporter::CheckLocalFiles() {
 
   DMSG("LocalFileExporter::CheckLocalFiles\n");
 
-  mutex_.Lock();
+  LockTable();
 
   for (LocalFiles::iterator it = local_files_.begin(); it != local_files_.end(); it++) {
     std::string filename = it->first;
     std::time_t mod_time = it->second;
-    bool is_copy = true;
 
     DMSG("check : %s\n", filename.c_str());
 
@@ -139,20 +161,23 @@ void LocalFileExporter::CheckLocalFiles() {
     std::string source = md_manager_ptr_->local_path(filename);
     std::string destination = md_manager_ptr_->secondary_path(filename);
 
-    if (boost::filesystem::exists(source)) {
-      if (boost::filesystem::exists(destination)) {
-        const std::time_t last_update_src = boost::filesystem::last_write_time(source);
-        const std::time_t last_update_dst = boost::filesystem::last_write_time(destination);
-
-        if (last_update_src <= last_update_dst) {
-          is_copy = false;
+    StripeLayout layout;
+    md_manager_ptr_->GetLocalStripe(filename, &layout);
+
+    if (boost::filesystem::exists(source) && layout.is_striped()) {
+      // ストライプファイルは複数サーバーが同じSecondaryファイルに書き込むため、
+      // Secondaryの更新日時ではなく自分が最後にエクスポートした時点と比較する
+      const std::time_t last_update_src = boost::filesystem::last_write_time(source);
+      LocalFiles::iterator it_exported = exported_stripes_.find(filename);
+      if (it_exported == exported_stripes_.end() || it_exported->second < last_update_src) {
+        StatsTimer timer(kPhaseCopy);
+        DMSG("copy stripes %s to %s\n", source.c_str(), destination.c_str());
+        if (CopyStripes(filename, layout)) {
+          exported_stripes_[filename] = last_update_src;
         }
       }
-
-      if (is_copy) {
-        DMSG("copy %s to %s\n", source.c_str(), destination.c_str());
-        boost::filesystem::copy_file(source, destination, boost::filesystem::copy_option::overwrite_if_exists);
-      }
+    } else if (boost::filesystem::exists(source)) {
+      ExportFile(filename);
     } else {
       erase_filename.push_back(filename);
     }
@@ -162,6 +187,245 @@ void LocalFileExporter::CheckLocalFiles() {
     local_files_.erase(filename);
   }
 
+  UnlockTable();
+}
+
+
+/**
+ * @breaf ストライプなしのファイルをSecondaryへ書き出す
+ *   変更範囲の記録があり、Secondaryのファイルが前回の書き出し時点から変わっていなければ
+ *   変更範囲だけを書き込む。Secondaryにない場合や他から更新された場合はファイル全体をコピーする。
+ * @param path ファイルパス
+ * @return bool 書き出し結果
+ */
+bool LocalFileExporter::ExportFile(const std::string &path) {
+  std::string source = md_manager_ptr_->local_path(path);
+  std::string destination = md_manager_ptr_->secondary_path(path);
+
+  // 共有のファイルシステムへの帯域とメタデータ操作を制限する
+  SecondaryThrottle::ExportScope export_scope(md_manager_ptr_->secondary_throttle());
+  md_manager_ptr_->secondary_throttle().Operation();
+
+  DirtyExtents extents;
+  bool has_record = md_manager_ptr_->TakeDirty(path, &extents);
+
+  struct stat src_st, dst_st;
+  if (stat(source.c_str(), &src_st) != 0) {
+    if (has_record) {
+      md_manager_ptr_->RestoreDirty(path, extents);
+    }
+    return false;
+  }
+  bool has_destination = stat(destination.c_str(), &dst_st) == 0;
+
+  bool is_incremental = false;
+  if (!has_record) {
+    // 記録のないファイルは更新日時で判断する
+    if (has_destination && src_st.st_mtime <= dst_st.st_mtime) {
+      return true;
+    }
+  } else if (!extents.is_full() && has_destination && md_manager_ptr_->CheckExportBaseline(path, dst_st)) {
+    if (extents.empty() && src_st.st_size == dst_st.st_size) {
+      return true;
+    }
+    is_incremental = true;
+  }
+
+  bool result;
+  {
+    StatsTimer timer(kPhaseCopy);
+    if (is_incremental) {
+      DMSG("copy extents %s to %s (%llu bytes)\n", source.c_str(), destination.c_str(), (unsigned long long)extents.bytes());
+      result = CopyExtents(path, extents);
+    } else {
+      DMSG("copy %s to %s\n", source.c_str(), destination.c_str());
+      result = MetaDataManager::CopyFile(source, destination, false) == kCBBSuccess;
+    }
+  }
+
+  if (result && stat(destination.c_str(), &dst_st) == 0) {
+    md_manager_ptr_->SetExportBaseline(path, dst_st);
+  } else if (has_record) {
+    md_manager_ptr_->RestoreDirty(path, extents);
+  }
+  return result;
+}
+
+/**
+ * @breaf 変更範囲だけをSecondaryファイルの同じオフセットに書き込む
+ *   縮められていた場合は先にそのサイズまで縮め、最後にLocalファイルのサイズに揃える。
+ * @param path ファイルパス
+ * @param extents 変更範囲
+ * @return bool コピー結果
+ */
+bool LocalFileExporter::CopyExtents(const std::string &path, const DirtyExtents &extents) {
+  std::string source = md_manager_ptr_->local_path(path);
+  std::string destination = md_manager_ptr_->secondary_path(path);
+
+  FileControl src_file;
+  int src_fd = src_file.Open(source.c_str(), O_RDONLY);
+  if (src_fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(src_fd, &st) != 0) {
+    src_file.Close();
+    return false;
+  }
+
+  int dst_fd = open(destination.c_str(), O_WRONLY);
+  if (dst_fd < 0) {
+    src_file.Close();
+    return false;
+  }
+
+  bool result = true;
+  if (extents.truncated() >= 0) {
+    result = ftruncate(dst_fd, extents.truncated()) == 0;
+  }
+
+  std::vector<char> buf(EXPORT_COPY_BUFFER_SIZE);
+  const DirtyExtents::Extents &ranges = extents.extents();
+  for (DirtyExtents::Extents::const_iterator it = ranges.begin(); it != ranges.end() && result; ++it) {
+    off_t end = std::min<off_t>(it->second, st.st_size);
+    for (off_t offset = it->first; offset < end; ) {
+      ssize_t length = src_file.Read(&buf[0], std::min<off_t>(buf.size(), end - offset), offset);
+      if (length <= 0 || pwrite(dst_fd, &buf[0], length, offset) != length) {
+        result = false;
+        break;
+      }
+      offset += length;
+      IoPriority::Pace(length);
+      SecondaryThrottle::Pace(length);
+    }
+  }
+
+  if (result) {
+    result = ftruncate(dst_fd, st.st_size) == 0;
+  }
+
+  close(dst_fd);
+  src_file.Close();
+  return result;
+}
+
+/**
+ * @breaf ストライプされたファイルをすぐにSecondaryへ書き出して登録を解除する
+ *   サーバー構成の変更でストライプの担当が変わる場合に、Localのファイルを削除する前に使う。
+ * @param path ファイルパス
+ * @return bool 書き出し結果
+ */
+bool LocalFileExporter::ExportStripes(const std::string &path) {
+  StripeLayout layout;
+  md_manager_ptr_->GetLocalStripe(path, &layout);
+  if (!layout.is_striped()) {
+    return false;
+  }
+
+  LockTable();
+  bool result;
+  {
+    StatsTimer timer(kPhaseCopy);
+    result = CopyStripes(path, layout);
+  }
+  if (result) {
+    local_files_.erase(path);
+    exported_stripes_.erase(path);
+  }
+  UnlockTable();
+
+  return result;
+}
+
+/**
+ * @breaf 自分が担当するストライプだけをSecondaryファイルの同じオフセットに書き込む
+ * @param path ファイルパス
+ * @param layout ストライプ配置
+ * @return bool コピー結果
+ */
+bool LocalFileExporter::CopyStripes(const std::string &path, const StripeLayout &layout) {
+  std::string source = md_manager_ptr_->local_path(path);
+  std::string destination = md_manager_ptr_->secondary_path(path);
+
+  SecondaryThrottle::ExportScope export_scope(md_manager_ptr_->secondary_throttle());
+  md_manager_ptr_->secondary_throttle().Operation();
+
+  FileControl src_file;
+  int src_fd = src_file.Open(source.c_str(), O_RDONLY);
+  if (src_fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(src_fd, &st) != 0) {
+    src_file.Close();
+    return false;
+  }
+
+  int dst_fd = open(destination.c_str(), O_WRONLY | O_CREAT, st.st_mode & 07777);
+  if (dst_fd < 0) {
+    src_file.Close();
+    return false;
+  }
+
+  bool result = true;
+  std::vector<char> buf(std::min<uint64_t>(layout.size, STRIPE_COPY_BUFFER_SIZE));
+  uint64_t stride = layout.size * layout.count;
+
+  for (off_t start = layout.size * layout.index; start < st.st_size && result; start += stride) {
+    off_t end = std::min<off_t>(start + layout.size, st.st_size);
+    for (off_t offset = start; offset < end; ) {
+      ssize_t length = src_file.Read(&buf[0], std::min<off_t>(buf.size(), end - offset), offset);
+      if (length <= 0 || pwrite(dst_fd, &buf[0], length, offset) != length) {
+        result = false;
+        break;
+      }
+      offset += length;
+      IoPriority::Pace(length);
+      SecondaryThrottle::Pace(length);
+    }
+  }
+
+  // 担当番号0のサーバーが論理サイズを保持している (Release時に揃えられる)
+  struct stat dst_st;
+  if (result && layout.index == 0 && fstat(dst_fd, &dst_st) == 0 && dst_st.st_size < st.st_size) {
+    result = ftruncate(dst_fd, st.st_size) == 0;
+  }
+
+  close(dst_fd);
+  src_file.Close();
+
+  if (result) {
+    md_manager_ptr_->SetSecondaryStripe(path, layout);
+  }
+  return result;
+}
+
+/**
+ * @breaf エクスポート待ちのファイル数
+ * @return size_t ファイル数
+ */
+size_t LocalFileExporter::queue_depth() {
+  mutex_.Lock();
+  size_t depth = queue_depth_;
+  mutex_.Unlock();
+  return depth;
+}
+
+/**
+ * @breaf 登録テーブルのロック (待ち時間は統計情報のqueue区間に加算)
+ */
+void LocalFileExporter::LockTable() {
+  StatsTimer timer(kPhaseQueue);
+  mutex_.Lock();
+}
+
+/**
+ * @breaf 登録テーブルのアンロック (登録数も更新する)
+ */
+void LocalFileExporter::UnlockTable() {
+  queue_depth_ = local_files_.size();
   mutex_.Unlock();
 }
 
@@ -172,6 +436,8 @@ void LocalFileExporter::CheckLocalFiles() {
  * @return bool 呼び出しを継続するかどうか
  */
 bool LocalFileExporter::ThreadCall(void *user_data) {
+  // 定期的な書き出しはアプリケーションの読み書きを優先する
+  IoPriority::BackgroundScope background_scope(md_manager_ptr_->io_priority());
   CheckLocalFiles();
   return true;
 }
@@ -180,12 +446,12 @@ bool LocalFileExporter::ThreadCall(void *user_data) {
 /**
  * @breaf ローカルファイルをサーチして登録する
  * @param path 検索ディレクトリパス
+ * @param local_path 検索するデバイスのルートパス
  */
-void LocalFileExporter::SearchLocalFiles(std::string path) {
+void LocalFileExporter::SearchLocalFiles(std::string path, const std::string &local_path) {
   DIR *dp;
   struct dirent *ent;
   struct stat st;
-  std::string local_path = md_manager_ptr_->local_path("");
 
   dp = opendir(path.c_str());
   if (dp == NULL) {
@@ -195,6 +461,11 @@ void LocalFileExporter::SearchLocalFiles(std::string path) {
   while ((ent = readdir(dp)) != NULL) {
     std::string fname = path + "/" + ent->d_name;
 
+    // サーバー内部ファイル (レプリカ、配置ディレクトリ等) は除く
+    if (is_internal_name(ent->d_name)) {
+      continue;
+    }
+
     // file
     if (boost::filesystem::is_regular_file(fname)) {
       std::string tmp = fname.substr(local_path.length());
@@ -204,7 +475,7 @@ void LocalFileExporter::SearchLocalFiles(std::string path) {
     // directory
     else if (boost::filesystem::is_directory(fname)) {
       if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
-        SearchLocalFiles(fname);
+        SearchLocalFiles(fname, local_path);
       }
     }
   }
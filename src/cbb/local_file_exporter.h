@@ -28,13 +28,15 @@
 namespace cbb {
 
 class MetaDataManager;
+class DirtyExtents;
+struct StripeLayout;
 
 // ローカルストレージのファイルをセカンダリストレージにコピーするクラス
 class LocalFileExporter : public Thread {
 
  public:
 
-  LocalFileExporter() : md_manager_ptr_(NULL) {}
+  LocalFileExporter() : md_manager_ptr_(NULL), queue_depth_(0) {}
   virtual ~LocalFileExporter() {}
 
   void Create(MetaDataManager *md_manager_ptr, int interval_time);
@@ -46,19 +48,30 @@ class LocalFileExporter : public Thread {
 
   void ReSearchLocalFiles();
   void CheckLocalFiles();
+  bool ExportStripes(const std::string &path);
+
+  size_t queue_depth();
 
  protected:
   bool ThreadCall(void *user_data);
 
  private:
 
-  void SearchLocalFiles(std::string path);
+  void SearchLocalFiles(std::string path, const std::string &local_path);
+  void SearchAllDevices();
+  bool ExportFile(const std::string &path);
+  bool CopyExtents(const std::string &path, const DirtyExtents &extents);
+  bool CopyStripes(const std::string &path, const StripeLayout &layout);
+  void LockTable();
+  void UnlockTable();
 
   typedef std::map<std::string, time_t> LocalFiles;
   LocalFiles local_files_;
+  LocalFiles exported_stripes_;  // ストライプファイルの最終エクスポート時の更新日時
 
   Mutex mutex_;
   MetaDataManager *md_manager_ptr_;
+  size_t queue_depth_;
 };
 
 } // namespace cbb
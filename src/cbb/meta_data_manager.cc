@@ -13,17 +13,109 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 //
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/xattr.h>
+
+#include <boost/foreach.hpp>
+#include <boost/functional/hash.hpp>
 
 #include "common/error.h"
 #include "common/common.h"
 #include "util/file_control.h"
+#include "util/io_priority.h"
+#include "util/secondary_throttle.h"
 #include "meta_data_manager.h"
+#include "server_stats.h"
+
+#define STRIPE_XATTR_NAME  "user.cbb.stripe"
+#define DIRTY_XATTR_NAME   "user.cbb.dirty"     // 変更範囲 ("o;..." 書き込み中 / "c;..." 確定)
+#define EXPORT_XATTR_NAME  "user.cbb.exported"  // 前回の書き出し直後のSecondaryの "size:sec:nsec"
+
+// fdキャッシュのキーにするオープンフラグ (これ以外のフラグの違いは同じfdで扱える)
+#define FD_CACHE_FLAGS  (O_ACCMODE | O_APPEND | O_DIRECT | O_SYNC | O_DSYNC | O_NOATIME)
 
 // 各ファイル等のメタデータマネージャークラス
 namespace cbb {
 
+/**
+ * @breaf ストライプ配置の読み込み ("size:count:index" 形式の拡張属性)
+ * @param filename 実ファイルパス
+ * @param layout_ptr ストライプ配置保存ポインタ
+ * @return bool 拡張属性があったかどうか
+ */
+static bool read_stripe_xattr(const std::string &filename, StripeLayout *layout_ptr) {
+  char value[64];
+  ssize_t length = getxattr(filename.c_str(), STRIPE_XATTR_NAME, value, sizeof(value) - 1);
+  if (length <= 0) {
+    return false;
+  }
+  value[length] = '\0';
+
+  unsigned long long size = 0;
+  int count = 0, index = 0;
+  if (sscanf(value, "%llu:%d:%d", &size, &count, &index) != 3) {
+    return false;
+  }
+
+  layout_ptr->size = size;
+  layout_ptr->count = count;
+  layout_ptr->index = index;
+  return true;
+}
+
+/**
+ * @breaf ストライプ配置の書き込み
+ * @param filename 実ファイルパス
+ * @param layout ストライプ配置
+ * @return Error値
+ */
+static Error write_stripe_xattr(const std::string &filename, const StripeLayout &layout) {
+  char value[64];
+  int length = snprintf(value, sizeof(value), "%llu:%d:%d", (unsigned long long)layout.size, layout.count, layout.index);
+  return errno_to_cbb_error(setxattr(filename.c_str(), STRIPE_XATTR_NAME, value, length, 0));
+}
+
+/**
+ * @breaf 変更範囲の読み込み
+ *   書き込み中の印が残っている場合 (異常終了した場合) は記録が不完全なのでファイル全体とする。
+ * @param filename 実ファイルパス
+ * @param extents_ptr 変更範囲保存ポインタ
+ * @return bool 拡張属性があったかどうか
+ */
+static bool read_dirty_xattr(const std::string &filename, DirtyExtents *extents_ptr) {
+  char value[4096];
+  ssize_t length = getxattr(filename.c_str(), DIRTY_XATTR_NAME, value, sizeof(value) - 1);
+  if (length < 0) {
+    if (errno == ERANGE) {
+      extents_ptr->SetFull();
+      return true;
+    }
+    extents_ptr->Clear();
+    return false;
+  }
+  value[length] = '\0';
+
+  if (length < 2 || value[0] != 'c' || value[1] != ';' || !DirtyExtents::Parse(value + 2, extents_ptr)) {
+    extents_ptr->SetFull();
+  }
+  return true;
+}
+
+/**
+ * @breaf 変更範囲の書き込み
+ * @param filename 実ファイルパス
+ * @param extents 変更範囲
+ * @param is_open 書き込み中の印を付けるかどうか
+ * @return Error値
+ */
+static Error write_dirty_xattr(const std::string &filename, const DirtyExtents &extents, bool is_open) {
+  std::string value = (is_open ? "o;" : "c;") + extents.str();
+  return errno_to_cbb_error(setxattr(filename.c_str(), DIRTY_XATTR_NAME, value.c_str(), value.size(), 0));
+}
+
 /**
  * @breaf テーブル登録
  * @param path ファイルパス
@@ -33,6 +125,12 @@ namespace cbb {
  */
 Error MetaDataManager::Register(const std::string &path, int fd) {
   table_[path].insert(fd);
+  RegisterDevice(path, fd);
+
+  dirty_mutex_.Lock();
+  fd_paths_[fd] = path;
+  dirty_mutex_.Unlock();
+
   return kCBBSuccess;
 }
 
@@ -42,14 +140,24 @@ Error MetaDataManager::Register(const std::string &path, int fd) {
  * @return Error値
  */
 Error MetaDataManager::Unregister(const std::string &path) {
+  InvalidateFdCache(path);
+
   BufferedFiles::iterator it = table_.find(path);
   if (it != table_.end()) {
+    dirty_mutex_.Lock();
+    for (std::set<int>::iterator it_fd = it->second.begin(); it_fd != it->second.end(); it_fd++) {
+      fd_paths_.erase(*it_fd);
+    }
+    dirty_mutex_.Unlock();
+
     for (std::set<int>::iterator it_fd = it->second.begin(); it_fd != it->second.end(); it_fd++) {
+      devices_.Close(*it_fd);
       FileControl file_control(*it_fd);
       file_control.Close();
     }
     table_.erase(path);
   }
+  CloseDirty(path);
 
   return kCBBSuccess;
 }
@@ -64,34 +172,321 @@ Error MetaDataManager::Unregister(const std::string &path, int fd) {
   BufferedFiles::iterator it = table_.find(path);
   if (it != table_.end()) {
     it->second.erase(fd);
+    devices_.Close(fd);
+
+    dirty_mutex_.Lock();
+    fd_paths_.erase(fd);
+    dirty_mutex_.Unlock();
+
     if (it->second.empty()) {
       table_.erase(path);
+      CloseDirty(path);
     }
   }
   return kCBBSuccess;
 }
 
 /**
- * @breaf ファイル属性取得
+ * @breaf fdキャッシュの設定
+ * @param cache_size 閉じずに再利用のため開いておく未使用fdの最大数 (0の場合はキャッシュしない)
+ */
+void MetaDataManager::SetFdCachePolicy(int cache_size) {
+  fd_cache_mutex_.Lock();
+  fd_cache_size_ = cache_size > 0 ? cache_size: 0;
+  while (fd_idle_.size() > fd_cache_size_) {
+    FdCache::iterator it = fd_cache_.find(fd_idle_.back());
+    FileControl(it->first).Close();
+    EraseCachedFd(it);
+  }
+  fd_cache_mutex_.Unlock();
+}
+
+/**
+ * @breaf Localストレージのデバイスの設定 (ファイルを開く前に呼ぶ)
+ * @param roots デバイスのルートパス (先頭は local_storage_root_path_)
+ */
+void MetaDataManager::SetLocalDevices(const std::vector<std::string> &roots) {
+  devices_.Init(roots.empty() ? std::vector<std::string>(1, local_storage_root_path_): roots);
+}
+
+/**
+ * @breaf デバイス間ストライプの設定
+ * @param stripe_size ストライプサイズ (0の場合はストライプしない)
+ * @param patterns 作成時にストライプするパスのパターン (fnmatch形式、カンマ区切り)
+ * @param min_size Secondaryから取り込む時にストライプするファイルサイズ (0の場合は取り込み時はしない)
+ */
+void MetaDataManager::SetDeviceStripePolicy(size_t stripe_size, const std::string &patterns, uint64_t min_size) {
+  stripe_size_ = stripe_size;
+  stripe_min_size_ = min_size;
+  stripe_patterns_.clear();
+
+  std::string::size_type start = 0;
+  while (start <= patterns.size()) {
+    std::string::size_type end = patterns.find(',', start);
+    if (end == std::string::npos) {
+      end = patterns.size();
+    }
+    if (end > start) {
+      stripe_patterns_.push_back(patterns.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+}
+
+/**
+ * @breaf 新しいファイルを置くデバイスの選択 (選んだデバイスに親ディレクトリを作る)
+ * @param path ファイルパス
+ * @return デバイス番号 (既にある場合はそのデバイス)
+ */
+int MetaDataManager::PlaceLocal(const std::string &path) {
+  if (devices_.size() <= 1) {
+    return 0;
+  }
+
+  int device = devices_.Place(path.c_str(), path.size());
+  if (device > 0) {
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(boost::filesystem::path(device_path(device, path)).parent_path(), ec);
+  }
+  return device;
+}
+
+/**
+ * @breaf パターンによるデバイス間ストライプの対象の判定
+ * @param path ファイルパス
+ * @return bool ストライプの対象かどうか
+ */
+bool MetaDataManager::IsStripeTarget(const std::string &path) {
+  BOOST_FOREACH(const std::string &pattern, stripe_patterns_) {
+    if (fnmatch(pattern.c_str(), path.c_str(), 0) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @breaf 作成した空のファイルをデバイス間でストライプする (置いたデバイスから順にすべてのデバイスを使う)
+ * @param path ファイルパス
+ * @param device ファイルを置いたデバイス番号
+ * @param file_control 開いたファイル
+ * @return bool ストライプしたかどうか
+ */
+bool MetaDataManager::StripeLocal(const std::string &path, int device, FileControl &file_control) {
+  if (stripe_size_ == 0 || devices_.size() <= 1 || is_buffered(path)) {
+    return false;
+  }
+
+  std::vector<std::string> roots;
+  for (int index = 0; index < devices_.size(); index++) {
+    roots.push_back(devices_.root((device + index) % devices_.size()));
+  }
+  return file_control.Stripe(device_path(device, path).c_str(), roots, stripe_size_);
+}
+
+/**
+ * @breaf 開いたファイルのデバイスの登録 (デバイスごとの統計、配置の負荷に使う)
+ * @param path ファイルパス
+ * @param fd ファイルディスクリプタ
+ */
+void MetaDataManager::RegisterDevice(const std::string &path, int fd) {
+  int device = devices_.size() > 1 ? devices_.Locate(path.c_str(), path.size()): 0;
+
+  size_t stripe_size = 0;
+  int stripe_count = 1;
+  FileControl(fd).stripe_layout(&stripe_size, &stripe_count);
+  devices_.Open(fd, device, stripe_size, stripe_count);
+}
+
+/**
+ * @breaf fdキャッシュの無効化 (ファイルの削除、名前の変更で別のファイルを指すようになるため)
+ *   未使用のfdは閉じ、使用中のfdはキャッシュから外して最後のクローズで閉じるようにする。
+ *   ディレクトリの場合は配下のファイルもすべて無効にする。
+ * @param path ファイルパス
+ */
+void MetaDataManager::InvalidateFdCache(const std::string &path) {
+  fd_cache_mutex_.Lock();
+  FdIndex::iterator it = fd_index_.lower_bound(std::make_pair(path, 0));
+  while (it != fd_index_.end() && it->first.first.compare(0, path.size(), path) == 0) {
+    const std::string &name = it->first.first;
+    if (name.size() > path.size() && name[path.size()] != '/') {
+      ++it;
+      continue;
+    }
+
+    FdCache::iterator entry = fd_cache_.find(it->second);
+    ++it;
+    if (entry->second.count == 0) {
+      FileControl(entry->first).Close();
+    }
+    EraseCachedFd(entry);
+  }
+  fd_cache_mutex_.Unlock();
+}
+
+/**
+ * @breaf キャッシュしたfdの取得
+ * @param path ファイルパス
+ * @param flags フラグ
+ * @param is_cacheable_ptr キャッシュを使うかどうか保存ポインタ (Server.fd_cache_size が0の場合はfalse)
+ * @return fd (キャッシュにない場合は-1)
+ */
+int MetaDataManager::AcquireCachedFd(const std::string &path, int flags, bool *is_cacheable_ptr) {
+  int fd = -1;
+
+  fd_cache_mutex_.Lock();
+  *is_cacheable_ptr = fd_cache_size_ > 0;
+  FdIndex::iterator it = *is_cacheable_ptr ? fd_index_.find(std::make_pair(path, flags & FD_CACHE_FLAGS)) : fd_index_.end();
+  if (it != fd_index_.end()) {
+    CachedFd &entry = fd_cache_[it->second];
+    if (entry.count == 0) {
+      fd_idle_.erase(entry.idle);
+    }
+    entry.count++;
+    fd = it->second;
+    Register(path, fd);
+  }
+  fd_cache_mutex_.Unlock();
+
+  return fd;
+}
+
+/**
+ * @breaf 新しく開いたfdのキャッシュ登録
+ *   同時に同じファイルを開いて先に登録されていた場合は、このfdはキャッシュせずに通常どおり閉じる。
+ * @param path ファイルパス
+ * @param flags フラグ
+ * @param fd ファイルディスクリプタ
+ */
+void MetaDataManager::AddCachedFd(const std::string &path, int flags, int fd) {
+  fd_cache_mutex_.Lock();
+  std::pair<FdIndex::iterator, bool> result = fd_index_.insert(std::make_pair(std::make_pair(path, flags & FD_CACHE_FLAGS), fd));
+  if (result.second) {
+    CachedFd &entry = fd_cache_[fd];
+    entry.path = path;
+    entry.flags = flags & FD_CACHE_FLAGS;
+    entry.count = 1;
+  }
+  fd_cache_mutex_.Unlock();
+}
+
+/**
+ * @breaf キャッシュしたfdの返却
+ *   参照がなくなったfdは閉じずに未使用リストの先頭に置き、上限を超えた古いものから閉じる。
+ * @param path ファイルパス
+ * @param fd ファイルディスクリプタ
+ * @return bool キャッシュしたfdだったかどうか (falseの場合は呼び出し元で閉じる)
+ */
+bool MetaDataManager::ReleaseCachedFd(const std::string &path, int fd) {
+  fd_cache_mutex_.Lock();
+  FdCache::iterator it = fd_cache_.find(fd);
+  if (it == fd_cache_.end() || it->second.path != path) {
+    fd_cache_mutex_.Unlock();
+    return false;
+  }
+
+  if (--it->second.count == 0) {
+    Unregister(path, fd);
+    fd_idle_.push_front(fd);
+    it->second.idle = fd_idle_.begin();
+
+    while (fd_idle_.size() > fd_cache_size_) {
+      FdCache::iterator evict = fd_cache_.find(fd_idle_.back());
+      FileControl(evict->first).Close();
+      EraseCachedFd(evict);
+    }
+  }
+  fd_cache_mutex_.Unlock();
+
+  return true;
+}
+
+/**
+ * @breaf fdキャッシュからの削除 (fdは閉じない)
+ * @param it キャッシュ情報
+ */
+void MetaDataManager::EraseCachedFd(FdCache::iterator it) {
+  if (it->second.count == 0) {
+    fd_idle_.erase(it->second.idle);
+  }
+  fd_index_.erase(std::make_pair(it->second.path, it->second.flags));
+  fd_cache_.erase(it);
+}
+
+/**
+ * @breaf ファイルの版の取得 (クライアントがページキャッシュを使い続けてよいかの判定に使う)
+ *   更新日時とサーバー内の変更世代の組で、どちらかが変わっていれば内容が変わった可能性がある。
+ * @param path ファイルパス
+ * @param fd 開いたファイルディスクリプタ
+ * @param mtime_ptr 更新日時 (ナノ秒) 保存ポインタ (取得できない場合は0)
+ * @param generation_ptr 変更世代保存ポインタ
+ */
+void MetaDataManager::GetVersion(const std::string &path, int fd, uint64_t *mtime_ptr, uint64_t *generation_ptr) {
+  *generation_ptr = __sync_fetch_and_add(&generations_[boost::hash<std::string>()(path) % GENERATION_BUCKETS], 0);
+
+  struct stat st;
+  if (fstat(fd, &st) == 0) {
+    *mtime_ptr = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  } else {
+    *mtime_ptr = 0;
+  }
+}
+
+/**
+ * @breaf ファイルの変更世代を進める (書き込み、サイズ変更、作成、名前の変更の後に呼ぶ)
  * @param path ファイルパス
+ */
+void MetaDataManager::BumpGeneration(const std::string &path) {
+  generations_[boost::hash<std::string>()(path) % GENERATION_BUCKETS] = __sync_add_and_fetch(&last_generation_, 1);
+}
+
+/**
+ * @breaf 変更世代の初期値 (起動時刻のマイクロ秒)
+ * @return 世代
+ */
+uint64_t MetaDataManager::initial_generation() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/**
+ * @breaf ファイル属性取得 (パスはスレッドのアリーナで作り、ヒープを使わない)
+ *   リンクパスはアリーナに作るため、呼び出し元の ArenaScope の中で呼ぶこと。
+ * @param path ファイルパス (受信バッファを指すため終端文字は不要)
+ * @param size ファイルパスの長さ
  * @param file_stat_ptr ファイル属性保存ポインタ
- * @param link_path リンクパス保存
+ * @param link_path_ptr リンクパス保存ポインタ (リンクでない場合は空文字列)
  * @return Error値
  */
-Error MetaDataManager::GetFileStat(const std::string &path, FileStat *file_stat_ptr, std::string &link_path) {
+Error MetaDataManager::GetFileStat(const char *path, size_t size, FileStat *file_stat_ptr, const char **link_path_ptr) {
 
   FileStat file_stat;
   struct stat st;
-  std::string tpath = target_path(path);
-  boost::system::error_code ec;
 
-  link_path = "";
+  *link_path_ptr = "";
 
-  if (!boost::filesystem::exists(tpath, ec)) {
-    return -ENOENT;
+  // target_path と同じく、Localに無ければSecondaryを見る
+  int device = devices_.size() > 1 ? devices_.Locate(path, size): 0;
+  const char *tpath = Arena::current()->Join(devices_.root(device > 0 ? device: 0), path, size);
+  if (tpath == NULL) {
+    return -ENOMEM;
+  }
+  if (stat(tpath, &st) != 0) {
+    tpath = Arena::current()->Join(secondary_storage_root_path_, path, size);
+    if (tpath == NULL) {
+      return -ENOMEM;
+    }
+    if (stat(tpath, &st) != 0) {
+      return -ENOENT;
+    }
   }
 
-  Error error = lstat(tpath.c_str(), &st);
+  Error error;
+  {
+    StatsTimer timer(kPhaseSyscall);
+    error = lstat(tpath, &st);
+  }
   if (error != kCBBSuccess) {
     return errno_to_cbb_error(error);
   }
@@ -117,18 +512,26 @@ Error MetaDataManager::GetFileStat(const std::string &path, FileStat *file_stat_
   file_stat.st_ctim.tv_nsec = st.st_ctim.tv_nsec;
 
   // Virtual Symlinkの場合はリンク先を読み込んでそれを返す
-  if (is_virtual_symlink(tpath)) {
+  if (strstr(tpath, VIRTUAL_SYMLINK_EXT) != NULL) {
     std::string line = read_one_line(tpath);
     if (!line.empty()) {
-      link_path = line;
+      const char *link_path = Arena::current()->Strndup(line.c_str(), line.size());
+      if (link_path == NULL) {
+        return -ENOMEM;
+      }
+      *link_path_ptr = link_path;
       file_stat.st_mode |= S_IFLNK; // symlink属性付加
     }
   }
   // Virtual Linkの場合はリンク先を読み込んでそれを返す
-  else if (is_virtual_link(tpath)) {
+  else if (strstr(tpath, VIRTUAL_LINK_EXT) != NULL) {
     std::string line = read_one_line(tpath);
     if (!line.empty()) {
-      link_path = line;
+      const char *link_path = Arena::current()->Strndup(line.c_str(), line.size());
+      if (link_path == NULL) {
+        return -ENOMEM;
+      }
+      *link_path_ptr = link_path;
 //      file_stat.st_mode |= S_IFLNK;
     }
   }
@@ -149,7 +552,11 @@ Error MetaDataManager::GetFileStatFD(int fd, FileStat *file_stat_ptr) {
   FileStat file_stat;
   struct stat st;
 
-  Error error = fstat(fd, &st);
+  Error error;
+  {
+    StatsTimer timer(kPhaseSyscall);
+    error = fstat(fd, &st);
+  }
   if (error != kCBBSuccess) {
     return errno_to_cbb_error(error);
   }
@@ -189,14 +596,34 @@ Error MetaDataManager::Rename(const std::string &old_path, const std::string &ne
 
   Error error = kCBBSuccess;
 
+  // 置き換えられる変更後のファイルを開いたfdを再利用しない
+  InvalidateFdCache(new_path);
+
   if (exists_on_local(old_path)) {
-    error = errno_to_cbb_error(rename(local_path(old_path).c_str(), local_path(new_path).c_str()));
+    CloseDirty(old_path);
+    // 変更後のファイルは変更前と同じデバイスに置く (他のデバイスにある置き換えられるファイルは削除する)
+    int device = devices_.size() > 1 ? devices_.Locate(old_path.c_str(), old_path.size()): 0;
+    std::string destination = device_path(device > 0 ? device: 0, new_path);
+    if (devices_.size() > 1) {
+      std::string current = local_path(new_path);
+      if (current != destination && !boost::filesystem::is_directory(current)) {
+        FileControl::Remove(current.c_str());
+      }
+      if (device > 0) {
+        boost::system::error_code ec;
+        boost::filesystem::create_directories(boost::filesystem::path(destination).parent_path(), ec);
+      }
+    }
+    error = FileControl::Rename(local_path(old_path).c_str(), destination.c_str());
     Unregister(old_path);
   }
 
   if (exists_on_secondary(old_path)) {
     errno_to_cbb_error(rename(secondary_path(old_path).c_str(), secondary_path(new_path).c_str()));
   }
+
+  BumpGeneration(old_path);
+  BumpGeneration(new_path);
   
   return error;
 }
@@ -249,7 +676,24 @@ Error MetaDataManager::Chown(const std::string &path, uid_t uid, gid_t gid) {
  * @return Error値
  */
 Error MetaDataManager::Truncate(const std::string &path, off_t size) {
-  return errno_to_cbb_error(truncate(target_path(path).c_str(), size));
+  if (!exists_on_local(path)) {
+    Error error;
+    {
+      StatsTimer timer(kPhaseSyscall);
+      error = errno_to_cbb_error(truncate(secondary_path(path).c_str(), size));
+    }
+    BumpGeneration(path);
+    return error;
+  }
+
+  MarkDirty(path);
+  Error error;
+  {
+    StatsTimer timer(kPhaseSyscall);
+    error = FileControl::Truncate(local_path(path).c_str(), size);
+  }
+  RecordDirty(path, size, 0, true);
+  return error;
 }
 
 /**
@@ -260,7 +704,15 @@ Error MetaDataManager::Truncate(const std::string &path, off_t size) {
  * @return Error値
  */
 Error MetaDataManager::FTruncate(const std::string &path, int fd, off_t size) {
-  return errno_to_cbb_error(ftruncate(fd, size));
+  MarkDirty(path);
+  Error error;
+  {
+    StatsTimer timer(kPhaseSyscall);
+    FileControl file_control(fd);
+    error = file_control.Truncate(size);
+  }
+  RecordDirty(path, size, 0, true);
+  return error;
 }
 
 /**
@@ -300,12 +752,30 @@ Error MetaDataManager::Utimens(const std::string &path, const TimeSpec &time0, c
  */
 Error MetaDataManager::Create(const std::string &path, int flags, mode_t mode) {
   FileControl file_control;
-  int fd = file_control.Create(local_path(path).c_str(), flags, mode);
+  LocalDevices::PlaceScope place(devices_, path.c_str(), path.size());
+  int device = PlaceLocal(path);
+  int fd;
+
+  // 切り詰めると未使用のキャッシュしたfdの読み書きの状態 (圧縮形式等) が古くなる
+  if (flags & O_TRUNC) {
+    InvalidateFdCache(path);
+  }
+  {
+    StatsTimer timer(kPhaseSyscall);
+    fd = file_control.Create(device_path(device, path).c_str(), flags, mode);
+  }
 
   if (fd == -1) {
     fd = -errno;
   } else {
+    if (!IsStripeTarget(path) || !StripeLocal(path, device, file_control)) {
+      FormatLocal(path, file_control, flags);
+    }
+    BumpGeneration(path);
     Register(path, fd);
+    if (flags & O_TRUNC) {
+      RecordDirty(path, 0, 0, true);
+    }
   }
 
   return fd;
@@ -321,15 +791,46 @@ Error MetaDataManager::Open(const std::string &path, int flags) {
   FileControl file_control;
   int fd = 0;
 
+  // 作成、切り詰めを伴わないオープンはキャッシュしたfdを再利用する
+  bool is_cacheable = (flags & (O_CREAT | O_EXCL | O_TRUNC)) == 0;
+  if (is_cacheable) {
+    fd = AcquireCachedFd(path, flags, &is_cacheable);
+    if (fd >= 0) {
+      return fd;
+    }
+  }
+
   if (exists_on_secondary(path) && !exists_on_local(path)) {
     CopySecondaryToLocal(path);
   }
 
-  fd = file_control.Open(local_path(path).c_str(), flags);
+  // 切り詰めると未使用のキャッシュしたfdの読み書きの状態 (圧縮形式等) が古くなる
+  if (flags & O_TRUNC) {
+    InvalidateFdCache(path);
+  }
+
+  {
+    StatsTimer timer(kPhaseSyscall);
+    if (flags & O_CREAT) {
+      LocalDevices::PlaceScope place(devices_, path.c_str(), path.size());
+      fd = file_control.Open(device_path(PlaceLocal(path), path).c_str(), flags);
+    } else {
+      fd = file_control.Open(local_path(path).c_str(), flags);
+    }
+  }
   if (fd == -1) {
     fd = errno_to_cbb_error(fd);
   } else {
+    if (flags & O_TRUNC) {
+      FormatLocal(path, file_control, flags);
+    }
     Register(path, fd);
+    if (flags & O_TRUNC) {
+      RecordDirty(path, 0, 0, true);
+    }
+    if (is_cacheable) {
+      AddCachedFd(path, flags, fd);
+    }
   }
 
   return fd;
@@ -344,14 +845,19 @@ Error MetaDataManager::Open(const std::string &path, int flags) {
  * @param offset オフセット
  * @return Error値
  */
-Error MetaDataManager::Read(const std::string &path, int fd, void *buf, size_t size, off_t offset) {
+Error MetaDataManager::Read(const char *path, int fd, void *buf, size_t size, off_t offset) {
   FileControl file_control(fd);
-  return file_control.Read(buf, size, offset);
+  StatsTimer timer(kPhaseSyscall);
+  Error ret = file_control.Read(buf, size, offset);
+  if (ret > 0) {
+    devices_.AddBytes(fd, offset, ret, false);
+  }
+  return ret;
 }
 
 /**
  * @breaf ファイル書き込み
- * @param path ファイルパス
+ * @param path ファイルパス (空の場合はfdから求める)
  * @param fd ファイルディスクリプタ
  * @param buf バッファ
  * @param size バッファサイズ
@@ -359,8 +865,78 @@ Error MetaDataManager::Read(const std::string &path, int fd, void *buf, size_t s
  * @return Error値
  */
 Error MetaDataManager::Write(const std::string &path, int fd, const void *buf, size_t size, off_t offset) {
+  // 共有メモリ経由の書き込みはパスを持たないので、fdから求める
+  const std::string target = path.empty() ? fd_path(fd) : path;
+
   FileControl file_control(fd);
-  return file_control.Write(buf, size, offset);
+  MarkDirty(target);
+  Error ret;
+  {
+    StatsTimer timer(kPhaseSyscall);
+    ret = file_control.Write(buf, size, offset);
+  }
+  if (ret > 0) {
+    RecordDirty(target, offset, ret, false);
+    devices_.AddBytes(fd, offset, ret, true);
+  }
+  return ret;
+}
+
+/**
+ * @breaf 非同期ファイル読み込みの投入
+ * @param path ファイルパス
+ * @param fd ファイルディスクリプタ
+ * @param buf バッファ
+ * @param size サイズ
+ * @param offset オフセット
+ * @param callback 完了通知
+ * @param user_data 完了通知に渡すデータ
+ * @return bool 投入できたかどうか (falseの場合は Read を使う)
+ */
+bool MetaDataManager::SubmitRead(const char *path, int fd, void *buf, size_t size, off_t offset,
+                                 IoRingCallback callback, void *user_data) {
+  FileControl file_control(fd);
+  if (!file_control.SubmitRead(buf, size, offset, callback, user_data)) {
+    return false;
+  }
+  devices_.AddBytes(fd, offset, size, false);
+  return true;
+}
+
+/**
+ * @breaf 非同期ファイル書き込みの投入 (完了通知で FinishWrite を呼ぶこと)
+ * @param path ファイルパス (空の場合はfdから求める)
+ * @param fd ファイルディスクリプタ
+ * @param buf バッファ (完了通知まで保持すること)
+ * @param size バッファサイズ
+ * @param offset オフセット
+ * @param callback 完了通知
+ * @param user_data 完了通知に渡すデータ
+ * @return bool 投入できたかどうか (falseの場合は Write を使う)
+ */
+bool MetaDataManager::SubmitWrite(const std::string &path, int fd, const void *buf, size_t size, off_t offset,
+                                  IoRingCallback callback, void *user_data) {
+  FileControl file_control(fd);
+  if (!FileControl::is_io_ring_enabled()) {
+    return false;
+  }
+
+  MarkDirty(path.empty() ? fd_path(fd) : path);
+  return file_control.SubmitWrite(buf, size, offset, callback, user_data);
+}
+
+/**
+ * @breaf 非同期ファイル書き込みの完了処理 (変更範囲の記録)
+ * @param path ファイルパス (空の場合はfdから求める)
+ * @param fd ファイルディスクリプタ
+ * @param offset オフセット
+ * @param result 書き込みサイズまたはError値
+ */
+void MetaDataManager::FinishWrite(const std::string &path, int fd, off_t offset, ssize_t result) {
+  if (result > 0) {
+    RecordDirty(path.empty() ? fd_path(fd) : path, offset, result, false);
+    devices_.AddBytes(fd, offset, result, true);
+  }
 }
 
 /**
@@ -372,6 +948,7 @@ Error MetaDataManager::Write(const std::string &path, int fd, const void *buf, s
  */
 Error MetaDataManager::FSync(const std::string &path, int fd, int is_data) {
   FileControl file_control(fd);
+  StatsTimer timer(kPhaseSyscall);
   return file_control.FSync(is_data);
 }
 
@@ -383,6 +960,7 @@ Error MetaDataManager::FSync(const std::string &path, int fd, int is_data) {
  */
 Error MetaDataManager::Flush(const std::string &path, int fd) {
   FileControl file_control(fd);
+  StatsTimer timer(kPhaseSyscall);
   return file_control.Flush();
 }
 
@@ -393,12 +971,93 @@ Error MetaDataManager::Flush(const std::string &path, int fd) {
  * @return Error値
  */
 Error MetaDataManager::Close(const std::string &path, int fd) {
+  if (ReleaseCachedFd(path, fd)) {
+    return kCBBSuccess;
+  }
+
   FileControl file_control(fd);
-  Error ret = file_control.Close();
+  Error ret;
+  {
+    StatsTimer timer(kPhaseSyscall);
+    ret = file_control.Close();
+  }
   Unregister(path, fd);
   return ret;
 }
 
+/**
+ * @breaf ファイルのコピー (圧縮形式、ストライプしたファイルは展開してコピーする)
+ *   バックグラウンドのコピーを止める場合、Secondaryへの帯域を制限する場合は、区切りごとにコピーする。
+ * @param source コピー元ファイルパス
+ * @param destination コピー先ファイルパス (既存の場合は上書き)
+ * @param is_compress コピー先を圧縮形式にするかどうか
+ * @return Error値
+ */
+Error MetaDataManager::CopyFile(const std::string &source, const std::string &destination, bool is_compress) {
+  if (is_compress || !FileControl::is_plain(source.c_str()) || !FileControl::is_plain(destination.c_str()) ||
+      IoPriority::is_paced() || SecondaryThrottle::is_paced()) {
+    return FileControl::CopyFile(source.c_str(), destination.c_str(), is_compress);
+  }
+
+  boost::system::error_code ec;
+  boost::filesystem::copy_file(source, destination, boost::filesystem::copy_option::overwrite_if_exists, ec);
+  return ec ? -ec.value(): kCBBSuccess;
+}
+
+/**
+ * @breaf 作成、切り詰めたLocalのファイルを圧縮形式にする (他で開いているファイルは通常のまま)
+ *   未使用のキャッシュしたfdは通常のファイルとして開いた状態のため、先にキャッシュから外して閉じる。
+ * @param path ファイルパス
+ * @param file_control 開いたファイル
+ * @param flags オープンフラグ
+ */
+void MetaDataManager::FormatLocal(const std::string &path, FileControl &file_control, int flags) {
+  if (!FileControl::is_compress_enabled() || (flags & O_ACCMODE) == O_RDONLY) {
+    return;
+  }
+  InvalidateFdCache(path);
+  if (!is_buffered(path)) {
+    file_control.Format();
+  }
+}
+
+/**
+ * @breaf 大きいファイルをデバイス間でストライプしてSecondaryから取り込む
+ * @param source コピー元ファイルパス
+ * @param path ファイルパス
+ * @param device ファイルを置くデバイス番号
+ * @return Error値 (ストライプの対象でない場合は-EAGAIN)
+ */
+Error MetaDataManager::CopyStriped(const std::string &source, const std::string &path, int device) {
+  struct stat st;
+  if (stripe_min_size_ == 0 || stat(source.c_str(), &st) != 0 || (uint64_t)st.st_size < stripe_min_size_ ||
+      exists_on_local(path)) {
+    return -EAGAIN;
+  }
+
+  FileControl destination_file;
+  if (destination_file.Create(device_path(device, path).c_str(), O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 07777) == -1) {
+    return -EAGAIN;
+  }
+  if (!StripeLocal(path, device, destination_file)) {
+    destination_file.Close();
+    FileControl::Remove(device_path(device, path).c_str());
+    return -EAGAIN;
+  }
+
+  FileControl source_file;
+  Error error = source_file.Open(source.c_str(), O_RDONLY) == -1 ? -errno: kCBBSuccess;
+  if (error == kCBBSuccess) {
+    error = FileControl::Copy(source_file, destination_file);
+    source_file.Close();
+  }
+  destination_file.Close();
+  if (error != kCBBSuccess) {
+    FileControl::Remove(device_path(device, path).c_str());
+  }
+  return error;
+}
+
 /**
  * @breaf SecondaryからLocalにファイルをコピー
  * @param path ファイルパス
@@ -409,10 +1068,15 @@ Error MetaDataManager::CopySecondaryToLocal(const std::string &path) {
   bool is_copy = true;
 
   std::string source = secondary_path(path);
-  std::string destination = local_path(path);
+  LocalDevices::PlaceScope place(devices_, path.c_str(), path.size());
+  int device = PlaceLocal(path);
+  std::string destination = device_path(device, path);
 
 DMSG("CopySecondaryToLocal src: %s >>> dst: %s : path = %s \n", source.c_str(), destination.c_str(), path.c_str());
 
+  // 取り込みのSecondaryの属性取得も共有のファイルシステムのメタデータ操作の上限に含める
+  secondary_throttle_.Operation();
+
   if (boost::filesystem::exists(source)) {
     if (boost::filesystem::exists(destination)) {
       const std::time_t last_update_src = boost::filesystem::last_write_time(source);
@@ -424,8 +1088,18 @@ DMSG("CopySecondaryToLocal src: %s >>> dst: %s : path = %s \n", source.c_str(),
     }
 
     if (is_copy) {
-      boost::system::error_code ec;
-      boost::filesystem::copy_file(source, destination, boost::filesystem::copy_option::overwrite_if_exists, ec);
+      StatsTimer timer(kPhaseCopy);
+      Error error = CopyStriped(source, path, device);
+      if (error == -EAGAIN) {
+        error = CopyFile(source, destination, FileControl::is_compress_enabled() && !is_buffered(path));
+      }
+
+      // Secondaryと同じ内容になったので、以降は変更範囲だけを書き出せる
+      struct stat st;
+      if (error == kCBBSuccess && stat(source.c_str(), &st) == 0) {
+        write_dirty_xattr(destination, DirtyExtents(), false);
+        SetExportBaseline(path, st);
+      }
     }
     ret = 0;
   } else {
@@ -436,6 +1110,249 @@ DMSG("CopySecondaryToLocal src: %s >>> dst: %s : path = %s \n", source.c_str(),
   return ret;
 }
 
+/**
+ * @breaf ストライプ配置の取得 (Localになければ Secondary から取得する)
+ *   Secondaryに保存されている配置の担当番号は常に0 (パスのハッシュで決まるサーバー)
+ * @param path ファイルパス
+ * @param layout_ptr ストライプ配置保存ポインタ (ストライプなしの場合はsize=0)
+ * @return Error値
+ */
+Error MetaDataManager::GetStripe(const std::string &path, StripeLayout *layout_ptr) {
+  *layout_ptr = StripeLayout();
+  if (!read_stripe_xattr(local_path(path), layout_ptr)) {
+    read_stripe_xattr(secondary_path(path), layout_ptr);
+  }
+  return kCBBSuccess;
+}
+
+/**
+ * @breaf Localファイルのストライプ配置の取得
+ * @param path ファイルパス
+ * @param layout_ptr ストライプ配置保存ポインタ (ストライプなしの場合はsize=0)
+ * @return Error値
+ */
+Error MetaDataManager::GetLocalStripe(const std::string &path, StripeLayout *layout_ptr) {
+  *layout_ptr = StripeLayout();
+  read_stripe_xattr(local_path(path), layout_ptr);
+  return kCBBSuccess;
+}
+
+/**
+ * @breaf Localファイルのストライプ配置の設定
+ * @param path ファイルパス
+ * @param layout ストライプ配置
+ * @return Error値
+ */
+Error MetaDataManager::SetLocalStripe(const std::string &path, const StripeLayout &layout) {
+  return write_stripe_xattr(local_path(path), layout);
+}
+
+/**
+ * @breaf Secondaryファイルのストライプ配置の設定 (担当番号は0で保存する)
+ * @param path ファイルパス
+ * @param layout ストライプ配置
+ * @return Error値
+ */
+Error MetaDataManager::SetSecondaryStripe(const std::string &path, const StripeLayout &layout) {
+  StripeLayout secondary_layout = layout;
+  secondary_layout.index = 0;
+  return write_stripe_xattr(secondary_path(path), secondary_layout);
+}
+
+/**
+ * @breaf 変更範囲を取り出す (エクスポート用)
+ *   取り出した範囲は記録から消える。書き出しに失敗した場合は RestoreDirty で戻す。
+ * @param path ファイルパス
+ * @param extents_ptr 変更範囲保存ポインタ
+ * @return bool 変更範囲の記録があったかどうか (ない場合は変更の有無が分からない)
+ */
+bool MetaDataManager::TakeDirty(const std::string &path, DirtyExtents *extents_ptr) {
+  dirty_mutex_.Lock();
+
+  bool exists;
+  DirtyFiles::iterator it = LoadDirty(path, &exists);
+  *extents_ptr = it->second.extents;
+  if (is_buffered(path)) {
+    it->second.extents.Clear();
+  } else {
+    if (exists && !extents_ptr->empty()) {
+      write_dirty_xattr(local_path(path), DirtyExtents(), false);
+    }
+    dirty_.erase(it);
+  }
+
+  dirty_mutex_.Unlock();
+  return exists;
+}
+
+/**
+ * @breaf 取り出した変更範囲を記録に戻す
+ * @param path ファイルパス
+ * @param extents 変更範囲
+ */
+void MetaDataManager::RestoreDirty(const std::string &path, const DirtyExtents &extents) {
+  dirty_mutex_.Lock();
+
+  bool exists;
+  DirtyFiles::iterator it = LoadDirty(path, &exists);
+  it->second.extents.Merge(extents);
+  SaveDirty(path, it);
+
+  dirty_mutex_.Unlock();
+}
+
+/**
+ * @breaf Secondaryのファイルが前回の書き出し時点から変わっていないかどうか
+ * @param path ファイルパス
+ * @param secondary_stat Secondaryのファイル属性
+ * @return bool 変わっていないかどうか
+ */
+bool MetaDataManager::CheckExportBaseline(const std::string &path, const struct stat &secondary_stat) {
+  char value[64];
+  ssize_t length = getxattr(local_path(path).c_str(), EXPORT_XATTR_NAME, value, sizeof(value) - 1);
+  if (length <= 0) {
+    return false;
+  }
+  value[length] = '\0';
+
+  long long size = 0, sec = 0, nsec = 0;
+  if (sscanf(value, "%lld:%lld:%lld", &size, &sec, &nsec) != 3) {
+    return false;
+  }
+  return size == secondary_stat.st_size &&
+         sec == secondary_stat.st_mtim.tv_sec && nsec == secondary_stat.st_mtim.tv_nsec;
+}
+
+/**
+ * @breaf 書き出し直後のSecondaryのファイル属性を保存する
+ * @param path ファイルパス
+ * @param secondary_stat Secondaryのファイル属性
+ * @return Error値
+ */
+Error MetaDataManager::SetExportBaseline(const std::string &path, const struct stat &secondary_stat) {
+  char value[64];
+  int length = snprintf(value, sizeof(value), "%lld:%lld:%lld", (long long)secondary_stat.st_size,
+                        (long long)secondary_stat.st_mtim.tv_sec, (long long)secondary_stat.st_mtim.tv_nsec);
+  return errno_to_cbb_error(setxattr(local_path(path).c_str(), EXPORT_XATTR_NAME, value, length, 0));
+}
+
+/**
+ * @breaf 開いているfdのファイルパス
+ * @param fd ファイルディスクリプタ
+ * @return ファイルパス (登録されていない場合は空)
+ */
+std::string MetaDataManager::fd_path(int fd) {
+  std::string path;
+
+  dirty_mutex_.Lock();
+  std::map<int, std::string>::iterator it = fd_paths_.find(fd);
+  if (it != fd_paths_.end()) {
+    path = it->second;
+  }
+  dirty_mutex_.Unlock();
+
+  return path;
+}
+
+/**
+ * @breaf 開いている (クライアントが使用中の) fdかどうか
+ * @param fd ファイルディスクリプタ
+ * @return bool 開いているかどうか
+ */
+bool MetaDataManager::is_open(int fd) {
+  dirty_mutex_.Lock();
+  bool is_found = fd_paths_.find(fd) != fd_paths_.end();
+  dirty_mutex_.Unlock();
+
+  return is_found;
+}
+
+/**
+ * @breaf 書き込み前に書き込み中の印を付ける (異常終了時に記録漏れを検出するため)
+ * @param path ファイルパス
+ */
+void MetaDataManager::MarkDirty(const std::string &path) {
+  dirty_mutex_.Lock();
+
+  bool exists;
+  DirtyFiles::iterator it = LoadDirty(path, &exists);
+  if (!it->second.is_marked) {
+    write_dirty_xattr(local_path(path), it->second.extents, true);
+    it->second.is_marked = true;
+  }
+
+  dirty_mutex_.Unlock();
+}
+
+/**
+ * @breaf 変更範囲の記録
+ * @param path ファイルパス
+ * @param offset 書き込んだオフセット (サイズ変更の場合は新しいサイズ)
+ * @param size 書き込んだサイズ
+ * @param is_truncate サイズ変更かどうか
+ */
+void MetaDataManager::RecordDirty(const std::string &path, off_t offset, size_t size, bool is_truncate) {
+  dirty_mutex_.Lock();
+
+  bool exists;
+  DirtyFiles::iterator it = LoadDirty(path, &exists);
+  if (is_truncate) {
+    it->second.extents.Truncate(offset);
+  } else {
+    it->second.extents.Add(offset, size);
+  }
+  SaveDirty(path, it);
+  BumpGeneration(path);
+
+  dirty_mutex_.Unlock();
+}
+
+/**
+ * @breaf 最後のクローズ時に変更範囲を確定して保存する
+ * @param path ファイルパス
+ */
+void MetaDataManager::CloseDirty(const std::string &path) {
+  dirty_mutex_.Lock();
+
+  DirtyFiles::iterator it = dirty_.find(path);
+  if (it != dirty_.end()) {
+    write_dirty_xattr(local_path(path), it->second.extents, false);
+    dirty_.erase(it);
+  }
+
+  dirty_mutex_.Unlock();
+}
+
+/**
+ * @breaf 変更範囲の取得 (メモリになければ拡張属性から読み込む、dirty_mutex_ をロックして呼ぶ)
+ * @param path ファイルパス
+ * @param exists_ptr 記録があったかどうか保存ポインタ
+ * @return 変更範囲
+ */
+MetaDataManager::DirtyFiles::iterator MetaDataManager::LoadDirty(const std::string &path, bool *exists_ptr) {
+  DirtyFiles::iterator it = dirty_.find(path);
+  if (it != dirty_.end()) {
+    *exists_ptr = true;
+    return it;
+  }
+
+  DirtyState state;
+  *exists_ptr = read_dirty_xattr(local_path(path), &state.extents);
+  return dirty_.insert(std::make_pair(path, state)).first;
+}
+
+/**
+ * @breaf 変更範囲の保存 (開いていないファイルは確定して保存し、メモリから消す)
+ * @param path ファイルパス
+ * @param it 変更範囲
+ */
+void MetaDataManager::SaveDirty(const std::string &path, DirtyFiles::iterator it) {
+  if (!is_buffered(path)) {
+    write_dirty_xattr(local_path(path), it->second.extents, false);
+    dirty_.erase(it);
+  }
+}
+
 /**
  * @breaf ファイルのフラッシュ（クローズ）
  * @param path ファイルパス
@@ -17,14 +17,55 @@
 #define CBB_META_DATA_MANAGER_H_
 
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <list>
 #include <map>
 #include <set>
 #include <boost/filesystem.hpp>
 
+#include "util/arena.h"
+#include "util/file_control.h"
+#include "util/io_priority.h"
+#include "util/io_ring.h"
+#include "util/local_devices.h"
+#include "util/mutex.h"
+#include "util/secondary_throttle.h"
+#include "dirty_extents.h"
+
+// Localストレージ内のサーバー内部ファイルの接頭辞 (ディレクトリ一覧、エクスポートの対象外)
+#define INTERNAL_NAME_PREFIX ".cbb_"
+
+// Localストレージ内のレプリカ保存ディレクトリ
+#define REPLICA_DIR_NAME INTERNAL_NAME_PREFIX "replica"
+
+// Secondaryストレージ内の書き出し中のサーバーのリースを置くディレクトリ
+#define LEASE_DIR_NAME INTERNAL_NAME_PREFIX "lease"
+
+// ファイルの変更世代を管理するバケット数 (パスのハッシュで分け、同じバケットのファイルは同時に世代が進む)
+#define GENERATION_BUCKETS 4096
 
 namespace cbb {
 
+/**
+ * @breaf サーバー内部ファイル (レプリカ、配置ディレクトリ、構成情報等) の名前かどうか
+ * @param name ファイル名 (パスを含まない)
+ * @return bool 内部ファイルかどうか
+ */
+inline bool is_internal_name(const char *name) {
+  return strncmp(name, INTERNAL_NAME_PREFIX, sizeof(INTERNAL_NAME_PREFIX) - 1) == 0;
+}
+
+/// ストライプ配置 (ファイルの拡張属性に保存)
+struct StripeLayout {
+  uint64_t size;  // ストライプサイズ (0の場合はストライプなし)
+  int count;      // ストライプ数 (サーバー数)
+  int index;      // このサーバーが担当するストライプ番号
+
+  StripeLayout() : size(0), count(0), index(0) {}
+  bool is_striped() const { return size > 0 && count > 1; }
+};
+
 // 各ファイル等のメタデータマネージャークラス
 class MetaDataManager {
 
@@ -33,13 +74,27 @@ class MetaDataManager {
   MetaDataManager(std::string local_storage_root_path,
                   std::string secondary_storage_root_path):
       local_storage_root_path_(local_storage_root_path),
-      secondary_storage_root_path_(secondary_storage_root_path) {}
+      secondary_storage_root_path_(secondary_storage_root_path),
+      fd_cache_size_(0),
+      stripe_size_(0),
+      stripe_min_size_(0),
+      last_generation_(initial_generation()) {
+    dirty_mutex_.Init();
+    fd_cache_mutex_.Init();
+    memset(generations_, 0, sizeof(generations_));
+    devices_.Init(std::vector<std::string>(1, local_storage_root_path));
+  }
 
   Error Register(const std::string &path, int fd);
   Error Unregister(const std::string &path);
   Error Unregister(const std::string &path, int fd);
 
-  Error GetFileStat(const std::string &path, FileStat *stat_ptr, std::string &link_path);
+  void SetFdCachePolicy(int cache_size);
+  void SetLocalDevices(const std::vector<std::string> &roots);
+  void SetDeviceStripePolicy(size_t stripe_size, const std::string &patterns, uint64_t min_size);
+  void InvalidateFdCache(const std::string &path);
+
+  Error GetFileStat(const char *path, size_t size, FileStat *stat_ptr, const char **link_path_ptr);
   Error GetFileStatFD(int fd, FileStat *file_stat_ptr);
 
   Error Rename(const std::string &old_path, const std::string &new_path);
@@ -52,15 +107,37 @@ class MetaDataManager {
 
   Error Create(const std::string &path, int flags, mode_t mode);
   Error Open(const std::string &path, int flags);
-  Error Read(const std::string &path, int fd, void *buf, size_t size, off_t offset);
+  Error Read(const char *path, int fd, void *buf, size_t size, off_t offset);
   Error Write(const std::string &path, int fd, const void *buf, size_t size, off_t offset);
+  bool SubmitRead(const char *path, int fd, void *buf, size_t size, off_t offset,
+                  IoRingCallback callback, void *user_data);
+  bool SubmitWrite(const std::string &path, int fd, const void *buf, size_t size, off_t offset,
+                   IoRingCallback callback, void *user_data);
+  void FinishWrite(const std::string &path, int fd, off_t offset, ssize_t result);
   Error FSync(const std::string &path, int fd, int is_data);
   Error Flush(const std::string &path, int fd);
   Error Close(const std::string &path, int fd);
 
   Error CopySecondaryToLocal(const std::string &path);
+  static Error CopyFile(const std::string &source, const std::string &destination, bool is_compress);
   Error FileFlush(const std::string &path);
 
+  Error GetStripe(const std::string &path, StripeLayout *layout_ptr);
+  Error GetLocalStripe(const std::string &path, StripeLayout *layout_ptr);
+  Error SetLocalStripe(const std::string &path, const StripeLayout &layout);
+  Error SetSecondaryStripe(const std::string &path, const StripeLayout &layout);
+
+  void GetVersion(const std::string &path, int fd, uint64_t *mtime_ptr, uint64_t *generation_ptr);
+
+  std::string fd_path(int fd);
+  bool is_open(int fd);
+  void BumpGeneration(const std::string &path);
+
+  bool TakeDirty(const std::string &path, DirtyExtents *extents_ptr);
+  void RestoreDirty(const std::string &path, const DirtyExtents &extents);
+  bool CheckExportBaseline(const std::string &path, const struct stat &secondary_stat);
+  Error SetExportBaseline(const std::string &path, const struct stat &secondary_stat);
+
   bool is_buffered(const std::string &path) {
     return (table_.find(path) != table_.end());
   }
@@ -78,8 +155,25 @@ class MetaDataManager {
   }
 
   const std::string local_path(const std::string &path) {
+    // 複数デバイスの場合はファイルのあるデバイス (どこにもなければ先頭のデバイス)
+    int device = devices_.size() > 1 ? devices_.Locate(path.c_str(), path.size()): 0;
+    return device_path(device > 0 ? device: 0, path);
+  }
+
+  const std::string device_path(int device, const std::string &path) {
     std::string slash = path.substr(0, 1) == "/" ? "": "/";
-    return  local_storage_root_path_ + slash + path;
+    return  devices_.root(device) + slash + path;
+  }
+
+  int PlaceLocal(const std::string &path);
+
+  LocalDevices &devices() { return devices_; }
+  IoPriority &io_priority() { return io_priority_; }
+  SecondaryThrottle &secondary_throttle() { return secondary_throttle_; }
+
+  const std::string replica_path(const std::string &path) {
+    std::string slash = path.substr(0, 1) == "/" ? "": "/";
+    return  local_storage_root_path_ + "/" REPLICA_DIR_NAME + slash + path;
   }
 
   const std::string secondary_path(const std::string &path) {
@@ -106,11 +200,68 @@ class MetaDataManager {
 
  private:
 
+  /// 開いているファイルの変更範囲
+  struct DirtyState {
+    DirtyExtents extents;
+    bool is_marked;  // 拡張属性に書き込み中の印を付けたかどうか
+    DirtyState() : is_marked(false) {}
+  };
+  typedef std::map<std::string, DirtyState> DirtyFiles;
+
+  void FormatLocal(const std::string &path, FileControl &file_control, int flags);
+  bool StripeLocal(const std::string &path, int device, FileControl &file_control);
+  Error CopyStriped(const std::string &source, const std::string &path, int device);
+  bool IsStripeTarget(const std::string &path);
+  void RegisterDevice(const std::string &path, int fd);
+
+  void MarkDirty(const std::string &path);
+  void RecordDirty(const std::string &path, off_t offset, size_t size, bool is_truncate);
+  void CloseDirty(const std::string &path);
+  DirtyFiles::iterator LoadDirty(const std::string &path, bool *exists_ptr);
+  void SaveDirty(const std::string &path, DirtyFiles::iterator it);
+
+  /// 再利用のために開いたままにするファイルディスクリプタ
+  struct CachedFd {
+    std::string path;
+    int flags;                        // キャッシュのキーになるオープンフラグ
+    int count;                        // 参照数 (0の場合は未使用)
+    std::list<int>::iterator idle;    // 未使用リスト内の位置 (count == 0 の場合のみ有効)
+  };
+  typedef std::map<int, CachedFd> FdCache;                     // fd → キャッシュ情報
+  typedef std::map<std::pair<std::string, int>, int> FdIndex;  // (パス, フラグ) → fd
+
+  int AcquireCachedFd(const std::string &path, int flags, bool *is_cacheable_ptr);
+  void AddCachedFd(const std::string &path, int flags, int fd);
+  bool ReleaseCachedFd(const std::string &path, int fd);
+  void EraseCachedFd(FdCache::iterator it);
+
   typedef std::map<std::string, std::set<int> > BufferedFiles;
   BufferedFiles table_;
 
+  DirtyFiles dirty_;
+  std::map<int, std::string> fd_paths_;  // fd → ファイルパス (パスを持たない共有メモリ経由の書き込み用)
+  Mutex dirty_mutex_;
+
   const std::string local_storage_root_path_;
   const std::string secondary_storage_root_path_;
+
+  FdCache fd_cache_;
+  FdIndex fd_index_;
+  std::list<int> fd_idle_;  // 未使用のfd (先頭ほど最近使ったもの)
+  size_t fd_cache_size_;    // 未使用のまま開いておくfdの最大数 (0の場合はキャッシュしない)
+  Mutex fd_cache_mutex_;
+
+  LocalDevices devices_;                   // Localストレージのデバイス (先頭は local_storage_root_path_)
+  size_t stripe_size_;                     // デバイス間のストライプサイズ (0の場合はストライプしない)
+  std::vector<std::string> stripe_patterns_;  // 作成時にストライプするパスのパターン (fnmatch形式)
+  uint64_t stripe_min_size_;               // Secondaryから取り込む時にストライプするサイズ (0の場合は取り込み時はしない)
+
+  IoPriority io_priority_;  // アプリケーションの読み書きを優先するためのバックグラウンドのコピーの制御
+  SecondaryThrottle secondary_throttle_;  // Secondaryストレージへの書き出しの制限
+
+  static uint64_t initial_generation();
+  uint64_t generations_[GENERATION_BUCKETS];  // バケットごとの最後に変更した時の世代 (0の場合は起動後に変更なし)
+  uint64_t last_generation_;                  // 最後に割り当てた世代 (起動時刻から始め、再起動後も重ならないようにする)
 };
 
 } // namespace cbb
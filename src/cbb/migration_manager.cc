@@ -0,0 +1,993 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "migration_manager.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <fstream>
+
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/format.hpp>
+
+#include <jubatus/msgpack/rpc/client.h>
+
+#include "local_file_exporter.h"
+#include "placement_directory.h"
+
+#define MIGRATION_INTERVAL    100        // 移動処理の確認間隔 (msec)
+#define MIGRATION_CHUNK_SIZE  (4 << 20)  // 移動時の読み込みサイズ
+#define MIGRATION_TIMEOUT     60         // 移動時の呼び出しタイムアウト (秒)
+#define MIGRATION_FORWARD_TIMEOUT 10     // リクエスト転送時の呼び出しタイムアウト (秒)
+#define MIGRATION_LIST_MAX    1024       // 一覧取得1回あたりの最大件数
+#define MIGRATION_BUSY_WAIT   5000       // オープン時に移動の完了を待つ最大時間 (msec)
+#define MIGRATION_RETRY_WAIT  10000      // 移動の完了待ちの確認間隔 (usec)
+#define MIGRATION_PULL_RESTARTS 3        // 読み込み中に変更された場合に先頭から読み直す回数
+#define MIGRATION_RELEASE_RETRIES 3      // 削除の応答が得られない場合に送り直す回数 (削除は何度送ってもよい)
+
+// サーバー構成の変更とファイル移動の管理クラス
+namespace cbb {
+
+/**
+ * @breaf 作成
+ *   保存ファイルに移動中の構成が残っている場合は移動を再開する。
+ * @param md_manager_ptr メタデータマネージャーポインタ
+ * @param lf_exporter_ptr Localファイルエクスポーターポインタ
+ * @param placement_ptr 配置ディレクトリポインタ
+ */
+void MigrationManager::Create(MetaDataManager *md_manager_ptr, LocalFileExporter *lf_exporter_ptr, PlacementDirectory *placement_ptr) {
+  assert(md_manager_ptr != NULL);
+  assert(lf_exporter_ptr != NULL);
+  assert(placement_ptr != NULL);
+
+  md_manager_ptr_ = md_manager_ptr;
+  lf_exporter_ptr_ = lf_exporter_ptr;
+  placement_ptr_ = placement_ptr;
+  mutex_.Init();
+  filename_ = md_manager_ptr_->local_path("/" MEMBERSHIP_FILE_NAME);
+
+  mutex_.Lock();
+  if (Load() == kCBBSuccess && current_.epoch > 0) {
+    current_select_.Init(&hash_calc_, current_.hosts, self_.port, current_.virtual_nodes);
+    if (previous_.epoch > 0 || !previous_.hosts.empty()) {
+      Start();
+    }
+  }
+  mutex_.Unlock();
+}
+
+/**
+ * @breaf 開放
+ */
+void MigrationManager::Release() {
+  Thread::Release();
+}
+
+/**
+ * @breaf 現在の構成の取得
+ * @param membership_ptr 構成保存ポインタ
+ * @param is_migrating_ptr 移動中かどうかの保存ポインタ
+ */
+void MigrationManager::GetMembership(Membership *membership_ptr, bool *is_migrating_ptr) {
+  mutex_.Lock();
+  *membership_ptr = current_;
+  *is_migrating_ptr = is_active_;
+  mutex_.Unlock();
+}
+
+/**
+ * @breaf 構成変更の準備
+ *   新しい構成で担当が変わる配置ディレクトリの登録を新しい担当サーバーに複製する。
+ * @param current 変更前の構成 (このサーバーが構成を持たない場合に使う)
+ * @param next 変更後の構成
+ * @param self このサーバー ("host:port")
+ * @return Error値
+ */
+Error MigrationManager::Prepare(const Membership &current, const Membership &next, const std::string &self) {
+  mutex_.Lock();
+  if (is_active_) {
+    mutex_.Unlock();
+    return -EBUSY;
+  }
+  if (current_.epoch == 0) {
+    current_ = current;
+    current_.epoch = 0;
+  }
+  if (next.epoch <= current_.epoch || next.hosts.empty()) {
+    mutex_.Unlock();
+    return -EINVAL;
+  }
+  self_ = ServerInfo::Parse(self, 0);
+  prepared_ = next;
+  mutex_.Unlock();
+
+  SelectServer next_select;
+  next_select.Init(&hash_calc_, next.hosts, self_.port, next.virtual_nodes);
+
+  Error error = kCBBSuccess;
+  std::map<std::string, ServerInfo> entries = placement_ptr_->entries();
+  for (std::map<std::string, ServerInfo>::iterator it = entries.begin(); it != entries.end(); ++it) {
+    ServerInfo owner = next_select.GetInfo(it->first);
+    if (owner == self_ || owner.host.empty()) {
+      continue;
+    }
+    try {
+      msgpack::rpc::client c(owner.host, owner.port);
+      c.set_timeout(MIGRATION_TIMEOUT);
+      c.call(CODE(kForward), std::string(CODE(kPlacement)),
+             msgpack::type::make_tuple(it->first, it->second.host, it->second.port),
+             (int)MIGRATION_FORWARD_MAX).get<msgpack::object>();
+    } catch (msgpack::rpc::rpc_error &e) {
+      error = -EIO;
+      break;
+    }
+  }
+
+  DMSG("MigrationManager::Prepare : epoch %lu -> %lu (%d)\n", current_.epoch, next.epoch, error);
+
+  return error;
+}
+
+/**
+ * @breaf 構成変更の確定
+ *   Prepare 済みの構成に切り替え、引き渡すファイルを調べて移動を開始する。
+ * @param epoch 確定する構成の版
+ * @return Error値
+ */
+Error MigrationManager::Commit(uint64_t epoch) {
+  mutex_.Lock();
+  if (current_.epoch == epoch && epoch > 0) {
+    mutex_.Unlock();
+    return kCBBSuccess;
+  }
+  if (is_active_ || prepared_.epoch != epoch || epoch == 0) {
+    mutex_.Unlock();
+    return -EINVAL;
+  }
+
+  previous_ = current_;
+  current_ = prepared_;
+  prepared_ = Membership();
+  current_select_.Init(&hash_calc_, current_.hosts, self_.port, current_.virtual_nodes);
+
+  // 担当でなくなった配置ディレクトリの登録は Prepare で新しい担当サーバーに複製済み
+  std::map<std::string, ServerInfo> entries = placement_ptr_->entries();
+  for (std::map<std::string, ServerInfo>::iterator it = entries.begin(); it != entries.end(); ++it) {
+    if (current_select_.GetInfo(it->first) != self_) {
+      placement_ptr_->Remove(it->first);
+    }
+  }
+
+  Start();
+  Error error = Save();
+  mutex_.Unlock();
+
+  DMSG("MigrationManager::Commit : epoch %lu (%d)\n", epoch, error);
+
+  return error;
+}
+
+/**
+ * @breaf 構成の変更を受けてリクエストの処理先を判定するかどうか
+ * @return bool 構成を変更済みかどうか
+ */
+bool MigrationManager::is_routing() {
+  mutex_.Lock();
+  bool is_routing = current_.epoch > 0;
+  mutex_.Unlock();
+  return is_routing;
+}
+
+/**
+ * @breaf リクエストの処理先の判定 (パスだけで処理できるリクエスト)
+ * @param path ファイルパス
+ * @param info_ptr 転送先サーバー保存ポインタ
+ * @return MigrationRoute
+ */
+MigrationRoute MigrationManager::Route(const std::string &path, ServerInfo *info_ptr) {
+  // 構成は Commit で変更されるため mutex_ を確保して参照する
+  mutex_.Lock();
+  uint64_t epoch = current_.epoch;
+  ServerInfo owner;
+  if (epoch > 0) {
+    owner = current_select_.GetInfo(path);
+  }
+  mutex_.Unlock();
+
+  if (epoch == 0 || IsLocalFile(path)) {
+    return kRouteLocal;
+  }
+
+  if (owner.host.empty()) {
+    return kRouteLocal;
+  }
+
+  if (owner == self_) {
+    // 移動中のファイルは読み込みを待ち、まだ読み込んでいない場合は移動元サーバーで処理する
+    WaitPull(path);
+    if (!IsLocalFile(path) && FindSource(path, info_ptr)) {
+      return kRouteForward;
+    }
+    return kRouteLocal;
+  }
+
+  // ディレクトリは全サーバーにある
+  boost::system::error_code ec;
+  if (boost::filesystem::is_directory(md_manager_ptr_->local_path(path), ec) ||
+      boost::filesystem::is_directory(md_manager_ptr_->secondary_path(path), ec)) {
+    return kRouteLocal;
+  }
+
+  *info_ptr = owner;
+  return kRouteForward;
+}
+
+/**
+ * @breaf オープン可能かどうかの判定
+ *   古い構成のクライアントがこのサーバーの担当でないファイルを開こうとした場合は -ESTALE を返し、
+ *   クライアントに構成を取り直させる。担当ファイルが移動中の場合はその場で読み込む。
+ * @param path ファイルパス
+ * @param client_epoch クライアントの構成の版
+ * @return Error値
+ */
+Error MigrationManager::CheckOpen(const std::string &path, uint64_t client_epoch) {
+  bool is_local = IsLocalFile(path);
+
+  mutex_.Lock();
+  if (current_.epoch == 0) {
+    mutex_.Unlock();
+    return kCBBSuccess;
+  }
+  ServerInfo owner = current_select_.GetInfo(path);
+  bool is_active = is_active_;
+  bool is_current = client_epoch >= current_.epoch;
+  bool is_pending = pending_.find(path) != pending_.end();
+  bool is_released = released_.find(path) != released_.end();
+  mutex_.Unlock();
+
+  if (owner == self_) {
+    return is_active && !is_local ? PullNow(path) : kCBBSuccess;
+  }
+  if (is_local) {
+    return is_current || !is_pending ? kCBBSuccess : -ESTALE;
+  }
+  // 配置先、ストライプ先として開く場合は担当サーバー以外でもよい
+  return is_current && !is_released ? kCBBSuccess : -ESTALE;
+}
+
+/**
+ * @breaf ファイルの読み込み完了待ち
+ * @param path ファイルパス
+ */
+void MigrationManager::WaitPull(const std::string &path) {
+  uint64_t deadline = get_time_msec() + MIGRATION_BUSY_WAIT;
+
+  mutex_.Lock();
+  while (pulling_.find(path) != pulling_.end() && get_time_msec() < deadline) {
+    mutex_.Unlock();
+    usleep(MIGRATION_RETRY_WAIT);
+    mutex_.Lock();
+  }
+  mutex_.Unlock();
+}
+
+/**
+ * @breaf 削除されたファイルを移動対象から外す
+ * @param path ファイルパス
+ */
+void MigrationManager::Forget(const std::string &path) {
+  mutex_.Lock();
+  if (is_active_) {
+    tombstones_.insert(path);
+    expected_.erase(path);
+    pending_.erase(path);
+  }
+  mutex_.Unlock();
+}
+
+/**
+ * @breaf リクエストの転送
+ *   転送先の呼び出しに失敗した場合は false を返し、呼び出し元がこのサーバーで処理する。
+ *   転送先との接続は使い回し、処理スレッドを待たせる時間は MIGRATION_FORWARD_TIMEOUT までとする。
+ * @param req MsgPackリクエストオブジェクト
+ * @param method メソッド (v1の名前、v2のコードのまま転送する)
+ * @param params パラメータ
+ * @param hops これまでの転送回数
+ * @param info 転送先サーバー
+ * @return bool 転送したかどうか
+ */
+bool MigrationManager::Forward(msgpack::rpc::request &req, const msgpack::object &method, const msgpack::object &params,
+                               int hops, const ServerInfo &info) {
+  msgpack::rpc::session c = forward_pool_.get_session(info.host, info.port);
+  try {
+    c.set_timeout(MIGRATION_FORWARD_TIMEOUT);
+    msgpack::rpc::future f = c.call(CODE(kForward), method, params, hops + 1);
+    msgpack::object result = f.get<msgpack::object>();
+    req.result(result, f.zone());
+  } catch (msgpack::rpc::rpc_error &e) {
+    c.close();
+    DMSG("MigrationManager::Forward : to %s failed\n", info.str().c_str());
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @breaf 引き渡すファイルの一覧 (移動元)
+ * @param epoch 移動先サーバーの構成の版
+ * @param info 移動先サーバー
+ * @param after このパスより後のファイルを返す
+ * @param max 最大件数
+ * @param paths_ptr パス一覧保存ポインタ (max件未満の場合は最後まで取得済み)
+ * @return Error値
+ */
+Error MigrationManager::List(uint64_t epoch, const ServerInfo &info, const std::string &after, size_t max,
+                             std::vector<std::string> *paths_ptr) {
+  paths_ptr->clear();
+
+  mutex_.Lock();
+  if (epoch != current_.epoch) {
+    mutex_.Unlock();
+    return -EAGAIN;
+  }
+
+  std::set<std::string>::iterator it = pending_.upper_bound(after);
+  for (; it != pending_.end() && paths_ptr->size() < max; ++it) {
+    if (current_select_.GetInfo(*it) == info) {
+      paths_ptr->push_back(*it);
+    }
+  }
+  mutex_.Unlock();
+
+  return kCBBSuccess;
+}
+
+/**
+ * @breaf 引き渡すファイルの読み込み (移動元)
+ * @param path ファイルパス
+ * @param size 読み込みサイズ
+ * @param offset オフセット
+ * @param stat_ptr ファイル属性保存ポインタ
+ * @param buf 読み込みバッファ
+ * @return 読み込んだサイズ (負の場合はError値)
+ */
+ssize_t MigrationManager::Read(const std::string &path, size_t size, off_t offset, FileStat *stat_ptr, char *buf) {
+  mutex_.Lock();
+  if (pending_.find(path) == pending_.end()) {
+    mutex_.Unlock();
+    return -ENOENT;
+  }
+  if (md_manager_ptr_->is_buffered(path)) {
+    mutex_.Unlock();
+    return -EBUSY;
+  }
+  mutex_.Unlock();
+
+  FileControl file_control;
+  int fd = file_control.Open(md_manager_ptr_->local_path(path).c_str(), O_RDONLY);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  ssize_t ssize = md_manager_ptr_->GetFileStatFD(fd, stat_ptr);
+  if (ssize == kCBBSuccess) {
+    ssize = file_control.Read(buf, size, offset);
+  }
+  file_control.Close();
+
+  return ssize;
+}
+
+/**
+ * @breaf 引き渡したファイルの削除 (移動元)
+ *   読み込み後に変更された場合は -EAGAIN を返し、移動先サーバーに読み込み直させる。
+ *   引き渡し済みのファイルは成功を返す (移動先は応答が得られない場合に送り直す)。
+ * @param path ファイルパス
+ * @param stat 移動先サーバーが読み込んだ時点のファイル属性
+ * @return Error値
+ */
+Error MigrationManager::ReleaseFile(const std::string &path, const FileStat &stat) {
+  std::string filename = md_manager_ptr_->local_path(path);
+  Error error = kCBBSuccess;
+
+  mutex_.Lock();
+  if (released_.find(path) != released_.end()) {
+    // 応答が失われて移動先が送り直した場合
+    error = kCBBSuccess;
+  } else if (pending_.find(path) == pending_.end()) {
+    error = -ENOENT;
+  } else if (md_manager_ptr_->is_buffered(path)) {
+    error = -EBUSY;
+  } else {
+    struct stat st;
+    if (lstat(filename.c_str(), &st) != 0) {
+      pending_.erase(path);
+      error = -ENOENT;
+    } else if (st.st_size != stat.st_size || st.st_mode != stat.st_mode ||
+               st.st_mtim.tv_sec != stat.st_mtim.tv_sec || st.st_mtim.tv_nsec != stat.st_mtim.tv_nsec) {
+      error = -EAGAIN;
+    } else {
+      lf_exporter_ptr_->Unregister(path);
+      md_manager_ptr_->InvalidateFdCache(path);
+      FileControl::Remove(filename.c_str());
+      pending_.erase(path);
+      released_.insert(path);
+    }
+  }
+  mutex_.Unlock();
+
+  DMSG("MigrationManager::ReleaseFile : %s (%d)\n", path.c_str(), error);
+
+  return error;
+}
+
+/**
+ * @see Thread::ThreadCall
+ * @breaf 移動処理 (一覧取得、読み込み、ストライプの書き戻し)
+ * @return bool 呼び出しを継続するかどうか
+ */
+bool MigrationManager::ThreadCall(void *user_data) {
+  // 移動元サーバーから一覧を取得
+  bool is_list_complete = true;
+  BOOST_FOREACH(Source &source, sources_) {
+    while (!source.is_complete && FetchList(&source) == kCBBSuccess) {
+    }
+    is_list_complete = is_list_complete && source.is_complete;
+  }
+
+  mutex_.Lock();
+  is_list_complete_ = is_list_complete;
+  std::map<std::string, ServerInfo> expected = expected_;
+  mutex_.Unlock();
+
+  // 担当になったファイルを読み込む
+  for (std::map<std::string, ServerInfo>::iterator it = expected.begin(); it != expected.end(); ++it) {
+    PullFile(it->first, it->second);
+  }
+
+  bool is_flushed = FlushStripes();
+
+  mutex_.Lock();
+  bool is_done = is_list_complete_ && is_flushed && pending_.empty() && expected_.empty() && unplaced_.empty();
+  if (is_done) {
+    Finish();
+  }
+  mutex_.Unlock();
+
+  return !is_done;
+}
+
+/**
+ * @breaf 保存ファイルの読み込み (mutex_ を取得して呼ぶ)
+ * @return Error値
+ */
+Error MigrationManager::Load() {
+  std::ifstream stream(filename_.c_str());
+  if (!stream) {
+    return -ENOENT;
+  }
+
+  // "key value" 形式
+  std::string line;
+  while (std::getline(stream, line)) {
+    std::string::size_type pos = line.find(' ');
+    if (pos == std::string::npos) {
+      continue;
+    }
+    std::string key = line.substr(0, pos);
+    std::string value = line.substr(pos + 1);
+
+    if (key == "epoch") {
+      current_.epoch = strtoull(value.c_str(), NULL, 10);
+    } else if (key == "virtual_nodes") {
+      current_.virtual_nodes = atoi(value.c_str());
+    } else if (key == "host") {
+      current_.hosts.push_back(value);
+    } else if (key == "self") {
+      self_ = ServerInfo::Parse(value, 0);
+    } else if (key == "previous_epoch") {
+      previous_.epoch = strtoull(value.c_str(), NULL, 10);
+    } else if (key == "previous_virtual_nodes") {
+      previous_.virtual_nodes = atoi(value.c_str());
+    } else if (key == "previous_host") {
+      previous_.hosts.push_back(value);
+    }
+  }
+
+  return kCBBSuccess;
+}
+
+/**
+ * @breaf 保存ファイルの書き込み (mutex_ を取得して呼ぶ)
+ *   移動中は変更前の構成も保存し、再起動後に移動を再開する。
+ * @return Error値
+ */
+Error MigrationManager::Save() {
+  std::string temporary = filename_ + ".tmp";
+  FILE *file = fopen(temporary.c_str(), "w");
+  if (file == NULL) {
+    return -errno;
+  }
+
+  fprintf(file, "epoch %lu\n", current_.epoch);
+  fprintf(file, "virtual_nodes %d\n", current_.virtual_nodes);
+  fprintf(file, "self %s\n", self_.str().c_str());
+  BOOST_FOREACH(const std::string &host, current_.hosts) {
+    fprintf(file, "host %s\n", host.c_str());
+  }
+  if (is_active_) {
+    fprintf(file, "previous_epoch %lu\n", previous_.epoch);
+    fprintf(file, "previous_virtual_nodes %d\n", previous_.virtual_nodes);
+    BOOST_FOREACH(const std::string &host, previous_.hosts) {
+      fprintf(file, "previous_host %s\n", host.c_str());
+    }
+  }
+
+  if (fclose(file) != 0 || rename(temporary.c_str(), filename_.c_str()) != 0) {
+    unlink(temporary.c_str());
+    return -errno;
+  }
+  return kCBBSuccess;
+}
+
+/**
+ * @breaf 移動の開始 (mutex_ を取得して呼ぶ)
+ *   Localストレージを調べて、引き渡すファイルと書き戻すストライプファイルを決める。
+ */
+void MigrationManager::Start() {
+  previous_select_.Init(&hash_calc_, previous_.hosts, self_.port, previous_.virtual_nodes);
+
+  sources_.clear();
+  BOOST_FOREACH(const ServerInfo &info, previous_select_.server_list()) {
+    if (info != self_) {
+      Source source;
+      source.info = info;
+      sources_.push_back(source);
+    }
+  }
+  is_list_complete_ = sources_.empty();
+
+  pending_.clear();
+  flush_queue_.clear();
+  expected_.clear();
+  released_.clear();
+  tombstones_.clear();
+  ScanLocalFiles("");
+
+  is_active_ = true;
+  Thread::Create(NULL, MIGRATION_INTERVAL);
+
+  DMSG("MigrationManager::Start : epoch %lu pending %lu stripes %lu sources %lu\n",
+       current_.epoch, pending_.size(), flush_queue_.size(), sources_.size());
+}
+
+/**
+ * @breaf 移動の終了 (mutex_ を取得して呼ぶ)
+ */
+void MigrationManager::Finish() {
+  is_active_ = false;
+  is_list_complete_ = true;
+  previous_ = Membership();
+  sources_.clear();
+  pending_.clear();
+  flush_queue_.clear();
+  expected_.clear();
+  released_.clear();
+  tombstones_.clear();
+  Save();
+
+  DMSG("MigrationManager::Finish : epoch %lu\n", current_.epoch);
+}
+
+/**
+ * @breaf Localストレージのファイルの振り分け (mutex_ を取得して呼ぶ)
+ * @param path 調べるディレクトリのパス
+ */
+void MigrationManager::ScanLocalFiles(const std::string &path) {
+  for (int device = 0; device < md_manager_ptr_->devices().size(); device++) {
+    ScanDeviceFiles(path, device);
+  }
+}
+
+/**
+ * @breaf デバイスごとのLocalストレージのファイルの振り分け (mutex_ を取得して呼ぶ)
+ *   ディレクトリは先頭のデバイスのものだけをたどる (他のデバイスにあるディレクトリは先頭のデバイスにもある)
+ * @param path 調べるディレクトリのパス
+ * @param device デバイス番号
+ */
+void MigrationManager::ScanDeviceFiles(const std::string &path, int device) {
+  DIR *dp = opendir(md_manager_ptr_->device_path(device, path).c_str());
+  if (dp == NULL) {
+    return;
+  }
+
+  bool is_member = current_select_.Contains(self_);
+
+  struct dirent *ent;
+  while ((ent = readdir(dp)) != NULL) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0 || is_internal_name(ent->d_name)) {
+      continue;
+    }
+
+    std::string fpath = path + "/" + ent->d_name;
+    std::string fname = md_manager_ptr_->device_path(device, fpath);
+
+    if (boost::filesystem::is_directory(fname)) {
+      if (device == 0) {
+        ScanLocalFiles(fpath);
+      }
+      continue;
+    }
+    if (!boost::filesystem::is_regular_file(fname)) {
+      continue;
+    }
+
+    // ストライプファイルは担当でなくなった場合にSecondaryに書き戻す (移動しない)
+    StripeLayout layout;
+    if (md_manager_ptr_->GetLocalStripe(fpath, &layout) == kCBBSuccess && layout.is_striped()) {
+      std::vector<ServerInfo> infos;
+      current_select_.GetStripeInfo(fpath.c_str(), layout.count, infos);
+      if (layout.index >= (int)infos.size() || infos[layout.index] != self_) {
+        flush_queue_.insert(fpath);
+      }
+      continue;
+    }
+
+    if (!is_member) {
+      pending_.insert(fpath);
+    } else if (previous_select_.GetInfo(fpath) == self_ && current_select_.GetInfo(fpath) != self_) {
+      pending_.insert(fpath);
+    }
+  }
+
+  closedir(dp);
+}
+
+/**
+ * @breaf Localストレージにある通常ファイルかどうか
+ * @param path ファイルパス
+ * @return bool 通常ファイルかどうか
+ */
+bool MigrationManager::IsLocalFile(const std::string &path) {
+  boost::system::error_code ec;
+  return boost::filesystem::is_regular_file(md_manager_ptr_->local_path(path), ec);
+}
+
+/**
+ * @breaf 担当になったファイルの移動元サーバーの検索
+ *   一覧を取得し終えるまでは、変更前の構成で担当だったサーバーを移動元とみなす。
+ * @param path ファイルパス
+ * @param info_ptr 移動元サーバー保存ポインタ
+ * @return bool 移動元サーバーがあるかどうか
+ */
+bool MigrationManager::FindSource(const std::string &path, ServerInfo *info_ptr) {
+  bool result = false;
+
+  mutex_.Lock();
+  if (is_active_) {
+    std::map<std::string, ServerInfo>::iterator it = expected_.find(path);
+    if (it != expected_.end()) {
+      *info_ptr = it->second;
+      result = true;
+    } else if (!is_list_complete_ && tombstones_.find(path) == tombstones_.end()) {
+      ServerInfo info = previous_select_.GetInfo(path);
+      if (!info.host.empty() && info != self_) {
+        *info_ptr = info;
+        result = true;
+      }
+    }
+  }
+  mutex_.Unlock();
+
+  return result;
+}
+
+/**
+ * @breaf 移動元サーバーからの一覧取得
+ * @param source_ptr 移動元サーバーの取得状況
+ * @return Error値
+ */
+Error MigrationManager::FetchList(Source *source_ptr) {
+  typedef msgpack::type::tuple<Error, std::vector<std::string> > Result;
+
+  Result result;
+  try {
+    msgpack::rpc::client c(source_ptr->info.host, source_ptr->info.port);
+    c.set_timeout(MIGRATION_TIMEOUT);
+    result = c.call(CODE(kMigrateList), current_.epoch, self_.host, self_.port,
+                    source_ptr->after, (size_t)MIGRATION_LIST_MAX).get<Result>();
+  } catch (msgpack::rpc::rpc_error &e) {
+    return -EIO;
+  }
+
+  Error error = result.get<0>();
+  if (error != kCBBSuccess) {
+    return error;
+  }
+
+  std::vector<std::string> &paths = result.get<1>();
+
+  mutex_.Lock();
+  BOOST_FOREACH(const std::string &path, paths) {
+    if (tombstones_.find(path) == tombstones_.end()) {
+      expected_[path] = source_ptr->info;
+    }
+  }
+  mutex_.Unlock();
+
+  if (!paths.empty()) {
+    source_ptr->after = paths.back();
+  }
+  source_ptr->is_complete = paths.size() < MIGRATION_LIST_MAX;
+
+  return kCBBSuccess;
+}
+
+/**
+ * @breaf オープン時の読み込み
+ *   移動元でファイルが使われている間は待ち、MIGRATION_BUSY_WAIT を過ぎた場合は -EAGAIN を返す。
+ * @param path ファイルパス
+ * @return Error値
+ */
+Error MigrationManager::PullNow(const std::string &path) {
+  uint64_t deadline = get_time_msec() + MIGRATION_BUSY_WAIT;
+
+  ServerInfo source;
+  while (FindSource(path, &source)) {
+    Error error = PullFile(path, source);
+    if (error != -EBUSY && error != -EAGAIN) {
+      // 移動元サーバーに接続できない場合はこのサーバーで処理する
+      break;
+    }
+    if (get_time_msec() >= deadline) {
+      return -EAGAIN;
+    }
+    usleep(MIGRATION_RETRY_WAIT);
+  }
+
+  return kCBBSuccess;
+}
+
+/**
+ * @breaf 移動元サーバーとファイル属性を比べる (読み込みの途中、削除の前に変更されていないか)
+ * @param a ファイル属性
+ * @param b ファイル属性
+ * @return bool 同じ版かどうか
+ */
+static bool is_same_version(const FileStat &a, const FileStat &b) {
+  return a.st_size == b.st_size && a.st_mode == b.st_mode &&
+      a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+/**
+ * @breaf 移動元サーバーからファイルを読み込む (移動先)
+ *   一時ファイルに読み込み、移動元が削除してから置き換えるため、同じファイルが2つのサーバーに残らない。
+ *   削除を送った後は応答が失われても移動元は削除済みのことがあるため、一時ファイルは消さずに置き換えをやり直す。
+ * @param path ファイルパス
+ * @param source 移動元サーバー
+ * @return Error値
+ */
+Error MigrationManager::PullFile(const std::string &path, const ServerInfo &source) {
+  mutex_.Lock();
+  if (pulling_.find(path) != pulling_.end()) {
+    mutex_.Unlock();
+    WaitPull(path);
+    return -EAGAIN;
+  }
+  pulling_.insert(path);
+  // 移動元が削除した後に置き換えられなかった一時ファイルがある場合は置き換えだけをやり直す
+  std::map<std::string, std::pair<int, std::string> >::iterator kept = unplaced_.find(path);
+  bool is_released = kept != unplaced_.end();
+  int device = is_released ? kept->second.first: 0;
+  std::string temporary = is_released ? kept->second.second: "";
+  uint64_t sequence = temp_sequence_++;
+  if (is_released) {
+    unplaced_.erase(kept);
+  }
+  mutex_.Unlock();
+
+  Error error = kCBBSuccess;
+  if (!is_released) {
+    // 名前の変更で置き換えるため、一時ファイルはファイルを置くデバイスに作る
+    device = md_manager_ptr_->PlaceLocal(path);
+    temporary = md_manager_ptr_->device_path(device, (boost::format("/" INTERNAL_NAME_PREFIX "migrate.%1%") % sequence).str());
+    error = FetchFile(path, source, temporary, &is_released);
+  }
+
+  std::string filename = md_manager_ptr_->device_path(device, path);
+  bool is_conflict = false;
+  if (error == kCBBSuccess) {
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(boost::filesystem::path(filename).parent_path(), ec);
+
+    // 取り込み中に別のデバイスに作られた場合はそちらを残す
+    LocalDevices::PlaceScope place(md_manager_ptr_->devices(), path.c_str(), path.size());
+    md_manager_ptr_->InvalidateFdCache(path);
+    int located = md_manager_ptr_->devices().Locate(path.c_str(), path.size());
+    if (located >= 0 && located != device) {
+      error = -EEXIST;
+      is_conflict = true;
+    } else if (rename(temporary.c_str(), filename.c_str()) != 0) {
+      error = -errno;
+    }
+  }
+  if (error == kCBBSuccess) {
+    lf_exporter_ptr_->Register(path);
+
+    ServerInfo placed;
+    if (placement_ptr_->Lookup(path, &placed) && placed == source) {
+      placement_ptr_->Remove(path);
+    }
+  } else if (!is_released) {
+    unlink(temporary.c_str());
+  } else if (is_conflict) {
+    // 移動元には残っていないため、後から作られたファイルとは別に引き渡されたデータを残す
+    EMSG("MigrationManager::PullFile : %s exists on another device, pulled data is kept in %s\n",
+         path.c_str(), temporary.c_str());
+  } else {
+    EMSG("MigrationManager::PullFile : %s is not placed (%d), retrying from %s\n",
+         path.c_str(), error, temporary.c_str());
+  }
+
+  mutex_.Lock();
+  pulling_.erase(path);
+  if (error == kCBBSuccess || error == -ENOENT || is_conflict) {
+    expected_.erase(path);
+  } else if (is_released) {
+    unplaced_[path] = std::make_pair(device, temporary);
+  }
+  mutex_.Unlock();
+
+  DMSG("MigrationManager::PullFile : %s from %s (%d)\n", path.c_str(), source.str().c_str(), error);
+
+  return error;
+}
+
+/**
+ * @breaf 移動元サーバーから一時ファイルへの読み込みと移動元の削除 (移動先)
+ *   読み込みの途中で移動元のファイルが変更された場合は、先頭から読み直す。
+ * @param path ファイルパス
+ * @param source 移動元サーバー
+ * @param temporary 一時ファイル
+ * @param is_released_ptr 削除を送ったかどうかの保存ポインタ (移動元が断った場合はfalse)
+ * @return Error値
+ */
+Error MigrationManager::FetchFile(const std::string &path, const ServerInfo &source, const std::string &temporary,
+                                  bool *is_released_ptr) {
+  *is_released_ptr = false;
+  int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  Error error = kCBBSuccess;
+  FileStat stat;
+  try {
+    msgpack::rpc::client c(source.host, source.port);
+    c.set_timeout(MIGRATION_TIMEOUT);
+
+    typedef msgpack::type::tuple<ssize_t, FileStat, msgpack::type::raw_ref> Result;
+    off_t offset = 0;
+    int restarts = 0;
+    while (error == kCBBSuccess) {
+      msgpack::rpc::auto_zone zone;
+      Result result = c.call(CODE(kMigrateRead), path, (size_t)MIGRATION_CHUNK_SIZE, offset).get<Result>(&zone);
+      ssize_t ssize = result.get<0>();
+      if (ssize < 0) {
+        error = ssize;
+        break;
+      }
+      // 先頭のチャンクの属性を版とし、途中で変わった場合は読み込み済みのチャンクが古い
+      if (offset == 0) {
+        stat = result.get<1>();
+      } else if (!is_same_version(stat, result.get<1>())) {
+        if (++restarts > MIGRATION_PULL_RESTARTS || ftruncate(fd, 0) != 0) {
+          error = -EAGAIN;
+        }
+        offset = 0;
+        continue;
+      }
+      if (ssize > 0 && pwrite(fd, result.get<2>().ptr, ssize, offset) != ssize) {
+        error = -EIO;
+      }
+      offset += ssize;
+      if (ssize < MIGRATION_CHUNK_SIZE) {
+        break;
+      }
+    }
+  } catch (msgpack::rpc::rpc_error &e) {
+    error = -EIO;
+  }
+  fchmod(fd, stat.st_mode & 07777);
+  close(fd);
+
+  mutex_.Lock();
+  if (error == kCBBSuccess && tombstones_.find(path) != tombstones_.end()) {
+    error = -ENOENT;
+  }
+  mutex_.Unlock();
+  if (error != kCBBSuccess) {
+    return error;
+  }
+
+  struct timespec times[2];
+  times[0].tv_sec = stat.st_atim.tv_sec;
+  times[0].tv_nsec = stat.st_atim.tv_nsec;
+  times[1].tv_sec = stat.st_mtim.tv_sec;
+  times[1].tv_nsec = stat.st_mtim.tv_nsec;
+  utimensat(AT_FDCWD, temporary.c_str(), times, 0);
+
+  // 削除を送った後は応答がなくても移動元は削除済みのことがある (送り直しは削除済みなら成功する)
+  *is_released_ptr = true;
+  for (int retry = 0; ; retry++) {
+    try {
+      msgpack::rpc::client c(source.host, source.port);
+      c.set_timeout(MIGRATION_TIMEOUT);
+      error = c.call(CODE(kMigrateRelease), path, stat).get<Error>();
+      break;
+    } catch (msgpack::rpc::rpc_error &e) {
+      if (retry >= MIGRATION_RELEASE_RETRIES) {
+        // 削除されたか分からない場合は、失わないようにこのサーバーに置く
+        WMSG("MigrationManager::FetchFile : no release reply for %s from %s, keeping the pulled data\n",
+             path.c_str(), source.str().c_str());
+        return kCBBSuccess;
+      }
+      usleep(MIGRATION_RETRY_WAIT);
+    }
+  }
+  if (error != kCBBSuccess) {
+    // 移動元が削除を断った場合はファイルは移動元に残っている
+    *is_released_ptr = false;
+  }
+  return error;
+}
+
+/**
+ * @breaf 担当でなくなったストライプファイルをSecondaryに書き戻して削除
+ * @return bool すべて書き戻したかどうか
+ */
+bool MigrationManager::FlushStripes() {
+  mutex_.Lock();
+  std::set<std::string> queue = flush_queue_;
+  mutex_.Unlock();
+
+  BOOST_FOREACH(const std::string &path, queue) {
+    if (md_manager_ptr_->is_buffered(path)) {
+      continue;
+    }
+    if (lf_exporter_ptr_->ExportStripes(path)) {
+      md_manager_ptr_->InvalidateFdCache(path);
+      FileControl::Remove(md_manager_ptr_->local_path(path).c_str());
+    } else if (IsLocalFile(path)) {
+      continue;
+    }
+    mutex_.Lock();
+    flush_queue_.erase(path);
+    mutex_.Unlock();
+  }
+
+  mutex_.Lock();
+  bool result = flush_queue_.empty();
+  mutex_.Unlock();
+
+  return result;
+}
+
+} // namespace cbb
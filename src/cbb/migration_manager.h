@@ -0,0 +1,147 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef CBB_MIGRATION_MANAGER_H_
+#define CBB_MIGRATION_MANAGER_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+
+#include <jubatus/msgpack/rpc/server.h>
+#include <jubatus/msgpack/rpc/session_pool.h>
+
+#include "common/common.h"
+#include "common/error.h"
+#include "util/mutex.h"
+#include "util/thread.h"
+#include "util/select_server.h"
+#include "util/hash/hash_calc_md5.h"
+#include "meta_data_manager.h"
+
+// Localストレージ内のサーバー構成の保存ファイル (ディレクトリ一覧、エクスポートの対象外)
+#define MEMBERSHIP_FILE_NAME INTERNAL_NAME_PREFIX "membership"
+
+// 転送されたリクエストを再転送できる回数
+#define MIGRATION_FORWARD_MAX 2
+
+// 構成の版を送らないクライアントの版 (常に最新の構成とみなす)
+#define MIGRATION_EPOCH_ANY ((uint64_t)-1)
+
+namespace cbb {
+
+class LocalFileExporter;
+class PlacementDirectory;
+
+/// リクエストの処理先
+enum MigrationRoute {
+  kRouteLocal = 0,    // このサーバーで処理する
+  kRouteForward = 1,  // 他のサーバーに転送する
+};
+
+// サーバー構成の変更とファイルの移動を管理するクラス
+//   構成の変更は Prepare (全サーバー) → Commit (全サーバー) の2段階で行う。
+//   新しい担当サーバーは移動元サーバーから一覧を取得してファイルを読み込み (pull)、
+//   移動が終わるまでは担当サーバーに届いたリクエストを移動元サーバーに転送する。
+class MigrationManager : public Thread {
+
+ public:
+
+  MigrationManager() : md_manager_ptr_(NULL), lf_exporter_ptr_(NULL), placement_ptr_(NULL),
+                       is_active_(false), is_list_complete_(true), temp_sequence_(0) {}
+  virtual ~MigrationManager() {}
+
+  void Create(MetaDataManager *md_manager_ptr, LocalFileExporter *lf_exporter_ptr, PlacementDirectory *placement_ptr);
+  void Release();
+
+  void GetMembership(Membership *membership_ptr, bool *is_migrating_ptr);
+  Error Prepare(const Membership &current, const Membership &next, const std::string &self);
+  Error Commit(uint64_t epoch);
+
+  bool is_routing();
+  MigrationRoute Route(const std::string &path, ServerInfo *info_ptr);
+  Error CheckOpen(const std::string &path, uint64_t client_epoch);
+  void WaitPull(const std::string &path);
+  void Forget(const std::string &path);
+  bool Forward(msgpack::rpc::request &req, const msgpack::object &method, const msgpack::object &params,
+               int hops, const ServerInfo &info);
+
+  Error List(uint64_t epoch, const ServerInfo &info, const std::string &after, size_t max,
+             std::vector<std::string> *paths_ptr);
+  ssize_t Read(const std::string &path, size_t size, off_t offset, FileStat *stat_ptr, char *buf);
+  Error ReleaseFile(const std::string &path, const FileStat &stat);
+
+ protected:
+  bool ThreadCall(void *user_data);
+
+ private:
+
+  /// 移動元サーバーごとの一覧取得状況
+  struct Source {
+    ServerInfo info;
+    std::string after;  // 取得済みの最後のパス
+    bool is_complete;   // 全件取得したかどうか
+    Source() : is_complete(false) {}
+  };
+
+  Error Load();
+  Error Save();
+  void Start();
+  void Finish();
+  void ScanLocalFiles(const std::string &path);
+  void ScanDeviceFiles(const std::string &path, int device);
+  bool IsLocalFile(const std::string &path);
+  bool FindSource(const std::string &path, ServerInfo *info_ptr);
+  Error FetchList(Source *source_ptr);
+  Error PullNow(const std::string &path);
+  Error PullFile(const std::string &path, const ServerInfo &source);
+  Error FetchFile(const std::string &path, const ServerInfo &source, const std::string &temporary, bool *is_released_ptr);
+  bool FlushStripes();
+
+  MetaDataManager *md_manager_ptr_;
+  LocalFileExporter *lf_exporter_ptr_;
+  PlacementDirectory *placement_ptr_;
+  HashCalcMD5 hash_calc_;
+
+  Membership current_;   // 現在の構成
+  Membership previous_;  // 移動中の場合は変更前の構成
+  Membership prepared_;  // Prepare 済みで Commit 待ちの構成
+  ServerInfo self_;
+  SelectServer current_select_;
+  SelectServer previous_select_;
+
+  bool is_active_;
+  bool is_list_complete_;
+  std::vector<Source> sources_;
+  std::set<std::string> pending_;                 // 他のサーバーに引き渡すファイル (移動元)
+  std::set<std::string> flush_queue_;             // Secondaryに書き戻すストライプファイル
+  std::map<std::string, ServerInfo> expected_;    // 読み込むファイルと移動元サーバー (移動先)
+  std::set<std::string> pulling_;                 // 読み込み中のファイル
+  std::map<std::string, std::pair<int, std::string> > unplaced_;  // 移動元が削除した後に置き換えられなかったファイルのデバイスと一時ファイル
+  std::set<std::string> released_;                // 引き渡し済みのファイル
+  std::set<std::string> tombstones_;              // 移動中に削除されたファイル
+  uint64_t temp_sequence_;
+  std::string filename_;
+  Mutex mutex_;
+
+  msgpack::rpc::session_pool forward_pool_;       // リクエスト転送先サーバーとの接続
+};
+
+} // namespace cbb
+
+#endif // CBB_MIGRATION_MANAGER_H_
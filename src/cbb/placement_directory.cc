@@ -0,0 +1,220 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "placement_directory.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fstream>
+
+#include <boost/format.hpp>
+
+#define PLACEMENT_COMPACT_MARGIN 1024  // 追記ログを書き直すまでの余分な行数
+
+// 配置ディレクトリクラス
+namespace cbb {
+
+/**
+ * @breaf 保存ファイルを読み込んで開く
+ * @param filename 保存ファイル名
+ * @return Error値
+ */
+Error PlacementDirectory::Open(const std::string &filename) {
+  Close();
+
+  mutex_.Init();
+  filename_ = filename;
+  entries_.clear();
+  log_count_ = 0;
+
+  // 追記ログの再生 ("+\thost\tport\tpath" または "-\tpath")
+  std::ifstream stream(filename.c_str());
+  std::string line;
+  while (std::getline(stream, line)) {
+    log_count_++;
+    if (line.size() > 2 && line[0] == '-' && line[1] == '\t') {
+      entries_.erase(line.substr(2));
+    } else if (line.size() > 2 && line[0] == '+' && line[1] == '\t') {
+      std::string::size_type host_end = line.find('\t', 2);
+      std::string::size_type port_end = host_end != std::string::npos ? line.find('\t', host_end + 1) : std::string::npos;
+      if (port_end == std::string::npos) {
+        continue;
+      }
+      ServerInfo info;
+      info.host = line.substr(2, host_end - 2);
+      info.port = atoi(line.substr(host_end + 1, port_end - host_end - 1).c_str());
+      entries_[line.substr(port_end + 1)] = info;
+    }
+  }
+  stream.close();
+
+  return Compact();
+}
+
+/**
+ * @breaf 保存ファイルを閉じる
+ */
+void PlacementDirectory::Close() {
+  if (file_ != NULL) {
+    fclose(file_);
+    file_ = NULL;
+  }
+}
+
+/**
+ * @breaf 配置先の検索
+ * @param path ファイルパス
+ * @param info_ptr 配置先サーバー保存ポインタ
+ * @return bool 登録されているかどうか
+ */
+bool PlacementDirectory::Lookup(const std::string &path, ServerInfo *info_ptr) {
+  bool result = false;
+
+  mutex_.Lock();
+  std::map<std::string, ServerInfo>::iterator it = entries_.find(path);
+  if (it != entries_.end()) {
+    *info_ptr = it->second;
+    result = true;
+  }
+  mutex_.Unlock();
+
+  return result;
+}
+
+/**
+ * @breaf 配置先の登録
+ * @param path ファイルパス
+ * @param info 配置先サーバー
+ * @return Error値
+ */
+Error PlacementDirectory::Set(const std::string &path, const ServerInfo &info) {
+  if (path.find('\n') != std::string::npos || info.host.find_first_of("\t\n") != std::string::npos) {
+    return -EINVAL;
+  }
+
+  mutex_.Lock();
+  entries_[path] = info;
+  Error error = Append((boost::format("+\t%1%\t%2%\t%3%\n") % info.host % info.port % path).str());
+  mutex_.Unlock();
+
+  return error;
+}
+
+/**
+ * @breaf 未登録の場合だけ配置先を登録 (作成時の配置の決定)
+ *   同じパスを同時に作成したクライアントのうち、最初に登録したものの配置先に揃える。
+ * @param path ファイルパス
+ * @param info 配置先サーバー
+ * @param existing_ptr 登録済みの配置先保存ポインタ (-EEXISTの場合)
+ * @return Error値 (別の配置先が登録済みの場合は-EEXIST)
+ */
+Error PlacementDirectory::Claim(const std::string &path, const ServerInfo &info, ServerInfo *existing_ptr) {
+  if (path.find('\n') != std::string::npos || info.host.find_first_of("\t\n") != std::string::npos) {
+    return -EINVAL;
+  }
+
+  Error error = kCBBSuccess;
+
+  mutex_.Lock();
+  std::map<std::string, ServerInfo>::iterator it = entries_.find(path);
+  if (it == entries_.end()) {
+    entries_[path] = info;
+    error = Append((boost::format("+\t%1%\t%2%\t%3%\n") % info.host % info.port % path).str());
+  } else if (it->second.host != info.host || it->second.port != info.port) {
+    *existing_ptr = it->second;
+    error = -EEXIST;
+  }
+  mutex_.Unlock();
+
+  return error;
+}
+
+/**
+ * @breaf 配置先の削除
+ * @param path ファイルパス
+ * @return Error値
+ */
+Error PlacementDirectory::Remove(const std::string &path) {
+  Error error = kCBBSuccess;
+
+  mutex_.Lock();
+  if (entries_.erase(path) > 0) {
+    error = Append("-\t" + path + "\n");
+  }
+  mutex_.Unlock();
+
+  return error;
+}
+
+/**
+ * @breaf 登録内容の取得
+ * @return パスと配置先サーバーの一覧 (呼び出し時点の複製)
+ */
+std::map<std::string, ServerInfo> PlacementDirectory::entries() {
+  mutex_.Lock();
+  std::map<std::string, ServerInfo> result = entries_;
+  mutex_.Unlock();
+
+  return result;
+}
+
+/**
+ * @breaf 現在の登録内容だけで保存ファイルを書き直す (mutex_ を取得して呼ぶ)
+ * @return Error値
+ */
+Error PlacementDirectory::Compact() {
+  Close();
+
+  std::string temporary = filename_ + ".tmp";
+  FILE *file = fopen(temporary.c_str(), "w");
+  if (file == NULL) {
+    return -errno;
+  }
+
+  for (std::map<std::string, ServerInfo>::iterator it = entries_.begin(); it != entries_.end(); ++it) {
+    fprintf(file, "+\t%s\t%d\t%s\n", it->second.host.c_str(), it->second.port, it->first.c_str());
+  }
+
+  if (fclose(file) != 0 || rename(temporary.c_str(), filename_.c_str()) != 0) {
+    unlink(temporary.c_str());
+    return -errno;
+  }
+  log_count_ = entries_.size();
+
+  file_ = fopen(filename_.c_str(), "a");
+  return file_ != NULL ? kCBBSuccess : -errno;
+}
+
+/**
+ * @breaf 保存ファイルへの追記 (mutex_ を取得して呼ぶ)
+ * @param line 追記する行
+ * @return Error値
+ */
+Error PlacementDirectory::Append(const std::string &line) {
+  if (++log_count_ > entries_.size() * 2 + PLACEMENT_COMPACT_MARGIN) {
+    return Compact();
+  }
+
+  if (file_ == NULL) {
+    return -EBADF;
+  }
+  if (fputs(line.c_str(), file_) < 0 || fflush(file_) != 0) {
+    return -errno;
+  }
+  return kCBBSuccess;
+}
+
+} // namespace cbb
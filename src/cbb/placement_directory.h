@@ -0,0 +1,69 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef CBB_PLACEMENT_DIRECTORY_H_
+#define CBB_PLACEMENT_DIRECTORY_H_
+
+#include <stdio.h>
+
+#include <string>
+#include <map>
+
+#include "common/common.h"
+#include "common/error.h"
+#include "util/mutex.h"
+#include "util/select_server.h"
+#include "meta_data_manager.h"
+
+// Localストレージ内の配置ディレクトリの保存ファイル (ディレクトリ一覧、エクスポートの対象外)
+#define PLACEMENT_FILE_NAME INTERNAL_NAME_PREFIX "placement"
+
+namespace cbb {
+
+// ハッシュで決まるサーバー以外に作成されたファイルの配置先を記録するクラス
+//   ハッシュで決まるサーバーが保持し、変更はファイルに追記して再起動後も復元する。
+class PlacementDirectory {
+
+ public:
+
+  PlacementDirectory() : file_(NULL), log_count_(0) {}
+  virtual ~PlacementDirectory() { Close(); }
+
+  Error Open(const std::string &filename);
+  void Close();
+
+  bool Lookup(const std::string &path, ServerInfo *info_ptr);
+  Error Set(const std::string &path, const ServerInfo &info);
+  Error Claim(const std::string &path, const ServerInfo &info, ServerInfo *existing_ptr);
+  Error Remove(const std::string &path);
+
+  size_t size() { return entries_.size(); }
+  std::map<std::string, ServerInfo> entries();
+
+ private:
+
+  Error Compact();
+  Error Append(const std::string &line);
+
+  std::string filename_;
+  FILE *file_;
+  size_t log_count_;
+  std::map<std::string, ServerInfo> entries_;
+  Mutex mutex_;
+};
+
+} // namespace cbb
+
+#endif // CBB_PLACEMENT_DIRECTORY_H_
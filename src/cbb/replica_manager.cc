@@ -0,0 +1,401 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "replica_manager.h"
+
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <sys/xattr.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/format.hpp>
+
+#include <jubatus/msgpack/rpc/client.h>
+
+#include "common/common.h"
+#include "util/io_priority.h"
+#include "meta_data_manager.h"
+
+#define REPLICA_XATTR_NAME   "user.cbb.replica"
+#define REPLICA_WINDOW       1000000    // オープン回数の計測期間 (usec)
+#define REPLICA_ENTRY_MAX    65536      // 管理情報の整理を始める件数
+#define REPLICA_FETCH_SIZE   (4 << 20)  // 複製時の読み込みサイズ
+#define REPLICA_FETCH_TIMEOUT 60        // 複製時の呼び出しタイムアウト (秒)
+#define REPLICA_INTERVAL     100        // 複製要求の確認間隔 (msec)
+
+// 読み込みの多いファイルの複製管理クラス
+namespace cbb {
+
+/**
+ * @breaf レプリカの版の読み込み
+ * @param filename ファイル名
+ * @return uint64_t 版 (ない場合は0)
+ */
+static uint64_t read_replica_version(const std::string &filename) {
+  char value[32];
+  ssize_t length = getxattr(filename.c_str(), REPLICA_XATTR_NAME, value, sizeof(value) - 1);
+  if (length <= 0) {
+    return 0;
+  }
+  value[length] = '\0';
+  return strtoull(value, NULL, 10);
+}
+
+/**
+ * @breaf 作成
+ * @param md_manager_ptr メタデータマネージャーポインタ
+ */
+void ReplicaManager::Create(MetaDataManager *md_manager_ptr) {
+  assert(md_manager_ptr != NULL);
+
+  md_manager_ptr_ = md_manager_ptr;
+  entry_mutex_.Init();
+  fetch_mutex_.Init();
+
+  Thread::Create(NULL, REPLICA_INTERVAL);
+}
+
+/**
+ * @breaf 開放
+ */
+void ReplicaManager::Release() {
+  Thread::Release();
+}
+
+/**
+ * @breaf 複製方針の設定
+ * @param replica_count オーナー以外に複製するサーバー数 (0の場合は複製しない)
+ * @param threshold 複製を始める1秒あたりの読み込みオープン回数 (0の場合は回数で判定しない)
+ * @param patterns 常に複製するパスのパターン (fnmatch形式、カンマ区切り)
+ */
+void ReplicaManager::SetPolicy(int replica_count, int threshold, const std::string &patterns) {
+  entry_mutex_.Lock();
+
+  replica_count_ = replica_count;
+  threshold_ = threshold;
+  patterns_.clear();
+
+  std::string::size_type start = 0;
+  while (start <= patterns.size()) {
+    std::string::size_type end = patterns.find(',', start);
+    if (end == std::string::npos) {
+      end = patterns.size();
+    }
+    if (end > start) {
+      patterns_.push_back(patterns.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+
+  entries_.clear();
+  entry_count_ = 0;
+
+  entry_mutex_.Unlock();
+}
+
+/**
+ * @breaf オープンの記録 (オーナーサーバー)
+ *   読み込みオープンが複製対象になった時点で新しい版を割り当て、呼び出し元に複製を依頼する。
+ *   書き込みオープンの場合は複製を無効にし、CloseWriter が呼ばれるまで複製しない。
+ * @param path ファイルパス
+ * @param is_read_only 読み込み専用かどうか
+ * @param version_ptr レプリカの版保存ポインタ (複製なしの場合は0)
+ * @param count_ptr レプリカ数保存ポインタ
+ * @return bool 呼び出し元が複製先サーバーに複製を依頼するかどうか
+ */
+bool ReplicaManager::RecordOpen(const std::string &path, bool is_read_only, uint64_t *version_ptr, int *count_ptr) {
+  *version_ptr = 0;
+  *count_ptr = 0;
+
+  // 方針 (SetPolicy で変更される) は entry_mutex_ を確保して参照する
+  entry_mutex_.Lock();
+
+  if (replica_count_ <= 0) {
+    entry_mutex_.Unlock();
+    return false;
+  }
+
+  if (!is_read_only) {
+    Entry &entry = entries_[path];
+    entry.version = 0;
+    entry.opens = 0;
+    entry.writers++;
+    entry_count_ = entries_.size();
+    entry_mutex_.Unlock();
+    return false;
+  }
+
+  bool is_policy_target = IsPolicyTarget(path);
+  if (!is_policy_target && threshold_ <= 0) {
+    entry_mutex_.Unlock();
+    return false;
+  }
+
+  uint64_t now = get_time_usec();
+  bool is_replicate = false;
+
+  PruneEntries(now);
+
+  Entry &entry = entries_[path];
+  if (entry.version == 0 && entry.writers == 0) {
+    if (now - entry.window_start >= REPLICA_WINDOW) {
+      entry.window_start = now;
+      entry.opens = 0;
+    }
+    entry.opens++;
+
+    if (is_policy_target || entry.opens >= threshold_) {
+      entry.version = std::max(now, last_version_ + 1);
+      last_version_ = entry.version;
+      is_replicate = true;
+    }
+  }
+
+  *version_ptr = entry.version;
+  *count_ptr = entry.version != 0 ? replica_count_ : 0;
+  entry_count_ = entries_.size();
+
+  entry_mutex_.Unlock();
+
+  return is_replicate;
+}
+
+/**
+ * @breaf 複製の無効化 (オーナーサーバー)
+ *   以降のオープンには新しい版を割り当てるため、古い版のレプリカは使われなくなる。
+ * @param path ファイルパス
+ */
+void ReplicaManager::Invalidate(const std::string &path) {
+  if (entry_count_ == 0) {
+    return;
+  }
+
+  entry_mutex_.Lock();
+  std::map<std::string, Entry>::iterator it = entries_.find(path);
+  if (it != entries_.end()) {
+    if (it->second.writers > 0) {
+      it->second.version = 0;
+      it->second.opens = 0;
+    } else {
+      entries_.erase(it);
+    }
+  }
+  entry_count_ = entries_.size();
+  entry_mutex_.Unlock();
+}
+
+/**
+ * @breaf 書き込みオープンの終了 (オーナーサーバー)
+ * @param path ファイルパス
+ */
+void ReplicaManager::CloseWriter(const std::string &path) {
+  if (entry_count_ == 0) {
+    return;
+  }
+
+  entry_mutex_.Lock();
+  std::map<std::string, Entry>::iterator it = entries_.find(path);
+  if (it != entries_.end() && it->second.writers > 0) {
+    if (--it->second.writers == 0 && it->second.version == 0) {
+      entries_.erase(it);
+    }
+  }
+  entry_count_ = entries_.size();
+  entry_mutex_.Unlock();
+}
+
+/**
+ * @breaf 複製要求の登録 (複製先サーバー)
+ * @param path ファイルパス
+ * @param version レプリカの版
+ * @param host オーナーサーバーのhost
+ * @param port オーナーサーバーのport
+ */
+void ReplicaManager::Fetch(const std::string &path, uint64_t version, const std::string &host, int port) {
+  FetchRequest request;
+  request.path = path;
+  request.version = version;
+  request.host = host;
+  request.port = port;
+
+  fetch_mutex_.Lock();
+  fetch_queue_.push_back(request);
+  fetch_mutex_.Unlock();
+}
+
+/**
+ * @breaf レプリカのオープン (複製先サーバー)
+ *   版が一致しない場合は開かない。古い版のレプリカはその場で削除する。
+ * @param path ファイルパス
+ * @param version レプリカの版
+ * @return Error値 (0以上の場合はファイルディスクリプタ)
+ */
+Error ReplicaManager::Open(const std::string &path, uint64_t version) {
+  std::string filename = md_manager_ptr_->replica_path(path);
+
+  uint64_t current = read_replica_version(filename);
+  if (current == 0) {
+    return -ENOENT;
+  }
+  if (current != version) {
+    if (current < version) {
+      unlink(filename.c_str());
+    }
+    return -ESTALE;
+  }
+
+  int fd = open(filename.c_str(), O_RDONLY);
+  return fd >= 0 ? fd : -errno;
+}
+
+/**
+ * @see Thread::ThreadCall
+ * @breaf 複製要求の処理
+ * @return bool 呼び出しを継続するかどうか
+ */
+bool ReplicaManager::ThreadCall(void *user_data) {
+  IoPriority::BackgroundScope background_scope(md_manager_ptr_->io_priority());
+  while (true) {
+    fetch_mutex_.Lock();
+    if (fetch_queue_.empty()) {
+      fetch_mutex_.Unlock();
+      break;
+    }
+    FetchRequest request = fetch_queue_.front();
+    fetch_queue_.pop_front();
+    fetch_mutex_.Unlock();
+
+    Error error = FetchFile(request);
+    DMSG("ReplicaManager::Fetch : %s (%lu) from %s:%d -> %d\n",
+         request.path.c_str(), request.version, request.host.c_str(), request.port, error);
+  }
+  return true;
+}
+
+/**
+ * @breaf パターンによる複製対象の判定 (entry_mutex_ を取得して呼ぶ)
+ * @param path ファイルパス
+ * @return bool 複製対象かどうか
+ */
+bool ReplicaManager::IsPolicyTarget(const std::string &path) {
+  BOOST_FOREACH(const std::string &pattern, patterns_) {
+    if (fnmatch(pattern.c_str(), path.c_str(), 0) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @breaf 取得待ちの複製の数
+ * @return 取得待ちの数
+ */
+size_t ReplicaManager::fetch_queue_depth() {
+  fetch_mutex_.Lock();
+  size_t depth = fetch_queue_.size();
+  fetch_mutex_.Unlock();
+  return depth;
+}
+
+/**
+ * @breaf 複製していない古い管理情報の整理 (entry_mutex_ を取得して呼ぶ)
+ * @param now 現在時刻 (usec)
+ */
+void ReplicaManager::PruneEntries(uint64_t now) {
+  if (entries_.size() < REPLICA_ENTRY_MAX) {
+    return;
+  }
+
+  std::map<std::string, Entry>::iterator it = entries_.begin();
+  while (it != entries_.end()) {
+    if (it->second.version == 0 && it->second.writers == 0 && now - it->second.window_start >= REPLICA_WINDOW) {
+      entries_.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+}
+
+/**
+ * @breaf オーナーサーバーからファイルを読み込んでレプリカを作成
+ *   一時ファイルに書き込んで版を設定してから置き換えるため、作成途中のレプリカは開かれない。
+ * @param request 複製要求
+ * @return Error値
+ */
+Error ReplicaManager::FetchFile(const FetchRequest &request) {
+  std::string destination = md_manager_ptr_->replica_path(request.path);
+  if (read_replica_version(destination) >= request.version) {
+    return kCBBSuccess;
+  }
+
+  std::string temporary = (boost::format("%1%.%2%.tmp") % destination % request.version).str();
+  boost::system::error_code ec;
+  boost::filesystem::create_directories(boost::filesystem::path(destination).parent_path(), ec);
+
+  int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  Error error = kCBBSuccess;
+  try {
+    msgpack::rpc::client c(request.host, request.port);
+    c.set_timeout(REPLICA_FETCH_TIMEOUT);
+
+    int remote_fd = c.call(CODE(kOpen), request.path, O_RDONLY).get<int>();
+    if (remote_fd < 0) {
+      error = remote_fd;
+    } else {
+      typedef msgpack::type::tuple<ssize_t, msgpack::type::raw_ref> Result;
+      off_t offset = 0;
+      while (error == kCBBSuccess) {
+        msgpack::rpc::auto_zone zone;
+        Result result = c.call(CODE(kRead), request.path, remote_fd, (size_t)REPLICA_FETCH_SIZE, offset).get<Result>(&zone);
+        ssize_t ssize = result.get<0>();
+        if (ssize <= 0) {
+          error = ssize;
+          break;
+        }
+        if (pwrite(fd, result.get<1>().ptr, ssize, offset) != ssize) {
+          error = -EIO;
+        }
+        offset += ssize;
+        IoPriority::Pace(ssize);
+      }
+      c.call(CODE(kRelease), request.path, remote_fd).get<Error>();
+    }
+  } catch (msgpack::rpc::rpc_error &e) {
+    error = -EIO;
+  }
+
+  close(fd);
+
+  if (error == kCBBSuccess) {
+    std::string value = (boost::format("%1%") % request.version).str();
+    if (setxattr(temporary.c_str(), REPLICA_XATTR_NAME, value.c_str(), value.size(), 0) != 0 ||
+        rename(temporary.c_str(), destination.c_str()) != 0) {
+      error = -errno;
+    }
+  }
+  if (error != kCBBSuccess) {
+    unlink(temporary.c_str());
+  }
+
+  return error;
+}
+
+} // namespace cbb
@@ -0,0 +1,99 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef CBB_REPLICA_MANAGER_H_
+#define CBB_REPLICA_MANAGER_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+
+#include "common/error.h"
+#include "util/mutex.h"
+#include "util/thread.h"
+
+namespace cbb {
+
+class MetaDataManager;
+
+// 読み込みの多いファイルを複数サーバーに複製するクラス
+//   オーナーサーバー: 読み込みオープンの頻度とパターンから複製対象を決めて版を割り当てる。
+//   複製先サーバー: オーナーサーバーからファイルを読み込み、レプリカ領域に版付きで保存する。
+class ReplicaManager : public Thread {
+
+ public:
+
+  ReplicaManager() : md_manager_ptr_(NULL), replica_count_(0), threshold_(0), entry_count_(0), last_version_(0) {}
+  virtual ~ReplicaManager() {}
+
+  void Create(MetaDataManager *md_manager_ptr);
+  void Release();
+  void SetPolicy(int replica_count, int threshold, const std::string &patterns);
+
+  bool RecordOpen(const std::string &path, bool is_read_only, uint64_t *version_ptr, int *count_ptr);
+  void Invalidate(const std::string &path);
+  void CloseWriter(const std::string &path);
+
+  void Fetch(const std::string &path, uint64_t version, const std::string &host, int port);
+  Error Open(const std::string &path, uint64_t version);
+
+  size_t fetch_queue_depth();
+
+ protected:
+  bool ThreadCall(void *user_data);
+
+ private:
+
+  /// 複製対象の管理情報 (オーナーサーバー)
+  struct Entry {
+    uint64_t version;       // レプリカの版 (0の場合は複製なし)
+    uint64_t window_start;  // オープン回数の計測開始時刻 (usec)
+    int opens;              // 計測中のオープン回数
+    int writers;            // 書き込みオープン中の数 (1以上の間は複製しない)
+    Entry() : version(0), window_start(0), opens(0), writers(0) {}
+  };
+
+  /// 複製要求 (複製先サーバー)
+  struct FetchRequest {
+    std::string path;
+    uint64_t version;
+    std::string host;
+    int port;
+  };
+
+  bool IsPolicyTarget(const std::string &path);
+  void PruneEntries(uint64_t now);
+  Error FetchFile(const FetchRequest &request);
+
+  MetaDataManager *md_manager_ptr_;
+  int replica_count_;
+  int threshold_;
+  std::vector<std::string> patterns_;
+
+  std::map<std::string, Entry> entries_;
+  volatile size_t entry_count_;
+  uint64_t last_version_;
+  Mutex entry_mutex_;
+
+  std::list<FetchRequest> fetch_queue_;
+  Mutex fetch_mutex_;
+};
+
+} // namespace cbb
+
+#endif // CBB_REPLICA_MANAGER_H_
@@ -0,0 +1,238 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "request_scheduler.h"
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+#include <algorithm>
+
+// データ転送要求の分類ごとの公平スケジューラークラス
+namespace cbb {
+
+/**
+ * @breaf constructor
+ */
+RequestScheduler::RequestScheduler() : handler_(NULL), context_(NULL) {
+  mutex_.Init();
+  sem_init(&sem_, 0, 0);
+}
+
+/**
+ * @breaf destructor
+ */
+RequestScheduler::~RequestScheduler() {
+  Stop();
+  sem_destroy(&sem_);
+}
+
+/**
+ * @breaf 処理スレッドの開始
+ * @param thread_count 処理スレッド数
+ * @param quantum 重み1あたりに1回で処理するバイト数
+ * @param bandwidth 分類ごとの帯域の既定の上限 (バイト/秒、0の場合は制限なし)
+ * @param classes 分類ごとの重み、帯域 ("名前:重み[:帯域],..."、カンマ区切り)
+ * @param handler 順番が来た要求の処理
+ * @param context 処理に渡すデータ
+ * @return bool 成否 (分類の指定が不正な場合は失敗)
+ */
+bool RequestScheduler::Start(int thread_count, size_t quantum, uint64_t bandwidth, const std::string &classes,
+                             RequestHandler handler, void *context) {
+  Stop();
+
+  uint64_t now = get_time_usec();
+  queue_.Init(quantum, bandwidth, now);
+  if (!Configure(classes, now)) {
+    return false;
+  }
+
+  handler_ = handler;
+  context_ = context;
+  for (int index = 0; index < thread_count; index++) {
+    Worker *worker = new Worker(this);
+    worker->Create(NULL);
+    workers_.push_back(worker);
+  }
+  return true;
+}
+
+/**
+ * @breaf 処理スレッドの停止 (キューに残った要求はその場で処理する)
+ */
+void RequestScheduler::Stop() {
+  for (size_t index = 0; index < workers_.size(); index++) {
+    workers_[index]->Release();
+    delete workers_[index];
+  }
+  workers_.clear();
+
+  for (;;) {
+    mutex_.Lock();
+    uint64_t wait;
+    Item *item = (Item *)queue_.Pop(get_time_usec(), &wait);
+    mutex_.Unlock();
+
+    if (item == NULL) {
+      if (wait == 0) {
+        break;
+      }
+      usleep(std::min<uint64_t>(wait, REQUEST_SCHEDULER_WAIT * 1000));
+      continue;
+    }
+    sem_trywait(&sem_);
+    handler_(context_, item->req, item->queued_time);
+    delete item;
+  }
+}
+
+/**
+ * @breaf 分類の登録
+ * @param name 分類名 (ジョブID)
+ * @return 分類番号 (分類なしの場合は0)
+ */
+int RequestScheduler::Register(const std::string &name) {
+  mutex_.Lock();
+  int class_id = queue_.Register(name, get_time_usec());
+  mutex_.Unlock();
+  return class_id;
+}
+
+/**
+ * @breaf 要求の登録
+ * @param req MsgPackリクエストオブジェクト
+ * @param class_id 分類番号
+ * @param cost 要求のコスト (転送バイト数)
+ */
+void RequestScheduler::Submit(msgpack::rpc::request req, int class_id, size_t cost) {
+  uint64_t now = get_time_usec();
+  Item *item = new Item(req, now);
+
+  mutex_.Lock();
+  queue_.Push(class_id, item, cost, now);
+  mutex_.Unlock();
+
+  sem_post(&sem_);
+}
+
+/**
+ * @breaf キューを通さない要求の帯域の制限 (分類の帯域の上限に達している間は待つ)
+ * @param class_id 分類番号
+ * @param cost 要求のコスト (転送バイト数)
+ */
+void RequestScheduler::Throttle(int class_id, size_t cost) {
+  if (!is_enabled()) {
+    return;
+  }
+
+  for (;;) {
+    mutex_.Lock();
+    uint64_t wait = queue_.Charge(class_id, cost, get_time_usec());
+    mutex_.Unlock();
+    if (wait == 0) {
+      break;
+    }
+    usleep(std::min<uint64_t>(wait, REQUEST_SCHEDULER_WAIT * 1000));
+  }
+}
+
+/**
+ * @breaf 分類ごとの統計情報の取得
+ * @param stats_ptr 統計情報保存ポインタ
+ */
+void RequestScheduler::Snapshot(std::vector<QosClassStats> *stats_ptr) {
+  mutex_.Lock();
+  queue_.Snapshot(stats_ptr);
+  mutex_.Unlock();
+}
+
+/**
+ * @breaf 1要求の処理 (処理スレッド)
+ * @return bool 呼び出しを継続するかどうか
+ */
+bool RequestScheduler::Serve() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_nsec += (long)REQUEST_SCHEDULER_WAIT * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  if (sem_timedwait(&sem_, &ts) != 0) {
+    return true;
+  }
+
+  mutex_.Lock();
+  uint64_t wait;
+  Item *item = (Item *)queue_.Pop(get_time_usec(), &wait);
+  mutex_.Unlock();
+
+  if (item == NULL) {
+    // すべての分類が帯域の上限に達している場合は、要求数を戻して待つ
+    sem_post(&sem_);
+    usleep(std::min<uint64_t>(std::max<uint64_t>(wait, 1), REQUEST_SCHEDULER_WAIT * 1000));
+    return true;
+  }
+
+  handler_(context_, item->req, item->queued_time);
+  delete item;
+  return true;
+}
+
+/**
+ * @breaf 分類ごとの重み、帯域の設定
+ * @param classes 分類ごとの重み、帯域 ("名前:重み[:帯域],..."、カンマ区切り)
+ * @param now_usec 現在時刻 (usec)
+ * @return bool 成否
+ */
+bool RequestScheduler::Configure(const std::string &classes, uint64_t now_usec) {
+  std::string::size_type start = 0;
+  while (start <= classes.size()) {
+    std::string::size_type end = classes.find(',', start);
+    if (end == std::string::npos) {
+      end = classes.size();
+    }
+    if (end > start) {
+      std::string entry = classes.substr(start, end - start);
+      std::string::size_type colon = entry.find(':');
+      if (colon == 0 || colon == std::string::npos) {
+        return false;
+      }
+
+      char *tail;
+      const char *weight_str = entry.c_str() + colon + 1;
+      long weight = strtol(weight_str, &tail, 10);
+      if (tail == weight_str || weight <= 0 || (*tail != '\0' && *tail != ':')) {
+        return false;
+      }
+      uint64_t bandwidth = 0;
+      if (*tail == ':') {
+        const char *bandwidth_str = tail + 1;
+        bandwidth = strtoull(bandwidth_str, &tail, 10);
+        if (tail == bandwidth_str || *tail != '\0') {
+          return false;
+        }
+      }
+      queue_.Configure(entry.substr(0, colon), weight, bandwidth, now_usec);
+    }
+    start = end + 1;
+  }
+  return true;
+}
+
+} // namespace cbb
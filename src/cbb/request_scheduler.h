@@ -0,0 +1,94 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef CBB_REQUEST_SCHEDULER_H_
+#define CBB_REQUEST_SCHEDULER_H_
+
+#include <semaphore.h>
+
+#include <string>
+#include <vector>
+
+#include <jubatus/msgpack/rpc/server.h>
+
+#include "common/common.h"
+#include "util/fair_queue.h"
+#include "util/mutex.h"
+#include "util/thread.h"
+
+#define REQUEST_SCHEDULER_WAIT 100           // 要求を待つ時間の上限 (msec、停止要求の確認間隔)
+#define REQUEST_SCHEDULER_DEFAULT_COST 4096  // サイズを持たない要求 (同期、ファイル単位のコピー) のコスト
+
+namespace cbb {
+
+/// 順番が来た要求の処理 (処理スレッドから呼ばれる、queued_time はキューに入れた時刻 (usec))
+typedef void (*RequestHandler)(void *context, msgpack::rpc::request req, uint64_t queued_time);
+
+// データ転送要求の分類ごとの公平スケジューラークラス
+//   要求は分類 (ジョブ) ごとのキューに入れ、処理スレッドが FairQueue の順に取り出して処理する。
+//   メタデータ操作はキューに入れず、受信スレッドでそのまま処理する。
+class RequestScheduler {
+
+ public:
+
+  RequestScheduler();
+  virtual ~RequestScheduler();
+
+  bool Start(int thread_count, size_t quantum, uint64_t bandwidth, const std::string &classes,
+             RequestHandler handler, void *context);
+  void Stop();
+  bool is_enabled() const { return !workers_.empty(); }
+
+  int Register(const std::string &name);
+  void Submit(msgpack::rpc::request req, int class_id, size_t cost);
+  void Throttle(int class_id, size_t cost);
+  void Snapshot(std::vector<QosClassStats> *stats_ptr);
+
+ private:
+
+  // 処理スレッド
+  class Worker : public Thread {
+   public:
+    Worker(RequestScheduler *scheduler) : scheduler_(scheduler) {}
+    virtual ~Worker() {}
+
+   protected:
+    bool ThreadCall(void *user_data) { return scheduler_->Serve(); }
+
+   private:
+    RequestScheduler *scheduler_;
+  };
+
+  /// 処理待ちの要求
+  struct Item {
+    msgpack::rpc::request req;
+    uint64_t queued_time;
+    Item(msgpack::rpc::request r, uint64_t time) : req(r), queued_time(time) {}
+  };
+
+  bool Serve();
+  bool Configure(const std::string &classes, uint64_t now_usec);
+
+  FairQueue queue_;
+  Mutex mutex_;
+  sem_t sem_;                      // キューの要求数
+  std::vector<Worker *> workers_;
+  RequestHandler handler_;
+  void *context_;
+};
+
+} // namespace cbb
+
+#endif // CBB_REQUEST_SCHEDULER_H_
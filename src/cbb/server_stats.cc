@@ -0,0 +1,287 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "server_stats.h"
+
+#include <string.h>
+
+// サーバー側のRPC統計情報クラス
+namespace cbb {
+
+static __thread StatsScope *tls_current_scope = NULL;
+
+static const char *g_method_names[kMsgPackCodeMax] = {
+  CODE(kNone),
+  CODE(kGetAttr),
+  CODE(kReadLink),
+  CODE(kMkDir),
+  CODE(kUnlink),
+  CODE(kRmDir),
+  CODE(kSymlink),
+  CODE(kRename),
+  CODE(kLink),
+  CODE(kChmod),
+  CODE(kChown),
+  CODE(kTruncate),
+  CODE(kOpen),
+  CODE(kRead),
+  CODE(kWrite),
+  CODE(kStatFs),
+  CODE(kFlush),
+  CODE(kRelease),
+  CODE(kFSync),
+  CODE(kSetXAttr),
+  CODE(kGetXAttr),
+  CODE(kListXAttr),
+  CODE(kRemoveXAttr),
+  CODE(kReadDir),
+  CODE(kFSyncDir),
+  CODE(kAccess),
+  CODE(kCreate),
+  CODE(kFTruncate),
+  CODE(kFGetAttr),
+  CODE(kLock),
+  CODE(kUtimens),
+  CODE(kFilePrevRead),
+  CODE(kFileFlush),
+  CODE(kLocalFileExport),
+  CODE(kStats),
+  CODE(kLogLevel),
+  CODE(kShmAttach),
+  CODE(kStripeOpen),
+  CODE(kGetStripe),
+  CODE(kReplicaOpen),
+  CODE(kReplicate),
+  CODE(kLoad),
+  CODE(kPlacement),
+  CODE(kPlacementLookup),
+  CODE(kMembership),
+  CODE(kSetMembership),
+  CODE(kMigrateList),
+  CODE(kMigrateRead),
+  CODE(kMigrateRelease),
+  CODE(kForward),
+  CODE(kHello),
+  CODE(kCompression),
+  CODE(kQosClass),
+};
+
+/**
+ * @breaf ヒストグラムを要約する
+ * @param histogram ヒストグラム
+ * @param summary_ptr 要約保存ポインタ
+ */
+static void Summarize(const Histogram &histogram, LatencySummary *summary_ptr) {
+  summary_ptr->count = histogram.count();
+  summary_ptr->sum = histogram.sum();
+  summary_ptr->max = histogram.max();
+  summary_ptr->p50 = histogram.Percentile(50.0);
+  summary_ptr->p90 = histogram.Percentile(90.0);
+  summary_ptr->p99 = histogram.Percentile(99.0);
+  summary_ptr->p999 = histogram.Percentile(99.9);
+}
+
+/**
+ * @breaf 統計情報をクリアする (キュー長は現在値のため対象外)
+ */
+void ServerStats::Reset() {
+  for (int code = 0; code < kMsgPackCodeMax; code++) {
+    Counters &counters = counters_[code];
+    counters.ops = 0;
+    counters.errors = 0;
+    counters.bytes_in = 0;
+    counters.bytes_out = 0;
+    for (int phase = 0; phase < kPhaseMax; phase++) {
+      counters.latency[phase].Reset();
+    }
+  }
+  start_time_ = get_time_msec();
+}
+
+/**
+ * @breaf 統計情報を取得する
+ * @param info_ptr 統計情報保存ポインタ
+ */
+void ServerStats::Snapshot(ServerStatsInfo *info_ptr) {
+  info_ptr->uptime_msec = get_time_msec() - start_time_;
+  info_ptr->export_queue_depth = export_queue_depth_;
+  info_ptr->prefetch_queue_depth = prefetch_queue_depth_ > 0 ? prefetch_queue_depth_: 0;
+  info_ptr->methods.clear();
+
+  for (int code = kGetAttr; code < kMsgPackCodeMax; code++) {
+    Counters &counters = counters_[code];
+    if (counters.ops == 0) {
+      continue;
+    }
+
+    MethodStats method;
+    method.name = method_name(code);
+    method.ops = counters.ops;
+    method.errors = counters.errors;
+    method.bytes_in = counters.bytes_in;
+    method.bytes_out = counters.bytes_out;
+    Summarize(counters.latency[kPhaseTotal], &method.total);
+    Summarize(counters.latency[kPhaseQueue], &method.queue);
+    Summarize(counters.latency[kPhaseSyscall], &method.syscall);
+    Summarize(counters.latency[kPhaseCopy], &method.copy);
+
+    info_ptr->methods.push_back(method);
+  }
+}
+
+/**
+ * @breaf 1リクエスト分の計測結果を記録する
+ * @param code メソッドコード
+ * @param phases 区間ごとの時間 (usec)
+ * @param is_error エラーかどうか
+ * @param bytes_in 受信データサイズ
+ * @param bytes_out 送信データサイズ
+ */
+void ServerStats::Record(int code, const uint64_t phases[kPhaseMax], bool is_error, uint64_t bytes_in, uint64_t bytes_out) {
+  if (code <= kNone || code >= kMsgPackCodeMax) {
+    return;
+  }
+
+  Counters &counters = counters_[code];
+  __sync_fetch_and_add(&counters.ops, 1);
+  if (is_error) {
+    __sync_fetch_and_add(&counters.errors, 1);
+  }
+  if (bytes_in > 0) {
+    __sync_fetch_and_add(&counters.bytes_in, bytes_in);
+  }
+  if (bytes_out > 0) {
+    __sync_fetch_and_add(&counters.bytes_out, bytes_out);
+  }
+
+  for (int phase = 0; phase < kPhaseMax; phase++) {
+    counters.latency[phase].Record(phases[phase]);
+  }
+}
+
+/**
+ * @breaf メソッド名を取得する
+ * @param code メソッドコード
+ * @return メソッド名
+ */
+const char *ServerStats::method_name(int code) {
+  if (code < 0 || code >= kMsgPackCodeMax) {
+    return "";
+  }
+  return g_method_names[code];
+}
+
+
+
+/**
+ * @breaf constractor
+ * @param stats 記録先の統計情報
+ * @param queued_time キューに入れた時刻 (usec、0の場合はキューを通していない)
+ */
+StatsScope::StatsScope(ServerStats *stats, uint64_t queued_time)
+    : stats_(stats), prev_(tls_current_scope), code_(kNone), is_error_(false),
+      queued_time_(0), start_time_(get_time_usec()), bytes_in_(0), bytes_out_(0) {
+  memset(phases_, 0x00, sizeof(phases_));
+  tls_current_scope = this;
+
+  // キューで待った時間も処理時間に含める
+  queued_time_ = (queued_time != 0 && queued_time < start_time_) ? queued_time: start_time_;
+}
+
+/**
+ * @breaf destructor (統計情報へ記録する)
+ */
+StatsScope::~StatsScope() {
+  tls_current_scope = prev_;
+
+  if (code_ != kNone) {
+    phases_[kPhaseTotal] = get_time_usec() - queued_time_;
+    stats_->Record(code_, phases_, is_error_, bytes_in_, bytes_out_);
+  }
+}
+
+/**
+ * @breaf 処理するメソッドを確定する
+ *   転送に失敗して本来のメソッドを選び直す場合は、待ち時間は最初に確定した時点までのままにする。
+ * @param code メソッドコード
+ * @return 常にtrue (dispatchの条件式で使用するため)
+ */
+bool StatsScope::Select(int code) {
+  if (code_ == kNone) {
+    // キューで待った時間と、dispatchの開始からメソッドを確定するまでの時間
+    phases_[kPhaseQueue] = (start_time_ - queued_time_) + (get_time_usec() - start_time_);
+  }
+  code_ = code;
+  return true;
+}
+
+/**
+ * @breaf 計測を完了時に記録するように引き継ぐ (このStatsScopeでは記録しない)
+ * @param deferred_ptr 引き継ぎ先
+ */
+void StatsScope::Defer(StatsDeferred *deferred_ptr) {
+  deferred_ptr->stats_ = stats_;
+  deferred_ptr->code_ = code_;
+  deferred_ptr->is_error_ = is_error_;
+  deferred_ptr->start_time_ = queued_time_;
+  deferred_ptr->submit_time_ = get_time_usec();
+  deferred_ptr->bytes_in_ = bytes_in_;
+  deferred_ptr->bytes_out_ = bytes_out_;
+  memcpy(deferred_ptr->phases_, phases_, sizeof(phases_));
+  code_ = kNone;
+}
+
+/**
+ * @breaf 引き継ぎの取り消し (要求を投入できずに同期で処理する場合)
+ * @param deferred Defer で引き継いだ計測
+ */
+void StatsScope::Resume(const StatsDeferred &deferred) {
+  code_ = deferred.code_;
+}
+
+/**
+ * @breaf 現在のスレッドで処理中のStatsScopeを取得する
+ * @return StatsScopeポインタ (処理中でない場合はNULL)
+ */
+StatsScope *StatsScope::current() {
+  return tls_current_scope;
+}
+
+/**
+ * @breaf constractor
+ */
+StatsDeferred::StatsDeferred()
+    : stats_(NULL), code_(kNone), is_error_(false), start_time_(0), submit_time_(0), bytes_in_(0), bytes_out_(0) {
+  memset(phases_, 0x00, sizeof(phases_));
+}
+
+/**
+ * @breaf 完了時の記録 (投入から完了までをシステムコールの区間に加える)
+ * @param is_error エラーかどうか
+ * @param bytes_in 受信データサイズ
+ * @param bytes_out 送信データサイズ
+ */
+void StatsDeferred::Finish(bool is_error, uint64_t bytes_in, uint64_t bytes_out) {
+  if (stats_ == NULL || code_ == kNone) {
+    return;
+  }
+
+  uint64_t now = get_time_usec();
+  phases_[kPhaseSyscall] += now - submit_time_;
+  phases_[kPhaseTotal] = now - start_time_;
+  stats_->Record(code_, phases_, is_error_ || is_error, bytes_in_ + bytes_in, bytes_out_ + bytes_out);
+}
+
+} // namespace cbb
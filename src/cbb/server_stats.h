@@ -0,0 +1,156 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef CBB_SERVER_STATS_H_
+#define CBB_SERVER_STATS_H_
+
+#include <stdint.h>
+#include <string>
+
+#include "common/common.h"
+#include "util/histogram.h"
+
+namespace cbb {
+
+/// 計測区間
+enum StatsPhase {
+  kPhaseTotal = 0,  // dispatch全体
+  kPhaseQueue,      // 処理開始までの待ち (メソッド判定、共有ロック待ち)
+  kPhaseSyscall,    // ファイル操作のシステムコール
+  kPhaseCopy,       // Local/Secondary間のファイルコピー
+  kPhaseMax,
+};
+
+// サーバー側のRPC統計情報クラス
+class ServerStats {
+
+ public:
+
+  ServerStats() : export_queue_depth_(0), prefetch_queue_depth_(0), inflight_bytes_(0) { Reset(); }
+  virtual ~ServerStats() {}
+
+  void Reset();
+  void Snapshot(ServerStatsInfo *info_ptr);
+
+  void Record(int code, const uint64_t phases[kPhaseMax], bool is_error, uint64_t bytes_in, uint64_t bytes_out);
+
+  void AddPrefetch(int count) { __sync_fetch_and_add(&prefetch_queue_depth_, count); }
+  void AddInflight(int64_t bytes) { __sync_fetch_and_add(&inflight_bytes_, bytes); }
+  uint64_t inflight_bytes() const { return inflight_bytes_ > 0 ? inflight_bytes_: 0; }
+  void set_export_queue_depth(uint64_t depth) { export_queue_depth_ = depth; }
+
+  static const char *method_name(int code);
+
+ private:
+
+  struct Counters {
+    uint64_t ops;
+    uint64_t errors;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    Histogram latency[kPhaseMax];
+  };
+
+  Counters counters_[kMsgPackCodeMax];
+  uint64_t start_time_;
+  uint64_t export_queue_depth_;
+  int64_t prefetch_queue_depth_;
+  int64_t inflight_bytes_;
+};
+
+class StatsDeferred;
+
+// 1リクエスト分の計測を行うクラス
+//
+// dispatch内でスタック上に生成し、処理中はスレッドローカルに登録される。
+// MetaDataManager等からはStatsTimerで区間時間を加算する。
+class StatsScope {
+
+ public:
+
+  StatsScope(ServerStats *stats, uint64_t queued_time = 0);
+  ~StatsScope();
+
+  bool Select(int code);
+
+  void set_error() { is_error_ = true; }
+  void AddBytesIn(uint64_t size) { bytes_in_ += size; }
+  void AddBytesOut(uint64_t size) { bytes_out_ += size; }
+  void AddPhase(StatsPhase phase, uint64_t usec) { phases_[phase] += usec; }
+  int code() const { return code_; }
+
+  void Defer(StatsDeferred *deferred_ptr);
+  void Resume(const StatsDeferred &deferred);
+
+  static StatsScope *current();
+
+ private:
+
+  ServerStats *stats_;
+  StatsScope *prev_;
+  int code_;
+  bool is_error_;
+  uint64_t queued_time_;  // キューに入れた時刻 (処理全体の時間の起点、キューを通していない場合は start_time_)
+  uint64_t start_time_;   // dispatchの開始時刻
+  uint64_t bytes_in_;
+  uint64_t bytes_out_;
+  uint64_t phases_[kPhaseMax];
+};
+
+// 完了を待たずにdispatchを抜ける要求 (io_uring) の計測を完了時に記録するクラス
+//   StatsScope::Defer で計測中の値を引き継ぎ、Finish で完了までの時間を加えて記録する。
+class StatsDeferred {
+
+ public:
+
+  StatsDeferred();
+
+  void Finish(bool is_error, uint64_t bytes_in, uint64_t bytes_out);
+
+ private:
+
+  friend class StatsScope;
+
+  ServerStats *stats_;
+  int code_;
+  bool is_error_;
+  uint64_t start_time_;
+  uint64_t submit_time_;
+  uint64_t bytes_in_;
+  uint64_t bytes_out_;
+  uint64_t phases_[kPhaseMax];
+};
+
+// 区間時間を現在のStatsScopeに加算するクラス
+class StatsTimer {
+
+ public:
+
+  StatsTimer(StatsPhase phase) : phase_(phase), start_time_(get_time_usec()) {}
+  ~StatsTimer() {
+    StatsScope *scope = StatsScope::current();
+    if (scope != NULL) {
+      scope->AddPhase(phase_, get_time_usec() - start_time_);
+    }
+  }
+
+ private:
+  StatsPhase phase_;
+  uint64_t start_time_;
+};
+
+} // namespace cbb
+
+#endif // CBB_SERVER_STATS_H_
@@ -0,0 +1,121 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "shm_server.h"
+
+#include <signal.h>
+
+#include "util/io_priority.h"
+#include "burst_buffer.h"
+
+#define SHM_WAIT_TIME      100   // 要求待ちのタイムアウト (msec)
+#define SHM_ATTACH_TIMEOUT 10000 // クライアント接続待ちの上限 (msec)
+
+// 共有メモリ要求処理スレッドクラス
+namespace cbb {
+
+/**
+ * @breaf destructor
+ */
+ShmServer::~ShmServer() {
+  Release();
+  channel_.Close();
+}
+
+/**
+ * @breaf 共有メモリを作成して処理スレッドを開始
+ * @param name 共有メモリ名
+ * @param nonce 同一ホスト確認用の乱数
+ * @param arena_size データ領域サイズ
+ * @return Error値
+ */
+Error ShmServer::Open(const std::string &name, uint64_t nonce, uint64_t arena_size) {
+  Error error = channel_.Create(name, nonce, arena_size);
+  if (error != kCBBSuccess) {
+    return error;
+  }
+
+  open_time_ = get_time_msec();
+  Create(NULL, 0);
+  return kCBBSuccess;
+}
+
+/**
+ * @see Thread::ThreadCall
+ * @breaf 共有メモリ要求の処理
+ * @return bool 呼び出しを継続するかどうか
+ */
+bool ShmServer::ThreadCall(void *user_data) {
+  if (!channel_.WaitRequest(SHM_WAIT_TIME)) {
+    // 要求がない間にクライアントの終了を確認する
+    if (!IsClientAlive()) {
+      DMSG("ShmServer : close %s\n", channel_.name().c_str());
+      channel_.Close();
+      is_closed_ = true;
+      return false;
+    }
+    return true;
+  }
+
+  ShmRequest request;
+  while (channel_.PopRequest(&request)) {
+    Process(request);
+  }
+  return true;
+}
+
+/**
+ * @breaf 1要求の処理
+ * @param request 要求
+ */
+void ShmServer::Process(const ShmRequest &request) {
+  StatsScope stats_scope(stats_);
+  IoPriority::ForegroundScope foreground_scope(bb_->io_priority());
+  ShmResponse response;
+  response.tag = request.tag;
+  response.result = -EINVAL;
+
+  if (request.data_offset + request.size > channel_.header()->arena_size) {
+    stats_scope.set_error();
+  } else if (request.op == kShmRead && stats_scope.Select(kRead)) {
+    bb_->Throttle(class_id_, request.size);
+    response.result = bb_->ReadData("", request.fd, channel_.data(request.data_offset), request.size, request.offset);
+  } else if (request.op == kShmWrite && stats_scope.Select(kWrite)) {
+    bb_->Throttle(class_id_, request.size);
+    response.result = bb_->WriteData("", request.fd, channel_.data(request.data_offset), request.size, request.offset);
+  }
+
+  if (response.result < 0) {
+    stats_scope.set_error();
+  }
+
+  // 要求数はリング容量以下なので応答リングが満杯になることはない
+  channel_.PushResponse(response);
+}
+
+/**
+ * @breaf クライアントが生存しているかどうか
+ * @return bool 生存しているかどうか
+ */
+bool ShmServer::IsClientAlive() {
+  pid_t client_pid = channel_.header()->client_pid;
+  if (client_pid == 0) {
+    // 別ホストのクライアントなど、接続されないまま放置されたもの
+    return get_time_msec() - open_time_ < SHM_ATTACH_TIMEOUT;
+  }
+  return kill(client_pid, 0) == 0 || errno != ESRCH;
+}
+
+} // namespace cbb
@@ -0,0 +1,63 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef CBB_SHM_SERVER_H_
+#define CBB_SHM_SERVER_H_
+
+#include <string>
+
+#include "common/error.h"
+#include "common/common.h"
+#include "util/thread.h"
+#include "util/shm_channel.h"
+#include "server_stats.h"
+
+namespace cbb {
+
+class BurstBuffer;
+
+// 同一ホストのクライアント1つ分の共有メモリ要求を処理するスレッドクラス
+//   読み書きは BurstBuffer の読み書き処理 (RPCと共通) で行い、クライアントのQoS分類の帯域を守る。
+class ShmServer : public Thread {
+
+ public:
+
+  ShmServer(BurstBuffer *bb, ServerStats *stats, int class_id)
+    : bb_(bb), stats_(stats), class_id_(class_id), open_time_(0), is_closed_(false) {}
+  virtual ~ShmServer();
+
+  Error Open(const std::string &name, uint64_t nonce, uint64_t arena_size);
+
+  bool is_closed() const { return is_closed_; }
+
+ protected:
+  bool ThreadCall(void *user_data);
+
+ private:
+
+  void Process(const ShmRequest &request);
+  bool IsClientAlive();
+
+  ShmChannel channel_;
+  BurstBuffer *bb_;
+  ServerStats *stats_;
+  int class_id_;  // クライアントのQoS分類 (0の場合は分類なし)
+  uint64_t open_time_;
+  volatile bool is_closed_;
+};
+
+} // namespace cbb
+
+#endif // CBB_SHM_SERVER_H_
@@ -15,11 +15,11 @@
 //
 #include <iostream>
 #include <string>
-#include <map>
 
 #include <fuse.h>
 
 #include "cbb/burst_buffer_client.h"
+#include "cbb/file_table.h"
 #include "cbb_client_wrapper.h"
 
 // CBFSで処理を行うFUSEのラッパー関数
@@ -27,8 +27,8 @@
 static std::string g_config_path;
 static cbb::BurstBufferClient *g_client_ptr;
 
-typedef std::map<uint64_t, cbb::File> FileTable;
-static FileTable g_files;
+// 開いているファイル (fi->fh はテーブルのハンドル、read/write はロックなしで参照する)
+static cbb::FileTable g_files;
 
 /**
  * @breaf FUSEエラーチェック関数
@@ -137,17 +137,27 @@ int CBFSOpen(const char *path, struct fuse_file_info *fi) {
   if (error != cbb::kCBBSuccess)
     return cbb_to_fuse_error(error);
 
-  fi->fh = file.fd;
-  g_files[fi->fh] = file;
+  uint64_t fh = g_files.Insert(file);
+  if (fh == 0) {
+    g_client_ptr->Release(file);
+    return -EMFILE;
+  }
+
+  // 前回のオープンから変わっていないファイルはカーネルのページキャッシュから読む
+  fi->keep_cache = file.keep_cache ? 1 : 0;
+  fi->fh = fh;
 
   return 0;
 }
 
 /// FUSE wrapper : read
 int CBFSRead(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-  cbb::File file = g_files[fi->fh];
+  const cbb::File *file = g_files.Lookup(fi->fh);
+  if (file == NULL)
+    return -EBADF;
+
   ssize_t ssize = 0;
-  cbb::Error error = g_client_ptr->Read(file, buf, size, offset, &ssize);
+  cbb::Error error = g_client_ptr->Read(*file, buf, size, offset, &ssize);
   if (error != cbb::kCBBSuccess)
     return cbb_to_fuse_error(error);
 
@@ -156,9 +166,12 @@ int CBFSRead(const char *path, char *buf, size_t size, off_t offset, struct fuse
 
 /// FUSE wrapper : write
 int CBFSWrite(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-  cbb::File file = g_files[fi->fh];
+  const cbb::File *file = g_files.Lookup(fi->fh);
+  if (file == NULL)
+    return -EBADF;
+
   ssize_t ssize = 0;
-  cbb::Error error = g_client_ptr->Write(file, buf, size, offset, &ssize);
+  cbb::Error error = g_client_ptr->Write(*file, buf, size, offset, &ssize);
   if (error != cbb::kCBBSuccess)
     return cbb_to_fuse_error(error);
 
@@ -172,20 +185,31 @@ int CBFSStatFs(const char *path, struct statvfs *buf) {
 
 /// FUSE wrapper : flush
 int CBFSFlush(const char *path, struct fuse_file_info *fi) {
-  cbb::File file = g_files[fi->fh];
-  return cbb_to_fuse_error(g_client_ptr->Flush(file));
+  const cbb::File *file = g_files.Lookup(fi->fh);
+  if (file == NULL)
+    return -EBADF;
+
+  return cbb_to_fuse_error(g_client_ptr->Flush(*file));
 }
 
 /// FUSE wrapper : release
 int CBFSRelease(const char *path, struct fuse_file_info *fi) {
-  cbb::File file = g_files[fi->fh];
-  return cbb_to_fuse_error(g_client_ptr->Release(file));
+  const cbb::File *file = g_files.Lookup(fi->fh);
+  if (file == NULL)
+    return -EBADF;
+
+  cbb::Error error = g_client_ptr->Release(*file);
+  g_files.Remove(fi->fh);
+  return cbb_to_fuse_error(error);
 }
 
 /// FUSE wrapper : fsync
 int CBFSFSync(const char *path, int datasync, struct fuse_file_info *fi) {
-  cbb::File file = g_files[fi->fh];
-  return cbb_to_fuse_error(g_client_ptr->FSync(file, datasync));
+  const cbb::File *file = g_files.Lookup(fi->fh);
+  if (file == NULL)
+    return -EBADF;
+
+  return cbb_to_fuse_error(g_client_ptr->FSync(*file, datasync));
 }
 
 
@@ -238,8 +262,9 @@ int CBFSReadDir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 
 /// FUSE wrapper : fsyncdir
 int CBFSFSyncDir(const char *path, int datasync, struct fuse_file_info *fi) {
-  cbb::File file = g_files[fi->fh];
-  return cbb_to_fuse_error(g_client_ptr->FSyncDir(path, datasync, file));
+  // opendir を実装していないため、通常は開いているファイルがない
+  const cbb::File *file = g_files.Lookup(fi->fh);
+  return cbb_to_fuse_error(g_client_ptr->FSyncDir(path, datasync, file != NULL ? *file : cbb::File()));
 }
 
 
@@ -271,23 +296,33 @@ int CBFSCreate(const char *path, mode_t mode, struct fuse_file_info *fi) {
   if (error != cbb::kCBBSuccess)
     return cbb_to_fuse_error(error);
 
-  fi->fh = file.fd;
-  g_files[fi->fh] = file;
+  uint64_t fh = g_files.Insert(file);
+  if (fh == 0) {
+    g_client_ptr->Release(file);
+    return -EMFILE;
+  }
+  fi->fh = fh;
 
   return 0;
 }
 
 /// FUSE wrapper : ftruncate
 int CBFSFTruncate(const char *path, off_t size, struct fuse_file_info *fi) {
-  cbb::File file = g_files[fi->fh];
-  return cbb_to_fuse_error(g_client_ptr->FTruncate(file, size));
+  const cbb::File *file = g_files.Lookup(fi->fh);
+  if (file == NULL)
+    return -EBADF;
+
+  return cbb_to_fuse_error(g_client_ptr->FTruncate(*file, size));
 }
 
 /// FUSE wrapper : fgetattr
 int CBFSFGetAttr(const char *path, struct stat *statbuf, struct fuse_file_info *fi) {
   cbb::FileStat file_stat;
-  cbb::File file = g_files[fi->fh];
-  cbb::Error error = g_client_ptr->FGetAttr(path, &file_stat, file);
+  const cbb::File *file = g_files.Lookup(fi->fh);
+  if (file == NULL)
+    return -EBADF;
+
+  cbb::Error error = g_client_ptr->FGetAttr(path, &file_stat, *file);
   if (error != cbb::kCBBSuccess)
     return cbb_to_fuse_error(error);
 
@@ -296,8 +331,11 @@ int CBFSFGetAttr(const char *path, struct stat *statbuf, struct fuse_file_info *
 
 /// FUSE wrapper : lock
 int CBFSLock(const char *path, struct fuse_file_info *fi, int cmd, struct flock *lockbuf) {
-  cbb::File file = g_files[fi->fh];
-  cbb::Error error = g_client_ptr->Lock(path, file, cmd, lockbuf);
+  const cbb::File *file = g_files.Lookup(fi->fh);
+  if (file == NULL)
+    return -EBADF;
+
+  cbb::Error error = g_client_ptr->Lock(path, *file, cmd, lockbuf);
   if (error != cbb::kCBBSuccess)
     return cbb_to_fuse_error(error);
 
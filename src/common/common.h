@@ -20,19 +20,22 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/statvfs.h>
 
 #include <string>
+#include <vector>
 
 #include <msgpack.hpp>
 #include <boost/filesystem/fstream.hpp>
 
+#include "util/logger.h"
+
 #ifndef CBB_CONFIG
   #define CBB_CONFIG "/etc/cbb.conf"
 #endif
 
-#define OUTPUT_PRINTF_DEBUG
 #define OUTPUT_PRINTF_TEST
 
 #define VIRTUAL_SYMLINK_EXT   ".870A7545-5F58-453A-A685-1C9A3A17272C_symlink"
@@ -81,6 +84,59 @@ struct FileStat {
                  st_ctim);
 };
 
+/// v2プロトコルのファイル属性 (時刻をナノ秒の整数にまとめ、クライアントが使わない st_dev, st_rdev を省く)
+struct CompactFileStat {
+  uint64_t ino;
+  uint32_t mode;
+  uint32_t nlink;
+  uint32_t uid;
+  uint32_t gid;
+  int64_t size;
+  int64_t blocks;
+  uint32_t blksize;
+  int64_t atime;
+  int64_t mtime;
+  int64_t ctime;
+
+  CompactFileStat() : ino(0), mode(0), nlink(0), uid(0), gid(0), size(0), blocks(0), blksize(0),
+                      atime(0), mtime(0), ctime(0) {}
+
+  explicit CompactFileStat(const FileStat &stat)
+      : ino(stat.st_ino), mode(stat.st_mode), nlink(stat.st_nlink), uid(stat.st_uid), gid(stat.st_gid),
+        size(stat.st_size), blocks(stat.st_blocks), blksize(stat.st_blksize),
+        atime(to_nsec(stat.st_atim)), mtime(to_nsec(stat.st_mtim)), ctime(to_nsec(stat.st_ctim)) {}
+
+  void ToFileStat(FileStat *stat_ptr) const {
+    FileStat stat = FileStat();
+    stat.st_ino = ino;
+    stat.st_mode = mode;
+    stat.st_nlink = nlink;
+    stat.st_uid = uid;
+    stat.st_gid = gid;
+    stat.st_size = size;
+    stat.st_blocks = blocks;
+    stat.st_blksize = blksize;
+    stat.st_atim = from_nsec(atime);
+    stat.st_mtim = from_nsec(mtime);
+    stat.st_ctim = from_nsec(ctime);
+    *stat_ptr = stat;
+  }
+
+  static int64_t to_nsec(const TimeSpec &time) { return (int64_t)time.tv_sec * 1000000000LL + time.tv_nsec; }
+  static TimeSpec from_nsec(int64_t nsec) {
+    TimeSpec time;
+    time.tv_sec = nsec / 1000000000LL;
+    time.tv_nsec = nsec % 1000000000LL;
+    if (time.tv_nsec < 0) {
+      time.tv_sec--;
+      time.tv_nsec += 1000000000LL;
+    }
+    return time;
+  }
+
+  MSGPACK_DEFINE(ino, mode, nlink, uid, gid, size, blocks, blksize, atime, mtime, ctime);
+};
+
 struct FLock : public flock {
   MSGPACK_DEFINE(
       l_type,
@@ -113,6 +169,129 @@ struct StatVfs : public statvfs {
 
 typedef std::map<std::string, cbb::FileStat> FileStats;
 
+/// レイテンシ分布の要約 (usec)
+struct LatencySummary {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t p50;
+  uint64_t p90;
+  uint64_t p99;
+  uint64_t p999;
+
+  MSGPACK_DEFINE(count, sum, max, p50, p90, p99, p999);
+};
+
+/// メソッドごとの統計情報
+struct MethodStats {
+  std::string name;
+  uint64_t ops;
+  uint64_t errors;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  LatencySummary total;
+  LatencySummary queue;
+  LatencySummary syscall;
+  LatencySummary copy;
+
+  MSGPACK_DEFINE(name, ops, errors, bytes_in, bytes_out, total, queue, syscall, copy);
+};
+
+/// Localストレージのデバイスごとの統計情報
+struct DeviceStats {
+  std::string root;        // ルートパス
+  uint64_t free_bytes;     // 空き容量
+  uint64_t total_bytes;    // 容量
+  uint64_t open_files;     // 開いているファイル数
+  uint64_t placed_files;   // 新しく配置したファイル数
+  uint64_t bytes_read;     // 読み込みバイト数
+  uint64_t bytes_written;  // 書き込みバイト数
+
+  MSGPACK_DEFINE(root, free_bytes, total_bytes, open_files, placed_files, bytes_read, bytes_written);
+};
+
+/// QoS分類ごとの統計情報
+struct QosClassStats {
+  std::string name;    // 分類名 (クライアントのジョブID、空の場合は分類なし)
+  uint32_t weight;     // 公平キューの重み
+  uint64_t bandwidth;  // 帯域の上限 (バイト/秒、0の場合は制限なし)
+  uint64_t queued;     // 待っているリクエスト数
+  uint64_t requests;   // 処理したリクエスト数
+  uint64_t bytes;      // 処理したバイト数
+  uint64_t wait_usec;  // キューで待った時間の合計
+  uint64_t throttled;  // 帯域の上限で後回しにした回数
+
+  MSGPACK_DEFINE(name, weight, bandwidth, queued, requests, bytes, wait_usec, throttled);
+};
+
+/// バックグラウンドのコピー (先読み、書き出し、レプリカの作成) の統計情報
+struct BackgroundStats {
+  uint64_t foreground;     // 処理中のフォアグラウンドの読み書き数
+  uint64_t active;         // 処理中のバックグラウンドのコピー数
+  uint64_t bytes;          // コピーしたバイト数
+  uint64_t deferred;       // フォアグラウンドを優先して止めた回数
+  uint64_t deferred_msec;  // 止めた時間の合計
+  uint64_t forced;         // 止める時間の上限を超えて再開した回数
+
+  BackgroundStats() : foreground(0), active(0), bytes(0), deferred(0), deferred_msec(0), forced(0) {}
+
+  MSGPACK_DEFINE(foreground, active, bytes, deferred, deferred_msec, forced);
+};
+
+/// Secondaryストレージへの書き出しの制限の統計情報
+struct SecondaryStats {
+  uint64_t bandwidth;       // 現在の書き込み帯域の上限 (バイト/秒、0の場合は制限なし)
+  uint64_t ops;             // 現在のメタデータ操作の上限 (回/秒、0の場合は制限なし)
+  uint64_t servers;         // 帯域を分け合っているサーバー数 (リース数、0の場合は調整なし)
+  uint64_t bytes;           // 書き込んだバイト数
+  uint64_t operations;      // メタデータ操作数
+  uint64_t throttled;       // 上限で待った回数
+  uint64_t throttled_msec;  // 待った時間の合計
+
+  SecondaryStats() : bandwidth(0), ops(0), servers(0), bytes(0), operations(0), throttled(0), throttled_msec(0) {}
+
+  MSGPACK_DEFINE(bandwidth, ops, servers, bytes, operations, throttled, throttled_msec);
+};
+
+/// サーバーの統計情報
+struct ServerStatsInfo {
+  uint64_t uptime_msec;
+  uint64_t export_queue_depth;
+  uint64_t prefetch_queue_depth;
+  std::vector<MethodStats> methods;
+  std::vector<DeviceStats> devices;
+  std::vector<QosClassStats> qos_classes;
+  BackgroundStats background;
+  SecondaryStats secondary;
+
+  MSGPACK_DEFINE(uptime_msec, export_queue_depth, prefetch_queue_depth, methods, devices, qos_classes, background,
+                 secondary);
+};
+
+/// サーバーの負荷・容量 (新規ファイルの配置先選択用)
+struct ServerLoad {
+  uint64_t free_bytes;      // Localストレージの空き容量
+  uint64_t total_bytes;     // Localストレージの容量
+  uint64_t inflight_bytes;  // 処理中の読み書きバイト数
+  uint64_t export_backlog;  // Secondaryへのエクスポート待ちファイル数
+  uint64_t placed_count;    // 配置ディレクトリの登録数
+
+  ServerLoad() : free_bytes(0), total_bytes(0), inflight_bytes(0), export_backlog(0), placed_count(0) {}
+
+  MSGPACK_DEFINE(free_bytes, total_bytes, inflight_bytes, export_backlog, placed_count);
+};
+
+/// クラスタのサーバー構成 (版付き)
+struct Membership {
+  uint64_t epoch;                  // 構成の版 (0の場合は設定ファイルの構成)
+  std::vector<std::string> hosts;  // サーバー一覧 ("host:port")
+  int virtual_nodes;               // サーバーあたりの仮想ノード数 (0の場合はハッシュ空間を均等に分割)
+
+  Membership() : epoch(0), virtual_nodes(0) {}
+
+  MSGPACK_DEFINE(epoch, hosts, virtual_nodes);
+};
+
 /// MsgPack Code
 #define CODE(code) #code
 enum CBBMsgPackCode {
@@ -155,8 +334,55 @@ enum CBBMsgPackCode {
   kFilePrevRead,
   kFileFlush,
   kLocalFileExport,
+
+  kStats,
+  kLogLevel,
+  kShmAttach,
+  kStripeOpen,
+  kGetStripe,
+  kReplicaOpen,
+  kReplicate,
+  kLoad,
+  kPlacement,
+  kPlacementLookup,
+  kMembership,
+  kSetMembership,
+  kMigrateList,
+  kMigrateRead,
+  kMigrateRelease,
+  kForward,
+  kHello,
+  kCompression,
+  kQosClass,
+
+  kMsgPackCodeMax,
 };
 
+/// プロトコルの版
+///   v1: メソッドはコード名の文字列 (CODE(kRead))、読み書きはパスとfdを送る
+///   v2: メソッドはコードの整数、読み書き等はオープン時にサーバーが発行したファイルハンドルだけを送る
+///   kHello (v1の文字列で送る) で双方が扱える版を決め、旧サーバーとは v1 で通信する。
+#define CBB_PROTOCOL_V1       1
+#define CBB_PROTOCOL_V2       2
+#define CBB_PROTOCOL_VERSION  CBB_PROTOCOL_V2
+
+/// v2のメソッドコードの上位ビットに入れるQoS分類 (kQosClass でサーバーが割り当てる、0は分類なし)
+#define CBB_QOS_CLASS_SHIFT   16
+#define CBB_QOS_CODE_MASK     ((1 << CBB_QOS_CLASS_SHIFT) - 1)
+
+/**
+ * @breaf v2プロトコルのファイルハンドル (上位32bit: サーバーのセッションID、下位32bit: fd)
+ *   セッションIDはサーバーの起動ごとに変わるため、再起動前のハンドルはサーバーが拒否する。
+ * @param session サーバーのセッションID
+ * @param fd サーバーのファイルディスクリプタ
+ * @return ハンドル
+ */
+inline uint64_t make_file_handle(uint32_t session, int fd) {
+  return ((uint64_t)session << 32) | (uint32_t)fd;
+}
+inline uint32_t file_handle_session(uint64_t handle) { return (uint32_t)(handle >> 32); }
+inline int file_handle_fd(uint64_t handle) { return (int)(uint32_t)handle; }
+
 enum CBBReadDirType {
   kDirLocal = 1,
   kDirSecondary = 2,
@@ -188,11 +414,11 @@ public:
   operator const char * ()		{ return str; }
 };
 
-#ifdef OUTPUT_PRINTF_DEBUG
-  #define DMSG(...) printf((const char *)cbb::S(__VA_ARGS__))
-#else
-  #define DMSG(...)
-#endif
+// ログ出力 (CBB_LOG_LEVEL未満はコンパイル時に除去、それ以上は Logger::set_level で実行時に制御)
+#define DMSG(...) CBB_LOG(cbb::kLogDebug, __VA_ARGS__)
+#define IMSG(...) CBB_LOG(cbb::kLogInfo, __VA_ARGS__)
+#define WMSG(...) CBB_LOG(cbb::kLogWarn, __VA_ARGS__)
+#define EMSG(...) CBB_LOG(cbb::kLogError, __VA_ARGS__)
 
 #ifdef OUTPUT_PRINTF_TEST
   #define TMSG(...) printf((const char *)cbb::S(__VA_ARGS__))
@@ -201,23 +427,9 @@ public:
 #endif
 
 
+// 旧ファイル出力 (出力先は Logger::Open で設定したファイルに集約)
 #define CBB_LOG_FILE "/tmp/cbb.log"
-static void FMSG(const char *filename, const char *format, ... )
-{
-  char  str[512];
-  va_list arg;
-  va_start( arg, format );
-  vsnprintf( str, sizeof(str), format, arg );
-  va_end( arg );
-  str[ sizeof(str) - 1 ] = NULL;
-
-  FILE *fpw = fopen(filename, "at");
-  if( fpw != NULL )
-  {
-    fprintf(fpw, "%s\n", str);
-    fclose( fpw );
-  }
-}
+#define FMSG(filename, format, ...) CBB_LOG(cbb::kLogInfo, format "\n", ##__VA_ARGS__)
 
 static uint64_t get_time_msec()
 {
@@ -226,6 +438,13 @@ static uint64_t get_time_msec()
     return ((uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_usec / 1000);
 }
 
+static uint64_t get_time_usec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000);
+}
+
 static std::string create_virtual_symlink(const std::string path) {
   std::string target = path + VIRTUAL_SYMLINK_EXT;
   return target;
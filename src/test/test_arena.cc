@@ -0,0 +1,85 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "test_common.h"
+#include "util/arena.h"
+
+// アリーナクラスユニットテスト
+
+BOOST_AUTO_TEST_SUITE_EX(arena)
+
+BOOST_AUTO_TEST_CASE(alloc_reset)
+{
+  cbb::Arena arena;
+  char *first = (char *)arena.Alloc(1);
+  char *second = (char *)arena.Alloc(100);
+  BOOST_CHECK(first != NULL);
+  BOOST_CHECK(second >= first + 1);
+  BOOST_CHECK(((uintptr_t)second & 15) == 0);
+
+  // 固定領域を超える確保
+  char *large = (char *)arena.Alloc(ARENA_BLOCK_SIZE * 2);
+  BOOST_CHECK(large != NULL);
+  memset(large, 0xff, ARENA_BLOCK_SIZE * 2);
+
+  arena.Reset();
+  BOOST_CHECK(arena.used() == 0);
+  BOOST_CHECK(arena.Alloc(1) == first);
+}
+
+BOOST_AUTO_TEST_CASE(oversized)
+{
+  cbb::Arena arena;
+  arena.Alloc(1);
+
+  // 揃えたサイズ、管理領域を足したサイズが桁あふれするサイズは確保しない
+  BOOST_CHECK(arena.Alloc(SIZE_MAX) == NULL);
+  BOOST_CHECK(arena.Alloc(SIZE_MAX - 8) == NULL);
+  BOOST_CHECK(arena.Alloc(SIZE_MAX - ARENA_ALIGN + 1) == NULL);
+  BOOST_CHECK(arena.used() == ARENA_ALIGN);
+
+  // 確保できないほど大きなサイズ
+  BOOST_CHECK(arena.Alloc(SIZE_MAX / 2) == NULL);
+  BOOST_CHECK(arena.Alloc(16) != NULL);
+}
+
+BOOST_AUTO_TEST_CASE(join)
+{
+  cbb::Arena arena;
+  const char *path = "/dir/file-tail";
+  BOOST_CHECK(std::string(arena.Join("/local", path, 9)) == "/local/dir/file");
+  BOOST_CHECK(std::string(arena.Join("/local", "dir", 3)) == "/local/dir");
+  BOOST_CHECK(std::string(arena.Join("/local", "", 0)) == "/local/");
+  BOOST_CHECK(std::string(arena.Strndup(path, 4)) == "/dir");
+}
+
+BOOST_AUTO_TEST_CASE(scope)
+{
+  cbb::Arena *arena = cbb::Arena::current();
+  BOOST_CHECK(arena == cbb::Arena::current());
+  {
+    cbb::ArenaScope outer(arena);
+    arena->Alloc(10);
+    {
+      // 内側の範囲の終わりでは破棄しない
+      cbb::ArenaScope inner(arena);
+      arena->Alloc(10);
+    }
+    BOOST_CHECK(arena->used() > 0);
+  }
+  BOOST_CHECK(arena->used() == 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
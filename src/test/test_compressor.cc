@@ -0,0 +1,179 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "test_common.h"
+#include "util/compressor.h"
+
+#include <pthread.h>
+
+#include <vector>
+
+#define COMPRESSOR_THREADS 4
+#define COMPRESSOR_CALLS 1000
+
+/**
+ * @breaf 見送った回数を数えながら ShouldCompress を呼ぶスレッド
+ * @param data 圧縮クラス
+ * @return 見送った回数
+ */
+static void *should_compress(void *data) {
+  cbb::Compressor *compressor = (cbb::Compressor *)data;
+  uintptr_t skipped = 0;
+  for (int index = 0; index < COMPRESSOR_CALLS; index++) {
+    if (!compressor->ShouldCompress(COMPRESS_MIN_SIZE)) {
+      skipped++;
+    }
+  }
+  return (void *)skipped;
+}
+
+// データ圧縮クラスユニットテスト
+
+BOOST_AUTO_TEST_SUITE_EX(compressor)
+
+BOOST_AUTO_TEST_CASE(parse_name)
+{
+  BOOST_CHECK_EQUAL(cbb::Compressor::Parse("none"), cbb::kCompressNone);
+  BOOST_CHECK_EQUAL(cbb::Compressor::Parse("lz4"), cbb::kCompressLZ4);
+  BOOST_CHECK_EQUAL(cbb::Compressor::Parse("zstd"), cbb::kCompressZstd);
+  BOOST_CHECK_EQUAL(cbb::Compressor::Parse("gzip"), -1);
+  BOOST_CHECK_EQUAL(std::string(cbb::Compressor::name(cbb::kCompressLZ4)), "lz4");
+  BOOST_CHECK(cbb::Compressor::is_supported(cbb::kCompressNone));
+  BOOST_CHECK(!cbb::Compressor::is_supported(cbb::kCompressTypeMax));
+
+  // 使えない方式は圧縮しない
+  cbb::Compressor compressor;
+  compressor.Init(cbb::kCompressTypeMax, 0, 0);
+  BOOST_CHECK(!compressor.is_enabled());
+  BOOST_CHECK(!compressor.ShouldCompress(1 << 20));
+}
+
+BOOST_AUTO_TEST_CASE(round_trip)
+{
+  std::vector<char> data(64 * 1024);
+  for (size_t index = 0; index < data.size(); index++) {
+    data[index] = "0123456789,abc\n"[index % 15];
+  }
+
+  for (int type = cbb::kCompressNone + 1; type < cbb::kCompressTypeMax; type++) {
+    if (!cbb::Compressor::is_supported(type)) {
+      continue;
+    }
+    int levels[] = { -4, 0, 3 };
+    for (int index = 0; index < 3; index++) {
+      cbb::Compressor compressor;
+      compressor.Init(type, levels[index], COMPRESS_MIN_SIZE);
+      BOOST_CHECK(compressor.ShouldCompress(data.size()));
+      BOOST_CHECK(!compressor.ShouldCompress(COMPRESS_MIN_SIZE - 1));
+
+      std::vector<char> cbuf(cbb::Compressor::Bound(type, data.size()));
+      ssize_t csize = compressor.Compress(&data[0], data.size(), &cbuf[0], cbuf.size());
+      BOOST_CHECK(csize > 0 && (size_t)csize < data.size() / 2);
+
+      std::vector<char> dbuf(data.size());
+      BOOST_CHECK_EQUAL(cbb::Compressor::Decompress(type, &cbuf[0], csize, &dbuf[0], dbuf.size()), (ssize_t)data.size());
+      BOOST_CHECK(dbuf == data);
+
+      // 壊れたデータ、小さすぎる展開先は失敗する
+      BOOST_CHECK_EQUAL(cbb::Compressor::Decompress(type, &cbuf[0], csize / 2, &dbuf[0], dbuf.size()), -1);
+      BOOST_CHECK_EQUAL(cbb::Compressor::Decompress(type, &cbuf[0], csize, &dbuf[0], dbuf.size() / 2), -1);
+
+      // 展開後のサイズは圧縮データのサイズの最大の倍率に収まる
+      BOOST_CHECK(data.size() <= cbb::Compressor::DecompressBound(type, csize));
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(decompress_bound)
+{
+  // 使えない方式は展開できない
+  BOOST_CHECK(cbb::Compressor::DecompressBound(cbb::kCompressNone, 100) == 0);
+  BOOST_CHECK(cbb::Compressor::DecompressBound(cbb::kCompressTypeMax, 100) == 0);
+
+  for (int type = cbb::kCompressNone + 1; type < cbb::kCompressTypeMax; type++) {
+    if (!cbb::Compressor::is_supported(type)) {
+      continue;
+    }
+    // 小さな圧縮データから申告された大きすぎるサイズ、桁あふれするサイズは範囲外
+    BOOST_CHECK(cbb::Compressor::DecompressBound(type, 16) < (size_t)1 << 30);
+    BOOST_CHECK(cbb::Compressor::DecompressBound(type, 16) < SIZE_MAX - 8);
+    BOOST_CHECK(cbb::Compressor::DecompressBound(type, SIZE_MAX / 2) == SIZE_MAX);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(skip_incompressible)
+{
+  std::vector<char> data(64 * 1024);
+  unsigned int seed = 1;
+  for (size_t index = 0; index < data.size(); index++) {
+    data[index] = (char)(rand_r(&seed) >> 7);
+  }
+
+  for (int type = cbb::kCompressNone + 1; type < cbb::kCompressTypeMax; type++) {
+    if (!cbb::Compressor::is_supported(type)) {
+      continue;
+    }
+    cbb::Compressor compressor;
+    compressor.Init(type, 0, COMPRESS_MIN_SIZE);
+    std::vector<char> cbuf(cbb::Compressor::Bound(type, data.size()));
+
+    // 効かなかった後は 1, 2, 4 ... 回見送る
+    BOOST_CHECK(compressor.ShouldCompress(data.size()));
+    BOOST_CHECK_EQUAL(compressor.Compress(&data[0], data.size(), &cbuf[0], cbuf.size()), -1);
+    BOOST_CHECK(!compressor.ShouldCompress(data.size()));
+    BOOST_CHECK(compressor.ShouldCompress(data.size()));
+    BOOST_CHECK_EQUAL(compressor.Compress(&data[0], data.size(), &cbuf[0], cbuf.size()), -1);
+    BOOST_CHECK(!compressor.ShouldCompress(data.size()));
+    BOOST_CHECK(!compressor.ShouldCompress(data.size()));
+    BOOST_CHECK(compressor.ShouldCompress(data.size()));
+
+    // 効いた場合は見送りをやめる
+    compressor.Record(true);
+    compressor.Record(false);
+    BOOST_CHECK(!compressor.ShouldCompress(data.size()));
+    BOOST_CHECK(compressor.ShouldCompress(data.size()));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(concurrent_skip)
+{
+  for (int type = cbb::kCompressNone + 1; type < cbb::kCompressTypeMax; type++) {
+    if (!cbb::Compressor::is_supported(type)) {
+      continue;
+    }
+    cbb::Compressor compressor;
+    compressor.Init(type, 0, COMPRESS_MIN_SIZE);
+
+    // 見送る回数は上限で止まり、同時に判定しても見送りは上限の回数だけ
+    for (int index = 0; index < 16; index++) {
+      compressor.Record(false);
+    }
+
+    pthread_t threads[COMPRESSOR_THREADS];
+    for (int index = 0; index < COMPRESSOR_THREADS; index++) {
+      pthread_create(&threads[index], NULL, should_compress, &compressor);
+    }
+
+    uintptr_t skipped = 0;
+    for (int index = 0; index < COMPRESSOR_THREADS; index++) {
+      void *result;
+      pthread_join(threads[index], &result);
+      skipped += (uintptr_t)result;
+    }
+    BOOST_CHECK_EQUAL(skipped, (uintptr_t)COMPRESS_SKIP_MAX);
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,99 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "test_common.h"
+#include "cbb/dirty_extents.h"
+
+// 変更範囲クラスユニットテスト
+
+BOOST_AUTO_TEST_SUITE_EX(dirty_extents)
+
+BOOST_AUTO_TEST_CASE(add_merge)
+{
+  cbb::DirtyExtents extents;
+  BOOST_CHECK(extents.empty());
+
+  // ブロック単位に揃え、隣接する範囲はまとめる
+  extents.Add(10, 1);
+  BOOST_CHECK(extents.str() == "0-65536");
+  extents.Add(DIRTY_BLOCK_SIZE, DIRTY_BLOCK_SIZE);
+  BOOST_CHECK(extents.str() == "0-131072");
+  extents.Add(4 * DIRTY_BLOCK_SIZE + 1, DIRTY_BLOCK_SIZE);
+  BOOST_CHECK(extents.str() == "0-131072,262144-393216");
+  BOOST_CHECK(extents.bytes() == 4 * DIRTY_BLOCK_SIZE);
+
+  extents.Add(DIRTY_BLOCK_SIZE, 3 * DIRTY_BLOCK_SIZE);
+  BOOST_CHECK(extents.str() == "0-393216");
+  BOOST_CHECK(extents.extents().size() == 1);
+}
+
+BOOST_AUTO_TEST_CASE(coalesce)
+{
+  cbb::DirtyExtents extents;
+  for (int i = 0; i < DIRTY_EXTENT_MAX; i++) {
+    extents.Add((off_t)i * 4 * DIRTY_BLOCK_SIZE, 1);
+  }
+  BOOST_CHECK(extents.extents().size() == DIRTY_EXTENT_MAX);
+
+  // 上限を超えると間隔の最も狭い範囲どうしをまとめる
+  extents.Add((off_t)DIRTY_EXTENT_MAX * 4 * DIRTY_BLOCK_SIZE - 2 * DIRTY_BLOCK_SIZE, 1);
+  BOOST_CHECK(extents.extents().size() == DIRTY_EXTENT_MAX);
+  BOOST_CHECK(extents.extents().rbegin()->second == (off_t)(DIRTY_EXTENT_MAX * 4 - 1) * DIRTY_BLOCK_SIZE);
+}
+
+BOOST_AUTO_TEST_CASE(truncate)
+{
+  cbb::DirtyExtents extents;
+  extents.Add(0, DIRTY_BLOCK_SIZE);
+  extents.Add(4 * DIRTY_BLOCK_SIZE, 4 * DIRTY_BLOCK_SIZE);
+  extents.Truncate(5 * DIRTY_BLOCK_SIZE + 1);
+  BOOST_CHECK(extents.str() == "t327681,0-65536,262144-393216");
+
+  // 最小のサイズだけを覚える
+  extents.Truncate(DIRTY_BLOCK_SIZE);
+  extents.Truncate(10 * DIRTY_BLOCK_SIZE);
+  BOOST_CHECK(extents.truncated() == DIRTY_BLOCK_SIZE);
+  BOOST_CHECK(extents.str() == "t65536,0-65536");
+  BOOST_CHECK(!extents.empty());
+}
+
+BOOST_AUTO_TEST_CASE(parse)
+{
+  cbb::DirtyExtents extents;
+  BOOST_CHECK(cbb::DirtyExtents::Parse("t100,0-65536,131072-196608", &extents));
+  BOOST_CHECK(extents.truncated() == 100);
+  BOOST_CHECK(extents.extents().size() == 2);
+  BOOST_CHECK(extents.str() == "t100,0-65536,131072-196608");
+
+  BOOST_CHECK(cbb::DirtyExtents::Parse("", &extents));
+  BOOST_CHECK(extents.empty());
+
+  BOOST_CHECK(cbb::DirtyExtents::Parse("*", &extents));
+  BOOST_CHECK(extents.is_full());
+  extents.Add(0, 1);
+  BOOST_CHECK(extents.str() == "*");
+
+  BOOST_CHECK(!cbb::DirtyExtents::Parse("0-", &extents));
+  BOOST_CHECK(!cbb::DirtyExtents::Parse("10-5", &extents));
+
+  // 全体とまとめると全体になる
+  cbb::DirtyExtents other;
+  other.Add(0, 1);
+  BOOST_CHECK(cbb::DirtyExtents::Parse("*", &extents));
+  other.Merge(extents);
+  BOOST_CHECK(other.is_full());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,178 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "test_common.h"
+#include "util/fair_queue.h"
+#include "util/token_bucket.h"
+
+// 分類ごとの公平キュー、トークンバケットクラスユニットテスト
+
+BOOST_AUTO_TEST_SUITE_EX(fair_queue)
+
+BOOST_AUTO_TEST_CASE(token_bucket)
+{
+  cbb::TokenBucket bucket;
+
+  // 制限なし
+  bucket.Init(0, 0, 0);
+  BOOST_CHECK(!bucket.is_limited());
+  BOOST_CHECK(bucket.TryTake(1000000, 0) == 0);
+  BOOST_CHECK(bucket.Wait(0) == 0);
+
+  // 1秒分から始め、使い切ると借りを返すまで待つ
+  bucket.Init(1000, 0, 0);
+  BOOST_CHECK(bucket.is_limited());
+  BOOST_CHECK(bucket.TryTake(600, 0) == 0);
+  BOOST_CHECK(bucket.TryTake(600, 0) == 0);
+  BOOST_CHECK(bucket.Wait(0) == 201000);
+  BOOST_CHECK(bucket.TryTake(1, 100000) > 0);
+  BOOST_CHECK(bucket.Wait(201000) == 0);
+
+  // 上限を超えては貯めない
+  bucket.Init(1000, 100, 0);
+  BOOST_CHECK(bucket.TryTake(100, 10000000) == 0);
+  BOOST_CHECK(bucket.Wait(10000000) > 0);
+
+  // 長く使われなかった場合は満杯にする
+  bucket.Init(1000, 0, 0);
+  bucket.Take(100000, 0);
+  BOOST_CHECK(bucket.Wait(1000000) > 0);
+  BOOST_CHECK(bucket.Wait(61000000) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(weight)
+{
+  cbb::FairQueue queue;
+  queue.Init(100, 0, 0);
+  queue.Configure("heavy", 3, 0, 0);
+  int light = queue.Register("light", 0);
+  int heavy = queue.Register("heavy", 0);
+  BOOST_CHECK(light == 1);
+  BOOST_CHECK(heavy == 2);
+  BOOST_CHECK(queue.Register("light", 0) == light);
+  BOOST_CHECK(queue.Register("", 0) == 0);
+
+  static int items[2];
+  for (int index = 0; index < 40; index++) {
+    queue.Push(light, &items[0], 100, 0);
+    queue.Push(heavy, &items[1], 100, 0);
+  }
+  BOOST_CHECK(queue.size() == 80);
+
+  // 重みに応じた割合で取り出す
+  int counts[2] = { 0, 0 };
+  uint64_t wait;
+  for (int index = 0; index < 40; index++) {
+    int *item = (int *)queue.Pop(0, &wait);
+    BOOST_REQUIRE(item != NULL);
+    counts[item - items]++;
+  }
+  BOOST_CHECK(counts[0] == 10);
+  BOOST_CHECK(counts[1] == 30);
+
+  // 片方が空になった後は残りの分類だけを取り出す
+  while (queue.size() > 0) {
+    BOOST_REQUIRE(queue.Pop(0, &wait) != NULL);
+  }
+  BOOST_CHECK(queue.Pop(0, &wait) == NULL);
+  BOOST_CHECK(wait == 0);
+
+  std::vector<cbb::QosClassStats> stats;
+  queue.Snapshot(&stats);
+  BOOST_REQUIRE(stats.size() == 3);
+  BOOST_CHECK(stats[1].name == "light");
+  BOOST_CHECK(stats[1].requests == 40);
+  BOOST_CHECK(stats[2].weight == 3);
+  BOOST_CHECK(stats[2].bytes == 4000);
+}
+
+BOOST_AUTO_TEST_CASE(large_request)
+{
+  cbb::FairQueue queue;
+  queue.Init(100, 0, 0);
+  int small = queue.Register("small", 0);
+  int large = queue.Register("large", 0);
+
+  // 1回分を超える要求も、回ってくるたびに貯めて取り出す
+  static int items[2];
+  queue.Push(large, &items[1], 350, 0);
+  for (int index = 0; index < 8; index++) {
+    queue.Push(small, &items[0], 100, 0);
+  }
+
+  uint64_t wait;
+  int order = 0;
+  int large_order = -1;
+  while (queue.size() > 0) {
+    int *item = (int *)queue.Pop(0, &wait);
+    BOOST_REQUIRE(item != NULL);
+    if (item == &items[1]) {
+      large_order = order;
+    }
+    order++;
+  }
+  BOOST_CHECK(large_order == 4);
+}
+
+BOOST_AUTO_TEST_CASE(bandwidth)
+{
+  cbb::FairQueue queue;
+  queue.Init(100, 0, 0);
+  queue.Configure("limited", 1, 1000, 0);
+  int limited = queue.Register("limited", 0);
+  int free = queue.Register("free", 0);
+
+  static int items[2];
+  queue.Push(limited, &items[0], 1000, 0);
+  queue.Push(limited, &items[0], 1000, 0);
+  queue.Push(free, &items[1], 100, 0);
+
+  // 帯域の上限に達した分類は、上限の解けるまで取り出さない
+  uint64_t wait;
+  BOOST_CHECK(queue.Pop(0, &wait) == &items[1]);
+  BOOST_CHECK(queue.Pop(0, &wait) == &items[0]);
+  BOOST_CHECK(queue.Pop(0, &wait) == NULL);
+  BOOST_CHECK(wait > 0);
+  BOOST_CHECK(queue.Pop(wait, &wait) == &items[0]);
+
+  std::vector<cbb::QosClassStats> stats;
+  queue.Snapshot(&stats);
+  BOOST_CHECK(stats[limited].bandwidth == 1000);
+  BOOST_CHECK(stats[limited].throttled > 0);
+  BOOST_CHECK(stats[limited].wait_usec > 0);
+}
+
+BOOST_AUTO_TEST_CASE(charge)
+{
+  cbb::FairQueue queue;
+  queue.Init(100, 0, 0);
+  queue.Configure("limited", 1, 1000, 0);
+  int limited = queue.Register("limited", 0);
+
+  // キューを通さない要求も同じ帯域の上限を守る
+  BOOST_CHECK(queue.Charge(limited, 1000, 0) == 0);
+  uint64_t wait = queue.Charge(limited, 1000, 0);
+  BOOST_CHECK(wait > 0);
+  BOOST_CHECK(queue.Charge(limited, 1000, wait) == 0);
+  BOOST_CHECK(queue.Charge(-1, 1000, 0) == 0);
+
+  std::vector<cbb::QosClassStats> stats;
+  queue.Snapshot(&stats);
+  BOOST_CHECK(stats[limited].requests == 2);
+  BOOST_CHECK(stats[limited].bytes == 2000);
+  BOOST_CHECK(stats[limited].throttled == 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -13,11 +13,34 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 //
+#include <stdlib.h>
+#include <vector>
+
 #include "test_common.h"
 #include "util/file_control.h"
 
 #define TEMP_FILE TEST_WORKSPACE"/test_file.tmp"
 
+// io_uring の完了通知
+struct IoResult {
+  IoResult() : result(0), is_done(0) {}
+  ssize_t result;
+  volatile int is_done;
+};
+
+static void io_done(void *user_data, ssize_t result) {
+  IoResult *io_result = (IoResult *)user_data;
+  io_result->result = result;
+  __sync_synchronize();
+  io_result->is_done = 1;
+}
+
+static void io_wait(IoResult *io_result) {
+  for (int wait = 0; wait < 5000 && !io_result->is_done; wait++) {
+    usleep(1000);
+  }
+}
+
 // ファイル制御クラスユニットテスト
 
 BOOST_AUTO_TEST_SUITE_EX(file_control)
@@ -79,4 +102,273 @@ BOOST_AUTO_TEST_CASE(read)
   remove(TEMP_FILE);
 }
 
+BOOST_AUTO_TEST_CASE(io_ring)
+{
+  if (!cbb::FileControl::EnableIoRing(8)) {
+    // カーネル、ビルド環境が io_uring に対応していない場合は投入できず、pread/pwrite を使う
+    cbb::FileControl fc;
+    fc.Create(TEMP_FILE, O_RDWR | O_CREAT, S_IREAD | S_IWRITE);
+    BOOST_CHECK(!fc.SubmitRead((void *)"", 1, 0, io_done, NULL));
+    BOOST_CHECK(cbb::FileControl::AllocIoBuffer(1) == NULL);
+    fc.Close();
+    remove(TEMP_FILE);
+    return;
+  }
+
+  cbb::FileControl fc;
+  int fd = fc.Create(TEMP_FILE, O_RDWR | O_CREAT, S_IREAD | S_IWRITE);
+  BOOST_CHECK(fd != -1);
+
+  IoResult write_result;
+  BOOST_CHECK(fc.SubmitWrite("io_uring test", 13, 0, io_done, &write_result));
+  io_wait(&write_result);
+  BOOST_CHECK(write_result.is_done);
+  BOOST_CHECK(write_result.result == 13);
+
+  // 登録バッファへの読み込み
+  char *buf = (char *)cbb::FileControl::AllocIoBuffer(16);
+  BOOST_CHECK(buf != NULL);
+  char local[16] = "";
+  if (buf == NULL) {
+    buf = local;
+  }
+
+  IoResult read_result;
+  BOOST_CHECK(fc.SubmitRead(buf, 16, 3, io_done, &read_result));
+  io_wait(&read_result);
+  BOOST_CHECK(read_result.is_done);
+  BOOST_CHECK(read_result.result == 10);
+  BOOST_CHECK(memcmp(buf, "uring test", 10) == 0);
+
+  if (buf != local) {
+    cbb::FileControl::FreeIoBuffer(buf);
+  }
+  fc.Close();
+  cbb::FileControl::DisableIoRing();
+
+  remove(TEMP_FILE);
+}
+
+BOOST_AUTO_TEST_CASE(direct_io)
+{
+  BOOST_CHECK(cbb::FileControl::EnableDirectIo(8192, 2));
+
+  // 境界に揃っていないオフセット、バッファで先頭と末尾の通常I/Oと中央の直接I/Oを通す
+  // (ファイルシステムが O_DIRECT に対応していない場合は通常I/Oになり、結果は同じ)
+  const size_t size = 3 * DIRECT_IO_ALIGN + 100;
+  std::vector<char> data(size + 1);
+  for (size_t index = 0; index < data.size(); index++) {
+    data[index] = (char)(index * 7);
+  }
+
+  cbb::FileControl fc;
+  int fd = fc.Create(TEMP_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IREAD | S_IWRITE);
+  BOOST_CHECK(fd != -1);
+  BOOST_CHECK(fc.Write(&data[1], size, 100) == (ssize_t)size);
+
+  // 直接I/Oの読み書きは io_uring に投入しない
+  BOOST_CHECK(!fc.SubmitRead(&data[0], size, 100, io_done, NULL));
+
+  std::vector<char> read(size + 1);
+  BOOST_CHECK(fc.Read(&read[1], size, 100) == (ssize_t)size);
+  BOOST_CHECK(memcmp(&read[1], &data[1], size) == 0);
+
+  // ファイル末尾を越える読み込みは短くなる
+  BOOST_CHECK(fc.Read(&read[1], size, 100 + DIRECT_IO_ALIGN) == (ssize_t)(size - DIRECT_IO_ALIGN));
+  BOOST_CHECK(memcmp(&read[1], &data[1 + DIRECT_IO_ALIGN], size - DIRECT_IO_ALIGN) == 0);
+
+  fc.Close();
+
+  // 他の利用者が残っている間は無効にしない
+  BOOST_CHECK(cbb::FileControl::EnableDirectIo(8192, 2));
+  cbb::FileControl::DisableDirectIo();
+  BOOST_CHECK(cbb::FileControl::is_direct_io_enabled());
+  cbb::FileControl::DisableDirectIo();
+  BOOST_CHECK(!cbb::FileControl::is_direct_io_enabled());
+
+  remove(TEMP_FILE);
+}
+
+// 読み込んだ内容が期待値と一致するか
+static bool check_content(cbb::FileControl &fc, const std::vector<char> &expected) {
+  std::vector<char> read(expected.size() + 1);
+  return fc.Read(&read[0], read.size(), 0) == (ssize_t)expected.size() &&
+      memcmp(&read[0], &expected[0], expected.size()) == 0;
+}
+
+BOOST_AUTO_TEST_CASE(local_compression)
+{
+  if (!cbb::Compressor::is_supported(cbb::kCompressLZ4)) {
+    return;
+  }
+  const size_t chunk_size = 16384;
+  BOOST_CHECK(cbb::FileControl::EnableChunkStore(cbb::kCompressLZ4, 0, chunk_size));
+
+  cbb::FileControl fc;
+  int fd = fc.Create(TEMP_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IREAD | S_IWRITE);
+  BOOST_CHECK(fd != -1);
+  BOOST_CHECK(fc.Format());
+
+  // 圧縮の効く内容を小さな書き込みで追記する (チャンクが埋まった時に圧縮される)
+  std::vector<char> expected;
+  char line[64];
+  while (expected.size() < 12 * chunk_size) {
+    int length = snprintf(line, sizeof(line), "%08zu,sensor-%03zu,%6.2f\n", expected.size(),
+                          expected.size() % 97, (expected.size() % 1000) / 10.0);
+    BOOST_CHECK(fc.Write(line, length, expected.size()) == length);
+    expected.insert(expected.end(), line, line + length);
+  }
+  BOOST_CHECK(check_content(fc, expected));
+
+  // チャンクをまたぐ部分的な書き換え、ファイル末尾から離れた書き込み (間は0)
+  srand(1);
+  for (int count = 0; count < 200; count++) {
+    size_t size = rand() % (2 * chunk_size) + 1;
+    off_t offset = rand() % (expected.size() + chunk_size);
+    std::vector<char> data(size, (char)('a' + count % 26));
+    BOOST_CHECK(fc.Write(&data[0], size, offset) == (ssize_t)size);
+    if (expected.size() < offset + size) {
+      expected.resize(offset + size, 0);
+    }
+    memcpy(&expected[offset], &data[0], size);
+  }
+  BOOST_CHECK(check_content(fc, expected));
+
+  // 圧縮されたチャンクの途中で切り詰めて広げる
+  expected.resize(5 * chunk_size + 1234);
+  BOOST_CHECK(fc.Truncate(expected.size()) == 0);
+  expected.resize(7 * chunk_size, 0);
+  BOOST_CHECK(fc.Truncate(expected.size()) == 0);
+  BOOST_CHECK(check_content(fc, expected));
+
+  // ファイルサイズは元のままで、使用ブロックが減る
+  struct stat st;
+  BOOST_CHECK(fstat(fd, &st) == 0);
+  BOOST_CHECK(st.st_size == (off_t)expected.size());
+  BOOST_CHECK(st.st_blocks * 512 < st.st_size);
+  fc.Close();
+
+  // 開き直しても読める (圧縮形式のファイルのコピーは展開される)
+  BOOST_CHECK(fc.Open(TEMP_FILE, O_RDONLY) != -1);
+  BOOST_CHECK(check_content(fc, expected));
+  fc.Close();
+
+  BOOST_CHECK(cbb::FileControl::CopyFile(TEMP_FILE, TEMP_FILE ".copy", false) == 0);
+  BOOST_CHECK(!cbb::ChunkStore::is_chunked(TEMP_FILE ".copy"));
+  BOOST_CHECK(fc.Open(TEMP_FILE ".copy", O_RDONLY) != -1);
+  BOOST_CHECK(check_content(fc, expected));
+  fc.Close();
+
+  // 圧縮形式を無効にした後は拡張属性を確認しない
+  BOOST_CHECK(!cbb::FileControl::is_plain(TEMP_FILE));
+  cbb::FileControl::DisableChunkStore();
+  BOOST_CHECK(cbb::FileControl::is_plain(TEMP_FILE));
+
+  // 圧縮形式のファイルを作ったLocalストレージの記録
+  mkdir(TEST_WORKSPACE "/storage", S_IRWXU);
+  BOOST_CHECK(!cbb::ChunkStore::is_marked(TEST_WORKSPACE "/storage"));
+  BOOST_CHECK(cbb::ChunkStore::MarkStorage(TEST_WORKSPACE "/storage"));
+  BOOST_CHECK(cbb::ChunkStore::is_marked(TEST_WORKSPACE "/storage"));
+  rmdir(TEST_WORKSPACE "/storage");
+
+  remove(TEMP_FILE ".copy");
+  remove(TEMP_FILE);
+}
+
+BOOST_AUTO_TEST_CASE(device_stripe)
+{
+  const size_t stripe_size = 4096;
+  std::vector<std::string> roots;
+  roots.push_back(TEST_WORKSPACE);
+  roots.push_back(TEST_WORKSPACE "/device1");
+  roots.push_back(TEST_WORKSPACE "/device2");
+  BOOST_CHECK(cbb::FileControl::EnableDeviceStripe());
+
+  cbb::FileControl fc;
+  remove(TEMP_FILE);
+  int fd = fc.Create(TEMP_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IREAD | S_IWRITE);
+  BOOST_CHECK(fd != -1);
+  BOOST_CHECK(fc.Stripe(TEMP_FILE, roots, stripe_size));
+  BOOST_CHECK(cbb::DeviceStripe::is_striped(TEMP_FILE));
+  BOOST_CHECK(!cbb::FileControl::is_plain(TEMP_FILE));
+
+  size_t size = 0;
+  int count = 0;
+  BOOST_CHECK(fc.stripe_layout(&size, &count));
+  BOOST_CHECK(size == stripe_size && count == 3);
+
+  // ストライプの境界をまたぐ書き込み、ファイル末尾から離れた書き込み (間は0)
+  std::vector<char> expected;
+  srand(2);
+  for (int index = 0; index < 100; index++) {
+    size_t length = rand() % (3 * stripe_size) + 1;
+    off_t offset = rand() % (expected.size() + stripe_size);
+    std::vector<char> data(length, (char)('A' + index % 26));
+    BOOST_CHECK(fc.Write(&data[0], length, offset) == (ssize_t)length);
+    if (expected.size() < offset + length) {
+      expected.resize(offset + length, 0);
+    }
+    memcpy(&expected[offset], &data[0], length);
+  }
+  BOOST_CHECK(check_content(fc, expected));
+
+  // 先頭のファイルが論理的なサイズを持ち、他のデバイスにストライプがある
+  struct stat st;
+  BOOST_CHECK(fstat(fd, &st) == 0);
+  BOOST_CHECK(st.st_size == (off_t)expected.size());
+  BOOST_CHECK(access(TEST_WORKSPACE "/device1/.cbb_stripe.1.test_file.tmp", F_OK) == 0);
+  BOOST_CHECK(access(TEST_WORKSPACE "/device2/.cbb_stripe.2.test_file.tmp", F_OK) == 0);
+
+  expected.resize(5 * stripe_size + 100);
+  BOOST_CHECK(fc.Truncate(expected.size()) == 0);
+  BOOST_CHECK(check_content(fc, expected));
+  BOOST_CHECK(fc.FSync(1) == 0);
+  fc.Close();
+
+  // 開き直し、名前の変更、コピーの後も同じ内容を読める
+  BOOST_CHECK(cbb::FileControl::Rename(TEMP_FILE, TEMP_FILE ".renamed") == 0);
+  BOOST_CHECK(access(TEST_WORKSPACE "/device1/.cbb_stripe.1.test_file.tmp", F_OK) != 0);
+  BOOST_CHECK(fc.Open(TEMP_FILE ".renamed", O_RDONLY) != -1);
+  BOOST_CHECK(check_content(fc, expected));
+  fc.Close();
+
+  BOOST_CHECK(cbb::FileControl::CopyFile(TEMP_FILE ".renamed", TEMP_FILE ".copy", false) == 0);
+  BOOST_CHECK(cbb::FileControl::is_plain(TEMP_FILE ".copy"));
+  BOOST_CHECK(fc.Open(TEMP_FILE ".copy", O_RDONLY) != -1);
+  BOOST_CHECK(check_content(fc, expected));
+  fc.Close();
+
+  BOOST_CHECK(cbb::FileControl::Remove(TEMP_FILE ".renamed") == 0);
+  BOOST_CHECK(access(TEST_WORKSPACE "/device1/.cbb_stripe.1.test_file.tmp.renamed", F_OK) != 0);
+  BOOST_CHECK(access(TEST_WORKSPACE "/device2/.cbb_stripe.2.test_file.tmp.renamed", F_OK) != 0);
+
+  // 他のサーバーが有効にしている間は無効にならない
+  BOOST_CHECK(cbb::FileControl::EnableDeviceStripe());
+  cbb::FileControl::DisableDeviceStripe();
+  BOOST_CHECK(cbb::FileControl::is_device_stripe_enabled());
+  cbb::FileControl::DisableDeviceStripe();
+  BOOST_CHECK(!cbb::FileControl::is_device_stripe_enabled());
+  remove(TEMP_FILE ".copy");
+  rmdir(TEST_WORKSPACE "/device1");
+  rmdir(TEST_WORKSPACE "/device2");
+}
+
+BOOST_AUTO_TEST_CASE(shared_features)
+{
+  // 同じプロセスの複数のサーバーが有効にした場合は、すべてが無効にするまで使える
+  BOOST_CHECK(cbb::FileControl::EnableChunkStore(cbb::kCompressLZ4, 0, 4096));
+  BOOST_CHECK(cbb::FileControl::EnableChunkStore(cbb::kCompressLZ4, 0, 4096));
+  cbb::FileControl::DisableChunkStore();
+  BOOST_CHECK(cbb::FileControl::is_compress_enabled());
+  cbb::FileControl::DisableChunkStore();
+  BOOST_CHECK(!cbb::FileControl::is_compress_enabled());
+
+  // 有効にしていない分の無効化は数えない
+  cbb::FileControl::DisableChunkStore();
+  BOOST_CHECK(cbb::FileControl::EnableChunkStore(cbb::kCompressLZ4, 0, 4096));
+  BOOST_CHECK(cbb::FileControl::is_compress_enabled());
+  cbb::FileControl::DisableChunkStore();
+  BOOST_CHECK(!cbb::FileControl::is_compress_enabled());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,103 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include <pthread.h>
+
+#include "test_common.h"
+#include "cbb/file_table.h"
+
+// ファイルハンドルテーブルクラスユニットテスト
+
+// 並行テストのスレッド数と1スレッドあたりの繰り返し回数
+#define FILE_TABLE_THREADS 4
+#define FILE_TABLE_LOOPS 10000
+
+/**
+ * @breaf 登録、参照、解除を繰り返すスレッド
+ * @param data ファイルテーブル
+ * @return 失敗回数
+ */
+static void *insert_remove(void *data) {
+  cbb::FileTable *table = (cbb::FileTable *)data;
+  uintptr_t failures = 0;
+
+  cbb::File file;
+  file.path = "/thread";
+  for (int loop = 0; loop < FILE_TABLE_LOOPS; loop++) {
+    file.fd = loop;
+    uint64_t handle = table->Insert(file);
+    const cbb::File *found = table->Lookup(handle);
+    if (handle == 0 || found == NULL || found->fd != (uint64_t)loop || !table->Remove(handle)) {
+      failures++;
+    }
+  }
+  return (void *)failures;
+}
+
+BOOST_AUTO_TEST_SUITE_EX(file_table)
+
+BOOST_AUTO_TEST_CASE(insert_lookup_remove)
+{
+  cbb::FileTable table(2);
+
+  cbb::File file;
+  file.path = "/a";
+  uint64_t first = table.Insert(file);
+  file.path = "/b";
+  uint64_t second = table.Insert(file);
+  BOOST_CHECK(first != 0 && second != 0 && first != second);
+  BOOST_CHECK(table.used() == 2);
+
+  // 空きがない
+  BOOST_CHECK(table.Insert(file) == 0);
+
+  BOOST_CHECK(table.Lookup(first)->path == "/a");
+  BOOST_CHECK(table.Lookup(second)->path == "/b");
+  BOOST_CHECK(table.Lookup(0) == NULL);
+  BOOST_CHECK(table.Lookup(3) == NULL);
+
+  // 解除したハンドルは、同じスロットを再利用しても無効
+  BOOST_CHECK(table.Remove(first));
+  BOOST_CHECK(!table.Remove(first));
+  BOOST_CHECK(table.Lookup(first) == NULL);
+  file.path = "/c";
+  uint64_t third = table.Insert(file);
+  BOOST_CHECK((uint32_t)third == (uint32_t)first);
+  BOOST_CHECK(third != first);
+  BOOST_CHECK(table.Lookup(first) == NULL);
+  BOOST_CHECK(table.Lookup(third)->path == "/c");
+  BOOST_CHECK(table.used() == 2);
+}
+
+BOOST_AUTO_TEST_CASE(concurrent)
+{
+  cbb::FileTable table(FILE_TABLE_THREADS);
+
+  pthread_t threads[FILE_TABLE_THREADS];
+  for (int index = 0; index < FILE_TABLE_THREADS; index++) {
+    pthread_create(&threads[index], NULL, insert_remove, &table);
+  }
+
+  uintptr_t failures = 0;
+  for (int index = 0; index < FILE_TABLE_THREADS; index++) {
+    void *result;
+    pthread_join(threads[index], &result);
+    failures += (uintptr_t)result;
+  }
+  BOOST_CHECK(failures == 0);
+  BOOST_CHECK(table.used() == 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
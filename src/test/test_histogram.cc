@@ -0,0 +1,63 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "test_common.h"
+#include "util/histogram.h"
+
+// ヒストグラムクラスユニットテスト
+
+BOOST_AUTO_TEST_SUITE_EX(histogram)
+
+BOOST_AUTO_TEST_CASE(bucket)
+{
+  for (uint64_t value = 0; value < 100000; value++) {
+    int index = cbb::Histogram::BucketIndex(value);
+
+    BOOST_CHECK(index >= 0 && index < cbb::Histogram::kBucketCount);
+    BOOST_CHECK(value <= cbb::Histogram::BucketUpperBound(index));
+    if (index > 0) {
+      BOOST_CHECK(value > cbb::Histogram::BucketUpperBound(index - 1));
+    }
+  }
+
+  BOOST_CHECK(cbb::Histogram::BucketIndex(~(uint64_t)0) == cbb::Histogram::kBucketCount - 1);
+}
+
+BOOST_AUTO_TEST_CASE(percentile)
+{
+  cbb::Histogram histogram;
+
+  BOOST_CHECK(histogram.Percentile(99.0) == 0);
+
+  for (uint64_t value = 1; value <= 1000; value++) {
+    histogram.Record(value);
+  }
+
+  BOOST_CHECK(histogram.count() == 1000);
+  BOOST_CHECK(histogram.sum() == 500500);
+  BOOST_CHECK(histogram.max() == 1000);
+
+  uint64_t p50 = histogram.Percentile(50.0);
+  uint64_t p99 = histogram.Percentile(99.0);
+
+  BOOST_CHECK(p50 >= 500 && p50 <= 500 * 107 / 100);
+  BOOST_CHECK(p99 >= 990 && p99 <= 1000);
+  BOOST_CHECK(histogram.Percentile(100.0) == 1000);
+
+  histogram.Reset();
+  BOOST_CHECK(histogram.count() == 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
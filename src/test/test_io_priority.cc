@@ -0,0 +1,138 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "test_common.h"
+#include "util/io_priority.h"
+
+// I/O優先度クラスユニットテスト
+
+static cbb::BackgroundStats snapshot(cbb::IoPriority &priority) {
+  cbb::BackgroundStats stats;
+  priority.Snapshot(&stats);
+  return stats;
+}
+
+BOOST_AUTO_TEST_SUITE_EX(io_priority)
+
+BOOST_AUTO_TEST_CASE(scope)
+{
+  cbb::IoPriority priority;
+  priority.SetPolicy(1, 0, 50, false);
+  BOOST_CHECK(!cbb::IoPriority::is_background());
+  {
+    cbb::IoPriority::BackgroundScope background_scope(priority);
+    BOOST_CHECK(cbb::IoPriority::is_background());
+    BOOST_CHECK(cbb::IoPriority::is_paced());
+    BOOST_CHECK(snapshot(priority).active == 1);
+    {
+      cbb::IoPriority::BackgroundScope nested_scope(priority);
+      BOOST_CHECK(snapshot(priority).active == 1);
+    }
+    BOOST_CHECK(cbb::IoPriority::is_background());
+  }
+  BOOST_CHECK(!cbb::IoPriority::is_background());
+  BOOST_CHECK(snapshot(priority).active == 0);
+
+  // フォアグラウンドのスレッドは止めない
+  cbb::BackgroundStats before = snapshot(priority);
+  {
+    cbb::IoPriority::ForegroundScope foreground_scope(priority);
+    BOOST_CHECK(snapshot(priority).foreground == 1);
+    cbb::IoPriority::Pace(100);
+  }
+  cbb::BackgroundStats after = snapshot(priority);
+  BOOST_CHECK(after.foreground == 0);
+  BOOST_CHECK(after.bytes == before.bytes);
+  BOOST_CHECK(after.deferred == before.deferred);
+}
+
+BOOST_AUTO_TEST_CASE(pace)
+{
+  cbb::IoPriority priority;
+  priority.SetPolicy(1, 0, 50, false);
+  cbb::IoPriority::BackgroundScope background_scope(priority);
+
+  // フォアグラウンドがなければ止めない
+  cbb::BackgroundStats before = snapshot(priority);
+  cbb::IoPriority::Pace(100);
+  cbb::BackgroundStats after = snapshot(priority);
+  BOOST_CHECK(after.bytes == before.bytes + 100);
+  BOOST_CHECK(after.deferred == before.deferred);
+
+  // 処理中の間は上限まで止める
+  before = after;
+  priority.EnterForeground();
+  uint64_t start = cbb::get_time_msec();
+  cbb::IoPriority::Pace(100);
+  BOOST_CHECK(cbb::get_time_msec() - start >= 50);
+  priority.LeaveForeground();
+  after = snapshot(priority);
+  BOOST_CHECK(after.deferred == before.deferred + 1);
+  BOOST_CHECK(after.forced == before.forced + 1);
+  BOOST_CHECK(after.deferred_msec >= before.deferred_msec + 50);
+
+  // 処理数が下回ってから idle_msec の間は止める
+  priority.SetPolicy(1, 30, 1000, false);
+  before = after;
+  {
+    cbb::IoPriority::ForegroundScope foreground_scope(priority);
+  }
+  start = cbb::get_time_msec();
+  cbb::IoPriority::Pace(100);
+  BOOST_CHECK(cbb::get_time_msec() - start >= 20);
+  after = snapshot(priority);
+  BOOST_CHECK(after.deferred == before.deferred + 1);
+  BOOST_CHECK(after.forced == before.forced);
+
+  // 止めない設定
+  priority.SetPolicy(0, 0, 0, false);
+  before = after;
+  priority.EnterForeground();
+  cbb::IoPriority::Pace(100);
+  priority.LeaveForeground();
+  after = snapshot(priority);
+  BOOST_CHECK(after.deferred == before.deferred);
+  BOOST_CHECK(!cbb::IoPriority::is_paced());
+}
+
+BOOST_AUTO_TEST_CASE(instances)
+{
+  // 同じプロセスのサーバーごとに設定と処理数を持つ
+  cbb::IoPriority priority;
+  cbb::IoPriority other;
+  priority.SetPolicy(1, 0, 50, false);
+  other.SetPolicy(0, 0, 0, false);
+
+  other.EnterForeground();
+  BOOST_CHECK(snapshot(priority).foreground == 0);
+  {
+    cbb::IoPriority::BackgroundScope background_scope(priority);
+    BOOST_CHECK(cbb::IoPriority::is_paced());
+    cbb::IoPriority::Pace(100);
+    BOOST_CHECK(snapshot(priority).deferred == 0);
+    BOOST_CHECK(snapshot(other).bytes == 0);
+  }
+  other.LeaveForeground();
+
+  {
+    cbb::IoPriority::BackgroundScope background_scope(other);
+    BOOST_CHECK(!cbb::IoPriority::is_paced());
+    BOOST_CHECK(snapshot(other).active == 1);
+    BOOST_CHECK(snapshot(priority).active == 0);
+  }
+  BOOST_CHECK(snapshot(priority).bytes == 100);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
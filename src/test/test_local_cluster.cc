@@ -0,0 +1,365 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "test_common.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <set>
+#include <vector>
+
+#include "cbb/local_cluster.h"
+#include "cbb/burst_buffer_client.h"
+
+// ローカルクラスタ (1プロセス内の複数サーバー) ユニットテスト
+
+BOOST_AUTO_TEST_SUITE_EX(local_cluster)
+
+BOOST_AUTO_TEST_CASE(start_stop)
+{
+  cbb::LocalCluster cluster;
+
+  BOOST_REQUIRE(cluster.Start(3) == cbb::kCBBSuccess);
+  BOOST_CHECK(cluster.server_count() == 3);
+
+  std::set<int> ports;
+  for (int index = 0; index < cluster.server_count(); index++) {
+    ports.insert(cluster.port(index));
+    BOOST_CHECK(access(cluster.local_path(index).c_str(), F_OK) == 0);
+    BOOST_CHECK(access(cluster.secondary_path(index).c_str(), F_OK) == 0);
+  }
+  BOOST_CHECK(ports.size() == 3);
+
+  cbb::Settings settings = cluster.client_settings();
+  BOOST_CHECK(settings.client_hosts().size() == 3);
+
+  std::string root_path = cluster.root_path();
+  cluster.Stop();
+  BOOST_CHECK(cluster.server_count() == 0);
+  BOOST_CHECK(access(root_path.c_str(), F_OK) != 0);
+}
+
+BOOST_AUTO_TEST_CASE(client_io)
+{
+  cbb::LocalCluster cluster;
+  BOOST_REQUIRE(cluster.Start(3) == cbb::kCBBSuccess);
+
+  cbb::BurstBufferClient client;
+  BOOST_REQUIRE(client.Init(cluster.client_settings()) == cbb::kCBBSuccess);
+  BOOST_CHECK(client.server_list().size() == 3);
+
+  const char data[] = "local cluster test data";
+  for (int loop = 0; loop < 10; loop++) {
+    char path[256];
+    sprintf(path, "/cluster_test_%02d.txt", loop);
+
+    cbb::File file;
+    ssize_t ssize = 0;
+    BOOST_REQUIRE(client.Create(path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR, &file) == cbb::kCBBSuccess);
+    BOOST_CHECK(client.Write(file, data, sizeof(data), 0, &ssize) == cbb::kCBBSuccess);
+    BOOST_CHECK(ssize == sizeof(data));
+    BOOST_CHECK(client.Release(file) == cbb::kCBBSuccess);
+
+    char buf[sizeof(data)];
+    BOOST_REQUIRE(client.Open(path, O_RDONLY, &file) == cbb::kCBBSuccess);
+    BOOST_CHECK(client.Read(file, buf, sizeof(buf), 0, &ssize) == cbb::kCBBSuccess);
+    BOOST_CHECK(ssize == sizeof(data));
+    BOOST_CHECK(memcmp(buf, data, sizeof(data)) == 0);
+    BOOST_CHECK(client.Release(file) == cbb::kCBBSuccess);
+
+    cbb::FileStat file_stat;
+    BOOST_CHECK(client.GetAttr(path, &file_stat) == cbb::kCBBSuccess);
+    BOOST_CHECK(file_stat.st_size == sizeof(data));
+  }
+
+  cbb::FileStats file_stats;
+  BOOST_CHECK(client.ReadDir("/", 0, &file_stats, cbb::kDirAll) == cbb::kCBBSuccess);
+  int count = 0;
+  for (cbb::FileStats::iterator it = file_stats.begin(); it != file_stats.end(); ++it) {
+    if (it->first.find("cluster_test_") == 0) {
+      count++;
+    }
+  }
+  BOOST_CHECK(count == 10);
+
+  for (int loop = 0; loop < 10; loop++) {
+    char path[256];
+    sprintf(path, "/cluster_test_%02d.txt", loop);
+    client.Unlink(path);
+  }
+
+  client.Destroy();
+  cluster.Stop();
+}
+
+BOOST_AUTO_TEST_CASE(striped_io)
+{
+  cbb::LocalCluster cluster;
+  BOOST_REQUIRE(cluster.Start(3) == cbb::kCBBSuccess);
+
+  cbb::Settings settings = cluster.client_settings();
+  settings.set_client_stripe(4096, 0);
+
+  cbb::BurstBufferClient client;
+  BOOST_REQUIRE(client.Init(settings) == cbb::kCBBSuccess);
+
+  // ストライプ境界をまたぐ書き込み
+  std::vector<char> data(4096 * 7 + 100);
+  for (size_t index = 0; index < data.size(); index++) {
+    data[index] = (char)(index * 7 + 3);
+  }
+
+  cbb::File file;
+  ssize_t ssize = 0;
+  BOOST_REQUIRE(client.Create("/striped.bin", O_CREAT | O_RDWR, S_IRUSR | S_IWUSR, &file) == cbb::kCBBSuccess);
+  BOOST_CHECK(file.is_striped());
+  BOOST_CHECK(file.stripes.size() == 3);
+  BOOST_CHECK(client.Write(file, &data[0], 1000, 0, &ssize) == cbb::kCBBSuccess);
+  BOOST_CHECK(client.Write(file, &data[1000], data.size() - 1000, 1000, &ssize) == cbb::kCBBSuccess);
+  BOOST_CHECK(ssize == (ssize_t)data.size() - 1000);
+  BOOST_CHECK(client.Release(file) == cbb::kCBBSuccess);
+
+  // 論理サイズはオーナーサーバーに反映される
+  cbb::FileStat file_stat;
+  BOOST_CHECK(client.GetAttr("/striped.bin", &file_stat) == cbb::kCBBSuccess);
+  BOOST_CHECK(file_stat.st_size == (off_t)data.size());
+
+  std::vector<char> buf(data.size() + 4096);
+  BOOST_REQUIRE(client.Open("/striped.bin", O_RDONLY, &file) == cbb::kCBBSuccess);
+  BOOST_CHECK(file.stripe_size == 4096);
+  BOOST_CHECK(client.Read(file, &buf[0], buf.size(), 0, &ssize) == cbb::kCBBSuccess);
+  BOOST_CHECK(ssize == (ssize_t)data.size());
+  BOOST_CHECK(memcmp(&buf[0], &data[0], data.size()) == 0);
+  BOOST_CHECK(client.Read(file, &buf[0], 5000, 3000, &ssize) == cbb::kCBBSuccess);
+  BOOST_CHECK(ssize == 5000);
+  BOOST_CHECK(memcmp(&buf[0], &data[3000], 5000) == 0);
+  BOOST_CHECK(client.Release(file) == cbb::kCBBSuccess);
+
+  // 穴のあるファイルは0で読める
+  std::vector<char> zero(4096, 0);
+  BOOST_REQUIRE(client.Create("/sparse.bin", O_CREAT | O_RDWR, S_IRUSR | S_IWUSR, &file) == cbb::kCBBSuccess);
+  BOOST_CHECK(client.Write(file, &data[0], 10, 4096 * 2, &ssize) == cbb::kCBBSuccess);
+  BOOST_CHECK(client.Read(file, &buf[0], buf.size(), 0, &ssize) == cbb::kCBBSuccess);
+  BOOST_CHECK(ssize == 4096 * 2 + 10);
+  BOOST_CHECK(memcmp(&buf[0], &zero[0], 4096) == 0);
+  BOOST_CHECK(memcmp(&buf[4096 * 2], &data[0], 10) == 0);
+  BOOST_CHECK(client.Release(file) == cbb::kCBBSuccess);
+
+  BOOST_CHECK(client.Rename("/striped.bin", "/striped2.bin") == cbb::kCBBSuccess);
+  BOOST_REQUIRE(client.Open("/striped2.bin", O_RDONLY, &file) == cbb::kCBBSuccess);
+  BOOST_CHECK(client.Read(file, &buf[0], buf.size(), 0, &ssize) == cbb::kCBBSuccess);
+  BOOST_CHECK(ssize == (ssize_t)data.size());
+  BOOST_CHECK(memcmp(&buf[0], &data[0], data.size()) == 0);
+  BOOST_CHECK(client.Release(file) == cbb::kCBBSuccess);
+
+  BOOST_CHECK(client.Unlink("/striped2.bin") == cbb::kCBBSuccess);
+  BOOST_CHECK(client.Unlink("/sparse.bin") == cbb::kCBBSuccess);
+  for (int index = 0; index < cluster.server_count(); index++) {
+    BOOST_CHECK(access((cluster.local_path(index) + "/striped2.bin").c_str(), F_OK) != 0);
+  }
+
+  client.Destroy();
+  cluster.Stop();
+}
+
+BOOST_AUTO_TEST_CASE(replicated_read)
+{
+  cbb::LocalCluster cluster;
+  BOOST_REQUIRE(cluster.Start(3) == cbb::kCBBSuccess);
+  for (int index = 0; index < cluster.server_count(); index++) {
+    cluster.server(index)->SetReplicaPolicy(2, 0, "/hot*");
+  }
+
+  // ランクの違うクライアント
+  cbb::BurstBufferClient clients[3];
+  for (int index = 0; index < 3; index++) {
+    char rank[16];
+    sprintf(rank, "%d", index);
+    setenv("PMI_RANK", rank, 1);
+    BOOST_REQUIRE(clients[index].Init(cluster.client_settings()) == cbb::kCBBSuccess);
+  }
+  unsetenv("PMI_RANK");
+
+  const char data[] = "replicated data";
+  cbb::File file;
+  ssize_t ssize = 0;
+  BOOST_REQUIRE(clients[0].Create("/hot.bin", O_CREAT | O_RDWR, S_IRUSR | S_IWUSR, &file) == cbb::kCBBSuccess);
+  BOOST_CHECK(clients[0].Write(file, data, sizeof(data), 0, &ssize) == cbb::kCBBSuccess);
+  BOOST_CHECK(clients[0].Release(file) == cbb::kCBBSuccess);
+
+  // 最初の読み込みオープンで複製が始まる
+  BOOST_REQUIRE(clients[0].Open("/hot.bin", O_RDONLY, &file) == cbb::kCBBSuccess);
+  BOOST_CHECK(!file.replica);
+  BOOST_CHECK(clients[0].Release(file) == cbb::kCBBSuccess);
+
+  int replica_files = 0;
+  for (int loop = 0; loop < 100 && replica_files < 2; loop++) {
+    usleep(50 * 1000);
+    replica_files = 0;
+    for (int index = 0; index < cluster.server_count(); index++) {
+      if (access((cluster.local_path(index) + "/" REPLICA_DIR_NAME "/hot.bin").c_str(), F_OK) == 0) {
+        replica_files++;
+      }
+    }
+  }
+  BOOST_CHECK(replica_files == 2);
+
+  int replica_opens = 0;
+  for (int index = 0; index < 3; index++) {
+    char buf[sizeof(data)];
+    BOOST_REQUIRE(clients[index].Open("/hot.bin", O_RDONLY, &file) == cbb::kCBBSuccess);
+    if (file.replica) {
+      replica_opens++;
+    }
+    BOOST_CHECK(clients[index].Read(file, buf, sizeof(buf), 0, &ssize) == cbb::kCBBSuccess);
+    BOOST_CHECK(ssize == sizeof(data));
+    BOOST_CHECK(memcmp(buf, data, sizeof(data)) == 0);
+    BOOST_CHECK(clients[index].Release(file) == cbb::kCBBSuccess);
+  }
+  BOOST_CHECK(replica_opens == 2);
+
+  // 書き込みでレプリカは使われなくなる
+  const char new_data[] = "rewritten data!";
+  BOOST_REQUIRE(clients[1].Open("/hot.bin", O_WRONLY, &file) == cbb::kCBBSuccess);
+  BOOST_CHECK(!file.replica);
+  BOOST_CHECK(clients[1].Write(file, new_data, sizeof(new_data), 0, &ssize) == cbb::kCBBSuccess);
+  BOOST_CHECK(clients[1].Release(file) == cbb::kCBBSuccess);
+
+  for (int index = 0; index < 3; index++) {
+    char buf[sizeof(new_data)];
+    BOOST_REQUIRE(clients[index].Open("/hot.bin", O_RDONLY, &file) == cbb::kCBBSuccess);
+    BOOST_CHECK(clients[index].Read(file, buf, sizeof(buf), 0, &ssize) == cbb::kCBBSuccess);
+    BOOST_CHECK(memcmp(buf, new_data, sizeof(new_data)) == 0);
+    BOOST_CHECK(clients[index].Release(file) == cbb::kCBBSuccess);
+  }
+
+  // レプリカはディレクトリ一覧に出ない
+  cbb::FileStats file_stats;
+  BOOST_CHECK(clients[0].ReadDir("/", 0, &file_stats, cbb::kDirAll) == cbb::kCBBSuccess);
+  BOOST_CHECK(file_stats.find(REPLICA_DIR_NAME) == file_stats.end());
+
+  clients[0].Unlink("/hot.bin");
+  for (int index = 0; index < 3; index++) {
+    clients[index].Destroy();
+  }
+  cluster.Stop();
+}
+
+BOOST_AUTO_TEST_CASE(membership)
+{
+  cbb::LocalCluster cluster;
+  BOOST_REQUIRE(cluster.Start(2) == cbb::kCBBSuccess);
+
+  cbb::BurstBufferClient client;
+  BOOST_REQUIRE(client.Init(cluster.client_settings()) == cbb::kCBBSuccess);
+
+  const int file_count = 20;
+  for (int loop = 0; loop < file_count; loop++) {
+    char path[256];
+    sprintf(path, "/member_%02d.txt", loop);
+
+    cbb::File file;
+    ssize_t ssize = 0;
+    BOOST_REQUIRE(client.Create(path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR, &file) == cbb::kCBBSuccess);
+    BOOST_CHECK(client.Write(file, path, strlen(path) + 1, 0, &ssize) == cbb::kCBBSuccess);
+    BOOST_CHECK(client.Release(file) == cbb::kCBBSuccess);
+  }
+
+  // サーバーを追加して構成を変更する (準備 → 確定)
+  BOOST_REQUIRE(cluster.AddServer() == cbb::kCBBSuccess);
+
+  cbb::Membership current;
+  current.hosts.push_back(cluster.address(0));
+  current.hosts.push_back(cluster.address(1));
+  cbb::Membership next;
+  next.epoch = 1;
+  next.hosts = current.hosts;
+  next.hosts.push_back(cluster.address(2));
+  next.virtual_nodes = 16;
+
+  cbb::BurstBufferClient admin;
+  BOOST_REQUIRE(admin.Init(cluster.client_settings()) == cbb::kCBBSuccess);
+  for (int commit = 0; commit <= 1; commit++) {
+    for (int index = 0; index < cluster.server_count(); index++) {
+      cbb::ServerInfo info("127.0.0.1", cluster.port(index));
+      BOOST_REQUIRE(admin.SetMembership(info, current, next, cluster.address(index), commit != 0) == cbb::kCBBSuccess);
+    }
+  }
+
+  bool is_migrating = true;
+  for (int loop = 0; loop < 200 && is_migrating; loop++) {
+    usleep(50 * 1000);
+    is_migrating = false;
+    for (int index = 0; index < cluster.server_count(); index++) {
+      cbb::Membership membership;
+      bool is_server_migrating = false;
+      BOOST_REQUIRE(admin.GetMembership(cbb::ServerInfo("127.0.0.1", cluster.port(index)),
+                                        &membership, &is_server_migrating) == cbb::kCBBSuccess);
+      BOOST_CHECK(membership.epoch == 1);
+      is_migrating = is_migrating || is_server_migrating;
+    }
+  }
+  BOOST_CHECK(!is_migrating);
+
+  // 各ファイルはいずれか1台のLocalストレージだけにあり、追加したサーバーにも移っている
+  int added_files = 0;
+  for (int loop = 0; loop < file_count; loop++) {
+    char path[256];
+    sprintf(path, "/member_%02d.txt", loop);
+
+    int copies = 0;
+    for (int index = 0; index < cluster.server_count(); index++) {
+      if (access((cluster.local_path(index) + path).c_str(), F_OK) == 0) {
+        copies++;
+        added_files += index == 2 ? 1 : 0;
+      }
+    }
+    BOOST_CHECK(copies == 1);
+  }
+  BOOST_CHECK(added_files > 0);
+
+  // 古い構成のクライアントも構成を取り直して読める
+  for (int loop = 0; loop < file_count; loop++) {
+    char path[256];
+    sprintf(path, "/member_%02d.txt", loop);
+
+    cbb::File file;
+    char buf[256];
+    ssize_t ssize = 0;
+    BOOST_REQUIRE(client.Open(path, O_RDONLY, &file) == cbb::kCBBSuccess);
+    BOOST_CHECK(client.Read(file, buf, sizeof(buf), 0, &ssize) == cbb::kCBBSuccess);
+    BOOST_CHECK(ssize == (ssize_t)strlen(path) + 1);
+    BOOST_CHECK(strcmp(buf, path) == 0);
+    BOOST_CHECK(client.Release(file) == cbb::kCBBSuccess);
+
+    cbb::FileStat file_stat;
+    BOOST_CHECK(client.GetAttr(path, &file_stat) == cbb::kCBBSuccess);
+    BOOST_CHECK(file_stat.st_size == (off_t)strlen(path) + 1);
+  }
+  BOOST_CHECK(client.server_list().size() == 3);
+
+  for (int loop = 0; loop < file_count; loop++) {
+    char path[256];
+    sprintf(path, "/member_%02d.txt", loop);
+    client.Unlink(path);
+  }
+  client.Destroy();
+  admin.Destroy();
+  cluster.Stop();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,191 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "test_common.h"
+#include "util/local_devices.h"
+
+#define DEVICE0 TEST_WORKSPACE "/local_device0"
+#define DEVICE1 TEST_WORKSPACE "/local_device1"
+#define PLACE_THREADS 4
+#define PLACE_FILES 64
+
+// Localストレージの複数デバイス管理クラスユニットテスト
+
+static cbb::DeviceLoad make_load(uint64_t free_bytes, uint64_t total_bytes, int open_files) {
+  cbb::DeviceLoad load;
+  load.free_bytes = free_bytes;
+  load.total_bytes = total_bytes;
+  load.open_files = open_files;
+  return load;
+}
+
+static void touch(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT, S_IREAD | S_IWRITE);
+  if (fd != -1) {
+    close(fd);
+  }
+}
+
+/**
+ * @breaf 同じパスのファイルを配置して作るスレッド
+ * @param data デバイス管理
+ * @return NULL
+ */
+static void *place_files(void *data) {
+  cbb::LocalDevices *devices = (cbb::LocalDevices *)data;
+  const char *roots[] = { DEVICE0, DEVICE1 };
+  for (int index = 0; index < PLACE_FILES; index++) {
+    char path[32];
+    int size = snprintf(path, sizeof(path), "/place.%d", index);
+    cbb::LocalDevices::PlaceScope place(*devices, path, size);
+    int device = devices->Place(path, size);
+    std::string target = std::string(roots[device]) + path;
+    touch(target.c_str());
+  }
+  return NULL;
+}
+
+BOOST_AUTO_TEST_SUITE_EX(local_devices)
+
+BOOST_AUTO_TEST_CASE(choose)
+{
+  std::vector<cbb::DeviceLoad> loads;
+  loads.push_back(make_load(100, 1000, 0));
+  loads.push_back(make_load(500, 1000, 0));
+  loads.push_back(make_load(300, 1000, 0));
+
+  // 空き容量の多いデバイス
+  BOOST_CHECK(cbb::LocalDevices::Choose(loads) == 1);
+
+  // 開いているファイルの多いデバイスは避ける
+  loads[1].open_files = 4;
+  BOOST_CHECK(cbb::LocalDevices::Choose(loads) == 2);
+
+  // 予備の容量を下回るデバイスには置かない
+  loads[1].open_files = 0;
+  loads[1].free_bytes = 10;
+  loads[2].free_bytes = 20;
+  BOOST_CHECK(cbb::LocalDevices::Choose(loads) == 0);
+
+  // すべてのデバイスが下回る場合は空いているデバイス
+  loads[0].free_bytes = 5;
+  BOOST_CHECK(cbb::LocalDevices::Choose(loads) == 2);
+
+  // 同じ場合は先頭のデバイス
+  loads.assign(2, make_load(100, 1000, 1));
+  BOOST_CHECK(cbb::LocalDevices::Choose(loads) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(locate_place)
+{
+  mkdir(DEVICE0, S_IRWXU);
+  mkdir(DEVICE0 "/dir", S_IRWXU);
+  mkdir(DEVICE1, S_IRWXU);
+  mkdir(DEVICE1 "/dir", S_IRWXU);
+  touch(DEVICE1 "/dir/file");
+
+  std::vector<std::string> roots;
+  roots.push_back(DEVICE0);
+  roots.push_back(DEVICE1);
+  cbb::LocalDevices devices;
+  devices.Init(roots);
+  BOOST_CHECK(devices.size() == 2);
+
+  // ファイルは置いたデバイス、ディレクトリは先頭のデバイス、無ければ-1
+  BOOST_CHECK(devices.Locate("/dir/file", 9) == 1);
+  BOOST_CHECK(devices.Locate("/dir", 4) == 0);
+  BOOST_CHECK(devices.Locate("/dir/none", 9) == -1);
+
+  // 既にあるファイルはそのデバイスに置く
+  BOOST_CHECK(devices.Place("/dir/file", 9) == 1);
+  int device = devices.Place("/dir/new", 8);
+  BOOST_CHECK(device == 0 || device == 1);
+
+  // 読み書きはストライプごとのデバイスに数える
+  devices.Open(3, 1, 0, 1);
+  devices.AddBytes(3, 0, 100, true);
+  devices.Open(4, 0, 10, 2);
+  devices.AddBytes(4, 5, 20, false);
+
+  std::vector<cbb::DeviceStats> stats;
+  devices.Snapshot(&stats);
+  BOOST_CHECK(stats.size() == 2);
+  BOOST_CHECK(stats[0].root == DEVICE0);
+  BOOST_CHECK(stats[1].open_files == 2);
+  BOOST_CHECK(stats[1].bytes_written == 100);
+  BOOST_CHECK(stats[0].bytes_read == 10);
+  BOOST_CHECK(stats[1].bytes_read == 10);
+  BOOST_CHECK(stats[0].total_bytes > 0);
+
+  devices.Close(3);
+  devices.Close(4);
+  devices.Close(4);
+  devices.Snapshot(&stats);
+  BOOST_CHECK(stats[0].open_files == 0 && stats[1].open_files == 0);
+
+  struct statvfs st;
+  BOOST_CHECK(devices.StatVfs(&st) == 0);
+  BOOST_CHECK(st.f_blocks > 0);
+
+  unlink(DEVICE1 "/dir/file");
+  rmdir(DEVICE1 "/dir");
+  rmdir(DEVICE1);
+  rmdir(DEVICE0 "/dir");
+  rmdir(DEVICE0);
+}
+
+BOOST_AUTO_TEST_CASE(place_scope)
+{
+  mkdir(DEVICE0, S_IRWXU);
+  mkdir(DEVICE1, S_IRWXU);
+
+  std::vector<std::string> roots;
+  roots.push_back(DEVICE0);
+  roots.push_back(DEVICE1);
+  cbb::LocalDevices devices;
+  devices.Init(roots);
+
+  // 同時に同じパスを配置しても、ファイルはいずれか1つのデバイスにだけ作られる
+  pthread_t threads[PLACE_THREADS];
+  for (int index = 0; index < PLACE_THREADS; index++) {
+    pthread_create(&threads[index], NULL, place_files, &devices);
+  }
+  for (int index = 0; index < PLACE_THREADS; index++) {
+    pthread_join(threads[index], NULL);
+  }
+
+  for (int index = 0; index < PLACE_FILES; index++) {
+    char path0[64];
+    char path1[64];
+    snprintf(path0, sizeof(path0), DEVICE0 "/place.%d", index);
+    snprintf(path1, sizeof(path1), DEVICE1 "/place.%d", index);
+    bool exists0 = access(path0, F_OK) == 0;
+    bool exists1 = access(path1, F_OK) == 0;
+    BOOST_CHECK(exists0 != exists1);
+    unlink(path0);
+    unlink(path1);
+  }
+
+  rmdir(DEVICE1);
+  rmdir(DEVICE0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,97 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "test_common.h"
+#include "util/logger.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// ロガークラスユニットテスト
+
+BOOST_AUTO_TEST_SUITE_EX(logger)
+
+BOOST_AUTO_TEST_CASE(parse_level)
+{
+  BOOST_CHECK(cbb::Logger::ParseLevel("debug", -1) == cbb::kLogDebug);
+  BOOST_CHECK(cbb::Logger::ParseLevel("info", -1) == cbb::kLogInfo);
+  BOOST_CHECK(cbb::Logger::ParseLevel("warn", -1) == cbb::kLogWarn);
+  BOOST_CHECK(cbb::Logger::ParseLevel("error", -1) == cbb::kLogError);
+  BOOST_CHECK(cbb::Logger::ParseLevel("none", -1) == cbb::kLogNone);
+  BOOST_CHECK(cbb::Logger::ParseLevel("unknown", -1) == -1);
+}
+
+BOOST_AUTO_TEST_CASE(write)
+{
+  char path[] = "/tmp/cbb_test_logger_XXXXXX";
+  int fd = mkstemp(path);
+  BOOST_REQUIRE(fd >= 0);
+  close(fd);
+
+  BOOST_REQUIRE(cbb::Logger::Open(path, cbb::kLogWarn));
+  BOOST_CHECK(!cbb::Logger::is_enabled(cbb::kLogInfo));
+  BOOST_CHECK(cbb::Logger::is_enabled(cbb::kLogError));
+
+  cbb::Logger::Write(cbb::kLogInfo, "filtered %d\n", 1);
+  cbb::Logger::Write(cbb::kLogError, "logged %d\n", 2);
+  cbb::Logger::Flush();
+
+  FILE *fp = fopen(path, "r");
+  BOOST_REQUIRE(fp != NULL);
+  char line[256];
+  int lines = 0;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    BOOST_CHECK(strstr(line, "E logged 2\n") != NULL);
+    lines++;
+  }
+  fclose(fp);
+  BOOST_CHECK(lines == 1);
+
+  cbb::Logger::Close();
+  unlink(path);
+}
+
+BOOST_AUTO_TEST_CASE(reopen)
+{
+  char path[] = "/tmp/cbb_test_logger_XXXXXX";
+  int fd = mkstemp(path);
+  BOOST_REQUIRE(fd >= 0);
+  close(fd);
+
+  // Close の後に開き直した場合もフラッシュスレッドが出力する
+  BOOST_REQUIRE(cbb::Logger::Open(path, cbb::kLogInfo));
+  cbb::Logger::Close();
+  BOOST_REQUIRE(cbb::Logger::Open(path, cbb::kLogInfo));
+  cbb::Logger::Write(cbb::kLogInfo, "reopened\n");
+
+  bool is_found = false;
+  for (int i = 0; i < 100 && !is_found; i++) {
+    usleep(10000);
+    FILE *fp = fopen(path, "r");
+    BOOST_REQUIRE(fp != NULL);
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      is_found = is_found || strstr(line, "I reopened\n") != NULL;
+    }
+    fclose(fp);
+  }
+  BOOST_CHECK(is_found);
+
+  cbb::Logger::Close();
+  unlink(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,119 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "test_common.h"
+#include "cbb/placement_directory.h"
+
+#include <unistd.h>
+
+#include <boost/format.hpp>
+
+// 配置ディレクトリクラスユニットテスト
+
+BOOST_AUTO_TEST_SUITE_EX(placement_directory)
+
+static std::string test_placement_file() {
+  return (boost::format("/tmp/cbb_test_placement.%1%") % getpid()).str();
+}
+
+BOOST_AUTO_TEST_CASE(set_lookup)
+{
+  unlink(test_placement_file().c_str());
+
+  cbb::PlacementDirectory directory;
+  BOOST_REQUIRE(directory.Open(test_placement_file()) == cbb::kCBBSuccess);
+  BOOST_CHECK(directory.size() == 0);
+
+  cbb::ServerInfo info;
+  BOOST_CHECK(!directory.Lookup("/a/b.dat", &info));
+
+  BOOST_CHECK(directory.Set("/a/b.dat", cbb::ServerInfo("127.0.0.2", 9102)) == cbb::kCBBSuccess);
+  BOOST_REQUIRE(directory.Lookup("/a/b.dat", &info));
+  BOOST_CHECK(info.host == "127.0.0.2" && info.port == 9102);
+
+  // 上書き
+  BOOST_CHECK(directory.Set("/a/b.dat", cbb::ServerInfo("127.0.0.3", 9103)) == cbb::kCBBSuccess);
+  BOOST_REQUIRE(directory.Lookup("/a/b.dat", &info));
+  BOOST_CHECK(info.host == "127.0.0.3" && info.port == 9103);
+  BOOST_CHECK(directory.size() == 1);
+
+  // 記録できない名前
+  BOOST_CHECK(directory.Set("/a/b\n.dat", cbb::ServerInfo("127.0.0.2", 9102)) == -EINVAL);
+  BOOST_CHECK(directory.Set("/a/b.dat", cbb::ServerInfo("127.0.0.2\t", 9102)) == -EINVAL);
+
+  BOOST_CHECK(directory.Remove("/a/b.dat") == cbb::kCBBSuccess);
+  BOOST_CHECK(!directory.Lookup("/a/b.dat", &info));
+  BOOST_CHECK(directory.size() == 0);
+
+  directory.Close();
+  unlink(test_placement_file().c_str());
+}
+
+BOOST_AUTO_TEST_CASE(claim)
+{
+  unlink(test_placement_file().c_str());
+
+  cbb::PlacementDirectory directory;
+  BOOST_REQUIRE(directory.Open(test_placement_file()) == cbb::kCBBSuccess);
+
+  cbb::ServerInfo existing;
+  BOOST_CHECK(directory.Claim("/a/b.dat", cbb::ServerInfo("127.0.0.2", 9102), &existing) == cbb::kCBBSuccess);
+  BOOST_CHECK(directory.Claim("/a/b.dat", cbb::ServerInfo("127.0.0.2", 9102), &existing) == cbb::kCBBSuccess);
+
+  // 先に登録された配置先は上書きしない
+  BOOST_CHECK(directory.Claim("/a/b.dat", cbb::ServerInfo("127.0.0.3", 9103), &existing) == -EEXIST);
+  BOOST_CHECK(existing.host == "127.0.0.2" && existing.port == 9102);
+
+  cbb::ServerInfo info;
+  BOOST_REQUIRE(directory.Lookup("/a/b.dat", &info));
+  BOOST_CHECK(info.host == "127.0.0.2" && info.port == 9102);
+  BOOST_CHECK(directory.size() == 1);
+
+  directory.Close();
+  unlink(test_placement_file().c_str());
+}
+
+BOOST_AUTO_TEST_CASE(reopen)
+{
+  unlink(test_placement_file().c_str());
+
+  {
+    cbb::PlacementDirectory directory;
+    BOOST_REQUIRE(directory.Open(test_placement_file()) == cbb::kCBBSuccess);
+    for (int index = 0; index < 3000; index++) {
+      std::string path = (boost::format("/dir/file%1%") % index).str();
+      BOOST_CHECK(directory.Set(path, cbb::ServerInfo("127.0.0.2", 9000 + index % 4)) == cbb::kCBBSuccess);
+      if (index % 2 == 1) {
+        BOOST_CHECK(directory.Remove(path) == cbb::kCBBSuccess);
+      }
+    }
+    BOOST_CHECK(directory.size() == 1500);
+  }
+
+  // 追記した変更が再起動後に復元される
+  cbb::PlacementDirectory directory;
+  BOOST_REQUIRE(directory.Open(test_placement_file()) == cbb::kCBBSuccess);
+  BOOST_CHECK(directory.size() == 1500);
+
+  cbb::ServerInfo info;
+  BOOST_REQUIRE(directory.Lookup("/dir/file2998", &info));
+  BOOST_CHECK(info.host == "127.0.0.2" && info.port == 9002);
+  BOOST_CHECK(!directory.Lookup("/dir/file2999", &info));
+
+  directory.Close();
+  unlink(test_placement_file().c_str());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,90 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "test_common.h"
+#include "common/common.h"
+
+// v2プロトコルのユニットテスト
+
+static cbb::FileStat sample_stat() {
+  cbb::FileStat stat = cbb::FileStat();
+  stat.st_dev = 2049;
+  stat.st_ino = 1234567;
+  stat.st_mode = S_IFREG | 0644;
+  stat.st_nlink = 1;
+  stat.st_uid = 1000;
+  stat.st_gid = 1000;
+  stat.st_size = 1 << 20;
+  stat.st_blksize = 4096;
+  stat.st_blocks = 2048;
+  stat.st_atim.tv_sec = 1700000000;
+  stat.st_atim.tv_nsec = 123456789;
+  stat.st_mtim.tv_sec = 1700000001;
+  stat.st_mtim.tv_nsec = 0;
+  stat.st_ctim.tv_sec = 1700000002;
+  stat.st_ctim.tv_nsec = 999999999;
+  return stat;
+}
+
+BOOST_AUTO_TEST_SUITE_EX(protocol)
+
+BOOST_AUTO_TEST_CASE(file_handle)
+{
+  uint64_t handle = cbb::make_file_handle(0x89abcdefU, 42);
+  BOOST_CHECK(handle != 0);
+  BOOST_CHECK(cbb::file_handle_session(handle) == 0x89abcdefU);
+  BOOST_CHECK(cbb::file_handle_fd(handle) == 42);
+
+  // セッションIDが違えば同じfdでも別のハンドル
+  BOOST_CHECK(cbb::make_file_handle(1, 42) != handle);
+}
+
+BOOST_AUTO_TEST_CASE(compact_file_stat)
+{
+  cbb::FileStat stat = sample_stat();
+  cbb::CompactFileStat compact(stat);
+
+  cbb::FileStat restored;
+  compact.ToFileStat(&restored);
+  BOOST_CHECK(restored.st_ino == stat.st_ino);
+  BOOST_CHECK(restored.st_mode == stat.st_mode);
+  BOOST_CHECK(restored.st_size == stat.st_size);
+  BOOST_CHECK(restored.st_blocks == stat.st_blocks);
+  BOOST_CHECK(restored.st_blksize == stat.st_blksize);
+  BOOST_CHECK(restored.st_atim.tv_sec == stat.st_atim.tv_sec);
+  BOOST_CHECK(restored.st_atim.tv_nsec == stat.st_atim.tv_nsec);
+  BOOST_CHECK(restored.st_ctim.tv_nsec == stat.st_ctim.tv_nsec);
+  BOOST_CHECK(restored.st_dev == 0);
+
+  // 1970年より前の時刻
+  cbb::TimeSpec time = cbb::CompactFileStat::from_nsec(-1);
+  BOOST_CHECK(time.tv_sec == -1);
+  BOOST_CHECK(time.tv_nsec == 999999999);
+}
+
+BOOST_AUTO_TEST_CASE(compact_file_stat_size)
+{
+  cbb::FileStat stat = sample_stat();
+
+  msgpack::sbuffer v1;
+  msgpack::pack(v1, stat);
+  msgpack::sbuffer v2;
+  msgpack::pack(v2, cbb::CompactFileStat(stat));
+
+  TMSG("FileStat %lu bytes -> CompactFileStat %lu bytes\n", v1.size(), v2.size());
+  BOOST_CHECK(v2.size() < v1.size());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,174 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "test_common.h"
+#include "util/secondary_throttle.h"
+
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#define LEASE_DIR TEST_WORKSPACE "/secondary_lease"
+
+// Secondaryストレージへの書き出しの制限クラスユニットテスト
+
+static cbb::SecondaryStats snapshot(cbb::SecondaryThrottle &throttle) {
+  cbb::SecondaryStats stats;
+  throttle.Snapshot(&stats);
+  return stats;
+}
+
+static void touch(const char *path, time_t age_sec) {
+  int fd = open(path, O_WRONLY | O_CREAT, S_IREAD | S_IWRITE);
+  if (fd != -1) {
+    close(fd);
+  }
+  struct timeval times[2];
+  gettimeofday(&times[0], NULL);
+  times[0].tv_sec -= age_sec;
+  times[1] = times[0];
+  utimes(path, times);
+}
+
+BOOST_AUTO_TEST_SUITE_EX(secondary_throttle)
+
+BOOST_AUTO_TEST_CASE(set_rate)
+{
+  cbb::TokenBucket bucket;
+  bucket.Init(1000, 0, 0);
+  bucket.Take(1500, 0);
+  BOOST_CHECK(bucket.Wait(0) > 0);
+
+  // 借りは引き継ぎ、新しい速さで返す
+  bucket.SetRate(2000, 0, 0);
+  BOOST_CHECK(bucket.rate() == 2000);
+  BOOST_CHECK(bucket.Wait(0) == 250500);
+
+  // 残りは新しい上限に切り詰める
+  bucket.Init(1000, 0, 0);
+  bucket.SetRate(100, 0, 0);
+  BOOST_CHECK(bucket.TryTake(100, 0) == 0);
+  BOOST_CHECK(bucket.Wait(0) > 0);
+}
+
+BOOST_AUTO_TEST_CASE(limit)
+{
+  cbb::SecondaryThrottle throttle;
+  throttle.SetPolicy(0, 0);
+  BOOST_CHECK(!throttle.is_enabled());
+  cbb::SecondaryStats before = snapshot(throttle);
+  throttle.Write(100);
+  throttle.Operation();
+  BOOST_CHECK(snapshot(throttle).bytes == before.bytes);
+
+  // 1秒分までは待たずに書き込み、超えた分は待つ
+  throttle.SetPolicy(10000, 0);
+  BOOST_CHECK(throttle.is_enabled());
+  before = snapshot(throttle);
+  uint64_t start = cbb::get_time_msec();
+  throttle.Write(10000);
+  BOOST_CHECK(cbb::get_time_msec() - start < 100);
+  throttle.Write(1000);
+  throttle.Write(1000);
+  BOOST_CHECK(cbb::get_time_msec() - start >= 50);
+  cbb::SecondaryStats after = snapshot(throttle);
+  BOOST_CHECK(after.bandwidth == 10000);
+  BOOST_CHECK(after.bytes - before.bytes == 12000);
+  BOOST_CHECK(after.throttled > before.throttled);
+
+  // メタデータ操作
+  throttle.SetPolicy(0, 20);
+  before = snapshot(throttle);
+  start = cbb::get_time_msec();
+  for (int i = 0; i < 22; i++) {
+    throttle.Operation();
+  }
+  BOOST_CHECK(cbb::get_time_msec() - start >= 50);
+  after = snapshot(throttle);
+  BOOST_CHECK(after.operations - before.operations == 22);
+  BOOST_CHECK(after.throttled > before.throttled);
+
+  throttle.Disable();
+}
+
+BOOST_AUTO_TEST_CASE(export_scope)
+{
+  cbb::SecondaryThrottle throttle;
+  throttle.SetPolicy(1000000, 0);
+  BOOST_CHECK(!cbb::SecondaryThrottle::is_paced());
+
+  // コピーの区切りはSecondaryへのコピー中だけ数える
+  cbb::SecondaryStats before = snapshot(throttle);
+  cbb::SecondaryThrottle::Pace(100);
+  BOOST_CHECK(snapshot(throttle).bytes == before.bytes);
+  {
+    cbb::SecondaryThrottle::ExportScope export_scope(throttle);
+    BOOST_CHECK(cbb::SecondaryThrottle::is_paced());
+    {
+      cbb::SecondaryThrottle::ExportScope nested_scope(throttle);
+    }
+    cbb::SecondaryThrottle::Pace(100);
+  }
+  BOOST_CHECK(!cbb::SecondaryThrottle::is_paced());
+  BOOST_CHECK(snapshot(throttle).bytes - before.bytes == 100);
+
+  throttle.Disable();
+}
+
+BOOST_AUTO_TEST_CASE(lease)
+{
+  cbb::SecondaryThrottle throttle;
+  mkdir(TEST_WORKSPACE, S_IRWXU);
+  mkdir(LEASE_DIR, S_IRWXU);
+  touch(LEASE_DIR "/other", 0);
+  touch(LEASE_DIR "/expired", 3600);
+
+  // 期限内のリース (自分と other) でクラスタ全体の上限を分ける
+  throttle.SetPolicy(0, 0);
+  throttle.SetCoordination(1000000, 100, LEASE_DIR, "self", 1000);
+  throttle.Operation();
+  BOOST_CHECK(access(LEASE_DIR "/self", F_OK) == 0);
+  cbb::SecondaryStats stats = snapshot(throttle);
+  BOOST_CHECK(stats.servers == 2);
+  BOOST_CHECK(stats.bandwidth == 500000);
+  BOOST_CHECK(stats.ops == 50);
+
+  // サーバーごとの上限の方が小さい場合
+  throttle.SetPolicy(200000, 0);
+  BOOST_CHECK(snapshot(throttle).bandwidth == 200000);
+
+  // 同じプロセスの他のサーバーは自分のリースを持つ
+  cbb::SecondaryThrottle other;
+  other.SetCoordination(1000000, 100, LEASE_DIR, "node2", 1000);
+  other.Operation();
+  BOOST_CHECK(access(LEASE_DIR "/node2", F_OK) == 0);
+  BOOST_CHECK(snapshot(other).servers == 3);
+
+  // 終了時に自分のリースだけを消す
+  throttle.Disable();
+  BOOST_CHECK(access(LEASE_DIR "/self", F_OK) != 0);
+  BOOST_CHECK(snapshot(throttle).servers == 0);
+  BOOST_CHECK(access(LEASE_DIR "/node2", F_OK) == 0);
+  BOOST_CHECK(other.is_enabled());
+  BOOST_CHECK(snapshot(other).ops == 33);
+
+  other.Disable();
+  BOOST_CHECK(access(LEASE_DIR "/node2", F_OK) != 0);
+
+  unlink(LEASE_DIR "/other");
+  unlink(LEASE_DIR "/expired");
+  rmdir(LEASE_DIR);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
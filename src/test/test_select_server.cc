@@ -55,4 +55,102 @@ BOOST_AUTO_TEST_CASE(create)
   }
 }
 
+BOOST_AUTO_TEST_CASE(host_port)
+{
+  std::vector<std::string> hosts;
+  hosts.push_back("127.0.0.1:9101");
+  hosts.push_back("127.0.0.1:9102");
+  hosts.push_back("127.0.0.2");
+
+  cbb::Settings port_settings;
+  port_settings.SetClient(hosts, 9091);
+
+  cbb::SelectServer port_ss;
+  port_ss.Init(port_settings, new cbb::HashCalcMD5());
+
+  std::list<cbb::ServerInfo> infos = port_ss.server_list();
+  BOOST_REQUIRE(infos.size() == 3);
+
+  std::list<cbb::ServerInfo>::iterator it = infos.begin();
+  BOOST_CHECK(it->host == "127.0.0.1" && it->port == 9101);
+  ++it;
+  BOOST_CHECK(it->host == "127.0.0.1" && it->port == 9102);
+  ++it;
+  BOOST_CHECK(it->host == "127.0.0.2" && it->port == 9091);
+}
+
+BOOST_AUTO_TEST_CASE(stripe_info)
+{
+  std::vector<std::string> hosts;
+  hosts.push_back("127.0.0.1:9101");
+  hosts.push_back("127.0.0.1:9102");
+  hosts.push_back("127.0.0.1:9103");
+
+  cbb::Settings stripe_settings;
+  stripe_settings.SetClient(hosts, 9091);
+
+  cbb::SelectServer stripe_ss;
+  stripe_ss.Init(stripe_settings, new cbb::HashCalcMD5());
+
+  for (int loop = 0; loop < 10; loop++) {
+    char path[256];
+    std::string host;
+    int port;
+
+    sprintf(path, "/cbb/test/stripe%02d.bin", loop);
+    stripe_ss.GetInfo(path, host, port);
+
+    // 先頭はパスのハッシュで決まるサーバー、以降は重複しない
+    std::vector<cbb::ServerInfo> infos;
+    stripe_ss.GetStripeInfo(path, 0, infos);
+    BOOST_REQUIRE(infos.size() == 3);
+    BOOST_CHECK(infos[0].host == host && infos[0].port == port);
+    BOOST_CHECK(infos[0].port != infos[1].port && infos[1].port != infos[2].port && infos[0].port != infos[2].port);
+
+    stripe_ss.GetStripeInfo(path, 2, infos);
+    BOOST_CHECK(infos.size() == 2);
+    stripe_ss.GetStripeInfo(path, 5, infos);
+    BOOST_CHECK(infos.size() == 3);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(virtual_nodes)
+{
+  std::vector<std::string> hosts;
+  hosts.push_back("127.0.0.1:9101");
+  hosts.push_back("127.0.0.1:9102");
+  hosts.push_back("127.0.0.1:9103");
+
+  cbb::SelectServer before;
+  before.Init(new cbb::HashCalcMD5(), hosts, 9091, 64);
+
+  hosts.push_back("127.0.0.1:9104");
+  cbb::SelectServer after;
+  after.Init(new cbb::HashCalcMD5(), hosts, 9091, 64);
+
+  // サーバーを1台追加しても担当が変わるのは追加したサーバーに移るパスだけ
+  int moved = 0;
+  int total = 1000;
+  for (int loop = 0; loop < total; loop++) {
+    char path[256];
+    sprintf(path, "/cbb/test/ring%04d.bin", loop);
+
+    cbb::ServerInfo old_info = before.GetInfo(std::string(path));
+    cbb::ServerInfo new_info = after.GetInfo(std::string(path));
+    BOOST_CHECK(!old_info.host.empty());
+    if (old_info != new_info) {
+      BOOST_CHECK(new_info.port == 9104);
+      moved++;
+    }
+  }
+  BOOST_CHECK(moved > 0);
+  BOOST_CHECK(moved < total / 2);
+
+  // Update で構成を差し替えられる
+  before.Update(hosts, 64);
+  BOOST_CHECK(before.server_list().size() == 4);
+  BOOST_CHECK(before.Contains(cbb::ServerInfo("127.0.0.1", 9104)));
+  BOOST_CHECK(before.GetInfo(std::string("/cbb/test/ring0000.bin")) == after.GetInfo(std::string("/cbb/test/ring0000.bin")));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,68 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "test_common.h"
+#include "util/server_health.h"
+
+// サーバー通信状態クラスユニットテスト
+
+BOOST_AUTO_TEST_SUITE_EX(server_health)
+
+BOOST_AUTO_TEST_CASE(circuit)
+{
+  cbb::ServerHealth health;
+  uint64_t now = 100000;
+
+  BOOST_CHECK(health.Allow("host1", 9091, now));
+  for (int count = 1; count < SERVER_HEALTH_FAILURE_MAX; count++) {
+    health.Failure("host1", 9091, now);
+    BOOST_CHECK(health.Allow("host1", 9091, now));
+  }
+
+  // 連続して失敗するとサーキットを開く (他のサーバーには影響しない)
+  health.Failure("host1", 9091, now);
+  BOOST_CHECK(health.is_open("host1", 9091, now));
+  BOOST_CHECK(!health.Allow("host1", 9091, now + 1));
+  BOOST_CHECK(health.Allow("host1", 9092, now + 1));
+  BOOST_CHECK(health.Allow("host2", 9091, now + 1));
+
+  // 期限を過ぎると1件だけ試す
+  now += SERVER_HEALTH_OPEN_MIN;
+  BOOST_CHECK(health.Allow("host1", 9091, now));
+  BOOST_CHECK(!health.Allow("host1", 9091, now));
+
+  // 試しに失敗すると開いておく時間が倍になる
+  health.Failure("host1", 9091, now);
+  BOOST_CHECK(!health.Allow("host1", 9091, now + SERVER_HEALTH_OPEN_MIN));
+  BOOST_CHECK(health.Allow("host1", 9091, now + 2 * SERVER_HEALTH_OPEN_MIN));
+
+  // 成功すると閉じる
+  health.Success("host1", 9091);
+  BOOST_CHECK(!health.is_open("host1", 9091, now));
+  BOOST_CHECK(health.Allow("host1", 9091, now));
+}
+
+BOOST_AUTO_TEST_CASE(backoff)
+{
+  unsigned int seed = 1;
+  for (int count = 0; count < 100; count++) {
+    BOOST_CHECK(cbb::ServerHealth::Backoff(1, 100, 2000, &seed) <= 100);
+    BOOST_CHECK(cbb::ServerHealth::Backoff(3, 100, 2000, &seed) <= 400);
+    BOOST_CHECK(cbb::ServerHealth::Backoff(10, 100, 2000, &seed) <= 2000);
+  }
+  BOOST_CHECK(cbb::ServerHealth::Backoff(1, 0, 2000, &seed) == 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
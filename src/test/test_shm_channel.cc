@@ -0,0 +1,105 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "test_common.h"
+#include "util/shm_channel.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#include <boost/format.hpp>
+
+// 共有メモリ通信路クラスユニットテスト
+
+BOOST_AUTO_TEST_SUITE_EX(shm_channel)
+
+static std::string test_shm_name() {
+  return (boost::format("/cbb_test.%1%") % getpid()).str();
+}
+
+BOOST_AUTO_TEST_CASE(attach)
+{
+  cbb::ShmChannel server;
+  cbb::ShmChannel client;
+
+  BOOST_REQUIRE(server.Create(test_shm_name(), 1234, 1 << 20) == cbb::kCBBSuccess);
+
+  // 乱数が一致しない場合は接続しない
+  BOOST_CHECK(client.Attach(test_shm_name(), 4321) != cbb::kCBBSuccess);
+  BOOST_CHECK(!client.is_open());
+
+  BOOST_REQUIRE(client.Attach(test_shm_name(), 1234) == cbb::kCBBSuccess);
+  BOOST_CHECK(server.header()->client_pid == getpid());
+  BOOST_CHECK(client.chunk_size() == (1 << 20) / SHM_RING_SLOTS);
+
+  // 接続済みの通信路には2つ目のクライアントは接続できない
+  cbb::ShmChannel other;
+  BOOST_CHECK(other.Attach(test_shm_name(), 1234) != cbb::kCBBSuccess);
+
+  server.Close();
+  BOOST_CHECK(client.header()->is_closed);
+}
+
+BOOST_AUTO_TEST_CASE(ring)
+{
+  cbb::ShmChannel server;
+  cbb::ShmChannel client;
+
+  BOOST_REQUIRE(server.Create(test_shm_name(), 1, 1 << 20) == cbb::kCBBSuccess);
+  BOOST_REQUIRE(client.Attach(test_shm_name(), 1) == cbb::kCBBSuccess);
+
+  BOOST_CHECK(!server.WaitRequest(10));
+
+  // リング容量まで追加できる
+  for (int index = 0; index < SHM_RING_SLOTS; index++) {
+    cbb::ShmRequest request;
+    memset(&request, 0, sizeof(request));
+    request.tag = index;
+    request.op = cbb::kShmWrite;
+    request.data_offset = index * client.chunk_size();
+    sprintf(client.data(request.data_offset), "data %d", index);
+    BOOST_CHECK(client.PushRequest(request));
+  }
+  cbb::ShmRequest overflow;
+  BOOST_CHECK(!client.PushRequest(overflow));
+
+  BOOST_CHECK(server.WaitRequest(10));
+  for (int index = 0; index < SHM_RING_SLOTS; index++) {
+    cbb::ShmRequest request;
+    BOOST_REQUIRE(server.PopRequest(&request));
+    BOOST_CHECK(request.tag == (uint64_t)index);
+
+    // データ領域はオフセットで共有される
+    char expected[32];
+    sprintf(expected, "data %d", index);
+    BOOST_CHECK(strcmp(server.data(request.data_offset), expected) == 0);
+
+    cbb::ShmResponse response;
+    response.tag = request.tag;
+    response.result = index;
+    BOOST_CHECK(server.PushResponse(response));
+  }
+  cbb::ShmRequest empty;
+  BOOST_CHECK(!server.PopRequest(&empty));
+
+  BOOST_CHECK(client.WaitResponse(10));
+  for (int index = 0; index < SHM_RING_SLOTS; index++) {
+    cbb::ShmResponse response;
+    BOOST_REQUIRE(client.PopResponse(&response));
+    BOOST_CHECK(response.result == index);
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,151 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "arena.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace cbb {
+
+namespace {
+
+pthread_once_t g_arena_once = PTHREAD_ONCE_INIT;
+pthread_key_t g_arena_key;
+__thread Arena *tls_arena = NULL;
+
+/**
+ * @breaf スレッド終了時にアリーナを破棄する
+ * @param data アリーナ
+ */
+void DeleteArena(void *data) {
+  delete (Arena *)data;
+}
+
+/**
+ * @breaf スレッド終了時の破棄の登録 (初回の取得時に一度だけ呼ばれる)
+ */
+void CreateArenaKey() {
+  pthread_key_create(&g_arena_key, DeleteArena);
+}
+
+} // namespace
+
+/**
+ * @breaf constructor
+ */
+Arena::Arena() : used_(0), overflow_(NULL), depth_(0) {
+}
+
+/**
+ * @breaf destructor
+ */
+Arena::~Arena() {
+  Reset();
+}
+
+/**
+ * @breaf 領域の確保
+ * @param size サイズ
+ * @return 領域のポインタ (Reset まで有効、確保できない、サイズが大きすぎる場合はNULL)
+ */
+void *Arena::Alloc(size_t size) {
+  // 揃えたサイズ、管理領域を足したサイズが桁あふれする場合は確保しない
+  if (size > SIZE_MAX - ARENA_ALIGN) {
+    return NULL;
+  }
+  size_t aligned = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if (aligned <= ARENA_BLOCK_SIZE - used_) {
+    void *ptr = block_ + used_;
+    used_ += aligned;
+    return ptr;
+  }
+
+  // 長いパス等の固定領域に収まらない確保は個別にヒープから取る
+  Overflow *overflow = (Overflow *)malloc(ARENA_ALIGN + size);
+  if (overflow == NULL) {
+    return NULL;
+  }
+  overflow->next = overflow_;
+  overflow_ = overflow;
+  return (char *)overflow + ARENA_ALIGN;
+}
+
+/**
+ * @breaf 文字列の複製 (終端文字を付ける)
+ * @param str 文字列 (終端文字は不要)
+ * @param size 文字列の長さ
+ * @return 複製した文字列
+ */
+const char *Arena::Strndup(const char *str, size_t size) {
+  char *ptr = (char *)Alloc(size + 1);
+  if (ptr == NULL) {
+    return NULL;
+  }
+  memcpy(ptr, str, size);
+  ptr[size] = '\0';
+  return ptr;
+}
+
+/**
+ * @breaf ストレージのパスの作成 (MetaDataManager::local_path 等と同じ規則で連結する)
+ * @param root ストレージのルートパス
+ * @param path ファイルパス (終端文字は不要)
+ * @param size ファイルパスの長さ
+ * @return 連結したパス
+ */
+const char *Arena::Join(const std::string &root, const char *path, size_t size) {
+  size_t slash = (size > 0 && path[0] == '/') ? 0: 1;
+  char *ptr = (char *)Alloc(root.size() + slash + size + 1);
+  if (ptr == NULL) {
+    return NULL;
+  }
+  memcpy(ptr, root.data(), root.size());
+  if (slash) {
+    ptr[root.size()] = '/';
+  }
+  memcpy(ptr + root.size() + slash, path, size);
+  ptr[root.size() + slash + size] = '\0';
+  return ptr;
+}
+
+/**
+ * @breaf 確保した領域をすべて破棄する
+ */
+void Arena::Reset() {
+  used_ = 0;
+  while (overflow_ != NULL) {
+    Overflow *next = overflow_->next;
+    free(overflow_);
+    overflow_ = next;
+  }
+}
+
+/**
+ * @breaf 現在のスレッドのアリーナを取得する (初回のみ作成する)
+ * @return アリーナ
+ */
+Arena *Arena::current() {
+  if (tls_arena == NULL) {
+    pthread_once(&g_arena_once, CreateArenaKey);
+    tls_arena = new Arena();
+    pthread_setspecific(g_arena_key, tls_arena);
+  }
+  return tls_arena;
+}
+
+} /* namespace cbb */
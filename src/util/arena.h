@@ -0,0 +1,86 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef UTIL_ARENA_H_
+#define UTIL_ARENA_H_
+
+#include <stddef.h>
+
+#include <string>
+
+// アリーナの固定領域のサイズ (超えた分はヒープから確保し、Resetで解放する)
+#define ARENA_BLOCK_SIZE 8192
+
+// 確保するアドレスの境界
+#define ARENA_ALIGN 16
+
+namespace cbb {
+
+// リクエスト単位の一時領域を確保するバンプアロケータクラス
+//
+// 確保はポインタを進めるだけで、個別の解放は行わず Reset でまとめて破棄する。
+// 固定領域に収まる限りヒープを使わない。スレッドごとに1つ持ち (current)、
+// ArenaScope で処理の終わりに Reset する。
+class Arena {
+ public:
+  Arena();
+  virtual ~Arena();
+
+  void *Alloc(size_t size);
+  const char *Strndup(const char *str, size_t size);
+  const char *Join(const std::string &root, const char *path, size_t size);
+  void Reset();
+
+  size_t used() const { return used_; }
+
+  static Arena *current();
+
+ private:
+  // 固定領域に収まらない確保 (単方向リスト)
+  struct Overflow {
+    Overflow *next;
+  };
+
+  char block_[ARENA_BLOCK_SIZE] __attribute__((aligned(ARENA_ALIGN)));
+  size_t used_;
+  Overflow *overflow_;
+  int depth_;
+
+  Arena(const Arena &);
+  Arena &operator=(const Arena &);
+
+  friend class ArenaScope;
+};
+
+// アリーナの使用範囲クラス (一番外側の範囲の終わりで Reset する)
+class ArenaScope {
+ public:
+  explicit ArenaScope(Arena *arena) : arena_(arena) { arena_->depth_++; }
+  ~ArenaScope() {
+    if (--arena_->depth_ == 0) {
+      arena_->Reset();
+    }
+  }
+
+ private:
+  Arena *arena_;
+
+  ArenaScope(const ArenaScope &);
+  ArenaScope &operator=(const ArenaScope &);
+};
+
+} /* namespace cbb */
+
+#endif /* UTIL_ARENA_H_ */
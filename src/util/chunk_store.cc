@@ -0,0 +1,735 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "chunk_store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <linux/falloc.h>
+
+#include <algorithm>
+
+#include "common/common.h"
+#include "util/compressor.h"
+
+#define CHUNKED_XATTR_NAME  "user.cbb.chunked"  // 圧縮形式 ("type:chunk_size")
+#define CHUNKS_XATTR_NAME   "user.cbb.chunks"   // 圧縮されているチャンクの索引 (ビット列)
+#define MARKED_XATTR_NAME   "user.cbb.compressed"  // 圧縮形式のファイルを作ったことがあるか (Localストレージのルートに付ける)
+
+#define CHUNK_MAGIC 0x315a4243                  // "CBZ1"
+
+namespace cbb {
+
+namespace {
+
+/// 圧縮したチャンクの先頭に置くヘッダー
+struct ChunkHeader {
+  uint32_t magic;
+  uint32_t type;     // 圧縮方式
+  uint32_t size;     // 圧縮データのサイズ
+  uint32_t length;   // 展開後のサイズ
+};
+
+pthread_once_t g_buffer_once = PTHREAD_ONCE_INIT;
+pthread_key_t g_buffer_key;
+__thread char *tls_buffer = NULL;
+__thread size_t tls_buffer_size = 0;
+
+void CreateBufferKey() {
+  pthread_key_create(&g_buffer_key, free);
+}
+
+inline size_t round_up(size_t size) {
+  return (size + CHUNK_STORE_BLOCK - 1) / CHUNK_STORE_BLOCK * CHUNK_STORE_BLOCK;
+}
+
+} // namespace
+
+/**
+ * @breaf constructor
+ */
+ChunkStore::ChunkStore() : type_(kCompressNone), level_(0), chunk_size_(CHUNK_STORE_CHUNK_SIZE) {
+  for (int index = 0; index < CHUNK_STORE_FILE_MAX; index++) {
+    files_[index] = NULL;
+    appends_[index] = 0;
+  }
+  mutex_.Init();
+  for (int index = 0; index < CHUNK_STORE_LOCKS; index++) {
+    chunk_locks_[index].Init();
+  }
+}
+
+/**
+ * @breaf destructor
+ */
+ChunkStore::~ChunkStore() {
+  Destroy();
+}
+
+/**
+ * @breaf 初期化
+ * @param type 新しく作るファイルの圧縮方式 (kCompressNone の場合は既存の圧縮形式のファイルの読み書きだけ行う)
+ * @param level 圧縮レベル (0の場合は方式の既定値)
+ * @param chunk_size チャンクサイズ (ブロックの倍数に切り上げる)
+ * @return bool 圧縮方式を使えるかどうか (使えない場合は kCompressNone として動く)
+ */
+bool ChunkStore::Init(int type, int level, size_t chunk_size) {
+  type_ = Compressor::is_supported(type) ? type: kCompressNone;
+  level_ = level;
+  chunk_size_ = round_up(std::max(chunk_size, (size_t)CHUNK_STORE_BLOCK * 2));
+  return type_ == type;
+}
+
+/**
+ * @breaf 終了処理 (登録したファイルをすべて解除する)
+ */
+void ChunkStore::Destroy() {
+  for (int index = 0; index < CHUNK_STORE_FILE_MAX; index++) {
+    Detach(index);
+  }
+}
+
+/**
+ * @breaf 開いたファイルの登録 (圧縮形式のファイルの場合だけ登録する)
+ * @param fd ファイルディスクリプタ
+ * @param flags オープンフラグ (O_TRUNC の場合は共有している情報のサイズを取り直す)
+ * @return bool 開いてよいかどうか (圧縮方式に対応していない、登録できない場合は errno を設定して false)
+ */
+bool ChunkStore::Attach(int fd, int flags) {
+  char value[64];
+  ssize_t length = fgetxattr(fd, CHUNKED_XATTR_NAME, value, sizeof(value) - 1);
+  if (length < 0) {
+    return true;
+  }
+  value[length] = '\0';
+
+  int type = kCompressNone;
+  unsigned long chunk_size = 0;
+  if (sscanf(value, "%d:%lu", &type, &chunk_size) != 2 || type == kCompressNone ||
+      !Compressor::is_supported(type) || chunk_size == 0) {
+    errno = ENOTSUP;
+    return false;
+  }
+  if (fd >= CHUNK_STORE_FILE_MAX) {
+    errno = EMFILE;
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return false;
+  }
+
+  // 書き込み位置は自分で決めるため、追記モードは外して記録する
+  if (flags & O_APPEND) {
+    int current = fcntl(fd, F_GETFL);
+    if (current == -1 || fcntl(fd, F_SETFL, current & ~O_APPEND) != 0) {
+      return false;
+    }
+    appends_[fd] = 1;
+  }
+
+  files_[fd] = AcquireFile(fd, st, type, chunk_size, (flags & O_TRUNC) != 0);
+  return true;
+}
+
+/**
+ * @breaf ファイルを閉じる前の登録解除
+ * @param fd ファイルディスクリプタ
+ */
+void ChunkStore::Detach(int fd) {
+  if (fd < 0 || fd >= CHUNK_STORE_FILE_MAX) {
+    return;
+  }
+  ChunkFile *file = __sync_lock_test_and_set(&files_[fd], (ChunkFile *)NULL);
+  appends_[fd] = 0;
+  if (file == NULL) {
+    return;
+  }
+
+  mutex_.Lock();
+  if (--file->count == 0) {
+    chunk_files_.erase(std::make_pair(file->dev, file->ino));
+    delete file;
+  }
+  mutex_.Unlock();
+}
+
+/**
+ * @breaf 空のファイルを圧縮形式にする (新しく作成したファイル、切り詰めたファイル)
+ *   他で開いているファイルは通常の読み書きと混ざるため、呼び出し元で除くこと。
+ * @param fd ファイルディスクリプタ
+ * @return bool 圧縮形式になったかどうか
+ */
+bool ChunkStore::Format(int fd) {
+  if (type_ == kCompressNone || fd < 0 || fd >= CHUNK_STORE_FILE_MAX) {
+    return false;
+  }
+  if (files_[fd] != NULL) {
+    return true;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size != 0) {
+    return false;
+  }
+
+  // 同時に作成した場合は先に設定した形式を使う
+  char value[64];
+  int length = snprintf(value, sizeof(value), "%d:%lu", type_, (unsigned long)chunk_size_);
+  if (fsetxattr(fd, CHUNKED_XATTR_NAME, value, length, XATTR_CREATE) != 0 && errno != EEXIST) {
+    return false;
+  }
+
+  int flags = fcntl(fd, F_GETFL);
+  return flags != -1 && Attach(fd, flags) && files_[fd] != NULL;
+}
+
+/**
+ * @breaf ファイル読み込み
+ * @param fd ファイルディスクリプタ
+ * @param buf バッファ
+ * @param size 読み込みサイズ
+ * @param offset オフセット
+ * @param ssize_ptr 読み込みサイズ保存ポインタ (エラーの場合は Error値)
+ * @return bool 圧縮形式として処理したかどうか (falseの場合は呼び出し元で pread する)
+ */
+bool ChunkStore::Read(int fd, void *buf, size_t size, off_t offset, ssize_t *ssize_ptr) {
+  if (!is_attached(fd)) {
+    return false;
+  }
+  ChunkFile *file = files_[fd];
+
+  file->mutex.Lock();
+  off_t file_size = file->size;
+  file->mutex.Unlock();
+
+  if (offset >= file_size) {
+    *ssize_ptr = 0;
+    return true;
+  }
+  size = std::min<off_t>(size, file_size - offset);
+
+  size_t chunk_size = file->chunk_size;
+  char *chunk_buf = NULL;
+  char *packed = NULL;
+  size_t done = 0;
+  Error error = kCBBSuccess;
+
+  while (done < size) {
+    off_t position = offset + done;
+    uint64_t chunk = position / chunk_size;
+    off_t chunk_offset = chunk * chunk_size;
+    size_t begin = position - chunk_offset;
+    size_t end = std::min(chunk_size, begin + (size - done));
+    size_t length = std::min<off_t>(chunk_size, file_size - chunk_offset);
+    char *dst = (char *)buf + done;
+
+    Mutex &lock = chunk_lock(file, chunk);
+    lock.Lock();
+    file->mutex.Lock();
+    bool packed_chunk = is_packed(file, chunk);
+    file->mutex.Unlock();
+
+    if (!packed_chunk) {
+      // 圧縮されていないチャンクは必要な範囲だけを読む (書き込み中の範囲は0)
+      ssize_t ssize = pread(fd, dst, end - begin, chunk_offset + begin);
+      if (ssize < 0) {
+        error = -errno;
+      } else {
+        memset(dst + ssize, 0, end - begin - ssize);
+      }
+    } else if (begin == 0 && end == length) {
+      if (chunk_buf == NULL) {
+        chunk_buf = buffer(file, &packed);
+      }
+      ssize_t ssize = LoadChunk(fd, file, chunk, length, true, dst, packed);
+      error = ssize < 0 ? ssize: kCBBSuccess;
+    } else {
+      if (chunk_buf == NULL) {
+        chunk_buf = buffer(file, &packed);
+      }
+      ssize_t ssize = LoadChunk(fd, file, chunk, length, true, chunk_buf, packed);
+      if (ssize < 0) {
+        error = ssize;
+      } else {
+        memcpy(dst, chunk_buf + begin, end - begin);
+      }
+    }
+    lock.Unlock();
+
+    if (error != kCBBSuccess) {
+      break;
+    }
+    done += end - begin;
+  }
+
+  *ssize_ptr = done > 0 ? (ssize_t)done: error;
+  return true;
+}
+
+/**
+ * @breaf ファイル書き込み
+ *   チャンク全体を書き換える場合、チャンクが埋まった場合、圧縮されたチャンクの一部を書き換える場合は
+ *   チャンクを圧縮し直す。圧縮されていないチャンクの一部だけの書き換えはそのまま書き込む。
+ * @param fd ファイルディスクリプタ
+ * @param buf バッファ
+ * @param size 書き込みサイズ
+ * @param offset オフセット (追記モードの場合はファイルの末尾)
+ * @param ssize_ptr 書き込みサイズ保存ポインタ (エラーの場合は Error値)
+ * @return bool 圧縮形式として処理したかどうか (falseの場合は呼び出し元で pwrite する)
+ */
+bool ChunkStore::Write(int fd, const void *buf, size_t size, off_t offset, ssize_t *ssize_ptr) {
+  if (!is_attached(fd)) {
+    return false;
+  }
+  ChunkFile *file = files_[fd];
+
+  if (appends_[fd]) {
+    file->mutex.Lock();
+    offset = file->size;
+    file->size += size;
+    file->mutex.Unlock();
+  }
+
+  size_t chunk_size = file->chunk_size;
+  char *chunk_buf = NULL;
+  char *packed = NULL;
+  size_t done = 0;
+  Error error = kCBBSuccess;
+
+  while (done < size) {
+    off_t position = offset + done;
+    uint64_t chunk = position / chunk_size;
+    off_t chunk_offset = chunk * chunk_size;
+    size_t begin = position - chunk_offset;
+    size_t end = std::min(chunk_size, begin + (size - done));
+    const char *src = (const char *)buf + done;
+
+    Mutex &lock = chunk_lock(file, chunk);
+    lock.Lock();
+    file->mutex.Lock();
+    off_t file_size = file->size;
+    bool was_packed = is_packed(file, chunk);
+    file->mutex.Unlock();
+
+    size_t old_length = file_size > chunk_offset ? std::min<off_t>(chunk_size, file_size - chunk_offset): 0;
+    size_t length = std::max(old_length, end);
+    bool is_whole = begin == 0 && end >= old_length;
+
+    if (!was_packed && old_length > 0 && !is_whole && !(old_length < chunk_size && length == chunk_size)) {
+      Extend(fd, file, chunk_offset + end, false);
+      ssize_t ssize = pwrite(fd, src, end - begin, chunk_offset + begin);
+      if (ssize != (ssize_t)(end - begin)) {
+        error = ssize < 0 ? -errno: -EIO;
+      }
+    } else {
+      if (packed == NULL) {
+        chunk_buf = buffer(file, &packed);
+      }
+      const char *data = src;
+      if (!is_whole) {
+        // 既存の内容に重ねる (ファイルの末尾より後ろは0)
+        ssize_t ssize = old_length > 0 ? LoadChunk(fd, file, chunk, old_length, was_packed, chunk_buf, packed): 0;
+        if (ssize < 0) {
+          error = ssize;
+        } else {
+          memset(chunk_buf + old_length, 0, length - old_length);
+          memcpy(chunk_buf + begin, src, end - begin);
+          data = chunk_buf;
+        }
+      }
+      if (error == kCBBSuccess) {
+        error = StoreChunk(fd, file, chunk, data, length, old_length, was_packed, packed);
+      }
+    }
+    lock.Unlock();
+
+    if (error != kCBBSuccess) {
+      break;
+    }
+    done += end - begin;
+  }
+
+  *ssize_ptr = done > 0 ? (ssize_t)done: error;
+  return true;
+}
+
+/**
+ * @breaf ファイルサイズ変更 (途中で切るチャンクが圧縮されている場合は切った長さで保存し直す)
+ * @param fd ファイルディスクリプタ
+ * @param size サイズ
+ * @param result_ptr 結果保存ポインタ (Error値)
+ * @return bool 圧縮形式として処理したかどうか (falseの場合は呼び出し元で ftruncate する)
+ */
+bool ChunkStore::Truncate(int fd, off_t size, int *result_ptr) {
+  if (!is_attached(fd)) {
+    return false;
+  }
+  ChunkFile *file = files_[fd];
+
+  size_t chunk_size = file->chunk_size;
+  uint64_t chunk = size / chunk_size;
+  off_t chunk_offset = chunk * chunk_size;
+  size_t length = size - chunk_offset;
+
+  Mutex &lock = chunk_lock(file, chunk);
+  lock.Lock();
+  file->mutex.Lock();
+  off_t file_size = file->size;
+  bool was_packed = is_packed(file, chunk);
+  file->mutex.Unlock();
+
+  Error error = kCBBSuccess;
+  if (length > 0 && was_packed && size < file_size) {
+    size_t old_length = std::min<off_t>(chunk_size, file_size - chunk_offset);
+    char *packed = NULL;
+    char *chunk_buf = buffer(file, &packed);
+    ssize_t ssize = LoadChunk(fd, file, chunk, old_length, true, chunk_buf, packed);
+    error = ssize < 0 ? ssize: StoreChunk(fd, file, chunk, chunk_buf, length, old_length, true, packed);
+  }
+
+  if (error == kCBBSuccess) {
+    file->mutex.Lock();
+    if (ftruncate(fd, size) != 0) {
+      error = -errno;
+    } else {
+      file->size = size;
+      TrimIndex(fd, file);
+    }
+    file->mutex.Unlock();
+  }
+  lock.Unlock();
+
+  *result_ptr = error;
+  return true;
+}
+
+/**
+ * @breaf 圧縮形式のファイルかどうか
+ * @param path ファイルパス
+ * @return bool 圧縮形式かどうか
+ */
+bool ChunkStore::is_chunked(const char *path) {
+  return getxattr(path, CHUNKED_XATTR_NAME, NULL, 0) >= 0;
+}
+
+/**
+ * @breaf 圧縮形式のファイルを作るLocalストレージの記録 (圧縮を止めた後も展開して読むため)
+ * @param root Localストレージのルートパス
+ * @return bool 記録できたかどうか
+ */
+bool ChunkStore::MarkStorage(const char *root) {
+  return setxattr(root, MARKED_XATTR_NAME, "1", 1, 0) == 0;
+}
+
+/**
+ * @breaf 圧縮形式のファイルを作ったことがあるLocalストレージかどうか
+ * @param root Localストレージのルートパス
+ * @return bool 記録があるかどうか
+ */
+bool ChunkStore::is_marked(const char *root) {
+  return getxattr(root, MARKED_XATTR_NAME, NULL, 0) >= 0;
+}
+
+/**
+ * @breaf ファイルの共有情報の取得 (初めて開いた場合は索引を読み込む)
+ * @param fd ファイルディスクリプタ
+ * @param st ファイル属性
+ * @param type 圧縮方式
+ * @param chunk_size チャンクサイズ
+ * @param is_truncate 切り詰めて開いたかどうか
+ * @return ファイルの共有情報
+ */
+ChunkStore::ChunkFile *ChunkStore::AcquireFile(int fd, const struct stat &st, int type, size_t chunk_size, bool is_truncate) {
+  std::pair<dev_t, ino_t> key(st.st_dev, st.st_ino);
+
+  mutex_.Lock();
+  ChunkFiles::iterator it = chunk_files_.find(key);
+  ChunkFile *file;
+  if (it != chunk_files_.end()) {
+    file = it->second;
+    if (is_truncate) {
+      file->mutex.Lock();
+      file->size = st.st_size;
+      TrimIndex(fd, file);
+      file->mutex.Unlock();
+    }
+  } else {
+    file = new ChunkFile();
+    file->dev = st.st_dev;
+    file->ino = st.st_ino;
+    file->count = 0;
+    file->type = type;
+    file->chunk_size = chunk_size;
+    file->size = st.st_size;
+    file->is_index_full = false;
+    file->mutex.Init();
+
+    ssize_t length = fgetxattr(fd, CHUNKS_XATTR_NAME, NULL, 0);
+    if (length > 0) {
+      file->index.resize(length);
+      length = fgetxattr(fd, CHUNKS_XATTR_NAME, &file->index[0], length);
+      file->index.resize(std::max<ssize_t>(length, 0));
+    }
+    TrimIndex(fd, file);
+    chunk_files_[key] = file;
+  }
+  file->count++;
+  mutex_.Unlock();
+
+  return file;
+}
+
+/**
+ * @breaf チャンクの排他の取得
+ * @param file ファイルの共有情報
+ * @param chunk チャンク番号
+ * @return 排他
+ */
+Mutex &ChunkStore::chunk_lock(const ChunkFile *file, uint64_t chunk) {
+  uint64_t hash = (uint64_t)file->ino * 0x9e3779b97f4a7c15ULL + chunk;
+  return chunk_locks_[(hash >> 32) % CHUNK_STORE_LOCKS];
+}
+
+/**
+ * @breaf チャンクの内容の読み込み (チャンクの排他を取得して呼ぶ)
+ *   圧縮の印があってもヘッダーが正しくない場合 (保存の途中で停止した場合) は、そのまま保存されたものとして扱う。
+ * @param fd ファイルディスクリプタ
+ * @param file ファイルの共有情報
+ * @param chunk チャンク番号
+ * @param length チャンクの長さ
+ * @param is_packed 圧縮されているかどうか
+ * @param dst 読み込み先 (length 以上)
+ * @param packed 圧縮データの読み込みに使う作業領域
+ * @return 読み込んだサイズ (負の場合はError値)
+ */
+ssize_t ChunkStore::LoadChunk(int fd, ChunkFile *file, uint64_t chunk, size_t length, bool is_packed,
+                              char *dst, char *packed) {
+  off_t chunk_offset = chunk * file->chunk_size;
+  if (!is_packed) {
+    ssize_t ssize = pread(fd, dst, length, chunk_offset);
+    if (ssize < 0) {
+      return -errno;
+    }
+    memset(dst + ssize, 0, length - ssize);
+    return length;
+  }
+
+  ssize_t ssize = pread(fd, packed, length, chunk_offset);
+  if (ssize < 0) {
+    return -errno;
+  }
+
+  ChunkHeader header;
+  if ((size_t)ssize >= sizeof(header)) {
+    memcpy(&header, packed, sizeof(header));
+    if (header.magic == CHUNK_MAGIC && (int)header.type == file->type && header.length <= length &&
+        header.size <= ssize - sizeof(header) &&
+        Compressor::Decompress(header.type, packed + sizeof(header), header.size, dst, header.length) == header.length) {
+      memset(dst + header.length, 0, length - header.length);
+      return length;
+    }
+  }
+
+  memcpy(dst, packed, ssize);
+  memset(dst + ssize, 0, length - ssize);
+  return length;
+}
+
+/**
+ * @breaf チャンクの保存 (チャンクの排他を取得して呼ぶ)
+ *   圧縮してブロック数が減る場合は索引に印を付けてから圧縮データを書き、以前の内容の残りを穴にする。
+ *   減らない場合はそのまま書いてから印を消す (どちらも途中で停止した場合は読み込み時にそのまま保存されたものとして扱える)。
+ * @param fd ファイルディスクリプタ
+ * @param file ファイルの共有情報
+ * @param chunk チャンク番号
+ * @param data チャンクの内容
+ * @param length チャンクの長さ
+ * @param old_length 以前のチャンクの長さ
+ * @param was_packed 以前の内容が圧縮されていたかどうか
+ * @param packed 圧縮に使う作業領域
+ * @return Error値
+ */
+Error ChunkStore::StoreChunk(int fd, ChunkFile *file, uint64_t chunk, const char *data, size_t length,
+                             size_t old_length, bool was_packed, char *packed) {
+  off_t chunk_offset = chunk * file->chunk_size;
+  size_t capacity = Compressor::Bound(file->type, file->chunk_size);
+
+  ssize_t csize = -1;
+  if (length > CHUNK_STORE_BLOCK) {
+    csize = Compressor::Compress(file->type, level_, data, length, packed + sizeof(ChunkHeader), capacity);
+  }
+  size_t packed_end = csize > 0 ? round_up(sizeof(ChunkHeader) + csize): length;
+
+  if (csize > 0 && packed_end < length && (was_packed || MarkPacked(fd, file, chunk, true))) {
+    ChunkHeader header;
+    header.magic = CHUNK_MAGIC;
+    header.type = file->type;
+    header.size = csize;
+    header.length = length;
+    memcpy(packed, &header, sizeof(header));
+
+    ssize_t ssize = pwrite(fd, packed, sizeof(header) + csize, chunk_offset);
+    if (ssize != (ssize_t)(sizeof(header) + csize)) {
+      return ssize < 0 ? -errno: -EIO;
+    }
+    // 空き容量を戻せない (穴に対応していない) 場合も内容は正しい
+    if (old_length > packed_end) {
+      fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, chunk_offset + packed_end, old_length - packed_end);
+    }
+    Extend(fd, file, chunk_offset + length, true);
+    return kCBBSuccess;
+  }
+
+  Extend(fd, file, chunk_offset + length, false);
+  ssize_t ssize = pwrite(fd, data, length, chunk_offset);
+  if (ssize != (ssize_t)length) {
+    return ssize < 0 ? -errno: -EIO;
+  }
+  if (was_packed) {
+    MarkPacked(fd, file, chunk, false);
+  }
+  return kCBBSuccess;
+}
+
+/**
+ * @breaf ファイルサイズの拡張
+ *   圧縮したチャンクは書いた範囲がチャンクの長さより短いため、末尾のチャンクの場合は ftruncate で広げる。
+ *   そのまま書くチャンクは書き込み前に呼び、後ろに書き込み中の範囲がある場合は縮めないようにする。
+ * @param fd ファイルディスクリプタ
+ * @param file ファイルの共有情報
+ * @param end 書き込んだ範囲の終端
+ * @param is_packed 圧縮したチャンクかどうか
+ */
+void ChunkStore::Extend(int fd, ChunkFile *file, off_t end, bool is_packed) {
+  file->mutex.Lock();
+  if (end > file->size) {
+    file->size = end;
+  }
+  if (is_packed && end == file->size) {
+    ftruncate(fd, end);
+  }
+  file->mutex.Unlock();
+}
+
+/**
+ * @breaf チャンクが圧縮されているかどうか (file->mutex を取得して呼ぶ)
+ * @param file ファイルの共有情報
+ * @param chunk チャンク番号
+ * @return bool 圧縮されているかどうか
+ */
+bool ChunkStore::is_packed(const ChunkFile *file, uint64_t chunk) {
+  return chunk / 8 < file->index.size() && (file->index[chunk / 8] & (1 << (chunk % 8))) != 0;
+}
+
+/**
+ * @breaf 索引の印の変更
+ * @param fd ファイルディスクリプタ
+ * @param file ファイルの共有情報
+ * @param chunk チャンク番号
+ * @param is_packed 圧縮されているかどうか
+ * @return bool 変更できたかどうか (索引を保存できない場合は圧縮しない)
+ */
+bool ChunkStore::MarkPacked(int fd, ChunkFile *file, uint64_t chunk, bool is_packed) {
+  file->mutex.Lock();
+  if (is_packed && (file->is_index_full || chunk / 8 >= CHUNK_STORE_INDEX_MAX)) {
+    file->mutex.Unlock();
+    return false;
+  }
+  if (chunk / 8 >= file->index.size()) {
+    file->index.resize(chunk / 8 + 1, 0);
+  }
+  uint8_t bit = 1 << (chunk % 8);
+  uint8_t old_value = file->index[chunk / 8];
+  file->index[chunk / 8] = is_packed ? (old_value | bit): (old_value & ~bit);
+
+  bool result = true;
+  if (file->index[chunk / 8] != old_value && !SaveIndex(fd, file)) {
+    // 拡張属性の上限を超えた場合、以降のチャンクは圧縮しない
+    file->index[chunk / 8] = old_value;
+    file->is_index_full = is_packed;
+    result = false;
+  }
+  file->mutex.Unlock();
+  return result;
+}
+
+/**
+ * @breaf ファイルの末尾より後ろの索引の削除 (file->mutex を取得して呼ぶ)
+ * @param fd ファイルディスクリプタ
+ * @param file ファイルの共有情報
+ */
+void ChunkStore::TrimIndex(int fd, ChunkFile *file) {
+  uint64_t chunks = (file->size + file->chunk_size - 1) / file->chunk_size;
+  bool is_changed = false;
+  for (uint64_t chunk = chunks; chunk < file->index.size() * 8; chunk++) {
+    if (is_packed(file, chunk)) {
+      file->index[chunk / 8] &= ~(1 << (chunk % 8));
+      is_changed = true;
+    }
+  }
+  if (is_changed) {
+    SaveIndex(fd, file);
+  }
+  file->is_index_full = false;
+}
+
+/**
+ * @breaf 索引の保存 (file->mutex を取得して呼ぶ。印のある最後のバイトまでを保存する)
+ * @param fd ファイルディスクリプタ
+ * @param file ファイルの共有情報
+ * @return bool 保存できたかどうか
+ */
+bool ChunkStore::SaveIndex(int fd, ChunkFile *file) {
+  size_t length = file->index.size();
+  while (length > 0 && file->index[length - 1] == 0) {
+    length--;
+  }
+  if (length == 0) {
+    return fremovexattr(fd, CHUNKS_XATTR_NAME) == 0 || errno == ENODATA;
+  }
+  return fsetxattr(fd, CHUNKS_XATTR_NAME, &file->index[0], length, 0) == 0;
+}
+
+/**
+ * @breaf スレッドごとの作業領域の取得 (チャンクの内容と圧縮データ)
+ * @param file ファイルの共有情報
+ * @param packed_ptr 圧縮データの作業領域保存ポインタ
+ * @return チャンクの内容の作業領域
+ */
+char *ChunkStore::buffer(const ChunkFile *file, char **packed_ptr) {
+  size_t capacity = sizeof(ChunkHeader) + std::max(Compressor::Bound(file->type, file->chunk_size), file->chunk_size);
+  size_t size = file->chunk_size + capacity;
+  if (tls_buffer_size < size) {
+    pthread_once(&g_buffer_once, CreateBufferKey);
+    free(tls_buffer);
+    tls_buffer = (char *)malloc(size);
+    tls_buffer_size = tls_buffer != NULL ? size: 0;
+    pthread_setspecific(g_buffer_key, tls_buffer);
+    assert(tls_buffer != NULL);
+  }
+  *packed_ptr = tls_buffer + file->chunk_size;
+  return tls_buffer;
+}
+
+} /* namespace cbb */
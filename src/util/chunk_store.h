@@ -0,0 +1,115 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef UTIL_CHUNK_STORE_H_
+#define UTIL_CHUNK_STORE_H_
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <map>
+#include <vector>
+
+#include "common/error.h"
+#include "util/mutex.h"
+
+#define CHUNK_STORE_FILE_MAX 4096            // 圧縮形式で開けるファイルの上限 (fd番号がこれ未満のもの)
+#define CHUNK_STORE_CHUNK_SIZE (128 << 10)   // 既定のチャンクサイズ
+#define CHUNK_STORE_BLOCK 4096               // 空き容量を戻す単位 (圧縮してもブロック数が減らないチャンクはそのまま保存する)
+#define CHUNK_STORE_INDEX_MAX (64 << 10)     // 索引 (拡張属性) の最大バイト数 (ファイルシステムの上限が小さい場合はそこまで)
+#define CHUNK_STORE_LOCKS 256                // チャンクの読み書きの排他の数 (ファイルとチャンク番号のハッシュで分ける)
+
+namespace cbb {
+
+// Localストレージのチャンク単位の圧縮形式クラス
+//   ファイルを固定サイズのチャンクに分け、チャンク i を元と同じオフセット (i * チャンクサイズ) に置く。
+//   圧縮が効いたチャンクはヘッダーと圧縮データだけを書き、残りは穴にして空き容量を戻すため、
+//   ファイルサイズは元のままで、ランダムな読み込みは触れたチャンクだけを展開する。
+//   どのチャンクが圧縮されているかの索引 (ビット列) は拡張属性に持ち、書き込みで変わった時だけ保存する。
+//   圧縮形式のファイルは形式の拡張属性で見分け、開いた時に登録してfd番号で引く。
+class ChunkStore {
+
+ public:
+
+  ChunkStore();
+  virtual ~ChunkStore();
+
+  bool Init(int type, int level, size_t chunk_size);
+  void Destroy();
+
+  bool Attach(int fd, int flags);
+  void Detach(int fd);
+  bool Format(int fd);
+
+  bool is_attached(int fd) const {
+    return fd >= 0 && fd < CHUNK_STORE_FILE_MAX && files_[fd] != NULL;
+  }
+  bool Read(int fd, void *buf, size_t size, off_t offset, ssize_t *ssize_ptr);
+  bool Write(int fd, const void *buf, size_t size, off_t offset, ssize_t *ssize_ptr);
+  bool Truncate(int fd, off_t size, int *result_ptr);
+
+  int type() const { return type_; }
+  size_t chunk_size() const { return chunk_size_; }
+
+  static bool is_chunked(const char *path);
+  static bool MarkStorage(const char *root);
+  static bool is_marked(const char *root);
+
+ private:
+
+  /// 圧縮形式のファイル (同じファイルを開いたfdで共有する)
+  struct ChunkFile {
+    dev_t dev;
+    ino_t ino;
+    int count;                    // 登録しているfdの数
+    int type;                     // 圧縮方式
+    size_t chunk_size;
+    off_t size;                   // ファイルサイズ (書き込み中の範囲を含む)
+    std::vector<uint8_t> index;   // チャンクごとの圧縮されているかどうか
+    bool is_index_full;           // 索引を拡張属性に保存できなくなったかどうか (以降はそのまま保存する)
+    Mutex mutex;                  // size, index の排他
+  };
+  typedef std::map<std::pair<dev_t, ino_t>, ChunkFile *> ChunkFiles;
+
+  ChunkFile *AcquireFile(int fd, const struct stat &st, int type, size_t chunk_size, bool is_truncate);
+  Mutex &chunk_lock(const ChunkFile *file, uint64_t chunk);
+
+  ssize_t LoadChunk(int fd, ChunkFile *file, uint64_t chunk, size_t length, bool is_packed, char *dst, char *packed);
+  Error StoreChunk(int fd, ChunkFile *file, uint64_t chunk, const char *data, size_t length,
+                   size_t old_length, bool was_packed, char *packed);
+  void Extend(int fd, ChunkFile *file, off_t end, bool is_packed);
+
+  static bool is_packed(const ChunkFile *file, uint64_t chunk);
+  static bool MarkPacked(int fd, ChunkFile *file, uint64_t chunk, bool is_packed);
+  static void TrimIndex(int fd, ChunkFile *file);
+  static bool SaveIndex(int fd, ChunkFile *file);
+
+  char *buffer(const ChunkFile *file, char **packed_ptr);
+
+  int type_;            // 新しく作るファイルの圧縮方式 (kCompressNone の場合は作らず、既存のファイルの読み書きだけ行う)
+  int level_;
+  size_t chunk_size_;
+
+  ChunkFile *volatile files_[CHUNK_STORE_FILE_MAX];   // fd番号ごとの圧縮形式のファイル (NULLの場合は通常のファイル)
+  volatile char appends_[CHUNK_STORE_FILE_MAX];       // 追記モードで開いたかどうか (O_APPEND は外して開き直さずに使う)
+  ChunkFiles chunk_files_;
+  Mutex mutex_;
+  Mutex chunk_locks_[CHUNK_STORE_LOCKS];
+};
+
+} /* namespace cbb */
+
+#endif /* UTIL_CHUNK_STORE_H_ */
@@ -0,0 +1,334 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "compressor.h"
+
+#include <pthread.h>
+
+#include <algorithm>
+
+#ifdef CBB_HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef CBB_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "common/common.h"
+
+namespace cbb {
+
+namespace {
+
+const char *g_type_names[] = {
+  "none",
+  "lz4",
+  "zstd",
+};
+
+#ifdef CBB_HAVE_ZSTD
+pthread_once_t g_zstd_once = PTHREAD_ONCE_INIT;
+pthread_key_t g_zstd_cctx_key;
+pthread_key_t g_zstd_dctx_key;
+__thread ZSTD_CCtx *tls_zstd_cctx = NULL;
+__thread ZSTD_DCtx *tls_zstd_dctx = NULL;
+
+void FreeCCtx(void *data) {
+  ZSTD_freeCCtx((ZSTD_CCtx *)data);
+}
+
+void FreeDCtx(void *data) {
+  ZSTD_freeDCtx((ZSTD_DCtx *)data);
+}
+
+/**
+ * @breaf スレッド終了時の破棄の登録 (初回の取得時に一度だけ呼ばれる)
+ */
+void CreateZstdKeys() {
+  pthread_key_create(&g_zstd_cctx_key, FreeCCtx);
+  pthread_key_create(&g_zstd_dctx_key, FreeDCtx);
+}
+
+/**
+ * @breaf 現在のスレッドの圧縮コンテキストを取得する (要求ごとの確保を避ける)
+ * @return コンテキスト
+ */
+ZSTD_CCtx *zstd_cctx() {
+  if (tls_zstd_cctx == NULL) {
+    pthread_once(&g_zstd_once, CreateZstdKeys);
+    tls_zstd_cctx = ZSTD_createCCtx();
+    pthread_setspecific(g_zstd_cctx_key, tls_zstd_cctx);
+  }
+  return tls_zstd_cctx;
+}
+
+/**
+ * @breaf 現在のスレッドの展開コンテキストを取得する
+ * @return コンテキスト
+ */
+ZSTD_DCtx *zstd_dctx() {
+  if (tls_zstd_dctx == NULL) {
+    pthread_once(&g_zstd_once, CreateZstdKeys);
+    tls_zstd_dctx = ZSTD_createDCtx();
+    pthread_setspecific(g_zstd_dctx_key, tls_zstd_dctx);
+  }
+  return tls_zstd_dctx;
+}
+#endif
+
+} // namespace
+
+/**
+ * @breaf 初期化
+ * @param type 圧縮方式 (使えない方式の場合は圧縮しない)
+ * @param level 圧縮レベル (0の場合は方式の既定値。LZ4 は負の値で高速化、正の値で LZ4HC)
+ * @param min_size 圧縮する最小サイズ
+ */
+void Compressor::Init(int type, int level, size_t min_size) {
+  type_ = is_supported(type) ? type: kCompressNone;
+  level_ = level;
+  min_size_ = min_size;
+  skip_ = 0;
+  backoff_ = 0;
+}
+
+/**
+ * @breaf 圧縮を試みるかどうか (圧縮が効かなかった後は決まった回数だけ見送る)
+ * @param size データサイズ
+ * @return bool 圧縮を試みるかどうか
+ */
+bool Compressor::ShouldCompress(size_t size) {
+  if (type_ == kCompressNone || size < min_size_) {
+    return false;
+  }
+  // 他のスレッドと同時に減らしても見送る回数を超えないように、0より大きい場合だけ減らす
+  int skip = skip_;
+  while (skip > 0) {
+    int prev = __sync_val_compare_and_swap(&skip_, skip, skip - 1);
+    if (prev == skip) {
+      return false;
+    }
+    skip = prev;
+  }
+  return true;
+}
+
+/**
+ * @breaf 圧縮 (結果を次の ShouldCompress の判定に使う)
+ * @param src データ
+ * @param size データサイズ
+ * @param dst 圧縮データ保存先
+ * @param capacity 保存先のサイズ (Bound 以上)
+ * @return 圧縮後のサイズ (効かなかった、失敗した場合は -1)
+ */
+ssize_t Compressor::Compress(const char *src, size_t size, char *dst, size_t capacity) {
+  ssize_t csize = Compress(type_, level_, src, size, dst, capacity);
+  if (csize < 0 || (size_t)csize * 100 > size * COMPRESS_RATIO_LIMIT) {
+    Record(false);
+    return -1;
+  }
+  Record(true);
+  return csize;
+}
+
+/**
+ * @breaf 圧縮が効いたかどうかの記録 (通信先で圧縮した場合に使う)
+ * @param is_effective 圧縮が効いたかどうか
+ */
+void Compressor::Record(bool is_effective) {
+  if (is_effective) {
+    __sync_lock_test_and_set(&backoff_, 0);
+    return;
+  }
+
+  int backoff = backoff_;
+  int next;
+  while (true) {
+    next = std::min(std::max(backoff * 2, 1), COMPRESS_SKIP_MAX);
+    int prev = __sync_val_compare_and_swap(&backoff_, backoff, next);
+    if (prev == backoff) {
+      break;
+    }
+    backoff = prev;
+  }
+  __sync_lock_test_and_set(&skip_, next);
+}
+
+/**
+ * @breaf 圧縮後の最大サイズ
+ * @param type 圧縮方式
+ * @param size データサイズ
+ * @return 最大サイズ
+ */
+size_t Compressor::Bound(int type, size_t size) {
+  switch (type) {
+#ifdef CBB_HAVE_LZ4
+  case kCompressLZ4:
+    return LZ4_compressBound((int)size);
+#endif
+#ifdef CBB_HAVE_ZSTD
+  case kCompressZstd:
+    return ZSTD_compressBound(size);
+#endif
+  default:
+    return size;
+  }
+}
+
+/**
+ * @breaf 展開後の最大サイズ (通信先が申告した展開後のサイズの検査に使う)
+ * @param type 圧縮方式
+ * @param size 圧縮データのサイズ
+ * @return 最大サイズ (使えない方式の場合は0)
+ */
+size_t Compressor::DecompressBound(int type, size_t size) {
+  size_t ratio = 0;
+  switch (type) {
+#ifdef CBB_HAVE_LZ4
+  case kCompressLZ4:
+    ratio = COMPRESS_LZ4_MAX_RATIO;
+    break;
+#endif
+#ifdef CBB_HAVE_ZSTD
+  case kCompressZstd:
+    ratio = COMPRESS_ZSTD_MAX_RATIO;
+    break;
+#endif
+  default:
+    return 0;
+  }
+  return size > SIZE_MAX / ratio ? SIZE_MAX: size * ratio;
+}
+
+/**
+ * @breaf 圧縮
+ * @param type 圧縮方式
+ * @param level 圧縮レベル
+ * @param src データ
+ * @param size データサイズ
+ * @param dst 圧縮データ保存先
+ * @param capacity 保存先のサイズ
+ * @return 圧縮後のサイズ (失敗した場合は -1)
+ */
+ssize_t Compressor::Compress(int type, int level, const char *src, size_t size, char *dst, size_t capacity) {
+  switch (type) {
+#ifdef CBB_HAVE_LZ4
+  case kCompressLZ4: {
+    if (size > LZ4_MAX_INPUT_SIZE) {
+      return -1;
+    }
+    int csize;
+    if (level > 0) {
+      csize = LZ4_compress_HC(src, dst, (int)size, (int)std::min(capacity, (size_t)INT32_MAX), level);
+    } else {
+      csize = LZ4_compress_fast(src, dst, (int)size, (int)std::min(capacity, (size_t)INT32_MAX), level < 0 ? -level: 1);
+    }
+    return csize > 0 ? csize: -1;
+  }
+#endif
+#ifdef CBB_HAVE_ZSTD
+  case kCompressZstd: {
+    ZSTD_CCtx *cctx = zstd_cctx();
+    if (cctx == NULL) {
+      return -1;
+    }
+    size_t csize = ZSTD_compressCCtx(cctx, dst, capacity, src, size, level);
+    return ZSTD_isError(csize) ? -1: (ssize_t)csize;
+  }
+#endif
+  default:
+    return -1;
+  }
+}
+
+/**
+ * @breaf 展開
+ * @param type 圧縮方式
+ * @param src 圧縮データ
+ * @param size 圧縮データサイズ
+ * @param dst データ保存先
+ * @param capacity 保存先のサイズ (元のデータサイズ以上)
+ * @return 展開後のサイズ (失敗した場合は -1)
+ */
+ssize_t Compressor::Decompress(int type, const char *src, size_t size, char *dst, size_t capacity) {
+  switch (type) {
+#ifdef CBB_HAVE_LZ4
+  case kCompressLZ4: {
+    int dsize = LZ4_decompress_safe(src, dst, (int)size, (int)std::min(capacity, (size_t)INT32_MAX));
+    return dsize >= 0 ? dsize: -1;
+  }
+#endif
+#ifdef CBB_HAVE_ZSTD
+  case kCompressZstd: {
+    ZSTD_DCtx *dctx = zstd_dctx();
+    if (dctx == NULL) {
+      return -1;
+    }
+    size_t dsize = ZSTD_decompressDCtx(dctx, dst, capacity, src, size);
+    return ZSTD_isError(dsize) ? -1: (ssize_t)dsize;
+  }
+#endif
+  default:
+    return -1;
+  }
+}
+
+/**
+ * @breaf 圧縮方式が使えるかどうか
+ * @param type 圧縮方式
+ * @return bool 使えるかどうか (kCompressNone は常に使える)
+ */
+bool Compressor::is_supported(int type) {
+  switch (type) {
+  case kCompressNone:
+    return true;
+#ifdef CBB_HAVE_LZ4
+  case kCompressLZ4:
+    return true;
+#endif
+#ifdef CBB_HAVE_ZSTD
+  case kCompressZstd:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+/**
+ * @breaf 圧縮方式名の解析
+ * @param name 圧縮方式名 (none, lz4, zstd)
+ * @return 圧縮方式 (不明な場合は -1)
+ */
+int Compressor::Parse(const std::string &name) {
+  for (int type = kCompressNone; type < kCompressTypeMax; type++) {
+    if (name == g_type_names[type]) {
+      return type;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @breaf 圧縮方式名
+ * @param type 圧縮方式
+ * @return 圧縮方式名
+ */
+const char *Compressor::name(int type) {
+  return type >= kCompressNone && type < kCompressTypeMax ? g_type_names[type]: "unknown";
+}
+
+} /* namespace cbb */
@@ -0,0 +1,81 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef UTIL_COMPRESSOR_H_
+#define UTIL_COMPRESSOR_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+
+#define COMPRESS_MIN_SIZE 4096     // 既定の圧縮する最小サイズ (これ未満は圧縮しない)
+#define COMPRESS_RATIO_LIMIT 90    // 圧縮後のサイズが元のサイズのこの割合(%)を超える場合は圧縮しない
+#define COMPRESS_SKIP_MAX 64       // 圧縮が効かなかった後に圧縮を見送る回数の上限
+#define COMPRESS_LZ4_MAX_RATIO 255     // LZ4 の展開後のサイズの圧縮データに対する最大の倍率
+#define COMPRESS_ZSTD_MAX_RATIO 32768  // Zstd の展開後のサイズの最大の倍率 (128KiB の RLE ブロックが4バイト)
+
+namespace cbb {
+
+/// 圧縮方式 (ビルド時にライブラリがない方式は使えない)
+enum CompressType {
+  kCompressNone = 0,
+  kCompressLZ4 = 1,
+  kCompressZstd = 2,
+  kCompressTypeMax,
+};
+
+// データ圧縮クラス
+//   圧縮が効かない (圧縮後のサイズが COMPRESS_RATIO_LIMIT を超える) データが続く場合は、
+//   見送る回数を倍々に増やして圧縮を試みる回数を減らし、効いた時点で元に戻す。
+//   見送りの状態は通信先ごと等の単位で持ち、複数のスレッドから同時に使ってよい (不可分に更新する)。
+class Compressor {
+
+ public:
+
+  Compressor() : type_(kCompressNone), level_(0), min_size_(COMPRESS_MIN_SIZE), skip_(0), backoff_(0) {}
+  virtual ~Compressor() {}
+
+  void Init(int type, int level, size_t min_size);
+
+  int type() const { return type_; }
+  int level() const { return level_; }
+  bool is_enabled() const { return type_ != kCompressNone; }
+
+  bool ShouldCompress(size_t size);
+  void Record(bool is_effective);
+  ssize_t Compress(const char *src, size_t size, char *dst, size_t capacity);
+
+  static size_t Bound(int type, size_t size);
+  static size_t DecompressBound(int type, size_t size);
+  static ssize_t Compress(int type, int level, const char *src, size_t size, char *dst, size_t capacity);
+  static ssize_t Decompress(int type, const char *src, size_t size, char *dst, size_t capacity);
+
+  static bool is_supported(int type);
+  static int Parse(const std::string &name);
+  static const char *name(int type);
+
+ private:
+
+  int type_;
+  int level_;
+  size_t min_size_;
+  volatile int skip_;     // 残りの見送る回数
+  volatile int backoff_;  // 次に圧縮が効かなかった場合に見送る回数
+};
+
+} /* namespace cbb */
+
+#endif /* UTIL_COMPRESSOR_H_ */
@@ -0,0 +1,471 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "device_stripe.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include <algorithm>
+
+#include <boost/filesystem.hpp>
+
+#define STRIPE_XATTR_NAME "user.cbb.devstripe"  // ストライプサイズとデバイスのルートの一覧 (改行区切り)
+
+namespace cbb {
+
+/**
+ * @breaf constructor
+ */
+DeviceStripe::DeviceStripe() {
+  for (int index = 0; index < DEVICE_STRIPE_FILE_MAX; index++) {
+    files_[index] = NULL;
+    appends_[index] = 0;
+  }
+  for (int index = 0; index < DEVICE_STRIPE_LOCKS; index++) {
+    locks_[index].Init();
+  }
+}
+
+/**
+ * @breaf destructor
+ */
+DeviceStripe::~DeviceStripe() {
+  for (int index = 0; index < DEVICE_STRIPE_FILE_MAX; index++) {
+    Detach(index);
+  }
+}
+
+/**
+ * @breaf 空のファイルをデバイス間でストライプする (新しく作成したファイル)
+ * @param fd ファイルディスクリプタ
+ * @param path ファイルの実パス (roots の先頭のルートの下にあること)
+ * @param roots ストライプするデバイスのルートパス (先頭はファイルのあるデバイス)
+ * @param stripe_size ストライプサイズ
+ * @return bool ストライプしたかどうか
+ */
+bool DeviceStripe::Create(int fd, const char *path, const std::vector<std::string> &roots, size_t stripe_size) {
+  if (fd < 0 || fd >= DEVICE_STRIPE_FILE_MAX || roots.size() < 2 || roots.size() > DEVICE_STRIPE_MAX ||
+      stripe_size == 0 || files_[fd] != NULL) {
+    return false;
+  }
+
+  struct stat st;
+  std::vector<std::string> paths;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size != 0 || !piece_paths(path, roots, &paths)) {
+    return false;
+  }
+
+  for (size_t index = 1; index < paths.size(); index++) {
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(boost::filesystem::path(paths[index]).parent_path(), ec);
+    int piece_fd = open(paths[index].c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (piece_fd < 0) {
+      return false;
+    }
+    close(piece_fd);
+  }
+
+  char value[32];
+  std::string layout(value, snprintf(value, sizeof(value), "%lu", (unsigned long)stripe_size));
+  for (size_t index = 0; index < roots.size(); index++) {
+    layout += "\n" + roots[index];
+  }
+  // 同時に作成した場合は先に設定したストライプを使う
+  if (fsetxattr(fd, STRIPE_XATTR_NAME, layout.data(), layout.size(), XATTR_CREATE) != 0 && errno != EEXIST) {
+    return false;
+  }
+
+  int flags = fcntl(fd, F_GETFL);
+  return flags != -1 && Attach(fd, path, flags) && files_[fd] != NULL;
+}
+
+/**
+ * @breaf 開いたファイルの登録 (ストライプしたファイルの場合だけ、他のストライプも開いて登録する)
+ * @param fd ファイルディスクリプタ
+ * @param path ファイルの実パス
+ * @param flags オープンフラグ
+ * @return bool 開いてよいかどうか (他のストライプを開けない場合は errno を設定して false)
+ */
+bool DeviceStripe::Attach(int fd, const char *path, int flags) {
+  size_t stripe_size;
+  std::vector<std::string> roots, paths;
+  if (!ReadLayout(path, fd, &stripe_size, &roots)) {
+    return true;
+  }
+  if (!piece_paths(path, roots, &paths)) {
+    errno = EIO;
+    return false;
+  }
+  if (fd >= DEVICE_STRIPE_FILE_MAX) {
+    errno = EMFILE;
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return false;
+  }
+
+  StripeFile *file = new StripeFile();
+  file->ino = st.st_ino;
+  file->stripe_size = stripe_size;
+  file->count = paths.size();
+  file->fds[0] = fd;
+
+  // 先頭と同じく切り詰め、同期書き込みの指定は引き継ぐ (作成は Create で行う)
+  int piece_flags = flags & (O_ACCMODE | O_TRUNC | O_SYNC | O_DSYNC);
+  for (int index = 1; index < file->count; index++) {
+    file->fds[index] = open(paths[index].c_str(), piece_flags);
+    if (file->fds[index] < 0) {
+      int error = errno;
+      while (--index > 0) {
+        close(file->fds[index]);
+      }
+      delete file;
+      errno = error;
+      return false;
+    }
+  }
+
+  // 書き込み位置は自分で決めるため、追記モードは外して記録する
+  if (flags & O_APPEND) {
+    int current = fcntl(fd, F_GETFL);
+    if (current != -1) {
+      fcntl(fd, F_SETFL, current & ~O_APPEND);
+    }
+    appends_[fd] = 1;
+  }
+
+  files_[fd] = file;
+  return true;
+}
+
+/**
+ * @breaf ファイルを閉じる前の登録解除 (他のストライプを閉じる)
+ * @param fd ファイルディスクリプタ
+ */
+void DeviceStripe::Detach(int fd) {
+  if (fd < 0 || fd >= DEVICE_STRIPE_FILE_MAX) {
+    return;
+  }
+  StripeFile *file = __sync_lock_test_and_set(&files_[fd], (StripeFile *)NULL);
+  appends_[fd] = 0;
+  if (file == NULL) {
+    return;
+  }
+
+  for (int index = 1; index < file->count; index++) {
+    close(file->fds[index]);
+  }
+  delete file;
+}
+
+/**
+ * @breaf ファイル読み込み (ストライプごとに分けて読み、書かれていない範囲は0)
+ * @param fd ファイルディスクリプタ
+ * @param buf バッファ
+ * @param size 読み込みサイズ
+ * @param offset オフセット
+ * @param ssize_ptr 読み込みサイズ保存ポインタ (エラーの場合は Error値)
+ * @return bool ストライプしたファイルとして処理したかどうか (falseの場合は呼び出し元で pread する)
+ */
+bool DeviceStripe::Read(int fd, void *buf, size_t size, off_t offset, ssize_t *ssize_ptr) {
+  if (!is_attached(fd)) {
+    return false;
+  }
+  StripeFile *file = files_[fd];
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    *ssize_ptr = -errno;
+    return true;
+  }
+  if (offset >= st.st_size) {
+    *ssize_ptr = 0;
+    return true;
+  }
+  size = std::min<off_t>(size, st.st_size - offset);
+
+  size_t done = 0;
+  Error error = kCBBSuccess;
+  while (done < size) {
+    off_t position = offset + done;
+    uint64_t unit = position / file->stripe_size;
+    size_t length = std::min<uint64_t>(size - done, (unit + 1) * file->stripe_size - position);
+    char *dst = (char *)buf + done;
+
+    ssize_t ssize = pread(file->fds[unit % file->count], dst, length, position);
+    if (ssize < 0) {
+      error = -errno;
+      break;
+    }
+    memset(dst + ssize, 0, length - ssize);
+    done += length;
+  }
+
+  *ssize_ptr = done > 0 ? (ssize_t)done: error;
+  return true;
+}
+
+/**
+ * @breaf ファイル書き込み (先にファイルサイズを広げてから、ストライプごとに分けて書く)
+ * @param fd ファイルディスクリプタ
+ * @param buf バッファ
+ * @param size 書き込みサイズ
+ * @param offset オフセット (追記モードの場合はファイルの末尾)
+ * @param ssize_ptr 書き込みサイズ保存ポインタ (エラーの場合は Error値)
+ * @return bool ストライプしたファイルとして処理したかどうか (falseの場合は呼び出し元で pwrite する)
+ */
+bool DeviceStripe::Write(int fd, const void *buf, size_t size, off_t offset, ssize_t *ssize_ptr) {
+  if (!is_attached(fd)) {
+    return false;
+  }
+  StripeFile *file = files_[fd];
+
+  Error error = Extend(fd, file, size, &offset);
+  size_t done = 0;
+  while (error == kCBBSuccess && done < size) {
+    off_t position = offset + done;
+    uint64_t unit = position / file->stripe_size;
+    size_t length = std::min<uint64_t>(size - done, (unit + 1) * file->stripe_size - position);
+
+    ssize_t ssize = pwrite(file->fds[unit % file->count], (const char *)buf + done, length, position);
+    if (ssize != (ssize_t)length) {
+      error = ssize < 0 ? -errno: -EIO;
+      break;
+    }
+    done += length;
+  }
+
+  *ssize_ptr = done > 0 ? (ssize_t)done: error;
+  return true;
+}
+
+/**
+ * @breaf ファイルサイズ変更 (すべてのストライプを同じサイズにする)
+ * @param fd ファイルディスクリプタ
+ * @param size サイズ
+ * @param result_ptr 結果保存ポインタ (Error値)
+ * @return bool ストライプしたファイルとして処理したかどうか (falseの場合は呼び出し元で ftruncate する)
+ */
+bool DeviceStripe::Truncate(int fd, off_t size, int *result_ptr) {
+  if (!is_attached(fd)) {
+    return false;
+  }
+  StripeFile *file = files_[fd];
+
+  Error error = kCBBSuccess;
+  lock(file).Lock();
+  for (int index = file->count - 1; index >= 0 && error == kCBBSuccess; index--) {
+    if (ftruncate(file->fds[index], size) != 0) {
+      error = -errno;
+    }
+  }
+  lock(file).Unlock();
+
+  *result_ptr = error;
+  return true;
+}
+
+/**
+ * @breaf ファイル同期 (すべてのストライプを同期する)
+ * @param fd ファイルディスクリプタ
+ * @param is_data Data Syncかどうか
+ * @param result_ptr 結果保存ポインタ (0 または -1)
+ * @return bool ストライプしたファイルとして処理したかどうか
+ */
+bool DeviceStripe::Sync(int fd, int is_data, int *result_ptr) {
+  if (!is_attached(fd)) {
+    return false;
+  }
+  StripeFile *file = files_[fd];
+
+  int result = 0;
+  for (int index = 0; index < file->count; index++) {
+    if ((is_data ? fdatasync(file->fds[index]) : fsync(file->fds[index])) != 0) {
+      result = -1;
+    }
+  }
+  *result_ptr = result;
+  return true;
+}
+
+/**
+ * @breaf ストライプ配置の取得
+ * @param fd ファイルディスクリプタ
+ * @param stripe_size_ptr ストライプサイズ保存ポインタ
+ * @param count_ptr ストライプするデバイス数保存ポインタ
+ * @return bool ストライプしたファイルかどうか
+ */
+bool DeviceStripe::layout(int fd, size_t *stripe_size_ptr, int *count_ptr) const {
+  if (!is_attached(fd)) {
+    return false;
+  }
+  *stripe_size_ptr = files_[fd]->stripe_size;
+  *count_ptr = files_[fd]->count;
+  return true;
+}
+
+/**
+ * @breaf デバイス間でストライプしたファイルかどうか
+ * @param path ファイルの実パス
+ * @return bool ストライプしたファイルかどうか
+ */
+bool DeviceStripe::is_striped(const char *path) {
+  return getxattr(path, STRIPE_XATTR_NAME, NULL, 0) >= 0;
+}
+
+/**
+ * @breaf 先頭以外のストライプの削除 (先頭のファイルは呼び出し元で削除する)
+ * @param path ファイルの実パス
+ * @return Error値
+ */
+Error DeviceStripe::Remove(const char *path) {
+  size_t stripe_size;
+  std::vector<std::string> roots, paths;
+  if (!ReadLayout(path, -1, &stripe_size, &roots) || !piece_paths(path, roots, &paths)) {
+    return kCBBSuccess;
+  }
+
+  Error error = kCBBSuccess;
+  for (size_t index = 1; index < paths.size(); index++) {
+    if (unlink(paths[index].c_str()) != 0 && errno != ENOENT) {
+      error = -errno;
+    }
+  }
+  return error;
+}
+
+/**
+ * @breaf 先頭以外のストライプの名前の変更 (先頭のファイルの名前を変える前に呼ぶ。同じデバイス内に限る)
+ * @param old_path 変更前の実パス
+ * @param new_path 変更後の実パス
+ * @return Error値
+ */
+Error DeviceStripe::Rename(const char *old_path, const char *new_path) {
+  size_t stripe_size;
+  std::vector<std::string> roots, old_paths, new_paths;
+  if (!ReadLayout(old_path, -1, &stripe_size, &roots) || !piece_paths(old_path, roots, &old_paths)) {
+    return kCBBSuccess;
+  }
+  if (!piece_paths(new_path, roots, &new_paths)) {
+    return -EXDEV;
+  }
+
+  Error error = kCBBSuccess;
+  for (size_t index = 1; index < old_paths.size(); index++) {
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(boost::filesystem::path(new_paths[index]).parent_path(), ec);
+    if (rename(old_paths[index].c_str(), new_paths[index].c_str()) != 0 && errno != ENOENT) {
+      error = -errno;
+    }
+  }
+  return error;
+}
+
+/**
+ * @breaf ファイルサイズの拡張 (書き込み前に呼び、後ろに書き込み中の範囲がある場合は縮めない)
+ * @param fd ファイルディスクリプタ
+ * @param file ストライプしたファイル
+ * @param size 書き込みサイズ
+ * @param offset_ptr オフセット (追記モードの場合はファイルの末尾を設定する)
+ * @return Error値
+ */
+Error DeviceStripe::Extend(int fd, StripeFile *file, size_t size, off_t *offset_ptr) {
+  Error error = kCBBSuccess;
+  lock(file).Lock();
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    error = -errno;
+  } else {
+    if (appends_[fd]) {
+      *offset_ptr = st.st_size;
+    }
+    if (*offset_ptr + (off_t)size > st.st_size && ftruncate(fd, *offset_ptr + size) != 0) {
+      error = -errno;
+    }
+  }
+  lock(file).Unlock();
+  return error;
+}
+
+/**
+ * @breaf 拡張属性からストライプ配置を読み込む
+ * @param path ファイルの実パス
+ * @param fd ファイルディスクリプタ (負の場合は path から読む)
+ * @param stripe_size_ptr ストライプサイズ保存ポインタ
+ * @param roots_ptr デバイスのルートパス保存ポインタ (配置が壊れている場合は空)
+ * @return bool ストライプしたファイルかどうか
+ */
+bool DeviceStripe::ReadLayout(const char *path, int fd, size_t *stripe_size_ptr, std::vector<std::string> *roots_ptr) {
+  char value[4096];
+  ssize_t length = fd >= 0 ? fgetxattr(fd, STRIPE_XATTR_NAME, value, sizeof(value) - 1):
+      getxattr(path, STRIPE_XATTR_NAME, value, sizeof(value) - 1);
+  if (length < 0) {
+    return false;
+  }
+  value[length] = '\0';
+
+  roots_ptr->clear();
+  for (char *line = strchr(value, '\n'); line != NULL; ) {
+    char *next = strchr(++line, '\n');
+    roots_ptr->push_back(next != NULL ? std::string(line, next - line): std::string(line));
+    line = next;
+  }
+  *stripe_size_ptr = strtoul(value, NULL, 10);
+  if (*stripe_size_ptr == 0 || roots_ptr->size() < 2 || roots_ptr->size() > DEVICE_STRIPE_MAX) {
+    roots_ptr->clear();
+  }
+  return true;
+}
+
+/**
+ * @breaf ストライプごとの実パスの作成
+ * @param path 先頭のストライプ (元のファイル) の実パス
+ * @param roots デバイスのルートパス
+ * @param paths_ptr 実パス保存ポインタ
+ * @return bool 作成できたかどうか (配置が壊れている、path が先頭のルートの下にない場合は false)
+ */
+bool DeviceStripe::piece_paths(const char *path, const std::vector<std::string> &roots, std::vector<std::string> *paths_ptr) {
+  if (roots.empty()) {
+    return false;
+  }
+  const std::string &home = roots[0];
+  if (strncmp(path, home.c_str(), home.size()) != 0) {
+    return false;
+  }
+  std::string relative(path + home.size());
+  std::string::size_type slash = relative.rfind('/');
+  std::string directory = slash != std::string::npos ? relative.substr(0, slash + 1): "/";
+  std::string name = slash != std::string::npos ? relative.substr(slash + 1): relative;
+
+  paths_ptr->clear();
+  paths_ptr->push_back(path);
+  for (size_t index = 1; index < roots.size(); index++) {
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), DEVICE_STRIPE_PREFIX "%lu.", (unsigned long)index);
+    paths_ptr->push_back(roots[index] + directory + prefix + name);
+  }
+  return true;
+}
+
+} /* namespace cbb */
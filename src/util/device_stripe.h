@@ -0,0 +1,80 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef UTIL_DEVICE_STRIPE_H_
+#define UTIL_DEVICE_STRIPE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include "common/error.h"
+#include "util/mutex.h"
+
+#define DEVICE_STRIPE_FILE_MAX 4096          // デバイス間でストライプしたファイルとして開ける上限 (fd番号がこれ未満のもの)
+#define DEVICE_STRIPE_MAX 16                 // ストライプするデバイス数の上限
+#define DEVICE_STRIPE_LOCKS 256              // ファイルサイズの拡張の排他の数 (inode番号で分ける)
+#define DEVICE_STRIPE_PREFIX ".cbb_stripe."  // 先頭以外のストライプのファイル名の接頭辞 (サーバー内部ファイルとして一覧から除かれる)
+
+namespace cbb {
+
+// Localストレージのデバイス間ストライプクラス
+//   大きなファイルをストライプサイズごとに複数のデバイスへ順に割り当て、各ストライプは元と同じオフセットに置く。
+//   先頭のストライプは元のパスのファイルが持ち、ファイルサイズも保持する。
+//   他のストライプは各デバイスの同じディレクトリに接頭辞付きの名前で置き、デバイスのルートの一覧を拡張属性に持つ。
+class DeviceStripe {
+ public:
+  DeviceStripe();
+  virtual ~DeviceStripe();
+
+  bool Create(int fd, const char *path, const std::vector<std::string> &roots, size_t stripe_size);
+  bool Attach(int fd, const char *path, int flags);
+  void Detach(int fd);
+  bool is_attached(int fd) const { return fd >= 0 && fd < DEVICE_STRIPE_FILE_MAX && files_[fd] != NULL; }
+
+  bool Read(int fd, void *buf, size_t size, off_t offset, ssize_t *ssize_ptr);
+  bool Write(int fd, const void *buf, size_t size, off_t offset, ssize_t *ssize_ptr);
+  bool Truncate(int fd, off_t size, int *result_ptr);
+  bool Sync(int fd, int is_data, int *result_ptr);
+  bool layout(int fd, size_t *stripe_size_ptr, int *count_ptr) const;
+
+  static bool is_striped(const char *path);
+  static Error Remove(const char *path);
+  static Error Rename(const char *old_path, const char *new_path);
+
+ private:
+  struct StripeFile {
+    ino_t ino;
+    size_t stripe_size;
+    int count;
+    int fds[DEVICE_STRIPE_MAX];  // ストライプごとのfd (先頭は登録したfd)
+  };
+
+  Mutex &lock(const StripeFile *file) { return locks_[file->ino % DEVICE_STRIPE_LOCKS]; }
+  Error Extend(int fd, StripeFile *file, size_t size, off_t *offset_ptr);
+
+  static bool ReadLayout(const char *path, int fd, size_t *stripe_size_ptr, std::vector<std::string> *roots_ptr);
+  static bool piece_paths(const char *path, const std::vector<std::string> &roots, std::vector<std::string> *paths_ptr);
+
+  StripeFile *volatile files_[DEVICE_STRIPE_FILE_MAX];
+  volatile char appends_[DEVICE_STRIPE_FILE_MAX];  // 追記モードで開いたかどうか
+  Mutex locks_[DEVICE_STRIPE_LOCKS];
+};
+
+} /* namespace cbb */
+
+#endif /* UTIL_DEVICE_STRIPE_H_ */
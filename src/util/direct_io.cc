@@ -0,0 +1,326 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "direct_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+
+#include "common/common.h"
+#include "common/error.h"
+
+// direct_fds_ の状態
+#define DIRECT_FD_NONE -1         // まだ開いていない
+#define DIRECT_FD_UNSUPPORTED -2  // ファイルシステムが O_DIRECT に対応していない
+
+namespace cbb {
+
+/**
+ * @breaf constructor
+ */
+DirectIo::DirectIo() : threshold_(0) {
+  for (int index = 0; index < DIRECT_IO_FILE_MAX; index++) {
+    direct_fds_[index] = DIRECT_FD_NONE;
+  }
+  buffer_mutex_.Init();
+}
+
+/**
+ * @breaf destructor
+ */
+DirectIo::~DirectIo() {
+  Destroy();
+}
+
+/**
+ * @breaf 初期化 (境界合わせバッファを確保してメモリに固定する)
+ * @param threshold 直接I/Oにする1回の転送サイズ
+ * @param buffer_count 境界合わせバッファの数
+ * @return bool 初期化できたかどうか
+ */
+bool DirectIo::Init(size_t threshold, int buffer_count) {
+  threshold_ = std::max(threshold, (size_t)DIRECT_IO_ALIGN);
+
+  for (int index = 0; index < buffer_count; index++) {
+    void *buf = NULL;
+    if (posix_memalign(&buf, DIRECT_IO_ALIGN, DIRECT_IO_BUFFER_SIZE) != 0) {
+      Destroy();
+      return false;
+    }
+    // 固定できない (RLIMIT_MEMLOCK) 場合も固定せずに使う
+    mlock(buf, DIRECT_IO_BUFFER_SIZE);
+    buffers_.push_back((char *)buf);
+  }
+  free_buffers_ = buffers_;
+  return true;
+}
+
+/**
+ * @breaf 終了処理 (開き直したfdを閉じ、バッファを解放する)
+ */
+void DirectIo::Destroy() {
+  for (int index = 0; index < DIRECT_IO_FILE_MAX; index++) {
+    Detach(index);
+  }
+
+  buffer_mutex_.Lock();
+  for (size_t index = 0; index < buffers_.size(); index++) {
+    munlock(buffers_[index], DIRECT_IO_BUFFER_SIZE);
+    free(buffers_[index]);
+  }
+  buffers_.clear();
+  free_buffers_.clear();
+  buffer_mutex_.Unlock();
+}
+
+/**
+ * @breaf 直接I/Oを指定して開いたファイルの登録 (転送サイズによらず直接I/Oにする)
+ * @param fd ファイルディスクリプタ
+ */
+void DirectIo::Attach(int fd) {
+  DirectFd(fd);
+}
+
+/**
+ * @breaf ファイルを閉じる前の登録解除 (開き直したfdを閉じる)
+ * @param fd ファイルディスクリプタ
+ */
+void DirectIo::Detach(int fd) {
+  if (fd < 0 || fd >= DIRECT_IO_FILE_MAX) {
+    return;
+  }
+  int direct_fd = __sync_lock_test_and_set(&direct_fds_[fd], DIRECT_FD_NONE);
+  if (direct_fd >= 0) {
+    close(direct_fd);
+  }
+}
+
+/**
+ * @breaf 直接I/Oを使うかどうか (io_uring への投入をやめて Read / Write を使うかの判定)
+ * @param fd ファイルディスクリプタ
+ * @param size 転送サイズ
+ * @param offset オフセット
+ * @return bool 直接I/Oを使うかどうか
+ */
+bool DirectIo::is_direct(int fd, size_t size, off_t offset) {
+  if (fd < 0 || fd >= DIRECT_IO_FILE_MAX || direct_fds_[fd] == DIRECT_FD_UNSUPPORTED) {
+    return false;
+  }
+  // 境界の揃った範囲がなければ通常のI/O
+  off_t start = (offset + DIRECT_IO_ALIGN - 1) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+  off_t end = (offset + (off_t)size) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+  if (end <= start) {
+    return false;
+  }
+  return direct_fds_[fd] >= 0 || size >= threshold_;
+}
+
+/**
+ * @breaf ファイル読み込み
+ * @param fd ファイルディスクリプタ
+ * @param buf バッファ
+ * @param size 読み込みサイズ
+ * @param offset オフセット
+ * @param ssize_ptr 読み込みサイズ保存ポインタ (エラーの場合は Error値)
+ * @return bool 直接I/Oで処理したかどうか (falseの場合は呼び出し元で pread する)
+ */
+bool DirectIo::Read(int fd, void *buf, size_t size, off_t offset, ssize_t *ssize_ptr) {
+  if (!is_direct(fd, size, offset)) {
+    return false;
+  }
+  int direct_fd = DirectFd(fd);
+  if (direct_fd < 0) {
+    return false;
+  }
+  *ssize_ptr = Transfer(false, fd, direct_fd, (char *)buf, size, offset);
+  return true;
+}
+
+/**
+ * @breaf ファイル書き込み
+ * @param fd ファイルディスクリプタ
+ * @param buf バッファ
+ * @param size 書き込みサイズ
+ * @param offset オフセット
+ * @param ssize_ptr 書き込みサイズ保存ポインタ (エラーの場合は Error値)
+ * @return bool 直接I/Oで処理したかどうか (falseの場合は呼び出し元で pwrite する)
+ */
+bool DirectIo::Write(int fd, const void *buf, size_t size, off_t offset, ssize_t *ssize_ptr) {
+  if (!is_direct(fd, size, offset)) {
+    return false;
+  }
+  int direct_fd = DirectFd(fd);
+  if (direct_fd < 0) {
+    return false;
+  }
+  *ssize_ptr = Transfer(true, fd, direct_fd, const_cast<char *>((const char *)buf), size, offset);
+  return true;
+}
+
+/**
+ * @breaf O_DIRECT のfdの取得 (まだない場合は /proc/self/fd から同じアクセスモードで開き直す)
+ * @param fd ファイルディスクリプタ
+ * @return O_DIRECT のfd (使えない場合は負の値)
+ */
+int DirectIo::DirectFd(int fd) {
+  if (fd < 0 || fd >= DIRECT_IO_FILE_MAX) {
+    return DIRECT_FD_UNSUPPORTED;
+  }
+  int direct_fd = direct_fds_[fd];
+  if (direct_fd != DIRECT_FD_NONE) {
+    return direct_fd;
+  }
+
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1) {
+    return DIRECT_FD_NONE;
+  }
+  // 追記モードは書き込み位置が変わるため通常のI/Oにする
+  if (flags & O_APPEND) {
+    __sync_bool_compare_and_swap(&direct_fds_[fd], DIRECT_FD_NONE, DIRECT_FD_UNSUPPORTED);
+    return DIRECT_FD_UNSUPPORTED;
+  }
+  char proc_path[64];
+  snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+  direct_fd = open(proc_path, (flags & O_ACCMODE) | O_DIRECT);
+  if (direct_fd == -1) {
+    DMSG("[DirectIo] : fd:%d  O_DIRECT not available (%d)\n", fd, errno);
+    __sync_bool_compare_and_swap(&direct_fds_[fd], DIRECT_FD_NONE, DIRECT_FD_UNSUPPORTED);
+    return DIRECT_FD_UNSUPPORTED;
+  }
+
+  // 同時に開き直した場合は先に登録した方を使う
+  if (!__sync_bool_compare_and_swap(&direct_fds_[fd], DIRECT_FD_NONE, direct_fd)) {
+    close(direct_fd);
+    return direct_fds_[fd];
+  }
+  return direct_fd;
+}
+
+/**
+ * @breaf 転送 (境界に合わない先頭と末尾は通常のfd、中央は O_DIRECT のfdを使う)
+ * @param is_write 書き込みかどうか
+ * @param fd ファイルディスクリプタ
+ * @param direct_fd O_DIRECT のfd
+ * @param buf バッファ
+ * @param size 転送サイズ
+ * @param offset オフセット
+ * @return 転送サイズ (途中でファイル末尾に達した場合は短い) または Error値
+ */
+ssize_t DirectIo::Transfer(bool is_write, int fd, int direct_fd, char *buf, size_t size, off_t offset) {
+  off_t start = (offset + DIRECT_IO_ALIGN - 1) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+  off_t end = (offset + (off_t)size) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+
+  size_t total = 0;
+  off_t position = offset;
+  while (position < offset + (off_t)size) {
+    bool is_aligned = position >= start && position < end && direct_fd >= 0;
+    off_t limit = position < start ? start: (position < end ? end: offset + (off_t)size);
+    size_t length = std::min((size_t)(limit - position), (size_t)DIRECT_IO_BUFFER_SIZE);
+    char *ptr = buf + (position - offset);
+
+    // 呼び出し元のバッファが境界に揃っていない場合は境界合わせバッファを経由する
+    char *bounce = NULL;
+    if (is_aligned && (uintptr_t)ptr % DIRECT_IO_ALIGN != 0) {
+      bounce = AllocBuffer();
+      is_aligned = bounce != NULL;
+    }
+
+    ssize_t ssize;
+    if (is_aligned) {
+      char *io_ptr = bounce != NULL ? bounce: ptr;
+      if (is_write) {
+        if (bounce != NULL) {
+          memcpy(bounce, ptr, length);
+        }
+        ssize = pwrite(direct_fd, io_ptr, length, position);
+      } else {
+        ssize = pread(direct_fd, io_ptr, length, position);
+        if (ssize > 0 && bounce != NULL) {
+          memcpy(ptr, bounce, ssize);
+        }
+      }
+      if (bounce != NULL) {
+        FreeBuffer(bounce);
+      }
+
+      // ファイルシステムが受け付けない場合は、このファイルは以後通常のI/Oにする
+      if (ssize == -1 && errno == EINVAL) {
+        Disable(fd);
+        direct_fd = -1;
+        continue;
+      }
+    } else if (is_write) {
+      ssize = pwrite(fd, ptr, length, position);
+    } else {
+      ssize = pread(fd, ptr, length, position);
+    }
+
+    if (ssize == -1) {
+      return total > 0 ? (ssize_t)total: errno_to_cbb_error(ssize);
+    }
+    total += ssize;
+    position += ssize;
+    if ((size_t)ssize < length) {
+      break;
+    }
+  }
+  return total;
+}
+
+/**
+ * @breaf 直接I/Oの無効化 (O_DIRECT で開けても転送できないファイルシステムの場合)
+ * @param fd ファイルディスクリプタ
+ */
+void DirectIo::Disable(int fd) {
+  int direct_fd = __sync_lock_test_and_set(&direct_fds_[fd], DIRECT_FD_UNSUPPORTED);
+  if (direct_fd >= 0) {
+    close(direct_fd);
+  }
+}
+
+/**
+ * @breaf 境界合わせバッファの取得
+ * @return バッファ (空きがない場合はNULL)
+ */
+char *DirectIo::AllocBuffer() {
+  char *buf = NULL;
+  buffer_mutex_.Lock();
+  if (!free_buffers_.empty()) {
+    buf = free_buffers_.back();
+    free_buffers_.pop_back();
+  }
+  buffer_mutex_.Unlock();
+  return buf;
+}
+
+/**
+ * @breaf 境界合わせバッファの返却
+ * @param buf AllocBuffer で取得したバッファ
+ */
+void DirectIo::FreeBuffer(char *buf) {
+  buffer_mutex_.Lock();
+  free_buffers_.push_back(buf);
+  buffer_mutex_.Unlock();
+}
+
+} /* namespace cbb */
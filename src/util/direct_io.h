@@ -0,0 +1,74 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef UTIL_DIRECT_IO_H_
+#define UTIL_DIRECT_IO_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <vector>
+
+#include "util/mutex.h"
+
+#define DIRECT_IO_FILE_MAX 4096            // 直接I/Oを使うファイルの上限 (fd番号がこれ未満のもの)
+#define DIRECT_IO_ALIGN 4096               // 直接I/Oのオフセット、サイズ、バッファの境界
+#define DIRECT_IO_BUFFER_SIZE (1 << 20)    // 境界合わせバッファ1個のサイズ (これより大きい転送は分割する)
+
+namespace cbb {
+
+// O_DIRECT による直接ファイルI/Oクラス
+//   大きな読み書きをページキャッシュを通さずに行い、チェックポイントの書き込みで
+//   ページキャッシュが溢れ、ステージングやエクスポートのコピーと競合するのを防ぐ。
+//   通常のfdはそのまま使い、同じファイルを O_DIRECT で開き直したfdを別に持つ。
+//   境界に合わない先頭と末尾は通常のfdで読み書きし、中央の境界の揃った範囲だけを直接I/Oにする。
+//   呼び出し元のバッファが境界に揃っていない場合は、起動時に確保して固定したバッファを経由する。
+class DirectIo {
+
+ public:
+
+  DirectIo();
+  virtual ~DirectIo();
+
+  bool Init(size_t threshold, int buffer_count);
+  void Destroy();
+
+  void Attach(int fd);
+  void Detach(int fd);
+
+  bool is_direct(int fd, size_t size, off_t offset);
+  bool Read(int fd, void *buf, size_t size, off_t offset, ssize_t *ssize_ptr);
+  bool Write(int fd, const void *buf, size_t size, off_t offset, ssize_t *ssize_ptr);
+
+ private:
+
+  int DirectFd(int fd);
+  ssize_t Transfer(bool is_write, int fd, int direct_fd, char *buf, size_t size, off_t offset);
+  void Disable(int fd);
+
+  char *AllocBuffer();
+  void FreeBuffer(char *buf);
+
+  size_t threshold_;                  // 直接I/Oにする1回の転送サイズ (これ以上)
+  volatile int direct_fds_[DIRECT_IO_FILE_MAX];  // fd番号ごとの O_DIRECT のfd (未使用は -1、非対応は -2)
+
+  std::vector<char *> buffers_;       // 境界合わせバッファ
+  std::vector<char *> free_buffers_;
+  Mutex buffer_mutex_;
+};
+
+} /* namespace cbb */
+
+#endif /* UTIL_DIRECT_IO_H_ */
@@ -0,0 +1,254 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "fair_queue.h"
+
+// 分類ごとの公平キュークラス
+namespace cbb {
+
+/**
+ * @breaf constructor
+ */
+FairQueue::FairQueue() : quantum_(1), bandwidth_(0), cursor_(0), size_(0) {
+}
+
+/**
+ * @breaf destructor
+ */
+FairQueue::~FairQueue() {
+}
+
+/**
+ * @breaf 初期化 (分類なしの0番だけにする)
+ * @param quantum 重み1あたりの1回のコスト (バイト)
+ * @param bandwidth 設定のない分類の帯域の上限 (バイト/秒、0の場合は制限なし)
+ * @param now_usec 現在時刻 (usec)
+ */
+void FairQueue::Init(size_t quantum, uint64_t bandwidth, uint64_t now_usec) {
+  quantum_ = quantum > 0 ? quantum: 1;
+  bandwidth_ = bandwidth;
+  cursor_ = 0;
+  size_ = 0;
+  ids_.clear();
+  configs_.clear();
+
+  classes_.assign(1, Class());
+  Setup(classes_[0], "", now_usec);
+}
+
+/**
+ * @breaf 分類ごとの重み、帯域の設定 (登録済みの分類にも反映する)
+ * @param name 分類名
+ * @param weight 重み (1以上)
+ * @param bandwidth 帯域の上限 (バイト/秒、0の場合は制限なし)
+ * @param now_usec 現在時刻 (usec)
+ */
+void FairQueue::Configure(const std::string &name, int weight, uint64_t bandwidth, uint64_t now_usec) {
+  Config config;
+  config.weight = weight > 0 ? weight: 1;
+  config.bandwidth = bandwidth;
+  configs_[name] = config;
+
+  std::map<std::string, int>::iterator it = ids_.find(name);
+  if (it != ids_.end()) {
+    Setup(classes_[it->second], name, now_usec);
+  }
+}
+
+/**
+ * @breaf 分類の登録
+ * @param name 分類名
+ * @param now_usec 現在時刻 (usec)
+ * @return 分類番号 (登録済みの場合は同じ番号、上限を超えた場合は分類なしの0)
+ */
+int FairQueue::Register(const std::string &name, uint64_t now_usec) {
+  std::map<std::string, int>::iterator it = ids_.find(name);
+  if (it != ids_.end()) {
+    return it->second;
+  }
+  if (name.empty() || classes_.size() >= FAIR_QUEUE_CLASS_MAX) {
+    return 0;
+  }
+
+  int class_id = classes_.size();
+  classes_.push_back(Class());
+  Setup(classes_.back(), name, now_usec);
+  ids_[name] = class_id;
+  return class_id;
+}
+
+/**
+ * @breaf 要素の追加
+ * @param class_id 分類番号 (不明な場合は分類なし)
+ * @param item 要素
+ * @param cost コスト (バイト)
+ * @param now_usec 現在時刻 (usec)
+ */
+void FairQueue::Push(int class_id, void *item, size_t cost, uint64_t now_usec) {
+  if (class_id < 0 || class_id >= (int)classes_.size()) {
+    class_id = 0;
+  }
+
+  Entry entry;
+  entry.item = item;
+  entry.cost = cost > 0 ? cost: 1;
+  entry.enqueue_time = now_usec;
+  classes_[class_id].queue.push_back(entry);
+  size_++;
+}
+
+/**
+ * @breaf 次の要素の取り出し
+ * @param now_usec 現在時刻 (usec)
+ * @param wait_usec_ptr 帯域の上限で取り出せなかった場合の待ち時間保存ポインタ
+ * @return 要素 (空の場合、すべての分類が帯域の上限に達している場合はNULL)
+ */
+void *FairQueue::Pop(uint64_t now_usec, uint64_t *wait_usec_ptr) {
+  *wait_usec_ptr = 0;
+  if (size_ == 0) {
+    return NULL;
+  }
+
+  // 取り出せる分類がなければ、最初に取り出せるようになるまでの時間を返す
+  uint64_t wait = 0;
+  bool is_ready_any = false;
+  for (size_t index = 0; index < classes_.size(); index++) {
+    Class &entry = classes_[index];
+    if (entry.queue.empty()) {
+      continue;
+    }
+    uint64_t class_wait = entry.bucket.Wait(now_usec);
+    if (class_wait == 0) {
+      is_ready_any = true;
+      break;
+    }
+    entry.throttled++;
+    wait = wait == 0 ? class_wait: std::min(wait, class_wait);
+  }
+  if (!is_ready_any) {
+    *wait_usec_ptr = wait;
+    return NULL;
+  }
+
+  // 取り出せる分類が1つはあるので、回るごとに与えるコストで必ず取り出せる
+  for (;;) {
+    Class &entry = classes_[cursor_];
+    if (is_ready(entry, now_usec) && entry.queue.front().cost <= entry.deficit) {
+      Entry head = entry.queue.front();
+      entry.queue.pop_front();
+      size_--;
+
+      entry.deficit -= head.cost;
+      if (entry.queue.empty()) {
+        entry.deficit = 0;
+      }
+      entry.bucket.Take(head.cost, now_usec);
+      entry.requests++;
+      entry.bytes += head.cost;
+      entry.wait_usec += now_usec > head.enqueue_time ? now_usec - head.enqueue_time: 0;
+      return head.item;
+    }
+    if (entry.queue.empty()) {
+      entry.deficit = 0;
+    }
+
+    cursor_ = (cursor_ + 1) % classes_.size();
+    Class &next = classes_[cursor_];
+    if (is_ready(next, now_usec)) {
+      next.deficit += (uint64_t)quantum_ * next.weight;
+    }
+  }
+}
+
+/**
+ * @breaf キューを通さない要求の帯域の消費 (共有メモリ経由の読み書き等)
+ *   重みによる順番は付けず、分類の帯域の上限だけを守る。
+ * @param class_id 分類番号 (不明な場合は分類なし)
+ * @param cost コスト (バイト)
+ * @param now_usec 現在時刻 (usec)
+ * @return 待ち時間 (usec、0の場合は消費した)
+ */
+uint64_t FairQueue::Charge(int class_id, size_t cost, uint64_t now_usec) {
+  if (class_id < 0 || class_id >= (int)classes_.size()) {
+    class_id = 0;
+  }
+
+  Class &entry = classes_[class_id];
+  uint64_t wait = entry.bucket.Wait(now_usec);
+  if (wait > 0) {
+    entry.throttled++;
+    return wait;
+  }
+  entry.bucket.Take(cost, now_usec);
+  entry.requests++;
+  entry.bytes += cost;
+  return 0;
+}
+
+/**
+ * @breaf 分類ごとの統計情報の取得
+ * @param stats_ptr 統計情報保存ポインタ
+ */
+void FairQueue::Snapshot(std::vector<QosClassStats> *stats_ptr) {
+  stats_ptr->clear();
+  for (size_t index = 0; index < classes_.size(); index++) {
+    const Class &entry = classes_[index];
+    QosClassStats stats;
+    stats.name = entry.name;
+    stats.weight = entry.weight;
+    stats.bandwidth = entry.bandwidth;
+    stats.queued = entry.queue.size();
+    stats.requests = entry.requests;
+    stats.bytes = entry.bytes;
+    stats.wait_usec = entry.wait_usec;
+    stats.throttled = entry.throttled;
+    stats_ptr->push_back(stats);
+  }
+}
+
+/**
+ * @breaf 分類の重み、帯域の設定 (設定ファイルにない分類は重み1、既定の帯域)
+ * @param entry 分類
+ * @param name 分類名
+ * @param now_usec 現在時刻 (usec)
+ */
+void FairQueue::Setup(Class &entry, const std::string &name, uint64_t now_usec) {
+  std::map<std::string, Config>::iterator it = configs_.find(name);
+  bool is_new = entry.name != name || entry.weight == 0;
+
+  entry.name = name;
+  entry.weight = it != configs_.end() ? it->second.weight: 1;
+  entry.bandwidth = it != configs_.end() ? it->second.bandwidth: bandwidth_;
+  entry.bucket.Init(entry.bandwidth, 0, now_usec);
+  if (is_new) {
+    entry.deficit = 0;
+    entry.requests = 0;
+    entry.bytes = 0;
+    entry.wait_usec = 0;
+    entry.throttled = 0;
+  }
+}
+
+/**
+ * @breaf 取り出せる分類かどうか (要素があり、帯域の上限に達していない)
+ * @param entry 分類
+ * @param now_usec 現在時刻 (usec)
+ * @return bool 取り出せるかどうか
+ */
+bool FairQueue::is_ready(Class &entry, uint64_t now_usec) {
+  return !entry.queue.empty() && entry.bucket.Wait(now_usec) == 0;
+}
+
+} /* namespace cbb */
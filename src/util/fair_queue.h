@@ -0,0 +1,94 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef UTIL_FAIR_QUEUE_H_
+#define UTIL_FAIR_QUEUE_H_
+
+#include <stdint.h>
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common/common.h"
+#include "util/token_bucket.h"
+
+#define FAIR_QUEUE_CLASS_MAX 256  // 分類数の上限 (0番は分類なし)
+
+namespace cbb {
+
+// 分類ごとの公平キュークラス (Deficit Round Robin)
+//
+// 分類ごとのキューを順に回り、回ってきた分類に quantum * 重み のバイト数を与えて、
+// 先頭の要素のコストがそれ以下になるまで取り出す。帯域の上限のある分類はトークンが尽きている間は飛ばす。
+// スレッドセーフではないので、呼び出し側で排他すること。
+class FairQueue {
+ public:
+  FairQueue();
+  virtual ~FairQueue();
+
+  void Init(size_t quantum, uint64_t bandwidth, uint64_t now_usec);
+  void Configure(const std::string &name, int weight, uint64_t bandwidth, uint64_t now_usec);
+  int Register(const std::string &name, uint64_t now_usec);
+
+  void Push(int class_id, void *item, size_t cost, uint64_t now_usec);
+  void *Pop(uint64_t now_usec, uint64_t *wait_usec_ptr);
+  uint64_t Charge(int class_id, size_t cost, uint64_t now_usec);
+
+  size_t size() const { return size_; }
+  void Snapshot(std::vector<QosClassStats> *stats_ptr);
+
+ private:
+  struct Entry {
+    void *item;
+    size_t cost;
+    uint64_t enqueue_time;
+  };
+
+  struct Class {
+    std::string name;
+    int weight;
+    uint64_t bandwidth;
+    TokenBucket bucket;
+    std::deque<Entry> queue;
+    uint64_t deficit;  // この回に取り出せる残りのコスト
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t wait_usec;
+    uint64_t throttled;
+  };
+
+  /// 設定ファイルで指定した分類ごとの重み、帯域
+  struct Config {
+    int weight;
+    uint64_t bandwidth;
+  };
+
+  void Setup(Class &entry, const std::string &name, uint64_t now_usec);
+  bool is_ready(Class &entry, uint64_t now_usec);
+
+  std::vector<Class> classes_;
+  std::map<std::string, int> ids_;
+  std::map<std::string, Config> configs_;
+  size_t quantum_;      // 重み1あたりの1回のコスト
+  uint64_t bandwidth_;  // 設定のない分類の帯域の上限 (0の場合は制限なし)
+  size_t cursor_;       // 取り出し中の分類
+  size_t size_;
+};
+
+} /* namespace cbb */
+
+#endif /* UTIL_FAIR_QUEUE_H_ */
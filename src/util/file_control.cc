@@ -14,11 +14,40 @@
 // limitations under the License.
 //
 #include "file_control.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <list>
+
 #include "common/error.h"
+#include "util/compressor.h"
+#include "util/io_priority.h"
+#include "util/secondary_throttle.h"
+
+#define COPY_BUFFER_SIZE (1 << 20)  // CopyFile で一度に読み書きするサイズ
 
 // ファイル制御クラス
 namespace cbb {
 
+IoRing *FileControl::io_ring_ = NULL;
+int FileControl::io_ring_users_ = 0;
+DirectIo *FileControl::direct_io_ = NULL;
+int FileControl::direct_io_users_ = 0;
+ChunkStore *FileControl::chunk_store_ = NULL;
+int FileControl::chunk_store_users_ = 0;
+DeviceStripe *FileControl::device_stripe_ = NULL;
+int FileControl::device_stripe_users_ = 0;
+
+// 機能の有効化、無効化の排他 (同じプロセスの複数のサーバーが起動、終了する場合)
+static pthread_mutex_t g_feature_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// 無効にした後も登録バッファが返答の送信待ちで使われている io_uring (g_feature_mutex で保護)
+static std::list<IoRing *> g_retired_io_rings;
+
 /**
  * @breaf constructor
  */
@@ -48,30 +77,7 @@ FileControl::~FileControl() {
  * @return ファイルディスクリプタ
  */
 int FileControl::Create(const char *path, int flags, mode_t mode) {
-  assert(fd_ == -1);
-
-  int fd = open(path, flags, mode);
-  int lock_mode = 0;
-
-  // openに成功した場合
-  if (fd != -1) {
-    // 書き込み属性がある場合
-    if (flags & (O_WRONLY | O_RDWR) != 0) {
-      lock_mode = LOCK_EX;
-    } else {
-      lock_mode = LOCK_SH;
-    }
-
-    // ロック設定
-//    if (flock(fd, lock_mode) != 0) {
-//      close(fd);
-//      fd = -1;
-//    }
-  }
-
-  fd_ = fd;
-
-  return fd;
+  return OpenFile(path, flags, mode);
 }
 
 /**
@@ -81,9 +87,26 @@ int FileControl::Create(const char *path, int flags, mode_t mode) {
  * @return ファイルディスクリプタ
  */
 int FileControl::Open(const char *path, int flags) {
+  return OpenFile(path, flags, 0);
+}
+
+/**
+ * @breaf ファイルを開く (O_DIRECT の指定は直接I/Oの対象にする指示として扱う)
+ * @param path ファイルパス
+ * @param flag ファイルフラグ
+ * @param mode ファイルモード (作成する場合)
+ * @return ファイルディスクリプタ
+ */
+int FileControl::OpenFile(const char *path, int flags, mode_t mode) {
   assert(fd_ == -1);
 
-  int fd = open(path, flags);
+  // 境界に合わない読み書きも受け付けるため、O_DIRECT を外して開き、境界の揃った範囲だけを直接I/Oにする
+  bool is_direct = (flags & O_DIRECT) != 0;
+  if (direct_io_ != NULL) {
+    flags &= ~O_DIRECT;
+  }
+
+  int fd = open(path, flags, mode);
   int lock_mode = 0;
 
   // openに成功した場合
@@ -100,6 +123,28 @@ int FileControl::Open(const char *path, int flags) {
 //      close(fd);
 //      fd = -1;
 //    }
+
+    // 圧縮形式のファイルはチャンク単位で読み書きする (展開できない場合は開かない)
+    // デバイス間でストライプしたファイルは他のストライプも開く
+    if ((chunk_store_ != NULL && !chunk_store_->Attach(fd, flags)) ||
+        (device_stripe_ != NULL && !device_stripe_->Attach(fd, path, flags))) {
+      int error = errno;
+      if (chunk_store_ != NULL) {
+        chunk_store_->Detach(fd);
+      }
+      close(fd);
+      errno = error;
+      fd = -1;
+    }
+  }
+
+  if (fd != -1) {
+    if (io_ring_ != NULL) {
+      io_ring_->RegisterFile(fd);
+    }
+    if (direct_io_ != NULL && is_direct && !is_extended(fd)) {
+      direct_io_->Attach(fd);
+    }
   }
 
   fd_ = fd;
@@ -118,7 +163,18 @@ ssize_t FileControl::Read(void *buf, size_t size, off_t offset) {
   assert(fd_ != -1);
   assert(buf != NULL);
 
-  ssize_t ssize = pread(fd_, buf, size, offset);
+  ssize_t ssize;
+  if (chunk_store_ != NULL && chunk_store_->Read(fd_, buf, size, offset, &ssize)) {
+    return ssize;
+  }
+  if (device_stripe_ != NULL && device_stripe_->Read(fd_, buf, size, offset, &ssize)) {
+    return ssize;
+  }
+  if (direct_io_ != NULL && direct_io_->Read(fd_, buf, size, offset, &ssize)) {
+    return ssize;
+  }
+
+  ssize = pread(fd_, buf, size, offset);
   if (ssize == -1) {
     ssize = errno_to_cbb_error(ssize);
   }
@@ -137,7 +193,18 @@ ssize_t FileControl::Write(const void *buf, size_t size, off_t offset) {
   assert(fd_ != -1);
   assert(buf != NULL);
 
-  ssize_t ssize = pwrite(fd_, buf, size, offset);
+  ssize_t ssize;
+  if (chunk_store_ != NULL && chunk_store_->Write(fd_, buf, size, offset, &ssize)) {
+    return ssize;
+  }
+  if (device_stripe_ != NULL && device_stripe_->Write(fd_, buf, size, offset, &ssize)) {
+    return ssize;
+  }
+  if (direct_io_ != NULL && direct_io_->Write(fd_, buf, size, offset, &ssize)) {
+    return ssize;
+  }
+
+  ssize = pwrite(fd_, buf, size, offset);
   if (ssize == -1) {
     ssize = errno_to_cbb_error(ssize);
   }
@@ -154,6 +221,9 @@ int FileControl::FSync(int is_data) {
   assert(fd_ != -1);
 
   int ret;
+  if (device_stripe_ != NULL && device_stripe_->Sync(fd_, is_data, &ret)) {
+    return ret;
+  }
   if (is_data) {
     ret = fdatasync(fd_);
   } else {
@@ -182,6 +252,18 @@ int FileControl::Close() {
   assert(fd_ != -1);
 
 //  flock(fd_, LOCK_UN);
+  if (io_ring_ != NULL) {
+    io_ring_->UnregisterFile(fd_);
+  }
+  if (direct_io_ != NULL) {
+    direct_io_->Detach(fd_);
+  }
+  if (chunk_store_ != NULL) {
+    chunk_store_->Detach(fd_);
+  }
+  if (device_stripe_ != NULL) {
+    device_stripe_->Detach(fd_);
+  }
   int ret = close(fd_);
 
   fd_ = -1;
@@ -189,4 +271,429 @@ int FileControl::Close() {
   return ret;
 }
 
+/**
+ * @breaf ファイルサイズ変更
+ * @param size サイズ
+ * @return 結果 (0 または Error値)
+ */
+int FileControl::Truncate(off_t size) {
+  assert(fd_ != -1);
+
+  int result;
+  if (chunk_store_ != NULL && chunk_store_->Truncate(fd_, size, &result)) {
+    return result;
+  }
+  if (device_stripe_ != NULL && device_stripe_->Truncate(fd_, size, &result)) {
+    return result;
+  }
+  return ftruncate(fd_, size) == 0 ? kCBBSuccess: -errno;
+}
+
+/**
+ * @breaf 開いた空のファイルを圧縮形式にする (他で開いていないファイルに対して呼ぶ)
+ * @return bool 圧縮形式になったかどうか
+ */
+bool FileControl::Format() {
+  assert(fd_ != -1);
+
+  return is_compress_enabled() && !(device_stripe_ != NULL && device_stripe_->is_attached(fd_)) &&
+      chunk_store_->Format(fd_);
+}
+
+/**
+ * @breaf 開いた空のファイルをデバイス間でストライプする (他で開いていないファイルに対して呼ぶ)
+ * @param path ファイルの実パス
+ * @param roots ストライプするデバイスのルートパス (先頭はファイルのあるデバイス)
+ * @param stripe_size ストライプサイズ
+ * @return bool ストライプしたかどうか
+ */
+bool FileControl::Stripe(const char *path, const std::vector<std::string> &roots, size_t stripe_size) {
+  assert(fd_ != -1);
+
+  return device_stripe_ != NULL && !(chunk_store_ != NULL && chunk_store_->is_attached(fd_)) &&
+      device_stripe_->Create(fd_, path, roots, stripe_size);
+}
+
+/**
+ * @breaf デバイス間ストライプの配置の取得
+ * @param stripe_size_ptr ストライプサイズ保存ポインタ
+ * @param count_ptr ストライプするデバイス数保存ポインタ
+ * @return bool ストライプしたファイルかどうか
+ */
+bool FileControl::stripe_layout(size_t *stripe_size_ptr, int *count_ptr) {
+  return device_stripe_ != NULL && device_stripe_->layout(fd_, stripe_size_ptr, count_ptr);
+}
+
+/**
+ * @breaf 非同期ファイル読み込みの投入
+ * @param buf バッファポインタ (AllocIoBuffer で取得したものは登録バッファとして読み込む)
+ * @param size 読み込みサイズ
+ * @param offset オフセット
+ * @param callback 完了通知 (読み込みサイズまたは-errnoを渡す)
+ * @param user_data 完了通知に渡すデータ
+ * @return bool 投入できたかどうか (falseの場合は Read を使う)
+ */
+bool FileControl::SubmitRead(void *buf, size_t size, off_t offset, IoRingCallback callback, void *user_data) {
+  assert(fd_ != -1);
+  assert(buf != NULL);
+
+  // 直接I/Oにする読み込み、圧縮形式、ストライプしたファイルは Read で行う
+  if (direct_io_ != NULL && direct_io_->is_direct(fd_, size, offset)) {
+    return false;
+  }
+  if (is_extended(fd_)) {
+    return false;
+  }
+  return io_ring_ != NULL && io_ring_->SubmitRead(fd_, buf, size, offset, callback, user_data);
+}
+
+/**
+ * @breaf 非同期ファイル書き込みの投入
+ * @param buf バッファポインタ (完了通知まで保持すること)
+ * @param size バッファサイズ
+ * @param offset オフセット
+ * @param callback 完了通知 (書き込みサイズまたは-errnoを渡す)
+ * @param user_data 完了通知に渡すデータ
+ * @return bool 投入できたかどうか (falseの場合は Write を使う)
+ */
+bool FileControl::SubmitWrite(const void *buf, size_t size, off_t offset, IoRingCallback callback, void *user_data) {
+  assert(fd_ != -1);
+  assert(buf != NULL);
+
+  if (direct_io_ != NULL && direct_io_->is_direct(fd_, size, offset)) {
+    return false;
+  }
+  if (is_extended(fd_)) {
+    return false;
+  }
+  return io_ring_ != NULL && io_ring_->SubmitWrite(fd_, buf, size, offset, callback, user_data);
+}
+
+/**
+ * @breaf io_uring の有効化 (ファイルを開く前、サーバー起動時に呼ぶ)
+ *   既に有効な場合はそのリングを共有する。有効にできた場合は終了時に DisableIoRing を呼ぶ。
+ * @param entries 投入リングの大きさ
+ * @return bool 有効にできたかどうか (できない場合は pread/pwrite を使う)
+ */
+bool FileControl::EnableIoRing(unsigned entries) {
+  pthread_mutex_lock(&g_feature_mutex);
+  if (io_ring_ == NULL) {
+    IoRing *io_ring = new IoRing();
+    if (!io_ring->Init(entries)) {
+      delete io_ring;
+      pthread_mutex_unlock(&g_feature_mutex);
+      return false;
+    }
+    io_ring_ = io_ring;
+  }
+  io_ring_users_++;
+  pthread_mutex_unlock(&g_feature_mutex);
+  return true;
+}
+
+/**
+ * @breaf io_uring の無効化 (最後の利用者の場合は処理中の要求の完了を待って停止する)
+ *   返答の送信待ちで使用中の登録バッファがある場合、リングはすべて返却されるまで解放しない。
+ *   有効にしたサーバーが要求の処理を終えてから呼ぶこと。
+ */
+void FileControl::DisableIoRing() {
+  IoRing *io_ring = NULL;
+  pthread_mutex_lock(&g_feature_mutex);
+  if (io_ring_users_ > 0 && --io_ring_users_ == 0 && io_ring_ != NULL) {
+    io_ring = io_ring_;
+    g_retired_io_rings.push_back(io_ring);
+    io_ring_ = NULL;
+  }
+  pthread_mutex_unlock(&g_feature_mutex);
+
+  if (io_ring != NULL) {
+    io_ring->Destroy();
+    ReapIoRings();
+  }
+}
+
+/**
+ * @breaf 無効にした io_uring のうち、登録バッファがすべて返却されたものの解放
+ */
+void FileControl::ReapIoRings() {
+  std::list<IoRing *> reaped;
+  pthread_mutex_lock(&g_feature_mutex);
+  std::list<IoRing *>::iterator it = g_retired_io_rings.begin();
+  while (it != g_retired_io_rings.end()) {
+    if (!(*it)->is_enabled() && !(*it)->is_buffer_in_use()) {
+      reaped.push_back(*it);
+      it = g_retired_io_rings.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  pthread_mutex_unlock(&g_feature_mutex);
+
+  for (it = reaped.begin(); it != reaped.end(); ++it) {
+    delete *it;
+  }
+}
+
+/**
+ * @breaf 登録バッファの取得
+ * @param size 必要なサイズ
+ * @return バッファ (取得できない場合はNULL)
+ */
+void *FileControl::AllocIoBuffer(size_t size) {
+  IoRing *io_ring = io_ring_;
+  return io_ring != NULL ? io_ring->AllocBuffer(size) : NULL;
+}
+
+/**
+ * @breaf 登録バッファの返却 (ゾーンのファイナライザから呼ばれるため、無効にした後の場合がある)
+ * @param buf AllocIoBuffer で取得したバッファ
+ */
+void FileControl::FreeIoBuffer(void *buf) {
+  IoRing *io_ring = io_ring_;
+  if (io_ring != NULL && io_ring->is_buffer(buf)) {
+    io_ring->FreeBuffer(buf);
+    if (io_ring_ == io_ring) {
+      return;
+    }
+  } else {
+    pthread_mutex_lock(&g_feature_mutex);
+    for (std::list<IoRing *>::iterator it = g_retired_io_rings.begin(); it != g_retired_io_rings.end(); ++it) {
+      if ((*it)->is_buffer(buf)) {
+        (*it)->FreeBuffer(buf);
+        break;
+      }
+    }
+    pthread_mutex_unlock(&g_feature_mutex);
+  }
+
+  // 無効にした io_uring の最後のバッファの場合は解放する
+  ReapIoRings();
+}
+
+/**
+ * @breaf 直接I/Oの有効化 (ファイルを開く前、サーバー起動時に呼ぶ)
+ *   既に有効な場合はその設定を共有する。有効にできた場合は終了時に DisableDirectIo を呼ぶ。
+ * @param threshold 直接I/Oにする1回の転送サイズ (O_DIRECT を指定して開いたファイルはこれ未満も対象)
+ * @param buffer_count 境界合わせバッファの数
+ * @return bool 有効にできたかどうか
+ */
+bool FileControl::EnableDirectIo(size_t threshold, int buffer_count) {
+  pthread_mutex_lock(&g_feature_mutex);
+  if (direct_io_ == NULL) {
+    DirectIo *direct_io = new DirectIo();
+    if (!direct_io->Init(threshold, buffer_count)) {
+      delete direct_io;
+      pthread_mutex_unlock(&g_feature_mutex);
+      return false;
+    }
+    direct_io_ = direct_io;
+  }
+  direct_io_users_++;
+  pthread_mutex_unlock(&g_feature_mutex);
+  return true;
+}
+
+/**
+ * @breaf 直接I/Oの無効化 (最後の利用者の場合に開き直したfdを閉じて解放する)
+ */
+void FileControl::DisableDirectIo() {
+  DirectIo *direct_io = NULL;
+  pthread_mutex_lock(&g_feature_mutex);
+  if (direct_io_users_ > 0 && --direct_io_users_ == 0) {
+    direct_io = direct_io_;
+    direct_io_ = NULL;
+  }
+  pthread_mutex_unlock(&g_feature_mutex);
+  delete direct_io;
+}
+
+/**
+ * @breaf 圧縮形式の有効化 (ファイルを開く前、サーバー起動時に呼ぶ)
+ *   既に有効な場合はその設定を共有する。結果によらず終了時に DisableChunkStore を呼ぶ。
+ * @param type 新しく書くファイルの圧縮方式 (kCompressNone の場合は既存の圧縮形式のファイルの読み書きだけ行う)
+ * @param level 圧縮レベル
+ * @param chunk_size チャンクサイズ
+ * @return bool 圧縮方式を使えるかどうか
+ */
+bool FileControl::EnableChunkStore(int type, int level, size_t chunk_size) {
+  bool is_supported;
+  pthread_mutex_lock(&g_feature_mutex);
+  if (chunk_store_ != NULL) {
+    is_supported = chunk_store_->type() == type;
+  } else {
+    ChunkStore *chunk_store = new ChunkStore();
+    is_supported = chunk_store->Init(type, level, chunk_size);
+    chunk_store_ = chunk_store;
+  }
+  chunk_store_users_++;
+  pthread_mutex_unlock(&g_feature_mutex);
+  return is_supported;
+}
+
+/**
+ * @breaf 圧縮形式の無効化 (最後の利用者の場合に解放する)
+ */
+void FileControl::DisableChunkStore() {
+  ChunkStore *chunk_store = NULL;
+  pthread_mutex_lock(&g_feature_mutex);
+  if (chunk_store_users_ > 0 && --chunk_store_users_ == 0) {
+    chunk_store = chunk_store_;
+    chunk_store_ = NULL;
+  }
+  pthread_mutex_unlock(&g_feature_mutex);
+  delete chunk_store;
+}
+
+/**
+ * @breaf パスを指定したファイルサイズ変更 (圧縮形式、ストライプしたファイルは開いて切り詰める)
+ * @param path ファイルパス
+ * @param size サイズ
+ * @return 結果 (0 または Error値)
+ */
+int FileControl::Truncate(const char *path, off_t size) {
+  if (is_plain(path)) {
+    return truncate(path, size) == 0 ? kCBBSuccess: -errno;
+  }
+
+  FileControl file_control;
+  if (file_control.Open(path, O_WRONLY) == -1) {
+    return -errno;
+  }
+  int result = file_control.Truncate(size);
+  file_control.Close();
+  return result;
+}
+
+/**
+ * @breaf パスを指定したファイル削除 (デバイス間でストライプしたファイルは他のストライプも削除する)
+ * @param path ファイルパス
+ * @return 結果 (0 または Error値)
+ */
+int FileControl::Remove(const char *path) {
+  DeviceStripe::Remove(path);
+  return unlink(path) == 0 ? kCBBSuccess: -errno;
+}
+
+/**
+ * @breaf パスを指定したファイルの名前の変更 (デバイス間でストライプしたファイルは他のストライプも変える)
+ * @param old_path 変更前ファイルパス
+ * @param new_path 変更後ファイルパス (同じデバイス内)
+ * @return 結果 (0 または Error値)
+ */
+int FileControl::Rename(const char *old_path, const char *new_path) {
+  // 置き換えられるファイルのストライプを残さない
+  if (strcmp(old_path, new_path) != 0) {
+    DeviceStripe::Remove(new_path);
+  }
+  int result = DeviceStripe::Rename(old_path, new_path);
+  if (result != kCBBSuccess) {
+    return result;
+  }
+  return rename(old_path, new_path) == 0 ? kCBBSuccess: -errno;
+}
+
+/**
+ * @breaf 開いたファイルの内容のコピー (圧縮形式、ストライプしたファイルは展開して読み書きする)
+ * @param source コピー元
+ * @param destination コピー先 (空のファイル)
+ * @return 結果 (0 または Error値)
+ */
+int FileControl::Copy(FileControl &source, FileControl &destination) {
+  // チャンクごとに圧縮し直すため、読み書きの単位はチャンクサイズの倍数にする
+  size_t size = COPY_BUFFER_SIZE;
+  if (chunk_store_ != NULL) {
+    size = std::max(size / chunk_store_->chunk_size(), (size_t)1) * chunk_store_->chunk_size();
+  }
+  char *buf = (char *)malloc(size);
+
+  int result = buf != NULL ? kCBBSuccess: -ENOMEM;
+  off_t offset = 0;
+  while (result == kCBBSuccess) {
+    ssize_t ssize = source.Read(buf, size, offset);
+    if (ssize <= 0) {
+      result = ssize;
+      break;
+    }
+    ssize_t written = destination.Write(buf, ssize, offset);
+    if (written != ssize) {
+      result = written < 0 ? written: -EIO;
+      break;
+    }
+    offset += ssize;
+    IoPriority::Pace(ssize);
+    SecondaryThrottle::Pace(ssize);
+  }
+
+  free(buf);
+  return result;
+}
+
+/**
+ * @breaf ファイルのコピー (圧縮形式、ストライプしたファイルは展開して読み、is_format の場合は圧縮形式で書く)
+ * @param source コピー元ファイルパス
+ * @param destination コピー先ファイルパス (既存の場合は上書き)
+ * @param is_format コピー先を圧縮形式にするかどうか
+ * @return 結果 (0 または Error値)
+ */
+int FileControl::CopyFile(const char *source, const char *destination, bool is_format) {
+  FileControl source_file;
+  if (source_file.Open(source, O_RDONLY) == -1) {
+    return -errno;
+  }
+  struct stat st;
+  if (fstat(source_file.fd(), &st) != 0) {
+    int result = -errno;
+    source_file.Close();
+    return result;
+  }
+
+  FileControl destination_file;
+  if (destination_file.Create(destination, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777) == -1) {
+    int result = -errno;
+    source_file.Close();
+    return result;
+  }
+  if (is_format) {
+    destination_file.Format();
+  }
+
+  int result = Copy(source_file, destination_file);
+  if (result == kCBBSuccess) {
+    fchmod(destination_file.fd(), st.st_mode & 07777);
+  }
+
+  destination_file.Close();
+  source_file.Close();
+  return result;
+}
+
+/**
+ * @breaf デバイス間ストライプの有効化 (複数のデバイスを使う場合、ファイルを開く前に呼ぶ)
+ *   既に有効な場合は共有する。有効にできた場合は終了時に DisableDeviceStripe を呼ぶ。
+ * @return bool 有効にできたかどうか
+ */
+bool FileControl::EnableDeviceStripe() {
+  pthread_mutex_lock(&g_feature_mutex);
+  if (device_stripe_ == NULL) {
+    device_stripe_ = new DeviceStripe();
+  }
+  device_stripe_users_++;
+  pthread_mutex_unlock(&g_feature_mutex);
+  return true;
+}
+
+/**
+ * @breaf デバイス間ストライプの無効化 (最後の利用者の場合に解放する)
+ */
+void FileControl::DisableDeviceStripe() {
+  DeviceStripe *device_stripe = NULL;
+  pthread_mutex_lock(&g_feature_mutex);
+  if (device_stripe_users_ > 0 && --device_stripe_users_ == 0) {
+    device_stripe = device_stripe_;
+    device_stripe_ = NULL;
+  }
+  pthread_mutex_unlock(&g_feature_mutex);
+  delete device_stripe;
+}
+
 } /* namespace cbb */
@@ -21,9 +21,17 @@
 #include <sys/file.h>
 #include <sys/stat.h>
 
+#include "io_ring.h"
+#include "direct_io.h"
+#include "chunk_store.h"
+#include "device_stripe.h"
+#include "compressor.h"
+
 namespace cbb {
 
 // ファイル制御クラス
+//   io_uring、圧縮形式等の機能はプロセス全体で共有する (同じプロセスの複数のサーバーは最初に有効にした
+//   サーバーの設定を使い、有効にしたすべてのサーバーが無効にした時に解放する)。
 class FileControl {
  public:
   FileControl();
@@ -37,11 +45,65 @@ class FileControl {
   int FSync(int isData);
   int Flush();
   int Close();
+  int Truncate(off_t size);
+  bool Format();
+  bool Stripe(const char *path, const std::vector<std::string> &roots, size_t stripe_size);
+  bool stripe_layout(size_t *stripe_size_ptr, int *count_ptr);
+
+  bool SubmitRead(void *buf, size_t size, off_t offset, IoRingCallback callback, void *user_data);
+  bool SubmitWrite(const void *buf, size_t size, off_t offset, IoRingCallback callback, void *user_data);
 
   int fd() { return fd_; }
 
+  static bool EnableIoRing(unsigned entries);
+  static void DisableIoRing();
+  static bool is_io_ring_enabled() { return io_ring_ != NULL; }
+  static void *AllocIoBuffer(size_t size);
+  static void FreeIoBuffer(void *buf);
+
+  static bool EnableDirectIo(size_t threshold, int buffer_count);
+  static void DisableDirectIo();
+  static bool is_direct_io_enabled() { return direct_io_ != NULL; }
+
+  static bool EnableChunkStore(int type, int level, size_t chunk_size);
+  static void DisableChunkStore();
+  static bool is_compress_enabled() { return chunk_store_ != NULL && chunk_store_->type() != kCompressNone; }
+  static bool EnableDeviceStripe();
+  static void DisableDeviceStripe();
+  static bool is_device_stripe_enabled() { return device_stripe_ != NULL; }
+
+  static int Truncate(const char *path, off_t size);
+  static int Remove(const char *path);
+  static int Rename(const char *old_path, const char *new_path);
+  static int Copy(FileControl &source, FileControl &destination);
+  static int CopyFile(const char *source, const char *destination, bool is_format);
+  /// 通常のファイルかどうか (有効にしていない形式の拡張属性は確認しない)
+  static bool is_plain(const char *path) {
+    return (chunk_store_ == NULL || !ChunkStore::is_chunked(path)) &&
+        (device_stripe_ == NULL || !DeviceStripe::is_striped(path));
+  }
+
  protected:
   int fd_;
+
+  static IoRing *io_ring_;  // io_uring (NULLの場合は pread/pwrite のみ)
+  static int io_ring_users_;  // io_uring を有効にしたサーバー数
+  static DirectIo *direct_io_;  // 直接I/O (NULLの場合は常にページキャッシュを通す)
+  static int direct_io_users_;  // 直接I/Oを有効にしたサーバー数
+  static ChunkStore *chunk_store_;  // 圧縮形式 (NULLの場合は圧縮形式のファイルを扱わない)
+  static int chunk_store_users_;  // 圧縮形式を有効にしたサーバー数
+  static DeviceStripe *device_stripe_;  // デバイス間ストライプ (NULLの場合はストライプしたファイルを扱わない)
+  static int device_stripe_users_;  // デバイス間ストライプを有効にしたサーバー数
+
+  int OpenFile(const char *path, int flags, mode_t mode);
+
+  static void ReapIoRings();
+
+  /// 圧縮形式、デバイス間ストライプのファイルかどうか (読み書きは Read/Write で行う)
+  static bool is_extended(int fd) {
+    return (chunk_store_ != NULL && chunk_store_->is_attached(fd)) ||
+        (device_stripe_ != NULL && device_stripe_->is_attached(fd));
+  }
 };
 
 } /* namespace cbb */
@@ -17,6 +17,7 @@
 #define UTIL_HASH_CONSISTENT_HASH_H_
 
 #include <vector>
+#include <algorithm>
 #include <boost/multiprecision/cpp_int.hpp>
 
 // コンシステントハッシュ共通ヘッダー
@@ -31,6 +32,8 @@ class ConsistentHash {
   struct NodeCircleInfo {
     boost::multiprecision::int256_t value;
     T info;
+
+    bool operator<(const NodeCircleInfo &other) const { return value < other.value; }
   };
 
  public:
@@ -54,8 +57,19 @@ class ConsistentHash {
     }
   }
 
+  /**
+   * @breaf 仮想ノード付きのConsistentHash構築
+   *   ノードの追加・削除で担当が変わるKeyは、そのノードの担当範囲だけになる。
+   * @param points Nodeの判定値と情報 (1つのNodeに複数の判定値を持たせる)
+   */
+  void CreateRing(std::vector<NodeCircleInfo> points) {
+    std::stable_sort(points.begin(), points.end());
+    node_circle_.swap(points);
+  }
+
   /**
    * @breaf KeyからNodeを取得する
+   *   最大の判定値より大きいKeyは先頭のNodeに戻る (Createの場合は最終ポイントが最大値のため戻らない)。
    * @param key 検索するKey
    * @return T Nodeに保存されている情報
    */
@@ -64,15 +78,15 @@ class ConsistentHash {
       return empty_;
     }
 
-    // 指定されたKeyが所属するNodeを探す
-    int max_index = node_circle_.size();
-    for (int index = 0; index < max_index; index++) {
-      if (key <= node_circle_[index].value) {
-        return node_circle_[index].info;
-      }
+    // 指定されたKeyが所属するNodeを探す (判定値の昇順に並んでいる)
+    NodeCircleInfo target;
+    target.value = key;
+    typename std::vector<NodeCircleInfo>::iterator it = std::lower_bound(node_circle_.begin(), node_circle_.end(), target);
+    if (it == node_circle_.end()) {
+      return node_circle_.front().info;
     }
 
-    return empty_;
+    return it->info;
   }
 
  private:
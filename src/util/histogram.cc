@@ -0,0 +1,115 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "histogram.h"
+
+#include <string.h>
+
+// HDR形式のヒストグラムクラス
+namespace cbb {
+
+/**
+ * @breaf 値を記録する
+ * @param value 記録値
+ */
+void Histogram::Record(uint64_t value) {
+  __sync_fetch_and_add(&buckets_[BucketIndex(value)], 1);
+  __sync_fetch_and_add(&count_, 1);
+  __sync_fetch_and_add(&sum_, value);
+
+  uint64_t current = max_;
+  while (value > current) {
+    uint64_t prev = __sync_val_compare_and_swap(&max_, current, value);
+    if (prev == current) {
+      break;
+    }
+    current = prev;
+  }
+}
+
+/**
+ * @breaf 記録をクリアする
+ */
+void Histogram::Reset() {
+  memset(buckets_, 0x00, sizeof(buckets_));
+  count_ = 0;
+  sum_ = 0;
+  max_ = 0;
+}
+
+/**
+ * @breaf パーセンタイル値を取得する
+ * @param percent パーセント (0 - 100)
+ * @return 該当バケットの上限値 (最大値を超えない)
+ */
+uint64_t Histogram::Percentile(double percent) const {
+  uint64_t total = count_;
+  if (total == 0) {
+    return 0;
+  }
+
+  uint64_t target = (uint64_t)(total * percent / 100.0 + 0.5);
+  if (target == 0) {
+    target = 1;
+  }
+
+  uint64_t seen = 0;
+  for (int index = 0; index < kBucketCount; index++) {
+    seen += buckets_[index];
+    if (seen >= target) {
+      uint64_t value = BucketUpperBound(index);
+      return value < max_ ? value: max_;
+    }
+  }
+
+  return max_;
+}
+
+/**
+ * @breaf 値からバケット番号を求める
+ * @param value 値
+ * @return バケット番号
+ */
+int Histogram::BucketIndex(uint64_t value) {
+  if (value < (uint64_t)kSubBucketCount) {
+    return (int)value;
+  }
+
+  int msb = 63 - __builtin_clzll(value);
+  int group = msb - kSubBucketBits + 1;
+  int sub = (int)(value >> (msb - kSubBucketBits)) - kSubBucketCount;
+
+  return group * kSubBucketCount + sub;
+}
+
+/**
+ * @breaf バケットに入る値の上限を求める
+ * @param index バケット番号
+ * @return 上限値
+ */
+uint64_t Histogram::BucketUpperBound(int index) {
+  int group = index / kSubBucketCount;
+  uint64_t sub = index % kSubBucketCount;
+
+  if (group == 0) {
+    return sub;
+  }
+
+  int shift = group - 1;
+  uint64_t lower = (kSubBucketCount + sub) << shift;
+  return lower + ((uint64_t)1 << shift) - 1;
+}
+
+} /* namespace cbb */
@@ -0,0 +1,56 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef UTIL_HISTOGRAM_H_
+#define UTIL_HISTOGRAM_H_
+
+#include <stdint.h>
+
+namespace cbb {
+
+// レイテンシ等の分布を記録するHDR形式のヒストグラムクラス
+//
+// 値を2のべき乗ごとのグループに分け、各グループを16分割したバケットに記録する。
+// 相対誤差は約6%以内。記録はロックフリー（アトミック加算）で行う。
+class Histogram {
+ public:
+  static const int kSubBucketBits = 4;
+  static const int kSubBucketCount = 1 << kSubBucketBits;
+  static const int kBucketCount = (64 - kSubBucketBits + 1) * kSubBucketCount;
+
+  Histogram() { Reset(); }
+  virtual ~Histogram() {}
+
+  void Record(uint64_t value);
+  void Reset();
+
+  uint64_t count() const { return count_; }
+  uint64_t sum() const { return sum_; }
+  uint64_t max() const { return max_; }
+  uint64_t Percentile(double percent) const;
+
+  static int BucketIndex(uint64_t value);
+  static uint64_t BucketUpperBound(int index);
+
+ private:
+  uint64_t buckets_[kBucketCount];
+  uint64_t count_;
+  uint64_t sum_;
+  uint64_t max_;
+};
+
+} /* namespace cbb */
+
+#endif /* UTIL_HISTOGRAM_H_ */
@@ -0,0 +1,207 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "io_priority.h"
+
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// ioprio_set / ioprio_get の引数 (linux/ioprio.h はglibcから提供されない)
+#define IOPRIO_WHO_PROCESS   1   // 第2引数が0の場合は呼び出したスレッド
+#define IOPRIO_CLASS_SHIFT   13
+#define IOPRIO_CLASS_BE      2
+#define IOPRIO_CLASS_IDLE    3
+#define IOPRIO_VALUE(klass, data) (((klass) << IOPRIO_CLASS_SHIFT) | (data))
+
+// I/O優先度クラス
+namespace cbb {
+
+// バックグラウンドのコピー中のスレッドのサーバー (NULLの場合はバックグラウンドでない)
+static __thread IoPriority *tls_background = NULL;
+
+/**
+ * @breaf スレッドのI/O優先度の取得
+ * @return I/O優先度 (取得できない場合は負の値)
+ */
+static int get_ioprio() {
+#ifdef SYS_ioprio_get
+  return syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+#else
+  return -1;
+#endif
+}
+
+/**
+ * @breaf スレッドのI/O優先度の設定
+ * @param value I/O優先度
+ * @return bool 成否
+ */
+static bool set_ioprio(int value) {
+#ifdef SYS_ioprio_set
+  return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, value) == 0;
+#else
+  return false;
+#endif
+}
+
+/**
+ * @breaf constructor (止めない設定で初期化する)
+ */
+IoPriority::IoPriority() : busy_depth_(0), idle_msec_(0), max_pause_msec_(0), use_ioprio_(false),
+    foreground_(0), last_busy_msec_(0), background_(0), copied_bytes_(0), deferred_(0), deferred_msec_(0), forced_(0) {
+}
+
+/**
+ * @breaf 優先度の設定 (サーバーの開始時に呼ぶ)
+ * @param busy_depth バックグラウンドのコピーを止めるフォアグラウンドの処理数 (0の場合は止めない)
+ * @param idle_msec 処理数が下回ってからコピーを再開するまでの時間 (msec)
+ * @param max_pause_msec 1回にコピーを止める時間の上限 (msec)
+ * @param use_ioprio バックグラウンドのスレッドのI/O優先度を idle クラスに下げるかどうか
+ */
+void IoPriority::SetPolicy(int busy_depth, int idle_msec, int max_pause_msec, bool use_ioprio) {
+  busy_depth_ = busy_depth > 0 ? busy_depth: 0;
+  idle_msec_ = idle_msec > 0 ? idle_msec: 0;
+  max_pause_msec_ = max_pause_msec > 0 ? max_pause_msec: 0;
+  use_ioprio_ = use_ioprio;
+}
+
+/**
+ * @breaf フォアグラウンドの処理の開始
+ */
+void IoPriority::EnterForeground() {
+  int depth = __sync_add_and_fetch(&foreground_, 1);
+  if (busy_depth_ > 0 && depth >= busy_depth_) {
+    last_busy_msec_ = get_time_msec();
+  }
+}
+
+/**
+ * @breaf フォアグラウンドの処理の終了
+ */
+void IoPriority::LeaveForeground() {
+  int depth = __sync_fetch_and_sub(&foreground_, 1);
+  if (busy_depth_ > 0 && depth >= busy_depth_) {
+    last_busy_msec_ = get_time_msec();
+  }
+}
+
+/**
+ * @breaf バックグラウンドのコピーの区切り (スレッドのサーバーのフォアグラウンドが忙しい間は止める)
+ * @param bytes 前回の区切りからコピーしたバイト数
+ */
+void IoPriority::Pace(uint64_t bytes) {
+  IoPriority *priority = tls_background;
+  if (priority == NULL) {
+    return;
+  }
+  __sync_fetch_and_add(&priority->copied_bytes_, bytes);
+  if (priority->busy_depth_ == 0) {
+    return;
+  }
+
+  uint64_t start = get_time_msec();
+  uint64_t now = start;
+  while (priority->is_busy(now)) {
+    if (priority->max_pause_msec_ > 0 && now - start >= (uint64_t)priority->max_pause_msec_) {
+      // 止め続けると書き出しが進まないため、上限を超えたら区切り1つ分は進める
+      __sync_fetch_and_add(&priority->forced_, 1);
+      break;
+    }
+    usleep(IO_PRIORITY_PAUSE_STEP * 1000);
+    now = get_time_msec();
+  }
+
+  if (now > start) {
+    __sync_fetch_and_add(&priority->deferred_, 1);
+    __sync_fetch_and_add(&priority->deferred_msec_, now - start);
+  }
+}
+
+/**
+ * @breaf 呼び出したスレッドがバックグラウンドのコピー中かどうか
+ * @return bool バックグラウンドかどうか
+ */
+bool IoPriority::is_background() {
+  return tls_background != NULL;
+}
+
+/**
+ * @breaf 呼び出したスレッドのコピーを区切りごとに止めることがあるかどうか
+ * @return bool 止めることがあるかどうか
+ */
+bool IoPriority::is_paced() {
+  IoPriority *priority = tls_background;
+  return priority != NULL && priority->busy_depth_ > 0;
+}
+
+/**
+ * @breaf 統計情報の取得
+ * @param stats_ptr 統計情報保存ポインタ
+ */
+void IoPriority::Snapshot(BackgroundStats *stats_ptr) {
+  stats_ptr->foreground = foreground_ > 0 ? foreground_: 0;
+  stats_ptr->active = background_ > 0 ? background_: 0;
+  stats_ptr->bytes = copied_bytes_;
+  stats_ptr->deferred = deferred_;
+  stats_ptr->deferred_msec = deferred_msec_;
+  stats_ptr->forced = forced_;
+}
+
+/**
+ * @breaf フォアグラウンドが忙しいかどうか
+ * @param now_msec 現在時刻 (msec)
+ * @return bool 忙しいかどうか (処理数が多い、または下回ってから idle_msec_ たっていない)
+ */
+bool IoPriority::is_busy(uint64_t now_msec) {
+  if (foreground_ >= busy_depth_) {
+    return true;
+  }
+  uint64_t last_busy = last_busy_msec_;
+  return last_busy != 0 && now_msec < last_busy + idle_msec_;
+}
+
+/**
+ * @breaf constructor (バックグラウンドのコピーの開始、入れ子の場合は外側のサーバーのまま)
+ * @param priority コピーするサーバーのI/O優先度
+ */
+IoPriority::BackgroundScope::BackgroundScope(IoPriority &priority) : prev_priority_(tls_background), prev_ioprio_(-1) {
+  if (prev_priority_ == NULL) {
+    __sync_fetch_and_add(&priority.background_, 1);
+    if (priority.use_ioprio_) {
+      int prev_ioprio = get_ioprio();
+      // idle クラスにできない場合はベストエフォートの最低の優先度にする
+      if (prev_ioprio >= 0 &&
+          (set_ioprio(IOPRIO_VALUE(IOPRIO_CLASS_IDLE, 0)) || set_ioprio(IOPRIO_VALUE(IOPRIO_CLASS_BE, 7)))) {
+        prev_ioprio_ = prev_ioprio;
+      }
+    }
+    tls_background = &priority;
+  }
+}
+
+/**
+ * @breaf destructor (バックグラウンドのコピーの終了)
+ */
+IoPriority::BackgroundScope::~BackgroundScope() {
+  if (prev_priority_ == NULL) {
+    if (prev_ioprio_ >= 0) {
+      set_ioprio(prev_ioprio_);
+    }
+    __sync_fetch_and_sub(&tls_background->background_, 1);
+    tls_background = NULL;
+  }
+}
+
+} /* namespace cbb */
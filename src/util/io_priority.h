@@ -0,0 +1,97 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef UTIL_IO_PRIORITY_H_
+#define UTIL_IO_PRIORITY_H_
+
+#include <stdint.h>
+
+#include "common/common.h"
+
+#define IO_PRIORITY_PAUSE_STEP 10  // バックグラウンドのコピーを止めている間の確認間隔 (msec)
+
+namespace cbb {
+
+// アプリケーションの読み書き (フォアグラウンド) を優先するI/O優先度クラス
+//
+// フォアグラウンドの処理中の数を数え、一定数を超えている間はバックグラウンドのコピー
+// (先読み、書き出し、レプリカの作成) をコピーの区切りごとに止める。
+// 数が下回ってから一定時間たつとコピーを再開し、止める時間の上限を超えた場合も再開する。
+// バックグラウンドのスレッドは、使える場合は ioprio の idle クラスで読み書きする。
+// 設定と処理数はサーバーごとに持ち、コピーの区切り (Pace) はスレッドが入っている BackgroundScope のサーバーで判定する。
+class IoPriority {
+ public:
+  IoPriority();
+
+  void SetPolicy(int busy_depth, int idle_msec, int max_pause_msec, bool use_ioprio);
+
+  void EnterForeground();
+  void LeaveForeground();
+  void Snapshot(BackgroundStats *stats_ptr);
+
+  static void Pace(uint64_t bytes);
+  static bool is_background();
+  static bool is_paced();
+
+  // フォアグラウンドの処理中の区間
+  class ForegroundScope {
+   public:
+    ForegroundScope(IoPriority &priority, bool is_foreground = true) : priority_(priority), is_foreground_(is_foreground) {
+      if (is_foreground_) {
+        priority_.EnterForeground();
+      }
+    }
+    ~ForegroundScope() {
+      if (is_foreground_) {
+        priority_.LeaveForeground();
+      }
+    }
+
+   private:
+    IoPriority &priority_;
+    bool is_foreground_;
+  };
+
+  // バックグラウンドのコピーの区間 (スレッドのI/O優先度を下げ、抜ける時に戻す)
+  class BackgroundScope {
+   public:
+    explicit BackgroundScope(IoPriority &priority);
+    ~BackgroundScope();
+
+   private:
+    IoPriority *prev_priority_;  // 外側の区間のサーバー (NULLの場合はバックグラウンドでなかった)
+    int prev_ioprio_;  // 元のI/O優先度 (負の場合は変更していない)
+  };
+
+ private:
+  bool is_busy(uint64_t now_msec);
+
+  int busy_depth_;          // コピーを止めるフォアグラウンドの処理数 (0の場合は止めない)
+  int idle_msec_;           // 処理数が下回ってからコピーを再開するまでの時間
+  int max_pause_msec_;      // 1回にコピーを止める時間の上限
+  bool use_ioprio_;         // バックグラウンドのスレッドのI/O優先度を下げるかどうか
+
+  volatile int foreground_;            // フォアグラウンドの処理数
+  volatile uint64_t last_busy_msec_;   // 最後に処理数が busy_depth_ 以上だった時刻
+  volatile int background_;            // バックグラウンドのコピー数
+  volatile uint64_t copied_bytes_;
+  volatile uint64_t deferred_;
+  volatile uint64_t deferred_msec_;
+  volatile uint64_t forced_;
+};
+
+} /* namespace cbb */
+
+#endif /* UTIL_IO_PRIORITY_H_ */
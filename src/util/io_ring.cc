@@ -0,0 +1,554 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "io_ring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+
+#include "../common/common.h"
+
+#ifdef CBB_HAVE_IO_URING
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_RW_CUR_POS  // IORING_OP_READ/WRITE (Linux 5.6) に対応したヘッダーの場合のみ使う
+#define USE_IO_URING
+#endif
+#endif
+
+#ifdef USE_IO_URING
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+#endif
+
+#define IO_RING_WAKEUP (~0ULL)  // 終了時に完了スレッドを起こす要求のタグ
+
+// io_uring による非同期ファイルI/Oクラス
+namespace cbb {
+
+/**
+ * @breaf constructor
+ */
+IoRing::IoRing() : ring_fd_(-1), sq_entries_(0), cq_entries_(0),
+                   sq_ptr_(NULL), sq_size_(0), cq_ptr_(NULL), cq_size_(0), sqes_ptr_(NULL), sqes_size_(0),
+                   sq_head_(NULL), sq_tail_(NULL), sq_mask_(NULL), sq_array_(NULL),
+                   cq_head_(NULL), cq_tail_(NULL), cq_mask_(NULL), cqes_(NULL),
+                   pending_(0), is_submitting_(false), is_stopping_(false),
+                   buffers_(NULL), buffer_count_(0) {
+  submit_mutex_.Init();
+  buffer_mutex_.Init();
+}
+
+/**
+ * @breaf destructor
+ */
+IoRing::~IoRing() {
+  Destroy();
+
+  // Destroy の時点で返却されていなかった登録バッファ
+  if (buffers_ != NULL) {
+    munmap(buffers_, (size_t)buffer_count_ * IO_RING_BUFFER_SIZE);
+    buffers_ = NULL;
+  }
+}
+
+/**
+ * @breaf 初期化 (リングの作成、ファイル表とバッファの登録、完了スレッドの開始)
+ *   ファイル表、バッファの登録に失敗した場合 (古いカーネル、ロック可能メモリの上限等) は登録なしで動作する。
+ * @param entries 投入リングの大きさ (同時に処理する要求数の目安)
+ * @return bool io_uring が使えるかどうか
+ */
+bool IoRing::Init(unsigned entries) {
+#ifdef USE_IO_URING
+  if (is_enabled()) {
+    return true;
+  }
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0) {
+    return false;
+  }
+  ring_fd_ = fd;
+  if ((params.features & IORING_FEAT_RW_CUR_POS) == 0) {
+    Unmap();
+    return false;
+  }
+
+  sq_entries_ = params.sq_entries;
+  cq_entries_ = params.cq_entries;
+  sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool is_single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (is_single_mmap) {
+    sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+  }
+
+  void *ptr = mmap(NULL, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (ptr == MAP_FAILED) {
+    Unmap();
+    return false;
+  }
+  sq_ptr_ = ptr;
+
+  if (is_single_mmap) {
+    cq_ptr_ = sq_ptr_;
+  } else {
+    ptr = mmap(NULL, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (ptr == MAP_FAILED) {
+      Unmap();
+      return false;
+    }
+    cq_ptr_ = ptr;
+  }
+
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  ptr = mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (ptr == MAP_FAILED) {
+    Unmap();
+    return false;
+  }
+  sqes_ptr_ = ptr;
+
+  char *sq = (char *)sq_ptr_;
+  char *cq = (char *)cq_ptr_;
+  sq_head_ = (unsigned *)(sq + params.sq_off.head);
+  sq_tail_ = (unsigned *)(sq + params.sq_off.tail);
+  sq_mask_ = (unsigned *)(sq + params.sq_off.ring_mask);
+  sq_array_ = (unsigned *)(sq + params.sq_off.array);
+  cq_head_ = (unsigned *)(cq + params.cq_off.head);
+  cq_tail_ = (unsigned *)(cq + params.cq_off.tail);
+  cq_mask_ = (unsigned *)(cq + params.cq_off.ring_mask);
+  cqes_ = cq + params.cq_off.cqes;
+
+  // 処理中の要求は完了リングに収まる数まで (完了を取りこぼさないため)
+  slots_.resize(cq_entries_);
+  free_slots_.clear();
+  for (unsigned index = cq_entries_; index > 0; index--) {
+    free_slots_.push_back(index - 1);
+  }
+  completed_.reserve(cq_entries_);
+
+  // ファイル表 (空き (-1) で登録し、開いたファイルを fd と同じ番号に入れる)
+  std::vector<int> fds(IO_RING_FILE_MAX, -1);
+  if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_FILES, &fds[0], IO_RING_FILE_MAX) == 0) {
+    files_.assign(IO_RING_FILE_MAX, 0);
+  }
+
+  // 読み込みバッファ
+  int count = std::min<int>(entries, IO_RING_BUFFER_MAX);
+  ptr = mmap(NULL, (size_t)count * IO_RING_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr != MAP_FAILED) {
+    std::vector<struct iovec> iovecs(count);
+    for (int index = 0; index < count; index++) {
+      iovecs[index].iov_base = (char *)ptr + (size_t)index * IO_RING_BUFFER_SIZE;
+      iovecs[index].iov_len = IO_RING_BUFFER_SIZE;
+    }
+    if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS, &iovecs[0], count) == 0) {
+      buffers_ = (char *)ptr;
+      buffer_count_ = count;
+      free_buffers_.clear();
+      for (int index = count; index > 0; index--) {
+        free_buffers_.push_back(index - 1);
+      }
+    } else {
+      munmap(ptr, (size_t)count * IO_RING_BUFFER_SIZE);
+    }
+  }
+
+  DMSG("IoRing::Init : entries %u/%u  files %d  buffers %d\n",
+       sq_entries_, cq_entries_, files_.empty() ? 0 : IO_RING_FILE_MAX, buffer_count_);
+
+  is_stopping_ = false;
+  Create(NULL, 0);
+  return true;
+#else
+  return false;
+#endif
+}
+
+/**
+ * @breaf 終了 (処理中の要求の完了を待ってから完了スレッドを止める)
+ */
+void IoRing::Destroy() {
+  if (!is_enabled()) {
+    return;
+  }
+
+  submit_mutex_.Lock();
+  is_stopping_ = true;
+  submit_mutex_.Unlock();
+
+  for (int wait = 0; wait < IO_RING_DRAIN_WAIT; wait++) {
+    submit_mutex_.Lock();
+    bool is_idle = free_slots_.size() == slots_.size();
+    submit_mutex_.Unlock();
+    if (is_idle) {
+      break;
+    }
+    usleep(1000);
+  }
+
+#ifdef USE_IO_URING
+  // 完了待ちの完了スレッドを起こす (受け取ったスレッドはループを抜ける)
+  submit_mutex_.Lock();
+  bool is_pushed = Push(IORING_OP_NOP, -1, NULL, 0, 0, IO_RING_WAKEUP);
+  submit_mutex_.Unlock();
+  if (is_pushed) {
+    Flush();
+    Release();
+  }
+#endif
+
+  Unmap();
+}
+
+/**
+ * @breaf ファイルの登録 (開いた直後に呼ぶ)
+ * @param fd ファイルディスクリプタ
+ */
+void IoRing::RegisterFile(int fd) {
+#ifdef USE_IO_URING
+  if (!is_enabled() || files_.empty() || fd < 0 || fd >= IO_RING_FILE_MAX) {
+    return;
+  }
+
+  struct io_uring_files_update update;
+  memset(&update, 0, sizeof(update));
+  update.offset = fd;
+  update.fds = (uintptr_t)&fd;
+
+  submit_mutex_.Lock();
+  if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1) {
+    files_[fd] = 1;
+  }
+  submit_mutex_.Unlock();
+#endif
+}
+
+/**
+ * @breaf ファイルの登録解除 (閉じる前に呼ぶ、登録したままだとファイルが閉じられない)
+ * @param fd ファイルディスクリプタ
+ */
+void IoRing::UnregisterFile(int fd) {
+#ifdef USE_IO_URING
+  if (!is_enabled() || files_.empty() || fd < 0 || fd >= IO_RING_FILE_MAX) {
+    return;
+  }
+
+  int none = -1;
+  struct io_uring_files_update update;
+  memset(&update, 0, sizeof(update));
+  update.offset = fd;
+  update.fds = (uintptr_t)&none;
+
+  submit_mutex_.Lock();
+  if (files_[fd] && syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1) {
+    files_[fd] = 0;
+  }
+  submit_mutex_.Unlock();
+#endif
+}
+
+/**
+ * @breaf 登録バッファの取得
+ * @param size 必要なサイズ
+ * @return バッファ (登録バッファがない、足りない、サイズが大きい場合はNULL)
+ */
+void *IoRing::AllocBuffer(size_t size) {
+  if (!is_enabled() || buffers_ == NULL || size > IO_RING_BUFFER_SIZE) {
+    return NULL;
+  }
+
+  void *buf = NULL;
+  buffer_mutex_.Lock();
+  if (!free_buffers_.empty()) {
+    buf = buffers_ + (size_t)free_buffers_.back() * IO_RING_BUFFER_SIZE;
+    free_buffers_.pop_back();
+  }
+  buffer_mutex_.Unlock();
+
+  return buf;
+}
+
+/**
+ * @breaf 登録バッファの返却
+ * @param buf AllocBuffer で取得したバッファ
+ */
+void IoRing::FreeBuffer(void *buf) {
+  buffer_mutex_.Lock();
+  free_buffers_.push_back(((char *)buf - buffers_) / IO_RING_BUFFER_SIZE);
+  buffer_mutex_.Unlock();
+}
+
+/**
+ * @breaf 返却されていない登録バッファがあるかどうか
+ * @return bool 使用中のバッファがあるかどうか
+ */
+bool IoRing::is_buffer_in_use() {
+  buffer_mutex_.Lock();
+  bool is_in_use = buffers_ != NULL && free_buffers_.size() < (size_t)buffer_count_;
+  buffer_mutex_.Unlock();
+  return is_in_use;
+}
+
+/**
+ * @breaf 読み込み要求の投入
+ * @param fd ファイルディスクリプタ
+ * @param buf バッファ (登録バッファの場合は登録バッファとして読み込む)
+ * @param size サイズ
+ * @param offset オフセット
+ * @param callback 完了通知
+ * @param user_data 完了通知に渡すデータ
+ * @return bool 投入できたかどうか (できない場合は呼び出し元で pread する)
+ */
+bool IoRing::SubmitRead(int fd, void *buf, size_t size, off_t offset, IoRingCallback callback, void *user_data) {
+#ifdef USE_IO_URING
+  return Submit(IORING_OP_READ, fd, buf, size, offset, callback, user_data);
+#else
+  return false;
+#endif
+}
+
+/**
+ * @breaf 書き込み要求の投入
+ * @param fd ファイルディスクリプタ
+ * @param buf バッファ (完了通知まで保持すること)
+ * @param size サイズ
+ * @param offset オフセット
+ * @param callback 完了通知
+ * @param user_data 完了通知に渡すデータ
+ * @return bool 投入できたかどうか (できない場合は呼び出し元で pwrite する)
+ */
+bool IoRing::SubmitWrite(int fd, const void *buf, size_t size, off_t offset, IoRingCallback callback, void *user_data) {
+#ifdef USE_IO_URING
+  return Submit(IORING_OP_WRITE, fd, const_cast<void *>(buf), size, offset, callback, user_data);
+#else
+  return false;
+#endif
+}
+
+/**
+ * @breaf 完了スレッド処理 (完了を待って受け取り、コールバックを呼ぶ)
+ * @param user_data 未使用
+ * @return bool 続けるかどうか
+ */
+bool IoRing::ThreadCall(void *user_data) {
+#ifdef USE_IO_URING
+  int ret = syscall(__NR_io_uring_enter, ring_fd_, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+  if (ret < 0 && errno != EINTR) {
+    usleep(1000);
+  }
+
+  bool is_wakeup = false;
+  unsigned head = *cq_head_;
+  unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    struct io_uring_cqe *cqe = (struct io_uring_cqe *)cqes_ + (head & *cq_mask_);
+    if (cqe->user_data == IO_RING_WAKEUP) {
+      is_wakeup = true;
+    } else {
+      Completion completion;
+      completion.index = (unsigned)cqe->user_data;
+      completion.slot = slots_[completion.index];
+      completion.result = cqe->res;
+      completed_.push_back(completion);
+    }
+    head++;
+  }
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+  submit_mutex_.Lock();
+  for (size_t index = 0; index < completed_.size(); index++) {
+    free_slots_.push_back(completed_[index].index);
+  }
+  submit_mutex_.Unlock();
+
+  for (size_t index = 0; index < completed_.size(); index++) {
+    const Completion &completion = completed_[index];
+    completion.slot.callback(completion.slot.user_data, completion.result);
+  }
+  completed_.clear();
+
+  // 完了リングが満杯で投入できなかった要求を渡す
+  Flush();
+
+  return !is_wakeup;
+#else
+  return false;
+#endif
+}
+
+/**
+ * @breaf 要求の投入 (リングに置き、まとめて io_uring_enter に渡す)
+ * @param opcode 操作
+ * @param fd ファイルディスクリプタ
+ * @param buf バッファ
+ * @param size サイズ
+ * @param offset オフセット
+ * @param callback 完了通知
+ * @param user_data 完了通知に渡すデータ
+ * @return bool 投入できたかどうか
+ */
+bool IoRing::Submit(int opcode, int fd, void *buf, size_t size, off_t offset, IoRingCallback callback, void *user_data) {
+  if (!is_enabled()) {
+    return false;
+  }
+
+  submit_mutex_.Lock();
+  if (is_stopping_ || free_slots_.empty()) {
+    submit_mutex_.Unlock();
+    return false;
+  }
+
+  unsigned index = free_slots_.back();
+  if (!Push(opcode, fd, buf, size, offset, index)) {
+    submit_mutex_.Unlock();
+    return false;
+  }
+  free_slots_.pop_back();
+  slots_[index].callback = callback;
+  slots_[index].user_data = user_data;
+  submit_mutex_.Unlock();
+
+  Flush();
+  return true;
+}
+
+/**
+ * @breaf 投入リングへの要求の追加 (submit_mutex_ をロックして呼ぶ)
+ *   登録したファイル、登録バッファ内の読み込みは登録済みのものとして処理させる。
+ * @param opcode 操作
+ * @param fd ファイルディスクリプタ
+ * @param buf バッファ
+ * @param size サイズ
+ * @param offset オフセット
+ * @param tag 完了時に返されるタグ
+ * @return bool 追加できたかどうか (リングが満杯の場合は失敗)
+ */
+bool IoRing::Push(int opcode, int fd, void *buf, size_t size, off_t offset, uint64_t tag) {
+#ifdef USE_IO_URING
+  unsigned tail = *sq_tail_;
+  unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  if (tail - head >= sq_entries_) {
+    return false;
+  }
+
+  unsigned position = tail & *sq_mask_;
+  struct io_uring_sqe *sqe = (struct io_uring_sqe *)sqes_ptr_ + position;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->off = offset;
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = size;
+  sqe->user_data = tag;
+
+  if (!files_.empty() && fd >= 0 && fd < IO_RING_FILE_MAX && files_[fd]) {
+    sqe->flags |= IOSQE_FIXED_FILE;
+  }
+  if (opcode == IORING_OP_READ && buffers_ != NULL &&
+      (char *)buf >= buffers_ && (char *)buf < buffers_ + (size_t)buffer_count_ * IO_RING_BUFFER_SIZE) {
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->buf_index = ((char *)buf - buffers_) / IO_RING_BUFFER_SIZE;
+  }
+
+  sq_array_[position] = position;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  pending_++;
+  return true;
+#else
+  return false;
+#endif
+}
+
+/**
+ * @breaf リングに置いた要求を io_uring_enter に渡す
+ *   他のスレッドが渡している最中の場合は、そのスレッドが続けてまとめて渡す。
+ */
+void IoRing::Flush() {
+#ifdef USE_IO_URING
+  submit_mutex_.Lock();
+  if (is_submitting_) {
+    submit_mutex_.Unlock();
+    return;
+  }
+
+  is_submitting_ = true;
+  while (pending_ > 0) {
+    unsigned count = pending_;
+    submit_mutex_.Unlock();
+    int ret = syscall(__NR_io_uring_enter, ring_fd_, count, 0, 0, NULL, 0);
+    int error = errno;
+    submit_mutex_.Lock();
+
+    if (ret > 0) {
+      pending_ -= ret;
+    } else if (ret == 0 || error != EINTR) {
+      // 完了リングが満杯 (EBUSY) 等の場合は、完了を受け取った後に完了スレッドが渡し直す
+      break;
+    }
+  }
+  is_submitting_ = false;
+  submit_mutex_.Unlock();
+#endif
+}
+
+/**
+ * @breaf リングの解放
+ */
+void IoRing::Unmap() {
+  if (sqes_ptr_ != NULL) {
+    munmap(sqes_ptr_, sqes_size_);
+  }
+  if (cq_ptr_ != NULL && cq_ptr_ != sq_ptr_) {
+    munmap(cq_ptr_, cq_size_);
+  }
+  if (sq_ptr_ != NULL) {
+    munmap(sq_ptr_, sq_size_);
+  }
+  // 返答の送信待ちで使用中の登録バッファは、すべて返却されてから解放する (デストラクタ)
+  if (buffers_ != NULL && !is_buffer_in_use()) {
+    munmap(buffers_, (size_t)buffer_count_ * IO_RING_BUFFER_SIZE);
+    buffers_ = NULL;
+    buffer_count_ = 0;
+    free_buffers_.clear();
+  }
+  if (ring_fd_ >= 0) {
+    close(ring_fd_);
+  }
+
+  ring_fd_ = -1;
+  sq_ptr_ = cq_ptr_ = sqes_ptr_ = NULL;
+  pending_ = 0;
+  slots_.clear();
+  free_slots_.clear();
+  files_.clear();
+}
+
+} // namespace cbb
@@ -0,0 +1,129 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef UTIL_IO_RING_H_
+#define UTIL_IO_RING_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <vector>
+
+#include "util/mutex.h"
+#include "util/thread.h"
+
+#define IO_RING_FILE_MAX 4096            // 登録するファイルの上限 (fd番号がこれ未満のものを同じ番号で登録する)
+#define IO_RING_BUFFER_SIZE (256 << 10)  // 登録バッファ1個のサイズ (これより大きい読み込みは通常のバッファを使う)
+#define IO_RING_BUFFER_MAX 64            // 登録バッファの最大数
+#define IO_RING_DRAIN_WAIT 5000          // 終了時に処理中の要求の完了を待つ時間 (msec)
+
+namespace cbb {
+
+/// 非同期I/Oの完了通知 (完了スレッドから呼ばれる、result は転送サイズ または -errno)
+typedef void (*IoRingCallback)(void *user_data, ssize_t result);
+
+// io_uring による非同期ファイルI/Oクラス
+//   複数のスレッドが投入した要求は、投入中のスレッドがまとめて io_uring_enter に渡す。
+//   完了は専用スレッドで受け取り、要求ごとのコールバックを呼ぶ。
+//   ファイルと読み込みバッファは事前に登録し、要求ごとのファイル参照の取得、ページの固定を省く。
+//   カーネルが io_uring に対応していない場合は Init が失敗し、呼び出し元は pread/pwrite を使う。
+class IoRing : public Thread {
+
+ public:
+
+  IoRing();
+  virtual ~IoRing();
+
+  bool Init(unsigned entries);
+  void Destroy();
+  bool is_enabled() const { return ring_fd_ >= 0; }
+
+  void RegisterFile(int fd);
+  void UnregisterFile(int fd);
+
+  void *AllocBuffer(size_t size);
+  void FreeBuffer(void *buf);
+  bool is_buffer(const void *buf) const {
+    return buffers_ != NULL && (const char *)buf >= buffers_ &&
+        (const char *)buf < buffers_ + (size_t)buffer_count_ * IO_RING_BUFFER_SIZE;
+  }
+  bool is_buffer_in_use();
+
+  bool SubmitRead(int fd, void *buf, size_t size, off_t offset, IoRingCallback callback, void *user_data);
+  bool SubmitWrite(int fd, const void *buf, size_t size, off_t offset, IoRingCallback callback, void *user_data);
+
+ protected:
+
+  bool ThreadCall(void *user_data);
+
+ private:
+
+  /// 処理中の要求
+  struct Slot {
+    IoRingCallback callback;
+    void *user_data;
+  };
+
+  /// 完了した要求 (コールバック待ち)
+  struct Completion {
+    Slot slot;
+    unsigned index;
+    ssize_t result;
+  };
+
+  bool Submit(int opcode, int fd, void *buf, size_t size, off_t offset, IoRingCallback callback, void *user_data);
+  bool Push(int opcode, int fd, void *buf, size_t size, off_t offset, uint64_t tag);
+  void Flush();
+  void Unmap();
+
+  int ring_fd_;
+  unsigned sq_entries_;
+  unsigned cq_entries_;
+
+  void *sq_ptr_;                 // 投入リング (mmap)
+  size_t sq_size_;
+  void *cq_ptr_;                 // 完了リング (mmap、投入リングと共有の場合あり)
+  size_t cq_size_;
+  void *sqes_ptr_;               // 投入エントリ配列 (mmap)
+  size_t sqes_size_;
+
+  unsigned *sq_head_;
+  unsigned *sq_tail_;
+  unsigned *sq_mask_;
+  unsigned *sq_array_;
+  unsigned *cq_head_;
+  unsigned *cq_tail_;
+  unsigned *cq_mask_;
+  void *cqes_;
+
+  std::vector<Slot> slots_;      // 処理中の要求 (完了リングの容量まで)
+  std::vector<unsigned> free_slots_;
+  std::vector<Completion> completed_;  // 完了スレッド専用の作業領域
+  unsigned pending_;             // リングに置いて、まだ io_uring_enter に渡していない数
+  bool is_submitting_;           // いずれかのスレッドが io_uring_enter で投入中かどうか
+  bool is_stopping_;             // 終了処理中 (新しい要求は受け付けない)
+  Mutex submit_mutex_;
+
+  std::vector<char> files_;      // fd番号ごとの登録状態 (空の場合はファイルを登録しない)
+
+  char *buffers_;                // 登録バッファ領域 (NULLの場合は登録なし)
+  int buffer_count_;
+  std::vector<int> free_buffers_;
+  Mutex buffer_mutex_;
+};
+
+} // namespace cbb
+
+#endif // UTIL_IO_RING_H_
@@ -0,0 +1,345 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "local_devices.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+#include "common/error.h"
+#include "util/arena.h"
+
+namespace cbb {
+
+/**
+ * @breaf constructor
+ */
+LocalDevices::LocalDevices() {
+  mutex_.Init();
+  for (int index = 0; index < LOCAL_DEVICES_PLACE_LOCKS; index++) {
+    place_mutexes_[index].Init();
+  }
+  for (int fd = 0; fd < LOCAL_DEVICES_FD_MAX; fd++) {
+    fds_[fd].device = -1;
+    fds_[fd].stripe_count = 0;
+    fds_[fd].stripe_size = 0;
+  }
+  memset((void *)hints_, 0, sizeof(hints_));
+}
+
+/**
+ * @breaf destructor
+ */
+LocalDevices::~LocalDevices() {
+}
+
+/**
+ * @breaf 初期化 (ファイルを開く前に呼ぶ)
+ * @param roots デバイスのルートパス (先頭は名前空間を持つルート、上限を超えた分は使わない)
+ */
+void LocalDevices::Init(const std::vector<std::string> &roots) {
+  mutex_.Lock();
+  devices_.clear();
+  for (size_t index = 0; index < roots.size() && index < LOCAL_DEVICES_MAX; index++) {
+    Device device;
+    device.root = roots[index];
+    device.free_bytes = 0;
+    device.total_bytes = 0;
+    device.refresh_time = 0;
+    device.placed_since_refresh = 0;
+    device.open_files = 0;
+    device.placed_files = 0;
+    device.bytes_read = 0;
+    device.bytes_written = 0;
+    devices_.push_back(device);
+  }
+  memset((void *)hints_, 0, sizeof(hints_));
+  mutex_.Unlock();
+}
+
+/**
+ * @breaf ファイルのあるデバイスの検索
+ *   先頭以外のデバイスのディレクトリはファイルを置くために作ったものなので、ディレクトリは先頭のデバイスで探す。
+ * @param path ファイルパス (終端文字は不要)
+ * @param size ファイルパスの長さ
+ * @return デバイス番号 (どのデバイスにもない場合は-1)
+ */
+int LocalDevices::Locate(const char *path, size_t size) {
+  int count = devices_.size();
+  unsigned bucket = hash(path, size) % LOCAL_DEVICES_HINTS;
+  int hint = hints_[bucket];
+  if (hint >= count) {
+    hint = 0;
+  }
+
+  ArenaScope arena_scope(Arena::current());
+  for (int index = -1; index < count; index++) {
+    int device = index < 0 ? hint: index;
+    if (index == hint) {
+      continue;
+    }
+    const char *target = Arena::current()->Join(devices_[device].root, path, size);
+    struct stat st;
+    if (target == NULL || lstat(target, &st) != 0 || (device != 0 && S_ISDIR(st.st_mode))) {
+      continue;
+    }
+    if (device != hint) {
+      hints_[bucket] = device;
+    }
+    return device;
+  }
+  return -1;
+}
+
+/**
+ * @breaf 同じパスの配置の開始 (他のスレッドが同じパスのファイルを作り終えるまで待つ)
+ * @param devices デバイス管理
+ * @param path ファイルパス (終端文字は不要)
+ * @param size ファイルパスの長さ
+ */
+LocalDevices::PlaceScope::PlaceScope(LocalDevices &devices, const char *path, size_t size) : mutex_(NULL) {
+  if (devices.size() > 1) {
+    mutex_ = &devices.place_mutexes_[hash(path, size) % LOCAL_DEVICES_PLACE_LOCKS];
+    mutex_->Lock();
+  }
+}
+
+/**
+ * @breaf 同じパスの配置の終了
+ */
+LocalDevices::PlaceScope::~PlaceScope() {
+  if (mutex_ != NULL) {
+    mutex_->Unlock();
+  }
+}
+
+/**
+ * @breaf 新しいファイルの配置先の選択 (既にある場合はそのデバイス)
+ *   選んだデバイスにファイルを作るまで PlaceScope の中で呼ぶこと。
+ * @param path ファイルパス (終端文字は不要)
+ * @param size ファイルパスの長さ
+ * @return デバイス番号
+ */
+int LocalDevices::Place(const char *path, size_t size) {
+  int device = Locate(path, size);
+  if (device >= 0) {
+    return device;
+  }
+
+  uint64_t now = get_time_msec();
+  std::vector<DeviceLoad> loads(devices_.size());
+
+  mutex_.Lock();
+  for (size_t index = 0; index < devices_.size(); index++) {
+    Device &entry = devices_[index];
+    if (now - entry.refresh_time >= LOCAL_DEVICES_REFRESH_MSEC) {
+      Refresh(entry, now);
+    }
+    loads[index].free_bytes = entry.free_bytes;
+    loads[index].total_bytes = entry.total_bytes;
+    loads[index].open_files = entry.open_files + entry.placed_since_refresh;
+  }
+  device = Choose(loads);
+  devices_[device].placed_since_refresh++;
+  devices_[device].placed_files++;
+  mutex_.Unlock();
+
+  hints_[hash(path, size) % LOCAL_DEVICES_HINTS] = device;
+  return device;
+}
+
+/**
+ * @breaf 配置先の選択
+ *   空き容量が予備の割合を下回るデバイスを除き、空き容量を開いているファイル数で割った値が最も大きいものを選ぶ。
+ * @param loads デバイスの状態
+ * @return デバイス番号
+ */
+int LocalDevices::Choose(const std::vector<DeviceLoad> &loads) {
+  int result = 0;
+  double best = -1.0;
+  bool is_reserved = true;
+
+  for (int pass = 0; pass < 2 && best < 0; pass++) {
+    for (size_t index = 0; index < loads.size(); index++) {
+      const DeviceLoad &load = loads[index];
+      if (is_reserved && load.free_bytes * 100 < load.total_bytes * LOCAL_DEVICES_RESERVE_RATIO) {
+        continue;
+      }
+      double score = (double)load.free_bytes / (1 + load.open_files);
+      if (score > best) {
+        best = score;
+        result = index;
+      }
+    }
+    is_reserved = false;
+  }
+  return result;
+}
+
+/**
+ * @breaf 開いたファイルの登録 (デバイスごとの統計用)
+ * @param fd ファイルディスクリプタ
+ * @param device デバイス番号
+ * @param stripe_size デバイス間のストライプサイズ (0の場合はストライプなし)
+ * @param stripe_count ストライプするデバイス数
+ */
+void LocalDevices::Open(int fd, int device, size_t stripe_size, int stripe_count) {
+  if (fd < 0 || fd >= LOCAL_DEVICES_FD_MAX || device < 0 || device >= size()) {
+    return;
+  }
+  Close(fd);
+  fds_[fd].stripe_count = stripe_size > 0 ? stripe_count: 1;
+  fds_[fd].stripe_size = stripe_size;
+  fds_[fd].device = device;
+  for (int index = 0; index < fds_[fd].stripe_count; index++) {
+    __sync_fetch_and_add(&devices_[(device + index) % size()].open_files, 1);
+  }
+}
+
+/**
+ * @breaf 閉じたファイルの登録解除
+ * @param fd ファイルディスクリプタ
+ */
+void LocalDevices::Close(int fd) {
+  if (fd < 0 || fd >= LOCAL_DEVICES_FD_MAX || fds_[fd].device < 0) {
+    return;
+  }
+  int device = fds_[fd].device;
+  fds_[fd].device = -1;
+  for (int index = 0; index < fds_[fd].stripe_count; index++) {
+    __sync_fetch_and_sub(&devices_[(device + index) % size()].open_files, 1);
+  }
+}
+
+/**
+ * @breaf 読み書きしたバイト数の加算 (ストライプしたファイルはデバイスごとに分ける)
+ * @param fd ファイルディスクリプタ
+ * @param offset オフセット
+ * @param size 読み書きしたサイズ
+ * @param is_write 書き込みかどうか
+ */
+void LocalDevices::AddBytes(int fd, off_t offset, size_t size, bool is_write) {
+  if (fd < 0 || fd >= LOCAL_DEVICES_FD_MAX || fds_[fd].device < 0) {
+    return;
+  }
+  const FdDevice &entry = fds_[fd];
+
+  while (size > 0) {
+    size_t length = size;
+    int device = entry.device;
+    if (entry.stripe_size > 0) {
+      uint64_t unit = offset / entry.stripe_size;
+      length = std::min<uint64_t>(size, (unit + 1) * entry.stripe_size - offset);
+      device = (device + unit % entry.stripe_count) % devices_.size();
+    }
+    if (is_write) {
+      __sync_fetch_and_add(&devices_[device].bytes_written, length);
+    } else {
+      __sync_fetch_and_add(&devices_[device].bytes_read, length);
+    }
+    offset += length;
+    size -= length;
+  }
+}
+
+/**
+ * @breaf デバイスごとの統計情報の取得
+ * @param stats_ptr 統計情報保存ポインタ
+ */
+void LocalDevices::Snapshot(std::vector<DeviceStats> *stats_ptr) {
+  uint64_t now = get_time_msec();
+  stats_ptr->clear();
+
+  mutex_.Lock();
+  for (size_t index = 0; index < devices_.size(); index++) {
+    Device &device = devices_[index];
+    Refresh(device, now);
+
+    DeviceStats stats;
+    stats.root = device.root;
+    stats.free_bytes = device.free_bytes;
+    stats.total_bytes = device.total_bytes;
+    stats.open_files = device.open_files > 0 ? device.open_files: 0;
+    stats.placed_files = device.placed_files;
+    stats.bytes_read = device.bytes_read;
+    stats.bytes_written = device.bytes_written;
+    stats_ptr->push_back(stats);
+  }
+  mutex_.Unlock();
+}
+
+/**
+ * @breaf 全デバイスを合わせたファイルシステム情報の取得 (同じファイルシステムのデバイスは1つとして数える)
+ * @param st_ptr ファイルシステム情報保存ポインタ (ブロック数は先頭のデバイスのブロックサイズに換算する)
+ * @return Error値
+ */
+int LocalDevices::StatVfs(struct statvfs *st_ptr) {
+  if (statvfs(root(0).c_str(), st_ptr) != 0) {
+    return -errno;
+  }
+
+  std::vector<unsigned long> fsids(1, st_ptr->f_fsid);
+  for (int device = 1; device < size(); device++) {
+    struct statvfs st;
+    if (statvfs(root(device).c_str(), &st) != 0 ||
+        std::find(fsids.begin(), fsids.end(), st.f_fsid) != fsids.end() || st_ptr->f_frsize == 0) {
+      continue;
+    }
+    fsids.push_back(st.f_fsid);
+
+    double scale = (double)st.f_frsize / st_ptr->f_frsize;
+    st_ptr->f_blocks += st.f_blocks * scale;
+    st_ptr->f_bfree += st.f_bfree * scale;
+    st_ptr->f_bavail += st.f_bavail * scale;
+    st_ptr->f_files += st.f_files;
+    st_ptr->f_ffree += st.f_ffree;
+    st_ptr->f_favail += st.f_favail;
+  }
+  return kCBBSuccess;
+}
+
+/**
+ * @breaf 空き容量の取得 (mutex_ を取得して呼ぶ)
+ * @param device デバイス
+ * @param now 現在時刻 (msec)
+ */
+void LocalDevices::Refresh(Device &device, uint64_t now) {
+  struct statvfs st;
+  if (statvfs(device.root.c_str(), &st) == 0) {
+    device.free_bytes = (uint64_t)st.f_bavail * st.f_frsize;
+    device.total_bytes = (uint64_t)st.f_blocks * st.f_frsize;
+  }
+  device.refresh_time = now;
+  device.placed_since_refresh = 0;
+}
+
+/**
+ * @breaf パスのハッシュ値 (FNV-1a)
+ * @param path ファイルパス
+ * @param size ファイルパスの長さ
+ * @return ハッシュ値
+ */
+unsigned LocalDevices::hash(const char *path, size_t size) {
+  unsigned value = 2166136261u;
+  for (size_t index = 0; index < size; index++) {
+    value = (value ^ (unsigned char)path[index]) * 16777619u;
+  }
+  return value;
+}
+
+} /* namespace cbb */
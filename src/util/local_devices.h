@@ -0,0 +1,118 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef UTIL_LOCAL_DEVICES_H_
+#define UTIL_LOCAL_DEVICES_H_
+
+#include <stdint.h>
+#include <sys/statvfs.h>
+
+#include <string>
+#include <vector>
+
+#include "common/common.h"
+#include "util/mutex.h"
+
+#define LOCAL_DEVICES_MAX 16              // Localストレージのデバイス数の上限
+#define LOCAL_DEVICES_FD_MAX 4096         // デバイスごとの統計を取るファイル (fd番号がこれ未満のもの)
+#define LOCAL_DEVICES_HINTS 4096          // ファイルのあるデバイスを覚えておくバケット数 (パスのハッシュで分ける)
+#define LOCAL_DEVICES_REFRESH_MSEC 1000   // 空き容量を取り直す間隔
+#define LOCAL_DEVICES_RESERVE_RATIO 5     // 新しいファイルを置かない空き容量の割合 (%、すべてのデバイスが下回る場合は除く)
+#define LOCAL_DEVICES_PLACE_LOCKS 256     // 配置を直列にするロック数 (パスのハッシュで分ける)
+
+namespace cbb {
+
+/// 配置先を選ぶためのデバイスの状態
+struct DeviceLoad {
+  uint64_t free_bytes;   // 空き容量
+  uint64_t total_bytes;  // 容量
+  int open_files;        // 開いているファイル数と前回空き容量を取得してから配置したファイル数
+
+  DeviceLoad() : free_bytes(0), total_bytes(0), open_files(0) {}
+};
+
+// Localストレージの複数デバイス管理クラス
+//   先頭のデバイス (ルート) が名前空間 (ディレクトリ、サーバー内部ファイル) を持ち、
+//   通常ファイルはいずれか1つのデバイスの同じ相対パスに置く。他のデバイスのディレクトリはファイルを置く時に作る。
+//   ファイルのあるデバイスはパスのハッシュごとに覚えておき、外れた場合は全デバイスを調べる。
+//   同じパスの配置先の選択 (Place) からファイルの作成までは PlaceScope の中で行い、別のデバイスに重複して作らない。
+class LocalDevices {
+ public:
+  // 同じパスの配置を直列にする範囲 (デバイスが1つの場合は何もしない)
+  class PlaceScope {
+   public:
+    PlaceScope(LocalDevices &devices, const char *path, size_t size);
+    ~PlaceScope();
+
+   private:
+    Mutex *mutex_;
+
+    PlaceScope(const PlaceScope &);
+    PlaceScope &operator=(const PlaceScope &);
+  };
+
+  LocalDevices();
+  virtual ~LocalDevices();
+
+  void Init(const std::vector<std::string> &roots);
+
+  int Locate(const char *path, size_t size);
+  int Place(const char *path, size_t size);
+
+  void Open(int fd, int device, size_t stripe_size, int stripe_count);
+  void Close(int fd);
+  void AddBytes(int fd, off_t offset, size_t size, bool is_write);
+
+  void Snapshot(std::vector<DeviceStats> *stats_ptr);
+  int StatVfs(struct statvfs *st_ptr);
+
+  int size() const { return devices_.size(); }
+  const std::string &root(int device) const { return devices_[device].root; }
+
+  static int Choose(const std::vector<DeviceLoad> &loads);
+
+ private:
+  struct Device {
+    std::string root;
+    uint64_t free_bytes;
+    uint64_t total_bytes;
+    uint64_t refresh_time;      // 空き容量を取得した時刻 (msec)
+    int placed_since_refresh;   // 空き容量を取得してから配置したファイル数
+    volatile int open_files;
+    volatile uint64_t placed_files;
+    volatile uint64_t bytes_read;
+    volatile uint64_t bytes_written;
+  };
+
+  /// fdごとのデバイス (ストライプしたファイルは先頭のデバイスから順に stripe_count 個)
+  struct FdDevice {
+    int8_t device;    // -1の場合は統計を取らない
+    int8_t stripe_count;
+    uint32_t stripe_size;
+  };
+
+  void Refresh(Device &device, uint64_t now);
+  static unsigned hash(const char *path, size_t size);
+
+  std::vector<Device> devices_;
+  FdDevice fds_[LOCAL_DEVICES_FD_MAX];
+  volatile int8_t hints_[LOCAL_DEVICES_HINTS];
+  Mutex mutex_;
+  Mutex place_mutexes_[LOCAL_DEVICES_PLACE_LOCKS];
+};
+
+} /* namespace cbb */
+
+#endif /* UTIL_LOCAL_DEVICES_H_ */
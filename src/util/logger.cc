@@ -0,0 +1,328 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "logger.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <list>
+
+#include "thread.h"
+#include "mutex.h"
+
+#define LOG_RING_SLOTS      1024  // スレッドごとのレコード数 (2のべき乗)
+#define LOG_RECORD_SIZE     256   // 1レコードの最大長
+#define LOG_FLUSH_INTERVAL  10000 // 出力するものがない場合の待ち時間 (usec)
+
+// 非同期ロガークラス
+namespace cbb {
+
+namespace {
+
+/// スレッドごとのリングバッファ
+struct LogRing {
+  volatile uint64_t head;   // 書き込み位置 (生成スレッドのみ更新)
+  volatile uint64_t tail;   // 読み込み位置 (フラッシュスレッドのみ更新)
+  volatile int is_closed;   // 生成スレッドが終了したかどうか
+  char records[LOG_RING_SLOTS][LOG_RECORD_SIZE];
+};
+
+// リングバッファを出力するフラッシュスレッド
+class LogFlusher : public Thread {
+ public:
+  LogFlusher() : output_(stdout), dropped_(0), is_running_(0) { rings_mutex_.Init(); output_mutex_.Init(); }
+
+  void Start();
+  void Stop();
+  LogRing *Attach();
+  bool Drain();
+  void SetOutput(FILE *output);
+  void AddDropped() { __sync_fetch_and_add(&dropped_, 1); }
+  uint64_t dropped() { return dropped_; }
+
+ protected:
+  bool ThreadCall(void *user_data);
+
+ private:
+  std::list<LogRing *> rings_;
+  Mutex rings_mutex_;
+  Mutex output_mutex_;
+  FILE *output_;
+  uint64_t dropped_;
+  volatile int is_running_;  // フラッシュスレッドが動いているかどうか
+};
+
+LogFlusher *g_flusher = NULL;
+pthread_once_t g_flusher_once = PTHREAD_ONCE_INIT;
+pthread_key_t g_ring_key;
+__thread LogRing *tls_ring = NULL;
+
+const char *g_level_names[] = { "D", "I", "W", "E" };
+
+/**
+ * @breaf スレッド終了時にリングバッファを閉じる
+ * @param data リングバッファ
+ */
+void CloseRing(void *data) {
+  LogRing *ring = (LogRing *)data;
+  __sync_synchronize();
+  ring->is_closed = 1;
+}
+
+/**
+ * @breaf フラッシュスレッドの開始 (初回の出力時に一度だけ呼ばれる)
+ */
+void StartFlusher() {
+  pthread_key_create(&g_ring_key, CloseRing);
+  g_flusher = new LogFlusher();
+  g_flusher->Start();
+}
+
+/**
+ * @breaf フラッシュスレッドの開始 (動いている場合は何もしない)
+ */
+void LogFlusher::Start() {
+  if (__sync_bool_compare_and_swap(&is_running_, 0, 1)) {
+    Create(NULL, 0);
+  }
+}
+
+/**
+ * @breaf フラッシュスレッドの停止 (再び Start で開始できる)
+ */
+void LogFlusher::Stop() {
+  if (__sync_bool_compare_and_swap(&is_running_, 1, 0)) {
+    Release();
+  }
+}
+
+/**
+ * @breaf リングバッファを作成して登録する
+ * @return リングバッファ
+ */
+LogRing *LogFlusher::Attach() {
+  LogRing *ring = new LogRing;
+  ring->head = 0;
+  ring->tail = 0;
+  ring->is_closed = 0;
+
+  rings_mutex_.Lock();
+  rings_.push_back(ring);
+  rings_mutex_.Unlock();
+
+  pthread_setspecific(g_ring_key, ring);
+  return ring;
+}
+
+/**
+ * @breaf 登録されているリングバッファをすべて出力する
+ * @return 出力したレコードがあるかどうか
+ */
+bool LogFlusher::Drain() {
+  bool is_written = false;
+
+  rings_mutex_.Lock();
+  output_mutex_.Lock();
+
+  std::list<LogRing *>::iterator it = rings_.begin();
+  while (it != rings_.end()) {
+    LogRing *ring = *it;
+    int is_closed = ring->is_closed;
+    __sync_synchronize();
+    uint64_t head = ring->head;
+    uint64_t tail = ring->tail;
+    __sync_synchronize();
+
+    for (; tail != head; tail++) {
+      fputs(ring->records[tail & (LOG_RING_SLOTS - 1)], output_);
+      is_written = true;
+    }
+
+    __sync_synchronize();
+    ring->tail = tail;
+
+    if (is_closed) {
+      it = rings_.erase(it);
+      delete ring;
+    } else {
+      ++it;
+    }
+  }
+
+  if (is_written) {
+    fflush(output_);
+  }
+
+  output_mutex_.Unlock();
+  rings_mutex_.Unlock();
+
+  return is_written;
+}
+
+/**
+ * @breaf 出力先の変更
+ * @param output 出力先
+ */
+void LogFlusher::SetOutput(FILE *output) {
+  output_mutex_.Lock();
+  if (output_ != stdout && output_ != stderr) {
+    fclose(output_);
+  }
+  output_ = output;
+  output_mutex_.Unlock();
+}
+
+/**
+ * @see Thread::ThreadCall
+ * @breaf リングバッファの出力
+ * @return bool 呼び出しを継続するかどうか
+ */
+bool LogFlusher::ThreadCall(void *user_data) {
+  if (!Drain()) {
+    usleep(LOG_FLUSH_INTERVAL);
+  }
+  return true;
+}
+
+} // namespace
+
+volatile int Logger::level_ = CBB_LOG_LEVEL;
+
+/**
+ * @breaf ログ出力先とレベルの設定 (Close の後はフラッシュスレッドを再開する)
+ * @param path 出力ファイルパス (空の場合は標準出力)
+ * @param level ログレベル
+ * @return bool 設定結果
+ */
+bool Logger::Open(const std::string &path, int level) {
+  pthread_once(&g_flusher_once, StartFlusher);
+  g_flusher->Start();
+
+  set_level(level);
+
+  FILE *output = stdout;
+  if (!path.empty()) {
+    output = fopen(path.c_str(), "at");
+    if (output == NULL) {
+      return false;
+    }
+  }
+
+  g_flusher->SetOutput(output);
+  return true;
+}
+
+/**
+ * @breaf フラッシュスレッドを停止して残りを出力する
+ */
+void Logger::Close() {
+  if (g_flusher != NULL) {
+    g_flusher->Stop();
+    g_flusher->Drain();
+    g_flusher->SetOutput(stdout);
+  }
+}
+
+/**
+ * @breaf 溜まっているログを出力する
+ */
+void Logger::Flush() {
+  if (g_flusher != NULL) {
+    g_flusher->Drain();
+  }
+}
+
+/**
+ * @breaf ログ出力
+ * @param level ログレベル
+ * @param format フォーマット
+ */
+void Logger::Write(int level, const char *format, ...) {
+  va_list arg;
+  va_start(arg, format);
+  WriteV(level, format, arg);
+  va_end(arg);
+}
+
+/**
+ * @breaf ログ出力 (va_list版)
+ * @param level ログレベル
+ * @param format フォーマット
+ * @param arg 引数リスト
+ */
+void Logger::WriteV(int level, const char *format, va_list arg) {
+  if (!is_enabled(level)) {
+    return;
+  }
+
+  pthread_once(&g_flusher_once, StartFlusher);
+
+  LogRing *ring = tls_ring;
+  if (ring == NULL) {
+    ring = tls_ring = g_flusher->Attach();
+  }
+
+  uint64_t head = ring->head;
+  if (head - ring->tail >= LOG_RING_SLOTS) {
+    g_flusher->AddDropped();
+    return;
+  }
+
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+
+  char *record = ring->records[head & (LOG_RING_SLOTS - 1)];
+  int length = snprintf(record, LOG_RECORD_SIZE, "%ld.%06ld %s ",
+                        (long)tv.tv_sec, (long)tv.tv_usec,
+                        g_level_names[level < kLogDebug ? kLogDebug: level > kLogError ? kLogError: level]);
+  int message_length = vsnprintf(record + length, LOG_RECORD_SIZE - length, format, arg);
+  if (message_length >= LOG_RECORD_SIZE - length) {
+    // 切り詰めた場合も改行で終える
+    record[LOG_RECORD_SIZE - 2] = '\n';
+  }
+  record[LOG_RECORD_SIZE - 1] = '\0';
+
+  __sync_synchronize();
+  ring->head = head + 1;
+}
+
+/**
+ * @breaf リングバッファ満杯で破棄したレコード数
+ * @return 破棄数
+ */
+uint64_t Logger::dropped() {
+  return g_flusher != NULL ? g_flusher->dropped(): 0;
+}
+
+/**
+ * @breaf ログレベル名の変換
+ * @param name レベル名 (debug, info, warn, error, none)
+ * @param default_level 不明な場合のレベル
+ * @return ログレベル
+ */
+int Logger::ParseLevel(const std::string &name, int default_level) {
+  if (name == "debug") return kLogDebug;
+  if (name == "info") return kLogInfo;
+  if (name == "warn") return kLogWarn;
+  if (name == "error") return kLogError;
+  if (name == "none") return kLogNone;
+  return default_level;
+}
+
+} /* namespace cbb */
@@ -0,0 +1,79 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef UTIL_LOGGER_H_
+#define UTIL_LOGGER_H_
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <string>
+
+/// ログレベル (コンパイル時判定用)
+#define CBB_LOG_LEVEL_DEBUG   0
+#define CBB_LOG_LEVEL_INFO    1
+#define CBB_LOG_LEVEL_WARN    2
+#define CBB_LOG_LEVEL_ERROR   3
+#define CBB_LOG_LEVEL_NONE    4
+
+#ifndef CBB_LOG_LEVEL
+  #define CBB_LOG_LEVEL CBB_LOG_LEVEL_INFO
+#endif
+
+namespace cbb {
+
+enum LogLevel {
+  kLogDebug = CBB_LOG_LEVEL_DEBUG,
+  kLogInfo = CBB_LOG_LEVEL_INFO,
+  kLogWarn = CBB_LOG_LEVEL_WARN,
+  kLogError = CBB_LOG_LEVEL_ERROR,
+  kLogNone = CBB_LOG_LEVEL_NONE,
+};
+
+// 非同期ロガークラス
+//
+// 各スレッドはスレッドローカルのリングバッファ（ロックフリー SPSC）へ
+// 書式化済みのレコードを書き込むだけで、出力はバックグラウンドの
+// フラッシュスレッドがまとめて行う。バッファが満杯の場合は破棄して件数を数える。
+class Logger {
+ public:
+  static bool Open(const std::string &path, int level);
+  static void Close();
+  static void Flush();
+
+  static void Write(int level, const char *format, ...);
+  static void WriteV(int level, const char *format, va_list arg);
+
+  static bool is_enabled(int level) { return level >= level_; }
+  static int level() { return level_; }
+  static void set_level(int level) { level_ = level; }
+  static uint64_t dropped();
+
+  static int ParseLevel(const std::string &name, int default_level);
+
+ private:
+  static volatile int level_;
+};
+
+} /* namespace cbb */
+
+/// コンパイル時のログレベル未満の出力は呼び出しごと除去される
+#define CBB_LOG(level, ...) \
+  do { \
+    if ((level) >= CBB_LOG_LEVEL && cbb::Logger::is_enabled(level)) { \
+      cbb::Logger::Write((level), __VA_ARGS__); \
+    } \
+  } while (0)
+
+#endif /* UTIL_LOGGER_H_ */
@@ -0,0 +1,290 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "secondary_throttle.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+// Secondaryストレージへの書き出しの制限クラス
+namespace cbb {
+
+// Secondaryへのコピー中のスレッドのサーバー (NULLの場合はコピー中でない)
+static __thread SecondaryThrottle *tls_export = NULL;
+
+/**
+ * @breaf constructor (制限なしで初期化する)
+ */
+SecondaryThrottle::SecondaryThrottle() : bandwidth_(0), ops_(0), cluster_bandwidth_(0), cluster_ops_(0),
+    lease_interval_msec_(0), lease_time_(0), servers_(1), bytes_(0), operations_(0), throttled_(0), throttled_msec_(0) {
+  mutex_.Init();
+}
+
+/**
+ * @breaf サーバーごとの上限の設定 (サーバーの開始時に呼ぶ)
+ * @param bandwidth 書き込み帯域の上限 (バイト/秒、0の場合は制限なし)
+ * @param ops メタデータ操作の上限 (回/秒、0の場合は制限なし)
+ */
+void SecondaryThrottle::SetPolicy(uint64_t bandwidth, uint64_t ops) {
+  mutex_.Lock();
+  bandwidth_ = bandwidth;
+  ops_ = ops;
+  UpdateRates(get_time_usec());
+  mutex_.Unlock();
+}
+
+/**
+ * @breaf クラスタ全体の上限の設定 (サーバーの開始時に呼ぶ)
+ * @param cluster_bandwidth クラスタ全体の書き込み帯域の上限 (バイト/秒、0の場合は調整しない)
+ * @param cluster_ops クラスタ全体のメタデータ操作の上限 (回/秒、0の場合は調整しない)
+ * @param lease_dir リースファイルを置くディレクトリ (全サーバーから見える場所)
+ * @param lease_name このサーバーのリースファイル名
+ * @param interval_msec リースの更新間隔 (msec)
+ */
+void SecondaryThrottle::SetCoordination(uint64_t cluster_bandwidth, uint64_t cluster_ops,
+                                        const std::string &lease_dir, const std::string &lease_name, int interval_msec) {
+  mutex_.Lock();
+  cluster_bandwidth_ = cluster_bandwidth;
+  cluster_ops_ = cluster_ops;
+  bool is_coordinated = (cluster_bandwidth > 0 || cluster_ops > 0) && !lease_dir.empty();
+  lease_dir_ = is_coordinated ? lease_dir: "";
+  lease_path_ = is_coordinated ? lease_dir + "/" + lease_name: "";
+  lease_interval_msec_ = interval_msec > 0 ? interval_msec: 1;
+  lease_time_ = 0;
+  servers_ = 1;
+  UpdateRates(get_time_usec());
+  mutex_.Unlock();
+}
+
+/**
+ * @breaf 制限の解除 (このサーバーのリースファイルを削除する)
+ */
+void SecondaryThrottle::Disable() {
+  mutex_.Lock();
+  if (!lease_path_.empty()) {
+    unlink(lease_path_.c_str());
+  }
+  bandwidth_ = 0;
+  ops_ = 0;
+  cluster_bandwidth_ = 0;
+  cluster_ops_ = 0;
+  lease_dir_.clear();
+  lease_path_.clear();
+  servers_ = 1;
+  UpdateRates(get_time_usec());
+  mutex_.Unlock();
+}
+
+/**
+ * @breaf Secondaryへの書き込み (上限を超えている間は待つ)
+ * @param bytes 書き込むバイト数
+ */
+void SecondaryThrottle::Write(uint64_t bytes) {
+  if (!is_enabled()) {
+    return;
+  }
+  RenewLease();
+  __sync_fetch_and_add(&bytes_, bytes);
+  Acquire(bytes_bucket_, bytes);
+}
+
+/**
+ * @breaf Secondaryのメタデータ操作 (作成、名前の変更、属性の取得等、上限を超えている間は待つ)
+ */
+void SecondaryThrottle::Operation() {
+  if (!is_enabled()) {
+    return;
+  }
+  RenewLease();
+  __sync_fetch_and_add(&operations_, 1);
+  Acquire(ops_bucket_, 1);
+}
+
+/**
+ * @breaf コピーの区切り (Secondaryへのコピー中のスレッドだけ書き込みを制限する)
+ * @param bytes 前回の区切りからコピーしたバイト数
+ */
+void SecondaryThrottle::Pace(uint64_t bytes) {
+  SecondaryThrottle *throttle = tls_export;
+  if (throttle != NULL) {
+    throttle->Write(bytes);
+  }
+}
+
+/**
+ * @breaf Secondaryへのコピーの帯域を区切りごとに制限するかどうか
+ * @return bool 制限するかどうか
+ */
+bool SecondaryThrottle::is_paced() {
+  SecondaryThrottle *throttle = tls_export;
+  return throttle != NULL && (throttle->bandwidth_ > 0 || throttle->cluster_bandwidth_ > 0);
+}
+
+/**
+ * @breaf 統計情報の取得
+ * @param stats_ptr 統計情報保存ポインタ
+ */
+void SecondaryThrottle::Snapshot(SecondaryStats *stats_ptr) {
+  mutex_.Lock();
+  stats_ptr->bandwidth = bytes_bucket_.rate();
+  stats_ptr->ops = ops_bucket_.rate();
+  stats_ptr->servers = lease_dir_.empty() ? 0: servers_;
+  mutex_.Unlock();
+
+  stats_ptr->bytes = bytes_;
+  stats_ptr->operations = operations_;
+  stats_ptr->throttled = throttled_;
+  stats_ptr->throttled_msec = throttled_msec_;
+}
+
+/**
+ * @breaf constructor (Secondaryへのコピーの開始、入れ子の場合は外側のサーバーのまま)
+ * @param throttle コピーするサーバーの制限
+ */
+SecondaryThrottle::ExportScope::ExportScope(SecondaryThrottle &throttle) : prev_throttle_(tls_export) {
+  if (prev_throttle_ == NULL) {
+    tls_export = &throttle;
+  }
+}
+
+/**
+ * @breaf destructor (Secondaryへのコピーの終了)
+ */
+SecondaryThrottle::ExportScope::~ExportScope() {
+  tls_export = prev_throttle_;
+}
+
+/**
+ * @breaf トークンの取得 (足りない間は待つ)
+ * @param bucket トークンバケット
+ * @param cost 消費するトークン数
+ */
+void SecondaryThrottle::Acquire(TokenBucket &bucket, uint64_t cost) {
+  uint64_t start = 0;
+  for (;;) {
+    mutex_.Lock();
+    uint64_t wait = bucket.TryTake(cost, get_time_usec());
+    mutex_.Unlock();
+    if (wait == 0) {
+      break;
+    }
+    if (start == 0) {
+      start = get_time_msec();
+    }
+    usleep(std::min<uint64_t>(wait, SECONDARY_THROTTLE_WAIT * 1000));
+  }
+
+  if (start != 0) {
+    __sync_fetch_and_add(&throttled_, 1);
+    __sync_fetch_and_add(&throttled_msec_, get_time_msec() - start);
+  }
+}
+
+/**
+ * @breaf リースの更新と期限内のリースの数え直し (更新間隔ごとに1つのスレッドだけが行う)
+ *   各サーバーの時計はそろっていないため、自分のリースファイルの更新日時を基準にする。
+ */
+void SecondaryThrottle::RenewLease() {
+  if (cluster_bandwidth_ == 0 && cluster_ops_ == 0) {
+    return;
+  }
+  uint64_t now = get_time_msec();
+  uint64_t last = lease_time_;
+  if (last != 0 && now < last + lease_interval_msec_) {
+    return;
+  }
+  if (!__sync_bool_compare_and_swap(&lease_time_, last, now)) {
+    return;
+  }
+
+  // 設定の変更、解除と同時に呼ばれるため、パスは mutex_ を取得して写す
+  mutex_.Lock();
+  std::string lease_dir = lease_dir_;
+  std::string lease_path = lease_path_;
+  int64_t expire_msec = (int64_t)lease_interval_msec_ * SECONDARY_LEASE_EXPIRE;
+  mutex_.Unlock();
+  if (lease_dir.empty()) {
+    return;
+  }
+
+  mkdir(lease_dir.c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+  int fd = open(lease_path.c_str(), O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd < 0) {
+    return;
+  }
+  struct stat own_st;
+  bool is_touched = futimens(fd, NULL) == 0 && fstat(fd, &own_st) == 0;
+  close(fd);
+  DIR *dp = is_touched ? opendir(lease_dir.c_str()): NULL;
+  if (dp == NULL) {
+    return;
+  }
+
+  int64_t own_msec = (int64_t)own_st.st_mtim.tv_sec * 1000 + own_st.st_mtim.tv_nsec / 1000000;
+  int count = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dp)) != NULL) {
+    struct stat st;
+    std::string path = lease_dir + "/" + ent->d_name;
+    if (ent->d_name[0] == '.' || stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    int64_t lease_msec = (int64_t)st.st_mtim.tv_sec * 1000 + st.st_mtim.tv_nsec / 1000000;
+    if (own_msec - lease_msec <= expire_msec) {
+      count++;
+    }
+  }
+  closedir(dp);
+
+  mutex_.Lock();
+  if (lease_path_ != lease_path) {
+    // 数えている間に解除、変更された場合は作り直した古いリースを消し、数も反映しない
+    mutex_.Unlock();
+    unlink(lease_path.c_str());
+    return;
+  }
+  servers_ = std::max(count, 1);
+  UpdateRates(get_time_usec());
+  mutex_.Unlock();
+}
+
+/**
+ * @breaf 現在の上限をトークンバケットに反映する (mutex_ を取得して呼ぶ)
+ * @param now_usec 現在時刻 (usec)
+ */
+void SecondaryThrottle::UpdateRates(uint64_t now_usec) {
+  bytes_bucket_.SetRate(share(bandwidth_, cluster_bandwidth_), 0, now_usec);
+  ops_bucket_.SetRate(share(ops_, cluster_ops_), 0, now_usec);
+}
+
+/**
+ * @breaf このサーバーの上限 (クラスタ全体の上限を期限内のリースの数で分けた値と、サーバーごとの上限の小さい方)
+ * @param limit サーバーごとの上限 (0の場合は制限なし)
+ * @param cluster_limit クラスタ全体の上限 (0の場合は調整しない)
+ * @return 上限 (0の場合は制限なし)
+ */
+uint64_t SecondaryThrottle::share(uint64_t limit, uint64_t cluster_limit) {
+  if (cluster_limit == 0 || lease_dir_.empty()) {
+    return limit;
+  }
+  uint64_t part = std::max<uint64_t>(cluster_limit / servers_, 1);
+  return limit > 0 ? std::min(limit, part): part;
+}
+
+} /* namespace cbb */
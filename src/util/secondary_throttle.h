@@ -0,0 +1,93 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef UTIL_SECONDARY_THROTTLE_H_
+#define UTIL_SECONDARY_THROTTLE_H_
+
+#include <stdint.h>
+
+#include <string>
+
+#include "common/common.h"
+#include "util/mutex.h"
+#include "util/token_bucket.h"
+
+#define SECONDARY_THROTTLE_WAIT 100  // 上限で待つ間の確認間隔 (msec)
+#define SECONDARY_LEASE_EXPIRE 3     // リースを有効とみなす期間 (更新間隔の倍数)
+
+namespace cbb {
+
+// Secondaryストレージ (共有の並列ファイルシステム) への書き出しの制限クラス
+//
+// 書き込み帯域とメタデータ操作の回数をトークンバケットで制限する。
+// リースのディレクトリを指定した場合、書き出し中のサーバーはそこに自分のリースファイルを置いて更新し続け、
+// 期限内のリースの数でクラスタ全体の上限を割った値を自分の上限にする。
+// 上限とリースはサーバーごとに持ち、コピーの区切り (Pace) はスレッドが入っている ExportScope のサーバーで制限する。
+class SecondaryThrottle {
+ public:
+  SecondaryThrottle();
+
+  void SetPolicy(uint64_t bandwidth, uint64_t ops);
+  void SetCoordination(uint64_t cluster_bandwidth, uint64_t cluster_ops,
+                       const std::string &lease_dir, const std::string &lease_name, int interval_msec);
+  void Disable();
+
+  void Write(uint64_t bytes);
+  void Operation();
+  static void Pace(uint64_t bytes);
+
+  bool is_enabled() { return bandwidth_ > 0 || ops_ > 0 || cluster_bandwidth_ > 0 || cluster_ops_ > 0; }
+  static bool is_paced();
+  void Snapshot(SecondaryStats *stats_ptr);
+
+  // Secondaryへのコピーの区間 (FileControl::Copy の区切りごとに帯域を制限する)
+  class ExportScope {
+   public:
+    explicit ExportScope(SecondaryThrottle &throttle);
+    ~ExportScope();
+
+   private:
+    SecondaryThrottle *prev_throttle_;  // 外側の区間のサーバー (NULLの場合はコピー中でなかった)
+  };
+
+ private:
+  void Acquire(TokenBucket &bucket, uint64_t cost);
+  void RenewLease();
+  void UpdateRates(uint64_t now_usec);
+  uint64_t share(uint64_t limit, uint64_t cluster_limit);
+
+  Mutex mutex_;
+  uint64_t bandwidth_;          // サーバーごとの書き込み帯域の上限 (バイト/秒、0の場合は制限なし)
+  uint64_t ops_;                // サーバーごとのメタデータ操作の上限 (回/秒、0の場合は制限なし)
+  uint64_t cluster_bandwidth_;  // クラスタ全体の書き込み帯域の上限 (0の場合は調整しない)
+  uint64_t cluster_ops_;        // クラスタ全体のメタデータ操作の上限 (0の場合は調整しない)
+  std::string lease_dir_;       // リースファイルを置くディレクトリ (空の場合は調整しない、mutex_ で保護)
+  std::string lease_path_;      // 自分のリースファイル (mutex_ で保護)
+  int lease_interval_msec_;     // リースの更新間隔
+  volatile uint64_t lease_time_;  // 最後にリースを更新した時刻 (msec)
+  int servers_;                 // 期限内のリース数 (自分を含む)
+
+  TokenBucket bytes_bucket_;
+  TokenBucket ops_bucket_;
+
+  volatile uint64_t bytes_;
+  volatile uint64_t operations_;
+  volatile uint64_t throttled_;
+  volatile uint64_t throttled_msec_;
+};
+
+} /* namespace cbb */
+
+#endif /* UTIL_SECONDARY_THROTTLE_H_ */
@@ -15,7 +15,10 @@
 //
 #include "select_server.h"
 
+#include <stdlib.h>
+
 #include <boost/foreach.hpp>
+#include <boost/format.hpp>
 
 #include "util/hash/hash_calc_md5.h"
 #include "util/hash/hash_calc_sha1.h"
@@ -24,29 +27,95 @@
 // サーバー選択クラス
 namespace cbb {
 
+/**
+ * @breaf "host" または "host:port" 形式のサーバー情報の解析
+ * @param host サーバー ("host" または "host:port")
+ * @param default_port ポート番号を省略した場合のポート番号
+ * @return サーバー情報
+ */
+ServerInfo ServerInfo::Parse(std::string host, int default_port) {
+  int port = default_port;
+
+  // "host:port" 形式の場合はサーバーごとのポート番号を使う
+  std::string::size_type pos = host.rfind(':');
+  if (pos != std::string::npos) {
+    port = atoi(host.c_str() + pos + 1);
+    host.erase(pos);
+  }
+
+  return ServerInfo(host.c_str(), port);
+}
+
+/**
+ * @breaf "host:port" 形式の文字列
+ * @return 文字列
+ */
+std::string ServerInfo::str() const {
+  return (boost::format("%1%:%2%") % host % port).str();
+}
+
 /**
  * @breaf 初期化
  * @param settings 設定クラス
  * @param hash_calc Hash計算クラス
  */
 void SelectServer::Init(Settings &settings, HashCalcBase *hash_calc) {
-  assert(hash_calc != NULL);
+  Init(hash_calc, settings.client_hosts(), settings.client_port(), 0);
+}
 
-  server_list_.clear();
+/**
+ * @breaf 初期化 (サーバー一覧を直接指定)
+ * @param hash_calc Hash計算クラス
+ * @param hosts サーバー一覧 ("host" または "host:port")
+ * @param default_port ポート番号を省略したサーバーのポート番号
+ * @param virtual_nodes サーバーあたりの仮想ノード数 (0の場合はハッシュ空間を均等に分割)
+ */
+void SelectServer::Init(HashCalcBase *hash_calc, const std::vector<std::string> &hosts, int default_port, int virtual_nodes) {
+  assert(hash_calc != NULL);
 
   // Hash計算クラス保存
   hash_calc_ = hash_calc;
+  default_port_ = default_port;
+
+  Update(hosts, virtual_nodes);
+}
+
+/**
+ * @breaf サーバー構成の差し替え
+ *   virtual_nodes が0の場合は従来どおりハッシュ空間をサーバー一覧の順に均等に分割する。
+ *   1以上の場合は "host:port#番号" のハッシュ値を各サーバーの判定値にする (構成の変更で担当が変わるパスが少ない)。
+ * @param hosts サーバー一覧 ("host" または "host:port")
+ * @param virtual_nodes サーバーあたりの仮想ノード数
+ */
+void SelectServer::Update(const std::vector<std::string> &hosts, int virtual_nodes) {
+  assert(hash_calc_ != NULL);
 
   // サーバーのIP、Portを登録
   std::vector<ServerInfo> infos;
-  BOOST_FOREACH(std::string host, settings.client_hosts()) {
-    ServerInfo info(host.c_str(), settings.client_port());
-    infos.push_back(info);
-    server_list_.push_back(info);
+  BOOST_FOREACH(std::string host, hosts) {
+    infos.push_back(ServerInfo::Parse(host, default_port_));
   }
 
+  mutex_.Lock();
+
+  server_list_.assign(infos.begin(), infos.end());
+
   // ConsistentHash構築
-  chash_.Create(hash_calc_->GetKeyBits(), infos);
+  if (virtual_nodes <= 0) {
+    chash_.Create(hash_calc_->GetKeyBits(), infos);
+  } else {
+    std::vector<ConsistentHash<ServerInfo>::NodeCircleInfo> points;
+    BOOST_FOREACH(const ServerInfo &info, infos) {
+      for (int index = 0; index < virtual_nodes; index++) {
+        std::string name = (boost::format("%1%#%2%") % info.str() % index).str();
+        ConsistentHash<ServerInfo>::NodeCircleInfo point = { hash_calc_->CalcHash(name.c_str(), name.size()), info };
+        points.push_back(point);
+      }
+    }
+    chash_.CreateRing(points);
+  }
+
+  mutex_.Unlock();
 }
 
 /**
@@ -56,14 +125,9 @@ void SelectServer::Init(Settings &settings, HashCalcBase *hash_calc) {
  * @param port サーバーのport情報を保存
  */
 void SelectServer::GetInfo(const char *path, std::string &host, int &port) {
-  assert(hash_calc_ != NULL);
   assert(path != NULL);
 
-  host = "";
-  port = 0;
-
-  boost::multiprecision::int256_t hash = hash_calc_->CalcHash(path, strlen(path));
-  ServerInfo info = chash_.GetNode(hash);
+  ServerInfo info = GetInfo(std::string(path));
 
   assert(!info.host.empty());
   assert(info.port > 0);
@@ -72,4 +136,87 @@ void SelectServer::GetInfo(const char *path, std::string &host, int &port) {
   port = info.port;
 }
 
+/**
+ * @breaf サーバー情報取得
+ * @param path path情報
+ * @return サーバー情報 (サーバーがない場合は空)
+ */
+ServerInfo SelectServer::GetInfo(const std::string &path) {
+  assert(hash_calc_ != NULL);
+
+  boost::multiprecision::int256_t hash = hash_calc_->CalcHash(path.c_str(), path.size());
+
+  mutex_.Lock();
+  ServerInfo info = chash_.GetNode(hash);
+  mutex_.Unlock();
+
+  return info;
+}
+
+/**
+ * @breaf ストライプ先サーバー一覧取得
+ *   先頭はパスのハッシュで決まるサーバーで、以降はサーバー一覧の順に続く。
+ * @param path path情報
+ * @param count ストライプ数 (0以下またはサーバー数より大きい場合はサーバー数)
+ * @param infos ストライプ番号順のサーバー情報を保存
+ */
+void SelectServer::GetStripeInfo(const char *path, int count, std::vector<ServerInfo> &infos) {
+  infos.clear();
+
+  ServerInfo owner = GetInfo(std::string(path));
+
+  std::vector<ServerInfo> servers;
+  mutex_.Lock();
+  servers.assign(server_list_.begin(), server_list_.end());
+  mutex_.Unlock();
+
+  if (servers.empty()) {
+    return;
+  }
+  if (count <= 0 || count > (int)servers.size()) {
+    count = servers.size();
+  }
+
+  size_t base = 0;
+  while (base < servers.size() && servers[base] != owner) {
+    base++;
+  }
+
+  for (int index = 0; index < count; index++) {
+    infos.push_back(servers[(base + index) % servers.size()]);
+  }
+}
+
+/**
+ * @breaf サーバー一覧に含まれるかどうか
+ * @param info サーバー情報
+ * @return bool 含まれるかどうか
+ */
+bool SelectServer::Contains(const ServerInfo &info) {
+  bool result = false;
+
+  mutex_.Lock();
+  BOOST_FOREACH(const ServerInfo &server, server_list_) {
+    if (server == info) {
+      result = true;
+      break;
+    }
+  }
+  mutex_.Unlock();
+
+  return result;
+}
+
+/**
+ * @breaf サーバー一覧の取得
+ * @return サーバー一覧 (構成の順)
+ */
+std::list<ServerInfo> SelectServer::server_list() {
+  mutex_.Lock();
+  std::list<ServerInfo> result = server_list_;
+  mutex_.Unlock();
+
+  return result;
+}
+
 } // namespace cbb
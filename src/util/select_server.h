@@ -17,7 +17,9 @@
 #define UTIL_SELECT_SERVER_H_
 
 #include <list>
+#include <vector>
 #include "util/settings.h"
+#include "util/mutex.h"
 #include "util/hash/hash_calc_base.h"
 #include "util/hash/consistent_hash.h"
 
@@ -36,23 +38,37 @@ struct ServerInfo {
     host = h;
     port = p;
   }
+
+  bool operator==(const ServerInfo &other) const { return host == other.host && port == other.port; }
+  bool operator!=(const ServerInfo &other) const { return !(*this == other); }
+
+  static ServerInfo Parse(std::string host, int default_port);
+  std::string str() const;
 };
 
 // サーバー選択クラス
+//   Update でサーバー構成を差し替えられるため、参照と更新は mutex_ で保護する。
 class SelectServer {
  public:
-  SelectServer() : hash_calc_(NULL) {}
+  SelectServer() : hash_calc_(NULL), default_port_(0) { mutex_.Init(); }
   virtual ~SelectServer() {}
 
   void Init(Settings &settings, HashCalcBase *hash_calc);
+  void Init(HashCalcBase *hash_calc, const std::vector<std::string> &hosts, int default_port, int virtual_nodes);
+  void Update(const std::vector<std::string> &hosts, int virtual_nodes);
   void GetInfo(const char *path, std::string &host, int &port);
+  ServerInfo GetInfo(const std::string &path);
+  void GetStripeInfo(const char *path, int count, std::vector<ServerInfo> &infos);
+  bool Contains(const ServerInfo &info);
 
-  std::list<ServerInfo> server_list() { return server_list_; }
+  std::list<ServerInfo> server_list();
 
  private:
   HashCalcBase *hash_calc_;
+  int default_port_;
   ConsistentHash<ServerInfo> chash_;
   std::list<ServerInfo> server_list_;
+  Mutex mutex_;
 };
 
 } // namespace cbb
@@ -0,0 +1,133 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "server_health.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include <boost/format.hpp>
+
+// サーバーごとの通信状態クラス
+namespace cbb {
+
+/**
+ * @breaf リクエストを送ってよいかどうか
+ *   サーキットを開いている期限を過ぎた場合は、次の期限までに1件だけ試しに送らせる。
+ * @param host サーバーのhost
+ * @param port サーバーのport
+ * @param now 現在時刻 (msec)
+ * @return bool 送ってよいかどうか
+ */
+bool ServerHealth::Allow(const std::string &host, int port, uint64_t now) {
+  mutex_.Lock();
+
+  bool is_allowed = true;
+  States::iterator it = states_.empty() ? states_.end() : states_.find(key(host, port));
+  if (it != states_.end() && it->second.failures >= SERVER_HEALTH_FAILURE_MAX) {
+    if (now < it->second.open_until) {
+      is_allowed = false;
+    } else {
+      it->second.open_until = now + it->second.open_time;
+    }
+  }
+
+  mutex_.Unlock();
+  return is_allowed;
+}
+
+/**
+ * @breaf 通信の成功 (サーキットを閉じる)
+ * @param host サーバーのhost
+ * @param port サーバーのport
+ */
+void ServerHealth::Success(const std::string &host, int port) {
+  mutex_.Lock();
+  if (!states_.empty()) {
+    states_.erase(key(host, port));
+  }
+  mutex_.Unlock();
+}
+
+/**
+ * @breaf 通信の失敗 (連続して失敗した場合はサーキットを開く)
+ * @param host サーバーのhost
+ * @param port サーバーのport
+ * @param now 現在時刻 (msec)
+ */
+void ServerHealth::Failure(const std::string &host, int port, uint64_t now) {
+  mutex_.Lock();
+
+  State &state = states_[key(host, port)];
+  state.failures++;
+  if (state.failures >= SERVER_HEALTH_FAILURE_MAX) {
+    if (state.open_time == 0) {
+      state.open_time = SERVER_HEALTH_OPEN_MIN;
+    } else if (state.failures > SERVER_HEALTH_FAILURE_MAX) {
+      state.open_time = std::min<uint64_t>(state.open_time * 2, SERVER_HEALTH_OPEN_MAX);
+    }
+    state.open_until = now + state.open_time;
+  }
+
+  mutex_.Unlock();
+}
+
+/**
+ * @breaf サーキットを開いているかどうか
+ * @param host サーバーのhost
+ * @param port サーバーのport
+ * @param now 現在時刻 (msec)
+ * @return bool サーキットを開いているかどうか
+ */
+bool ServerHealth::is_open(const std::string &host, int port, uint64_t now) {
+  mutex_.Lock();
+  States::iterator it = states_.empty() ? states_.end() : states_.find(key(host, port));
+  bool result = it != states_.end() && it->second.failures >= SERVER_HEALTH_FAILURE_MAX && now < it->second.open_until;
+  mutex_.Unlock();
+  return result;
+}
+
+/**
+ * @breaf 再実行までの待ち時間 (指数バックオフ、0から上限までの乱数でばらつかせる)
+ * @param attempt 再実行回数 (1から)
+ * @param base 1回目の待ち時間の上限 (msec)
+ * @param max 待ち時間の上限 (msec)
+ * @param seed_ptr 乱数の種
+ * @return 待ち時間 (msec)
+ */
+uint64_t ServerHealth::Backoff(int attempt, uint64_t base, uint64_t max, unsigned int *seed_ptr) {
+  uint64_t limit = base;
+  for (int count = 1; count < attempt && limit < max; count++) {
+    limit *= 2;
+  }
+  limit = std::min(limit, max);
+  if (limit == 0) {
+    return 0;
+  }
+  return (uint64_t)rand_r(seed_ptr) % (limit + 1);
+}
+
+/**
+ * @breaf 状態テーブルのキー
+ * @param host サーバーのhost
+ * @param port サーバーのport
+ * @return "host:port"
+ */
+std::string ServerHealth::key(const std::string &host, int port) {
+  return (boost::format("%1%:%2%") % host % port).str();
+}
+
+} // namespace cbb
@@ -0,0 +1,68 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef UTIL_SERVER_HEALTH_H_
+#define UTIL_SERVER_HEALTH_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <map>
+
+#include "util/mutex.h"
+
+#define SERVER_HEALTH_FAILURE_MAX 3     // サーキットを開く連続失敗回数
+#define SERVER_HEALTH_OPEN_MIN 1000     // サーキットを開いておく時間の初期値 (msec)
+#define SERVER_HEALTH_OPEN_MAX 30000    // サーキットを開いておく時間の上限 (msec)
+
+namespace cbb {
+
+// サーバーごとの通信状態 (サーキットブレーカー)
+//   通信の失敗が SERVER_HEALTH_FAILURE_MAX 回続いたサーバーへのリクエストは、
+//   一定時間 (失敗が続くたびに倍、上限 SERVER_HEALTH_OPEN_MAX) 送らずにすぐ失敗させる。
+//   時間が過ぎると1件だけ試し、成功すれば元に戻す。
+class ServerHealth {
+
+ public:
+
+  ServerHealth() { mutex_.Init(); }
+  virtual ~ServerHealth() {}
+
+  bool Allow(const std::string &host, int port, uint64_t now);
+  void Success(const std::string &host, int port);
+  void Failure(const std::string &host, int port, uint64_t now);
+  bool is_open(const std::string &host, int port, uint64_t now);
+
+  static uint64_t Backoff(int attempt, uint64_t base, uint64_t max, unsigned int *seed_ptr);
+
+ private:
+
+  struct State {
+    int failures;         // 連続失敗回数
+    uint64_t open_time;   // サーキットを開いておく時間 (msec)
+    uint64_t open_until;  // サーキットを開いている期限 (msec)
+    State() : failures(0), open_time(0), open_until(0) {}
+  };
+  typedef std::map<std::string, State> States;
+
+  static std::string key(const std::string &host, int port);
+
+  States states_;
+  Mutex mutex_;
+};
+
+} // namespace cbb
+
+#endif // UTIL_SERVER_HEALTH_H_
@@ -63,9 +63,43 @@ bool Settings::Load(const char *filename, bool is_server) {
       server_host_ = tree.get<std::string>("Server.host");
       server_port_ = tree.get<int>("Server.port");
       server_thread_ = tree.get<int>("Server.thread");
-      server_local_strage_path_ = tree.get<std::string>("Server.local_strage_path");
+      // カンマ区切りで複数のデバイスを指定できる (先頭が名前空間を持つ)
+      server_local_devices_ = to_array<std::string>(tree.get<std::string>("Server.local_strage_path"));
+      server_local_strage_path_ = server_local_devices_.empty() ? "": server_local_devices_[0];
       server_secondary_storage_path_ = tree.get<std::string>("Server.secondary_storage_path");
       server_interval_time_ = tree.get<int>("Server.secondary_storage_path", 1);
+      server_log_file_ = tree.get<std::string>("Server.log_file", "");
+      server_log_level_ = tree.get<std::string>("Server.log_level", "info");
+      server_replica_count_ = tree.get<int>("Server.replica_count", 0);
+      server_replica_threshold_ = tree.get<int>("Server.replica_threshold", 0);
+      server_replica_pattern_ = tree.get<std::string>("Server.replica_pattern", "");
+      server_fsyncdir_syncfs_ = tree.get<int>("Server.fsyncdir_syncfs", 0) != 0;
+      server_fd_cache_size_ = tree.get<int>("Server.fd_cache_size", 256);
+      server_io_uring_entries_ = tree.get<int>("Server.io_uring_entries", 0);
+      server_direct_io_size_ = tree.get<size_t>("Server.direct_io_size", 0);
+      server_direct_io_buffers_ = tree.get<int>("Server.direct_io_buffers", 16);
+      server_compression_level_ = tree.get<int>("Server.compression_level", 0);
+      server_max_transfer_size_ = tree.get<size_t>("Server.max_transfer_size", 67108864);
+      server_local_compression_ = tree.get<std::string>("Server.local_compression", "none");
+      server_local_compression_level_ = tree.get<int>("Server.local_compression_level", 0);
+      server_local_compression_chunk_size_ = tree.get<size_t>("Server.local_compression_chunk_size", 131072);
+      server_local_stripe_size_ = tree.get<size_t>("Server.local_stripe_size", 0);
+      server_local_stripe_pattern_ = tree.get<std::string>("Server.local_stripe_pattern", "");
+      server_local_stripe_min_size_ = tree.get<uint64_t>("Server.local_stripe_min_size", 0);
+      server_qos_threads_ = tree.get<int>("Server.qos_threads", 0);
+      server_qos_quantum_ = tree.get<size_t>("Server.qos_quantum", 1048576);
+      server_qos_bandwidth_ = tree.get<uint64_t>("Server.qos_bandwidth", 0);
+      server_qos_classes_ = tree.get<std::string>("Server.qos_classes", "");
+      server_background_busy_depth_ = tree.get<int>("Server.background_busy_depth", 0);
+      server_background_idle_msec_ = tree.get<int>("Server.background_idle_msec", 100);
+      server_background_max_pause_msec_ = tree.get<int>("Server.background_max_pause_msec", 1000);
+      server_background_ioprio_ = tree.get<int>("Server.background_ioprio", 0) != 0;
+      server_secondary_bandwidth_ = tree.get<uint64_t>("Server.secondary_bandwidth", 0);
+      server_secondary_ops_ = tree.get<uint64_t>("Server.secondary_ops", 0);
+      server_secondary_cluster_bandwidth_ = tree.get<uint64_t>("Server.secondary_cluster_bandwidth", 0);
+      server_secondary_cluster_ops_ = tree.get<uint64_t>("Server.secondary_cluster_ops", 0);
+      server_secondary_lease_dir_ = tree.get<std::string>("Server.secondary_lease_dir", "");
+      server_secondary_lease_interval_ = tree.get<int>("Server.secondary_lease_interval", 5000);
 
       result = true;
     } catch (...) {
@@ -73,8 +107,11 @@ bool Settings::Load(const char *filename, bool is_server) {
       server_port_ = 0;
       server_thread_ = 0;
       server_local_strage_path_.clear();
+      server_local_devices_.clear();
       server_secondary_storage_path_.clear();
       server_interval_time_ = 1;
+      server_log_file_.clear();
+      server_log_level_.clear();
     }
 
   } else {
@@ -82,6 +119,7 @@ bool Settings::Load(const char *filename, bool is_server) {
     server_port_ = 0;
     server_thread_ = 0;
     server_local_strage_path_.clear();
+    server_local_devices_.clear();
     server_secondary_storage_path_.clear();
 
     // Client setting
@@ -91,6 +129,22 @@ bool Settings::Load(const char *filename, bool is_server) {
 
       client_hosts_ = to_array<std::string>(tree.get<std::string>("Client.host"));
       client_port_ = tree.get<int>("Client.port");
+      client_shared_memory_ = tree.get<int>("Client.shared_memory", 1) != 0;
+      client_stripe_size_ = tree.get<uint64_t>("Client.stripe_size", 0);
+      client_stripe_count_ = tree.get<int>("Client.stripe_count", 0);
+      client_placement_ = tree.get<int>("Client.placement", 0) != 0;
+      client_placement_interval_ = tree.get<int>("Client.placement_interval", 1000);
+      client_placement_min_free_ = tree.get<int>("Client.placement_min_free", 10);
+      client_membership_interval_ = tree.get<int>("Client.membership_interval", 1000);
+      client_rpc_deadline_ = tree.get<int>("Client.rpc_deadline", 10000);
+      client_rpc_timeout_ = tree.get<int>("Client.rpc_timeout", 2000);
+      client_retry_interval_ = tree.get<int>("Client.retry_interval", 100);
+      client_keep_cache_ = tree.get<int>("Client.keep_cache", 1) != 0;
+      client_protocol_ = tree.get<int>("Client.protocol", 2);
+      client_compression_ = tree.get<std::string>("Client.compression", "none");
+      client_compression_level_ = tree.get<int>("Client.compression_level", 0);
+      client_compression_min_size_ = tree.get<size_t>("Client.compression_min_size", 4096);
+      client_job_id_ = tree.get<std::string>("Client.job_id", "");
 
       result = true;
     } catch (...) {
@@ -102,4 +156,34 @@ bool Settings::Load(const char *filename, bool is_server) {
   return result;
 }
 
+/**
+ * @breaf サーバー設定 (設定ファイルを使わない場合)
+ * @param host 待ち受けIPアドレス
+ * @param port 待ち受けポート番号
+ * @param thread スレッド数
+ * @param local_strage_path ローカルストレージパス
+ * @param secondary_storage_path セカンドストレージパス
+ * @param interval_time 監視間隔時間 (分)
+ */
+void Settings::SetServer(const std::string &host, int port, int thread,
+                         const std::string &local_strage_path, const std::string &secondary_storage_path, int interval_time) {
+  server_host_ = host;
+  server_port_ = port;
+  server_thread_ = thread;
+  server_local_strage_path_ = local_strage_path;
+  server_local_devices_.assign(1, local_strage_path);
+  server_secondary_storage_path_ = secondary_storage_path;
+  server_interval_time_ = interval_time;
+}
+
+/**
+ * @breaf クライアント設定 (設定ファイルを使わない場合)
+ * @param hosts サーバー一覧 ("host" または "host:port")
+ * @param port 既定のポート番号
+ */
+void Settings::SetClient(const std::vector<std::string> &hosts, int port) {
+  client_hosts_ = hosts;
+  client_port_ = port;
+}
+
 } // namesapce cbb
@@ -16,6 +16,8 @@
 #ifndef SETTINGS_H_
 #define SETTINGS_H_
 
+#include <stdint.h>
+
 #include <vector>
 #include <string>
 
@@ -25,32 +27,165 @@ namespace cbb {
 class Settings {
 
  public:
-  Settings() : server_port_(0), server_thread_(0), client_port_(0), server_interval_time_(0) {}
+  Settings() : server_port_(0), server_thread_(0), client_port_(0), client_shared_memory_(true),
+               client_stripe_size_(0), client_stripe_count_(0),
+               client_placement_(false), client_placement_interval_(1000), client_placement_min_free_(10),
+               client_membership_interval_(1000), client_rpc_deadline_(10000), client_rpc_timeout_(2000),
+               client_retry_interval_(100),
+               client_keep_cache_(true), client_protocol_(2),
+               client_compression_("none"), client_compression_level_(0), client_compression_min_size_(4096),
+               server_interval_time_(0),
+               server_replica_count_(0), server_replica_threshold_(0), server_fsyncdir_syncfs_(false),
+               server_fd_cache_size_(256), server_io_uring_entries_(0),
+               server_direct_io_size_(0), server_direct_io_buffers_(16), server_compression_level_(0),
+               server_max_transfer_size_(67108864),
+               server_local_compression_("none"), server_local_compression_level_(0),
+               server_local_compression_chunk_size_(131072),
+               server_local_stripe_size_(0), server_local_stripe_min_size_(0),
+               server_qos_threads_(0), server_qos_quantum_(1048576), server_qos_bandwidth_(0),
+               server_background_busy_depth_(0), server_background_idle_msec_(100),
+               server_background_max_pause_msec_(1000), server_background_ioprio_(false),
+               server_secondary_bandwidth_(0), server_secondary_ops_(0),
+               server_secondary_cluster_bandwidth_(0), server_secondary_cluster_ops_(0),
+               server_secondary_lease_interval_(5000) {}
   Settings(const char *filename, bool is_server) { Load(filename, is_server); }
   virtual ~Settings() {}
 
   bool Load(const char *filename, bool is_server);
+  void SetServer(const std::string &host, int port, int thread,
+                 const std::string &local_strage_path, const std::string &secondary_storage_path, int interval_time);
+  void SetClient(const std::vector<std::string> &hosts, int port);
 
   std::string server_host() { return server_host_; }
   int server_port() { return server_port_; }
   int server_thread() { return server_thread_; }
   std::string server_local_strage_path() { return server_local_strage_path_; }
+  std::vector<std::string> server_local_devices() { return server_local_devices_; }
   std::string server_secondary_storage_path() { return server_secondary_storage_path_; }
   int server_interval_time() { return server_interval_time_; }
+  std::string server_log_file() { return server_log_file_; }
+  std::string server_log_level() { return server_log_level_; }
+  int server_replica_count() { return server_replica_count_; }
+  int server_replica_threshold() { return server_replica_threshold_; }
+  std::string server_replica_pattern() { return server_replica_pattern_; }
+  bool server_fsyncdir_syncfs() { return server_fsyncdir_syncfs_; }
+  int server_fd_cache_size() { return server_fd_cache_size_; }
+  int server_io_uring_entries() { return server_io_uring_entries_; }
+  size_t server_direct_io_size() { return server_direct_io_size_; }
+  int server_direct_io_buffers() { return server_direct_io_buffers_; }
+  int server_compression_level() { return server_compression_level_; }
+  size_t server_max_transfer_size() { return server_max_transfer_size_; }
+  std::string server_local_compression() { return server_local_compression_; }
+  int server_local_compression_level() { return server_local_compression_level_; }
+  size_t server_local_compression_chunk_size() { return server_local_compression_chunk_size_; }
+  size_t server_local_stripe_size() { return server_local_stripe_size_; }
+  std::string server_local_stripe_pattern() { return server_local_stripe_pattern_; }
+  uint64_t server_local_stripe_min_size() { return server_local_stripe_min_size_; }
+  int server_qos_threads() { return server_qos_threads_; }
+  size_t server_qos_quantum() { return server_qos_quantum_; }
+  uint64_t server_qos_bandwidth() { return server_qos_bandwidth_; }
+  std::string server_qos_classes() { return server_qos_classes_; }
+  int server_background_busy_depth() { return server_background_busy_depth_; }
+  int server_background_idle_msec() { return server_background_idle_msec_; }
+  int server_background_max_pause_msec() { return server_background_max_pause_msec_; }
+  bool server_background_ioprio() { return server_background_ioprio_; }
+  uint64_t server_secondary_bandwidth() { return server_secondary_bandwidth_; }
+  uint64_t server_secondary_ops() { return server_secondary_ops_; }
+  uint64_t server_secondary_cluster_bandwidth() { return server_secondary_cluster_bandwidth_; }
+  uint64_t server_secondary_cluster_ops() { return server_secondary_cluster_ops_; }
+  const std::string& server_secondary_lease_dir() { return server_secondary_lease_dir_; }
+  int server_secondary_lease_interval() { return server_secondary_lease_interval_; }
 
   std::vector<std::string> client_hosts() { return client_hosts_; }
   int client_port() { return client_port_; }
+  bool client_shared_memory() { return client_shared_memory_; }
+  void set_client_shared_memory(bool shared_memory) { client_shared_memory_ = shared_memory; }
+  uint64_t client_stripe_size() { return client_stripe_size_; }
+  int client_stripe_count() { return client_stripe_count_; }
+  void set_client_stripe(uint64_t size, int count) { client_stripe_size_ = size; client_stripe_count_ = count; }
+  bool client_placement() { return client_placement_; }
+  int client_placement_interval() { return client_placement_interval_; }
+  int client_placement_min_free() { return client_placement_min_free_; }
+  void set_client_placement(bool placement, int interval, int min_free) {
+    client_placement_ = placement;
+    client_placement_interval_ = interval;
+    client_placement_min_free_ = min_free;
+  }
+  int client_membership_interval() { return client_membership_interval_; }
+  void set_client_membership_interval(int interval) { client_membership_interval_ = interval; }
+  int client_rpc_deadline() { return client_rpc_deadline_; }
+  int client_rpc_timeout() { return client_rpc_timeout_; }
+  int client_retry_interval() { return client_retry_interval_; }
+  void set_client_rpc_deadline(int deadline, int retry_interval) {
+    client_rpc_deadline_ = deadline;
+    client_retry_interval_ = retry_interval;
+  }
+  bool client_keep_cache() { return client_keep_cache_; }
+  int client_protocol() { return client_protocol_; }
+  std::string client_compression() { return client_compression_; }
+  int client_compression_level() { return client_compression_level_; }
+  size_t client_compression_min_size() { return client_compression_min_size_; }
+  std::string client_job_id() { return client_job_id_; }
 
  private:
   std::string server_host_;
   int server_port_;
   int server_thread_;
-  std::string server_local_strage_path_;
+  std::string server_local_strage_path_;    // 先頭のLocalストレージパス
+  std::vector<std::string> server_local_devices_;  // Localストレージパスの一覧 (デバイスごと)
   std::string server_secondary_storage_path_;
   int server_interval_time_;
+  std::string server_log_file_;
+  std::string server_log_level_;
+  int server_replica_count_;
+  int server_replica_threshold_;
+  std::string server_replica_pattern_;
+  bool server_fsyncdir_syncfs_;
+  int server_fd_cache_size_;
+  int server_io_uring_entries_;
+  size_t server_direct_io_size_;
+  int server_direct_io_buffers_;
+  int server_compression_level_;
+  size_t server_max_transfer_size_;
+  std::string server_local_compression_;
+  int server_local_compression_level_;
+  size_t server_local_compression_chunk_size_;
+  size_t server_local_stripe_size_;
+  std::string server_local_stripe_pattern_;
+  uint64_t server_local_stripe_min_size_;
+  int server_qos_threads_;
+  size_t server_qos_quantum_;
+  uint64_t server_qos_bandwidth_;
+  std::string server_qos_classes_;
+  int server_background_busy_depth_;
+  int server_background_idle_msec_;
+  int server_background_max_pause_msec_;
+  bool server_background_ioprio_;
+  uint64_t server_secondary_bandwidth_;
+  uint64_t server_secondary_ops_;
+  uint64_t server_secondary_cluster_bandwidth_;
+  uint64_t server_secondary_cluster_ops_;
+  std::string server_secondary_lease_dir_;
+  int server_secondary_lease_interval_;
 
   std::vector<std::string> client_hosts_;
   int client_port_;
+  bool client_shared_memory_;
+  uint64_t client_stripe_size_;
+  int client_stripe_count_;
+  bool client_placement_;
+  int client_placement_interval_;
+  int client_placement_min_free_;
+  int client_membership_interval_;
+  int client_rpc_deadline_;
+  int client_rpc_timeout_;
+  int client_retry_interval_;
+  bool client_keep_cache_;
+  int client_protocol_;
+  std::string client_compression_;
+  int client_compression_level_;
+  size_t client_compression_min_size_;
+  std::string client_job_id_;
 };
 
 } // namesapce cbb
@@ -0,0 +1,148 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "shm_channel.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// 共有メモリ通信路クラス
+namespace cbb {
+
+/**
+ * @breaf 共有メモリの作成 (サーバー側)
+ * @param name 共有メモリ名 ("/" で始まる)
+ * @param nonce 同一ホスト確認用の乱数
+ * @param arena_size データ領域サイズ
+ * @return Error値
+ */
+Error ShmChannel::Create(const std::string &name, uint64_t nonce, uint64_t arena_size) {
+  Close();
+
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  uint64_t arena_offset = (sizeof(ShmChannelHeader) + 4095) & ~(uint64_t)4095;
+  size_t size = arena_offset + arena_size;
+
+  void *ptr = MAP_FAILED;
+  if (ftruncate(fd, size) == 0) {
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  Error error = ptr == MAP_FAILED ? -errno: kCBBSuccess;
+  close(fd);
+
+  if (error != kCBBSuccess) {
+    shm_unlink(name.c_str());
+    return error;
+  }
+
+  header_ = (ShmChannelHeader *)ptr;
+  size_ = size;
+  name_ = name;
+  is_owner_ = true;
+
+  memset(header_, 0, sizeof(ShmChannelHeader));
+  header_->nonce = nonce;
+  header_->arena_offset = arena_offset;
+  header_->arena_size = arena_size;
+  header_->server_pid = getpid();
+  sem_init(&header_->request.sem, 1, 0);
+  sem_init(&header_->response.sem, 1, 0);
+
+  // 初期化完了後にmagicを設定する
+  __sync_synchronize();
+  header_->magic = SHM_CHANNEL_MAGIC;
+  header_->version = SHM_CHANNEL_VERSION;
+
+  return kCBBSuccess;
+}
+
+/**
+ * @breaf 共有メモリへの接続 (クライアント側)
+ * @param name 共有メモリ名
+ * @param nonce サーバーから通知された乱数 (一致しない場合は別ホストとみなす)
+ * @return Error値
+ */
+Error ShmChannel::Attach(const std::string &name, uint64_t nonce) {
+  Close();
+
+  int fd = shm_open(name.c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  struct stat st;
+  void *ptr = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ShmChannelHeader)) {
+    ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+
+  if (ptr == MAP_FAILED) {
+    return -EINVAL;
+  }
+
+  ShmChannelHeader *header = (ShmChannelHeader *)ptr;
+  if (header->magic != SHM_CHANNEL_MAGIC || header->version != SHM_CHANNEL_VERSION ||
+      header->nonce != nonce || header->client_pid != 0 ||
+      header->arena_offset + header->arena_size > (uint64_t)st.st_size) {
+    munmap(ptr, st.st_size);
+    return -EINVAL;
+  }
+
+  header_ = header;
+  size_ = st.st_size;
+  name_ = name;
+  is_owner_ = false;
+
+  header_->client_pid = getpid();
+  __sync_synchronize();
+
+  // 名前は不要になるので削除する (マッピングは双方が閉じるまで残る)
+  shm_unlink(name.c_str());
+
+  return kCBBSuccess;
+}
+
+/**
+ * @breaf 共有メモリを閉じる
+ */
+void ShmChannel::Close() {
+  if (header_ == NULL) {
+    return;
+  }
+
+  if (is_owner_) {
+    header_->is_closed = 1;
+    __sync_synchronize();
+    sem_post(&header_->response.sem);
+    shm_unlink(name_.c_str());
+  }
+
+  munmap(header_, size_);
+  header_ = NULL;
+  size_ = 0;
+  name_.clear();
+  is_owner_ = false;
+}
+
+} // namespace cbb
@@ -0,0 +1,198 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef UTIL_SHM_CHANNEL_H_
+#define UTIL_SHM_CHANNEL_H_
+
+#include <stdint.h>
+#include <semaphore.h>
+
+#include <string>
+
+#include "common/error.h"
+
+#define SHM_CHANNEL_MAGIC    0x43424253 // "CBBS"
+#define SHM_CHANNEL_VERSION  1
+#define SHM_RING_SLOTS       32         // 2のべき乗
+#define SHM_ARENA_SIZE       (32 << 20) // 1スロットあたり1MB
+#define SHM_CACHE_LINE       64
+
+namespace cbb {
+
+/// 共有メモリ経由の操作種別
+enum ShmOp {
+  kShmRead = 1,
+  kShmWrite = 2,
+};
+
+/// 要求 (クライアント → サーバー)
+struct ShmRequest {
+  uint64_t tag;          // 応答との対応付け
+  int32_t op;            // ShmOp
+  int32_t fd;            // サーバー側ファイルディスクリプタ
+  uint64_t size;         // 転送サイズ
+  int64_t offset;        // ファイルオフセット
+  uint64_t data_offset;  // データ領域内のオフセット
+};
+
+/// 応答 (サーバー → クライアント)
+struct ShmResponse {
+  uint64_t tag;
+  int64_t result;        // 転送サイズ または -errno
+};
+
+/// 単一生産者・単一消費者のリングバッファ
+template <typename T>
+struct ShmRing {
+  volatile uint64_t head;  // 生産者のみ更新
+  char head_pad[SHM_CACHE_LINE - sizeof(uint64_t)];
+  volatile uint64_t tail;  // 消費者のみ更新
+  char tail_pad[SHM_CACHE_LINE - sizeof(uint64_t)];
+  sem_t sem;               // 追加通知 (プロセス間共有)
+  T slots[SHM_RING_SLOTS];
+};
+
+/// 共有メモリ先頭のヘッダー (この後ろにデータ領域が続く)
+struct ShmChannelHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t nonce;              // 同一ホスト確認用の乱数
+  uint64_t arena_offset;
+  uint64_t arena_size;
+  volatile int32_t server_pid;
+  volatile int32_t client_pid; // 0の場合は未接続
+  volatile int32_t is_closed;  // サーバーが閉じた
+  ShmRing<ShmRequest> request;
+  ShmRing<ShmResponse> response;
+};
+
+// 同一ホストのクライアント・サーバー間の共有メモリ通信路クラス
+//
+// 要求と応答をそれぞれSPSCリングで受け渡し、データ本体は共有のデータ領域に置いて
+// オフセットで参照する。リングへの追加はプロセス間セマフォで通知する。
+class ShmChannel {
+
+ public:
+
+  ShmChannel() : header_(NULL), size_(0), is_owner_(false) {}
+  virtual ~ShmChannel() { Close(); }
+
+  Error Create(const std::string &name, uint64_t nonce, uint64_t arena_size);
+  Error Attach(const std::string &name, uint64_t nonce);
+  void Close();
+
+  bool PushRequest(const ShmRequest &request) { return Push(&header_->request, request); }
+  bool PopRequest(ShmRequest *request_ptr) { return Pop(&header_->request, request_ptr); }
+  bool WaitRequest(int timeout_msec) { return Wait(&header_->request, timeout_msec); }
+
+  bool PushResponse(const ShmResponse &response) { return Push(&header_->response, response); }
+  bool PopResponse(ShmResponse *response_ptr) { return Pop(&header_->response, response_ptr); }
+  bool WaitResponse(int timeout_msec) { return Wait(&header_->response, timeout_msec); }
+
+  bool is_open() const { return header_ != NULL; }
+  const std::string &name() const { return name_; }
+  ShmChannelHeader *header() { return header_; }
+  char *data(uint64_t offset) { return (char *)header_ + header_->arena_offset + offset; }
+  uint64_t chunk_size() const { return header_->arena_size / SHM_RING_SLOTS; }
+
+ private:
+
+  template <typename T>
+  static bool Push(ShmRing<T> *ring, const T &value);
+  template <typename T>
+  static bool Pop(ShmRing<T> *ring, T *value_ptr);
+  template <typename T>
+  static bool Wait(ShmRing<T> *ring, int timeout_msec);
+
+  ShmChannelHeader *header_;
+  size_t size_;
+  std::string name_;
+  bool is_owner_;
+};
+
+/**
+ * @breaf リングへの追加 (生産者側)
+ * @param ring リング
+ * @param value 追加する値
+ * @return bool 追加できたかどうか (満杯の場合false)
+ */
+template <typename T>
+bool ShmChannel::Push(ShmRing<T> *ring, const T &value) {
+  uint64_t head = ring->head;
+  if (head - ring->tail >= SHM_RING_SLOTS) {
+    return false;
+  }
+
+  ring->slots[head & (SHM_RING_SLOTS - 1)] = value;
+  __sync_synchronize();
+  ring->head = head + 1;
+
+  sem_post(&ring->sem);
+  return true;
+}
+
+/**
+ * @breaf リングからの取り出し (消費者側)
+ * @param ring リング
+ * @param value_ptr 取り出した値の保存先
+ * @return bool 取り出せたかどうか (空の場合false)
+ */
+template <typename T>
+bool ShmChannel::Pop(ShmRing<T> *ring, T *value_ptr) {
+  uint64_t tail = ring->tail;
+  if (tail == ring->head) {
+    return false;
+  }
+
+  __sync_synchronize();
+  *value_ptr = ring->slots[tail & (SHM_RING_SLOTS - 1)];
+  __sync_synchronize();
+  ring->tail = tail + 1;
+
+  return true;
+}
+
+/**
+ * @breaf リングへの追加通知を待つ
+ * @param ring リング
+ * @param timeout_msec タイムアウト (msec)
+ * @return bool 通知があったかどうか
+ */
+template <typename T>
+bool ShmChannel::Wait(ShmRing<T> *ring, int timeout_msec) {
+  if (ring->tail != ring->head) {
+    return true;
+  }
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += timeout_msec / 1000;
+  ts.tv_nsec += (long)(timeout_msec % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+
+  while (sem_timedwait(&ring->sem, &ts) != 0) {
+    if (errno != EINTR) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace cbb
+
+#endif // UTIL_SHM_CHANNEL_H_
@@ -15,9 +15,13 @@
 //
 #include "thread.h"
 
+#include <unistd.h>
+
+#include <algorithm>
+
 #include "../common/common.h"
 
-#define THREAD_CALL_SLEEP     5 // sec
+#define THREAD_CALL_SLEEP     100 // msec
 
 // スレッド制御クラス
 namespace cbb {
@@ -44,7 +48,9 @@ void *Thread::Threading(void *data)
       result = info->thread_ptr->ThreadCall(info->user_data);
       info->thread_ptr->Unlock();
     } else {
-      sleep(THREAD_CALL_SLEEP);
+      // 停止要求にすぐ応じられるように短く区切って待つ
+      uint64_t wait_time = std::min<uint64_t>(next_time - now_time, THREAD_CALL_SLEEP);
+      usleep(wait_time * 1000);
     }
   }
 
@@ -72,15 +78,16 @@ Thread::~Thread() {
 pthread_t Thread::Create(void *user_data, uint64_t interval_time) {
   Release();
 
-  pthread_create(&thread_id_, NULL, cbb::Thread::Threading, &thread_info_);
+  // スレッド開始前に設定する (開始直後にis_loopを参照するため)
+  Mutex::Init();
 
-  if (thread_id_ != 0) {
-    Mutex::Init();
+  thread_info_.is_loop = true;
+  thread_info_.interval_time = interval_time;
+  thread_info_.thread_ptr = this;
+  thread_info_.user_data = user_data;
 
-    thread_info_.is_loop = true;
-    thread_info_.interval_time = interval_time;
-    thread_info_.thread_ptr = this;
-    thread_info_.user_data = user_data;
+  if (pthread_create(&thread_id_, NULL, cbb::Thread::Threading, &thread_info_) != 0) {
+    Init();
   }
 
   return thread_id_;
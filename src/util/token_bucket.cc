@@ -0,0 +1,126 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "token_bucket.h"
+
+#define TOKEN_BUCKET_IDLE_USEC (60ULL * 1000000)  // この時間使われなかったバケットは満杯にする
+
+// トークンバケットクラス
+namespace cbb {
+
+/**
+ * @breaf 初期化 (満杯の状態から始める)
+ * @param rate 1秒あたりのトークン数 (0の場合は制限しない)
+ * @param burst 貯められるトークン数の上限 (0の場合は1秒分)
+ * @param now_usec 現在時刻 (usec)
+ */
+void TokenBucket::Init(uint64_t rate, uint64_t burst, uint64_t now_usec) {
+  rate_ = rate;
+  burst_ = burst > 0 ? burst: rate;
+  tokens_ = burst_;
+  last_time_ = now_usec;
+}
+
+/**
+ * @breaf 制限の変更 (残りのトークン、借りは引き継ぐ)
+ * @param rate 1秒あたりのトークン数 (0の場合は制限しない)
+ * @param burst 貯められるトークン数の上限 (0の場合は1秒分)
+ * @param now_usec 現在時刻 (usec)
+ */
+void TokenBucket::SetRate(uint64_t rate, uint64_t burst, uint64_t now_usec) {
+  if (rate_ == 0 || rate == 0) {
+    Init(rate, burst, now_usec);
+    return;
+  }
+  Refill(now_usec);
+  rate_ = rate;
+  burst_ = burst > 0 ? burst: rate;
+  if (tokens_ > (int64_t)burst_) {
+    tokens_ = burst_;
+  }
+}
+
+/**
+ * @breaf 要求を通せるまでの待ち時間
+ * @param now_usec 現在時刻 (usec)
+ * @return 待ち時間 (usec、0の場合はすぐに通せる)
+ */
+uint64_t TokenBucket::Wait(uint64_t now_usec) {
+  if (rate_ == 0) {
+    return 0;
+  }
+  Refill(now_usec);
+  if (tokens_ > 0) {
+    return 0;
+  }
+  // 残りが1トークンになるまでの時間
+  return ((uint64_t)(1 - tokens_) * 1000000 + rate_ - 1) / rate_;
+}
+
+/**
+ * @breaf トークンの消費 (待ち時間を確かめずに消費し、足りない分は借りにする)
+ * @param cost 消費するトークン数
+ * @param now_usec 現在時刻 (usec)
+ */
+void TokenBucket::Take(uint64_t cost, uint64_t now_usec) {
+  if (rate_ == 0) {
+    return;
+  }
+  Refill(now_usec);
+  tokens_ -= (int64_t)cost;
+}
+
+/**
+ * @breaf 通せる場合だけトークンを消費する
+ * @param cost 消費するトークン数
+ * @param now_usec 現在時刻 (usec)
+ * @return 待ち時間 (usec、0の場合は消費した)
+ */
+uint64_t TokenBucket::TryTake(uint64_t cost, uint64_t now_usec) {
+  uint64_t wait = Wait(now_usec);
+  if (wait == 0) {
+    Take(cost, now_usec);
+  }
+  return wait;
+}
+
+/**
+ * @breaf 経過時間分のトークンの補充
+ * @param now_usec 現在時刻 (usec)
+ */
+void TokenBucket::Refill(uint64_t now_usec) {
+  if (now_usec <= last_time_) {
+    return;
+  }
+  uint64_t elapsed = now_usec - last_time_;
+  if (elapsed >= TOKEN_BUCKET_IDLE_USEC) {
+    // 長く使われなかった場合は満杯にする
+    tokens_ = burst_;
+    last_time_ = now_usec;
+    return;
+  }
+  uint64_t added = (uint64_t)((double)elapsed * rate_ / 1000000);
+  if (added == 0) {
+    // 補充が1トークンに満たない間は時刻を進めない (端数を捨てないため)
+    return;
+  }
+  tokens_ += (int64_t)added;
+  if (tokens_ > (int64_t)burst_) {
+    tokens_ = burst_;
+  }
+  last_time_ += added * 1000000 / rate_;
+}
+
+} /* namespace cbb */
@@ -0,0 +1,54 @@
+//
+// Copyright (C) 2015 Tokyo Institute of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef UTIL_TOKEN_BUCKET_H_
+#define UTIL_TOKEN_BUCKET_H_
+
+#include <stdint.h>
+
+namespace cbb {
+
+// 帯域、操作回数を制限するトークンバケットクラス
+//
+// 1秒あたり rate のトークンを burst まで貯め、残りが正の間は要求を通す。
+// 大きな要求は残りを負 (借り) にして通し、借りを返すまで次の要求を待たせる。
+// スレッドセーフではないので、呼び出し側で排他すること。
+class TokenBucket {
+ public:
+  TokenBucket() : rate_(0), burst_(0), tokens_(0), last_time_(0) {}
+  virtual ~TokenBucket() {}
+
+  void Init(uint64_t rate, uint64_t burst, uint64_t now_usec);
+  void SetRate(uint64_t rate, uint64_t burst, uint64_t now_usec);
+
+  uint64_t Wait(uint64_t now_usec);
+  void Take(uint64_t cost, uint64_t now_usec);
+  uint64_t TryTake(uint64_t cost, uint64_t now_usec);
+
+  bool is_limited() const { return rate_ > 0; }
+  uint64_t rate() const { return rate_; }
+
+ private:
+  void Refill(uint64_t now_usec);
+
+  uint64_t rate_;       // 1秒あたりのトークン数 (0の場合は制限しない)
+  uint64_t burst_;      // 貯められるトークン数の上限
+  int64_t tokens_;      // 残りのトークン数 (負の場合は借り)
+  uint64_t last_time_;  // 最後に補充した時刻 (usec)
+};
+
+} /* namespace cbb */
+
+#endif /* UTIL_TOKEN_BUCKET_H_ */